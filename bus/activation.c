@@ -35,6 +35,7 @@
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-spawn.h>
 #include <dbus/dbus-timeout.h>
@@ -65,6 +66,10 @@ typedef struct
   char *dir_c;
   BusServiceDirFlags flags;
   DBusHashTable *entries;
+  /* filename => entry, from before a reload; only set during the reload */
+  DBusHashTable *previous_entries;
+  /* wall-clock time at which the last full scan started */
+  long scan_time;
 } BusServiceDirectory;
 
 struct BusActivationEntry
@@ -106,6 +111,7 @@ typedef struct
   char *systemd_service;
   DBusList *entries;
   int n_entries;
+  long n_bytes; /* total size of the activation_message of each entry */
   DBusBabysitter *babysitter;
   DBusTimeout *timeout;
   unsigned int timeout_added : 1;
@@ -137,6 +143,8 @@ bus_service_directory_unref (BusServiceDirectory *dir)
 
   if (dir->entries)
     _dbus_hash_table_unref (dir->entries);
+  if (dir->previous_entries)
+    _dbus_hash_table_unref (dir->previous_entries);
 
   dbus_free (dir->dir_c);
   dbus_free (dir);
@@ -263,7 +271,6 @@ update_desktop_file_entry (BusActivation       *activation,
   char *name, *exec, *user, *exec_tmp, *systemd_service;
   char *assumed_apparmor_label;
   BusActivationEntry *entry;
-  DBusStat stat_buf;
   DBusString file_path;
   DBusError tmp_error;
   dbus_bool_t retval;
@@ -295,13 +302,6 @@ update_desktop_file_entry (BusActivation       *activation,
       goto out;
     }
 
-  if (!_dbus_stat (&file_path, &stat_buf, NULL))
-    {
-      dbus_set_error (error, DBUS_ERROR_FAILED,
-                      "Can't stat the service file\n");
-      goto out;
-    }
-
   if (!bus_desktop_file_get_string (desktop_file,
                                     DBUS_SERVICE_SECTION,
                                     DBUS_SERVICE_NAME,
@@ -567,7 +567,9 @@ update_desktop_file_entry (BusActivation       *activation,
         }
     }
 
-  entry->mtime = stat_buf.mtime;
+  /* Use the mtime from before the file was read, so that if the file
+   * was changed while we were loading it, it will be loaded again */
+  entry->mtime = bus_desktop_file_get_mtime (desktop_file);
   retval = TRUE;
 
 out:
@@ -686,6 +688,72 @@ out:
 }
 
 
+/*
+ * During a reload, if the service file @filename was already loaded
+ * before the reload and hasn't changed since, put its existing entry
+ * back instead of parsing the file again. A file whose mtime is not
+ * older than the previous scan might have been modified within the
+ * same second, so it is always parsed again.
+ *
+ * Sets @reused to #TRUE if the caller doesn't need to load the file.
+ * Only fails on OOM.
+ */
+static dbus_bool_t
+reuse_previous_entry (BusActivation       *activation,
+                      BusServiceDirectory *s_dir,
+                      const DBusString    *filename,
+                      const DBusString    *full_path,
+                      dbus_bool_t         *reused,
+                      DBusError           *error)
+{
+  BusActivationEntry *entry;
+  DBusStat stat_buf;
+
+  *reused = FALSE;
+
+  entry = _dbus_hash_table_lookup_string (s_dir->previous_entries,
+                                          _dbus_string_get_const_data (filename));
+  if (entry == NULL)
+    return TRUE;
+
+  if (!_dbus_stat (full_path, &stat_buf, NULL) ||
+      stat_buf.mtime != entry->mtime ||
+      (long) entry->mtime >= s_dir->scan_time)
+    return TRUE;
+
+  *reused = TRUE;
+
+  /* Same rule as update_desktop_file_entry(): the first file to claim
+   * a name wins */
+  if (_dbus_hash_table_lookup_string (activation->entries, entry->name))
+    {
+      _dbus_verbose ("Service %s already exists in activation entry list, "
+                     "not reusing \"%s\"\n",
+                     entry->name, _dbus_string_get_const_data (full_path));
+      return TRUE;
+    }
+
+  if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                       bus_activation_entry_ref (entry)))
+    {
+      bus_activation_entry_unref (entry);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename,
+                                       bus_activation_entry_ref (entry)))
+    {
+      bus_activation_entry_unref (entry);
+      _dbus_hash_table_remove_string (activation->entries, entry->name);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Reused unchanged entry for \"%s\"\n", entry->name);
+  return TRUE;
+}
+
 /* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
@@ -701,12 +769,14 @@ update_directory (BusActivation       *activation,
   dbus_bool_t retval;
   BusActivationEntry *entry;
   DBusString full_path;
+  long scan_time;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   iter = NULL;
   desktop_file = NULL;
 
+  _dbus_get_real_time (&scan_time, NULL);
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
   if (!_dbus_string_init (&filename))
@@ -766,6 +836,18 @@ update_directory (BusActivation       *activation,
           goto out;
         }
 
+      if (s_dir->previous_entries != NULL)
+        {
+          dbus_bool_t reused;
+
+          if (!reuse_previous_entry (activation, s_dir, &filename,
+                                     &full_path, &reused, error))
+            goto out;
+
+          if (reused)
+            continue;
+        }
+
       /* New file */
       desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
       if (desktop_file == NULL)
@@ -818,6 +900,7 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  s_dir->scan_time = scan_time;
   retval = TRUE;
 
  out:
@@ -834,6 +917,177 @@ update_directory (BusActivation       *activation,
   return retval;
 }
 
+/**
+ * Bring the activation entry for a single service file up to date after
+ * being told that @filename in @directory was created, changed or
+ * deleted, without rescanning any directories.
+ *
+ * This is only possible when the change cannot affect which file
+ * provides some other name: if a file that provided a name went away or
+ * now provides a different name, or a new file wants a name that some
+ * other file already provides, *handled is set to #FALSE and the caller
+ * must do a full reload to resolve it.
+ *
+ * @param activation the activation
+ * @param directory the service directory, exactly as configured
+ * @param filename the name of the file within @directory
+ * @param handled set to #TRUE if the change has been dealt with
+ * @param error set on OOM
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+bus_activation_update_service_file (BusActivation *activation,
+                                    const char    *directory,
+                                    const char    *filename,
+                                    dbus_bool_t   *handled,
+                                    DBusError     *error)
+{
+  BusServiceDirectory *s_dir;
+  BusActivationEntry *entry;
+  BusDesktopFile *desktop_file;
+  DBusString file_str, full_path;
+  DBusError tmp_error;
+  DBusStat stat_buf;
+  DBusList *link;
+  char *name;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  *handled = FALSE;
+  s_dir = NULL;
+
+  for (link = _dbus_list_get_first_link (&activation->directories);
+       link != NULL;
+       link = _dbus_list_get_next_link (&activation->directories, link))
+    {
+      BusServiceDirectory *d = link->data;
+
+      if (strcmp (d->dir_c, directory) == 0)
+        {
+          s_dir = d;
+          break;
+        }
+    }
+
+  if (s_dir == NULL)
+    return TRUE;
+
+  _dbus_string_init_const (&file_str, filename);
+
+  if (!_dbus_string_ends_with_c_str (&file_str, ".service"))
+    {
+      _dbus_verbose ("Ignoring change to non-.service file '%s'\n",
+                     filename);
+      *handled = TRUE;
+      return TRUE;
+    }
+
+  if (!_dbus_string_init (&full_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = FALSE;
+  desktop_file = NULL;
+  name = NULL;
+  dbus_error_init (&tmp_error);
+
+  if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, &file_str))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  entry = _dbus_hash_table_lookup_string (s_dir->entries, filename);
+
+  if (!_dbus_stat (&full_path, &stat_buf, NULL))
+    {
+      /* A file we never loaded going away changes nothing; but another
+       * file might have been shadowed by one we did load */
+      *handled = (entry == NULL);
+      retval = TRUE;
+      goto out;
+    }
+
+  desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
+  if (desktop_file == NULL)
+    {
+      _dbus_verbose ("Could not load %s: %s\n",
+                     _dbus_string_get_const_data (&full_path),
+                     tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      dbus_error_free (&tmp_error);
+      *handled = (entry == NULL);
+      retval = TRUE;
+      goto out;
+    }
+
+  if (entry != NULL)
+    {
+      if (!bus_desktop_file_get_string (desktop_file,
+                                        DBUS_SERVICE_SECTION,
+                                        DBUS_SERVICE_NAME,
+                                        &name, &tmp_error))
+        {
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (&tmp_error, error);
+              goto out;
+            }
+
+          dbus_error_free (&tmp_error);
+          retval = TRUE;
+          goto out;
+        }
+
+      if (strcmp (name, entry->name) != 0)
+        {
+          retval = TRUE;
+          goto out;
+        }
+    }
+
+  if (!update_desktop_file_entry (activation, s_dir, &file_str,
+                                  desktop_file, &tmp_error))
+    {
+      _dbus_verbose ("Could not update %s: %s\n",
+                     _dbus_string_get_const_data (&full_path),
+                     tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      dbus_error_free (&tmp_error);
+      retval = TRUE;
+      goto out;
+    }
+
+  _dbus_verbose ("Updated \"%s\" without a reload\n",
+                 _dbus_string_get_const_data (&full_path));
+  *handled = TRUE;
+  retval = TRUE;
+
+ out:
+  if (desktop_file != NULL)
+    bus_desktop_file_free (desktop_file);
+
+  dbus_free (name);
+  _dbus_string_free (&full_path);
+  return retval;
+}
+
 static dbus_bool_t
 populate_environment (BusActivation *activation)
 {
@@ -858,7 +1112,12 @@ bus_activation_reload (BusActivation     *activation,
                        DBusError         *error)
 {
   DBusList      *link;
+  DBusList      *old_directories;
   char          *dir;
+  dbus_bool_t    retval;
+
+  retval = FALSE;
+  old_directories = NULL;
 
   if (activation->server_address != NULL)
     dbus_free (activation->server_address);
@@ -878,18 +1137,70 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
-  _dbus_list_foreach (&activation->directories,
-                      (DBusForeachFunction) bus_service_directory_unref, NULL);
-  _dbus_list_clear (&activation->directories);
+  /* Keep the old directories until the new ones have been scanned, so
+   * that service files which didn't change can be reused */
+  old_directories = activation->directories;
+  activation->directories = NULL;
 
   link = _dbus_list_get_first_link (directories);
   while (link != NULL)
     {
       BusConfigServiceDir *config = link->data;
       BusServiceDirectory *s_dir;
+      DBusList *old_link;
+      dbus_bool_t ok;
 
       _dbus_assert (config->path != NULL);
 
+      for (old_link = _dbus_list_get_first_link (&old_directories);
+           old_link != NULL;
+           old_link = _dbus_list_get_next_link (&old_directories, old_link))
+        {
+          s_dir = old_link->data;
+
+          if (s_dir->flags == config->flags &&
+              strcmp (s_dir->dir_c, config->path) == 0)
+            break;
+        }
+
+      if (old_link != NULL)
+        {
+          DBusHashTable *entries;
+
+          entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                          (DBusFreeFunction)bus_activation_entry_unref);
+          if (entries == NULL)
+            {
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          _dbus_list_unlink (&old_directories, old_link);
+          _dbus_list_append_link (&activation->directories, old_link);
+
+          _dbus_assert (s_dir->previous_entries == NULL);
+          s_dir->previous_entries = s_dir->entries;
+          s_dir->entries = entries;
+
+          ok = update_directory (activation, s_dir, error);
+
+          /* Entries that weren't reused belong to files that are gone
+           * or have changed, and were loaded again if necessary */
+          _dbus_hash_table_unref (s_dir->previous_entries);
+          s_dir->previous_entries = NULL;
+
+          if (!ok)
+            {
+              if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+                goto failed;
+              else
+                dbus_error_free (error);
+            }
+
+          link = _dbus_list_get_next_link (directories, link);
+          continue;
+        }
+
       dir = _dbus_strdup (config->path);
       if (!dir)
         {
@@ -938,9 +1249,14 @@ bus_activation_reload (BusActivation     *activation,
       link = _dbus_list_get_next_link (directories, link);
     }
 
-  return TRUE;
+  retval = TRUE;
+
  failed:
-  return FALSE;
+  _dbus_list_foreach (&old_directories,
+                      (DBusForeachFunction) bus_service_directory_unref, NULL);
+  _dbus_list_clear (&old_directories);
+
+  return retval;
 }
 
 BusActivation*
@@ -1872,6 +2188,24 @@ bus_activation_activate_service (BusActivation  *activation,
   was_pending_activation = (pending_activation != NULL);
   if (was_pending_activation)
     {
+      long byte_limit;
+
+      /* Messages queued for a service that is slow to start stay in
+       * memory until it arrives, so bound the backlog per service */
+      byte_limit = bus_context_get_max_pending_activation_bytes (activation->context);
+
+      if (pending_activation->n_bytes +
+          _dbus_message_get_size (activation_message) > byte_limit)
+        {
+          dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                          "Too many bytes of messages are already waiting "
+                          "for %s to start "
+                          "(max_pending_service_start_bytes=%ld)",
+                          service_name, byte_limit);
+          bus_pending_activation_entry_free (pending_activation_entry);
+          return FALSE;
+        }
+
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
           _dbus_verbose ("Failed to append a new entry to pending activation\n");
@@ -1882,6 +2216,7 @@ bus_activation_activate_service (BusActivation  *activation,
         }
 
       pending_activation->n_entries += 1;
+      pending_activation->n_bytes += _dbus_message_get_size (activation_message);
       pending_activation->activation->n_pending_activations += 1;
     }
   else
@@ -1975,6 +2310,7 @@ bus_activation_activate_service (BusActivation  *activation,
         }
 
       pending_activation->n_entries += 1;
+      pending_activation->n_bytes += _dbus_message_get_size (activation_message);
       pending_activation->activation->n_pending_activations += 1;
 
       if (!_dbus_hash_table_insert_string (activation->pending_activations,
@@ -2323,6 +2659,26 @@ bus_activation_list_services (BusActivation *activation,
   return FALSE;
 }
 
+/* Calls function with the name of every activatable service, in no
+ * particular order; unlike bus_activation_list_services(), nothing is
+ * copied, so this can't fail. */
+void
+bus_activation_foreach_name (BusActivation *activation,
+                             void         (*function) (const char *name,
+                                                       void       *data),
+                             void          *data)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (activation->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      (* function) (entry->name, data);
+    }
+}
+
 dbus_bool_t
 dbus_activation_systemd_failure (BusActivation *activation,
                                  DBusMessage   *message)
@@ -2589,6 +2945,89 @@ do_test (const char *description, dbus_bool_t oom_test, CheckData *data)
   return TRUE;
 }
 
+static void
+check_update_service_file (BusActivation *activation,
+                           DBusString    *dir)
+{
+  const char *dir_c = _dbus_string_get_const_data (dir);
+  DBusError error = DBUS_ERROR_INIT;
+  BusActivationEntry *entry;
+  dbus_bool_t handled;
+
+#define UPDATE(directory, filename) \
+  do \
+    { \
+      if (!bus_activation_update_service_file (activation, directory, \
+                                               filename, &handled, \
+                                               &error)) \
+        _dbus_test_fatal ("Updating %s failed: %s", filename, \
+                          error.message); \
+    } \
+  while (0)
+
+  /* SERVICE_FILE_1 provides SERVICE_NAME_3 at this point */
+
+  /* A new file providing a new name is simply added */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    _dbus_test_fatal ("Could not create %s", SERVICE_FILE_2);
+
+  UPDATE (dir_c, SERVICE_FILE_2);
+  _dbus_assert (handled);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_2);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->exec, "exec-2") == 0);
+
+  /* So is a change that doesn't rename the service */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2b"))
+    _dbus_test_fatal ("Could not create %s", SERVICE_FILE_2);
+
+  UPDATE (dir_c, SERVICE_FILE_2);
+  _dbus_assert (handled);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_2);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->exec, "exec-2b") == 0);
+
+  /* Other files in the directory are not interesting */
+  UPDATE (dir_c, "README");
+  _dbus_assert (handled);
+
+  /* A second file for the same name needs a reload to pick a winner */
+  if (!test_create_service_file (dir, SERVICE_FILE_3, SERVICE_NAME_2, "exec-3"))
+    _dbus_test_fatal ("Could not create %s", SERVICE_FILE_3);
+
+  UPDATE (dir_c, SERVICE_FILE_3);
+  _dbus_assert (!handled);
+
+  /* but removing it again doesn't, because it was never loaded */
+  if (!test_remove_service_file (dir, SERVICE_FILE_3))
+    _dbus_test_fatal ("Could not remove %s", SERVICE_FILE_3);
+
+  UPDATE (dir_c, SERVICE_FILE_3);
+  _dbus_assert (handled);
+
+  /* Renaming or removing a service that was loaded might uncover some
+   * other file, so those need a reload */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_1, "exec-2"))
+    _dbus_test_fatal ("Could not create %s", SERVICE_FILE_2);
+
+  UPDATE (dir_c, SERVICE_FILE_2);
+  _dbus_assert (!handled);
+  _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                SERVICE_NAME_2) != NULL);
+
+  if (!test_remove_service_file (dir, SERVICE_FILE_2))
+    _dbus_test_fatal ("Could not remove %s", SERVICE_FILE_2);
+
+  UPDATE (dir_c, SERVICE_FILE_2);
+  _dbus_assert (!handled);
+
+  /* We know nothing about directories we aren't using */
+  UPDATE ("/nonexistent", SERVICE_FILE_2);
+  _dbus_assert (!handled);
+
+#undef UPDATE
+}
+
 static dbus_bool_t
 do_service_reload_test (const DBusString *test_data_dir,
                         DBusString       *dir,
@@ -2674,6 +3113,9 @@ do_service_reload_test (const DBusString *test_data_dir,
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  if (!oom_test)
+    check_update_service_file (activation, dir);
+
   bus_activation_unref (activation);
   _dbus_list_clear (&directories);
   bus_context_unref (context);
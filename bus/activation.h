@@ -36,6 +36,11 @@ dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
 						DBusError         *error);
+dbus_bool_t bus_activation_update_service_file (BusActivation *activation,
+                                                const char    *directory,
+                                                const char    *filename,
+                                                dbus_bool_t   *handled,
+                                                DBusError     *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
 
@@ -57,6 +62,10 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
 						char            ***listp,
 						int               *array_len);
+void           bus_activation_foreach_name     (BusActivation     *activation,
+                                                void             (*function) (const char *name,
+                                                                              void       *data),
+                                                void              *data);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
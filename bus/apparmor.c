@@ -29,7 +29,9 @@
 #ifdef HAVE_APPARMOR
 
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-string.h>
+#include <dbus/dbus-watch.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -74,6 +76,32 @@ struct BusAppArmorConfinement
 
 static BusAppArmorConfinement *bus_con = NULL;
 
+/* Answers from aa_query_label(), keyed by the permission and the query
+ * after its AA_QUERY_CMD_LABEL_SIZE scratch prefix. The query holds both
+ * labels, the bus type, the peer's name and the path, interface and
+ * member, so equal queries always get equal answers until the policy
+ * changes. Snap-confined applications ask the same few questions over
+ * and over. The cache is direct-mapped. */
+#define QUERY_CACHE_SIZE 256
+
+typedef struct
+{
+  char *query; /* NULL if the slot is unused */
+  int len;
+  uint32_t perm;
+  int allow;
+  int audit;
+} CachedQuery;
+
+static CachedQuery query_cache[QUERY_CACHE_SIZE];
+
+/* The kernel's policy revision file becomes readable whenever the
+ * policy is replaced, which is our cue to forget every answer. Without
+ * it the cache is not used at all. */
+static int revision_fd = -1;
+static DBusWatch *revision_watch = NULL;
+static DBusLoop *revision_loop = NULL;
+
 /**
  * Callers of this function give up ownership of the *label and *mode
  * pointers.
@@ -164,49 +192,53 @@ modestr_is_complain (const char *mode)
 }
 
 static void
-log_message (dbus_bool_t allow, const char *op, DBusString *data)
+write_log_message (const char *text,
+                   void       *data)
 {
-  const char *mstr;
 #ifdef HAVE_LIBAUDIT
   int audit_fd;
-#endif
-
-  if (allow)
-    mstr = "ALLOWED";
-  else
-    mstr = "DENIED";
 
-#ifdef HAVE_LIBAUDIT
   audit_fd = bus_audit_get_fd ();
 
   if (audit_fd >= 0)
-  {
-    DBusString avc;
+    {
+      /* FIXME: need to change this to show real user */
+      audit_log_user_avc_message (audit_fd, AUDIT_USER_AVC, text,
+                                  NULL, NULL, NULL, getuid ());
+      return;
+    }
+#endif /* HAVE_LIBAUDIT */
 
-    if (!_dbus_string_init (&avc))
-      goto syslog;
+  syslog (LOG_USER | LOG_NOTICE, "%s", text);
+}
 
-    if (!_dbus_string_append_printf (&avc,
-          "apparmor=\"%s\" operation=\"dbus_%s\" %s\n",
-          mstr, op, _dbus_string_get_const_data (data)))
-      {
-        _dbus_string_free (&avc);
-        goto syslog;
-      }
+/* The message is queued, so that a flood of them is rate-limited and
+ * does not hold up routing */
+static void
+log_message (BusContext *context,
+             dbus_bool_t allow,
+             const char *op,
+             DBusString *data)
+{
+  const char *mstr;
+  DBusString avc;
 
-    /* FIXME: need to change this to show real user */
-    audit_log_user_avc_message (audit_fd, AUDIT_USER_AVC,
-                                _dbus_string_get_const_data (&avc),
-                                NULL, NULL, NULL, getuid ());
-    _dbus_string_free (&avc);
+  if (allow)
+    mstr = "ALLOWED";
+  else
+    mstr = "DENIED";
+
+  if (!_dbus_string_init (&avc))
     return;
-  }
 
-syslog:
-#endif /* HAVE_LIBAUDIT */
+  if (_dbus_string_append_printf (&avc,
+        "apparmor=\"%s\" operation=\"dbus_%s\" %s\n",
+        mstr, op, _dbus_string_get_const_data (data)))
+    bus_log_queue_push (bus_context_get_security_log (context),
+                        write_log_message, NULL,
+                        _dbus_string_get_const_data (&avc));
 
-  syslog (LOG_USER | LOG_NOTICE, "apparmor=\"%s\" operation=\"dbus_%s\" %s\n",
-          mstr, op, _dbus_string_get_const_data (data));
+  _dbus_string_free (&avc);
 }
 
 static dbus_bool_t
@@ -320,6 +352,108 @@ build_eavesdrop_query (DBusString *query, const char *con, const char *bustype)
   return build_common_query (query, con, bustype);
 }
 
+static void
+query_cache_flush (void)
+{
+  int i;
+
+  for (i = 0; i < QUERY_CACHE_SIZE; i++)
+    {
+      dbus_free (query_cache[i].query);
+      query_cache[i].query = NULL;
+    }
+}
+
+static CachedQuery *
+query_cache_slot (uint32_t    perm,
+                  const char *key,
+                  int         len)
+{
+  unsigned int hash = perm;
+  int i;
+
+  for (i = 0; i < len; i++)
+    hash = hash * 31 + (unsigned char) key[i];
+
+  return &query_cache[hash % QUERY_CACHE_SIZE];
+}
+
+/*
+ * aa_query_label(), answered from the cache when the same query was
+ * asked since the policy last changed. Failed queries are not cached.
+ */
+static int
+query_label (uint32_t    perm,
+             DBusString *query,
+             int        *allow,
+             int        *audit)
+{
+  const char *key;
+  CachedQuery *slot = NULL;
+  int len;
+  int res;
+
+  key = _dbus_string_get_const_data (query) + AA_QUERY_CMD_LABEL_SIZE;
+  len = _dbus_string_get_length (query) - AA_QUERY_CMD_LABEL_SIZE;
+
+  if (revision_watch != NULL)
+    {
+      slot = query_cache_slot (perm, key, len);
+
+      if (slot->query != NULL && slot->perm == perm && slot->len == len &&
+          memcmp (slot->query, key, len) == 0)
+        {
+          *allow = slot->allow;
+          *audit = slot->audit;
+          return 0;
+        }
+    }
+
+  res = aa_query_label (perm,
+                        _dbus_string_get_data (query),
+                        _dbus_string_get_length (query),
+                        allow, audit);
+
+  /* aa_query_label() only scribbled over the prefix, so key is intact.
+   * If we can't remember the answer, we'll just ask again next time. */
+  if (res == 0 && slot != NULL)
+    {
+      char *copy = dbus_malloc (len);
+
+      if (copy != NULL)
+        {
+          memcpy (copy, key, len);
+          dbus_free (slot->query);
+          slot->query = copy;
+          slot->len = len;
+          slot->perm = perm;
+          slot->allow = *allow;
+          slot->audit = *audit;
+        }
+    }
+
+  return res;
+}
+
+static dbus_bool_t
+handle_revision_watch (DBusWatch    *watch,
+                       unsigned int  flags,
+                       void         *data)
+{
+  char buf[32];
+
+  _dbus_verbose ("AppArmor policy changed, forgetting cached queries\n");
+
+  /* Reading the revision is what stops the file being readable */
+  if (lseek (revision_fd, 0, SEEK_SET) < 0 ||
+      read (revision_fd, buf, sizeof (buf)) < 0)
+    _dbus_verbose ("Error reading AppArmor policy revision: %s\n",
+                   _dbus_strerror (errno));
+
+  query_cache_flush ();
+  return TRUE;
+}
+
 static void
 set_error_from_query_errno (DBusError *error, int error_number)
 {
@@ -478,6 +612,73 @@ bus_apparmor_full_init (DBusError *error)
   return TRUE;
 }
 
+/**
+ * Starts caching the answers to AppArmor queries, if the kernel can
+ * tell us when the policy changes. Failing to do so is not an error:
+ * every query just goes to the kernel, as it always did.
+ */
+void
+bus_apparmor_watch_policy (BusContext *context)
+{
+#ifdef HAVE_APPARMOR
+  DBusString path = _DBUS_STRING_INIT_INVALID;
+  char *mountpoint = NULL;
+
+  if (!apparmor_enabled || revision_watch != NULL)
+    return;
+
+  if (aa_find_mountpoint (&mountpoint) != 0)
+    {
+      _dbus_verbose ("AppArmor filesystem not found, not caching queries\n");
+      return;
+    }
+
+  if (!_dbus_string_init (&path) ||
+      !_dbus_string_append (&path, mountpoint) ||
+      !_dbus_string_append (&path, "/revision"))
+    goto out;
+
+  revision_fd = open (_dbus_string_get_const_data (&path),
+                      O_RDONLY | O_CLOEXEC);
+
+  if (revision_fd < 0)
+    {
+      _dbus_verbose ("Cannot open %s, not caching AppArmor queries: %s\n",
+                     _dbus_string_get_const_data (&path),
+                     _dbus_strerror (errno));
+      goto out;
+    }
+
+  revision_watch = _dbus_watch_new (revision_fd, DBUS_WATCH_READABLE, TRUE,
+                                    handle_revision_watch, NULL, NULL);
+
+  if (revision_watch == NULL)
+    goto out;
+
+  revision_loop = bus_context_get_loop (context);
+
+  if (!_dbus_loop_add_watch (revision_loop, revision_watch))
+    {
+      _dbus_watch_unref (revision_watch);
+      revision_watch = NULL;
+      revision_loop = NULL;
+      goto out;
+    }
+
+  _dbus_loop_ref (revision_loop);
+
+ out:
+  if (revision_watch == NULL && revision_fd >= 0)
+    {
+      close (revision_fd);
+      revision_fd = -1;
+    }
+
+  free (mountpoint);
+  _dbus_string_free (&path);
+#endif /* HAVE_APPARMOR */
+}
+
 void
 bus_apparmor_shutdown (void)
 {
@@ -487,6 +688,20 @@ bus_apparmor_shutdown (void)
 
   _dbus_verbose ("AppArmor shutdown\n");
 
+  if (revision_watch != NULL)
+    {
+      _dbus_loop_remove_watch (revision_loop, revision_watch);
+      _dbus_watch_invalidate (revision_watch);
+      _dbus_watch_unref (revision_watch);
+      _dbus_loop_unref (revision_loop);
+      revision_watch = NULL;
+      revision_loop = NULL;
+      close (revision_fd);
+      revision_fd = -1;
+    }
+
+  query_cache_flush ();
+
   bus_apparmor_confinement_unref (bus_con);
   bus_con = NULL;
 #endif /* HAVE_APPARMOR */
@@ -636,10 +851,7 @@ bus_apparmor_allows_acquire_service (DBusConnection     *connection,
       goto oom;
     }
 
-  res = aa_query_label (AA_DBUS_BIND,
-                        _dbus_string_get_data (&qstr),
-                        _dbus_string_get_length (&qstr),
-                        &allow, &audit);
+  res = query_label (AA_DBUS_BIND, &qstr, &allow, &audit);
   _dbus_string_free (&qstr);
   if (res == -1)
     {
@@ -687,7 +899,8 @@ bus_apparmor_allows_acquire_service (DBusConnection     *connection,
   if (con->label && !_dbus_append_pair_str (&auxdata, "label", con->label))
     goto oom;
 
-  log_message (allow, "bind", &auxdata);
+  log_message (bus_connection_get_context (connection), allow, "bind",
+               &auxdata);
 
  out:
   if (con != NULL)
@@ -816,10 +1029,7 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           goto oom;
         }
 
-      res = aa_query_label (src_perm,
-                            _dbus_string_get_data (&qstr),
-                            _dbus_string_get_length (&qstr),
-                            &src_allow, &src_audit);
+      res = query_label (src_perm, &qstr, &src_allow, &src_audit);
       _dbus_string_free (&qstr);
       if (res == -1)
         {
@@ -850,10 +1060,7 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           goto oom;
         }
 
-      res = aa_query_label (dst_perm,
-                            _dbus_string_get_data (&qstr),
-                            _dbus_string_get_length (&qstr),
-                            &dst_allow, &dst_audit);
+      res = query_label (dst_perm, &qstr, &dst_allow, &dst_audit);
       _dbus_string_free (&qstr);
       if (res == -1)
         {
@@ -948,7 +1155,8 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           !_dbus_append_pair_str (&auxdata, "peer_info", strerror (dst_errno)))
         goto oom;
 
-      log_message (src_allow, msgtypestr, &auxdata);
+      log_message (bus_connection_get_context (sender), src_allow,
+                   msgtypestr, &auxdata);
     }
   if (dst_audit)
     {
@@ -984,7 +1192,8 @@ bus_apparmor_allows_send (DBusConnection     *sender,
           !_dbus_append_pair_str (&auxdata, "peer_info", strerror (src_errno)))
         goto oom;
 
-      log_message (dst_allow, msgtypestr, &auxdata);
+      log_message (bus_connection_get_context (sender), dst_allow,
+                   msgtypestr, &auxdata);
     }
 
  out:
@@ -1052,10 +1261,7 @@ bus_apparmor_allows_eavesdropping (DBusConnection     *connection,
       goto oom;
     }
 
-  res = aa_query_label (AA_DBUS_EAVESDROP,
-                        _dbus_string_get_data (&qstr),
-                        _dbus_string_get_length (&qstr),
-                        &allow, &audit);
+  res = query_label (AA_DBUS_EAVESDROP, &qstr, &allow, &audit);
   _dbus_string_free (&qstr);
   if (res == -1)
     {
@@ -1099,7 +1305,8 @@ bus_apparmor_allows_eavesdropping (DBusConnection     *connection,
   if (con->label && !_dbus_append_pair_str (&auxdata, "label", con->label))
     goto oom;
 
-  log_message (allow, "eavesdrop", &auxdata);
+  log_message (bus_connection_get_context (connection), allow,
+               "eavesdrop", &auxdata);
 
  out:
   if (con != NULL)
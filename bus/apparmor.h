@@ -33,6 +33,7 @@ dbus_bool_t bus_apparmor_pre_init (void);
 dbus_bool_t bus_apparmor_set_mode_from_config (const char *mode,
                                                DBusError *error);
 dbus_bool_t bus_apparmor_full_init (DBusError *error);
+void bus_apparmor_watch_policy (BusContext *context);
 void bus_apparmor_shutdown (void);
 dbus_bool_t bus_apparmor_enabled (void);
 
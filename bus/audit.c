@@ -36,6 +36,10 @@
 #include <libaudit.h>
 #endif
 
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
 #include <dbus/dbus-internals.h>
 #ifdef DBUS_UNIX
 #include <dbus/dbus-userdb.h>
@@ -109,6 +113,55 @@ bus_audit_shutdown (void)
 #endif /* HAVE_LIBAUDIT */
 }
 
+/**
+ * Called just before the bus executes a new instance of itself to hand
+ * over to (see handoff.c). An exec by the unprivileged daemon user
+ * would lose the CAP_AUDIT_WRITE that _dbus_change_to_daemon_user()
+ * kept, so raise it into the ambient set, which survives exec.
+ *
+ * The new instance, or this one if the exec fails, must lower it again
+ * with bus_audit_clear_ambient_capabilities(), or activated services
+ * would inherit it.
+ */
+void
+bus_audit_keep_capabilities_across_exec (BusContext *context)
+{
+#if defined(HAVE_LIBAUDIT) && defined(PR_CAP_AMBIENT)
+  /* root keeps its capabilities across exec anyway */
+  if (_dbus_geteuid () == 0)
+    return;
+
+  capng_get_caps_process ();
+
+  if (!capng_have_capability (CAPNG_PERMITTED, CAP_AUDIT_WRITE))
+    return;
+
+  if (capng_update (CAPNG_ADD, CAPNG_INHERITABLE, CAP_AUDIT_WRITE) < 0 ||
+      capng_apply (CAPNG_SELECT_CAPS) < 0 ||
+      prctl (PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, CAP_AUDIT_WRITE, 0, 0) < 0)
+    {
+      int e = errno;
+
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to keep CAP_AUDIT_WRITE for the new instance "
+                       "of the bus, audit messages will not be written: %s",
+                       _dbus_strerror (e));
+    }
+#endif
+}
+
+/**
+ * Undoes bus_audit_keep_capabilities_across_exec(), leaving the
+ * permitted and effective capabilities as they are.
+ */
+void
+bus_audit_clear_ambient_capabilities (void)
+{
+#if defined(HAVE_LIBAUDIT) && defined(PR_CAP_AMBIENT)
+  prctl (PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0);
+#endif
+}
+
 /* The !HAVE_LIBAUDIT case lives in dbus-sysdeps-util-unix.c */
 #ifdef HAVE_LIBAUDIT
 /**
@@ -29,5 +29,7 @@
 void bus_audit_init (BusContext *context);
 int bus_audit_get_fd (void);
 void bus_audit_shutdown (void);
+void bus_audit_keep_capabilities_across_exec (BusContext *context);
+void bus_audit_clear_ambient_capabilities (void);
 
 #endif
@@ -39,13 +39,23 @@
 #include "apparmor.h"
 #include "audit.h"
 #include "dir-watch.h"
+#include "log-queue.h"
+#include "handoff.h"
 #include <dbus/dbus-auth.h>
+#include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-probes-internal.h>
 #include <dbus/dbus-server-protected.h>
 
+#ifdef DBUS_UNIX
+#include <dbus/dbus-server-socket.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#include <dbus/dbus-transport-socket.h>
+#endif
+
 #ifdef DBUS_CYGWIN
 #include <signal.h>
 #endif
@@ -62,6 +72,7 @@ struct BusContext
   char *user;
   char *log_prefix;
   DBusLoop *loop;
+  BusLogQueue *security_log; /**< Denials etc. waiting to be written */
   DBusList *servers;
   BusConnections *connections;
   BusActivation *activation;
@@ -71,15 +82,24 @@ struct BusContext
   BusLimits limits;
   DBusRLimit *initial_fd_limit;
   BusContainers *containers;
+  BusConfigParser *config_parser; /* what we last loaded successfully */
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
   unsigned int allow_anonymous : 1;
   unsigned int systemd_activation : 1;
+  unsigned int normalize_byte_order : 1;
+  DBusList *priority_uids;
+  DBusList *priority_gids;
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   unsigned int quiet_log : 1;
 #endif
   dbus_bool_t watches_enabled;
+  /* Non-NULL while bus_context_new() takes over from a previous
+   * instance of the bus, see handoff.c */
+  BusHandoff *handoff;
+  /* TRUE while we are getting ready to hand over to a new instance */
+  dbus_bool_t handing_off;
 };
 
 static dbus_int32_t server_data_slot = -1;
@@ -87,6 +107,7 @@ static dbus_int32_t server_data_slot = -1;
 typedef struct
 {
   BusContext *context;
+  char *address; /**< The address we were asked to listen on, if any */
 } BusServerData;
 
 #define BUS_SERVER_DATA(server) (dbus_server_get_data ((server), server_data_slot))
@@ -120,7 +141,19 @@ add_server_watch (DBusWatch  *watch,
 
   context = server_get_context (server);
 
-  return _dbus_loop_add_watch (context->loop, watch);
+  if (!_dbus_loop_add_watch (context->loop, watch))
+    return FALSE;
+
+  /* New clients wait for established connections */
+  if (!_dbus_loop_set_priority (context->loop,
+                                _dbus_watch_get_pollable (watch),
+                                DBUS_LOOP_PRIORITY_LOW))
+    {
+      _dbus_loop_remove_watch (context->loop, watch);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 static void
@@ -212,26 +245,161 @@ bus_context_add_incoming_connection (BusContext *context,
   dbus_connection_set_allow_anonymous (new_connection,
                                        context->allow_anonymous);
 
+  /* We validate everything we receive before routing it, so clients
+   * that trust us need not do it again */
+  _dbus_connection_set_validates_bodies (new_connection, TRUE);
+
   return TRUE;
 }
 
+#ifdef DBUS_UNIX
+/**
+ * Connects a client in this process to the bus, for applications that
+ * run the bus in-process from the dbus-daemon-internal library. Its
+ * messages are routed, checked against the policy and counted against
+ * the limits like any other connection's, but travel through a socket
+ * pair rather than a listening socket, so no other process is woken to
+ * deliver them.
+ *
+ * The connection authenticates with EXTERNAL as the user running this
+ * process. It is not registered yet: the caller should call
+ * dbus_bus_register() or send Hello itself.
+ *
+ * The bus is single-threaded: this must be called from the thread that
+ * runs the bus's main loop, between iterations, like everything else
+ * that touches @p context. The client end that is returned belongs to
+ * no main loop and may be handed to another thread; a blocking call on
+ * it can only complete if the bus's main loop keeps running meanwhile,
+ * so it must not be made from the bus's thread.
+ *
+ * @param context the bus
+ * @param error used to report errors
+ * @returns the client end of the new connection, or #NULL
+ */
+DBusConnection *
+bus_context_open_in_process_connection (BusContext *context,
+                                        DBusError  *error)
+{
+  static const char * const mechanisms[] = { "EXTERNAL", NULL };
+  DBusSocket client_fd = DBUS_SOCKET_INIT;
+  DBusSocket bus_fd = DBUS_SOCKET_INIT;
+  DBusTransport *transport = NULL;
+  DBusConnection *bus_side = NULL;
+  DBusConnection *client = NULL;
+  DBusString guid, address;
+  char *id;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (context->servers != NULL);
+
+  id = dbus_server_get_id (context->servers->data);
+
+  if (id == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!_dbus_socketpair (&client_fd, &bus_fd, FALSE, error))
+    goto out;
+
+  _dbus_string_init_const (&guid, id);
+  transport = _dbus_transport_new_for_socket (bus_fd, &guid, NULL);
+
+  if (transport == NULL)
+    goto oom;
+
+  _dbus_socket_invalidate (&bus_fd);
+
+  if (!_dbus_transport_set_auth_mechanisms (transport, (const char **) mechanisms))
+    goto oom;
+
+  bus_side = _dbus_connection_new_for_transport (transport);
+
+  if (bus_side == NULL)
+    goto oom;
+
+  _dbus_transport_unref (transport);
+  _dbus_string_init_const (&address, bus_context_get_address (context));
+  transport = _dbus_transport_new_for_socket (client_fd, NULL, &address);
+
+  if (transport == NULL)
+    goto oom;
+
+  _dbus_socket_invalidate (&client_fd);
+
+  client = _dbus_connection_new_for_transport (transport);
+
+  if (client == NULL)
+    goto oom;
+
+  if (!bus_context_add_incoming_connection (context, bus_side))
+    {
+      dbus_connection_close (client);
+      dbus_connection_unref (client);
+      client = NULL;
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Unable to set up connection");
+    }
+
+  goto out;
+
+oom:
+  BUS_SET_OOM (error);
+
+out:
+  if (bus_side != NULL)
+    {
+      /* The bus holds its own reference if it accepted the connection */
+      if (client == NULL)
+        dbus_connection_close (bus_side);
+      dbus_connection_unref (bus_side);
+    }
+
+  if (transport != NULL)
+    _dbus_transport_unref (transport);
+
+  if (_dbus_socket_is_valid (client_fd))
+    _dbus_close_socket (client_fd, NULL);
+
+  if (_dbus_socket_is_valid (bus_fd))
+    _dbus_close_socket (bus_fd, NULL);
+
+  dbus_free (id);
+  return client;
+}
+#endif /* DBUS_UNIX */
+
 static void
 free_server_data (void *data)
 {
   BusServerData *bd = data;
 
+  dbus_free (bd->address);
   dbus_free (bd);
 }
 
 static dbus_bool_t
 setup_server (BusContext *context,
               DBusServer *server,
+              const char *address,
               char      **auth_mechanisms,
               DBusError  *error)
 {
+  BusServerData *bd;
+
   if (!bus_context_setup_server (context, server, error))
     return FALSE;
 
+  bd = BUS_SERVER_DATA (server);
+  bd->address = _dbus_strdup (address);
+
+  if (bd->address == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
   if (!dbus_server_set_auth_mechanisms (server, (const char**) auth_mechanisms))
     {
       BUS_SET_OOM (error);
@@ -286,6 +454,28 @@ bus_context_setup_server (BusContext                 *context,
   return TRUE;
 }
 
+/* Listens on @address, or keeps listening on the sockets that a
+ * previous instance of the bus was using for it */
+static DBusServer *
+listen_on_address (BusContext *context,
+                   const char *address,
+                   DBusError  *error)
+{
+#ifdef DBUS_UNIX
+  if (context->handoff != NULL)
+    {
+      DBusServer *server;
+
+      server = bus_handoff_take_server (context->handoff, address, error);
+
+      if (server != NULL || dbus_error_is_set (error))
+        return server;
+    }
+#endif
+
+  return dbus_server_listen (address, error);
+}
+
 /* This code only gets executed the first time the
  * config files are parsed.  It is not executed
  * when config files are reloaded.
@@ -349,7 +539,9 @@ process_config_first_time_only (BusContext       *context,
   if (flags & BUS_CONTEXT_FLAG_WRITE_PID_FILE)
     pidfile = bus_config_parser_get_pidfile (parser);
 
-  if (pidfile != NULL)
+  /* When taking over from a previous instance, the pid file is ours:
+   * we are the same process */
+  if (pidfile != NULL && context->handoff == NULL)
     {
       DBusString u;
       DBusStat stbuf;
@@ -491,13 +683,16 @@ process_config_first_time_only (BusContext       *context,
     {
       DBusServer *server;
 
-      server = dbus_server_listen (_dbus_string_get_const_data(address), error);
+      server = listen_on_address (context, _dbus_string_get_const_data (address),
+                                  error);
       if (server == NULL)
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
           goto failed;
         }
-      else if (!setup_server (context, server, auth_mechanisms, error))
+      else if (!setup_server (context, server,
+                              _dbus_string_get_const_data (address),
+                              auth_mechanisms, error))
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
           goto failed;
@@ -515,13 +710,14 @@ process_config_first_time_only (BusContext       *context,
         {
           DBusServer *server;
 
-          server = dbus_server_listen (link->data, error);
+          server = listen_on_address (context, link->data, error);
           if (server == NULL)
             {
               _DBUS_ASSERT_ERROR_IS_SET (error);
               goto failed;
             }
-          else if (!setup_server (context, server, auth_mechanisms, error))
+          else if (!setup_server (context, server, link->data,
+                                  auth_mechanisms, error))
             {
               _DBUS_ASSERT_ERROR_IS_SET (error);
               goto failed;
@@ -569,6 +765,7 @@ process_config_every_time (BusContext      *context,
   char *addr;
   const char *servicehelper;
   char *s;
+  BusPolicy *policy;
 
   dbus_bool_t retval;
 
@@ -585,11 +782,39 @@ process_config_every_time (BusContext      *context,
 
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
+  _dbus_loop_set_low_priority_budget (context->loop,
+                                      context->limits.max_handshakes_per_iteration);
+
+  context->normalize_byte_order =
+    bus_config_parser_get_normalize_byte_order (parser);
+
+  _dbus_list_clear (&context->priority_uids);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_priority_uids (parser))))
+    _dbus_list_append_link (&context->priority_uids, link);
 
-  if (context->policy)
-    bus_policy_unref (context->policy);
-  context->policy = bus_config_parser_steal_policy (parser);
-  _dbus_assert (context->policy != NULL);
+  _dbus_list_clear (&context->priority_gids);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_priority_gids (parser))))
+    _dbus_list_append_link (&context->priority_gids, link);
+
+  policy = bus_config_parser_steal_policy (parser);
+  _dbus_assert (policy != NULL);
+
+  /* Most reloads are triggered by a new .service file or some unrelated
+   * part of the configuration; keep the old policy if its rules didn't
+   * change, so that the client policies already compiled from it can
+   * be reused for the connections below.
+   */
+  if (context->policy && bus_policy_equal (context->policy, policy))
+    {
+      _dbus_verbose ("Policy rules unchanged, keeping current policy\n");
+      bus_policy_unref (policy);
+    }
+  else
+    {
+      if (context->policy)
+        bus_policy_unref (context->policy);
+      context->policy = policy;
+    }
 
   /* context->connections is NULL when creating new BusContext */
   if (context->connections)
@@ -730,6 +955,31 @@ raise_file_descriptor_limit (BusContext      *context)
 #endif
 }
 
+/* Reload the parts of the configuration that depend on something other
+ * than the configuration files, when those files are known not to have
+ * changed since @parser loaded them */
+static dbus_bool_t
+process_config_unchanged (BusContext      *context,
+                          BusConfigParser *parser,
+                          DBusError       *error)
+{
+  DBusString address;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  /* The user database cache was flushed, so group memberships might
+   * be different */
+  _dbus_verbose ("Reload policy rules for completed connections\n");
+  if (!bus_connections_reload_policy (context->connections, error))
+    return FALSE;
+
+  /* .service files might have been added, changed or removed */
+  _dbus_string_init_const (&address, context->address);
+  return bus_activation_reload (context->activation, &address,
+                                bus_config_parser_get_service_dirs (parser),
+                                error);
+}
+
 static dbus_bool_t
 process_config_postinit (BusContext      *context,
 			 BusConfigParser *parser,
@@ -766,12 +1016,28 @@ process_config_postinit (BusContext      *context,
   return TRUE;
 }
 
+static inline const char *
+nonnull (const char *maybe_null,
+         const char *if_null)
+{
+  return (maybe_null ? maybe_null : if_null);
+}
+
+/* Messages on the security log already carry the log prefix */
+static void
+write_security_log (const char *text,
+                    void       *data)
+{
+  _dbus_log (DBUS_SYSTEM_LOG_SECURITY, "%s", text);
+}
+
 BusContext*
 bus_context_new (const DBusString *config_file,
                  BusContextFlags   flags,
                  DBusPipe         *print_addr_pipe,
                  DBusPipe         *print_pid_pipe,
                  const DBusString *address,
+                 BusHandoff       *handoff,
                  DBusError        *error)
 {
   BusContext *context;
@@ -798,7 +1064,13 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
   context->refcount = 1;
+  context->handoff = handoff;
 
+#ifdef DBUS_UNIX
+  if (handoff != NULL)
+    bus_handoff_get_uuid (handoff, &context->uuid);
+  else
+#endif
   if (!_dbus_generate_uuid (&context->uuid, error))
     goto failed;
 
@@ -815,6 +1087,14 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  context->security_log = bus_log_queue_new (context->loop,
+                                             write_security_log, NULL);
+  if (context->security_log == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   context->watches_enabled = TRUE;
 
   context->registry = bus_registry_new (context);
@@ -954,9 +1234,11 @@ bus_context_new (const DBusString *config_file,
 
         /* Need to write PID file and to PID pipe for ourselves,
          * not for the child process. This is a no-op if the pidfile
-         * is NULL and print_pid_pipe is NULL.
+         * is NULL and print_pid_pipe is NULL. A previous instance
+         * that handed over to us already wrote our pid.
          */
-        if (!_dbus_write_pid_to_file_and_pipe (context->pidfile ? &u : NULL,
+        if (!_dbus_write_pid_to_file_and_pipe (context->pidfile &&
+                                               handoff == NULL ? &u : NULL,
                                                print_pid_pipe,
                                                _dbus_getpid (),
                                                error))
@@ -978,7 +1260,10 @@ bus_context_new (const DBusString *config_file,
    * when the main thread calls setuid().
    * https://bugs.freedesktop.org/show_bug.cgi?id=92832
    */
-  if (context->user != NULL)
+  /* A previous instance that handed over to us already did this, and
+   * passed CAP_AUDIT_WRITE on as an ambient capability, which must not
+   * reach activated services */
+  if (context->user != NULL && handoff == NULL)
     {
       if (!_dbus_change_to_daemon_user (context->user, error))
 	{
@@ -986,6 +1271,10 @@ bus_context_new (const DBusString *config_file,
 	  goto failed;
 	}
     }
+  else if (handoff != NULL)
+    {
+      bus_audit_clear_ambient_capabilities ();
+    }
 
   /* Auditing should be initialized before LSMs, so that the LSMs are able
    * to log audit-events that happen during their initialization.
@@ -1012,6 +1301,8 @@ bus_context_new (const DBusString *config_file,
       if (context->syslog)
         bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
                          "AppArmor D-Bus mediation is enabled\n");
+
+      bus_apparmor_watch_policy (context);
     }
 
   /* When SELinux is used, this must happen after bus_selinux_full_init()
@@ -1025,11 +1316,16 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (parser != NULL)
-    {
-      bus_config_parser_unref (parser);
-      parser = NULL;
-    }
+  /* Keep the parser, so that a reload can tell whether it needs to
+   * parse the configuration again */
+  context->config_parser = parser;
+  parser = NULL;
+
+#ifdef DBUS_UNIX
+  if (handoff != NULL)
+    bus_handoff_restore (handoff, context);
+#endif
+  context->handoff = NULL;
 
   dbus_server_free_data_slot (&server_data_slot);
 
@@ -1066,6 +1362,32 @@ bus_context_reload_config (BusContext *context,
   _dbus_flush_caches ();
 
   ret = FALSE;
+  parser = NULL;
+
+  /* Most reloads are triggered by a change to a directory of .service
+   * files, which does not need the XML configuration to be parsed again */
+  if (context->config_parser != NULL &&
+      bus_config_parser_sources_unchanged (context->config_parser))
+    {
+      _dbus_verbose ("Configuration files unchanged, not parsing them again\n");
+
+      if (!process_config_unchanged (context, context->config_parser, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      ret = TRUE;
+      goto done;
+    }
+
+  /* If we fail part way through, we no longer know what we loaded */
+  if (context->config_parser != NULL)
+    {
+      bus_config_parser_unref (context->config_parser);
+      context->config_parser = NULL;
+    }
+
   _dbus_string_init_const (&config_file, context->config_file);
   parser = bus_config_load (&config_file, TRUE, NULL, error);
   if (parser == NULL)
@@ -1086,6 +1408,10 @@ bus_context_reload_config (BusContext *context,
     }
   ret = TRUE;
 
+  context->config_parser = parser;
+  parser = NULL;
+
+ done:
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
  failed:
   if (!ret)
@@ -1185,12 +1511,21 @@ bus_context_unref (BusContext *context)
         }
       _dbus_list_clear (&context->servers);
 
+      _dbus_list_clear (&context->priority_uids);
+      _dbus_list_clear (&context->priority_gids);
+
       if (context->policy)
         {
           bus_policy_unref (context->policy);
           context->policy = NULL;
         }
 
+      if (context->security_log)
+        {
+          bus_log_queue_free (context->security_log);
+          context->security_log = NULL;
+        }
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
@@ -1204,6 +1539,13 @@ bus_context_unref (BusContext *context)
         }
 
       bus_clear_containers (&context->containers);
+
+      if (context->config_parser)
+        {
+          bus_config_parser_unref (context->config_parser);
+          context->config_parser = NULL;
+        }
+
       dbus_free (context->config_file);
       dbus_free (context->log_prefix);
       dbus_free (context->type);
@@ -1258,6 +1600,46 @@ bus_context_get_systemd_activation (BusContext *context)
   return context->systemd_activation;
 }
 
+dbus_bool_t
+bus_context_get_normalize_byte_order (BusContext *context)
+{
+  return context->normalize_byte_order;
+}
+
+/* TRUE if <priority> says the connection should be serviced first */
+dbus_bool_t
+bus_context_connection_has_priority (BusContext     *context,
+                                     DBusConnection *connection)
+{
+  DBusList *link;
+  unsigned long uid;
+
+  if (context->priority_uids == NULL && context->priority_gids == NULL)
+    return FALSE;
+
+  if (!dbus_connection_get_unix_user (connection, &uid))
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (&context->priority_uids);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->priority_uids, link))
+    {
+      if ((unsigned long) _DBUS_POINTER_TO_INT (link->data) == uid)
+        return TRUE;
+    }
+
+  for (link = _dbus_list_get_first_link (&context->priority_gids);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->priority_gids, link))
+    {
+      if (bus_connection_is_in_unix_group (connection,
+                                           (unsigned long) _DBUS_POINTER_TO_INT (link->data)))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 BusRegistry*
 bus_context_get_registry (BusContext  *context)
 {
@@ -1373,6 +1755,12 @@ bus_context_get_max_pending_activations (BusContext *context)
   return context->limits.max_pending_activations;
 }
 
+long
+bus_context_get_max_pending_activation_bytes (BusContext *context)
+{
+  return context->limits.max_pending_activation_bytes;
+}
+
 int
 bus_context_get_max_services_per_connection (BusContext *context)
 {
@@ -1391,6 +1779,54 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+int
+bus_context_get_max_messages_per_second (BusContext *context)
+{
+  return context->limits.max_messages_per_second;
+}
+
+int
+bus_context_get_max_message_bytes_per_second (BusContext *context)
+{
+  return context->limits.max_message_bytes_per_second;
+}
+
+int
+bus_context_get_max_messages_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_messages_per_second_per_user;
+}
+
+int
+bus_context_get_max_message_bytes_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_message_bytes_per_second_per_user;
+}
+
+long
+bus_context_get_max_total_message_bytes (BusContext *context)
+{
+  return context->limits.max_total_message_bytes;
+}
+
+long
+bus_context_get_outgoing_bytes_high_watermark (BusContext *context)
+{
+  return context->limits.outgoing_bytes_high_watermark;
+}
+
+long
+bus_context_get_outgoing_bytes_low_watermark (BusContext *context)
+{
+  return context->limits.outgoing_bytes_low_watermark;
+}
+
+long
+bus_context_get_max_lossy_monitor_bytes (BusContext *context)
+{
+  return context->limits.max_lossy_monitor_bytes;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
@@ -1436,7 +1872,21 @@ bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char
 
   va_start (args, msg);
 
-  if (context->log_prefix)
+  if (severity == DBUS_SYSTEM_LOG_SECURITY && context->security_log)
+    {
+      DBusString full_msg;
+
+      if (!_dbus_string_init (&full_msg))
+        goto out;
+
+      if (_dbus_string_append (&full_msg, nonnull (context->log_prefix, "")) &&
+          _dbus_string_append_printf_valist (&full_msg, msg, args))
+        bus_log_queue_push (context->security_log, write_security_log, NULL,
+                            _dbus_string_get_const_data (&full_msg));
+
+      _dbus_string_free (&full_msg);
+    }
+  else if (context->log_prefix)
     {
       DBusString full_msg;
 
@@ -1462,21 +1912,41 @@ out:
   va_end (args);
 }
 
-static inline const char *
-nonnull (const char *maybe_null,
-         const char *if_null)
-{
-  return (maybe_null ? maybe_null : if_null);
-}
-
 void
 bus_context_log_literal (BusContext            *context,
                          DBusSystemLogSeverity  severity,
                          const char            *msg)
 {
+  if (severity == DBUS_SYSTEM_LOG_SECURITY && context->security_log)
+    {
+      DBusString full_msg;
+
+      if (!_dbus_string_init (&full_msg))
+        return;
+
+      if (_dbus_string_append (&full_msg, nonnull (context->log_prefix, "")) &&
+          _dbus_string_append (&full_msg, msg))
+        bus_log_queue_push (context->security_log, write_security_log, NULL,
+                            _dbus_string_get_const_data (&full_msg));
+
+      _dbus_string_free (&full_msg);
+      return;
+    }
+
   _dbus_log (severity, "%s%s", nonnull (context->log_prefix, ""), msg);
 }
 
+/**
+ * Returns the queue that security-related log messages should go
+ * through, so that a flood of them is rate-limited and written from
+ * the main loop rather than while routing a message.
+ */
+BusLogQueue *
+bus_context_get_security_log (BusContext *context)
+{
+  return context->security_log;
+}
+
 void
 bus_context_log_and_set_error (BusContext            *context,
                                DBusSystemLogSeverity  severity,
@@ -1581,6 +2051,59 @@ complain_about_message (BusContext     *context,
  * NULL for addressed_recipient may mean the bus driver, or may mean
  * no destination was specified in the message (e.g. a signal).
  */
+/*
+ * Broadcasts and eavesdropped messages can have many recipients, and
+ * most of them typically share a BusClientPolicy. The verdict only
+ * depends on the policy, the message, who sent it and to whom it was
+ * addressed, so we only need to evaluate each distinct policy once.
+ */
+static dbus_bool_t
+check_can_receive (BusContext      *context,
+                   BusTransaction  *transaction,
+                   BusClientPolicy *recipient_policy,
+                   dbus_bool_t      requested_reply,
+                   DBusConnection  *sender,
+                   DBusConnection  *addressed_recipient,
+                   DBusConnection  *proposed_recipient,
+                   DBusMessage     *message,
+                   dbus_int32_t    *toggles)
+{
+  dbus_bool_t allowed;
+
+  if (transaction == NULL || addressed_recipient == proposed_recipient)
+    return bus_client_policy_check_can_receive (recipient_policy,
+                                                context->registry,
+                                                requested_reply,
+                                                sender,
+                                                addressed_recipient,
+                                                proposed_recipient,
+                                                message, toggles);
+
+  /* only the addressed recipient can have requested a reply */
+  _dbus_assert (!requested_reply);
+
+  if (bus_transaction_get_receive_verdict (transaction, recipient_policy,
+                                           sender, addressed_recipient,
+                                           message, &allowed, toggles))
+    {
+      _dbus_verbose ("  (policy) reusing receive verdict %d\n", allowed);
+      return allowed;
+    }
+
+  allowed = bus_client_policy_check_can_receive (recipient_policy,
+                                                 context->registry,
+                                                 requested_reply,
+                                                 sender,
+                                                 addressed_recipient,
+                                                 proposed_recipient,
+                                                 message, toggles);
+
+  bus_transaction_set_receive_verdict (transaction, recipient_policy,
+                                       sender, addressed_recipient,
+                                       message, allowed, *toggles);
+  return allowed;
+}
+
 dbus_bool_t
 bus_context_check_security_policy (BusContext     *context,
                                    BusTransaction *transaction,
@@ -1624,8 +2147,8 @@ bus_context_check_security_policy (BusContext     *context,
       _dbus_verbose ("security check disallowing message of unknown type %d\n",
                      type);
 
-      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                      "Message bus will not accept messages of unknown type\n");
+      dbus_set_error_const (error, DBUS_ERROR_ACCESS_DENIED,
+                            "Message bus will not accept messages of unknown type\n");
 
       return FALSE;
     }
@@ -1690,6 +2213,8 @@ bus_context_check_security_policy (BusContext     *context,
               _dbus_verbose ("SELinux security check denying send to service\n");
             }
 
+          bus_connection_count_policy_denial (sender);
+          _DBUS_PROBE_MESSAGE (policy__denied, message);
           return FALSE;
         }
 
@@ -1708,7 +2233,11 @@ bus_context_check_security_policy (BusContext     *context,
                                      src ? src : DBUS_SERVICE_DBUS,
                                      activation_entry,
                                      error))
-        return FALSE;
+        {
+          bus_connection_count_policy_denial (sender);
+          _DBUS_PROBE_MESSAGE (policy__denied, message);
+          return FALSE;
+        }
 
       if (!bus_connection_is_active (sender))
         {
@@ -1729,9 +2258,8 @@ bus_context_check_security_policy (BusContext     *context,
               _dbus_verbose ("security check disallowing non-%s message\n",
                              "Hello");
 
-              dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                              "Client tried to send a message other than %s without being registered",
-                              "Hello");
+              dbus_set_error_const (error, DBUS_ERROR_ACCESS_DENIED,
+                                    "Client tried to send a message other than Hello without being registered");
 
               return FALSE;
             }
@@ -1794,6 +2322,8 @@ bus_context_check_security_policy (BusContext     *context,
           message, sender, proposed_recipient, requested_reply,
           (addressed_recipient == proposed_recipient), error);
       _dbus_verbose ("security policy disallowing message due to sender policy\n");
+      bus_connection_count_policy_denial (sender);
+      _DBUS_PROBE_MESSAGE (policy__denied, message);
       return FALSE;
     }
 
@@ -1808,18 +2338,21 @@ bus_context_check_security_policy (BusContext     *context,
     }
 
   if (recipient_policy &&
-      !bus_client_policy_check_can_receive (recipient_policy,
-                                            context->registry,
-                                            requested_reply,
-                                            sender,
-                                            addressed_recipient, proposed_recipient,
-                                            message, &toggles))
+      !check_can_receive (context, transaction, recipient_policy,
+                          requested_reply, sender, addressed_recipient,
+                          proposed_recipient, message, &toggles))
     {
       complain_about_message (context, DBUS_ERROR_ACCESS_DENIED,
           "Rejected receive message", toggles,
           message, sender, proposed_recipient, requested_reply,
           (addressed_recipient == proposed_recipient), error);
       _dbus_verbose ("security policy disallowing message due to recipient policy\n");
+
+      if (sender != NULL)
+        bus_connection_count_policy_denial (sender);
+
+      _DBUS_PROBE_MESSAGE (policy__denied, message);
+
       return FALSE;
     }
 
@@ -1873,6 +2406,10 @@ bus_context_check_all_watches (BusContext *context)
       enabled = FALSE;
     }
 
+  /* New connections wait in the listen backlog for the next instance */
+  if (context->handing_off)
+    enabled = FALSE;
+
   if (context->watches_enabled == enabled)
     return;
 
@@ -1894,6 +2431,124 @@ bus_context_check_all_watches (BusContext *context)
     }
 }
 
+void
+bus_context_set_handing_off (BusContext  *context,
+                             dbus_bool_t  handing_off)
+{
+  context->handing_off = handing_off;
+  bus_context_check_all_watches (context);
+}
+
+#ifdef DBUS_UNIX
+/*
+ * Appends what a new instance of the bus needs to keep listening where
+ * we do, as the bus ID ("ay") followed by an array of "(ssai)" structs:
+ * the address each server was configured with, the address it is
+ * actually listening on including its GUID, and its listening sockets.
+ * The sockets are made to survive exec. Servers whose sockets cannot
+ * be handed over are left out, and the new instance listens afresh.
+ */
+dbus_bool_t
+bus_context_append_handoff (BusContext      *context,
+                            DBusMessageIter *iter)
+{
+  DBusMessageIter array_iter;
+  DBusList *link;
+  const unsigned char *uuid = context->uuid.as_bytes;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &array_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+                                             &uuid, DBUS_UUID_LENGTH_BYTES))
+    {
+      dbus_message_iter_abandon_container (iter, &array_iter);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (iter, &array_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "(ssai)",
+                                         &array_iter))
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (&context->servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->servers, link))
+    {
+      DBusServer *server = link->data;
+      BusServerData *bd = BUS_SERVER_DATA (server);
+      DBusMessageIter struct_iter = DBUS_MESSAGE_ITER_INIT_CLOSED;
+      DBusMessageIter fds_iter = DBUS_MESSAGE_ITER_INIT_CLOSED;
+      const DBusSocket *fds;
+      int n_fds, i;
+      char *listening;
+      dbus_bool_t ok;
+
+      if (bd->address == NULL ||
+          !_dbus_server_socket_get_fds (server, &fds, &n_fds))
+        continue;
+
+      listening = dbus_server_get_address (server);
+
+      if (listening == NULL)
+        goto oom;
+
+      ok = dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter);
+
+      if (ok)
+        {
+          ok = dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                               &bd->address) &&
+            dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                            &listening) &&
+            dbus_message_iter_open_container (&struct_iter, DBUS_TYPE_ARRAY,
+                                              DBUS_TYPE_INT32_AS_STRING,
+                                              &fds_iter);
+
+          for (i = 0; ok && i < n_fds; i++)
+            {
+              dbus_int32_t fd = _dbus_socket_get_int (fds[i]);
+
+              ok = dbus_message_iter_append_basic (&fds_iter, DBUS_TYPE_INT32,
+                                                   &fd);
+            }
+
+          ok = ok && dbus_message_iter_close_container (&struct_iter,
+                                                        &fds_iter);
+          ok = ok && dbus_message_iter_close_container (&array_iter,
+                                                        &struct_iter);
+
+          if (!ok)
+            {
+              dbus_message_iter_abandon_container_if_open (&struct_iter,
+                                                           &fds_iter);
+              dbus_message_iter_abandon_container_if_open (&array_iter,
+                                                           &struct_iter);
+            }
+        }
+
+      dbus_free (listening);
+
+      if (!ok)
+        goto oom;
+
+      for (i = 0; i < n_fds; i++)
+        _dbus_fd_clear_close_on_exec (_dbus_socket_get_int (fds[i]));
+    }
+
+  return dbus_message_iter_close_container (iter, &array_iter);
+
+oom:
+  dbus_message_iter_abandon_container (iter, &array_iter);
+  return FALSE;
+}
+#endif /* DBUS_UNIX */
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 void
 bus_context_quiet_log_begin (BusContext *context)
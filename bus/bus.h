@@ -30,6 +30,8 @@
 #include <dbus/dbus-pipe.h>
 #include <dbus/dbus-sysdeps.h>
 
+#include "log-queue.h"
+
 typedef struct BusActivation    BusActivation;
 typedef struct BusConnections   BusConnections;
 typedef struct BusContext       BusContext;
@@ -46,6 +48,7 @@ typedef struct BusMatchmaker    BusMatchmaker;
 typedef struct BusMatchRule     BusMatchRule;
 typedef struct BusActivationEntry BusActivationEntry;
 typedef struct BusContainers    BusContainers;
+typedef struct BusHandoff       BusHandoff;
 
 typedef struct
 {
@@ -53,6 +56,10 @@ typedef struct
   long max_incoming_unix_fds;       /**< How many incoming message unix fds for a single connection */
   long max_outgoing_bytes;          /**< How many outgoing bytes can be queued for a single connection */
   long max_outgoing_unix_fds;       /**< How many outgoing unix fds can be queued for a single connection */
+  long max_total_message_bytes;     /**< How many message bytes all connections together can have in flight */
+  long outgoing_bytes_high_watermark; /**< Outgoing bytes queued for a connection at which it is reported as slow, or 0 */
+  long outgoing_bytes_low_watermark;  /**< Outgoing bytes queued at which a slow connection is reported as caught up */
+  long max_lossy_monitor_bytes;     /**< How many outgoing bytes can be queued for a lossy monitor before the oldest are dropped */
   long max_message_size;            /**< Max size of a single message in bytes */
   long max_message_unix_fds;        /**< Max number of unix fds of a single message*/
   int activation_timeout;           /**< How long to wait for an activation to time out */
@@ -60,11 +67,17 @@ typedef struct
   int pending_fd_timeout;           /**< How long to wait for a D-Bus message with a fd to time out */
   int max_completed_connections;    /**< Max number of authorized connections */
   int max_incomplete_connections;   /**< Max number of incomplete connections */
+  int max_handshakes_per_iteration; /**< Max listening sockets and incomplete connections handled per main loop iteration, or 0 */
   int max_connections_per_user;     /**< Max number of connections auth'd as same user */
   int max_pending_activations;      /**< Max number of pending activations for the entire bus */
+  long max_pending_activation_bytes; /**< How many message bytes can be queued for a single service being started */
   int max_services_per_connection;  /**< Max number of owned services for a single connection */
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
+  int max_messages_per_second;      /**< Sustained message rate for a single connection, or 0 */
+  int max_message_bytes_per_second; /**< Sustained byte rate for a single connection, or 0 */
+  int max_messages_per_second_per_user;      /**< Sustained message rate for all connections of a user, or 0 */
+  int max_message_bytes_per_second_per_user; /**< Sustained byte rate for all connections of a user, or 0 */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
   int max_containers;               /**< Max number of restricted servers for app-containers */
   int max_containers_per_user;      /**< Max number of restricted servers for app-containers, per user */
@@ -89,10 +102,15 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusPipe         *print_addr_pipe,
                                                                   DBusPipe         *print_pid_pipe,
                                                                   const DBusString *address,
+                                                                  BusHandoff       *handoff,
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
 void              bus_context_shutdown                           (BusContext       *context);
+#ifdef DBUS_UNIX
+DBusConnection*   bus_context_open_in_process_connection         (BusContext       *context,
+                                                                  DBusError        *error);
+#endif
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
 dbus_bool_t       bus_context_get_id                             (BusContext       *context,
@@ -101,6 +119,9 @@ const char*       bus_context_get_type                           (BusContext
 const char*       bus_context_get_address                        (BusContext       *context);
 const char*       bus_context_get_servicehelper                  (BusContext       *context);
 dbus_bool_t       bus_context_get_systemd_activation             (BusContext       *context);
+dbus_bool_t       bus_context_get_normalize_byte_order           (BusContext       *context);
+dbus_bool_t       bus_context_connection_has_priority            (BusContext       *context,
+                                                                  DBusConnection   *connection);
 BusRegistry*      bus_context_get_registry                       (BusContext       *context);
 BusConnections*   bus_context_get_connections                    (BusContext       *context);
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
@@ -123,9 +144,18 @@ int               bus_context_get_max_completed_connections      (BusContext
 int               bus_context_get_max_incomplete_connections     (BusContext       *context);
 int               bus_context_get_max_connections_per_user       (BusContext       *context);
 int               bus_context_get_max_pending_activations        (BusContext       *context);
+long              bus_context_get_max_pending_activation_bytes   (BusContext       *context);
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
+int               bus_context_get_max_messages_per_second        (BusContext       *context);
+int               bus_context_get_max_message_bytes_per_second   (BusContext       *context);
+int               bus_context_get_max_messages_per_second_per_user (BusContext     *context);
+int               bus_context_get_max_message_bytes_per_second_per_user (BusContext *context);
+long              bus_context_get_max_total_message_bytes        (BusContext       *context);
+long              bus_context_get_outgoing_bytes_high_watermark  (BusContext       *context);
+long              bus_context_get_outgoing_bytes_low_watermark   (BusContext       *context);
+long              bus_context_get_max_lossy_monitor_bytes        (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
 int               bus_context_get_max_containers                 (BusContext       *context);
 int               bus_context_get_max_containers_per_user        (BusContext       *context);
@@ -140,6 +170,7 @@ void              bus_context_log                                (BusContext
 void              bus_context_log_literal                        (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   const char       *msg);
+BusLogQueue *     bus_context_get_security_log                   (BusContext       *context);
 void              bus_context_log_and_set_error                  (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   DBusError        *error,
@@ -155,6 +186,10 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   BusActivationEntry *activation_entry,
                                                                   DBusError        *error);
 void              bus_context_check_all_watches                  (BusContext       *context);
+void              bus_context_set_handing_off                    (BusContext       *context,
+                                                                  dbus_bool_t       handing_off);
+dbus_bool_t       bus_context_append_handoff                     (BusContext       *context,
+                                                                  DBusMessageIter  *iter);
 dbus_bool_t       bus_context_setup_server                       (BusContext       *context,
                                                                   DBusServer       *server,
                                                                   DBusError        *error);
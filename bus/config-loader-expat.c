@@ -248,6 +248,14 @@ bus_config_load (const DBusString      *file,
         goto failed;
       }
 
+    /* Stat before reading, so a change made while we read is noticed */
+    if (!bus_config_parser_add_source (parser, file))
+      {
+        _dbus_string_free (&data);
+        dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+        goto failed;
+      }
+
     if (!_dbus_file_get_contents (&data, file, error))
       {
         _dbus_string_free (&data);
@@ -127,6 +127,14 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_ALLOW_ANONYMOUS;
     }
+  else if (strcmp (name, "normalize_byte_order") == 0)
+    {
+      return ELEMENT_NORMALIZE_BYTE_ORDER;
+    }
+  else if (strcmp (name, "priority") == 0)
+    {
+      return ELEMENT_PRIORITY;
+    }
   else if (strcmp (name, "apparmor") == 0)
     {
       return ELEMENT_APPARMOR;
@@ -185,6 +193,10 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "keep_umask";
     case ELEMENT_ALLOW_ANONYMOUS:
       return "allow_anonymous";
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+      return "normalize_byte_order";
+    case ELEMENT_PRIORITY:
+      return "priority";
     case ELEMENT_APPARMOR:
       return "apparmor";
     default:
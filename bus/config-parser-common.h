@@ -50,6 +50,8 @@ typedef enum
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
   ELEMENT_ALLOW_ANONYMOUS,
+  ELEMENT_NORMALIZE_BYTE_ORDER,
+  ELEMENT_PRIORITY,
   ELEMENT_APPARMOR
 } ElementType;
 
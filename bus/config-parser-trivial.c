@@ -205,6 +205,8 @@ bus_config_parser_start_element (BusConfigParser   *parser,
     case ELEMENT_KEEP_UMASK:
     case ELEMENT_SYSLOG:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+    case ELEMENT_PRIORITY:
     case ELEMENT_APPARMOR:
       /* fall through */
     default:
@@ -328,6 +330,8 @@ bus_config_parser_content (BusConfigParser   *parser,
     case ELEMENT_KEEP_UMASK:
     case ELEMENT_SYSLOG:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+    case ELEMENT_PRIORITY:
     case ELEMENT_APPARMOR:
       /* fall through */
     default:
@@ -356,6 +360,14 @@ bus_config_parser_finished (BusConfigParser   *parser,
   return TRUE;
 }
 
+dbus_bool_t
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *filename)
+{
+  /* the activation helper never reloads, so needn't track its sources */
+  return TRUE;
+}
+
 const char*
 bus_config_parser_get_user (BusConfigParser *parser)
 {
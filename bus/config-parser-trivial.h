@@ -55,6 +55,8 @@ dbus_bool_t      bus_config_parser_content       (BusConfigParser   *parser,
                                                   DBusError         *error);
 dbus_bool_t      bus_config_parser_finished      (BusConfigParser   *parser,
                                                   DBusError         *error);
+dbus_bool_t      bus_config_parser_add_source    (BusConfigParser   *parser,
+                                                  const DBusString  *filename);
 
 /* Functions for extracting the parse results */
 const char* bus_config_parser_get_user         (BusConfigParser *parser);
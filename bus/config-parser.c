@@ -24,6 +24,7 @@
 #include <config.h>
 #include "config-parser-common.h"
 #include "config-parser.h"
+#include "intern.h"
 #include "test.h"
 #include "utils.h"
 #include "policy.h"
@@ -80,6 +81,17 @@ typedef struct
 
 } Element;
 
+/**
+ * A file or directory that was read while loading the configuration,
+ * and its state at that time.
+ */
+typedef struct
+{
+  char *path;            /**< Absolute path */
+  unsigned long mtime;   /**< Modification time when it was read */
+  unsigned int exists : 1; /**< FALSE if it was missing and ignored */
+} BusConfigSource;
+
 /**
  * Parser for bus configuration file. 
  */
@@ -109,12 +121,20 @@ struct BusConfigParser
 
   BusLimits limits;      /**< Limits */
 
+  DBusList *priority_uids; /**< Users whose connections get priority */
+
+  DBusList *priority_gids; /**< Groups whose connections get priority */
+
   char *pidfile;         /**< PID file */
 
   DBusList *included_files;  /**< Included files stack */
 
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
 
+  DBusList *sources;     /**< BusConfigSource for each file and directory read */
+
+  long load_time;        /**< Time the top-level file started loading */
+
   unsigned int fork : 1; /**< TRUE to fork into daemon mode */
 
   unsigned int syslog : 1; /**< TRUE to enable syslog */
@@ -123,6 +143,8 @@ struct BusConfigParser
   unsigned int is_toplevel : 1; /**< FALSE if we are a sub-config-file inside another one */
 
   unsigned int allow_anonymous : 1; /**< TRUE to allow anonymous connections */
+
+  unsigned int normalize_byte_order : 1; /**< TRUE to re-encode messages in their recipients' byte order */
 };
 
 static Element*
@@ -259,6 +281,13 @@ bus_config_service_dir_free (BusConfigServiceDir *self)
   dbus_free (self);
 }
 
+static void
+bus_config_source_free (BusConfigSource *source)
+{
+  dbus_free (source->path);
+  dbus_free (source);
+}
+
 static BusConfigServiceDir *
 service_dirs_find_dir (DBusList **service_dirs,
                        const char *dir)
@@ -388,6 +417,9 @@ merge_included (BusConfigParser *parser,
   if (included->allow_anonymous)
     parser->allow_anonymous = TRUE;
 
+  if (included->normalize_byte_order)
+    parser->normalize_byte_order = TRUE;
+
   if (included->pidfile != NULL)
     {
       dbus_free (parser->pidfile);
@@ -405,9 +437,18 @@ merge_included (BusConfigParser *parser,
   while ((link = _dbus_list_pop_first_link (&included->listen_on)))
     _dbus_list_append_link (&parser->listen_on, link);
 
+  while ((link = _dbus_list_pop_first_link (&included->sources)))
+    _dbus_list_append_link (&parser->sources, link);
+
   while ((link = _dbus_list_pop_first_link (&included->mechanisms)))
     _dbus_list_append_link (&parser->mechanisms, link);
 
+  while ((link = _dbus_list_pop_first_link (&included->priority_uids)))
+    _dbus_list_append_link (&parser->priority_uids, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->priority_gids)))
+    _dbus_list_append_link (&parser->priority_gids, link);
+
   while ((link = _dbus_list_pop_first_link (&included->service_dirs)))
     service_dirs_append_link_unique_or_free (&parser->service_dirs, link);
 
@@ -477,9 +518,12 @@ bus_config_parser_new (const DBusString      *basedir,
       /* Use the parent's list of included_files to avoid
 	 circular inclusions. */
       parser->included_files = parent->included_files;
+
+      parser->load_time = parent->load_time;
     }
   else
     {
+      _dbus_get_real_time (&parser->load_time, NULL);
 
       /* Make up some numbers! woot!
        * Please keep these hard-coded values in sync with the comments
@@ -487,6 +531,10 @@ bus_config_parser_new (const DBusString      *basedir,
 
       parser->limits.max_incoming_bytes = _DBUS_ONE_MEGABYTE * 127;
       parser->limits.max_outgoing_bytes = _DBUS_ONE_MEGABYTE * 127;
+      parser->limits.max_total_message_bytes = _DBUS_ONE_MEGABYTE * 512;
+      parser->limits.outgoing_bytes_high_watermark = _DBUS_ONE_MEGABYTE * 16;
+      parser->limits.outgoing_bytes_low_watermark = _DBUS_ONE_MEGABYTE;
+      parser->limits.max_lossy_monitor_bytes = _DBUS_ONE_MEGABYTE * 16;
       parser->limits.max_message_size = _DBUS_ONE_MEGABYTE * 32;
 
       /* We set relatively conservative values here since due to the
@@ -516,6 +564,9 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.pending_fd_timeout = 150000; /* 2.5 minutes */
       
       parser->limits.max_incomplete_connections = 64;
+      /* Enough to get through a login storm in reasonable time without
+       * making established connections wait behind all of it */
+      parser->limits.max_handshakes_per_iteration = 16;
       parser->limits.max_connections_per_user = 256;
       parser->limits.max_containers_per_user = 16;
       
@@ -534,6 +585,7 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.max_container_metadata_bytes = 4096;
       
       parser->limits.max_pending_activations = 512;
+      parser->limits.max_pending_activation_bytes = _DBUS_ONE_MEGABYTE * 64;
       parser->limits.max_services_per_connection = 512;
 
       /* For this one, keep in mind that it isn't only the memory used
@@ -552,6 +604,12 @@ bus_config_parser_new (const DBusString      *basedir,
        * that require a reply
        */
       parser->limits.max_replies_per_connection = 128;
+
+      /* Rates are not limited unless the configuration asks for it */
+      parser->limits.max_messages_per_second = 0;
+      parser->limits.max_message_bytes_per_second = 0;
+      parser->limits.max_messages_per_second_per_user = 0;
+      parser->limits.max_message_bytes_per_second_per_user = 0;
     }
       
   parser->refcount = 1;
@@ -609,6 +667,15 @@ bus_config_parser_unref (BusConfigParser *parser)
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_clear (&parser->priority_uids);
+      _dbus_list_clear (&parser->priority_gids);
+
+      _dbus_list_foreach (&parser->sources,
+                          (DBusForeachFunction) bus_config_source_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->sources);
       
       _dbus_string_free (&parser->basedir);
 
@@ -1018,6 +1085,84 @@ start_busconfig_child (BusConfigParser   *parser,
       parser->allow_anonymous = TRUE;
       return TRUE;
     }
+  else if (element_type == ELEMENT_NORMALIZE_BYTE_ORDER)
+    {
+      if (!check_no_attributes (parser, "normalize_byte_order", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_NORMALIZE_BYTE_ORDER) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->normalize_byte_order = TRUE;
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PRIORITY)
+    {
+      const char *user;
+      const char *group;
+
+      if (!locate_attributes (parser, "priority",
+                              attribute_names,
+                              attribute_values,
+                              error,
+                              "user", &user,
+                              "group", &group,
+                              NULL))
+        return FALSE;
+
+      if ((user == NULL) == (group == NULL))
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "<priority> element must have exactly one of (user|group) attributes");
+          return FALSE;
+        }
+
+      if (push_element (parser, ELEMENT_PRIORITY) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (user != NULL)
+        {
+          DBusString username;
+          unsigned long uid;
+
+          _dbus_string_init_const (&username, user);
+
+          if (!_dbus_parse_unix_user_from_config (&username, &uid))
+            _dbus_warn ("Unknown username \"%s\" in message bus configuration file",
+                        user);
+          else if (!_dbus_list_append (&parser->priority_uids,
+                                       _DBUS_INT_TO_POINTER (uid)))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+      else
+        {
+          DBusString group_name;
+          unsigned long gid;
+
+          _dbus_string_init_const (&group_name, group);
+
+          if (!_dbus_parse_unix_group_from_config (&group_name, &gid))
+            _dbus_warn ("Unknown group \"%s\" in message bus configuration file",
+                        group);
+          else if (!_dbus_list_append (&parser->priority_gids,
+                                       _DBUS_INT_TO_POINTER (gid)))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+
+      return TRUE;
+    }
   else if (element_type == ELEMENT_SERVICEDIR)
     {
       if (!check_no_attributes (parser, "servicedir", attribute_names, attribute_values, error))
@@ -1629,8 +1774,8 @@ append_rule_from_element (BusConfigParser   *parser,
 
       rule->d.send.message_type = message_type;
       rule->d.send.path = _dbus_strdup (send_path);
-      rule->d.send.interface = _dbus_strdup (send_interface);
-      rule->d.send.member = _dbus_strdup (send_member);
+      rule->d.send.interface = bus_intern_string (send_interface);
+      rule->d.send.member = bus_intern_string (send_member);
       rule->d.send.error = _dbus_strdup (send_error);
       rule->d.send.destination = _dbus_strdup (send_destination);
       rule->d.send.max_fds = max_fds;
@@ -1719,8 +1864,8 @@ append_rule_from_element (BusConfigParser   *parser,
       
       rule->d.receive.message_type = message_type;
       rule->d.receive.path = _dbus_strdup (receive_path);
-      rule->d.receive.interface = _dbus_strdup (receive_interface);
-      rule->d.receive.member = _dbus_strdup (receive_member);
+      rule->d.receive.interface = bus_intern_string (receive_interface);
+      rule->d.receive.member = bus_intern_string (receive_member);
       rule->d.receive.error = _dbus_strdup (receive_error);
       rule->d.receive.origin = _dbus_strdup (receive_sender);
       rule->d.receive.max_fds = max_fds;
@@ -2113,6 +2258,26 @@ set_limit (BusConfigParser *parser,
       must_be_positive = TRUE;
       parser->limits.max_outgoing_unix_fds = value;
     }
+  else if (strcmp (name, "max_total_message_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_total_message_bytes = value;
+    }
+  else if (strcmp (name, "outgoing_bytes_high_watermark") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.outgoing_bytes_high_watermark = value;
+    }
+  else if (strcmp (name, "outgoing_bytes_low_watermark") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.outgoing_bytes_low_watermark = value;
+    }
+  else if (strcmp (name, "max_lossy_monitor_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_lossy_monitor_bytes = value;
+    }
   else if (strcmp (name, "max_message_size") == 0)
     {
       must_be_positive = TRUE;
@@ -2159,6 +2324,12 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_incomplete_connections = value;
     }
+  else if (strcmp (name, "max_handshakes_per_iteration") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_handshakes_per_iteration = value;
+    }
   else if (strcmp (name, "max_connections_per_user") == 0)
     {
       must_be_positive = TRUE;
@@ -2171,6 +2342,11 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_pending_activations = value;
     }
+  else if (strcmp (name, "max_pending_service_start_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_pending_activation_bytes = value;
+    }
   else if (strcmp (name, "max_names_per_connection") == 0)
     {
       must_be_positive = TRUE;
@@ -2189,6 +2365,30 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "max_messages_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_second = value;
+    }
+  else if (strcmp (name, "max_message_bytes_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_message_bytes_per_second = value;
+    }
+  else if (strcmp (name, "max_messages_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_second_per_user = value;
+    }
+  else if (strcmp (name, "max_message_bytes_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_message_bytes_per_second_per_user = value;
+    }
   else if (strcmp (name, "max_containers") == 0)
     {
       must_be_positive = TRUE;
@@ -2325,6 +2525,8 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+    case ELEMENT_PRIORITY:
     case ELEMENT_APPARMOR:
       break;
     }
@@ -2416,6 +2618,14 @@ include_file (BusConfigParser   *parser,
           ignore_missing)
         {
           dbus_error_free (&tmp_error);
+
+          /* If it appears later, a reload must notice */
+          if (!bus_config_parser_add_source (parser, filename))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
           return TRUE;
         }
       else
@@ -2494,6 +2704,14 @@ include_dir (BusConfigParser   *parser,
     }
 
   retval = FALSE;
+  dir = NULL;
+
+  /* Adding or removing a file changes the directory's mtime */
+  if (!bus_config_parser_add_source (parser, dirname))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
   
   dir = _dbus_directory_open (dirname, error);
 
@@ -2629,6 +2847,8 @@ bus_config_parser_content (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:    
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:    
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+    case ELEMENT_PRIORITY:
     case ELEMENT_SELINUX:
     case ELEMENT_ASSOCIATE:
     case ELEMENT_APPARMOR:
@@ -2985,6 +3205,24 @@ bus_config_parser_get_allow_anonymous (BusConfigParser   *parser)
   return parser->allow_anonymous;
 }
 
+dbus_bool_t
+bus_config_parser_get_normalize_byte_order (BusConfigParser   *parser)
+{
+  return parser->normalize_byte_order;
+}
+
+DBusList**
+bus_config_parser_get_priority_uids (BusConfigParser   *parser)
+{
+  return &parser->priority_uids;
+}
+
+DBusList**
+bus_config_parser_get_priority_gids (BusConfigParser   *parser)
+{
+  return &parser->priority_gids;
+}
+
 const char *
 bus_config_parser_get_pidfile (BusConfigParser   *parser)
 {
@@ -3078,6 +3316,84 @@ oom:
   return FALSE;
 }
 
+/**
+ * Record that the given file or directory was read (or was looked for
+ * and found to be missing) while loading the configuration, so that
+ * bus_config_parser_sources_unchanged() can check it later.
+ *
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *filename)
+{
+  BusConfigSource *source;
+  DBusStat sb;
+
+  source = dbus_new0 (BusConfigSource, 1);
+  if (source == NULL)
+    return FALSE;
+
+  if (!_dbus_string_copy_data (filename, &source->path))
+    {
+      dbus_free (source);
+      return FALSE;
+    }
+
+  if (_dbus_stat (filename, &sb, NULL))
+    {
+      source->exists = TRUE;
+      source->mtime = sb.mtime;
+    }
+
+  if (!_dbus_list_append (&parser->sources, source))
+    {
+      bus_config_source_free (source);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Check whether loading the configuration again would read exactly the
+ * same files as last time. Every file and directory that was read is
+ * stat()ed again; if any was created, removed or modified, or was
+ * modified in the same second that loading began (so that a later
+ * change in that second would be invisible), this returns #FALSE.
+ *
+ * @returns #TRUE if parsing the configuration again would give the
+ *  same result
+ */
+dbus_bool_t
+bus_config_parser_sources_unchanged (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      BusConfigSource *source = link->data;
+      DBusString path;
+      DBusStat sb;
+      dbus_bool_t exists;
+
+      _dbus_string_init_const (&path, source->path);
+      exists = _dbus_stat (&path, &sb, NULL);
+
+      if (exists != source->exists)
+        return FALSE;
+
+      if (exists &&
+          (sb.mtime != source->mtime ||
+           (long) sb.mtime >= parser->load_time))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include <stdio.h>
 
@@ -3396,6 +3712,8 @@ elements_equal (const Element *a,
     case ELEMENT_KEEP_UMASK:
     case ELEMENT_SYSLOG:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_NORMALIZE_BYTE_ORDER:
+    case ELEMENT_PRIORITY:
     case ELEMENT_APPARMOR:
     default:
       /* do nothing: nothing in the Element struct for these types */
@@ -3448,6 +3766,27 @@ lists_of_c_strings_equal (DBusList *a,
   return ia == NULL && ib == NULL;
 }
 
+static dbus_bool_t
+lists_of_ids_equal (DBusList *a,
+                    DBusList *b)
+{
+  DBusList *ia;
+  DBusList *ib;
+
+  ia = a;
+  ib = b;
+
+  while (ia != NULL && ib != NULL)
+    {
+      if (ia->data != ib->data)
+        return FALSE;
+      ia = _dbus_list_get_next_link (&a, ia);
+      ib = _dbus_list_get_next_link (&b, ib);
+    }
+
+  return ia == NULL && ib == NULL;
+}
+
 static dbus_bool_t
 lists_of_service_dirs_equal (DBusList *a,
                              DBusList *b)
@@ -3485,6 +3824,10 @@ limits_equal (const BusLimits *a,
      || a->max_incoming_unix_fds == b->max_incoming_unix_fds
      || a->max_outgoing_bytes == b->max_outgoing_bytes
      || a->max_outgoing_unix_fds == b->max_outgoing_unix_fds
+     || a->max_total_message_bytes == b->max_total_message_bytes
+     || a->outgoing_bytes_high_watermark == b->outgoing_bytes_high_watermark
+     || a->outgoing_bytes_low_watermark == b->outgoing_bytes_low_watermark
+     || a->max_lossy_monitor_bytes == b->max_lossy_monitor_bytes
      || a->max_message_size == b->max_message_size
      || a->max_message_unix_fds == b->max_message_unix_fds
      || a->activation_timeout == b->activation_timeout
@@ -3492,11 +3835,17 @@ limits_equal (const BusLimits *a,
      || a->pending_fd_timeout == b->pending_fd_timeout
      || a->max_completed_connections == b->max_completed_connections
      || a->max_incomplete_connections == b->max_incomplete_connections
+     || a->max_handshakes_per_iteration == b->max_handshakes_per_iteration
      || a->max_connections_per_user == b->max_connections_per_user
      || a->max_pending_activations == b->max_pending_activations
+     || a->max_pending_activation_bytes == b->max_pending_activation_bytes
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
+     || a->max_messages_per_second == b->max_messages_per_second
+     || a->max_message_bytes_per_second == b->max_message_bytes_per_second
+     || a->max_messages_per_second_per_user == b->max_messages_per_second_per_user
+     || a->max_message_bytes_per_second_per_user == b->max_message_bytes_per_second_per_user
      || a->reply_timeout == b->reply_timeout);
 }
 
@@ -3538,6 +3887,15 @@ config_parsers_equal (const BusConfigParser *a,
   if (! bools_equal (a->keep_umask, b->keep_umask))
     return FALSE;
 
+  if (! bools_equal (a->normalize_byte_order, b->normalize_byte_order))
+    return FALSE;
+
+  if (!lists_of_ids_equal (a->priority_uids, b->priority_uids))
+    return FALSE;
+
+  if (!lists_of_ids_equal (a->priority_gids, b->priority_gids))
+    return FALSE;
+
   if (! bools_equal (a->is_toplevel, b->is_toplevel))
     return FALSE;
 
@@ -4032,6 +4390,129 @@ test_default_system_servicedirs (void)
 }
 #endif
 		   
+static dbus_bool_t
+test_config_sources (const DBusString *test_base_dir)
+{
+  BusConfigParser *parser;
+  BusConfigSource *source;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString full_path;
+  DBusString tmp;
+  DBusList *link;
+  int n_missing = 0;
+
+  if (!_dbus_string_init (&full_path) ||
+      !_dbus_string_copy (test_base_dir, 0, &full_path, 0))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  _dbus_string_init_const (&tmp, "valid-config-files");
+  if (!_dbus_concat_dir_and_file (&full_path, &tmp))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  _dbus_string_init_const (&tmp, "basic.conf");
+  if (!_dbus_concat_dir_and_file (&full_path, &tmp))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_test_fatal ("Failed to load %s: %s",
+                      _dbus_string_get_const_data (&full_path),
+                      error.message);
+
+  /* basic.conf, basic.d and basic.d/basic.conf; and the missing
+   * nonexistent.conf, basic.d/basic.d and basic.d/nonexistent.conf */
+  _dbus_assert (_dbus_list_get_length (&parser->sources) == 6);
+
+  source = _dbus_list_get_first (&parser->sources);
+  _dbus_assert (strcmp (source->path,
+                        _dbus_string_get_const_data (&full_path)) == 0);
+  _dbus_assert (source->exists);
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      BusConfigSource *s = link->data;
+
+      if (!s->exists)
+        n_missing++;
+    }
+
+  _dbus_assert (n_missing == 3);
+
+  /* The test data might have been written in the same second we loaded
+   * it, which counts as changed; pretend we loaded it much later */
+  parser->load_time = _DBUS_INT32_MAX;
+  _dbus_assert (bus_config_parser_sources_unchanged (parser));
+
+  source->mtime -= 1;
+  _dbus_assert (!bus_config_parser_sources_unchanged (parser));
+  source->mtime += 1;
+
+  source->exists = FALSE;
+  _dbus_assert (!bus_config_parser_sources_unchanged (parser));
+  source->exists = TRUE;
+
+  _dbus_assert (bus_config_parser_sources_unchanged (parser));
+
+  parser->load_time = 0;
+  _dbus_assert (!bus_config_parser_sources_unchanged (parser));
+
+  bus_config_parser_unref (parser);
+  _dbus_string_free (&full_path);
+  return TRUE;
+}
+
+#ifndef DBUS_WIN
+/* Checks that <priority> elements end up as lists of IDs */
+static dbus_bool_t
+test_priority (const DBusString *test_base_dir)
+{
+  BusConfigParser *parser;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString full_path;
+  DBusString tmp;
+  DBusList **uids;
+  DBusList **gids;
+  DBusList *link;
+
+  if (!_dbus_string_init (&full_path) ||
+      !_dbus_string_copy (test_base_dir, 0, &full_path, 0))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  _dbus_string_init_const (&tmp, "valid-config-files-system");
+  if (!_dbus_concat_dir_and_file (&full_path, &tmp))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  _dbus_string_init_const (&tmp, "priority.conf");
+  if (!_dbus_concat_dir_and_file (&full_path, &tmp))
+    _dbus_test_fatal ("OOM allocating strings");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_test_fatal ("Failed to load %s: %s",
+                      _dbus_string_get_const_data (&full_path),
+                      error.message);
+
+  /* user="root" and user="0" are both uid 0 */
+  uids = bus_config_parser_get_priority_uids (parser);
+  _dbus_assert (_dbus_list_get_length (uids) == 2);
+
+  for (link = _dbus_list_get_first_link (uids);
+       link != NULL;
+       link = _dbus_list_get_next_link (uids, link))
+    _dbus_assert (_DBUS_POINTER_TO_INT (link->data) == 0);
+
+  gids = bus_config_parser_get_priority_gids (parser);
+  _dbus_assert (_dbus_list_get_length (gids) == 1);
+  _dbus_assert (_DBUS_POINTER_TO_INT (_dbus_list_get_first (gids)) == 0);
+
+  bus_config_parser_unref (parser);
+  _dbus_string_free (&full_path);
+  return TRUE;
+}
+#endif
+
 dbus_bool_t
 bus_config_parser_test (const DBusString *test_data_dir)
 {
@@ -4066,6 +4547,14 @@ bus_config_parser_test (const DBusString *test_data_dir)
   if (!process_test_equiv_subdir (test_data_dir, "equiv-config-files"))
     return FALSE;
 
+  if (!test_config_sources (test_data_dir))
+    return FALSE;
+
+#ifndef DBUS_WIN
+  if (!test_priority (test_data_dir))
+    return FALSE;
+#endif
+
   return TRUE;
 }
 
@@ -56,6 +56,8 @@ dbus_bool_t      bus_config_parser_content       (BusConfigParser   *parser,
                                                   DBusError         *error);
 dbus_bool_t      bus_config_parser_finished      (BusConfigParser   *parser,
                                                   DBusError         *error);
+dbus_bool_t      bus_config_parser_add_source    (BusConfigParser   *parser,
+                                                  const DBusString  *filename);
 
 /* Functions for extracting the parse results */
 const char* bus_config_parser_get_user         (BusConfigParser *parser);
@@ -64,6 +66,9 @@ DBusList**  bus_config_parser_get_addresses    (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_mechanisms   (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_fork         (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_allow_anonymous (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_normalize_byte_order (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_priority_uids (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_priority_gids (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_syslog       (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_keep_umask   (BusConfigParser *parser);
 const char* bus_config_parser_get_pidfile      (BusConfigParser *parser);
@@ -78,6 +83,8 @@ dbus_bool_t bus_config_parser_get_watched_dirs (BusConfigParser  *parser,
 
 DBusHashTable* bus_config_parser_steal_service_context_table (BusConfigParser *parser);
 
+dbus_bool_t bus_config_parser_sources_unchanged (BusConfigParser  *parser);
+
 /* Loader functions (backended off one of the XML parsers).  Returns a
  * finished ConfigParser.
  */
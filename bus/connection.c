@@ -30,13 +30,19 @@
 #include "services.h"
 #include "utils.h"
 #include "signals.h"
+#include "stats.h"
 #include "expirelist.h"
 #include "selinux.h"
 #include "apparmor.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-resources.h>
 #include <dbus/dbus-timeout.h>
+#include <dbus/dbus-watch.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
@@ -44,7 +50,7 @@
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
-typedef struct
+typedef struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -52,9 +58,35 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
+
+  /** Our link in BusConnections::pending_replies */
+  DBusList *expire_link;
+  /** Next pending reply with the same reply_serial for will_get_reply */
+  struct BusPendingReply *next_with_serial;
 } BusPendingReply;
 
+/**
+ * Token buckets for max_messages_per_second and
+ * max_message_bytes_per_second. Each holds at most one second's worth
+ * of its rate, counted in thousandths so that the tokens added over
+ * a few milliseconds are not rounded away.
+ */
+typedef struct
+{
+  dbus_int64_t last_usec; /**< Monotonic time of the last refill */
+  dbus_int64_t messages;  /**< Thousandths of a message that may be sent */
+  dbus_int64_t bytes;     /**< Thousandths of a byte that may be sent */
+  dbus_bool_t primed;     /**< FALSE until the first refill */
+  dbus_bool_t limited;    /**< TRUE if the last message was over the rate */
+} BusRateBuckets;
+
+/** What we track for each UID with completed connections */
+typedef struct
+{
+  int n_connections;
+  BusRateBuckets rate;
+} BusUserData;
+
 struct BusConnections
 {
   int refcount;
@@ -63,13 +95,20 @@ struct BusConnections
   DBusList *incomplete; /**< List of all not-yet-active connections */
   int n_incomplete;     /**< Length of incomplete list */
   BusContext *context;
-  DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
+  DBusHashTable *completed_by_user; /**< #BusUserData for each UID with completed connections */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
-  int stamp;                   /**< Incrementing number */
+  dbus_uint64_t stamp;         /**< Incrementing number */
   BusExpireList *pending_replies; /**< List of pending replies */
+  DBusMemPool *pending_reply_pool; /**< Storage for BusPendingReply */
+  DBusCounter *message_counter; /**< Bytes of every message received and not yet freed */
+  DBusTimeout *watermark_timeout; /**< Rechecks outgoing queues while any is above its high watermark */
+  dbus_bool_t memory_pressure;  /**< TRUE while message_counter exceeds max_total_message_bytes */
 
   /** List of all monitoring connections, a subset of completed.
-   * Each member is a #DBusConnection. */
+   * Each member is a #DBusConnection. While it is empty, capturing a
+   * message for monitors is a single pointer comparison: callers of
+   * bus_transaction_capture() rely on that, and do no monitor-related
+   * work of their own. */
   DBusList *monitors;
   BusMatchmaker *monitor_matchmaker;
 
@@ -81,6 +120,15 @@ struct BusConnections
   int total_bus_names;
   int peak_bus_names;
   int peak_bus_names_per_conn;
+
+  dbus_uint32_t memory_pressure_events;
+  dbus_uint32_t messages_shed;
+  dbus_uint32_t messages_rate_limited;
+
+  BusTrafficStats traffic; /**< Totals over all connections, past and present */
+
+  DBusLatencyHistogram routing_latency; /**< Time from reading a message to queueing it for its recipients */
+  DBusLatencyHistogram closed_queue_latency; /**< Outgoing queue latencies of connections that have gone away */
 #endif
 };
 
@@ -93,12 +141,19 @@ typedef struct
   DBusConnection *connection;
   DBusList *services_owned;
   int n_services_owned;
+  /** BusService => the BusOwner through which this connection owns or
+   * is queued for it, so that the owner can be found without walking
+   * the service's queue. Created when the first name is added. */
+  DBusHashTable *owners_by_service;
   DBusList *match_rules;
   int n_match_rules;
   char *name;
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
+  DBusMessage *reply_template; /**< Header of the driver's method returns to us, once we have a name */
+  DBusMessage *error_template; /**< Header of the driver's last error reply to us */
+  char byte_order; /**< Byte order of the first message it sent us, or 0 if none yet */
   BusClientPolicy *policy;
 
   char *cached_loginfo_string;
@@ -107,17 +162,56 @@ typedef struct
 
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
-  int stamp;               /**< connections->stamp last time we were traversed */
+  dbus_uint64_t stamp;     /**< connections->stamp last time we were traversed */
 
 #ifdef DBUS_ENABLE_STATS
   int peak_match_rules;
   int peak_bus_names;
+  BusTrafficStats traffic;
 #endif
   int n_pending_unix_fds;
   DBusTimeout *pending_unix_fds_timeout;
+  dbus_bool_t above_watermark; /**< Outgoing queue reached outgoing_bytes_high_watermark and has not drained yet */
+
+  /** Pending replies this connection will get, by reply serial; each
+   * value is a chain of #BusPendingReply linked by next_with_serial.
+   * Created when the first reply is expected. */
+  DBusHashTable *pending_replies;
+  int n_pending_replies; /**< Number of entries in pending_replies */
 
   /** non-NULL if and only if this is a monitor */
   DBusList *link_in_monitors;
+  /** If this is a monitor, the flags it passed to BecomeMonitor */
+  dbus_uint32_t monitor_flags;
+  /** Messages to skip before the next one delivered to a sampling monitor */
+  dbus_uint32_t monitor_skip;
+  /** Messages dropped so far for a lossy monitor */
+  dbus_uint32_t monitor_dropped;
+  /** TRUE if monitor_dropped has changed since it was last reported */
+  dbus_bool_t monitor_report_pending;
+  /** TRUE if this connection called AcceptPeerConnections(TRUE) */
+  dbus_bool_t accepts_peer_connections;
+  /** What the main loop was told about our socket: low until the
+   * connection is complete, then high if it matches <priority> */
+  DBusLoopPriority loop_priority;
+  /** Non-NULL if this connection called EnableFlowControl(TRUE);
+   * enabled while a FlowControl signal is owed */
+  DBusTimeout *flow_control_timeout;
+  dbus_bool_t throttled; /**< TRUE if we have stopped reading from it */
+  dbus_bool_t throttled_reported; /**< Last state sent in FlowControl */
+  BusRateBuckets rate;
+  BusUserData *user; /**< Per-UID data, or NULL if not active or no UID */
+  /** Outgoing bytes at which signals to this connection replace older
+   * ones with the same sender, path, interface and member, or 0 */
+  long coalesce_signals_bytes;
+  /** The service this connection last sent a message to, valid while
+   * the registry's owners serial is still last_destination_serial */
+  BusService *last_destination;
+  dbus_uint64_t last_destination_serial;
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint32_t messages_rate_limited;
+  dbus_uint32_t signals_coalesced;
+#endif
 } BusConnectionData;
 
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
@@ -128,6 +222,7 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
                                                  DBusConnection  *connection);
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
+static dbus_bool_t check_watermarks_timeout (void *data);
 
 #define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
 
@@ -147,17 +242,17 @@ static int
 get_connections_for_uid (BusConnections *connections,
                          dbus_uid_t      uid)
 {
-  void *val;
-  int current_count;
+  BusUserData *user;
 
-  /* val is NULL is 0 when it isn't in the hash yet */
-  
-  val = _dbus_hash_table_lookup_uintptr (connections->completed_by_user,
-                                       uid);
+  /* there are no connections when it isn't in the hash yet */
 
-  current_count = _DBUS_POINTER_TO_INT (val);
+  user = _dbus_hash_table_lookup_uintptr (connections->completed_by_user,
+                                          uid);
 
-  return current_count;
+  if (user == NULL)
+    return 0;
+
+  return user->n_connections;
 }
 
 static dbus_bool_t
@@ -186,18 +281,33 @@ adjust_connections_for_uid (BusConnections *connections,
     }
   else
     {
-      dbus_bool_t retval;
-      
-      retval = _dbus_hash_table_insert_uintptr (connections->completed_by_user,
-                                              uid, _DBUS_INT_TO_POINTER (current_count));
+      BusUserData *user;
+
+      user = _dbus_hash_table_lookup_uintptr (connections->completed_by_user,
+                                              uid);
 
       /* only positive adjustment can fail as otherwise
        * a hash entry should already exist
        */
-      _dbus_assert (adjustment > 0 ||
-                    (adjustment <= 0 && retval));
+      if (user == NULL)
+        {
+          _dbus_assert (adjustment > 0);
+
+          user = dbus_new0 (BusUserData, 1);
+
+          if (user == NULL)
+            return FALSE;
 
-      return retval;
+          if (!_dbus_hash_table_insert_uintptr (connections->completed_by_user,
+                                                uid, user))
+            {
+              dbus_free (user);
+              return FALSE;
+            }
+        }
+
+      user->n_connections = current_count;
+      return TRUE;
     }
 }
 
@@ -205,7 +315,6 @@ void
 bus_connection_disconnected (DBusConnection *connection)
 {
   BusConnectionData *d;
-  BusService *service;
   BusMatchmaker *matchmaker;
   
   d = BUS_CONNECTION_DATA (connection);
@@ -214,8 +323,19 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
-  /* Delete our match rules */
-  if (d->n_match_rules > 0)
+#ifdef DBUS_ENABLE_STATS
+    {
+      DBusLatencyHistogram queue_latency;
+
+      _dbus_connection_get_queue_latency (connection, &queue_latency);
+      _dbus_latency_histogram_merge (&d->connections->closed_queue_latency,
+                                     &queue_latency);
+    }
+#endif
+
+  /* Delete our match rules, and other connections' rules that name us
+   * (only possible once we have a unique name) */
+  if (d->name != NULL)
     {
       matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
@@ -227,30 +347,50 @@ bus_connection_disconnected (DBusConnection *connection)
    * disconnecting a client, and preallocating a broadcast "service is
    * now gone" message for every client-service pair seems kind of
    * involved.
+   *
+   * All the names are released in one transaction, so that a client
+   * with many names produces one burst of NameOwnerChanged signals that
+   * are queued back to back, rather than a transaction per name. The
+   * owners stay in services_owned until the transaction is freed, so
+   * we work from a copy. If we run out of memory, the whole batch is
+   * cancelled and retried with whatever is left.
    */
-  while ((service = _dbus_list_get_last (&d->services_owned)))
+  while (d->services_owned != NULL)
     {
       BusTransaction *transaction;
+      DBusList *services;
+      DBusList *link;
       DBusError error;
 
-    retry:
-      
       dbus_error_init (&error);
         
       while ((transaction = bus_transaction_new (d->connections->context)) == NULL)
         _dbus_wait_for_memory ();
-        
-      if (!bus_service_remove_owner (service, connection,
-                                     transaction, &error))
+
+      services = NULL;
+      while (!_dbus_list_copy (&d->services_owned, &services))
+        _dbus_wait_for_memory ();
+
+      /* Last to first, so that the unique name goes last */
+      for (link = _dbus_list_get_last_link (&services);
+           link != NULL;
+           link = _dbus_list_get_prev_link (&services, link))
+        {
+          if (!bus_service_remove_owner (link->data, connection,
+                                         transaction, &error))
+            break;
+        }
+
+      _dbus_list_clear (&services);
+
+      if (dbus_error_is_set (&error))
         {
-          _DBUS_ASSERT_ERROR_IS_SET (&error);
-          
           if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
             {
               dbus_error_free (&error);
               bus_transaction_cancel_and_free (transaction);
               _dbus_wait_for_memory ();
-              goto retry;
+              continue;
             }
           else
             {
@@ -294,6 +434,8 @@ bus_connection_disconnected (DBusConnection *connection)
     }
   d->pending_unix_fds_timeout = NULL;
   _dbus_connection_set_pending_fds_function (connection, NULL, NULL);
+
+  bus_connection_set_flow_control (connection, FALSE);
   
   bus_connection_remove_transactions (connection);
 
@@ -320,6 +462,7 @@ bus_connection_disconnected (DBusConnection *connection)
           _dbus_list_remove_link (&d->connections->completed, d->link_in_connection_list);
           d->link_in_connection_list = NULL;
           d->connections->n_completed -= 1;
+          d->user = NULL;
 
           if (dbus_connection_get_unix_user (connection, &uid))
             {
@@ -358,8 +501,21 @@ add_connection_watch (DBusWatch      *watch,
                       void           *data)
 {
   DBusConnection *connection = data;
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+  DBusLoop *loop = connection_get_loop (connection);
+
+  if (!_dbus_loop_add_watch (loop, watch))
+    return FALSE;
+
+  if (d != NULL && d->loop_priority != DBUS_LOOP_PRIORITY_NORMAL &&
+      !_dbus_loop_set_priority (loop, _dbus_watch_get_pollable (watch),
+                                d->loop_priority))
+    {
+      _dbus_loop_remove_watch (loop, watch);
+      return FALSE;
+    }
 
-  return _dbus_loop_add_watch (connection_get_loop (connection), watch);
+  return TRUE;
 }
 
 static void
@@ -404,11 +560,20 @@ dispatch_status_function (DBusConnection    *connection,
                           void              *data)
 {
   DBusLoop *loop = data;
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
   
   if (new_status != DBUS_DISPATCH_COMPLETE)
     {
-      while (!_dbus_loop_queue_dispatch (loop, connection))
-        _dbus_wait_for_memory ();
+      if (d != NULL && d->loop_priority == DBUS_LOOP_PRIORITY_HIGH)
+        {
+          while (!_dbus_loop_queue_priority_dispatch (loop, connection))
+            _dbus_wait_for_memory ();
+        }
+      else
+        {
+          while (!_dbus_loop_queue_dispatch (loop, connection))
+            _dbus_wait_for_memory ();
+        }
     }
 }
 
@@ -443,11 +608,30 @@ free_connection_data (void *data)
   if (d->oom_message)
     dbus_message_unref (d->oom_message);
 
+  if (d->reply_template)
+    dbus_message_unref (d->reply_template);
+
+  if (d->error_template)
+    dbus_message_unref (d->error_template);
+
   if (d->policy)
     bus_client_policy_unref (d->policy);
 
   if (d->apparmor_confinement)
     bus_apparmor_confinement_unref (d->apparmor_confinement);
+
+  if (d->pending_replies)
+    {
+      /* dropped when we disconnected */
+      _dbus_assert (d->n_pending_replies == 0);
+      _dbus_hash_table_unref (d->pending_replies);
+    }
+
+  if (d->owners_by_service)
+    {
+      _dbus_assert (_dbus_hash_table_get_n_entries (d->owners_by_service) == 0);
+      _dbus_hash_table_unref (d->owners_by_service);
+    }
   
   dbus_free (d->cached_loginfo_string);
   
@@ -469,7 +653,7 @@ bus_connections_new (BusContext *context)
     goto failed_1;
 
   connections->completed_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
-                                                         NULL, NULL);
+                                                         NULL, dbus_free);
   if (connections->completed_by_user == NULL)
     goto failed_2;
 
@@ -487,16 +671,46 @@ bus_connections_new (BusContext *context)
                                                       connections);
   if (connections->pending_replies == NULL)
     goto failed_4;
+
+  connections->pending_reply_pool = _dbus_mem_pool_new (sizeof (BusPendingReply),
+                                                        TRUE);
+  if (connections->pending_reply_pool == NULL)
+    goto failed_5;
+
+  connections->message_counter = _dbus_counter_new ();
+  if (connections->message_counter == NULL)
+    goto failed_6;
+
+  connections->watermark_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                                      check_watermarks_timeout,
+                                                      connections, NULL);
+  if (connections->watermark_timeout == NULL)
+    goto failed_7;
+
+  _dbus_timeout_disable (connections->watermark_timeout);
   
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout))
-    goto failed_5;
+    goto failed_8;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->watermark_timeout))
+    goto failed_9;
   
   connections->refcount = 1;
   connections->context = context;
   
   return connections;
 
+ failed_9:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->expire_timeout);
+ failed_8:
+  _dbus_timeout_unref (connections->watermark_timeout);
+ failed_7:
+  _dbus_counter_unref (connections->message_counter);
+ failed_6:
+  _dbus_mem_pool_free (connections->pending_reply_pool);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
@@ -542,9 +756,6 @@ bus_connections_unref (BusConnections *connections)
 
       _dbus_assert (connections->n_incomplete == 0);
 
-      /* drop all monitors */
-      _dbus_list_clear (&connections->monitors);
-
       /* drop all real connections */
       while (connections->completed != NULL)
         {
@@ -559,13 +770,22 @@ bus_connections_unref (BusConnections *connections)
         }
 
       _dbus_assert (connections->n_completed == 0);
+      /* monitors are completed connections too, and unlink themselves */
+      _dbus_assert (connections->monitors == NULL);
 
       bus_expire_list_free (connections->pending_replies);
+      _dbus_mem_pool_free (connections->pending_reply_pool);
+      _dbus_counter_unref (connections->message_counter);
       
       _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
                                  connections->expire_timeout);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->watermark_timeout);
+
+      _dbus_timeout_unref (connections->watermark_timeout);
       
       _dbus_hash_table_unref (connections->completed_by_user);
 
@@ -751,6 +971,80 @@ pending_unix_fds_timeout_cb (void *data)
   return TRUE;
 }
 
+/* Called from the transport with the connection lock held, so we
+ * only note the change here and send the signal from the main loop.
+ */
+static void
+throttle_changed_cb (void        *data,
+                     dbus_bool_t  throttled)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  d->throttled = throttled;
+
+  if (d->flow_control_timeout != NULL)
+    _dbus_timeout_restart (d->flow_control_timeout, 0);
+}
+
+static dbus_bool_t
+flow_control_timeout_cb (void *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d = BUS_CONNECTION_DATA (connection);
+  BusTransaction *transaction;
+  DBusMessage *message;
+  dbus_bool_t throttled;
+  dbus_uint64_t queued;
+
+  _dbus_assert (d != NULL);
+
+  throttled = d->throttled;
+
+  if (throttled == d->throttled_reported || d->name == NULL)
+    {
+      _dbus_timeout_disable (d->flow_control_timeout);
+      return TRUE;
+    }
+
+  transaction = bus_transaction_new (d->connections->context);
+
+  if (transaction == NULL)
+    return FALSE;
+
+  message = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                     DBUS_INTERFACE_DBUS,
+                                     "FlowControl");
+
+  if (message == NULL)
+    {
+      bus_transaction_cancel_and_free (transaction);
+      return FALSE;
+    }
+
+  queued = _dbus_connection_get_incoming_size (connection);
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BOOLEAN, &throttled,
+                                 DBUS_TYPE_UINT64, &queued,
+                                 DBUS_TYPE_INVALID) ||
+      !bus_transaction_send_from_driver (transaction, connection, message))
+    {
+      dbus_message_unref (message);
+      bus_transaction_cancel_and_free (transaction);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+  bus_transaction_execute_and_free (transaction);
+
+  d->throttled_reported = throttled;
+  _dbus_timeout_disable (d->flow_control_timeout);
+  return TRUE;
+}
+
 dbus_bool_t
 bus_connections_setup_connection (BusConnections *connections,
                                   DBusConnection *connection)
@@ -766,9 +1060,14 @@ bus_connections_setup_connection (BusConnections *connections,
 
   d->connections = connections;
   d->connection = connection;
+
+  /* Authentication and Hello wait for established connections, within
+   * the budget set by max_handshakes_per_iteration */
+  d->loop_priority = DBUS_LOOP_PRIORITY_LOW;
   
-  _dbus_get_monotonic_time (&d->connection_tv_sec,
-                            &d->connection_tv_usec);
+  _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                 &d->connection_tv_sec,
+                                 &d->connection_tv_usec);
   
   _dbus_assert (connection_data_slot >= 0);
   
@@ -961,7 +1260,8 @@ bus_connections_expire_incomplete (BusConnections *connections)
       DBusList *link;
       int auth_timeout;
       
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                     &tv_sec, &tv_usec);
       auth_timeout = bus_context_get_auth_timeout (connections->context);
   
       link = _dbus_list_get_first_link (&connections->incomplete);
@@ -1032,11 +1332,42 @@ bus_connection_get_unix_groups  (DBusConnection   *connection,
                                  int              *n_groups,
                                  DBusError        *error)
 {
+  DBusCredentials *credentials;
+  const dbus_gid_t *gids;
+  size_t n_gids;
   unsigned long uid;
 
   *groups = NULL;
   *n_groups = 0;
 
+  /* Prefer the groups the kernel gave us with the socket credentials
+   * (SO_PEERGROUPS): they are what the peer process really has, and
+   * using them means policy checks never wait for the name service */
+  credentials = _dbus_connection_get_credentials (connection);
+
+  if (credentials != NULL &&
+      _dbus_credentials_get_unix_gids (credentials, &gids, &n_gids))
+    {
+      _DBUS_STATIC_ASSERT (sizeof (dbus_gid_t) == sizeof (unsigned long));
+
+      if (n_gids > 0)
+        {
+          *groups = dbus_new (unsigned long, n_gids);
+
+          if (*groups == NULL)
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
+          memcpy (*groups, gids, n_gids * sizeof (unsigned long));
+        }
+
+      *n_groups = n_gids;
+      _dbus_verbose ("Got %d groups from socket credentials\n", *n_groups);
+      return TRUE;
+    }
+
   if (dbus_connection_get_unix_user (connection, &uid))
     {
       if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
@@ -1197,15 +1528,16 @@ bus_connections_get_context (BusConnections *connections)
 
 /*
  * This is used to avoid covering the same connection twice when
- * traversing connections. Note that it assumes we will
- * bus_connection_mark_stamp() each connection at least once per
- * INT_MAX increments of the global stamp, or wraparound would break
- * things.
+ * traversing connections, in constant time per connection: a
+ * connection has been covered if its stamp equals the global one.
+ * The stamp is 64 bits wide so that it cannot realistically wrap
+ * around and collide with the stale stamp of an idle connection.
  */
 void
 bus_connections_increment_stamp (BusConnections *connections)
 {
   connections->stamp += 1;
+  _dbus_assert (connections->stamp != 0);
 }
 
 /* Mark connection with current stamp, return TRUE if it
@@ -1265,6 +1597,50 @@ bus_connection_get_registry (DBusConnection *connection)
   return bus_context_get_registry (d->connections->context);
 }
 
+/**
+ * Looks up the service that a message from this connection is
+ * addressed to. Connections tend to send many messages in a row to the
+ * same destination, so the last one found is remembered until any
+ * name's owners change, which is also the only way a service can go
+ * away.
+ *
+ * @param connection the sender
+ * @param name the destination
+ * @returns the service, or #NULL if the name has no owner
+ */
+BusService *
+bus_connection_lookup_destination (DBusConnection *connection,
+                                   const char     *name)
+{
+  BusConnectionData *d;
+  BusRegistry *registry;
+  DBusString str;
+  BusService *service;
+  dbus_uint64_t serial;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  registry = bus_context_get_registry (d->connections->context);
+  serial = bus_registry_get_owners_serial (registry);
+
+  if (d->last_destination != NULL &&
+      d->last_destination_serial == serial &&
+      strcmp (bus_service_get_name (d->last_destination), name) == 0)
+    return d->last_destination;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service != NULL)
+    {
+      d->last_destination = service;
+      d->last_destination_serial = serial;
+    }
+
+  return service;
+}
+
 BusActivation*
 bus_connection_get_activation (DBusConnection *connection)
 {
@@ -1493,15 +1869,62 @@ bus_connection_get_n_match_rules (DBusConnection *connection)
   return d->n_match_rules;
 }
 
-void
-bus_connection_add_owned_service_link (DBusConnection *connection,
-                                       DBusList       *link)
+DBusList **
+bus_connection_get_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->match_rules;
+}
+
+/**
+ * Records that the connection owns or is queued for the service,
+ * through the given owner.
+ *
+ * @param connection the connection
+ * @param service the service
+ * @param owner the owner, which must stay valid until it is passed to
+ *  bus_connection_remove_owned_service()
+ * @returns the new link in the connection's list of owned services,
+ *  or #NULL if no memory
+ */
+DBusList *
+bus_connection_add_owned_service (DBusConnection *connection,
+                                  BusService     *service,
+                                  BusOwner       *owner)
 {
   BusConnectionData *d;
+  DBusList *link;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
+  if (d->owners_by_service == NULL)
+    {
+      d->owners_by_service = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                   NULL, NULL);
+      if (d->owners_by_service == NULL)
+        return NULL;
+    }
+
+  link = _dbus_list_alloc_link (service);
+
+  if (link == NULL)
+    return NULL;
+
+  /* If an earlier owner for this service is still alive, it has already
+   * been removed from the service's queue and is only waiting for its
+   * transaction to be freed; the new owner replaces it here. */
+  if (!_dbus_hash_table_insert_uintptr (d->owners_by_service,
+                                        (uintptr_t) service, owner))
+    {
+      _dbus_list_free_link (link);
+      return NULL;
+    }
+
   _dbus_list_append_link (&d->services_owned, link);
 
   d->n_services_owned += 1;
@@ -1515,34 +1938,35 @@ bus_connection_add_owned_service_link (DBusConnection *connection,
   update_peak (&d->connections->peak_bus_names,
                d->connections->total_bus_names);
 #endif
-}
-
-dbus_bool_t
-bus_connection_add_owned_service (DBusConnection *connection,
-                                  BusService     *service)
-{
-  DBusList *link;
-
-  link = _dbus_list_alloc_link (service);
 
-  if (link == NULL)
-    return FALSE;
-
-  bus_connection_add_owned_service_link (connection, link);
-
-  return TRUE;
+  return link;
 }
 
+/**
+ * Undoes bus_connection_add_owned_service().
+ *
+ * @param connection the connection
+ * @param owner the owner that was added
+ * @param link the link that was returned when it was added
+ */
 void
 bus_connection_remove_owned_service (DBusConnection *connection,
-                                     BusService     *service)
+                                     BusOwner       *owner,
+                                     DBusList       *link)
 {
   BusConnectionData *d;
+  uintptr_t key;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
+  _dbus_assert (d->owners_by_service != NULL);
+
+  key = (uintptr_t) link->data;
 
-  _dbus_list_remove_last (&d->services_owned, service);
+  if (_dbus_hash_table_lookup_uintptr (d->owners_by_service, key) == owner)
+    _dbus_hash_table_remove_uintptr (d->owners_by_service, key);
+
+  _dbus_list_remove_link (&d->services_owned, link);
 
   d->n_services_owned -= 1;
   _dbus_assert (d->n_services_owned >= 0);
@@ -1552,6 +1976,30 @@ bus_connection_remove_owned_service (DBusConnection *connection,
 #endif
 }
 
+/**
+ * Finds the most recently added owner through which the connection
+ * owns or is queued for the service.
+ *
+ * @param connection the connection
+ * @param service the service
+ * @returns the owner, or #NULL
+ */
+BusOwner *
+bus_connection_get_owner (DBusConnection *connection,
+                          BusService     *service)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->owners_by_service == NULL)
+    return NULL;
+
+  return _dbus_hash_table_lookup_uintptr (d->owners_by_service,
+                                          (uintptr_t) service);
+}
+
 int
 bus_connection_get_n_services_owned (DBusConnection *connection)
 {
@@ -1563,6 +2011,52 @@ bus_connection_get_n_services_owned (DBusConnection *connection)
   return d->n_services_owned;
 }
 
+/* The returned list of BusService includes names for which @connection is
+ * only queued, not the primary owner. It must not be modified. */
+DBusList **
+bus_connection_get_owned_services (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->services_owned;
+}
+
+/* Give the connection the priority in the main loop that a complete
+ * connection should have according to the bus configuration. Returns
+ * FALSE on OOM. */
+static dbus_bool_t
+update_priority (DBusConnection *connection)
+{
+  BusConnectionData *d;
+  DBusLoopPriority priority;
+  DBusPollable fd;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (bus_context_connection_has_priority (d->connections->context,
+                                           connection))
+    priority = DBUS_LOOP_PRIORITY_HIGH;
+  else
+    priority = DBUS_LOOP_PRIORITY_NORMAL;
+
+  if (priority == d->loop_priority)
+    return TRUE;
+
+  if (_dbus_connection_get_pollable (connection, &fd) &&
+      !_dbus_loop_set_priority (connection_get_loop (connection), fd,
+                                priority))
+    return FALSE;
+
+  _dbus_verbose ("Connection %p now has priority %d\n", connection,
+                 priority);
+  d->loop_priority = priority;
+  return TRUE;
+}
+
 dbus_bool_t
 bus_connection_complete (DBusConnection   *connection,
 			 const DBusString *name,
@@ -1606,6 +2100,9 @@ bus_connection_complete (DBusConnection   *connection,
       d->name = NULL;
       return FALSE;
     }
+
+  if (!update_priority (connection))
+    goto fail;
   
   if (dbus_connection_get_unix_user (connection, &uid))
     {
@@ -1620,6 +2117,10 @@ bus_connection_complete (DBusConnection   *connection,
   if (!cache_peer_loginfo_string (d, connection))
     goto fail;
 
+  if (dbus_connection_get_unix_user (connection, &uid))
+    d->user = _dbus_hash_table_lookup_uintptr (d->connections->completed_by_user,
+                                               uid);
+
   /* Now the connection is active, move it between lists */
   _dbus_list_unlink (&d->connections->incomplete,
                      d->link_in_connection_list);
@@ -1656,6 +2157,7 @@ bus_connections_reload_policy (BusConnections *connections,
                                DBusError      *error)
 {
   BusConnectionData *d;
+  BusClientPolicy *policy;
   DBusConnection *connection;
   DBusList *link;
 
@@ -1671,17 +2173,30 @@ bus_connections_reload_policy (BusConnections *connections,
       _dbus_assert (d != NULL);
       _dbus_assert (d->policy != NULL);
 
-      bus_client_policy_unref (d->policy);
-      d->policy = bus_context_create_client_policy (connections->context,
-                                                    connection,
-                                                    error);
-      if (d->policy == NULL)
+      /* Create the new client policy before dropping the old one: if the
+       * bus policy didn't change, this is usually the same object, and
+       * we don't want to free and rebuild it when its last user lets go.
+       */
+      policy = bus_context_create_client_policy (connections->context,
+                                                 connection,
+                                                 error);
+      if (policy == NULL)
         {
           _dbus_verbose ("Failed to create security policy for connection %p\n",
                       connection);
           _DBUS_ASSERT_ERROR_IS_SET (error);
           return FALSE;
         }
+
+      bus_client_policy_unref (d->policy);
+      d->policy = policy;
+
+      /* <priority> may have changed too */
+      if (!update_priority (connection))
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
     }
 
   return TRUE;
@@ -1698,6 +2213,97 @@ bus_connection_get_name (DBusConnection *connection)
   return d->name;
 }
 
+/**
+ * Creates a reply from the bus driver to a message from this
+ * connection: a method return if error_name is #NULL, or else an error
+ * with that name and no arguments yet. The sender, destination and
+ * NO_REPLY_EXPECTED flag are already what
+ * bus_transaction_send_from_driver() will want.
+ *
+ * Once the connection has a unique name, the header is built once and
+ * kept, and each reply is a copy of it with the reply serial patched
+ * in; one error template is kept too, since a client that gets an
+ * error from us tends to get the same one again.
+ *
+ * @param connection the connection the reply is for
+ * @param in_reply_to the message from it being replied to
+ * @param error_name the error name, or #NULL for a method return
+ * @returns the new reply, or #NULL if no memory
+ */
+DBusMessage *
+bus_connection_new_driver_reply (DBusConnection *connection,
+                                 DBusMessage    *in_reply_to,
+                                 const char     *error_name)
+{
+  BusConnectionData *d;
+  DBusMessage **template_p;
+  DBusMessage *reply;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  /* until Hello, replies have no destination */
+  if (d->name == NULL)
+    {
+      if (error_name == NULL)
+        return dbus_message_new_method_return (in_reply_to);
+      else
+        return dbus_message_new_error (in_reply_to, error_name, NULL);
+    }
+
+  if (error_name == NULL)
+    {
+      template_p = &d->reply_template;
+    }
+  else
+    {
+      template_p = &d->error_template;
+
+      if (*template_p != NULL &&
+          strcmp (dbus_message_get_error_name (*template_p), error_name) != 0)
+        {
+          dbus_message_unref (*template_p);
+          *template_p = NULL;
+        }
+    }
+
+  if (*template_p == NULL)
+    {
+      DBusMessage *template;
+
+      if (error_name == NULL)
+        template = dbus_message_new_method_return (in_reply_to);
+      else
+        template = dbus_message_new_error (in_reply_to, error_name, NULL);
+
+      if (template == NULL)
+        return NULL;
+
+      if (!dbus_message_set_sender (template, DBUS_SERVICE_DBUS) ||
+          !dbus_message_set_destination (template, d->name))
+        {
+          dbus_message_unref (template);
+          return NULL;
+        }
+
+      dbus_message_set_no_reply (template, TRUE);
+      *template_p = template;
+    }
+
+  reply = dbus_message_copy (*template_p);
+  if (reply == NULL)
+    return NULL;
+
+  if (!dbus_message_set_reply_serial (reply,
+                                      dbus_message_get_serial (in_reply_to)))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  return reply;
+}
+
 /**
  * Check whether completing the passed-in connection would
  * exceed limits, and if so set error and return #FALSE
@@ -1722,8 +2328,8 @@ bus_connections_check_limits (BusConnections  *connections,
       if (limit_out != NULL)
         *limit_out = limit;
 
-      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
-                      "The maximum number of active connections has been reached");
+      dbus_set_error_const (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                            "The maximum number of active connections has been reached");
       return FALSE;
     }
   
@@ -1749,8 +2355,114 @@ bus_connections_check_limits (BusConnections  *connections,
   return TRUE;
 }
 
+static BusPendingReply *
+bus_pending_reply_find (BusConnectionData *d,
+                        DBusConnection    *will_send_reply,
+                        dbus_uint32_t      reply_serial)
+{
+  BusPendingReply *pending;
+
+  if (d->pending_replies == NULL)
+    return NULL;
+
+  pending = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                             reply_serial);
+  while (pending != NULL && pending->will_send_reply != will_send_reply)
+    pending = pending->next_with_serial;
+
+  return pending;
+}
+
+static dbus_bool_t
+bus_pending_reply_index (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+  BusPendingReply *first;
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->pending_replies == NULL)
+    {
+      d->pending_replies = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                 NULL, NULL);
+      if (d->pending_replies == NULL)
+        return FALSE;
+    }
+
+  first = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                           pending->reply_serial);
+  if (first != NULL)
+    {
+      /* Same serial, different replier; no allocation needed */
+      pending->next_with_serial = first->next_with_serial;
+      first->next_with_serial = pending;
+    }
+  else if (!_dbus_hash_table_insert_uintptr (d->pending_replies,
+                                             pending->reply_serial,
+                                             pending))
+    {
+      return FALSE;
+    }
+
+  d->n_pending_replies += 1;
+
+  return TRUE;
+}
+
+/* Does nothing if the pending reply was never indexed */
+static void
+bus_pending_reply_unindex (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+  BusPendingReply *first;
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->pending_replies == NULL)
+    return;
+
+  first = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                           pending->reply_serial);
+  if (first == NULL)
+    return;
+
+  if (first == pending)
+    {
+      if (pending->next_with_serial == NULL)
+        {
+          _dbus_hash_table_remove_uintptr (d->pending_replies,
+                                           pending->reply_serial);
+        }
+      /* replacing the value for an existing key doesn't allocate */
+      else if (!_dbus_hash_table_insert_uintptr (d->pending_replies,
+                                                 pending->reply_serial,
+                                                 pending->next_with_serial))
+        {
+          _dbus_assert_not_reached ("replacing a hash value should never fail");
+        }
+    }
+  else
+    {
+      BusPendingReply *prev = first;
+
+      while (prev != NULL && prev->next_with_serial != pending)
+        prev = prev->next_with_serial;
+
+      if (prev == NULL)
+        return;
+
+      prev->next_with_serial = pending->next_with_serial;
+    }
+
+  pending->next_with_serial = NULL;
+  d->n_pending_replies -= 1;
+}
+
 static void
-bus_pending_reply_free (BusPendingReply *pending)
+bus_pending_reply_free (BusConnections  *connections,
+                        BusPendingReply *pending)
 {
   _dbus_verbose ("Freeing pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -1758,7 +2470,9 @@ bus_pending_reply_free (BusPendingReply *pending)
                  pending->will_get_reply,
                  pending->reply_serial);
 
-  dbus_free (pending);
+  bus_pending_reply_unindex (pending);
+
+  _dbus_mem_pool_dealloc (connections->pending_reply_pool, pending);
 }
 
 static dbus_bool_t
@@ -1842,7 +2556,7 @@ bus_pending_reply_expired (BusExpireList *list,
 
   bus_expire_list_remove_link (connections->pending_replies, link);
 
-  bus_pending_reply_free (pending);
+  bus_pending_reply_free (connections, pending);
   bus_transaction_execute_and_free (transaction);
 
   return TRUE;
@@ -1882,7 +2596,7 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
           
           bus_expire_list_remove_link (connections->pending_replies,
                                        link);
-          bus_pending_reply_free (pending);
+          bus_pending_reply_free (connections, pending);
         }
       else if (pending->will_send_reply == connection)
         {
@@ -1896,10 +2610,9 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
                          pending->reply_serial);
           
           pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+          bus_expire_list_expire_link (connections->pending_replies,
+                                       link);
         }
       
       link = next;
@@ -1920,11 +2633,13 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
+  _dbus_assert (bus_expire_list_contains_item (d->connections->pending_replies,
+                                               &d->pending->expire_item));
+
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->expire_link);
 
-  bus_pending_reply_free (d->pending); /* since it's been cancelled */
+  bus_pending_reply_free (d->connections, d->pending); /* since it's been cancelled */
 }
 
 static void
@@ -1953,11 +2668,10 @@ bus_connections_expect_reply (BusConnections  *connections,
                               DBusMessage     *reply_to_this,
                               DBusError       *error)
 {
+  BusConnectionData *d;
   BusPendingReply *pending;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
   int limit;
 
   _dbus_assert (will_get_reply != NULL);
@@ -1969,30 +2683,19 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
-    {
-      pending = link->data;
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
 
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+  if (bus_pending_reply_find (d, will_send_reply, reply_serial) != NULL)
+    {
+      dbus_set_error_const (error, DBUS_ERROR_ACCESS_DENIED,
+                            "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
 
   limit = bus_context_get_max_replies_per_connection (connections->context);
 
-  if (count >= limit)
+  if (d->n_pending_replies >= limit)
     {
       bus_context_log (connections->context, DBUS_SYSTEM_LOG_WARNING,
                        "The maximum number of pending replies for "
@@ -2002,12 +2705,12 @@ bus_connections_expect_reply (BusConnections  *connections,
                        bus_connection_get_loginfo (will_get_reply),
                        limit);
 
-      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
-		      "The maximum number of pending replies per connection has been reached");
+      dbus_set_error_const (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                            "The maximum number of pending replies per connection has been reached");
       return FALSE;
     }
 
-  pending = dbus_new0 (BusPendingReply, 1);
+  pending = _dbus_mem_pool_alloc (connections->pending_reply_pool);
   if (pending == NULL)
     {
       BUS_SET_OOM (error);
@@ -2028,16 +2731,24 @@ bus_connections_expect_reply (BusConnections  *connections,
   if (cprd == NULL)
     {
       BUS_SET_OOM (error);
-      bus_pending_reply_free (pending);
+      bus_pending_reply_free (connections, pending);
+      return FALSE;
+    }
+
+  if (!bus_pending_reply_index (pending))
+    {
+      BUS_SET_OOM (error);
+      dbus_free (cprd);
+      bus_pending_reply_free (connections, pending);
       return FALSE;
     }
   
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+  pending->expire_link = _dbus_list_alloc_link (&pending->expire_item);
+  if (pending->expire_link == NULL)
     {
       BUS_SET_OOM (error);
       dbus_free (cprd);
-      bus_pending_reply_free (pending);
+      bus_pending_reply_free (connections, pending);
       return FALSE;
     }
 
@@ -2047,17 +2758,22 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         cancel_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
+      _dbus_list_free_link (pending->expire_link);
       dbus_free (cprd);
-      bus_pending_reply_free (pending);
+      bus_pending_reply_free (connections, pending);
       return FALSE;
     }
                                         
   cprd->pending = pending;
   cprd->connections = connections;
   
-  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
-                            &pending->expire_item.added_tv_usec);
+  _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                 &pending->expire_item.added_tv_sec,
+                                 &pending->expire_item.added_tv_usec);
+
+  /* This is the newest item, so it goes straight to the end */
+  bus_expire_list_add_link (connections->pending_replies,
+                            pending->expire_link);
 
   _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -2100,7 +2816,7 @@ check_pending_reply_data_free (void *data)
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
       
-      bus_pending_reply_free (pending);
+      bus_pending_reply_free (d->connections, pending);
       _dbus_list_free_link (d->link);
     }
   
@@ -2119,6 +2835,8 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusMessage    *reply,
                              DBusError      *error)
 {
+  BusConnectionData *d;
+  BusPendingReply *pending;
   CheckPendingReplyData *cprd;
   DBusList *link;
   dbus_uint32_t reply_serial;
@@ -2128,30 +2846,25 @@ bus_connections_check_reply (BusConnections *connections,
 
   reply_serial = dbus_message_get_reply_serial (reply);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
+  d = BUS_CONNECTION_DATA (receiving_reply);
+  _dbus_assert (d != NULL);
 
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
+  /* A pending reply stays indexed until it is freed, so one that is
+   * already being replied to in this transaction would be found here
+   * too; only one reply is ever checked per transaction, though. */
+  pending = bus_pending_reply_find (d, sending_reply, reply_serial);
 
-  if (link == NULL)
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+
+  link = pending->expire_link;
+
   cprd = dbus_new0 (CheckPendingReplyData, 1);
   if (cprd == NULL)
     {
@@ -2192,6 +2905,7 @@ typedef struct
   BusTransaction *transaction;
   DBusMessage    *message;
   DBusPreallocatedSend *preallocated;
+  dbus_bool_t     in_arena;
 } MessageToSend;
 
 typedef struct
@@ -2199,15 +2913,97 @@ typedef struct
   BusTransactionCancelFunction cancel_function;
   DBusFreeFunction free_data_function;
   void *data;
+  dbus_bool_t in_arena;
 } CancelHook;
 
+/* Most transactions send one or two messages and add a few cancel hooks,
+ * so we keep that many of each inside the transaction itself */
+#define TRANSACTION_ARENA_SIZE 4
+
+typedef struct
+{
+  BusClientPolicy *policy;
+  dbus_bool_t allowed;
+  dbus_int32_t toggles;
+} ReceiveVerdict;
+
 struct BusTransaction
 {
   DBusList *connections;
   BusContext *context;
   DBusList *cancel_hooks;
+
+  /* Results of bus_client_policy_check_can_receive() for the recipients
+   * of verdicts_message, keyed by BusClientPolicy. They are only valid
+   * for one sender, addressed recipient and set of name owners.
+   */
+  DBusHashTable *verdicts;
+  DBusMessage *verdicts_message;
+  DBusConnection *verdicts_sender;
+  DBusConnection *verdicts_addressed_recipient;
+  dbus_uint64_t verdicts_owners_serial;
+
+  /* With <normalize_byte_order/>, the copy of swapped_original in the
+   * other byte order, so that a signal fanned out to many recipients is
+   * only swapped once. */
+  DBusMessage *swapped_original;
+  DBusMessage *swapped;
+
+  /* Storage for the first MessageToSends and CancelHooks, handed out in
+   * order and never reused, so that it all goes away with the
+   * transaction. Once it runs out we fall back to dbus_new(). */
+  int n_messages_in_arena;
+  int n_hooks_in_arena;
+  MessageToSend message_arena[TRANSACTION_ARENA_SIZE];
+  CancelHook hook_arena[TRANSACTION_ARENA_SIZE];
+
+  /* If TRUE, messages sent in this transaction are discarded, see
+   * bus_transaction_set_quiet() */
+  dbus_bool_t quiet;
 };
 
+static MessageToSend *
+transaction_new_message_to_send (BusTransaction *transaction)
+{
+  MessageToSend *to_send;
+
+  if (transaction->n_messages_in_arena < TRANSACTION_ARENA_SIZE)
+    {
+      to_send = &transaction->message_arena[transaction->n_messages_in_arena];
+      transaction->n_messages_in_arena += 1;
+      to_send->in_arena = TRUE;
+      return to_send;
+    }
+
+  to_send = dbus_new (MessageToSend, 1);
+
+  if (to_send != NULL)
+    to_send->in_arena = FALSE;
+
+  return to_send;
+}
+
+static CancelHook *
+transaction_new_cancel_hook (BusTransaction *transaction)
+{
+  CancelHook *ch;
+
+  if (transaction->n_hooks_in_arena < TRANSACTION_ARENA_SIZE)
+    {
+      ch = &transaction->hook_arena[transaction->n_hooks_in_arena];
+      transaction->n_hooks_in_arena += 1;
+      ch->in_arena = TRUE;
+      return ch;
+    }
+
+  ch = dbus_new (CancelHook, 1);
+
+  if (ch != NULL)
+    ch->in_arena = FALSE;
+
+  return ch;
+}
+
 static void
 message_to_send_free (DBusConnection *connection,
                       MessageToSend  *to_send)
@@ -2218,7 +3014,10 @@ message_to_send_free (DBusConnection *connection,
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  /* a MessageToSend never outlives its transaction, so there is nothing
+   * to do for those in the arena */
+  if (!to_send->in_arena)
+    dbus_free (to_send);
 }
 
 static void
@@ -2242,7 +3041,8 @@ cancel_hook_free (void *element,
   if (ch->free_data_function)
     (* ch->free_data_function) (ch->data);
 
-  dbus_free (ch);
+  if (!ch->in_arena)
+    dbus_free (ch);
 }
 
 static void
@@ -2274,6 +3074,69 @@ bus_transaction_get_context (BusTransaction  *transaction)
   return transaction->context;
 }
 
+/* Makes the transaction discard every message sent in it, while its
+ * other effects still happen. This is for rebuilding state that
+ * the recipients already know about, such as name ownership that was
+ * handed over from a previous instance of the bus. */
+void
+bus_transaction_set_quiet (BusTransaction *transaction,
+                           dbus_bool_t     quiet)
+{
+  transaction->quiet = quiet;
+}
+
+/* A lossy monitor that has fallen behind loses the oldest messages
+ * queued for it, down to half of max_lossy_monitor_bytes so that this
+ * happens in bursts, and is then told how many it has lost. The report
+ * is a running total, because the report itself can be dropped by the
+ * next burst. */
+static dbus_bool_t
+drop_for_lossy_monitor (BusTransaction *transaction,
+                        DBusConnection *monitor)
+{
+  BusConnectionData *d = BUS_CONNECTION_DATA (monitor);
+  DBusMessage *report;
+  long limit;
+  dbus_bool_t ret = FALSE;
+
+  limit = bus_context_get_max_lossy_monitor_bytes (transaction->context);
+
+  if (dbus_connection_get_outgoing_size (monitor) > limit)
+    {
+      int n_dropped = _dbus_connection_drop_outgoing (monitor, limit / 2);
+
+      if (n_dropped > 0)
+        {
+          d->monitor_dropped += n_dropped;
+          d->monitor_report_pending = TRUE;
+        }
+    }
+
+  if (!d->monitor_report_pending)
+    return TRUE;
+
+  report = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                    DBUS_INTERFACE_MONITORING,
+                                    "MessagesDropped");
+
+  if (report == NULL)
+    return FALSE;
+
+  if (!dbus_message_set_sender (report, DBUS_SERVICE_DBUS) ||
+      !dbus_message_append_args (report,
+                                 DBUS_TYPE_UINT32, &d->monitor_dropped,
+                                 DBUS_TYPE_INVALID) ||
+      !bus_transaction_send (transaction, monitor, report))
+    goto out;
+
+  d->monitor_report_pending = FALSE;
+  ret = TRUE;
+
+out:
+  dbus_message_unref (report);
+  return ret;
+}
+
 /**
  * Reserve enough memory to capture the given message if the
  * transaction goes through.
@@ -2288,6 +3151,7 @@ bus_transaction_capture (BusTransaction *transaction,
   BusMatchmaker *mm;
   DBusList *link;
   DBusList *recipients = NULL;
+  DBusMessage *header_copy = NULL;
   dbus_bool_t ret = FALSE;
 
   connections = bus_context_get_connections (transaction->context);
@@ -2310,14 +3174,48 @@ bus_transaction_capture (BusTransaction *transaction,
       link = _dbus_list_get_next_link (&recipients, link))
     {
       DBusConnection *recipient = link->data;
+      BusConnectionData *d = BUS_CONNECTION_DATA (recipient);
+      DBusMessage *captured = message;
+      dbus_uint32_t sample_interval;
+
+      if (d->monitor_skip > 0)
+        {
+          d->monitor_skip--;
+          continue;
+        }
+
+      /* deliver this message, then skip until the next sample */
+      sample_interval = d->monitor_flags >> DBUS_MONITOR_SAMPLE_SHIFT;
+      d->monitor_skip = sample_interval > 1 ? sample_interval - 1 : 0;
+
+      if (d->monitor_flags & DBUS_MONITOR_FLAG_HEADERS_ONLY)
+        {
+          /* shared by all the monitors that only want headers */
+          if (header_copy == NULL)
+            {
+              header_copy = _dbus_message_copy_header (message);
+
+              if (header_copy == NULL)
+                goto out;
+            }
+
+          captured = header_copy;
+        }
+
+      if ((d->monitor_flags & DBUS_MONITOR_FLAG_LOSSY) &&
+          !drop_for_lossy_monitor (transaction, recipient))
+        goto out;
 
-      if (!bus_transaction_send (transaction, recipient, message))
+      if (!bus_transaction_send (transaction, recipient, captured))
         goto out;
     }
 
   ret = TRUE;
 
 out:
+  if (header_copy != NULL)
+    dbus_message_unref (header_copy);
+
   _dbus_list_clear (&recipients);
   return ret;
 }
@@ -2423,6 +3321,34 @@ bus_transaction_send_from_driver (BusTransaction *transaction,
   return bus_transaction_send (transaction, connection, message);
 }
 
+/* Returns a copy of message in byte_order, owned by the transaction.
+ * Messages only come in two byte orders, so one copy per original
+ * is enough. */
+static DBusMessage *
+transaction_get_swapped (BusTransaction *transaction,
+                         DBusMessage    *message,
+                         char            byte_order)
+{
+  DBusMessage *swapped;
+
+  if (transaction->swapped_original == message)
+    return transaction->swapped;
+
+  swapped = _dbus_message_copy_in_byte_order (message, byte_order);
+  if (swapped == NULL)
+    return NULL;
+
+  if (transaction->swapped_original != NULL)
+    dbus_message_unref (transaction->swapped_original);
+
+  if (transaction->swapped != NULL)
+    dbus_message_unref (transaction->swapped);
+
+  transaction->swapped_original = dbus_message_ref (message);
+  transaction->swapped = swapped;
+  return swapped;
+}
+
 dbus_bool_t
 bus_transaction_send (BusTransaction *transaction,
                       DBusConnection *connection,
@@ -2449,20 +3375,34 @@ bus_transaction_send (BusTransaction *transaction,
   
   if (!dbus_connection_get_is_connected (connection))
     return TRUE; /* silently ignore disconnected connections */
+
+  if (transaction->quiet)
+    return TRUE;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
+
+  if (d->byte_order != 0 &&
+      bus_context_get_normalize_byte_order (transaction->context) &&
+      _dbus_message_get_byte_order (message) != d->byte_order &&
+      !dbus_message_contains_unix_fds (message))
+    {
+      message = transaction_get_swapped (transaction, message, d->byte_order);
+      if (message == NULL)
+        return FALSE;
+    }
   
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = transaction_new_message_to_send (transaction);
   if (to_send == NULL)
     {
       return FALSE;
     }
 
+  to_send->message = NULL;
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
     {
-      dbus_free (to_send);
+      message_to_send_free (connection, to_send);
       return FALSE;
     }  
   
@@ -2518,6 +3458,18 @@ transaction_free (BusTransaction *transaction)
 
   free_cancel_hooks (transaction);
 
+  if (transaction->verdicts != NULL)
+    _dbus_hash_table_unref (transaction->verdicts);
+
+  if (transaction->verdicts_message != NULL)
+    dbus_message_unref (transaction->verdicts_message);
+
+  if (transaction->swapped_original != NULL)
+    dbus_message_unref (transaction->swapped_original);
+
+  if (transaction->swapped != NULL)
+    dbus_message_unref (transaction->swapped);
+
   dbus_free (transaction);
 }
 
@@ -2588,12 +3540,39 @@ connection_execute_transaction (DBusConnection *connection,
                                   link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
-          
+
+          if (d->coalesce_signals_bytes > 0 &&
+              dbus_message_get_type (m->message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+              dbus_connection_get_outgoing_size (connection) >=
+              d->coalesce_signals_bytes)
+            {
+              int n_dropped;
+
+              n_dropped = _dbus_connection_drop_superseded_signals (connection,
+                                                                    m->message);
+#ifdef DBUS_ENABLE_STATS
+              d->signals_coalesced += n_dropped;
+#else
+              (void) n_dropped;
+#endif
+            }
+
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
                                              m->message,
                                              NULL);
 
+#ifdef DBUS_ENABLE_STATS
+          {
+            int size = _dbus_message_get_size (m->message);
+
+            d->traffic.messages_sent += 1;
+            d->traffic.bytes_sent += size;
+            d->connections->traffic.messages_sent += 1;
+            d->connections->traffic.bytes_sent += size;
+          }
+#endif
+
           m->preallocated = NULL; /* so we don't double-free it */
           
           message_to_send_free (connection, m);
@@ -2601,6 +3580,18 @@ connection_execute_transaction (DBusConnection *connection,
         
       link = prev;
     }
+
+  /* Reporting the connection as slow means sending signals, which we
+   * can't do in the middle of executing a transaction */
+  if (!d->above_watermark)
+    {
+      long high;
+
+      high = bus_context_get_outgoing_bytes_high_watermark (d->connections->context);
+
+      if (high > 0 && dbus_connection_get_outgoing_size (connection) >= high)
+        _dbus_timeout_restart (d->connections->watermark_timeout, 0);
+    }
 }
 
 void
@@ -2639,11 +3630,127 @@ bus_connection_remove_transactions (DBusConnection *connection)
     }
 }
 
-/**
- * Converts the DBusError to a message reply
- */
-dbus_bool_t
-bus_transaction_send_error_reply (BusTransaction  *transaction,
+static void
+receive_verdict_free (ReceiveVerdict *verdict)
+{
+  if (verdict == NULL)
+    return;
+
+  bus_client_policy_unref (verdict->policy);
+  dbus_free (verdict);
+}
+
+/* Forget the remembered verdicts if they were about a different
+ * delivery, or if a name has changed owner since then, which can
+ * affect receive_sender rules. */
+static void
+transaction_select_verdicts (BusTransaction *transaction,
+                             DBusConnection *sender,
+                             DBusConnection *addressed_recipient,
+                             DBusMessage    *message)
+{
+  dbus_uint64_t serial;
+
+  serial = bus_registry_get_owners_serial (
+      bus_context_get_registry (transaction->context));
+
+  if (transaction->verdicts_message == message &&
+      transaction->verdicts_sender == sender &&
+      transaction->verdicts_addressed_recipient == addressed_recipient &&
+      transaction->verdicts_owners_serial == serial)
+    return;
+
+  if (transaction->verdicts != NULL)
+    _dbus_hash_table_remove_all (transaction->verdicts);
+
+  if (transaction->verdicts_message != NULL)
+    dbus_message_unref (transaction->verdicts_message);
+
+  transaction->verdicts_message = dbus_message_ref (message);
+  transaction->verdicts_sender = sender;
+  transaction->verdicts_addressed_recipient = addressed_recipient;
+  transaction->verdicts_owners_serial = serial;
+}
+
+/*
+ * Look up whether @policy allows one of the recipients other than
+ * @addressed_recipient to receive @message, if a recipient with the
+ * same policy has already been checked during this transaction.
+ */
+dbus_bool_t
+bus_transaction_get_receive_verdict (BusTransaction  *transaction,
+                                     BusClientPolicy *policy,
+                                     DBusConnection  *sender,
+                                     DBusConnection  *addressed_recipient,
+                                     DBusMessage     *message,
+                                     dbus_bool_t     *allowed,
+                                     dbus_int32_t    *toggles)
+{
+  ReceiveVerdict *verdict;
+
+  transaction_select_verdicts (transaction, sender, addressed_recipient,
+                               message);
+
+  if (transaction->verdicts == NULL)
+    return FALSE;
+
+  verdict = _dbus_hash_table_lookup_uintptr (transaction->verdicts,
+                                             (uintptr_t) policy);
+
+  if (verdict == NULL)
+    return FALSE;
+
+  *allowed = verdict->allowed;
+  *toggles = verdict->toggles;
+  return TRUE;
+}
+
+/*
+ * Remember the result of checking @policy for a recipient of @message.
+ * This is only an optimization, so running out of memory is not an
+ * error.
+ */
+void
+bus_transaction_set_receive_verdict (BusTransaction  *transaction,
+                                     BusClientPolicy *policy,
+                                     DBusConnection  *sender,
+                                     DBusConnection  *addressed_recipient,
+                                     DBusMessage     *message,
+                                     dbus_bool_t      allowed,
+                                     dbus_int32_t     toggles)
+{
+  ReceiveVerdict *verdict;
+
+  transaction_select_verdicts (transaction, sender, addressed_recipient,
+                               message);
+
+  if (transaction->verdicts == NULL)
+    {
+      transaction->verdicts = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL,
+          (DBusFreeFunction) receive_verdict_free);
+
+      if (transaction->verdicts == NULL)
+        return;
+    }
+
+  verdict = dbus_new (ReceiveVerdict, 1);
+  if (verdict == NULL)
+    return;
+
+  verdict->policy = bus_client_policy_ref (policy);
+  verdict->allowed = allowed;
+  verdict->toggles = toggles;
+
+  if (!_dbus_hash_table_insert_uintptr (transaction->verdicts,
+                                        (uintptr_t) policy, verdict))
+    receive_verdict_free (verdict);
+}
+
+/**
+ * Converts the DBusError to a message reply
+ */
+dbus_bool_t
+bus_transaction_send_error_reply (BusTransaction  *transaction,
                                   DBusConnection  *connection,
                                   const DBusError *error,
                                   DBusMessage     *in_reply_to)
@@ -2656,12 +3763,20 @@ bus_transaction_send_error_reply (BusTransaction  *transaction,
   _dbus_verbose ("Sending error reply %s \"%s\"\n",
                  error->name, error->message);
 
-  reply = dbus_message_new_error (in_reply_to,
-                                  error->name,
-                                  error->message);
+  reply = bus_connection_new_driver_reply (connection, in_reply_to,
+                                           error->name);
   if (reply == NULL)
     return FALSE;
 
+  if (error->message != NULL &&
+      !dbus_message_append_args (reply,
+                                 DBUS_TYPE_STRING, &error->message,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
   if (!bus_transaction_send_from_driver (transaction, connection, reply))
     {
       dbus_message_unref (reply);
@@ -2681,7 +3796,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
 {
   CancelHook *ch;
 
-  ch = dbus_new (CancelHook, 1);
+  ch = transaction_new_cancel_hook (transaction);
   if (ch == NULL)
     return FALSE;
 
@@ -2697,7 +3812,8 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
    */
   if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
     {
-      dbus_free (ch);
+      ch->free_data_function = NULL;
+      cancel_hook_free (ch, NULL);
       return FALSE;
     }
 
@@ -2716,6 +3832,507 @@ bus_connections_get_n_incomplete (BusConnections *connections)
   return connections->n_incomplete;
 }
 
+/**
+ * Charges a message received from a connection to the bus-wide total,
+ * until the message is freed.
+ *
+ * @param connections the connections object
+ * @param message the message that was just received
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_connections_track_message (BusConnections *connections,
+                               DBusMessage    *message)
+{
+  return _dbus_message_add_counter (message, connections->message_counter);
+}
+
+/**
+ * Counts a message that a connection sent to the bus, in its own
+ * statistics and those of the whole bus.
+ *
+ * @param connection the connection that sent the message
+ * @param message the message
+ */
+void
+bus_connection_count_received (DBusConnection *connection,
+                               DBusMessage    *message)
+{
+#ifdef DBUS_ENABLE_STATS
+  BusConnectionData *d;
+  int size;
+  int i;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  size = _dbus_message_get_size (message);
+
+  for (i = 0; i < 2; i++)
+    {
+      BusTrafficStats *traffic = i == 0 ? &d->traffic : &d->connections->traffic;
+
+      traffic->messages_received += 1;
+      traffic->bytes_received += size;
+
+      switch (dbus_message_get_type (message))
+        {
+          case DBUS_MESSAGE_TYPE_METHOD_CALL:
+            traffic->method_calls_received += 1;
+            break;
+          case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+            traffic->method_returns_received += 1;
+            break;
+          case DBUS_MESSAGE_TYPE_ERROR:
+            traffic->errors_received += 1;
+            break;
+          case DBUS_MESSAGE_TYPE_SIGNAL:
+            traffic->signals_received += 1;
+            break;
+          default:
+            break;
+        }
+    }
+#endif
+}
+
+/**
+ * Counts the connections that a signal from this connection was
+ * delivered to because of their match rules.
+ *
+ * @param connection the connection that sent the signal
+ * @param n_recipients how many connections it was delivered to
+ */
+void
+bus_connection_count_fanned_out (DBusConnection *connection,
+                                 int             n_recipients)
+{
+#ifdef DBUS_ENABLE_STATS
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->traffic.signals_fanned_out += n_recipients;
+  d->connections->traffic.signals_fanned_out += n_recipients;
+#endif
+}
+
+/**
+ * Counts a message from this connection that security policy did not
+ * allow.
+ *
+ * @param connection the connection that sent the message
+ */
+void
+bus_connection_count_policy_denial (DBusConnection *connection)
+{
+#ifdef DBUS_ENABLE_STATS
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->traffic.policy_denials += 1;
+  d->connections->traffic.policy_denials += 1;
+#endif
+}
+
+/**
+ * Counts a message that is being sent to this connection because one
+ * of its match rules matched it.
+ *
+ * @param connection the connection the message is sent to
+ */
+void
+bus_connection_count_match_rule_delivery (DBusConnection *connection)
+{
+#ifdef DBUS_ENABLE_STATS
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->traffic.match_rule_deliveries += 1;
+  d->connections->traffic.match_rule_deliveries += 1;
+#endif
+}
+
+/**
+ * Counts how long the bus took to route a message from this
+ * connection, from reading it to queueing it for all its recipients.
+ *
+ * @param connection the connection that sent the message
+ * @param message the message, which has been routed
+ */
+void
+bus_connection_count_routing_latency (DBusConnection *connection,
+                                      DBusMessage    *message)
+{
+#ifdef DBUS_ENABLE_STATS
+  BusConnectionData *d;
+  dbus_int64_t received;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  received = _dbus_message_get_received_usec (message);
+
+  if (received != 0)
+    _dbus_latency_histogram_add (&d->connections->routing_latency,
+                                 _dbus_get_monotonic_usec () - received);
+#endif
+}
+
+/** How often to recheck queues that are above the high watermark, in ms */
+#define WATERMARK_RECHECK_INTERVAL 250
+
+static void
+report_watermark (BusConnections *connections,
+                  DBusConnection *connection,
+                  dbus_bool_t     above,
+                  long            queued_bytes)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (above)
+    bus_context_log (connections->context, DBUS_SYSTEM_LOG_WARNING,
+        "Connection \"%s\" (%s) is not reading its messages fast enough: "
+        "%ld bytes are queued for it (outgoing_bytes_high_watermark=%ld)",
+        d->name != NULL ? d->name : "(null)",
+        bus_connection_get_loginfo (connection),
+        queued_bytes,
+        bus_context_get_outgoing_bytes_high_watermark (connections->context));
+  else
+    bus_context_log (connections->context, DBUS_SYSTEM_LOG_INFO,
+        "Connection \"%s\" (%s) has caught up: "
+        "%ld bytes are queued for it (outgoing_bytes_low_watermark=%ld)",
+        d->name != NULL ? d->name : "(null)",
+        bus_connection_get_loginfo (connection),
+        queued_bytes,
+        bus_context_get_outgoing_bytes_low_watermark (connections->context));
+
+#ifdef DBUS_ENABLE_STATS
+    {
+      BusTransaction *transaction;
+      DBusError error = DBUS_ERROR_INIT;
+
+      /* The signal is only informational, so if we are out of memory
+       * the log message has to do */
+      transaction = bus_transaction_new (connections->context);
+
+      if (transaction == NULL)
+        return;
+
+      if (bus_stats_send_queue_watermark (connection, above, transaction,
+                                          &error))
+        bus_transaction_execute_and_free (transaction);
+      else
+        bus_transaction_cancel_and_free (transaction);
+
+      dbus_error_free (&error);
+    }
+#endif
+}
+
+/* Crossing the high watermark is noticed when a transaction queues
+ * messages, which schedules this to run straight away. From then on it
+ * polls until every queue above the high watermark has drained to the
+ * low watermark, since draining happens inside libdbus. */
+static dbus_bool_t
+check_watermarks_timeout (void *data)
+{
+  BusConnections *connections = data;
+  DBusList *link;
+  long high, low;
+  dbus_bool_t any_above;
+
+  high = bus_context_get_outgoing_bytes_high_watermark (connections->context);
+  low = bus_context_get_outgoing_bytes_low_watermark (connections->context);
+  any_above = FALSE;
+
+  link = _dbus_list_get_first_link (&connections->completed);
+  while (link != NULL)
+    {
+      DBusConnection *connection = link->data;
+      DBusList *next = _dbus_list_get_next_link (&connections->completed, link);
+      BusConnectionData *d;
+      long queued_bytes;
+
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      queued_bytes = dbus_connection_get_outgoing_size (connection);
+
+      if (!d->above_watermark && high > 0 && queued_bytes >= high)
+        {
+          d->above_watermark = TRUE;
+          report_watermark (connections, connection, TRUE, queued_bytes);
+        }
+      else if (d->above_watermark && queued_bytes <= low)
+        {
+          d->above_watermark = FALSE;
+          report_watermark (connections, connection, FALSE, queued_bytes);
+        }
+
+      if (d->above_watermark)
+        any_above = TRUE;
+
+      link = next;
+    }
+
+  if (any_above)
+    _dbus_timeout_restart (connections->watermark_timeout,
+                           WATERMARK_RECHECK_INTERVAL);
+  else
+    _dbus_timeout_disable (connections->watermark_timeout);
+
+  return TRUE;
+}
+
+/**
+ * Checks the bus-wide total of message bytes against
+ * max_total_message_bytes. While it is over the limit, the bus is in
+ * memory-pressure mode: on entering it we drop what caches we can, and
+ * we refuse new messages from any sender that holds more than an even
+ * share of the limit, which are the ones that got us here.
+ *
+ * @param connections the connections object
+ * @param sender the connection that sent the message being dispatched
+ * @returns #TRUE if the message should be refused
+ */
+dbus_bool_t
+bus_connections_should_shed_message (BusConnections *connections,
+                                     DBusConnection *sender)
+{
+  long limit;
+  long total;
+  long share;
+
+  limit = bus_context_get_max_total_message_bytes (connections->context);
+  total = _dbus_counter_get_size_value (connections->message_counter);
+
+  if (total < limit)
+    {
+      if (connections->memory_pressure)
+        {
+          bus_context_log (connections->context, DBUS_SYSTEM_LOG_INFO,
+                           "Messages use %ld bytes, below "
+                           "max_total_message_bytes=%ld again",
+                           total, limit);
+          connections->memory_pressure = FALSE;
+        }
+
+      return FALSE;
+    }
+
+  if (!connections->memory_pressure)
+    {
+      bus_context_log (connections->context, DBUS_SYSTEM_LOG_WARNING,
+                       "Messages use %ld bytes, exceeding "
+                       "max_total_message_bytes=%ld; refusing messages "
+                       "from the heaviest senders",
+                       total, limit);
+      connections->memory_pressure = TRUE;
+#ifdef DBUS_ENABLE_STATS
+      connections->memory_pressure_events += 1;
+#endif
+
+      _dbus_message_cache_flush ();
+      bus_matchmaker_compact (bus_context_get_matchmaker (connections->context));
+    }
+
+  share = limit / MAX (connections->n_completed, 1);
+
+  if (_dbus_connection_get_incoming_size (sender) <= share)
+    return FALSE;
+
+#ifdef DBUS_ENABLE_STATS
+  connections->messages_shed += 1;
+#endif
+  return TRUE;
+}
+
+static void
+rate_buckets_refill (BusRateBuckets *rate,
+                     dbus_int64_t    now,
+                     int             messages_per_second,
+                     int             bytes_per_second)
+{
+  dbus_int64_t elapsed_ms;
+
+  if (!rate->primed)
+    {
+      rate->messages = (dbus_int64_t) messages_per_second * 1000;
+      rate->bytes = (dbus_int64_t) bytes_per_second * 1000;
+      rate->last_usec = now;
+      rate->primed = TRUE;
+      return;
+    }
+
+  elapsed_ms = (now - rate->last_usec) / 1000;
+
+  if (elapsed_ms <= 0)
+    return;
+
+  /* Only whole milliseconds are used up, so that frequent refills do
+   * not lose the remainder */
+  rate->last_usec += elapsed_ms * 1000;
+
+  /* The buckets are full after a second, whatever the rates */
+  elapsed_ms = MIN (elapsed_ms, 1000);
+
+  rate->messages = MIN (rate->messages + elapsed_ms * messages_per_second,
+                        (dbus_int64_t) messages_per_second * 1000);
+  rate->bytes = MIN (rate->bytes + elapsed_ms * bytes_per_second,
+                     (dbus_int64_t) bytes_per_second * 1000);
+}
+
+/* A message larger than a second's worth of bytes needs a full bucket,
+ * rather than never being allowed at all. */
+static dbus_int64_t
+rate_bytes_cost (int size,
+                 int bytes_per_second)
+{
+  return (dbus_int64_t) MIN (size, bytes_per_second) * 1000;
+}
+
+static dbus_bool_t
+rate_buckets_allow (const BusRateBuckets *rate,
+                    int                   size,
+                    int                   messages_per_second,
+                    int                   bytes_per_second)
+{
+  if (messages_per_second > 0 && rate->messages < 1000)
+    return FALSE;
+
+  if (bytes_per_second > 0 &&
+      rate->bytes < rate_bytes_cost (size, bytes_per_second))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+rate_buckets_take (BusRateBuckets *rate,
+                   int             size,
+                   int             messages_per_second,
+                   int             bytes_per_second)
+{
+  if (messages_per_second > 0)
+    rate->messages -= 1000;
+
+  if (bytes_per_second > 0)
+    rate->bytes -= rate_bytes_cost (size, bytes_per_second);
+}
+
+/* Logs the first message over a limit, and nothing more until the
+ * sender has come back under it */
+static void
+rate_buckets_note (BusRateBuckets *rate,
+                   dbus_bool_t     allowed,
+                   BusContext     *context,
+                   DBusConnection *connection,
+                   const char     *whose,
+                   const char     *limit_names)
+{
+  if (allowed == !rate->limited)
+    return;
+
+  rate->limited = !allowed;
+
+  if (allowed)
+    return;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                   "Connection \"%s\" (%s) is sending faster than %s "
+                   "allows (%s); refusing its method calls and dropping "
+                   "its signals",
+                   bus_connection_get_name (connection),
+                   bus_connection_get_loginfo (connection),
+                   whose, limit_names);
+}
+
+/**
+ * Checks a method call or signal from an active connection against
+ * max_messages_per_second, max_message_bytes_per_second and their
+ * per-user counterparts, and uses up its share of them if it is
+ * within all of them.
+ *
+ * @returns #FALSE if the message should be refused or dropped
+ */
+dbus_bool_t
+bus_connection_check_rate_limits (DBusConnection *connection,
+                                  DBusMessage    *message)
+{
+  BusConnectionData *d;
+  BusContext *context;
+  int messages_per_second, bytes_per_second;
+  int user_messages_per_second, user_bytes_per_second;
+  dbus_int64_t now;
+  dbus_bool_t allowed;
+  int size;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  context = d->connections->context;
+  messages_per_second = bus_context_get_max_messages_per_second (context);
+  bytes_per_second = bus_context_get_max_message_bytes_per_second (context);
+  user_messages_per_second =
+    bus_context_get_max_messages_per_second_per_user (context);
+  user_bytes_per_second =
+    bus_context_get_max_message_bytes_per_second_per_user (context);
+
+  /* The usual case: no rate limits at all, and no clock read */
+  if (messages_per_second == 0 && bytes_per_second == 0 &&
+      user_messages_per_second == 0 && user_bytes_per_second == 0)
+    return TRUE;
+
+  now = _dbus_loop_get_monotonic_usec (bus_context_get_loop (context));
+  size = _dbus_message_get_size (message);
+
+  rate_buckets_refill (&d->rate, now, messages_per_second, bytes_per_second);
+  allowed = rate_buckets_allow (&d->rate, size,
+                                messages_per_second, bytes_per_second);
+  rate_buckets_note (&d->rate, allowed, context, connection,
+                     "its per-connection limit",
+                     "max_messages_per_second, max_message_bytes_per_second");
+
+  if (allowed && d->user != NULL)
+    {
+      rate_buckets_refill (&d->user->rate, now, user_messages_per_second,
+                           user_bytes_per_second);
+      allowed = rate_buckets_allow (&d->user->rate, size,
+                                    user_messages_per_second,
+                                    user_bytes_per_second);
+      rate_buckets_note (&d->user->rate, allowed, context, connection,
+                         "the limit for its user",
+                         "max_messages_per_second_per_user, "
+                         "max_message_bytes_per_second_per_user");
+    }
+
+  if (!allowed)
+    {
+#ifdef DBUS_ENABLE_STATS
+      d->messages_rate_limited += 1;
+      d->connections->messages_rate_limited += 1;
+#endif
+      return FALSE;
+    }
+
+  rate_buckets_take (&d->rate, size, messages_per_second, bytes_per_second);
+
+  if (d->user != NULL)
+    rate_buckets_take (&d->user->rate, size, user_messages_per_second,
+                       user_bytes_per_second);
+
+  return TRUE;
+}
+
 #ifdef DBUS_ENABLE_STATS
 int
 bus_connections_get_total_match_rules (BusConnections *connections)
@@ -2753,6 +4370,81 @@ bus_connections_get_peak_bus_names_per_conn (BusConnections *connections)
   return connections->peak_bus_names_per_conn;
 }
 
+void
+bus_connections_get_memory_pressure_stats (BusConnections *connections,
+                                           dbus_uint32_t  *in_pressure_p,
+                                           dbus_uint32_t  *bytes_p,
+                                           dbus_uint32_t  *peak_bytes_p,
+                                           dbus_uint32_t  *events_p,
+                                           dbus_uint32_t  *shed_p)
+{
+  *in_pressure_p = connections->memory_pressure;
+  *bytes_p = _dbus_counter_get_size_value (connections->message_counter);
+  *peak_bytes_p = _dbus_counter_get_peak_size_value (connections->message_counter);
+  *events_p = connections->memory_pressure_events;
+  *shed_p = connections->messages_shed;
+}
+
+dbus_uint32_t
+bus_connections_get_messages_rate_limited (BusConnections *connections)
+{
+  return connections->messages_rate_limited;
+}
+
+void
+bus_connections_get_pending_reply_pool_stats (BusConnections *connections,
+                                              dbus_uint32_t  *in_use_p,
+                                              dbus_uint32_t  *in_free_list_p,
+                                              dbus_uint32_t  *allocated_p)
+{
+  _dbus_mem_pool_get_stats (connections->pending_reply_pool,
+                            in_use_p, in_free_list_p, allocated_p);
+}
+
+void
+bus_connections_get_traffic_stats (BusConnections  *connections,
+                                   BusTrafficStats *stats)
+{
+  *stats = connections->traffic;
+}
+
+void
+bus_connections_get_routing_latency (BusConnections       *connections,
+                                     DBusLatencyHistogram *histogram)
+{
+  *histogram = connections->routing_latency;
+}
+
+void
+bus_connections_get_queue_latency (BusConnections       *connections,
+                                   DBusLatencyHistogram *histogram)
+{
+  DBusLatencyHistogram queue_latency;
+  DBusList *link;
+
+  *histogram = connections->closed_queue_latency;
+
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      _dbus_connection_get_queue_latency (link->data, &queue_latency);
+      _dbus_latency_histogram_merge (histogram, &queue_latency);
+    }
+}
+
+void
+bus_connection_get_traffic_stats (DBusConnection  *connection,
+                                  BusTrafficStats *stats)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  *stats = d->traffic;
+}
+
 int
 bus_connection_get_peak_match_rules (DBusConnection *connection)
 {
@@ -2774,8 +4466,250 @@ bus_connection_get_peak_bus_names (DBusConnection *connection)
 
   return d->peak_bus_names;
 }
+
+dbus_uint32_t
+bus_connection_get_messages_rate_limited (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->messages_rate_limited;
+}
+
+dbus_uint32_t
+bus_connection_get_signals_coalesced (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->signals_coalesced;
+}
 #endif /* DBUS_ENABLE_STATS */
 
+dbus_bool_t
+bus_connection_get_accepts_peer_connections (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->accepts_peer_connections;
+}
+
+void
+bus_connection_set_accepts_peer_connections (DBusConnection *connection,
+                                             dbus_bool_t     accept)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->accepts_peer_connections = accept;
+}
+
+/**
+ * Sets the number of outgoing bytes queued for this connection above
+ * which a new signal replaces queued signals with the same sender,
+ * path, interface and member, or 0 to always deliver every signal.
+ */
+void
+bus_connection_set_coalesce_signals (DBusConnection *connection,
+                                     long            queued_bytes)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->coalesce_signals_bytes = queued_bytes;
+}
+
+/**
+ * Starts or stops sending FlowControl signals to this connection
+ * when the bus stops and resumes reading from it.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_connection_set_flow_control (DBusConnection *connection,
+                                 dbus_bool_t     enable)
+{
+  BusConnectionData *d;
+  DBusLoop *loop;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  loop = bus_context_get_loop (d->connections->context);
+
+  if (!enable)
+    {
+      _dbus_connection_set_throttle_function (connection, NULL, NULL);
+
+      if (d->flow_control_timeout != NULL)
+        {
+          _dbus_loop_remove_timeout (loop, d->flow_control_timeout);
+          _dbus_timeout_unref (d->flow_control_timeout);
+          d->flow_control_timeout = NULL;
+        }
+
+      return TRUE;
+    }
+
+  if (d->flow_control_timeout != NULL)
+    return TRUE;
+
+  d->flow_control_timeout = _dbus_timeout_new (0, flow_control_timeout_cb,
+                                               connection, NULL);
+
+  if (d->flow_control_timeout == NULL)
+    return FALSE;
+
+  _dbus_timeout_disable (d->flow_control_timeout);
+
+  if (!_dbus_loop_add_timeout (loop, d->flow_control_timeout))
+    {
+      _dbus_timeout_unref (d->flow_control_timeout);
+      d->flow_control_timeout = NULL;
+      return FALSE;
+    }
+
+  d->throttled = FALSE;
+  d->throttled_reported = FALSE;
+  _dbus_connection_set_throttle_function (connection,
+                                          throttle_changed_cb,
+                                          connection);
+  return TRUE;
+}
+
+dbus_bool_t
+bus_connection_get_flow_control (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->flow_control_timeout != NULL;
+}
+
+long
+bus_connection_get_coalesce_signals (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->coalesce_signals_bytes;
+}
+
+/**
+ * Appends the text of each of the connection's match rules to an
+ * array of strings, oldest first.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_connection_append_match_rules (DBusConnection  *connection,
+                                   DBusMessageIter *array_iter)
+{
+  BusConnectionData *d;
+  DBusList *link;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  for (link = _dbus_list_get_first_link (&d->match_rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->match_rules, link))
+    {
+      char *text = bus_match_rule_to_string (link->data);
+      dbus_bool_t ok;
+
+      if (text == NULL)
+        return FALSE;
+
+      ok = dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &text);
+      dbus_free (text);
+
+      if (!ok)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Appends each outstanding method call to an array of structs of
+ * signature "(ssu)": the unique name of the caller, the unique name of
+ * the connection that may reply, and the serial of the call.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_connections_append_pending_replies (BusConnections  *connections,
+                                        DBusMessageIter *array_iter)
+{
+  DBusList *link;
+
+  for (link = bus_expire_list_get_first_link (connections->pending_replies);
+       link != NULL;
+       link = bus_expire_list_get_next_link (connections->pending_replies,
+                                             link))
+    {
+      BusPendingReply *pending = link->data;
+      DBusMessageIter struct_iter;
+      const char *will_get_reply, *will_send_reply;
+
+      will_get_reply = bus_connection_get_name (pending->will_get_reply);
+      will_send_reply = bus_connection_get_name (pending->will_send_reply);
+
+      if (will_get_reply == NULL || will_send_reply == NULL)
+        continue;
+
+      if (!dbus_message_iter_open_container (array_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        return FALSE;
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &will_get_reply) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &will_send_reply) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                           &pending->reply_serial))
+        {
+          dbus_message_iter_abandon_container (array_iter, &struct_iter);
+          return FALSE;
+        }
+
+      if (!dbus_message_iter_close_container (array_iter, &struct_iter))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+void
+bus_connection_note_byte_order (DBusConnection *connection,
+                                DBusMessage    *message)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->byte_order == 0)
+    d->byte_order = _dbus_message_get_byte_order (message);
+}
+
 dbus_bool_t
 bus_connection_is_monitor (DBusConnection *connection)
 {
@@ -2833,6 +4767,7 @@ dbus_bool_t
 bus_connection_be_monitor (DBusConnection  *connection,
                            BusTransaction  *transaction,
                            DBusList       **rules,
+                           dbus_uint32_t    flags,
                            DBusError       *error)
 {
   BusConnectionData *d;
@@ -2904,6 +4839,10 @@ bus_connection_be_monitor (DBusConnection  *connection,
 
   /* flag it as a monitor */
   d->link_in_monitors = link;
+  d->monitor_flags = flags;
+  d->monitor_skip = 0;
+  d->monitor_dropped = 0;
+  d->monitor_report_pending = FALSE;
   _dbus_list_append_link (&d->connections->monitors, link);
 
   /* it isn't allowed to reply, and it is no longer relevant whether it
@@ -31,6 +31,22 @@
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
 
+/** Cumulative message counts for one connection, or for the whole bus */
+typedef struct
+{
+  dbus_uint64_t messages_received;       /**< Messages this connection sent to the bus */
+  dbus_uint64_t bytes_received;          /**< Bytes of messages_received */
+  dbus_uint64_t method_calls_received;   /**< Method calls among messages_received */
+  dbus_uint64_t method_returns_received; /**< Method returns among messages_received */
+  dbus_uint64_t errors_received;         /**< Errors among messages_received */
+  dbus_uint64_t signals_received;        /**< Signals among messages_received */
+  dbus_uint64_t messages_sent;           /**< Messages the bus sent to this connection */
+  dbus_uint64_t bytes_sent;              /**< Bytes of messages_sent */
+  dbus_uint64_t signals_fanned_out;      /**< Match-rule recipients of this connection's signals */
+  dbus_uint64_t policy_denials;          /**< Messages from this connection denied by policy */
+  dbus_uint64_t match_rule_deliveries;   /**< Messages sent to this connection because of its match rules */
+} BusTrafficStats;
+
 
 BusConnections* bus_connections_new               (BusContext                   *context);
 BusConnections* bus_connections_ref               (BusConnections               *connections);
@@ -47,9 +63,13 @@ BusContext*     bus_connections_get_context       (BusConnections
 void            bus_connections_increment_stamp   (BusConnections               *connections);
 dbus_bool_t     bus_connections_reload_policy     (BusConnections               *connections,
                                                    DBusError                    *error);
+dbus_bool_t     bus_connections_append_pending_replies (BusConnections          *connections,
+                                                   DBusMessageIter              *array_iter);
 BusContext*     bus_connection_get_context        (DBusConnection               *connection);
 BusConnections* bus_connection_get_connections    (DBusConnection               *connection);
 BusRegistry*    bus_connection_get_registry       (DBusConnection               *connection);
+BusService*     bus_connection_lookup_destination (DBusConnection               *connection,
+                                                   const char                   *name);
 BusActivation*  bus_connection_get_activation     (DBusConnection               *connection);
 BusMatchmaker*  bus_connection_get_matchmaker     (DBusConnection               *connection);
 const char *    bus_connection_get_loginfo        (DBusConnection        *connection);
@@ -79,6 +99,9 @@ dbus_bool_t     bus_connection_mark_stamp         (DBusConnection
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
+DBusMessage *bus_connection_new_driver_reply (DBusConnection *connection,
+                                              DBusMessage    *in_reply_to,
+                                              const char     *error_name);
 
 dbus_bool_t bus_connection_preallocate_oom_error (DBusConnection *connection);
 void        bus_connection_send_oom_error        (DBusConnection *connection,
@@ -92,15 +115,19 @@ void        bus_connection_add_match_rule_link (DBusConnection *connection,
 void        bus_connection_remove_match_rule   (DBusConnection *connection,
                                                 BusMatchRule   *rule);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+DBusList  **bus_connection_get_match_rules     (DBusConnection *connection);
+DBusList  **bus_connection_get_owned_services  (DBusConnection *connection);
 
 
 /* called by services.c */
-dbus_bool_t bus_connection_add_owned_service      (DBusConnection *connection,
-                                                   BusService     *service);
+DBusList   *bus_connection_add_owned_service      (DBusConnection *connection,
+                                                   BusService     *service,
+                                                   BusOwner       *owner);
 void        bus_connection_remove_owned_service   (DBusConnection *connection,
-                                                   BusService     *service);
-void        bus_connection_add_owned_service_link (DBusConnection *connection,
+                                                   BusOwner       *owner,
                                                    DBusList       *link);
+BusOwner   *bus_connection_get_owner              (DBusConnection *connection,
+                                                   BusService     *service);
 int         bus_connection_get_n_services_owned   (DBusConnection *connection);
 
 /* called by driver.c */
@@ -119,10 +146,25 @@ dbus_bool_t      bus_connection_get_unix_groups  (DBusConnection       *connecti
                                                   DBusError            *error);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
 
+dbus_bool_t bus_connection_get_accepts_peer_connections (DBusConnection *connection);
+void        bus_connection_set_accepts_peer_connections (DBusConnection *connection,
+                                                         dbus_bool_t     accept);
+void        bus_connection_set_coalesce_signals         (DBusConnection *connection,
+                                                         long            queued_bytes);
+dbus_bool_t bus_connection_set_flow_control             (DBusConnection *connection,
+                                                         dbus_bool_t     enable);
+dbus_bool_t bus_connection_get_flow_control             (DBusConnection *connection);
+long        bus_connection_get_coalesce_signals         (DBusConnection *connection);
+dbus_bool_t bus_connection_append_match_rules           (DBusConnection  *connection,
+                                                         DBusMessageIter *array_iter);
+void        bus_connection_note_byte_order              (DBusConnection *connection,
+                                                         DBusMessage    *message);
+
 dbus_bool_t bus_connection_is_monitor (DBusConnection  *connection);
 dbus_bool_t bus_connection_be_monitor (DBusConnection  *connection,
                                        BusTransaction  *transaction,
                                        DBusList       **rules,
+                                       dbus_uint32_t    flags,
                                        DBusError       *error);
 
 /* transaction API so we can send or not send a block of messages as a whole */
@@ -131,6 +173,8 @@ typedef void (* BusTransactionCancelFunction) (void *data);
 
 BusTransaction* bus_transaction_new              (BusContext                   *context);
 BusContext*     bus_transaction_get_context      (BusTransaction               *transaction);
+void            bus_transaction_set_quiet        (BusTransaction               *transaction,
+                                                  dbus_bool_t                   quiet);
 dbus_bool_t     bus_transaction_send             (BusTransaction               *transaction,
                                                   DBusConnection               *connection,
                                                   DBusMessage                  *message);
@@ -155,10 +199,41 @@ dbus_bool_t     bus_transaction_add_cancel_hook  (BusTransaction               *
                                                   BusTransactionCancelFunction  cancel_function,
                                                   void                         *data,
                                                   DBusFreeFunction              free_data_function);
+dbus_bool_t     bus_transaction_get_receive_verdict (BusTransaction            *transaction,
+                                                  BusClientPolicy              *policy,
+                                                  DBusConnection               *sender,
+                                                  DBusConnection               *addressed_recipient,
+                                                  DBusMessage                  *message,
+                                                  dbus_bool_t                  *allowed,
+                                                  dbus_int32_t                 *toggles);
+void            bus_transaction_set_receive_verdict (BusTransaction            *transaction,
+                                                  BusClientPolicy              *policy,
+                                                  DBusConnection               *sender,
+                                                  DBusConnection               *addressed_recipient,
+                                                  DBusMessage                  *message,
+                                                  dbus_bool_t                   allowed,
+                                                  dbus_int32_t                  toggles);
 
 int bus_connections_get_n_active                  (BusConnections *connections);
 int bus_connections_get_n_incomplete              (BusConnections *connections);
 
+dbus_bool_t bus_connections_track_message         (BusConnections *connections,
+                                                   DBusMessage    *message);
+
+/* these do nothing unless DBUS_ENABLE_STATS */
+void bus_connection_count_received                (DBusConnection *connection,
+                                                   DBusMessage    *message);
+void bus_connection_count_fanned_out              (DBusConnection *connection,
+                                                   int             n_recipients);
+void bus_connection_count_policy_denial           (DBusConnection *connection);
+void bus_connection_count_match_rule_delivery     (DBusConnection *connection);
+void bus_connection_count_routing_latency         (DBusConnection *connection,
+                                                   DBusMessage    *message);
+dbus_bool_t bus_connections_should_shed_message   (BusConnections *connections,
+                                                   DBusConnection *sender);
+dbus_bool_t bus_connection_check_rate_limits      (DBusConnection *connection,
+                                                   DBusMessage    *message);
+
 /* called by stats.c, only present if DBUS_ENABLE_STATS */
 int bus_connections_get_total_match_rules         (BusConnections *connections);
 int bus_connections_get_peak_match_rules          (BusConnections *connections);
@@ -166,8 +241,29 @@ int bus_connections_get_peak_match_rules_per_conn (BusConnections *connections);
 int bus_connections_get_total_bus_names           (BusConnections *connections);
 int bus_connections_get_peak_bus_names            (BusConnections *connections);
 int bus_connections_get_peak_bus_names_per_conn   (BusConnections *connections);
+void bus_connections_get_memory_pressure_stats  (BusConnections *connections,
+                                                 dbus_uint32_t  *in_pressure_p,
+                                                 dbus_uint32_t  *bytes_p,
+                                                 dbus_uint32_t  *peak_bytes_p,
+                                                 dbus_uint32_t  *events_p,
+                                                 dbus_uint32_t  *shed_p);
+dbus_uint32_t bus_connections_get_messages_rate_limited (BusConnections *connections);
+void bus_connections_get_pending_reply_pool_stats (BusConnections *connections,
+                                                   dbus_uint32_t  *in_use_p,
+                                                   dbus_uint32_t  *in_free_list_p,
+                                                   dbus_uint32_t  *allocated_p);
+void bus_connections_get_traffic_stats        (BusConnections  *connections,
+                                                BusTrafficStats *stats);
+void bus_connections_get_routing_latency      (BusConnections       *connections,
+                                               DBusLatencyHistogram *histogram);
+void bus_connections_get_queue_latency        (BusConnections       *connections,
+                                               DBusLatencyHistogram *histogram);
 
+void bus_connection_get_traffic_stats         (DBusConnection  *connection,
+                                               BusTrafficStats *stats);
 int bus_connection_get_peak_match_rules           (DBusConnection *connection);
 int bus_connection_get_peak_bus_names             (DBusConnection *connection);
+dbus_uint32_t bus_connection_get_messages_rate_limited (DBusConnection *connection);
+dbus_uint32_t bus_connection_get_signals_coalesced (DBusConnection *connection);
 
 #endif /* BUS_CONNECTION_H */
@@ -57,9 +57,13 @@ typedef struct
   BusContainers *containers;
   DBusServer *server;
   DBusConnection *creator;
+  /* Our link in the creator's BusContainerCreatorData.instances, or NULL
+   * if not in that list */
+  DBusList *creator_link;
   /* List of owned DBusConnection, removed when the DBusConnection is
    * removed from the bus */
   DBusList *connections;
+  int n_connections;
   unsigned long uid;
   unsigned announced:1;
 } BusContainerInstance;
@@ -75,6 +79,16 @@ typedef struct
 /* Data slot on DBusConnection, holding BusContainerCreatorData */
 static dbus_int32_t container_creator_data_slot = -1;
 
+/* Data attached to a DBusConnection that connected to a container
+ * instance's server. */
+typedef struct
+{
+  /* Owned reference */
+  BusContainerInstance *instance;
+  /* Our link in instance->connections, or NULL if not in that list */
+  DBusList *link;
+} BusContainedData;
+
 /*
  * Singleton data structure encapsulating the container-related parts of
  * a BusContext.
@@ -91,7 +105,7 @@ struct BusContainers
   dbus_uint64_t next_container_id;
 };
 
-/* Data slot on DBusConnection, holding BusContainerInstance */
+/* Data slot on DBusConnection, holding BusContainedData */
 static dbus_int32_t contained_data_slot = -1;
 
 BusContainers *
@@ -303,10 +317,18 @@ bus_container_instance_unref (BusContainerInstance *self)
        * BusContainerInstance */
       _dbus_assert (self->connections == NULL);
 
-      creator_data = dbus_connection_get_data (self->creator,
-                                               container_creator_data_slot);
-      _dbus_assert (creator_data != NULL);
-      _dbus_list_remove (&creator_data->instances, self);
+      /* Unlink directly rather than searching the list, so that a
+       * container manager with thousands of instances doesn't pay for
+       * all of them each time one goes away */
+      if (self->creator_link != NULL)
+        {
+          creator_data = dbus_connection_get_data (self->creator,
+                                                   container_creator_data_slot);
+          _dbus_assert (creator_data != NULL);
+          _dbus_list_remove_link (&creator_data->instances,
+                                  self->creator_link);
+          self->creator_link = NULL;
+        }
 
       /* It's OK to do this even if we were never added to instances_by_path,
        * because the paths are globally unique. */
@@ -401,6 +423,7 @@ bus_container_instance_new (BusContext *context,
   self->containers = bus_containers_ref (containers);
   self->server = NULL;
   self->creator = dbus_connection_ref (creator);
+  self->creator_link = NULL;
 
   if (containers->next_container_id >=
       DBUS_UINT64_CONSTANT (0xFFFFFFFFFFFFFFFF))
@@ -470,17 +493,48 @@ allow_same_uid_only (DBusConnection *connection,
   return (uid == (uintptr_t) data);
 }
 
+static void
+bus_contained_data_free (BusContainedData *contained)
+{
+  _dbus_assert (contained->link == NULL);
+  bus_container_instance_unref (contained->instance);
+  dbus_free (contained);
+}
+
+/* Remove connection from instance->connections, if it's there */
+static void
+bus_contained_data_unlink (BusContainedData *contained,
+                           DBusConnection   *connection)
+{
+  BusContainerInstance *instance = contained->instance;
+
+  if (contained->link == NULL)
+    return;
+
+  _dbus_assert (contained->link->data == connection);
+  _dbus_list_remove_link (&instance->connections, contained->link);
+  contained->link = NULL;
+  instance->n_connections -= 1;
+  _dbus_assert (instance->n_connections >= 0);
+  dbus_connection_unref (connection);
+}
+
 static void
 bus_container_instance_lost_connection (BusContainerInstance *instance,
                                         DBusConnection *connection)
 {
+  BusContainedData *contained;
+
   bus_container_instance_ref (instance);
   dbus_connection_ref (connection);
 
-  /* This is O(n), but we don't expect to have many connections per
-   * container instance. */
-  if (_dbus_list_remove (&instance->connections, connection))
-    dbus_connection_unref (connection);
+  contained = dbus_connection_get_data (connection, contained_data_slot);
+
+  if (contained != NULL)
+    {
+      _dbus_assert (contained->instance == instance);
+      bus_contained_data_unlink (contained, connection);
+    }
 
   dbus_connection_set_data (connection, contained_data_slot, NULL, NULL);
 
@@ -494,10 +548,10 @@ new_connection_cb (DBusServer     *server,
                    void           *data)
 {
   BusContainerInstance *instance = data;
+  BusContainedData *contained;
   int limit = bus_context_get_max_connections_per_container (instance->context);
 
-  /* This is O(n), but we assume n is small in practice. */
-  if (_dbus_list_get_length (&instance->connections) >= limit)
+  if (instance->n_connections >= limit)
     {
       /* We can't send this error to the new connection, so just log it */
       bus_context_log (instance->context, DBUS_SYSTEM_LOG_WARNING,
@@ -508,17 +562,31 @@ new_connection_cb (DBusServer     *server,
       return;
     }
 
+  contained = dbus_new0 (BusContainedData, 1);
+
+  if (contained == NULL)
+    {
+      bus_container_instance_lost_connection (instance, new_connection);
+      return;
+    }
+
+  contained->instance = bus_container_instance_ref (instance);
+
   if (!dbus_connection_set_data (new_connection, contained_data_slot,
-                                 bus_container_instance_ref (instance),
-                                 (DBusFreeFunction) bus_container_instance_unref))
+                                 contained,
+                                 (DBusFreeFunction) bus_contained_data_free))
     {
-      bus_container_instance_unref (instance);
+      bus_contained_data_free (contained);
       bus_container_instance_lost_connection (instance, new_connection);
       return;
     }
 
-  if (_dbus_list_append (&instance->connections, new_connection))
+  contained->link = _dbus_list_alloc_link (new_connection);
+
+  if (contained->link != NULL)
     {
+      _dbus_list_append_link (&instance->connections, contained->link);
+      instance->n_connections += 1;
       dbus_connection_ref (new_connection);
     }
   else
@@ -900,9 +968,13 @@ bus_containers_handle_add_server (DBusConnection *connection,
   _dbus_hash_iter_set_value (&n_containers_by_user_entry,
                              (void *) this_user_containers);
 
-  if (!_dbus_list_append (&creator_data->instances, instance))
+  instance->creator_link = _dbus_list_alloc_link (instance);
+
+  if (instance->creator_link == NULL)
     goto oom;
 
+  _dbus_list_append_link (&creator_data->instances, instance->creator_link);
+
   /* This part is separated out because we eventually want to be able to
    * accept a fd-passed server socket in the named parameters, instead of
    * creating our own server, and defer listening on it until later */
@@ -1126,6 +1198,7 @@ bus_containers_handle_get_connection_instance (DBusConnection *caller,
                                                DBusError      *error)
 {
   BusContainerInstance *instance;
+  BusContainedData *contained;
   BusDriverFound found;
   DBusConnection *subject;
   DBusMessage *reply = NULL;
@@ -1154,15 +1227,16 @@ bus_containers_handle_get_connection_instance (DBusConnection *caller,
         goto failed;
     }
 
-  instance = dbus_connection_get_data (subject, contained_data_slot);
+  contained = dbus_connection_get_data (subject, contained_data_slot);
 
-  if (instance == NULL)
+  if (contained == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_NOT_CONTAINER,
                       "Connection '%s' is not in a container", bus_name);
       goto failed;
     }
 
+  instance = contained->instance;
   reply = dbus_message_new_method_return (message);
 
   if (reply == NULL)
@@ -1354,6 +1428,7 @@ bus_containers_remove_connection (BusContainers *self,
 #ifdef DBUS_ENABLE_CONTAINERS
   BusContainerCreatorData *creator_data;
   BusContainerInstance *instance;
+  BusContainedData *contained;
 
   dbus_connection_ref (connection);
   creator_data = dbus_connection_get_data (connection,
@@ -1382,15 +1457,12 @@ bus_containers_remove_connection (BusContainers *self,
         }
     }
 
-  instance = dbus_connection_get_data (connection, contained_data_slot);
+  contained = dbus_connection_get_data (connection, contained_data_slot);
 
-  if (instance != NULL)
+  if (contained != NULL)
     {
-      bus_container_instance_ref (instance);
-
-      if (_dbus_list_remove (&instance->connections, connection))
-        dbus_connection_unref (connection);
-
+      instance = bus_container_instance_ref (contained->instance);
+      bus_contained_data_unlink (contained, connection);
       bus_container_instance_unref (instance);
     }
 
@@ -1405,12 +1477,14 @@ bus_containers_connection_is_contained (DBusConnection *connection,
                                         const char **name)
 {
 #ifdef DBUS_ENABLE_CONTAINERS
-  BusContainerInstance *instance;
+  BusContainedData *contained;
 
-  instance = dbus_connection_get_data (connection, contained_data_slot);
+  contained = dbus_connection_get_data (connection, contained_data_slot);
 
-  if (instance != NULL)
+  if (contained != NULL)
     {
+      BusContainerInstance *instance = contained->instance;
+
       if (path != NULL)
         *path = instance->path;
 
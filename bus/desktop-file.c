@@ -48,6 +48,7 @@ struct BusDesktopFile
   int n_sections;
   BusDesktopFileSection *sections;
   int n_allocated_sections;
+  unsigned long mtime; /**< Modification time of the file when it was read */
 };
 
 /**
@@ -649,6 +650,7 @@ bus_desktop_file_load (DBusString *filename,
       return NULL;
     }
   
+  parser.desktop_file->mtime = sb.mtime;
   parser.data = str;
   parser.line_num = 1;
   parser.pos = 0;
@@ -687,6 +689,20 @@ bus_desktop_file_load (DBusString *filename,
   return parser.desktop_file;
 }
 
+/**
+ * Gets the modification time that the file had when it was loaded,
+ * taken before its contents were read: if the file changes later, it
+ * will look newer than this.
+ *
+ * @param desktop_file the loaded file
+ * @returns the modification time
+ */
+unsigned long
+bus_desktop_file_get_mtime (BusDesktopFile *desktop_file)
+{
+  return desktop_file->mtime;
+}
+
 static BusDesktopFileSection *
 lookup_section (BusDesktopFile *desktop_file,
 		const char     *section_name)
@@ -42,6 +42,7 @@ typedef struct BusDesktopFile BusDesktopFile;
 BusDesktopFile *bus_desktop_file_load (DBusString     *filename,
 				       DBusError      *error);
 void            bus_desktop_file_free (BusDesktopFile *file);
+unsigned long   bus_desktop_file_get_mtime (BusDesktopFile *desktop_file);
 
 dbus_bool_t bus_desktop_file_get_raw    (BusDesktopFile  *desktop_file,
 					 const char      *section_name,
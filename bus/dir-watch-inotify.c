@@ -40,6 +40,7 @@
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps-unix.h>
 #include <dbus/dbus-watch.h>
+#include "activation.h"
 #include "dir-watch.h"
 
 #define MAX_DIRS_TO_WATCH 128
@@ -54,27 +55,69 @@ static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
 
+static const char *
+_find_watched_dir (int wd)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (wds[i] == wd)
+        return dirs[i];
+    }
+
+  return NULL;
+}
+
+/* Returns TRUE if the event needs a full reload */
+static dbus_bool_t
+_handle_inotify_event (BusContext           *context,
+                       struct inotify_event *ev)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  const char *dir;
+  dbus_bool_t handled;
+
+  dir = _find_watched_dir (ev->wd);
+
+  /* We get IN_IGNORED for a watch we removed ourselves during a reload */
+  if (dir == NULL && (ev->mask & IN_IGNORED))
+    return FALSE;
+
+  /* Anything else not about a file in one of our directories, notably
+   * IN_Q_OVERFLOW, means we don't know what changed */
+  if (dir == NULL || ev->len == 0)
+    return TRUE;
+
+  if (!bus_activation_update_service_file (bus_context_get_activation (context),
+                                           dir, ev->name, &handled, &error))
+    {
+      _dbus_verbose ("Unable to update '%s' in '%s': %s\n",
+                     ev->name, dir, error.message);
+      dbus_error_free (&error);
+      return TRUE;
+    }
+
+  /* Not a file in a service directory, or a change that affects other
+   * service files */
+  return !handled;
+}
+
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
 {
+  BusContext *context = data;
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
-#ifdef DBUS_ENABLE_VERBOSE_MODE
+  dbus_bool_t need_reload = FALSE;
   int i = 0;
-#endif
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
   if (ret < 0)
     _dbus_verbose ("Error reading inotify event: '%s'\n", _dbus_strerror(errno));
   else if (!ret)
     _dbus_verbose ("Error reading inotify event: buffer too small\n");
-  else
-    {
-      _dbus_verbose ("Sending SIGHUP signal on reception of %ld inotify event(s)\n", (long) ret);
-      (void) kill (_dbus_getpid (), SIGHUP);
-    }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
   while (i < ret)
     {
       struct inotify_event *ev;
@@ -84,8 +127,18 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
       if (ev->len)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
+
+      /* Once we know we will reload everything, don't bother with the
+       * individual files */
+      if (!need_reload)
+        need_reload = _handle_inotify_event (context, ev);
+    }
+
+  if (need_reload)
+    {
+      _dbus_verbose ("Sending SIGHUP signal on reception of %ld inotify event(s)\n", (long) ret);
+      (void) kill (_dbus_getpid (), SIGHUP);
     }
-#endif
 
   return TRUE;
 }
@@ -247,8 +300,10 @@ _init_inotify (BusContext *context)
       loop = bus_context_get_loop (context);
       _dbus_loop_ref (loop);
 
+      /* Like the loop, this is the first context's: in the dbus-daemon
+       * it is the only one */
       watch = _dbus_watch_new (inotify_fd, DBUS_WATCH_READABLE, TRUE,
-                               _handle_inotify_watch, NULL, NULL);
+                               _handle_inotify_watch, context, NULL);
 
       if (watch == NULL)
         {
@@ -32,10 +32,12 @@
 #include "utils.h"
 #include "bus.h"
 #include "signals.h"
+#include "stats.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-misc.h>
+#include <dbus/dbus-probes-internal.h>
 #include <dbus/dbus-test-tap.h>
 #include <string.h>
 
@@ -116,6 +118,8 @@ send_one_message (DBusConnection *connection,
       return FALSE;
     }
 
+  bus_connection_count_match_rule_delivery (connection);
+
   return TRUE;
 }
 
@@ -186,6 +190,10 @@ bus_dispatch_matches (BusTransaction *transaction,
       return FALSE;
     }
 
+  /* Every recipient queues a reference to the same DBusMessage, which is
+   * locked (so its header and body can no longer change) when the first
+   * of them sends it. The transports write those two buffers directly,
+   * so the message is marshalled once however many recipients it has. */
   link = _dbus_list_get_first_link (&recipients);
   while (link != NULL)
     {
@@ -200,6 +208,13 @@ bus_dispatch_matches (BusTransaction *transaction,
       link = _dbus_list_get_next_link (&recipients, link);
     }
 
+  _DBUS_PROBE_MESSAGE_COUNT (match__results, message,
+                             _dbus_list_get_length (&recipients));
+
+  if (sender != NULL && recipients != NULL &&
+      dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
+    bus_connection_count_fanned_out (sender, _dbus_list_get_length (&recipients));
+
   _dbus_list_clear (&recipients);
 
   if (dbus_error_is_set (&tmp_error))
@@ -240,6 +255,10 @@ bus_dispatch (DBusConnection *connection,
   /* Ref connection in case we disconnect it at some point in here */
   dbus_connection_ref (connection);
 
+  bus_connection_note_byte_order (connection, message);
+
+  _DBUS_PROBE_MESSAGE (dispatch__start, message);
+
   /* Monitors aren't meant to send messages to us. */
   if (bus_connection_is_monitor (connection))
     {
@@ -343,6 +362,19 @@ bus_dispatch (DBusConnection *connection,
         }
     }
 
+  /* Count it towards max_total_message_bytes until it is freed */
+  if (!bus_connections_track_message (bus_connection_get_connections (connection),
+                                      message))
+    {
+      BUS_SET_OOM (&error);
+      goto out;
+    }
+
+  bus_connection_count_received (connection, message);
+#ifdef DBUS_ENABLE_STATS
+  bus_stats_count_message (connection, message);
+#endif
+
   /* Create our transaction */
   transaction = bus_transaction_new (context);
   if (transaction == NULL)
@@ -382,6 +414,53 @@ bus_dispatch (DBusConnection *connection,
    */
   service_name = dbus_message_get_destination (message);
 
+  /* If the bus is short of memory, refuse new work from the connections
+   * responsible. Replies and messages to the bus driver still get through,
+   * so that pending calls can complete and clients can clean up. */
+  if (bus_connection_is_active (connection) &&
+      (service_name == NULL || strcmp (service_name, DBUS_SERVICE_DBUS) != 0) &&
+      (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+       dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL) &&
+      bus_connections_should_shed_message (bus_connection_get_connections (connection),
+                                           connection))
+    {
+      if (!bus_transaction_capture (transaction, connection, NULL, message))
+        {
+          BUS_SET_OOM (&error);
+          goto out;
+        }
+
+      dbus_set_error (&error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Rejected: the bus is short of memory and \"%s\" has "
+                      "too many messages in flight",
+                      bus_connection_get_name (connection));
+      goto out;
+    }
+
+  /* Likewise for connections sending faster than the configured rates;
+   * replies still get through so that calls in progress can complete */
+  if (bus_connection_is_active (connection) &&
+      (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+       dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL) &&
+      !bus_connection_check_rate_limits (connection, message))
+    {
+      if (!bus_transaction_capture (transaction, connection, NULL, message))
+        {
+          BUS_SET_OOM (&error);
+          goto out;
+        }
+
+      /* Nobody is waiting to hear that a signal went nowhere */
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
+        goto out;
+
+      dbus_set_error (&error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Rejected: \"%s\" is sending messages faster than "
+                      "the bus allows",
+                      bus_connection_get_name (connection));
+      goto out;
+    }
+
   if (service_name &&
       strcmp (service_name, DBUS_SERVICE_DBUS) == 0) /* to bus driver */
     {
@@ -417,16 +496,11 @@ bus_dispatch (DBusConnection *connection,
     }
   else if (service_name != NULL) /* route to named service */
     {
-      DBusString service_string;
       BusService *service;
-      BusRegistry *registry;
 
       _dbus_assert (service_name != NULL);
 
-      registry = bus_connection_get_registry (connection);
-
-      _dbus_string_init_const (&service_string, service_name);
-      service = bus_registry_lookup (registry, &service_string);
+      service = bus_connection_lookup_destination (connection, service_name);
 
       if (service == NULL && dbus_message_get_auto_start (message))
         {
@@ -544,8 +618,11 @@ bus_dispatch (DBusConnection *connection,
   if (transaction != NULL)
     {
       bus_transaction_execute_and_free (transaction);
+      bus_connection_count_routing_latency (connection, message);
     }
 
+  _DBUS_PROBE_MESSAGE (dispatch__done, message);
+
   dbus_connection_unref (connection);
 
   return result;
@@ -585,8 +662,6 @@ bus_dispatch_remove_connection (DBusConnection *connection)
 
 #include <stdio.h>
 
-#include "stats.h"
-
 /* This is used to know whether we need to block in order to finish
  * sending a message, or whether the initial dbus_connection_send()
  * already flushed the queue.
@@ -5153,151 +5228,1726 @@ bus_dispatch_sha1_test (const DBusString *test_data_dir)
   return TRUE;
 }
 
-#ifdef HAVE_UNIX_FD_PASSING
+/* Connects a new client to @context, says Hello and matches every
+ * message, like the clients set up by bus_dispatch_test_conf() */
+static DBusConnection *
+open_test_client (BusContext *context)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_test_fatal ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_test_fatal ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_test_fatal ("hello message failed");
+
+  if (!check_add_match (context, connection, ""))
+    _dbus_test_fatal ("AddMatch message failed");
+
+  return connection;
+}
+
+/* Sends @message, a method call to the bus driver, from @connection
+ * and returns the reply, which must be the next message it receives */
+static DBusMessage *
+call_bus_method (BusContext     *context,
+                 DBusConnection *connection,
+                 DBusMessage    *message)
+{
+  DBusMessage *reply;
+  dbus_uint32_t serial;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    _dbus_test_fatal ("no memory to send %s",
+                      dbus_message_get_member (message));
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection,
+                                           dbus_message_get_member (message));
+  reply = pop_message_waiting_for_memory (connection);
+
+  if (reply == NULL)
+    _dbus_test_fatal ("no reply to %s", dbus_message_get_member (message));
+
+  if (dbus_message_get_reply_serial (reply) != serial)
+    {
+      warn_unexpected (connection, reply, "reply to a bus method");
+      _dbus_test_fatal ("unexpected message instead of reply to %s",
+                        dbus_message_get_member (message));
+    }
+
+  return reply;
+}
+
+static DBusMessage *
+new_add_matches_call (const char **rules,
+                      int          n_rules)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "AddMatches");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for AddMatches");
+
+  return message;
+}
+
+/* Returns the bus's end of the client @connection */
+static DBusConnection *
+get_bus_connection (BusContext     *context,
+                    DBusConnection *connection)
+{
+  BusService *service;
+  DBusString name;
+
+  _dbus_string_init_const (&name, dbus_bus_get_unique_name (connection));
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+
+  if (service == NULL)
+    _dbus_test_fatal ("%s has no connection on the bus",
+                      dbus_bus_get_unique_name (connection));
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Returns how many match rules the bus holds for the client @connection */
+static int
+count_match_rules (BusContext     *context,
+                   DBusConnection *connection)
+{
+  return bus_connection_get_n_match_rules (get_bus_connection (context,
+                                                               connection));
+}
 
 dbus_bool_t
-bus_unix_fds_passing_test(const DBusString *test_data_dir)
+bus_add_matches_test (const DBusString *test_data_dir)
 {
+  static const char *rules[] = {
+    "type='signal',interface='com.example.First'",
+    "type='signal',interface='com.example.Second'",
+    "type='signal',member='Third'"
+  };
+  static const char *with_invalid[] = {
+    "type='signal',interface='com.example.Fourth'",
+    "type='signal',interface='com.example.Fifth'",
+    "type='no-such-type'",
+    "type='signal',interface='com.example.Sixth'"
+  };
   BusContext *context;
-  DBusConnection *foo, *bar;
-  DBusError error;
-  DBusMessage *m;
-  DBusSocket one[2], two[2];
-  int x, y, z;
-  char r;
-
-  dbus_error_init (&error);
+  DBusConnection *foo;
+  DBusMessage *message, *reply;
+  int n_rules;
 
   context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
   if (context == NULL)
     _dbus_test_fatal ("could not alloc context");
 
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
-    _dbus_test_fatal ("could not alloc connection");
+  foo = open_test_client (context);
+  n_rules = count_match_rules (context, foo);
 
-  if (!bus_setup_debug_client (foo))
-    _dbus_test_fatal ("could not set up connection");
+  message = new_add_matches_call (rules, _DBUS_N_ELEMENTS (rules));
+  reply = call_bus_method (context, foo, message);
 
-  spin_connection_until_authenticated (context, foo);
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (foo, reply, "method return");
+      _dbus_test_fatal ("AddMatches failed");
+    }
 
-  if (!check_hello_message (context, foo))
-    _dbus_test_fatal ("hello message failed");
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
 
-  if (!check_add_match (context, foo, ""))
-    _dbus_test_fatal ("AddMatch message failed");
+  n_rules += _DBUS_N_ELEMENTS (rules);
 
-  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (bar == NULL)
-    _dbus_test_fatal ("could not alloc connection");
+  if (count_match_rules (context, foo) != n_rules)
+    _dbus_test_fatal ("AddMatches left %d match rules, expected %d",
+                      count_match_rules (context, foo), n_rules);
 
-  if (!bus_setup_debug_client (bar))
-    _dbus_test_fatal ("could not set up connection");
+  _dbus_test_ok ("%s - every rule of a batch added", _DBUS_FUNCTION_NAME);
 
-  spin_connection_until_authenticated (context, bar);
+  message = new_add_matches_call (with_invalid,
+                                  _DBUS_N_ELEMENTS (with_invalid));
+  reply = call_bus_method (context, foo, message);
 
-  if (!check_hello_message (context, bar))
-    _dbus_test_fatal ("hello message failed");
+  if (!dbus_message_is_error (reply, DBUS_ERROR_MATCH_RULE_INVALID))
+    {
+      warn_unexpected (foo, reply, DBUS_ERROR_MATCH_RULE_INVALID);
+      _dbus_test_fatal ("AddMatches with an invalid rule did not fail");
+    }
 
-  if (!check_add_match (context, bar, ""))
-    _dbus_test_fatal ("AddMatch message failed");
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
 
-  if (!(m = dbus_message_new_signal("/", "a.b.c", "d")))
-    _dbus_test_fatal ("could not alloc message");
+  /* Neither the rules before the invalid one nor those after it */
+  if (count_match_rules (context, foo) != n_rules)
+    _dbus_test_fatal ("AddMatches kept %d rules of a failed batch",
+                      count_match_rules (context, foo) - n_rules);
 
-  if (!(_dbus_socketpair (one, one+1, TRUE, &error)))
-    _dbus_test_fatal ("Failed to allocate pipe #1");
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after AddMatches");
 
-  if (!(_dbus_socketpair (two, two+1, TRUE, &error)))
-    _dbus_test_fatal ("Failed to allocate pipe #2");
+  _dbus_test_ok ("%s - no rule of a batch with an invalid one added",
+                 _DBUS_FUNCTION_NAME);
 
-  if (!dbus_message_append_args(m,
-                                DBUS_TYPE_UNIX_FD, one,
-                                DBUS_TYPE_UNIX_FD, two,
-                                DBUS_TYPE_UNIX_FD, two,
-                                DBUS_TYPE_INVALID))
-    _dbus_test_fatal ("Failed to attach fds.");
+  kill_client_connection_unchecked (foo);
+  bus_context_unref (context);
 
-  if (!_dbus_close_socket (one[0], &error))
-    _dbus_test_fatal ("Failed to close pipe #1 ");
-  if (!_dbus_close_socket (two[0], &error))
-    _dbus_test_fatal ("Failed to close pipe #2 ");
+  return TRUE;
+}
 
-  if (!(dbus_connection_can_send_type(foo, DBUS_TYPE_UNIX_FD)))
-    _dbus_test_fatal ("Connection cannot do fd passing");
+/* Calls @method, ListNamesPaged or ListActivatableNamesPaged, appends
+ * each name on the page it returns to @names followed by a space, and
+ * returns how many there were. The cursor for the next page is stored
+ * in @next_cursor, to be freed with dbus_free(). */
+static int
+list_name_page (BusContext      *context,
+                DBusConnection  *connection,
+                const char      *method,
+                const char      *prefix,
+                const char      *cursor,
+                dbus_uint32_t    max_names,
+                DBusString      *names,
+                char           **next_cursor)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *message, *reply;
+  char **page;
+  const char *next;
+  int n_page;
+  int i;
 
-  if (!(dbus_connection_can_send_type(bar, DBUS_TYPE_UNIX_FD)))
-    _dbus_test_fatal ("Connection cannot do fd passing");
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
 
-  if (!dbus_connection_send (foo, m, NULL))
-    _dbus_test_fatal ("Failed to send fds");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &prefix,
+                                 DBUS_TYPE_STRING, &cursor,
+                                 DBUS_TYPE_UINT32, &max_names,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for %s", method);
 
-  dbus_message_unref(m);
+  reply = call_bus_method (context, connection, message);
 
-  bus_test_run_clients_loop (SEND_PENDING (foo));
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &page, &n_page,
+                              DBUS_TYPE_STRING, &next,
+                              DBUS_TYPE_INVALID))
+    {
+      warn_unexpected (connection, reply, "method return");
+      _dbus_test_fatal ("bad reply to %s: %s", method, error.message);
+    }
 
-  bus_test_run_everything (context);
+  for (i = 0; i < n_page; i++)
+    {
+      if (!_dbus_string_append (names, page[i]) ||
+          !_dbus_string_append_byte (names, ' '))
+        _dbus_test_fatal ("no memory for names");
+    }
 
-  block_connection_until_message_from_bus (context, foo, "unix fd reception on foo");
+  *next_cursor = _dbus_strdup (next);
 
-  if (!(m = pop_message_waiting_for_memory (foo)))
-    _dbus_test_fatal ("Failed to receive msg");
+  if (*next_cursor == NULL)
+    _dbus_test_fatal ("no memory for cursor");
 
-  if (!dbus_message_is_signal(m, "a.b.c", "d"))
-    _dbus_test_fatal ("bogus message received");
+  dbus_free_string_array (page);
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
 
-  dbus_message_unref(m);
+  return n_page;
+}
 
-  block_connection_until_message_from_bus (context, bar, "unix fd reception on bar");
+dbus_bool_t
+bus_list_names_paged_test (const DBusString *test_data_dir)
+{
+  static const char * const methods[] = {
+    "ListNamesPaged",
+    "ListActivatableNamesPaged"
+  };
+  /* The unique names of the clients below, and the services in
+   * test/data/valid-service-files */
+  static const char * const prefixes[] = {
+    ":",
+    "org.freedesktop.DBus.TestSuite"
+  };
+  BusContext *context;
+  DBusConnection *foo, *bar, *baz;
+  int i;
 
-  if (!(m = pop_message_waiting_for_memory (bar)))
-    _dbus_test_fatal ("Failed to receive msg");
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
 
-  if (!dbus_message_is_signal(m, "a.b.c", "d"))
-    _dbus_test_fatal ("bogus message received");
+  foo = open_test_client (context);
+  bar = open_test_client (context);
+  baz = open_test_client (context);
 
-  if (!dbus_message_get_args(m,
-                             &error,
-                             DBUS_TYPE_UNIX_FD, &x,
-                             DBUS_TYPE_UNIX_FD, &y,
-                             DBUS_TYPE_UNIX_FD, &z,
-                             DBUS_TYPE_INVALID))
-    _dbus_test_fatal ("Failed to parse fds.");
+  for (i = 0; i < _DBUS_N_ELEMENTS (methods); i++)
+    {
+      DBusString all, walked;
+      char *cursor;
+      int n_all, n_page;
 
-  dbus_message_unref(m);
+      if (!_dbus_string_init (&all) || !_dbus_string_init (&walked))
+        _dbus_test_fatal ("no memory for names");
 
-  if (write(x, "X", 1) != 1)
-    _dbus_test_fatal ("Failed to write to pipe #1");
-  if (write(y, "Y", 1) != 1)
-    _dbus_test_fatal ("Failed to write to pipe #2");
-  if (write(z, "Z", 1) != 1)
-    _dbus_test_fatal ("Failed to write to pipe #2/2nd fd");
+      /* An empty cursor starts from the first name; all of them fit */
+      n_all = list_name_page (context, foo, methods[i], prefixes[i], "",
+                              1000, &all, &cursor);
 
-  if (!_dbus_close(x, &error))
-    _dbus_test_fatal ("Failed to close pipe #1/other side ");
-  if (!_dbus_close(y, &error))
-    _dbus_test_fatal ("Failed to close pipe #2/other side ");
-  if (!_dbus_close(z, &error))
-    _dbus_test_fatal ("Failed to close pipe #2/other size 2nd fd ");
+      if (n_all < 3)
+        _dbus_test_fatal ("%s listed only %d names starting with %s",
+                          methods[i], n_all, prefixes[i]);
 
-  if (read(one[1].fd, &r, 1) != 1 || r != 'X')
-    _dbus_test_fatal ("Failed to read value from pipe.");
-  if (read(two[1].fd, &r, 1) != 1 || r != 'Y')
-    _dbus_test_fatal ("Failed to read value from pipe.");
-  if (read(two[1].fd, &r, 1) != 1 || r != 'Z')
-    _dbus_test_fatal ("Failed to read value from pipe.");
+      if (cursor[0] != '\0')
+        _dbus_test_fatal ("%s gave cursor %s after the last page",
+                          methods[i], cursor);
 
-  if (!_dbus_close_socket (one[1], &error))
-    _dbus_test_fatal ("Failed to close pipe #1 ");
-  if (!_dbus_close_socket (two[1], &error))
-    _dbus_test_fatal ("Failed to close pipe #2 ");
+      dbus_free (cursor);
 
-  _dbus_verbose ("Disconnecting foo\n");
-  kill_client_connection_unchecked (foo);
+      /* Walking two at a time must find the same names in the same order */
+      cursor = _dbus_strdup ("");
 
-  _dbus_verbose ("Disconnecting bar\n");
+      if (cursor == NULL)
+        _dbus_test_fatal ("no memory for cursor");
+
+      do
+        {
+          char *previous = cursor;
+
+          n_page = list_name_page (context, foo, methods[i], prefixes[i],
+                                   previous, 2, &walked, &cursor);
+
+          if (cursor[0] != '\0' && n_page != 2)
+            _dbus_test_fatal ("%s returned %d names before the last page",
+                              methods[i], n_page);
+
+          dbus_free (previous);
+        }
+      while (cursor[0] != '\0');
+
+      dbus_free (cursor);
+
+      if (!_dbus_string_equal (&all, &walked))
+        _dbus_test_fatal ("%s listed \"%s\" in one page but \"%s\" in pages",
+                          methods[i], _dbus_string_get_const_data (&all),
+                          _dbus_string_get_const_data (&walked));
+
+      /* A cursor past the last name gives an empty last page */
+      _dbus_string_set_length (&walked, 0);
+      n_page = list_name_page (context, foo, methods[i], prefixes[i], "~",
+                               2, &walked, &cursor);
+
+      if (n_page != 0 || cursor[0] != '\0')
+        _dbus_test_fatal ("%s listed \"%s\" past the last name",
+                          methods[i], _dbus_string_get_const_data (&walked));
+
+      dbus_free (cursor);
+      _dbus_string_free (&all);
+      _dbus_string_free (&walked);
+
+      _dbus_test_ok ("%s - %s", _DBUS_FUNCTION_NAME, methods[i]);
+    }
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after listing names");
+
+  kill_client_connection_unchecked (foo);
   kill_client_connection_unchecked (bar);
+  kill_client_connection_unchecked (baz);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Calls @method, which takes one argument of @type and returns nothing,
+ * on the bus driver and checks that it succeeds */
+static void
+check_bus_setter (BusContext     *context,
+                  DBusConnection *connection,
+                  const char     *method,
+                  int             type,
+                  const void     *value)
+{
+  DBusMessage *message, *reply;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 type, value,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for %s", method);
 
+  reply = call_bus_method (context, connection, message);
+
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, reply, "method return");
+      _dbus_test_fatal ("%s failed", method);
+    }
+
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+}
+
+/* Signals big enough that a few of them fill the socket to a receiver
+ * that isn't reading, so that the rest wait in the bus */
+#define FLOOD_SIGNALS 100
+#define FLOOD_PAYLOAD 16384
+
+/* Queues FLOOD_SIGNALS signals from @sender to @destination, numbered
+ * from 0, all with the same path, interface and member */
+static void
+queue_flood (DBusConnection *sender,
+             const char     *destination)
+{
+  static unsigned char payload[FLOOD_PAYLOAD];
+  const unsigned char *p = payload;
+  dbus_uint32_t i;
+
+  for (i = 0; i < FLOOD_SIGNALS; i++)
+    {
+      DBusMessage *signal;
+
+      signal = dbus_message_new_signal ("/com/example/Flood",
+                                        "com.example.Flood",
+                                        "Tick");
+
+      if (signal == NULL ||
+          !dbus_message_set_destination (signal, destination) ||
+          !dbus_message_append_args (signal,
+                                     DBUS_TYPE_UINT32, &i,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                     &p, FLOOD_PAYLOAD,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (sender, signal, NULL))
+        _dbus_test_fatal ("no memory for flood");
+
+      dbus_message_unref (signal);
+    }
+}
+
+/* Moves what can be moved without blocking, on @connection and in the
+ * bus, but not on any other client */
+static void
+pump_connection (BusContext     *context,
+                 DBusConnection *connection)
+{
+  dbus_connection_read_write (connection, 0);
+  bus_test_run_bus_loop (context, FALSE);
+}
+
+/* Reads the signals queued by queue_flood() from @receiver, checking
+ * that they arrive in order, until the last one has. @sender is kept
+ * writing meanwhile. If @reply_serial is not 0, the reply to that
+ * call is expected too, and *@n_before_reply says how many signals
+ * came ahead of it. Returns how many signals arrived. */
+static int
+receive_flood (BusContext     *context,
+               DBusConnection *sender,
+               DBusConnection *receiver,
+               dbus_uint32_t   reply_serial,
+               int            *n_before_reply)
+{
+  dbus_bool_t have_reply = (reply_serial == 0);
+  int n_received = 0;
+  int last = -1;
+  int rounds;
+
+  for (rounds = 0; rounds < 100000; rounds++)
+    {
+      DBusMessage *message;
+
+      if (last == FLOOD_SIGNALS - 1 && have_reply)
+        return n_received;
+
+      dbus_connection_read_write (sender, 0);
+      pump_connection (context, receiver);
+
+      while ((message = pop_message_waiting_for_memory (receiver)) != NULL)
+        {
+          dbus_uint32_t n;
+
+          if (!have_reply &&
+              dbus_message_get_reply_serial (message) == reply_serial)
+            {
+              have_reply = TRUE;
+              *n_before_reply = n_received;
+            }
+          else if (dbus_message_is_signal (message, "com.example.Flood",
+                                           "Tick") &&
+                   dbus_message_get_args (message, NULL,
+                                          DBUS_TYPE_UINT32, &n,
+                                          DBUS_TYPE_INVALID))
+            {
+              if ((int) n <= last)
+                _dbus_test_fatal ("signal %u arrived after %d", n, last);
+
+              last = n;
+              n_received++;
+            }
+          else
+            {
+              warn_unexpected (receiver, message, "com.example.Flood.Tick");
+              _dbus_test_fatal ("unexpected message during flood");
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  _dbus_test_fatal ("flood did not arrive: got %d signals, the last %d",
+                    n_received, last);
+  return -1;
+}
+
+/* Pumps @connection until it has received something, and returns it */
+static DBusMessage *
+pump_until_message (BusContext     *context,
+                    DBusConnection *connection,
+                    const char     *what_is_expected)
+{
+  int rounds;
+
+  for (rounds = 0; rounds < 100000; rounds++)
+    {
+      DBusMessage *message;
+
+      pump_connection (context, connection);
+      message = pop_message_waiting_for_memory (connection);
+
+      if (message != NULL)
+        return message;
+    }
+
+  _dbus_test_fatal ("never received %s", what_is_expected);
+  return NULL;
+}
+
+static void
+check_flow_control_signal (DBusConnection *connection,
+                           DBusMessage    *message,
+                           dbus_bool_t     expected)
+{
+  dbus_bool_t throttled;
+  dbus_uint64_t queued;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "FlowControl") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_BOOLEAN, &throttled,
+                              DBUS_TYPE_UINT64, &queued,
+                              DBUS_TYPE_INVALID))
+    {
+      warn_unexpected (connection, message, "FlowControl");
+      _dbus_test_fatal ("bogus FlowControl received");
+    }
+
+  if (throttled != expected)
+    _dbus_test_fatal ("FlowControl said throttled=%d, expected %d",
+                      throttled, expected);
+}
+
+dbus_bool_t
+bus_flow_control_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  DBusMessage *message;
+  dbus_bool_t enable = TRUE;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  sender = open_test_client (context);
+  receiver = open_test_client (context);
+
+  check_bus_setter (context, sender, "EnableFlowControl",
+                    DBUS_TYPE_BOOLEAN, &enable);
+
+  /* The signals stuck on their way to the receiver count against the
+   * sender, so the bus soon stops reading from it */
+  dbus_connection_set_max_received_size (get_bus_connection (context, sender),
+                                         4 * FLOOD_PAYLOAD);
+
+  queue_flood (sender, dbus_bus_get_unique_name (receiver));
+
+  message = pump_until_message (context, sender, "FlowControl");
+  check_flow_control_signal (sender, message, TRUE);
+  dbus_message_unref (message);
+
+  if (!dbus_connection_has_messages_to_send (sender))
+    _dbus_test_fatal ("the bus read all the signals while throttled");
+
+  _dbus_test_ok ("%s - told the sender it stopped reading",
+                 _DBUS_FUNCTION_NAME);
+
+  if (receive_flood (context, sender, receiver, 0, NULL) != FLOOD_SIGNALS)
+    _dbus_test_fatal ("signals were lost without CoalesceSignals");
+
+  message = pump_until_message (context, sender, "FlowControl");
+  check_flow_control_signal (sender, message, FALSE);
+  dbus_message_unref (message);
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after flow control");
+
+  _dbus_test_ok ("%s - told the sender it resumed reading",
+                 _DBUS_FUNCTION_NAME);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_coalesce_signals_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  dbus_uint32_t queued_bytes = 1;
+  int n_received;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  sender = open_test_client (context);
+  receiver = open_test_client (context);
+
+  /* Coalesce as soon as anything at all is waiting for the receiver */
+  check_bus_setter (context, receiver, "CoalesceSignals",
+                    DBUS_TYPE_UINT32, &queued_bytes);
+
+  queue_flood (sender, dbus_bus_get_unique_name (receiver));
+
+  while (dbus_connection_has_messages_to_send (sender))
+    pump_connection (context, sender);
+
+  /* receive_flood() checks that they stay in order and that the last
+   * one, which superseded the others, arrives */
+  n_received = receive_flood (context, sender, receiver, 0, NULL);
+
+  if (n_received >= FLOOD_SIGNALS)
+    _dbus_test_fatal ("all %d signals arrived despite CoalesceSignals",
+                      n_received);
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after coalescing signals");
+
+  _dbus_test_ok ("%s - %d of %d signals arrived", _DBUS_FUNCTION_NAME,
+                 n_received, FLOOD_SIGNALS);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_prioritize_replies_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  DBusMessage *message;
+  dbus_bool_t enable = TRUE;
+  dbus_uint32_t serial;
+  int n_before_reply;
+  int n_received;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  sender = open_test_client (context);
+  receiver = open_test_client (context);
+
+  check_bus_setter (context, receiver, "PrioritizeReplies",
+                    DBUS_TYPE_BOOLEAN, &enable);
+
+  queue_flood (sender, dbus_bus_get_unique_name (receiver));
+
+  while (dbus_connection_has_messages_to_send (sender))
+    pump_connection (context, sender);
+
+  /* With the signals waiting in the bus, ask it for something */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetId");
+
+  if (message == NULL || !dbus_connection_send (receiver, message, &serial))
+    _dbus_test_fatal ("no memory for GetId");
+
+  dbus_message_unref (message);
+
+  n_received = receive_flood (context, sender, receiver, serial,
+                              &n_before_reply);
+
+  if (n_received != FLOOD_SIGNALS)
+    _dbus_test_fatal ("%d of %d signals arrived without CoalesceSignals",
+                      n_received, FLOOD_SIGNALS);
+
+  if (n_before_reply >= FLOOD_SIGNALS)
+    _dbus_test_fatal ("the reply did not overtake any queued signals");
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after prioritizing replies");
+
+  _dbus_test_ok ("%s - reply arrived after %d of %d signals",
+                 _DBUS_FUNCTION_NAME, n_before_reply, FLOOD_SIGNALS);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Makes @connection a monitor of everything, with @flags */
+static void
+become_monitor (BusContext     *context,
+                DBusConnection *connection,
+                dbus_uint32_t   flags)
+{
+  DBusMessage *message;
+  const char **rules = NULL;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_MONITORING,
+                                          "BecomeMonitor");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &rules, 0,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    _dbus_test_fatal ("no memory for BecomeMonitor");
+
+  dbus_message_unref (message);
+
+  /* Skip the signals that were already on their way */
+  while (TRUE)
+    {
+      message = pump_until_message (context, connection, "BecomeMonitor reply");
+
+      if (dbus_message_get_reply_serial (message) == serial)
+        break;
+
+      dbus_message_unref (message);
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, message, "method return");
+      _dbus_test_fatal ("BecomeMonitor failed");
+    }
+
+  dbus_message_unref (message);
+}
+
+/* Reads and throws away whatever has been sent to @connection, so that
+ * it can be killed */
+static void
+discard_messages (BusContext     *context,
+                  DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  pump_connection (context, connection);
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+}
+
+/* Returns TRUE if @message is a signal from the bus driver, which the
+ * clients opened by open_test_client() receive whenever names change */
+static dbus_bool_t
+is_bus_signal (DBusMessage *message)
+{
+  return dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+         dbus_message_has_sender (message, DBUS_SERVICE_DBUS);
+}
+
+/* Method calls and signals whose only purpose is to be counted */
+#define RATE_BURST 6
+
+/* Sends RATE_BURST method calls from @caller to @callee, and pumps until
+ * each has either arrived or been refused with LimitsExceeded. The
+ * calls that arrived are appended to @calls, if not NULL, for the callee
+ * to reply to. Returns how many were refused. */
+static int
+send_rate_limited_calls (BusContext     *context,
+                         DBusConnection *caller,
+                         DBusConnection *callee,
+                         DBusList      **calls)
+{
+  int n_arrived = 0;
+  int n_refused = 0;
+  int rounds;
+  int i;
+
+  for (i = 0; i < RATE_BURST; i++)
+    {
+      DBusMessage *message;
+
+      message = dbus_message_new_method_call (dbus_bus_get_unique_name (callee),
+                                              "/com/example/Rate",
+                                              "com.example.Rate",
+                                              "Call");
+
+      if (message == NULL || !dbus_connection_send (caller, message, NULL))
+        _dbus_test_fatal ("no memory for method call");
+
+      dbus_message_unref (message);
+    }
+
+  for (rounds = 0; n_arrived + n_refused < RATE_BURST; rounds++)
+    {
+      DBusMessage *message;
+
+      if (rounds >= 100000)
+        _dbus_test_fatal ("only %d of %d calls were accounted for",
+                          n_arrived + n_refused, RATE_BURST);
+
+      pump_connection (context, caller);
+      pump_connection (context, callee);
+
+      while ((message = pop_message_waiting_for_memory (caller)) != NULL)
+        {
+          if (dbus_message_is_error (message, DBUS_ERROR_LIMITS_EXCEEDED))
+            n_refused++;
+          else if (!is_bus_signal (message))
+            {
+              warn_unexpected (caller, message, "LimitsExceeded");
+              _dbus_test_fatal ("unexpected message to the caller");
+            }
+
+          dbus_message_unref (message);
+        }
+
+      while ((message = pop_message_waiting_for_memory (callee)) != NULL)
+        {
+          if (dbus_message_is_method_call (message, "com.example.Rate",
+                                           "Call"))
+            {
+              n_arrived++;
+
+              if (calls != NULL)
+                {
+                  if (!_dbus_list_append (calls, message))
+                    _dbus_test_fatal ("no memory to keep a call");
+
+                  continue;
+                }
+            }
+          else if (!is_bus_signal (message))
+            {
+              warn_unexpected (callee, message, "com.example.Rate.Call");
+              _dbus_test_fatal ("unexpected message to the callee");
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  return n_refused;
+}
+
+dbus_bool_t
+bus_rate_limits_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *caller, *callee, *monitor;
+  DBusConnection *other_caller;
+  DBusList *calls = NULL;
+  DBusMessage *message;
+  int n_calls, n_refused, n_replies, n_signals, n_monitored;
+  int rounds;
+  int i;
+
+  /* Each connection may send four messages a second */
+  context = bus_context_new_test (test_data_dir, "valid-config-files/rate-limits.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  caller = open_test_client (context);
+  callee = open_test_client (context);
+  monitor = open_test_client (context);
+  become_monitor (context, monitor, 0);
+
+  /* AddMatch used one of the caller's four, so three calls get through */
+  n_refused = send_rate_limited_calls (context, caller, callee, &calls);
+  n_calls = _dbus_list_get_length (&calls);
+
+  if (n_refused == 0 || n_calls == 0)
+    _dbus_test_fatal ("%d calls arrived and %d were refused", n_calls,
+                      n_refused);
+
+  _dbus_test_ok ("%s - %d of %d method calls refused with LimitsExceeded",
+                 _DBUS_FUNCTION_NAME, n_refused, RATE_BURST);
+
+  /* The callee uses up its own allowance on signals, which are dropped
+   * without an error, and then replies */
+  for (i = 0; i < RATE_BURST; i++)
+    {
+      message = dbus_message_new_signal ("/com/example/Rate",
+                                         "com.example.Rate",
+                                         "Tick");
+
+      if (message == NULL ||
+          !dbus_message_set_destination (message,
+                                         dbus_bus_get_unique_name (caller)) ||
+          !dbus_connection_send (callee, message, NULL))
+        _dbus_test_fatal ("no memory for signal");
+
+      dbus_message_unref (message);
+    }
+
+  while ((message = _dbus_list_pop_first (&calls)) != NULL)
+    {
+      DBusMessage *reply = dbus_message_new_method_return (message);
+
+      if (reply == NULL || !dbus_connection_send (callee, reply, NULL))
+        _dbus_test_fatal ("no memory for reply");
+
+      dbus_message_unref (reply);
+      dbus_message_unref (message);
+    }
+
+  /* The replies come after any signals that got through */
+  n_replies = 0;
+  n_signals = 0;
+  n_monitored = 0;
+
+  for (rounds = 0; n_replies < n_calls || n_monitored < RATE_BURST; rounds++)
+    {
+      if (rounds >= 100000)
+        _dbus_test_fatal ("%d of %d replies arrived and the monitor saw %d "
+                          "of %d signals", n_replies, n_calls, n_monitored,
+                          RATE_BURST);
+
+      pump_connection (context, callee);
+      pump_connection (context, caller);
+      pump_connection (context, monitor);
+
+      while ((message = pop_message_waiting_for_memory (caller)) != NULL)
+        {
+          if (dbus_message_is_signal (message, "com.example.Rate", "Tick"))
+            n_signals++;
+          else if (dbus_message_get_type (message) ==
+                   DBUS_MESSAGE_TYPE_METHOD_RETURN)
+            n_replies++;
+          else if (!is_bus_signal (message))
+            {
+              warn_unexpected (caller, message, "reply or Tick");
+              _dbus_test_fatal ("unexpected message to the caller");
+            }
+
+          dbus_message_unref (message);
+        }
+
+      while ((message = pop_message_waiting_for_memory (monitor)) != NULL)
+        {
+          if (dbus_message_is_signal (message, "com.example.Rate", "Tick"))
+            n_monitored++;
+
+          dbus_message_unref (message);
+        }
+    }
+
+  if (n_signals >= RATE_BURST)
+    _dbus_test_fatal ("all %d signals arrived despite the limit", n_signals);
+
+  while ((message = pop_message_waiting_for_memory (callee)) != NULL)
+    {
+      if (!is_bus_signal (message))
+        {
+          warn_unexpected (callee, message, "nothing");
+          _dbus_test_fatal ("the sender of dropped signals was told");
+        }
+
+      dbus_message_unref (message);
+    }
+
+  _dbus_test_ok ("%s - %d of %d signals dropped silently, all seen by the "
+                 "monitor", _DBUS_FUNCTION_NAME, RATE_BURST - n_signals,
+                 RATE_BURST);
+  _dbus_test_ok ("%s - %d replies got through over the limit",
+                 _DBUS_FUNCTION_NAME, n_replies);
+
+  /* A second later the caller's allowance is full again, but no fuller */
+  _dbus_sleep_milliseconds (1100);
+
+  n_refused = send_rate_limited_calls (context, caller, callee, NULL);
+
+  if (n_refused == 0 || RATE_BURST - n_refused < 4)
+    _dbus_test_fatal ("after refilling, %d of %d calls were refused",
+                      n_refused, RATE_BURST);
+
+  _dbus_test_ok ("%s - allowance refilled over time", _DBUS_FUNCTION_NAME);
+
+  discard_messages (context, monitor);
+  kill_client_connection_unchecked (monitor);
+  kill_client_connection_unchecked (caller);
+  kill_client_connection_unchecked (callee);
+  bus_context_unref (context);
+
+  /* Each user may send six messages a second, whatever the connection */
+  context = bus_context_new_test (test_data_dir, "valid-config-files/rate-limits-per-user.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  caller = open_test_client (context);
+  other_caller = open_test_client (context);
+  callee = open_test_client (context);
+
+  /* Three AddMatch calls used half of it and the caller uses up the
+   * rest, so the other caller is refused although it has only sent
+   * AddMatch, and there is no per-connection limit */
+  n_refused = send_rate_limited_calls (context, caller, callee, NULL);
+
+  if (n_refused == 0)
+    _dbus_test_fatal ("the per-user limit did not apply");
+
+  n_refused = send_rate_limited_calls (context, other_caller, callee, NULL);
+
+  if (n_refused == 0)
+    _dbus_test_fatal ("another connection of the same user was not limited");
+
+  _dbus_test_ok ("%s - connections of one user share its allowance",
+                 _DBUS_FUNCTION_NAME);
+
+  kill_client_connection_unchecked (caller);
+  kill_client_connection_unchecked (other_caller);
+  kill_client_connection_unchecked (callee);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_lossy_monitor_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver, *monitor;
+  DBusConnection *bus_monitor;
+  DBusMessage *message;
+  dbus_uint32_t dropped = 0;
+  dbus_uint32_t n_missed = 0;
+  long queued;
+  int n_reports = 0;
+  int n_monitored = 0;
+  int last = -1;
+  int rounds;
+
+  /* Only 64KiB, four of the flood's signals, may wait for the monitor */
+  context = bus_context_new_test (test_data_dir, "valid-config-files/lossy-monitor.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  sender = open_test_client (context);
+  receiver = open_test_client (context);
+  monitor = open_test_client (context);
+  /* Looked up by name, which the monitor is about to lose */
+  bus_monitor = get_bus_connection (context, monitor);
+  become_monitor (context, monitor, DBUS_MONITOR_FLAG_LOSSY);
+
+  /* The others are told that the monitor lost its unique name */
+  message = pump_until_message (context, sender, "NameOwnerChanged");
+  _dbus_assert (is_bus_signal (message));
+  dbus_message_unref (message);
+  message = pump_until_message (context, receiver, "NameOwnerChanged");
+  _dbus_assert (is_bus_signal (message));
+  dbus_message_unref (message);
+
+  /* Nobody reads, so the copies for the monitor pile up in the bus */
+  queue_flood (sender, dbus_bus_get_unique_name (receiver));
+
+  while (dbus_connection_has_messages_to_send (sender))
+    pump_connection (context, sender);
+
+  /* About one signal more than the limit is waiting, at most */
+  queued = dbus_connection_get_outgoing_size (bus_monitor);
+
+  if (queued > 65536 + 2 * FLOOD_PAYLOAD)
+    _dbus_test_fatal ("%ld bytes are waiting for the lossy monitor", queued);
+
+  /* The oldest were dropped, and the newest are still there, each
+   * burst of drops reported ahead of the messages that survived it */
+  for (rounds = 0; last < FLOOD_SIGNALS - 1; rounds++)
+    {
+      if (rounds >= 100000)
+        _dbus_test_fatal ("the monitor saw %d signals, the last %d",
+                          n_monitored, last);
+
+      pump_connection (context, monitor);
+
+      while ((message = pop_message_waiting_for_memory (monitor)) != NULL)
+        {
+          dbus_uint32_t n;
+
+          if (dbus_message_is_signal (message, DBUS_INTERFACE_MONITORING,
+                                      "MessagesDropped"))
+            {
+              if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+                  !dbus_message_has_path (message, DBUS_PATH_DBUS) ||
+                  !dbus_message_get_args (message, NULL,
+                                          DBUS_TYPE_UINT32, &n,
+                                          DBUS_TYPE_INVALID))
+                {
+                  warn_unexpected (monitor, message, "MessagesDropped");
+                  _dbus_test_fatal ("bogus MessagesDropped received");
+                }
+
+              /* A running total, which only grows */
+              if (n <= dropped)
+                _dbus_test_fatal ("MessagesDropped said %u after %u", n,
+                                  dropped);
+
+              dropped = n;
+              n_reports++;
+            }
+          else if (dbus_message_is_signal (message, "com.example.Flood",
+                                           "Tick") &&
+                   dbus_message_get_args (message, NULL,
+                                          DBUS_TYPE_UINT32, &n,
+                                          DBUS_TYPE_INVALID))
+            {
+              if ((int) n <= last)
+                _dbus_test_fatal ("signal %u arrived after %d", n, last);
+
+              /* Anything skipped must have been reported first */
+              n_missed += n - last - 1;
+
+              if (n_missed > dropped)
+                _dbus_test_fatal ("%u signals before %u were dropped, but "
+                                  "only %u drops were reported", n_missed, n,
+                                  dropped);
+
+              last = n;
+              n_monitored++;
+            }
+          else if (!is_bus_signal (message))
+            {
+              warn_unexpected (monitor, message, "Tick or MessagesDropped");
+              _dbus_test_fatal ("unexpected message to the monitor");
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  if (n_reports == 0 || n_monitored >= FLOOD_SIGNALS)
+    _dbus_test_fatal ("the monitor saw %d of %d signals and %d reports",
+                      n_monitored, FLOOD_SIGNALS, n_reports);
+
+  /* The count may also include reports that were themselves dropped
+   * by a later burst */
+  _dbus_assert (n_monitored + n_missed == FLOOD_SIGNALS);
+
+  _dbus_test_ok ("%s - the monitor saw %d of %d signals and was told %u "
+                 "messages were dropped", _DBUS_FUNCTION_NAME, n_monitored,
+                 FLOOD_SIGNALS, dropped);
+
+  /* The receiver is not affected */
+  if (receive_flood (context, sender, receiver, 0, NULL) != FLOOD_SIGNALS)
+    _dbus_test_fatal ("signals to the receiver were lost");
+
+  _dbus_test_ok ("%s - nothing dropped for the receiver", _DBUS_FUNCTION_NAME);
+
+  discard_messages (context, monitor);
+  kill_client_connection_unchecked (monitor);
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#ifdef DBUS_ENABLE_STATS
+/* Identical broadcasts, so that all but the first take their
+ * recipients from the matchmaker's cache */
+#define CACHED_SIGNALS 10
+
+/* Pumps @connection until it has received CACHED_SIGNALS of the
+ * signals sent by bus_match_stats_test(), and nothing else */
+static void
+receive_cached_signals (BusContext     *context,
+                        DBusConnection *connection)
+{
+  int n_received = 0;
+  int rounds;
+
+  for (rounds = 0; n_received < CACHED_SIGNALS; rounds++)
+    {
+      DBusMessage *message;
+
+      if (rounds >= 100000)
+        _dbus_test_fatal ("only %d of %d signals arrived", n_received,
+                          CACHED_SIGNALS);
+
+      pump_connection (context, connection);
+
+      while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+        {
+          if (!dbus_message_is_signal (message, "com.example.Cached", "Tick"))
+            {
+              warn_unexpected (connection, message, "com.example.Cached.Tick");
+              _dbus_test_fatal ("unexpected message");
+            }
+
+          n_received++;
+          dbus_message_unref (message);
+        }
+    }
+}
+
+dbus_bool_t
+bus_match_stats_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusMatchmaker *matchmaker;
+  DBusConnection *sender, *receiver;
+  DBusConnection *bus_receiver;
+  dbus_uint64_t evaluated_before, matched_before;
+  dbus_uint64_t evaluated, matched;
+  int i;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  matchmaker = bus_context_get_matchmaker (context);
+  sender = open_test_client (context);
+  receiver = open_test_client (context);
+  bus_receiver = get_bus_connection (context, receiver);
+
+  /* The receiver's rule has already seen NameOwnerChanged and so on */
+  bus_matchmaker_get_rule_stats (matchmaker, bus_receiver,
+                                 &evaluated_before, &matched_before);
+
+  for (i = 0; i < CACHED_SIGNALS; i++)
+    {
+      DBusMessage *signal;
+
+      signal = dbus_message_new_signal ("/com/example/Cached",
+                                        "com.example.Cached",
+                                        "Tick");
+
+      if (signal == NULL || !dbus_connection_send (sender, signal, NULL))
+        _dbus_test_fatal ("no memory for signal");
+
+      dbus_message_unref (signal);
+    }
+
+  /* Both clients match everything, so the sender gets them back */
+  receive_cached_signals (context, sender);
+  receive_cached_signals (context, receiver);
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after cached broadcasts");
+
+  bus_matchmaker_get_rule_stats (matchmaker, bus_receiver,
+                                 &evaluated, &matched);
+  evaluated -= evaluated_before;
+  matched -= matched_before;
+
+  if (evaluated != CACHED_SIGNALS || matched != CACHED_SIGNALS)
+    _dbus_test_fatal ("rule evaluated %lu and matched %lu of %d signals",
+                      (unsigned long) evaluated, (unsigned long) matched,
+                      CACHED_SIGNALS);
+
+  _dbus_test_ok ("%s - cached recipients were accounted to the rule",
+                 _DBUS_FUNCTION_NAME);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+#endif
+
+#ifdef DBUS_UNIX
+/* Sends a method call to the bus driver from @connection and pumps
+ * until the reply arrives, discarding any signals that come first */
+static DBusMessage *
+call_bus_method_pumped (BusContext     *context,
+                        DBusConnection *connection,
+                        const char     *method)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+
+  if (message == NULL || !dbus_connection_send (connection, message, &serial))
+    _dbus_test_fatal ("no memory for %s", method);
+
+  dbus_message_unref (message);
+
+  while (TRUE)
+    {
+      message = pump_until_message (context, connection, method);
+
+      if (dbus_message_get_reply_serial (message) == serial)
+        break;
+
+      if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL)
+        {
+          warn_unexpected (connection, message, "reply to a bus method");
+          _dbus_test_fatal ("unexpected message instead of reply to %s",
+                            method);
+        }
+
+      dbus_message_unref (message);
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, message, "method return");
+      _dbus_test_fatal ("%s failed", method);
+    }
+
+  return message;
+}
+
+dbus_bool_t
+bus_in_process_connection_test (const DBusString *test_data_dir)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  BusContext *context;
+  DBusConnection *client;
+  DBusMessage *reply;
+  DBusString unique_name;
+  const char *name;
+  char **names;
+  int n_names;
+  int i;
+  dbus_bool_t found_self = FALSE;
+  dbus_bool_t found_bus = FALSE;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  client = bus_context_open_in_process_connection (context, &error);
+
+  if (client == NULL)
+    _dbus_test_fatal ("could not open in-process connection: %s",
+                      error.message);
+
+  /* This thread runs the bus loop too, so nothing here may block */
+  reply = call_bus_method_pumped (context, client, "Hello");
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID) ||
+      !dbus_bus_set_unique_name (client, name))
+    _dbus_test_fatal ("bad reply to Hello");
+
+  dbus_message_unref (reply);
+
+  reply = call_bus_method_pumped (context, client, "ListNames");
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &names, &n_names,
+                              DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("bad reply to ListNames: %s", error.message);
+
+  for (i = 0; i < n_names; i++)
+    {
+      if (strcmp (names[i], DBUS_SERVICE_DBUS) == 0)
+        found_bus = TRUE;
+      else if (strcmp (names[i], dbus_bus_get_unique_name (client)) == 0)
+        found_self = TRUE;
+    }
+
+  if (!found_bus || !found_self)
+    _dbus_test_fatal ("ListNames did not list the bus and %s",
+                      dbus_bus_get_unique_name (client));
+
+  dbus_free_string_array (names);
+  dbus_message_unref (reply);
+
+  _dbus_test_ok ("%s - in-process client %s said Hello and listed names",
+                 _DBUS_FUNCTION_NAME, dbus_bus_get_unique_name (client));
+
+  if (!_dbus_string_init (&unique_name) ||
+      !_dbus_string_append (&unique_name, dbus_bus_get_unique_name (client)))
+    _dbus_test_fatal ("no memory for unique name");
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+
+  /* The bus notices the other end of the socket pair closing */
+  for (i = 0;
+       bus_registry_lookup (bus_context_get_registry (context),
+                            &unique_name) != NULL;
+       i++)
+    {
+      if (i >= 100000)
+        _dbus_test_fatal ("the bus did not notice the client going away");
+
+      bus_test_run_bus_loop (context, FALSE);
+    }
+
+  _dbus_string_free (&unique_name);
+  bus_context_unref (context);
+
+  return TRUE;
+}
+#endif
+
+#ifdef HAVE_UNIX_FD_PASSING
+
+dbus_bool_t
+bus_unix_fds_passing_test(const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bar;
+  DBusError error;
+  DBusMessage *m;
+  DBusSocket one[2], two[2];
+  int x, y, z;
+  char r;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_test_fatal ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_test_fatal ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_test_fatal ("hello message failed");
+
+  if (!check_add_match (context, foo, ""))
+    _dbus_test_fatal ("AddMatch message failed");
+
+  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (bar == NULL)
+    _dbus_test_fatal ("could not alloc connection");
+
+  if (!bus_setup_debug_client (bar))
+    _dbus_test_fatal ("could not set up connection");
+
+  spin_connection_until_authenticated (context, bar);
+
+  if (!check_hello_message (context, bar))
+    _dbus_test_fatal ("hello message failed");
+
+  if (!check_add_match (context, bar, ""))
+    _dbus_test_fatal ("AddMatch message failed");
+
+  if (!(m = dbus_message_new_signal("/", "a.b.c", "d")))
+    _dbus_test_fatal ("could not alloc message");
+
+  if (!(_dbus_socketpair (one, one+1, TRUE, &error)))
+    _dbus_test_fatal ("Failed to allocate pipe #1");
+
+  if (!(_dbus_socketpair (two, two+1, TRUE, &error)))
+    _dbus_test_fatal ("Failed to allocate pipe #2");
+
+  if (!dbus_message_append_args(m,
+                                DBUS_TYPE_UNIX_FD, one,
+                                DBUS_TYPE_UNIX_FD, two,
+                                DBUS_TYPE_UNIX_FD, two,
+                                DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("Failed to attach fds.");
+
+  if (!_dbus_close_socket (one[0], &error))
+    _dbus_test_fatal ("Failed to close pipe #1 ");
+  if (!_dbus_close_socket (two[0], &error))
+    _dbus_test_fatal ("Failed to close pipe #2 ");
+
+  if (!(dbus_connection_can_send_type(foo, DBUS_TYPE_UNIX_FD)))
+    _dbus_test_fatal ("Connection cannot do fd passing");
+
+  if (!(dbus_connection_can_send_type(bar, DBUS_TYPE_UNIX_FD)))
+    _dbus_test_fatal ("Connection cannot do fd passing");
+
+  if (!dbus_connection_send (foo, m, NULL))
+    _dbus_test_fatal ("Failed to send fds");
+
+  dbus_message_unref(m);
+
+  bus_test_run_clients_loop (SEND_PENDING (foo));
+
+  bus_test_run_everything (context);
+
+  block_connection_until_message_from_bus (context, foo, "unix fd reception on foo");
+
+  if (!(m = pop_message_waiting_for_memory (foo)))
+    _dbus_test_fatal ("Failed to receive msg");
+
+  if (!dbus_message_is_signal(m, "a.b.c", "d"))
+    _dbus_test_fatal ("bogus message received");
+
+  dbus_message_unref(m);
+
+  block_connection_until_message_from_bus (context, bar, "unix fd reception on bar");
+
+  if (!(m = pop_message_waiting_for_memory (bar)))
+    _dbus_test_fatal ("Failed to receive msg");
+
+  if (!dbus_message_is_signal(m, "a.b.c", "d"))
+    _dbus_test_fatal ("bogus message received");
+
+  if (!dbus_message_get_args(m,
+                             &error,
+                             DBUS_TYPE_UNIX_FD, &x,
+                             DBUS_TYPE_UNIX_FD, &y,
+                             DBUS_TYPE_UNIX_FD, &z,
+                             DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("Failed to parse fds.");
+
+  dbus_message_unref(m);
+
+  if (write(x, "X", 1) != 1)
+    _dbus_test_fatal ("Failed to write to pipe #1");
+  if (write(y, "Y", 1) != 1)
+    _dbus_test_fatal ("Failed to write to pipe #2");
+  if (write(z, "Z", 1) != 1)
+    _dbus_test_fatal ("Failed to write to pipe #2/2nd fd");
+
+  if (!_dbus_close(x, &error))
+    _dbus_test_fatal ("Failed to close pipe #1/other side ");
+  if (!_dbus_close(y, &error))
+    _dbus_test_fatal ("Failed to close pipe #2/other side ");
+  if (!_dbus_close(z, &error))
+    _dbus_test_fatal ("Failed to close pipe #2/other size 2nd fd ");
+
+  if (read(one[1].fd, &r, 1) != 1 || r != 'X')
+    _dbus_test_fatal ("Failed to read value from pipe.");
+  if (read(two[1].fd, &r, 1) != 1 || r != 'Y')
+    _dbus_test_fatal ("Failed to read value from pipe.");
+  if (read(two[1].fd, &r, 1) != 1 || r != 'Z')
+    _dbus_test_fatal ("Failed to read value from pipe.");
+
+  if (!_dbus_close_socket (one[1], &error))
+    _dbus_test_fatal ("Failed to close pipe #1 ");
+  if (!_dbus_close_socket (two[1], &error))
+    _dbus_test_fatal ("Failed to close pipe #2 ");
+
+  _dbus_verbose ("Disconnecting foo\n");
+  kill_client_connection_unchecked (foo);
+
+  _dbus_verbose ("Disconnecting bar\n");
+  kill_client_connection_unchecked (bar);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+static DBusMessage *
+new_open_peer_connection_call (const char *name,
+                               int         fd)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "OpenPeerConnection");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for OpenPeerConnection");
+
+  return message;
+}
+
+static void
+check_open_peer_connection_refused (BusContext     *context,
+                                    DBusConnection *connection,
+                                    const char     *name,
+                                    int             fd,
+                                    const char     *expected_error)
+{
+  DBusMessage *message, *reply;
+
+  message = new_open_peer_connection_call (name, fd);
+  reply = call_bus_method (context, connection, message);
+
+  if (!dbus_message_is_error (reply, expected_error))
+    {
+      warn_unexpected (connection, reply, expected_error);
+      _dbus_test_fatal ("OpenPeerConnection to %s was not refused with %s",
+                        name, expected_error);
+    }
+
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+}
+
+dbus_bool_t
+bus_peer_connection_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bar;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *message, *reply;
+  DBusSocket fds[2];
+  const char *bar_name;
+  const char *initiator;
+  dbus_bool_t accept = TRUE;
+  int fd;
+  char r;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_test_fatal ("could not alloc context");
+
+  foo = open_test_client (context);
+  bar = open_test_client (context);
+  bar_name = dbus_bus_get_unique_name (bar);
+
+  if (!_dbus_socketpair (&fds[0], &fds[1], TRUE, &error))
+    _dbus_test_fatal ("Failed to allocate socketpair: %s", error.message);
+
+  /* bar has not called AcceptPeerConnections yet */
+  check_open_peer_connection_refused (context, foo, bar_name, fds[1].fd,
+                                      DBUS_ERROR_ACCESS_DENIED);
+  check_open_peer_connection_refused (context, foo,
+                                      dbus_bus_get_unique_name (foo),
+                                      fds[1].fd, DBUS_ERROR_INVALID_ARGS);
+  check_open_peer_connection_refused (context, foo, "com.example.Nobody",
+                                      fds[1].fd,
+                                      DBUS_ERROR_NAME_HAS_NO_OWNER);
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("refused peer connections were offered anyway");
+
+  _dbus_test_ok ("%s - refused without AcceptPeerConnections",
+                 _DBUS_FUNCTION_NAME);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "AcceptPeerConnections");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_BOOLEAN, &accept,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for AcceptPeerConnections");
+
+  reply = call_bus_method (context, bar, message);
+
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (bar, reply, "method return");
+      _dbus_test_fatal ("AcceptPeerConnections failed");
+    }
+
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+
+  /* foo keeps fds[0] and hands fds[1] to bar through the bus */
+  message = new_open_peer_connection_call (bar_name, fds[1].fd);
+  reply = call_bus_method (context, foo, message);
+
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (foo, reply, "method return");
+      _dbus_test_fatal ("OpenPeerConnection failed");
+    }
+
+  dbus_message_unref (reply);
+  dbus_message_unref (message);
+
+  if (!_dbus_close_socket (fds[1], &error))
+    _dbus_test_fatal ("Failed to close the peer's end");
+
+  block_connection_until_message_from_bus (context, bar,
+                                           "PeerConnectionOffered");
+
+  if (!(message = pop_message_waiting_for_memory (bar)))
+    _dbus_test_fatal ("Failed to receive PeerConnectionOffered");
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "PeerConnectionOffered") ||
+      !dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &initiator,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    {
+      warn_unexpected (bar, message, "PeerConnectionOffered");
+      _dbus_test_fatal ("bogus PeerConnectionOffered received");
+    }
+
+  if (strcmp (initiator, dbus_bus_get_unique_name (foo)) != 0)
+    _dbus_test_fatal ("PeerConnectionOffered came from %s, not %s",
+                      initiator, dbus_bus_get_unique_name (foo));
+
+  dbus_message_unref (message);
+
+  /* bar's fd is the other end of the socket that foo kept */
+  if (write (fd, "X", 1) != 1)
+    _dbus_test_fatal ("Failed to write to the offered socket");
+  if (read (fds[0].fd, &r, 1) != 1 || r != 'X')
+    _dbus_test_fatal ("Offered socket is not connected to the initiator's");
+
+  if (!_dbus_close (fd, &error))
+    _dbus_test_fatal ("Failed to close the offered socket");
+  if (!_dbus_close_socket (fds[0], &error))
+    _dbus_test_fatal ("Failed to close the initiator's end");
+
+  if (!check_no_leftovers (context))
+    _dbus_test_fatal ("messages left over after a peer connection");
+
+  _dbus_test_ok ("%s - offered after AcceptPeerConnections",
+                 _DBUS_FUNCTION_NAME);
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
   bus_context_unref (context);
 
   return TRUE;
@@ -37,6 +37,8 @@
 
 #include <dbus/dbus-asv-util.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message.h>
@@ -44,6 +46,10 @@
 #include <dbus/dbus-marshal-validate.h>
 #include <string.h>
 
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
 static inline const char *
 nonnull (const char *maybe_null,
          const char *if_null)
@@ -379,66 +385,6 @@ bus_driver_send_service_acquired (DBusConnection *connection,
     }
 }
 
-static dbus_bool_t
-create_unique_client_name (BusRegistry *registry,
-                           DBusString  *str)
-{
-  /* We never want to use the same unique client name twice, because
-   * we want to guarantee that if you send a message to a given unique
-   * name, you always get the same application. So we use two numbers
-   * for INT_MAX * INT_MAX combinations, should be pretty safe against
-   * wraparound.
-   */
-  /* FIXME these should be in BusRegistry rather than static vars */
-  static int next_major_number = 0;
-  static int next_minor_number = 0;
-  int len;
-
-  len = _dbus_string_get_length (str);
-
-  while (TRUE)
-    {
-      /* start out with 1-0, go to 1-1, 1-2, 1-3,
-       * up to 1-MAXINT, then 2-0, 2-1, etc.
-       */
-      if (next_minor_number <= 0)
-        {
-          next_major_number += 1;
-          next_minor_number = 0;
-          if (next_major_number <= 0)
-            _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
-        }
-
-      _dbus_assert (next_major_number > 0);
-      _dbus_assert (next_minor_number >= 0);
-
-      /* appname:MAJOR-MINOR */
-
-      if (!_dbus_string_append (str, ":"))
-        return FALSE;
-
-      if (!_dbus_string_append_int (str, next_major_number))
-        return FALSE;
-
-      if (!_dbus_string_append (str, "."))
-        return FALSE;
-
-      if (!_dbus_string_append_int (str, next_minor_number))
-        return FALSE;
-
-      next_minor_number += 1;
-
-      /* Check if a client with the name exists */
-      if (bus_registry_lookup (registry, str) == NULL)
-	break;
-
-      /* drop the number again, try the next one. */
-      _dbus_string_set_length (str, len);
-    }
-
-  return TRUE;
-}
-
 static dbus_bool_t
 bus_driver_handle_hello (DBusConnection *connection,
                          BusTransaction *transaction,
@@ -446,6 +392,8 @@ bus_driver_handle_hello (DBusConnection *connection,
                          DBusError      *error)
 {
   DBusString unique_name;
+  /* room for ":" plus two ints and a "." */
+  char unique_name_buffer[32];
   BusService *service;
   dbus_bool_t retval;
   BusRegistry *registry;
@@ -486,17 +434,14 @@ bus_driver_handle_hello (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!_dbus_string_init (&unique_name))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  _dbus_string_init_with_buffer (&unique_name, unique_name_buffer,
+                                 sizeof (unique_name_buffer));
 
   retval = FALSE;
 
   registry = bus_connection_get_registry (connection);
 
-  if (!create_unique_client_name (registry, &unique_name))
+  if (!bus_registry_new_unique_name (registry, &unique_name))
     {
       BUS_SET_OOM (error);
       goto out_0;
@@ -763,6 +708,199 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
     }
 }
 
+/* The most names a single ListNamesPaged or ListActivatableNamesPaged
+ * reply carries, whatever the caller asked for */
+#define MAX_NAMES_PER_PAGE 4096
+
+/*
+ * One page of names, in strcmp() order: the first max_names names that
+ * start with prefix and sort after cursor. We keep one name more than
+ * we return, to know whether there is another page.
+ */
+typedef struct
+{
+  const char *prefix;
+  size_t prefix_len;
+  const char *cursor;
+  const char **names;   /* borrowed from the registry or activation */
+  int n_names;
+  int max_names;
+} NamePage;
+
+static void
+name_page_consider (const char *name,
+                    void       *data)
+{
+  NamePage *page = data;
+  int lo, hi;
+
+  if (strncmp (name, page->prefix, page->prefix_len) != 0)
+    return;
+
+  if (page->cursor[0] != '\0' && strcmp (name, page->cursor) <= 0)
+    return;
+
+  if (page->n_names == page->max_names + 1 &&
+      strcmp (name, page->names[page->n_names - 1]) >= 0)
+    return;
+
+  lo = 0;
+  hi = page->n_names;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (strcmp (page->names[mid], name) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (page->n_names == page->max_names + 1)
+    page->n_names--;
+
+  memmove (page->names + lo + 1, page->names + lo,
+           (page->n_names - lo) * sizeof (const char *));
+  page->names[lo] = name;
+  page->n_names++;
+}
+
+static void
+name_page_consider_service (BusService *service,
+                            void       *data)
+{
+  name_page_consider (bus_service_get_name (service), data);
+}
+
+static dbus_bool_t
+bus_driver_send_name_page (DBusConnection *connection,
+                           BusTransaction *transaction,
+                           DBusMessage    *message,
+                           dbus_bool_t     activatable,
+                           DBusError      *error)
+{
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter;
+  DBusMessageIter sub;
+  NamePage page;
+  dbus_uint32_t max_names;
+  const char *next_cursor;
+  dbus_bool_t more;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &page.prefix,
+                              DBUS_TYPE_STRING, &page.cursor,
+                              DBUS_TYPE_UINT32, &max_names,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (max_names == 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "The maximum number of names must be at least 1");
+      return FALSE;
+    }
+
+  if (max_names > MAX_NAMES_PER_PAGE)
+    max_names = MAX_NAMES_PER_PAGE;
+
+  page.prefix_len = strlen (page.prefix);
+  page.max_names = max_names;
+  page.n_names = 0;
+  page.names = dbus_new (const char *, page.max_names + 1);
+
+  if (page.names == NULL)
+    goto oom;
+
+  if (activatable)
+    {
+      bus_activation_foreach_name (bus_connection_get_activation (connection),
+                                   name_page_consider, &page);
+    }
+  else
+    {
+      bus_registry_foreach (bus_connection_get_registry (connection),
+                            name_page_consider_service, &page);
+    }
+
+  /* Include the bus driver in the list, as ListNames does */
+  name_page_consider (DBUS_SERVICE_DBUS, &page);
+
+  more = (page.n_names > page.max_names);
+
+  if (more)
+    page.n_names = page.max_names;
+
+  next_cursor = more ? page.names[page.n_names - 1] : "";
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &sub))
+    goto oom;
+
+  for (i = 0; i < page.n_names; i++)
+    {
+      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                           &page.names[i]))
+        {
+          dbus_message_iter_abandon_container (&iter, &sub);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub) ||
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING,
+                                       &next_cursor))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_free (page.names);
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  dbus_free (page.names);
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_list_services_paged (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  return bus_driver_send_name_page (connection, transaction, message,
+                                    FALSE, error);
+}
+
+static dbus_bool_t
+bus_driver_handle_list_activatable_services_paged (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error)
+{
+  return bus_driver_send_name_page (connection, transaction, message,
+                                    TRUE, error);
+}
+
 static dbus_bool_t
 bus_driver_handle_acquire_service (DBusConnection *connection,
                                    BusTransaction *transaction,
@@ -800,7 +938,7 @@ bus_driver_handle_acquire_service (DBusConnection *connection,
                                      error))
     goto out;
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     {
       BUS_SET_OOM (error);
@@ -861,7 +999,7 @@ bus_driver_handle_release_service (DBusConnection *connection,
                                      transaction, error))
     goto out;
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     {
       BUS_SET_OOM (error);
@@ -924,7 +1062,7 @@ bus_driver_handle_service_exists (DBusConnection *connection,
       service_exists = service != NULL;
     }
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     {
       BUS_SET_OOM (error);
@@ -1006,7 +1144,7 @@ bus_driver_send_ack_reply (DBusConnection *connection,
   if (dbus_message_get_no_reply (message))
     return TRUE;
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     {
       BUS_SET_OOM (error);
@@ -1399,6 +1537,130 @@ bus_driver_handle_add_match (DBusConnection *connection,
   return FALSE;
 }
 
+/* AddMatches is AddMatch for an array of rules. All of them are parsed and
+ * checked before any is added, so either the whole batch takes effect or
+ * none of it does.
+ */
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  BusMatchRule **rules;
+  char **texts;
+  const char *bustype;
+  BusMatchmaker *matchmaker;
+  int n_texts, n_parsed, n_added;
+  int limit;
+  int i;
+  BusContext *context;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  rules = NULL;
+  n_texts = 0;
+  n_parsed = 0;
+  n_added = 0;
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to AddMatches\n");
+      goto failed;
+    }
+
+  context = bus_transaction_get_context (transaction);
+  limit = bus_context_get_max_match_rules_per_connection (context);
+
+  if (n_texts > limit - bus_connection_get_n_match_rules (connection))
+    {
+      DBusError tmp_error;
+
+      dbus_error_init (&tmp_error);
+      dbus_set_error (&tmp_error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Connection \"%s\" is not allowed to add %d more match "
+                      "rules (increase limits in configuration file if "
+                      "required; max_match_rules_per_connection=%d)",
+                      bus_connection_is_active (connection) ?
+                      bus_connection_get_name (connection) :
+                      "(inactive)",
+                      n_texts, limit);
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING, "%s",
+                       tmp_error.message);
+      dbus_move_error (&tmp_error, error);
+      goto failed;
+    }
+
+  rules = dbus_new0 (BusMatchRule *, n_texts + 1);
+
+  if (rules == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  bustype = bus_context_get_type (context);
+
+  while (n_parsed < n_texts)
+    {
+      BusMatchRule *rule;
+      DBusString str;
+
+      _dbus_string_init_const (&str, texts[n_parsed]);
+
+      rule = bus_match_rule_parse (connection, &str, error);
+      if (rule == NULL)
+        goto failed;
+
+      rules[n_parsed++] = rule;
+
+      if (bus_match_rule_get_client_is_eavesdropping (rule) &&
+          (!bus_driver_check_caller_is_privileged (connection,
+                                                   transaction,
+                                                   message,
+                                                   error) ||
+           !bus_apparmor_allows_eavesdropping (connection, bustype, error)))
+        goto failed;
+    }
+
+  for (n_added = 0; n_added < n_parsed; n_added++)
+    {
+      if (!bus_matchmaker_add_rule (matchmaker, rules[n_added]))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  if (!bus_driver_send_ack_reply (connection, transaction, message, error))
+    goto failed;
+
+  for (i = 0; i < n_parsed; i++)
+    bus_match_rule_unref (rules[i]);
+
+  dbus_free (rules);
+  dbus_free_string_array (texts);
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  for (i = 0; i < n_added; i++)
+    bus_matchmaker_remove_rule (matchmaker, rules[i]);
+
+  for (i = 0; i < n_parsed; i++)
+    bus_match_rule_unref (rules[i]);
+
+  dbus_free (rules);
+  dbus_free_string_array (texts);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_remove_match (DBusConnection *connection,
                                 BusTransaction *transaction,
@@ -1507,7 +1769,7 @@ bus_driver_handle_get_service_owner (DBusConnection *connection,
 
   _dbus_assert (base_name != NULL);
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     goto oom;
 
@@ -1589,7 +1851,7 @@ bus_driver_handle_list_queued_owners (DBusConnection *connection,
 
   _dbus_assert (base_names != NULL);
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     goto oom;
 
@@ -1683,7 +1945,7 @@ bus_driver_handle_get_connection_unix_user (DBusConnection *connection,
       goto failed;
     }
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     goto oom;
 
@@ -1752,7 +2014,7 @@ bus_driver_handle_get_connection_unix_process_id (DBusConnection *connection,
       goto failed;
     }
 
-  reply = dbus_message_new_method_return (message);
+  reply = bus_connection_new_driver_reply (connection, message, NULL);
   if (reply == NULL)
     goto oom;
 
@@ -1912,7 +2174,8 @@ bus_driver_fill_connection_credentials (DBusConnection  *conn,
                                         DBusMessageIter *asv_iter)
 {
   unsigned long ulong_uid, ulong_pid;
-  char *s;
+  DBusCredentials *credentials = NULL;
+  const char *s;
   const char *path;
 
   if (conn == NULL)
@@ -1922,11 +2185,22 @@ bus_driver_fill_connection_credentials (DBusConnection  *conn,
     }
   else
     {
-      if (!dbus_connection_get_unix_process_id (conn, &ulong_pid))
-        ulong_pid = DBUS_PID_UNSET;
+      /* Everything we report was captured once, when the connection
+       * authenticated, and doesn't change after that; so read it all from
+       * the same object instead of locking the connection and copying
+       * strings for each item. */
+      credentials = _dbus_connection_get_credentials (conn);
 
-      if (!dbus_connection_get_unix_user (conn, &ulong_uid))
-        ulong_uid = DBUS_UID_UNSET;
+      if (credentials != NULL)
+        {
+          ulong_pid = _dbus_credentials_get_pid (credentials);
+          ulong_uid = _dbus_credentials_get_unix_uid (credentials);
+        }
+      else
+        {
+          ulong_pid = DBUS_PID_UNSET;
+          ulong_uid = DBUS_UID_UNSET;
+        }
     }
 
   /* we can't represent > 32-bit pids; if your system needs them, please
@@ -1942,46 +2216,29 @@ bus_driver_fill_connection_credentials (DBusConnection  *conn,
     return FALSE;
 
   /* FIXME: Obtain the Windows user of the bus daemon itself */
-  if (conn != NULL &&
-      dbus_connection_get_windows_user (conn, &s))
+  if (credentials != NULL &&
+      (s = _dbus_credentials_get_windows_sid (credentials)) != NULL)
     {
       DBusString str;
       dbus_bool_t result;
 
-      if (s == NULL)
-        return FALSE;
-
       _dbus_string_init_const (&str, s);
       result = _dbus_validate_utf8 (&str, 0, _dbus_string_get_length (&str));
       _dbus_string_free (&str);
-      if (result)
-        {
-          if (!_dbus_asv_add_string (asv_iter, "WindowsSID", s))
-            {
-              dbus_free (s);
-              return FALSE;
-            }
-        }
-      dbus_free (s);
+
+      if (result && !_dbus_asv_add_string (asv_iter, "WindowsSID", s))
+        return FALSE;
     }
 
   /* FIXME: Obtain the security label for the bus daemon itself */
-  if (conn != NULL &&
-      _dbus_connection_get_linux_security_label (conn, &s))
+  if (credentials != NULL &&
+      (s = _dbus_credentials_get_linux_security_label (credentials)) != NULL)
     {
-      if (s == NULL)
-        return FALSE;
-
       /* use the GVariant bytestring convention for strings of unknown
        * encoding: include the \0 in the payload, for zero-copy reading */
       if (!_dbus_asv_add_byte_array (asv_iter, "LinuxSecurityLabel",
                                      s, strlen (s) + 1))
-        {
-          dbus_free (s);
-          return FALSE;
-        }
-
-      dbus_free (s);
+        return FALSE;
     }
 
   if (conn != NULL &&
@@ -2035,8 +2292,26 @@ bus_driver_handle_get_connection_credentials (DBusConnection *connection,
   reply = _dbus_asv_new_method_return (message, &reply_iter, &array_iter);
 
   if (reply == NULL ||
-      !bus_driver_fill_connection_credentials (conn, &array_iter) ||
-      !_dbus_asv_close (&reply_iter, &array_iter))
+      !bus_driver_fill_connection_credentials (conn, &array_iter))
+    goto oom;
+
+  /* A pidfd lets the caller talk about the process without racing
+   * against process ID reuse, but we can only hand it to callers that
+   * are able to receive file descriptors */
+  if (conn != NULL &&
+      dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    {
+      DBusCredentials *credentials = _dbus_connection_get_credentials (conn);
+
+      if (credentials != NULL &&
+          _dbus_credentials_include (credentials,
+                                     DBUS_CREDENTIAL_UNIX_PROCESS_FD) &&
+          !_dbus_asv_add_unix_fd (&array_iter, "ProcessFD",
+                                  _dbus_credentials_get_pid_fd (credentials)))
+        goto oom;
+    }
+
+  if (!_dbus_asv_close (&reply_iter, &array_iter))
     goto oom;
 
   if (! bus_transaction_send_from_driver (transaction, connection, reply))
@@ -2226,10 +2501,229 @@ bus_driver_handle_get_id (DBusConnection *connection,
 }
 
 static dbus_bool_t
-bus_driver_handle_become_monitor (DBusConnection *connection,
-                                  BusTransaction *transaction,
-                                  DBusMessage    *message,
-                                  DBusError      *error)
+bus_driver_handle_accept_peer_connections (DBusConnection *connection,
+                                           BusTransaction *transaction,
+                                           DBusMessage    *message,
+                                           DBusError      *error)
+{
+  dbus_bool_t accept;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_BOOLEAN, &accept,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!bus_driver_send_ack_reply (connection, transaction, message, error))
+    return FALSE;
+
+  bus_connection_set_accepts_peer_connections (connection, accept);
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_coalesce_signals (DBusConnection *connection,
+                                    BusTransaction *transaction,
+                                    DBusMessage    *message,
+                                    DBusError      *error)
+{
+  dbus_uint32_t queued_bytes;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_UINT32, &queued_bytes,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!bus_driver_send_ack_reply (connection, transaction, message, error))
+    return FALSE;
+
+  bus_connection_set_coalesce_signals (connection, queued_bytes);
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_prioritize_replies (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  dbus_bool_t enable;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_BOOLEAN, &enable,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!bus_driver_send_ack_reply (connection, transaction, message, error))
+    return FALSE;
+
+  _dbus_connection_set_replies_first (connection, enable);
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_driver_handle_enable_flow_control (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  dbus_bool_t enable;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_BOOLEAN, &enable,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!bus_driver_send_ack_reply (connection, transaction, message, error))
+    return FALSE;
+
+  if (!bus_connection_set_flow_control (connection, enable))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Passes the socket that the caller sent us to the owner of a name in
+ * a PeerConnectionOffered signal, so that they can talk to each other
+ * directly. The caller created the socketpair and keeps the other end,
+ * so the peer's credentials for the socket are the caller's rather than
+ * ours. The peer is expected to be the server side of the
+ * authentication handshake.
+ */
+static dbus_bool_t
+bus_driver_handle_open_peer_connection (DBusConnection *connection,
+                                        BusTransaction *transaction,
+                                        DBusMessage    *message,
+                                        DBusError      *error)
+{
+  DBusConnection *peer;
+  DBusMessage *probe = NULL;
+  DBusMessage *offer = NULL;
+  const char *name;
+  const char *caller_name;
+  int fd = -1;
+  dbus_bool_t retval = FALSE;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  switch (bus_driver_get_conn_helper (connection, message, "peer connection",
+                                      &name, &peer, error))
+    {
+      case BUS_DRIVER_FOUND_PEER:
+        break;
+
+      case BUS_DRIVER_FOUND_SELF:
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "%s cannot be connected to directly", DBUS_SERVICE_DBUS);
+        return FALSE;
+
+      case BUS_DRIVER_FOUND_ERROR:
+        /* fall through */
+      default:
+        return FALSE;
+    }
+
+  if (peer == connection)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Cannot open a peer connection to ourselves");
+      return FALSE;
+    }
+
+  if (!bus_connection_get_accepts_peer_connections (peer))
+    {
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "The owner of \"%s\" does not accept peer connections",
+                      name);
+      return FALSE;
+    }
+
+  if (!dbus_connection_can_send_type (peer, DBUS_TYPE_UNIX_FD))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "The owner of \"%s\" cannot receive Unix fds, so it "
+                      "cannot accept peer connections", name);
+      return FALSE;
+    }
+
+  caller_name = bus_connection_get_name (connection);
+
+  /* A peer connection bypasses the bus, so only allow it if the
+   * policy would let the caller send the peer this method call */
+  probe = dbus_message_new_method_call (name, DBUS_PATH_DBUS,
+                                        DBUS_INTERFACE_DBUS,
+                                        "OpenPeerConnection");
+
+  if (probe == NULL || !dbus_message_set_sender (probe, caller_name))
+    goto oom;
+
+  /* It is never sent, so the peer must not be expected to reply */
+  dbus_message_set_no_reply (probe, TRUE);
+
+  if (!bus_context_check_security_policy (bus_transaction_get_context (transaction),
+                                          transaction, connection, peer, peer,
+                                          probe, NULL, error))
+    goto out;
+
+  /* The name was checked by bus_driver_get_conn_helper() */
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    goto out;
+
+  offer = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                   "PeerConnectionOffered");
+
+  if (offer == NULL ||
+      !dbus_message_append_args (offer,
+                                 DBUS_TYPE_STRING, &caller_name,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, peer, offer))
+    goto oom;
+
+  retval = bus_driver_send_ack_reply (connection, transaction, message,
+                                      error);
+  goto out;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ out:
+  /* The offer holds its own duplicate of the fd */
+#ifdef DBUS_UNIX
+  if (fd >= 0)
+    _dbus_close (fd, NULL);
+#endif
+
+  if (probe != NULL)
+    dbus_message_unref (probe);
+
+  if (offer != NULL)
+    dbus_message_unref (offer);
+
+  return retval;
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
 {
   char **match_rules = NULL;
   const char *bustype;
@@ -2256,16 +2750,20 @@ bus_driver_handle_become_monitor (DBusConnection *connection,
         DBUS_TYPE_INVALID))
     goto out;
 
-  if (flags != 0)
+  if ((flags & ~(DBUS_MONITOR_FLAG_HEADERS_ONLY | DBUS_MONITOR_FLAG_LOSSY) &
+       ((1U << DBUS_MONITOR_SAMPLE_SHIFT) - 1)) != 0)
     {
       dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-          "BecomeMonitor does not support any flags yet");
+          "BecomeMonitor does not support flags 0x%x",
+          flags & ~(DBUS_MONITOR_FLAG_HEADERS_ONLY | DBUS_MONITOR_FLAG_LOSSY) &
+          ((1U << DBUS_MONITOR_SAMPLE_SHIFT) - 1));
       goto out;
     }
 
   /* Special case: a zero-length array becomes [""] */
   if (n_match_rules == 0)
     {
+      dbus_free_string_array (match_rules);
       match_rules = dbus_malloc (2 * sizeof (char *));
 
       if (match_rules == NULL)
@@ -2311,7 +2809,8 @@ bus_driver_handle_become_monitor (DBusConnection *connection,
   if (!bus_driver_send_ack_reply (connection, transaction, message, error))
     goto out;
 
-  if (!bus_connection_be_monitor (connection, transaction, &rules, error))
+  if (!bus_connection_be_monitor (connection, transaction, &rules, flags,
+                                  error))
     goto out;
 
   ret = TRUE;
@@ -2462,9 +2961,8 @@ typedef struct
                           DBusMessageIter *variant_iter);
 } PropertyHandler;
 
-/* For speed it might be useful to sort this in order of
- * frequency of use (but doesn't matter with only a few items
- * anyhow)
+/* Method calls are looked up through method_index, so the order of
+ * these tables only matters for introspection
  */
 static const MessageHandler dbus_message_handlers[] = {
   { "Hello",
@@ -2507,11 +3005,26 @@ static const MessageHandler dbus_message_handlers[] = {
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_list_activatable_services,
     METHOD_FLAG_ANY_PATH },
+  { "ListNamesPaged",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_services_paged,
+    METHOD_FLAG_ANY_PATH },
+  { "ListActivatableNamesPaged",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_activatable_services_paged,
+    METHOD_FLAG_ANY_PATH },
   { "AddMatch",
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_add_match,
     METHOD_FLAG_ANY_PATH },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_add_matches,
+    METHOD_FLAG_ANY_PATH },
   { "RemoveMatch",
     DBUS_TYPE_STRING_AS_STRING,
     "",
@@ -2560,6 +3073,31 @@ static const MessageHandler dbus_message_handlers[] = {
   { "GetConnectionCredentials", "s", "a{sv}",
     bus_driver_handle_get_connection_credentials,
     METHOD_FLAG_ANY_PATH },
+  { "AcceptPeerConnections",
+    DBUS_TYPE_BOOLEAN_AS_STRING,
+    "",
+    bus_driver_handle_accept_peer_connections,
+    METHOD_FLAG_NO_CONTAINERS },
+  { "OpenPeerConnection",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UNIX_FD_AS_STRING,
+    "",
+    bus_driver_handle_open_peer_connection,
+    METHOD_FLAG_NO_CONTAINERS },
+  { "EnableFlowControl",
+    DBUS_TYPE_BOOLEAN_AS_STRING,
+    "",
+    bus_driver_handle_enable_flow_control,
+    METHOD_FLAG_NONE },
+  { "CoalesceSignals",
+    DBUS_TYPE_UINT32_AS_STRING,
+    "",
+    bus_driver_handle_coalesce_signals,
+    METHOD_FLAG_NONE },
+  { "PrioritizeReplies",
+    DBUS_TYPE_BOOLEAN_AS_STRING,
+    "",
+    bus_driver_handle_prioritize_replies,
+    METHOD_FLAG_NONE },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -2630,6 +3168,12 @@ static const MessageHandler stats_message_handlers[] = {
     METHOD_FLAG_NO_CONTAINERS },
   { "GetAllMatchRules", "", "a{sas}", bus_stats_handle_get_all_match_rules,
     METHOD_FLAG_NO_CONTAINERS },
+  { "GetAllMatchRuleStats", "", "a{sa(stt)}",
+    bus_stats_handle_get_all_match_rule_stats, METHOD_FLAG_NO_CONTAINERS },
+  { "GetTopTalkers", "", "a(sssttt)", bus_stats_handle_get_top_talkers,
+    METHOD_FLAG_NO_CONTAINERS },
+  { "GetPolicyStats", "", "a{sv}", bus_stats_handle_get_policy_stats,
+    METHOD_FLAG_NO_CONTAINERS },
   { NULL, NULL, NULL, NULL }
 };
 #endif
@@ -2665,8 +3209,8 @@ typedef struct {
   const PropertyHandler *property_handlers;
 } InterfaceHandler;
 
-/* These should ideally be sorted by frequency of use, although it
- * probably doesn't matter with this few items */
+/* A method call with no interface goes to the first interface in this
+ * list that has a method of that name */
 static InterfaceHandler interface_handlers[] = {
   { DBUS_INTERFACE_DBUS, dbus_message_handlers,
     "    <signal name=\"NameOwnerChanged\">\n"
@@ -2679,6 +3223,14 @@ static InterfaceHandler interface_handlers[] = {
     "    </signal>\n"
     "    <signal name=\"NameAcquired\">\n"
     "      <arg type=\"s\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"PeerConnectionOffered\">\n"
+    "      <arg type=\"s\" name=\"initiator\"/>\n"
+    "      <arg type=\"h\" name=\"fd\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"FlowControl\">\n"
+    "      <arg type=\"b\" name=\"throttled\"/>\n"
+    "      <arg type=\"t\" name=\"queued_bytes\"/>\n"
     "    </signal>\n",
     /* Not in the Interfaces property because if you can get the properties
      * of the o.fd.DBus interface, then you certainly have the o.fd.DBus
@@ -2700,7 +3252,10 @@ static InterfaceHandler interface_handlers[] = {
      * feature in the same way as e.g. Monitoring.
      * Available at all paths so tools like d-feet can start from "/". */
     INTERFACE_FLAG_ANY_PATH | INTERFACE_FLAG_UNINTERESTING },
-  { DBUS_INTERFACE_MONITORING, monitoring_message_handlers, NULL,
+  { DBUS_INTERFACE_MONITORING, monitoring_message_handlers,
+    "    <signal name=\"MessagesDropped\">\n"
+    "      <arg type=\"u\" name=\"count\"/>\n"
+    "    </signal>\n",
     INTERFACE_FLAG_NONE },
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   { DBUS_INTERFACE_VERBOSE, verbose_message_handlers, NULL,
@@ -2725,6 +3280,106 @@ static InterfaceHandler interface_handlers[] = {
   { NULL, NULL, NULL }
 };
 
+/* An entry in method_index: one method of one interface. Entries with
+ * the same member name are chained in the order of interface_handlers,
+ * which is the order in which they must be considered when a method
+ * call does not specify an interface. */
+typedef struct DriverMethod DriverMethod;
+
+struct DriverMethod
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  DriverMethod *next;
+};
+
+/* Member name => first DriverMethod with that name */
+static DBusHashTable *method_index = NULL;
+static DriverMethod *method_index_entries = NULL;
+
+static void
+method_index_shutdown (void *data)
+{
+  _dbus_hash_table_unref (method_index);
+  method_index = NULL;
+  dbus_free (method_index_entries);
+  method_index_entries = NULL;
+}
+
+/* Build method_index the first time it is needed. The handler tables
+ * are constant, so it never has to change after that. */
+static dbus_bool_t
+method_index_init (void)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  DriverMethod *entry;
+  int n_methods;
+
+  if (method_index != NULL)
+    return TRUE;
+
+  n_methods = 0;
+
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        n_methods++;
+    }
+
+  method_index = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  method_index_entries = dbus_new0 (DriverMethod, n_methods);
+
+  if (method_index == NULL || method_index_entries == NULL)
+    goto failed;
+
+  entry = method_index_entries;
+
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          DriverMethod *first;
+
+          entry->ih = ih;
+          entry->mh = mh;
+
+          first = _dbus_hash_table_lookup_string (method_index, mh->name);
+
+          if (first == NULL)
+            {
+              if (!_dbus_hash_table_insert_string (method_index,
+                                                   (char *) mh->name,
+                                                   entry))
+                goto failed;
+            }
+          else
+            {
+              while (first->next != NULL)
+                first = first->next;
+
+              first->next = entry;
+            }
+
+          entry++;
+        }
+    }
+
+  if (!_dbus_register_shutdown_func (method_index_shutdown, NULL))
+    goto failed;
+
+  return TRUE;
+
+failed:
+  if (method_index != NULL)
+    _dbus_hash_table_unref (method_index);
+
+  method_index = NULL;
+  dbus_free (method_index_entries);
+  method_index_entries = NULL;
+  return FALSE;
+}
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -2923,6 +3578,7 @@ bus_driver_handle_message (DBusConnection *connection,
   const char *name, *interface;
   const InterfaceHandler *ih;
   const MessageHandler *mh;
+  const DriverMethod *method;
   dbus_bool_t found_interface = FALSE;
   dbus_bool_t is_canonical_path;
 
@@ -2992,87 +3648,102 @@ bus_driver_handle_message (DBusConnection *connection,
 
   is_canonical_path = dbus_message_has_path (message, DBUS_PATH_DBUS);
 
-  for (ih = interface_handlers; ih->name != NULL; ih++)
+  if (!method_index_init ())
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  for (method = _dbus_hash_table_lookup_string (method_index, name);
+       method != NULL;
+       method = method->next)
     {
+      ih = method->ih;
+      mh = method->mh;
+
       if (!(is_canonical_path || (ih->flags & INTERFACE_FLAG_ANY_PATH)))
         continue;
 
       if (interface != NULL && strcmp (interface, ih->name) != 0)
         continue;
 
-      found_interface = TRUE;
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+      if (mh->flags & METHOD_FLAG_PRIVILEGED)
         {
-          if (strcmp (mh->name, name) != 0)
-            continue;
-
-          _dbus_verbose ("Found driver handler for %s\n", name);
-
-          if (mh->flags & METHOD_FLAG_PRIVILEGED)
+          if (!bus_driver_check_caller_is_privileged (connection,
+                                                      transaction, message,
+                                                      error))
             {
-              if (!bus_driver_check_caller_is_privileged (connection,
-                                                          transaction, message,
-                                                          error))
-                {
-                  _DBUS_ASSERT_ERROR_IS_SET (error);
-                  return FALSE;
-                }
-            }
-          else if (mh->flags & METHOD_FLAG_NO_CONTAINERS)
-            {
-              if (!bus_driver_check_caller_is_not_container (connection,
-                                                             transaction,
-                                                             message, error))
-                {
-                  _DBUS_ASSERT_ERROR_IS_SET (error);
-                  return FALSE;
-                }
-            }
-
-          if (!(is_canonical_path || (mh->flags & METHOD_FLAG_ANY_PATH)))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                  "Method '%s' is only available at the canonical object path '%s'",
-                  dbus_message_get_member (message), DBUS_PATH_DBUS);
               _DBUS_ASSERT_ERROR_IS_SET (error);
               return FALSE;
             }
-
-          if (!dbus_message_has_signature (message, mh->in_args))
+        }
+      else if (mh->flags & METHOD_FLAG_NO_CONTAINERS)
+        {
+          if (!bus_driver_check_caller_is_not_container (connection,
+                                                         transaction,
+                                                         message, error))
             {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             mh->in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              mh->in_args);
               _DBUS_ASSERT_ERROR_IS_SET (error);
               return FALSE;
             }
+        }
 
-          if ((* mh->handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
+      if (!(is_canonical_path || (mh->flags & METHOD_FLAG_ANY_PATH)))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+              "Method '%s' is only available at the canonical object path '%s'",
+              dbus_message_get_member (message), DBUS_PATH_DBUS);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
+
+      if (!dbus_message_has_signature (message, mh->in_args))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, dbus_message_get_signature (message),
+                         mh->in_args);
+
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, dbus_message_get_signature (message),
+                          mh->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
+
+      if ((* mh->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
         }
     }
 
   _dbus_verbose ("No driver handler for message \"%s\"\n",
                  name);
 
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      if (!(is_canonical_path || (ih->flags & INTERFACE_FLAG_ANY_PATH)))
+        continue;
+
+      if (interface == NULL || strcmp (interface, ih->name) == 0)
+        {
+          found_interface = TRUE;
+          break;
+        }
+    }
+
   dbus_set_error (error, found_interface ? DBUS_ERROR_UNKNOWN_METHOD : DBUS_ERROR_UNKNOWN_INTERFACE,
                   "%s does not understand message %s",
                   DBUS_SERVICE_DBUS, name);
@@ -31,7 +31,7 @@
 
 struct BusExpireList
 {
-  DBusList      *items; /**< List of BusExpireItem */
+  DBusList      *items; /**< List of BusExpireItem, oldest first */
   DBusTimeout   *timeout;
   DBusLoop      *loop;
   BusExpireFunc  expire_func;
@@ -121,17 +121,22 @@ bus_expire_list_recheck_immediately (BusExpireList *list)
   bus_expire_timeout_set_interval (list->timeout, 0);
 }
 
+/* Items are kept in the order they were added, and every item in a
+ * list has the same lifetime, so the list is also in order of expiry.
+ * Items that are to be expired immediately have their added time
+ * zeroed and are moved to the front by bus_expire_list_expire_link().
+ * This means we can stop at the first item that has not expired yet,
+ * and only touch the items we actually expire.
+ */
 static int
 do_expiration_with_monotonic_time (BusExpireList *list,
                                    long           tv_sec,
                                    long           tv_usec)
 {
   DBusList *link;
-  int next_interval, min_wait_time, items_to_expire;
+  int next_interval;
 
   next_interval = -1;
-  min_wait_time = 3600 * 1000; /* this is reset anyway if used */
-  items_to_expire = 0;
   
   link = _dbus_list_get_first_link (&list->items);
   while (link != NULL)
@@ -163,22 +168,18 @@ do_expiration_with_monotonic_time (BusExpireList *list,
               break;
             }
         }
-      else if (list->expire_after > 0)
+      else
         {
-          double to_wait;
+          /* We can end the loop, since the items are in oldest-first order */
+          if (list->expire_after > 0)
+            next_interval = (double) list->expire_after - elapsed;
 
-          items_to_expire = 1;
-          to_wait = (double) list->expire_after - elapsed;
-          if (min_wait_time > to_wait)
-            min_wait_time = to_wait;
+          break;
         }
 
       link = next;
     }
 
-  if (next_interval < 0 && items_to_expire)
-    next_interval = min_wait_time;
-
   return next_interval;
 }
 
@@ -193,7 +194,7 @@ bus_expirelist_expire (BusExpireList *list)
     {
       long tv_sec, tv_usec;
 
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      _dbus_loop_get_monotonic_time (list->loop, &tv_sec, &tv_usec);
 
       next_interval = do_expiration_with_monotonic_time (list, tv_sec, tv_usec);
     }
@@ -241,25 +242,68 @@ bus_expire_list_add (BusExpireList *list,
 {
   dbus_bool_t ret;
 
-  ret = _dbus_list_prepend (&list->items, item);
+  ret = _dbus_list_append (&list->items, item);
   if (ret && !dbus_timeout_get_enabled (list->timeout))
     bus_expire_timeout_set_interval (list->timeout, 0);
 
   return ret;
 }
 
+static dbus_bool_t
+item_added_before (const BusExpireItem *a,
+                   const BusExpireItem *b)
+{
+  if (a->added_tv_sec != b->added_tv_sec)
+    return a->added_tv_sec < b->added_tv_sec;
+
+  return a->added_tv_usec < b->added_tv_usec;
+}
+
 void
 bus_expire_list_add_link (BusExpireList *list,
                           DBusList      *link)
 {
+  DBusList *prev;
+
   _dbus_assert (link->data != NULL);
-  
-  _dbus_list_prepend_link (&list->items, link);
+
+  /* This can be a link that was unlinked earlier and is being put
+   * back, so it can be older than the newest items; find its place
+   * from the newest end to keep the list in order.
+   */
+  prev = _dbus_list_get_last_link (&list->items);
+  while (prev != NULL && item_added_before (link->data, prev->data))
+    prev = _dbus_list_get_prev_link (&list->items, prev);
+
+  _dbus_list_insert_after_link (&list->items, prev, link);
 
   if (!dbus_timeout_get_enabled (list->timeout))
     bus_expire_timeout_set_interval (list->timeout, 0);
 }
 
+/**
+ * Arranges for the item in the given link to be expired the next time
+ * the list is checked, and schedules that check to happen immediately.
+ * The link stays in the list; it is only moved to the front.
+ *
+ * @param list the expire list
+ * @param link a link in the list
+ */
+void
+bus_expire_list_expire_link (BusExpireList *list,
+                             DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+
+  item->added_tv_sec = 0;
+  item->added_tv_usec = 0;
+
+  _dbus_list_unlink (&list->items, link);
+  _dbus_list_prepend_link (&list->items, link);
+
+  bus_expire_list_recheck_immediately (list);
+}
+
 DBusList*
 bus_expire_list_get_first_link (BusExpireList *list)
 {
@@ -326,6 +370,8 @@ bus_expire_list_test (const DBusString *test_data_dir)
   long tv_sec_expired, tv_usec_expired;
   long tv_sec_past, tv_usec_past;
   TestExpireItem *item;
+  TestExpireItem *later;
+  DBusList *link;
   int next_interval;
   dbus_bool_t result = FALSE;
 
@@ -387,7 +433,57 @@ bus_expire_list_test (const DBusString *test_data_dir)
   _dbus_assert (next_interval == 1000 + EXPIRE_AFTER);
 
   bus_expire_list_remove (list, &item->item);
+  item->expire_count = 0;
+
+  /* Items are expired oldest first, and the walk stops at the first
+   * item that has not expired yet */
+  later = dbus_new0 (TestExpireItem, 1);
+
+  if (later == NULL)
+    goto oom;
+
+  item->item.added_tv_sec = tv_sec;
+  item->item.added_tv_usec = tv_usec;
+  later->item.added_tv_sec = tv_sec_not_expired;
+  later->item.added_tv_usec = tv_usec_not_expired;
+
+  if (!bus_expire_list_add (list, &item->item) ||
+      !bus_expire_list_add (list, &later->item))
+    _dbus_test_fatal ("out of memory");
+
+  next_interval =
+    do_expiration_with_monotonic_time (list, tv_sec_expired,
+                                       tv_usec_expired);
+  _dbus_assert (item->expire_count == 1);
+  _dbus_assert (later->expire_count == 0);
+  _dbus_verbose ("next_interval = %d\n", next_interval);
+  _dbus_assert (next_interval == EXPIRE_AFTER - 1);
+
+  /* A link that is put back is returned to its place in the order */
+  link = bus_expire_list_get_first_link (list);
+  _dbus_assert (link->data == &item->item);
+  bus_expire_list_unlink (list, link);
+  bus_expire_list_add_link (list, link);
+  _dbus_assert (bus_expire_list_get_first_link (list) == link);
+
+  /* An item that must expire now is moved to the front */
+  link = bus_expire_list_get_next_link (list, link);
+  _dbus_assert (link->data == &later->item);
+  bus_expire_list_expire_link (list, link);
+  _dbus_assert (bus_expire_list_get_first_link (list) == link);
+
+  next_interval =
+    do_expiration_with_monotonic_time (list, tv_sec_not_expired,
+                                       tv_usec_not_expired);
+  _dbus_assert (later->expire_count == 1);
+  _dbus_assert (item->expire_count == 1);
+  _dbus_verbose ("next_interval = %d\n", next_interval);
+  _dbus_assert (next_interval == 1);
+
+  bus_expire_list_remove (list, &item->item);
+  bus_expire_list_remove (list, &later->item);
   dbus_free (item);
+  dbus_free (later);
   
   bus_expire_list_free (list);
   _dbus_loop_unref (loop);
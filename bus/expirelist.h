@@ -60,6 +60,8 @@ dbus_bool_t    bus_expire_list_add                 (BusExpireList *list,
                                                     BusExpireItem *item);
 void           bus_expire_list_add_link            (BusExpireList *list,
                                                     DBusList      *link);
+void           bus_expire_list_expire_link         (BusExpireList *list,
+                                                    DBusList      *link);
 dbus_bool_t    bus_expire_list_contains_item       (BusExpireList *list,
                                                     BusExpireItem *item);
 void           bus_expire_list_unlink              (BusExpireList *list,
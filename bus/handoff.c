@@ -0,0 +1,1271 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.c  Replacing a running message bus without disconnecting it
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "handoff.h"
+
+#ifdef DBUS_UNIX
+
+#include "audit.h"
+#include "connection.h"
+#include "containers.h"
+#include "services.h"
+#include "signals.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-server-socket.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#include <dbus/dbus-timeout.h>
+
+/*
+ * On SIGUSR2 the bus executes itself again, and the new process takes
+ * over the listening sockets and every connection that it can, so that
+ * a new dbus-daemon binary or a configuration that cannot be reloaded
+ * takes effect without clients noticing.
+ *
+ * First we stop reading from clients and give them up to
+ * HANDOFF_DRAIN_MSEC to become idle: everything already read has been
+ * routed and everything queued for them has been written. Monitors and
+ * connections to container servers cannot be handed over, so they are
+ * closed at this point, which lets everyone else hear that they went
+ * away. Then the state that the new process needs is written to an
+ * unlinked file as a marshalled message, the sockets are made to
+ * survive exec, and we exec with --handoff-fd pointing to the file.
+ *
+ * The new process uses the listening sockets when it reaches the same
+ * <listen> address in its configuration, and after it has finished
+ * starting up it recreates each connection with the same unique name,
+ * match rules, owned and queued names and pending replies, without
+ * sending anyone any messages about it. A connection that was not
+ * idle in time, or whose transport holds state that cannot be handed
+ * over such as compression, is simply closed by exec.
+ */
+
+/* Bump this whenever the layout of the state changes */
+#define HANDOFF_VERSION 1
+
+/* version, bus ID, servers, unique name counter, connections, name
+ * owners, pending replies */
+#define HANDOFF_SIGNATURE \
+  "u" "ay" "a(ssai)" "(ii)" "a(s(iibbuxxaussay)bbbxas)" "a(ssu)" "a(ssu)"
+
+/* How long to wait for connections to become idle */
+#define HANDOFF_DRAIN_MSEC 1000
+/* How often to check */
+#define HANDOFF_POLL_MSEC 10
+
+struct BusHandoff
+{
+  DBusMessage *state;
+  dbus_bool_t *server_taken; /**< Which servers bus_handoff_take_server() used */
+  int n_servers;
+};
+
+typedef struct
+{
+  BusContext *context;
+  DBusTimeout *timeout;
+  dbus_int64_t started_usec;
+} HandoffDrain;
+
+/* What to execute, and its arguments apart from the ones we add */
+static char *exec_program = NULL;
+static char **exec_argv = NULL;
+static int exec_argc = 0;
+
+static HandoffDrain *drain = NULL;
+
+static dbus_int64_t
+monotonic_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return (dbus_int64_t) tv_sec * 1000000 + tv_usec;
+}
+
+static dbus_bool_t
+arg_takes_value (const char *arg)
+{
+  return strcmp (arg, "--print-address") == 0 ||
+    strcmp (arg, "--print-pid") == 0;
+}
+
+/**
+ * Remembers how we were started, so that bus_handoff_begin() can start
+ * us again. Options that only make sense the first time, such as
+ * --fork and --print-address, are left out.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_handoff_save_argv (int    argc,
+                       char **argv)
+{
+  int i;
+
+  _dbus_assert (exec_argv == NULL);
+
+  /* We may chdir("/") when we become a daemon */
+  if (argv[0][0] != '/' && strchr (argv[0], '/') != NULL)
+    {
+      DBusString path;
+      char *cwd = getcwd (NULL, 0);
+
+      if (cwd == NULL)
+        return FALSE;
+
+      if (!_dbus_string_init (&path) ||
+          !_dbus_string_append_printf (&path, "%s/%s", cwd, argv[0]) ||
+          !_dbus_string_steal_data (&path, &exec_program))
+        {
+          _dbus_string_free (&path);
+          free (cwd);
+          return FALSE;
+        }
+
+      _dbus_string_free (&path);
+      free (cwd);
+    }
+  else
+    {
+      exec_program = _dbus_strdup (argv[0]);
+
+      if (exec_program == NULL)
+        return FALSE;
+    }
+
+  /* argv[0], the arguments we keep, the two we add and NULL */
+  exec_argv = dbus_new0 (char *, argc + 3);
+
+  if (exec_argv == NULL)
+    return FALSE;
+
+  exec_argv[exec_argc++] = argv[0];
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--fork") == 0 ||
+          strcmp (arg, "--nofork") == 0 ||
+          strstr (arg, "--print-address=") == arg ||
+          strstr (arg, "--print-pid=") == arg ||
+          strstr (arg, "--handoff-fd=") == arg)
+        continue;
+
+      if (arg_takes_value (arg))
+        {
+          if (i + 1 < argc && strstr (argv[i + 1], "--") != argv[i + 1])
+            i++;
+
+          continue;
+        }
+
+      exec_argv[exec_argc++] = argv[i];
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+can_be_handed_off (DBusConnection *connection)
+{
+  return !bus_connection_is_monitor (connection) &&
+    !bus_containers_connection_is_contained (connection, NULL, NULL, NULL);
+}
+
+static dbus_bool_t
+pause_connection (DBusConnection *connection,
+                  void           *data)
+{
+  DBusList **to_close = data;
+
+  if (can_be_handed_off (connection))
+    _dbus_connection_set_reading_paused (connection, TRUE);
+  else if (to_close != NULL)
+    {
+      if (!_dbus_list_append (to_close, connection))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+resume_connection (DBusConnection *connection,
+                   void           *data)
+{
+  _dbus_connection_set_reading_paused (connection, FALSE);
+  return TRUE;
+}
+
+static dbus_bool_t
+check_idle (DBusConnection *connection,
+            void           *data)
+{
+  dbus_bool_t *all_idle = data;
+
+  /* Connections that completed Hello since we started must stop
+   * sending too. Monitors and contained connections that we closed
+   * have not finished going away yet. */
+  if (!pause_connection (connection, NULL) ||
+      !can_be_handed_off (connection) ||
+      !_dbus_connection_can_hand_off (connection))
+    {
+      *all_idle = FALSE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_connection (DBusConnection *connection,
+                   void           *data)
+{
+  DBusMessageIter *array_iter = data;
+  DBusMessageIter struct_iter = DBUS_MESSAGE_ITER_INIT_CLOSED;
+  DBusMessageIter rules_iter = DBUS_MESSAGE_ITER_INIT_CLOSED;
+  const char *name;
+  dbus_bool_t accepts_peer, flow_control, replies_first;
+  dbus_int64_t coalesce;
+
+  if (!can_be_handed_off (connection) ||
+      !_dbus_connection_can_hand_off (connection))
+    return TRUE;
+
+  name = bus_connection_get_name (connection);
+  accepts_peer = bus_connection_get_accepts_peer_connections (connection);
+  flow_control = bus_connection_get_flow_control (connection);
+  replies_first = _dbus_connection_get_replies_first (connection);
+  coalesce = bus_connection_get_coalesce_signals (connection);
+
+  if (!dbus_message_iter_open_container (array_iter, DBUS_TYPE_STRUCT, NULL,
+                                         &struct_iter) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &name) ||
+      !_dbus_connection_append_handoff (connection, &struct_iter) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BOOLEAN,
+                                       &accepts_peer) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BOOLEAN,
+                                       &flow_control) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BOOLEAN,
+                                       &replies_first) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_INT64,
+                                       &coalesce) ||
+      !dbus_message_iter_open_container (&struct_iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &rules_iter) ||
+      !bus_connection_append_match_rules (connection, &rules_iter) ||
+      !dbus_message_iter_close_container (&struct_iter, &rules_iter) ||
+      !dbus_message_iter_close_container (array_iter, &struct_iter))
+    {
+      dbus_message_iter_abandon_container_if_open (&struct_iter, &rules_iter);
+      dbus_message_iter_abandon_container_if_open (array_iter, &struct_iter);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static DBusMessage *
+save_state (BusContext *context)
+{
+  DBusMessage *state;
+  DBusMessageIter iter, sub;
+  dbus_uint32_t version = HANDOFF_VERSION;
+  dbus_int32_t major, minor;
+
+  state = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                   "Handoff");
+
+  if (state == NULL)
+    return NULL;
+
+  dbus_message_iter_init_append (state, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &version) ||
+      !bus_context_append_handoff (context, &iter))
+    goto oom;
+
+  bus_registry_get_unique_name_counter (bus_context_get_registry (context),
+                                        &major, &minor);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_STRUCT, NULL,
+                                         &sub))
+    goto oom;
+
+  if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT32, &major) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT32, &minor))
+    {
+      dbus_message_iter_abandon_container (&iter, &sub);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "(s(iibbuxxaussay)bbbxas)", &sub))
+    goto oom;
+
+  /* The callback cannot tell us it failed, so check afterwards */
+  bus_connections_foreach_active (bus_context_get_connections (context),
+                                  append_connection, &sub);
+
+  if (!dbus_message_iter_close_container (&iter, &sub) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssu)",
+                                         &sub))
+    goto oom;
+
+  if (!bus_registry_append_owners (bus_context_get_registry (context), &sub))
+    {
+      dbus_message_iter_abandon_container (&iter, &sub);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssu)",
+                                         &sub))
+    goto oom;
+
+  if (!bus_connections_append_pending_replies (bus_context_get_connections (context),
+                                               &sub))
+    {
+      dbus_message_iter_abandon_container (&iter, &sub);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub))
+    goto oom;
+
+  if (!dbus_message_has_signature (state, HANDOFF_SIGNATURE))
+    goto oom;
+
+  /* dbus_message_demarshal() insists on a serial */
+  dbus_message_set_serial (state, 1);
+  return state;
+
+oom:
+  dbus_message_unref (state);
+  return NULL;
+}
+
+/* Calls @function on each file descriptor in the state */
+static void
+foreach_state_fd (DBusMessage *state,
+                  void       (* function) (int fd))
+{
+  DBusMessageIter iter, array_iter, struct_iter, sub;
+
+  dbus_message_iter_init (state, &iter);
+  dbus_message_iter_next (&iter);     /* version */
+  dbus_message_iter_next (&iter);     /* bus ID */
+
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_recurse (&struct_iter, &sub);
+
+      while (dbus_message_iter_get_arg_type (&sub) == DBUS_TYPE_INT32)
+        {
+          dbus_int32_t fd;
+
+          dbus_message_iter_get_basic (&sub, &fd);
+          function (fd);
+          dbus_message_iter_next (&sub);
+        }
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  dbus_message_iter_next (&iter);     /* servers */
+  dbus_message_iter_next (&iter);     /* unique name counter */
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      dbus_int32_t fd;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_recurse (&struct_iter, &sub);
+
+      /* the socket, then the pidfd or -1 */
+      dbus_message_iter_get_basic (&sub, &fd);
+      function (fd);
+      dbus_message_iter_next (&sub);
+      dbus_message_iter_get_basic (&sub, &fd);
+
+      if (fd >= 0)
+        function (fd);
+
+      dbus_message_iter_next (&array_iter);
+    }
+}
+
+static void
+end_drain (void)
+{
+  _dbus_loop_remove_timeout (bus_context_get_loop (drain->context),
+                             drain->timeout);
+  _dbus_timeout_unref (drain->timeout);
+  dbus_free (drain);
+  drain = NULL;
+}
+
+static void
+handoff_exec (BusContext *context)
+{
+  DBusMessage *state;
+  char *data = NULL;
+  int len;
+  FILE *file = NULL;
+  int fd;
+  int saved_errno;
+  DBusString str;
+  char fd_arg[64];
+
+  state = save_state (context);
+
+  if (state == NULL)
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Not enough memory to hand over to a new instance of "
+                       "the bus, carrying on");
+      return;
+    }
+
+  if (!dbus_message_marshal (state, &data, &len))
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Not enough memory to hand over to a new instance of "
+                       "the bus, carrying on");
+      goto failed;
+    }
+
+  file = tmpfile ();
+
+  if (file == NULL)
+    {
+      saved_errno = errno;
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to create a file to hand over to a new "
+                       "instance of the bus, carrying on: %s",
+                       _dbus_strerror (saved_errno));
+      goto failed;
+    }
+
+  fd = fileno (file);
+  _dbus_string_init_const_len (&str, data, len);
+
+  if (_dbus_write (fd, &str, 0, len) != len ||
+      lseek (fd, 0, SEEK_SET) != 0)
+    {
+      saved_errno = errno;
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to write the state to hand over to a new "
+                       "instance of the bus, carrying on: %s",
+                       _dbus_strerror (saved_errno));
+      goto failed;
+    }
+
+  _dbus_fd_clear_close_on_exec (fd);
+  snprintf (fd_arg, sizeof (fd_arg), "--handoff-fd=%d", fd);
+  exec_argv[exec_argc] = "--nofork";
+  exec_argv[exec_argc + 1] = fd_arg;
+  exec_argv[exec_argc + 2] = NULL;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Handing over to a new instance of the bus: %s",
+                   exec_program);
+
+  bus_audit_keep_capabilities_across_exec (context);
+
+  if (strchr (exec_program, '/') != NULL)
+    execv (exec_program, exec_argv);
+  else
+    execvp (exec_program, exec_argv);
+
+  saved_errno = errno;
+  bus_audit_clear_ambient_capabilities ();
+  exec_argv[exec_argc] = NULL;
+  bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                   "Unable to execute \"%s\" to hand over to a new instance "
+                   "of the bus, carrying on: %s",
+                   exec_program, _dbus_strerror (saved_errno));
+
+failed:
+  /* Give back what we were going to hand over */
+  foreach_state_fd (state, _dbus_fd_set_close_on_exec);
+  dbus_message_unref (state);
+  dbus_free (data);
+
+  if (file != NULL)
+    fclose (file);
+}
+
+static dbus_bool_t
+drain_timeout_cb (void *data)
+{
+  BusContext *context = drain->context;
+  dbus_bool_t all_idle = TRUE;
+
+  bus_connections_foreach_active (bus_context_get_connections (context),
+                                  check_idle, &all_idle);
+
+  if (!all_idle &&
+      monotonic_usec () - drain->started_usec < HANDOFF_DRAIN_MSEC * 1000)
+    return TRUE;
+
+  /* If this returns, the exec failed and we carry on as we were */
+  end_drain ();
+  handoff_exec (context);
+
+  bus_connections_foreach_active (bus_context_get_connections (context),
+                                  resume_connection, NULL);
+  bus_context_set_handing_off (context, FALSE);
+  return TRUE;
+}
+
+/**
+ * Starts handing over to a new instance of the bus, which happens once
+ * the connections have become idle or HANDOFF_DRAIN_MSEC has passed.
+ */
+void
+bus_handoff_begin (BusContext *context)
+{
+  DBusList *to_close = NULL;
+  DBusConnection *connection;
+
+  if (drain != NULL)
+    return;
+
+  if (exec_argv == NULL)
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                       "Unable to hand over to a new instance of the bus: "
+                       "not enough memory to remember our arguments");
+      return;
+    }
+
+  drain = dbus_new0 (HandoffDrain, 1);
+
+  if (drain == NULL)
+    goto oom;
+
+  drain->context = context;
+  drain->started_usec = monotonic_usec ();
+  drain->timeout = _dbus_timeout_new (HANDOFF_POLL_MSEC, drain_timeout_cb,
+                                      NULL, NULL);
+
+  if (drain->timeout == NULL)
+    goto oom;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               drain->timeout))
+    goto oom;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Getting ready to hand over to a new instance of the bus");
+
+  bus_context_set_handing_off (context, TRUE);
+
+  /* On OOM, some monitors are not closed until the exec */
+  bus_connections_foreach_active (bus_context_get_connections (context),
+                                  pause_connection, &to_close);
+
+  while ((connection = _dbus_list_pop_first (&to_close)) != NULL)
+    dbus_connection_close (connection);
+
+  return;
+
+oom:
+  if (drain != NULL)
+    {
+      if (drain->timeout != NULL)
+        _dbus_timeout_unref (drain->timeout);
+
+      dbus_free (drain);
+      drain = NULL;
+    }
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                   "Not enough memory to hand over to a new instance of the "
+                   "bus");
+}
+
+/**
+ * Reads the state that a previous instance of the bus handed over to
+ * us, and closes @fd.
+ *
+ * @returns the state, or #NULL with @error set
+ */
+BusHandoff *
+bus_handoff_load (int        fd,
+                  DBusError *error)
+{
+  BusHandoff *handoff = NULL;
+  DBusMessage *state = NULL;
+  DBusMessageIter iter;
+  DBusString str;
+  dbus_uint32_t version;
+  int n;
+
+  if (!_dbus_string_init (&str))
+    {
+      BUS_SET_OOM (error);
+      _dbus_close (fd, NULL);
+      return NULL;
+    }
+
+  do
+    n = _dbus_read (fd, &str, 8192);
+  while (n > 0);
+
+  if (n < 0)
+    dbus_set_error (error, _dbus_error_from_errno (errno),
+                    "Unable to read the state handed over by the previous "
+                    "instance of the bus: %s", _dbus_strerror (errno));
+
+  _dbus_close (fd, NULL);
+
+  if (n < 0)
+    goto out;
+
+  state = dbus_message_demarshal (_dbus_string_get_const_data (&str),
+                                  _dbus_string_get_length (&str), error);
+
+  if (state == NULL)
+    goto out;
+
+  dbus_message_iter_init (state, &iter);
+
+  if (!dbus_message_has_signature (state, HANDOFF_SIGNATURE) ||
+      (dbus_message_iter_get_basic (&iter, &version),
+       version != HANDOFF_VERSION))
+    {
+      /* We cannot know what file descriptors it holds, so they leak */
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "The previous instance of the bus handed over state "
+                      "that this one does not understand");
+      goto out;
+    }
+
+  handoff = dbus_new0 (BusHandoff, 1);
+
+  if (handoff == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_next (&iter);
+  handoff->n_servers = dbus_message_iter_get_element_count (&iter);
+  handoff->server_taken = dbus_new0 (dbus_bool_t, handoff->n_servers + 1);
+
+  if (handoff->server_taken == NULL)
+    {
+      dbus_free (handoff);
+      handoff = NULL;
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  handoff->state = state;
+  state = NULL;
+
+out:
+  if (state != NULL)
+    dbus_message_unref (state);
+
+  _dbus_string_free (&str);
+  return handoff;
+}
+
+static void
+close_fd (int fd)
+{
+  _dbus_close (fd, NULL);
+}
+
+void
+bus_handoff_free (BusHandoff *handoff)
+{
+  dbus_message_unref (handoff->state);
+  dbus_free (handoff->server_taken);
+  dbus_free (handoff);
+}
+
+void
+bus_handoff_get_uuid (BusHandoff *handoff,
+                      DBusGUID   *uuid)
+{
+  DBusMessageIter iter, array_iter;
+  const unsigned char *bytes;
+  int n_bytes;
+
+  dbus_message_iter_init (handoff->state, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  dbus_message_iter_get_fixed_array (&array_iter, &bytes, &n_bytes);
+
+  memset (uuid, 0, sizeof (*uuid));
+  memcpy (uuid->as_bytes, bytes, MIN (n_bytes, DBUS_UUID_LENGTH_BYTES));
+}
+
+static void
+init_servers_iter (BusHandoff      *handoff,
+                   DBusMessageIter *array_iter)
+{
+  DBusMessageIter iter;
+
+  dbus_message_iter_init (handoff->state, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, array_iter);
+}
+
+/**
+ * Gets a server listening on the sockets that the previous instance
+ * of the bus was using for @address, if it handed them over.
+ *
+ * @returns a new server, or #NULL if there is none (without setting
+ *  @error) or it could not be created (with @error set)
+ */
+DBusServer *
+bus_handoff_take_server (BusHandoff *handoff,
+                         const char *address,
+                         DBusError  *error)
+{
+  DBusMessageIter array_iter;
+  int i;
+
+  init_servers_iter (handoff, &array_iter);
+
+  for (i = 0;
+       dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT;
+       i++, dbus_message_iter_next (&array_iter))
+    {
+      DBusMessageIter struct_iter, fds_iter;
+      const char *configured, *listening;
+      DBusSocket *fds;
+      int n_fds, j;
+      DBusString listening_str;
+      DBusServer *server;
+      DBusAddressEntry **entries;
+      int n_entries;
+      const char *guid, *path, *end;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &configured);
+
+      if (handoff->server_taken[i] || strcmp (configured, address) != 0)
+        continue;
+
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &listening);
+      dbus_message_iter_next (&struct_iter);
+      n_fds = dbus_message_iter_get_element_count (&struct_iter);
+      dbus_message_iter_recurse (&struct_iter, &fds_iter);
+
+      fds = dbus_new (DBusSocket, n_fds);
+
+      if (fds == NULL)
+        {
+          BUS_SET_OOM (error);
+          return NULL;
+        }
+
+      for (j = 0; j < n_fds; j++)
+        {
+          dbus_int32_t fd;
+
+          dbus_message_iter_get_basic (&fds_iter, &fd);
+          _dbus_fd_set_close_on_exec (fd);
+          fds[j] = _dbus_socket_get_invalid ();
+          fds[j].fd = fd;
+          dbus_message_iter_next (&fds_iter);
+        }
+
+      if (!dbus_parse_address (listening, &entries, &n_entries, error))
+        {
+          dbus_free (fds);
+          return NULL;
+        }
+
+      guid = NULL;
+      path = NULL;
+
+      if (n_entries == 1)
+        {
+          guid = dbus_address_entry_get_value (entries[0], "guid");
+
+          if (strcmp (dbus_address_entry_get_method (entries[0]),
+                      "unix") == 0)
+            path = dbus_address_entry_get_value (entries[0], "path");
+        }
+
+      /* The server appends its GUID to the address itself */
+      end = strstr (listening, ",guid=");
+      _dbus_string_init_const_len (&listening_str, listening,
+                                   end != NULL ? end - listening
+                                               : (long) strlen (listening));
+      server = _dbus_server_new_for_socket (fds, n_fds, &listening_str,
+                                            NULL, error);
+      dbus_free (fds);
+
+      if (server == NULL)
+        {
+          dbus_address_entries_free (entries);
+          return NULL;
+        }
+
+      handoff->server_taken[i] = TRUE;
+
+      /* Clients have the previous instance's GUID in the address they
+       * were given, so keep it */
+      if (guid != NULL && !_dbus_server_set_guid (server, guid, error))
+        {
+          dbus_address_entries_free (entries);
+          dbus_server_disconnect (server);
+          dbus_server_unref (server);
+          return NULL;
+        }
+
+      /* Like a server we created, remove the socket when we exit */
+      if (path != NULL)
+        {
+          char *copy = _dbus_strdup (path);
+
+          if (copy != NULL)
+            _dbus_server_socket_own_filename (server, copy);
+        }
+
+      dbus_address_entries_free (entries);
+      return server;
+    }
+
+  return NULL;
+}
+
+static void
+close_unused_servers (BusHandoff *handoff)
+{
+  DBusMessageIter array_iter;
+  int i;
+
+  init_servers_iter (handoff, &array_iter);
+
+  for (i = 0;
+       dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT;
+       i++, dbus_message_iter_next (&array_iter))
+    {
+      DBusMessageIter struct_iter, fds_iter;
+
+      if (handoff->server_taken[i])
+        continue;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_recurse (&struct_iter, &fds_iter);
+
+      while (dbus_message_iter_get_arg_type (&fds_iter) == DBUS_TYPE_INT32)
+        {
+          dbus_int32_t fd;
+
+          dbus_message_iter_get_basic (&fds_iter, &fd);
+          close_fd (fd);
+          dbus_message_iter_next (&fds_iter);
+        }
+    }
+}
+
+static DBusConnection *
+lookup_connection (BusRegistry *registry,
+                   const char  *name)
+{
+  DBusString str;
+  BusService *service;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+static dbus_bool_t
+restore_connection (BusContext       *context,
+                    DBusMessageIter  *struct_iter,
+                    const DBusString *guid,
+                    DBusError        *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  BusMatchmaker *matchmaker = bus_context_get_matchmaker (context);
+  DBusConnection *connection;
+  BusTransaction *transaction;
+  DBusMessageIter rules_iter;
+  DBusString name;
+  const char *name_c;
+  dbus_bool_t accepts_peer, flow_control, replies_first;
+  dbus_int64_t coalesce;
+  dbus_bool_t ret = FALSE;
+
+  dbus_message_iter_get_basic (struct_iter, &name_c);
+  dbus_message_iter_next (struct_iter);
+  _dbus_string_init_const (&name, name_c);
+
+  connection = _dbus_connection_new_from_handoff (struct_iter, guid, error);
+
+  if (connection == NULL)
+    return FALSE;
+
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &accepts_peer);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &flow_control);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &replies_first);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &coalesce);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_recurse (struct_iter, &rules_iter);
+
+  /* This logs a warning and closes the connection if it fails */
+  if (!bus_context_add_incoming_connection (context, connection))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Unable to set up connection");
+      dbus_connection_unref (connection);
+      return FALSE;
+    }
+
+  /* This is where the unix user function gets to check the identity
+   * that was handed over */
+  if (!dbus_connection_get_is_authenticated (connection))
+    {
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Connection is no longer allowed to connect");
+      goto out;
+    }
+
+  if (bus_registry_lookup (registry, &name) != NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Unique name is already in use");
+      goto out;
+    }
+
+  transaction = bus_transaction_new (context);
+
+  if (transaction == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  /* Everyone already knows about this connection */
+  bus_transaction_set_quiet (transaction, TRUE);
+
+  if (!bus_connection_complete (connection, &name, error) ||
+      bus_registry_ensure (registry, &name, connection, 0, transaction,
+                           error) == NULL)
+    {
+      bus_transaction_cancel_and_free (transaction);
+      goto out;
+    }
+
+  bus_transaction_execute_and_free (transaction);
+
+  bus_connection_set_accepts_peer_connections (connection, accepts_peer);
+  bus_connection_set_coalesce_signals (connection, (long) coalesce);
+  _dbus_connection_set_replies_first (connection, replies_first);
+
+  if (!bus_connection_set_flow_control (connection, flow_control))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  /* The previous instance already checked whether eavesdropping rules
+   * were allowed */
+  while (dbus_message_iter_get_arg_type (&rules_iter) == DBUS_TYPE_STRING)
+    {
+      const char *text;
+      DBusString text_str;
+      BusMatchRule *rule;
+
+      dbus_message_iter_get_basic (&rules_iter, &text);
+      _dbus_string_init_const (&text_str, text);
+      rule = bus_match_rule_parse (connection, &text_str, error);
+
+      if (rule == NULL)
+        goto out;
+
+      if (!bus_matchmaker_add_rule (matchmaker, rule))
+        {
+          bus_match_rule_unref (rule);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      bus_match_rule_unref (rule);
+      dbus_message_iter_next (&rules_iter);
+    }
+
+  ret = TRUE;
+
+out:
+  if (!ret)
+    dbus_connection_close (connection);
+
+  dbus_connection_unref (connection);
+  return ret;
+}
+
+static dbus_bool_t
+restore_owner (BusContext      *context,
+               DBusMessageIter *struct_iter,
+               DBusError       *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  BusTransaction *transaction;
+  DBusConnection *connection;
+  const char *name, *owner;
+  DBusString name_str;
+  dbus_uint32_t flags, result;
+
+  dbus_message_iter_get_basic (struct_iter, &name);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &owner);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &flags);
+
+  connection = lookup_connection (registry, owner);
+
+  /* It was not handed over, or went away */
+  if (connection == NULL)
+    return TRUE;
+
+  transaction = bus_transaction_new (context);
+
+  if (transaction == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  bus_transaction_set_quiet (transaction, TRUE);
+  _dbus_string_init_const (&name_str, name);
+
+  if (!bus_registry_acquire_service (registry, connection, &name_str, flags,
+                                     &result, transaction, error))
+    {
+      bus_transaction_cancel_and_free (transaction);
+      return FALSE;
+    }
+
+  bus_transaction_execute_and_free (transaction);
+  return TRUE;
+}
+
+static dbus_bool_t
+restore_pending_reply (BusContext      *context,
+                       DBusMessageIter *struct_iter,
+                       DBusError       *error)
+{
+  BusRegistry *registry = bus_context_get_registry (context);
+  BusTransaction *transaction;
+  DBusConnection *will_get_reply, *will_send_reply;
+  DBusMessage *call;
+  const char *caller, *callee;
+  dbus_uint32_t serial;
+  dbus_bool_t ret;
+
+  dbus_message_iter_get_basic (struct_iter, &caller);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &callee);
+  dbus_message_iter_next (struct_iter);
+  dbus_message_iter_get_basic (struct_iter, &serial);
+
+  will_get_reply = lookup_connection (registry, caller);
+  will_send_reply = lookup_connection (registry, callee);
+
+  if (will_get_reply == NULL || will_send_reply == NULL)
+    return TRUE;
+
+  /* All that is remembered about the call is its serial */
+  call = dbus_message_new_method_call (NULL, "/", NULL, "Handoff");
+
+  if (call == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dbus_message_set_serial (call, serial);
+  transaction = bus_transaction_new (context);
+
+  if (transaction == NULL)
+    {
+      dbus_message_unref (call);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  ret = bus_connections_expect_reply (bus_context_get_connections (context),
+                                      transaction, will_get_reply,
+                                      will_send_reply, call, error);
+
+  if (ret)
+    bus_transaction_execute_and_free (transaction);
+  else
+    bus_transaction_cancel_and_free (transaction);
+
+  dbus_message_unref (call);
+  return ret;
+}
+
+/**
+ * Recreates the connections, name owners and pending replies that the
+ * previous instance of the bus handed over, and closes the listening
+ * sockets that our configuration no longer uses. Anything that cannot
+ * be restored is logged and dropped.
+ */
+void
+bus_handoff_restore (BusHandoff *handoff,
+                     BusContext *context)
+{
+  DBusMessageIter iter, array_iter, struct_iter;
+  DBusString guid;
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_int32_t major, minor;
+  int n_connections = 0;
+  int n_failed = 0;
+
+  close_unused_servers (handoff);
+
+  dbus_message_iter_init (handoff->state, &iter);
+  dbus_message_iter_next (&iter);     /* version */
+  dbus_message_iter_next (&iter);     /* bus ID */
+  dbus_message_iter_next (&iter);     /* servers */
+
+  dbus_message_iter_recurse (&iter, &struct_iter);
+  dbus_message_iter_get_basic (&struct_iter, &major);
+  dbus_message_iter_next (&struct_iter);
+  dbus_message_iter_get_basic (&struct_iter, &minor);
+  bus_registry_set_unique_name_counter (bus_context_get_registry (context),
+                                        major, minor);
+  dbus_message_iter_next (&iter);
+
+  if (!_dbus_string_init (&guid) || !bus_context_get_id (context, &guid))
+    {
+      /* The connections are closed by the exit that follows */
+      _dbus_string_free (&guid);
+      bus_context_log (context, DBUS_SYSTEM_LOG_ERROR,
+                       "Not enough memory to take over connections");
+      return;
+    }
+
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+      if (restore_connection (context, &struct_iter, &guid, &error))
+        {
+          n_connections++;
+        }
+      else
+        {
+          n_failed++;
+          bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                           "Unable to take over a connection from the "
+                           "previous instance of the bus: %s",
+                           error.message);
+          dbus_error_free (&error);
+        }
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  _dbus_string_free (&guid);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+      if (!restore_owner (context, &struct_iter, &error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_WARNING,
+                           "Unable to take over a name from the previous "
+                           "instance of the bus: %s", error.message);
+          dbus_error_free (&error);
+        }
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+      if (!restore_pending_reply (context, &struct_iter, &error))
+        {
+          _dbus_verbose ("Unable to take over a pending reply: %s\n",
+                         error.message);
+          dbus_error_free (&error);
+        }
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Took over from the previous instance of the bus with "
+                   "%d connections (%d could not be taken over)",
+                   n_connections, n_failed);
+}
+
+#endif /* DBUS_UNIX */
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.h  Replacing a running message bus without disconnecting it
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_HANDOFF_H
+#define BUS_HANDOFF_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+#include "bus.h"
+
+#ifdef DBUS_UNIX
+
+/* In the running bus */
+dbus_bool_t  bus_handoff_save_argv   (int          argc,
+                                      char       **argv);
+void         bus_handoff_begin       (BusContext  *context);
+
+/* In the bus that takes over */
+BusHandoff  *bus_handoff_load        (int          fd,
+                                      DBusError   *error);
+void         bus_handoff_free        (BusHandoff  *handoff);
+void         bus_handoff_get_uuid    (BusHandoff  *handoff,
+                                      DBusGUID    *uuid);
+DBusServer  *bus_handoff_take_server (BusHandoff  *handoff,
+                                      const char  *address,
+                                      DBusError   *error);
+void         bus_handoff_restore     (BusHandoff  *handoff,
+                                      BusContext  *context);
+
+#endif /* DBUS_UNIX */
+
+#endif /* BUS_HANDOFF_H */
@@ -0,0 +1,148 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* intern.c  Shared copies of interface and member names
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "intern.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+
+/* atom => number of references, stored with _DBUS_INT_TO_POINTER.
+ * The keys are the atoms themselves. Freed along with the last atom,
+ * so that it doesn't show up as a leak. */
+static DBusHashTable *atoms = NULL;
+
+/**
+ * Returns the atom for str, creating it if necessary, or #NULL
+ * if no memory.
+ *
+ * @param str a string, or #NULL
+ * @returns a new reference to the atom, or #NULL if str is #NULL
+ *  or there is no memory
+ */
+const char *
+bus_intern_string (const char *str)
+{
+  DBusHashIter iter;
+  char *copy;
+
+  if (str == NULL)
+    return NULL;
+
+  if (atoms == NULL)
+    {
+      atoms = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+      if (atoms == NULL)
+        return NULL;
+    }
+
+  if (_dbus_hash_iter_lookup (atoms, (char *) str, FALSE, &iter))
+    {
+      int refcount = _DBUS_POINTER_TO_INT (_dbus_hash_iter_get_value (&iter));
+
+      _dbus_hash_iter_set_value (&iter, _DBUS_INT_TO_POINTER (refcount + 1));
+      return _dbus_hash_iter_get_string_key (&iter);
+    }
+
+  copy = _dbus_strdup (str);
+  if (copy == NULL)
+    goto failed;
+
+  if (!_dbus_hash_iter_lookup (atoms, copy, TRUE, &iter))
+    {
+      dbus_free (copy);
+      goto failed;
+    }
+
+  _dbus_hash_iter_set_value (&iter, _DBUS_INT_TO_POINTER (1));
+  return copy;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+
+  return NULL;
+}
+
+/**
+ * Drops a reference to an atom returned by bus_intern_string().
+ *
+ * @param atom the atom, or #NULL
+ */
+void
+bus_intern_release (const char *atom)
+{
+  DBusHashIter iter;
+  int refcount;
+
+  if (atom == NULL)
+    return;
+
+  _dbus_assert (atoms != NULL);
+
+  if (!_dbus_hash_iter_lookup (atoms, (char *) atom, FALSE, &iter))
+    _dbus_assert_not_reached ("released a string that was not interned");
+
+  _dbus_assert (_dbus_hash_iter_get_string_key (&iter) == atom);
+
+  refcount = _DBUS_POINTER_TO_INT (_dbus_hash_iter_get_value (&iter));
+  _dbus_assert (refcount > 0);
+
+  if (refcount > 1)
+    {
+      _dbus_hash_iter_set_value (&iter, _DBUS_INT_TO_POINTER (refcount - 1));
+      return;
+    }
+
+  /* frees the atom too */
+  _dbus_hash_iter_remove_entry (&iter);
+
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+}
+
+/**
+ * Returns the atom for str if someone holds one, without taking
+ * a reference. If there is none, no atom can be equal to str.
+ *
+ * @param str a string, or #NULL
+ * @returns the atom, or #NULL
+ */
+const char *
+bus_intern_lookup (const char *str)
+{
+  DBusHashIter iter;
+
+  if (str == NULL || atoms == NULL)
+    return NULL;
+
+  if (!_dbus_hash_iter_lookup (atoms, (char *) str, FALSE, &iter))
+    return NULL;
+
+  return _dbus_hash_iter_get_string_key (&iter);
+}
@@ -0,0 +1,39 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* intern.h  Shared copies of interface and member names
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_INTERN_H
+#define BUS_INTERN_H
+
+#include <dbus/dbus.h>
+
+/* An interned string ("atom") is a read-only copy shared by everyone
+ * who interns an equal string, so two atoms are equal if and only if
+ * they are the same pointer. Each bus_intern_string() must be paired
+ * with a bus_intern_release(). The table is global: the bus is
+ * single-threaded.
+ */
+const char *bus_intern_string  (const char *str);
+void        bus_intern_release (const char *atom);
+const char *bus_intern_lookup  (const char *str);
+
+#endif /* BUS_INTERN_H */
@@ -0,0 +1,376 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* log-queue.c  Rate-limited queue of security log messages
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "log-queue.h"
+#include "expirelist.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-test-tap.h>
+#include <dbus/dbus-timeout.h>
+
+/*
+ * Denials are logged while a message is being routed, and writing them
+ * to syslog or the audit socket can block, so a client that provokes
+ * thousands of them a second would stall everyone else's messages. So
+ * they are queued, and written out when the main loop next gets round
+ * to it. At most MAX_PER_WINDOW are accepted per WINDOW_MSEC; the rest
+ * are only counted, and replaced by one summary when the window ends.
+ * That also bounds the queue.
+ */
+#define WINDOW_MSEC 1000
+#define MAX_PER_WINDOW 100
+
+typedef struct
+{
+  BusLogWriteFunc write_func;
+  void *write_data;
+  char text[1]; /* really longer */
+} BusLogEntry;
+
+struct BusLogQueue
+{
+  DBusLoop *loop;
+  DBusTimeout *timeout;
+  DBusList *entries; /**< BusLogEntry, oldest first */
+  BusLogWriteFunc summary_func;
+  void *summary_data;
+  long window_start; /**< Monotonic time the window began, in ms */
+  int n_in_window; /**< Messages accepted in this window */
+  int n_suppressed; /**< Messages dropped and not yet reported */
+};
+
+static dbus_bool_t log_queue_timeout_handler (void *data);
+
+static long
+monotonic_msec (void)
+{
+  long sec, usec;
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  return sec * 1000 + usec / 1000;
+}
+
+BusLogQueue *
+bus_log_queue_new (DBusLoop        *loop,
+                   BusLogWriteFunc  summary_func,
+                   void            *summary_data)
+{
+  BusLogQueue *queue;
+
+  queue = dbus_new0 (BusLogQueue, 1);
+  if (queue == NULL)
+    return NULL;
+
+  queue->loop = loop;
+  queue->summary_func = summary_func;
+  queue->summary_data = summary_data;
+  queue->window_start = monotonic_msec ();
+
+  queue->timeout = _dbus_timeout_new (100, /* irrelevant */
+                                      log_queue_timeout_handler,
+                                      queue, NULL);
+  if (queue->timeout == NULL)
+    goto failed;
+
+  _dbus_timeout_disable (queue->timeout);
+
+  if (!_dbus_loop_add_timeout (queue->loop, queue->timeout))
+    goto failed;
+
+  return queue;
+
+ failed:
+  if (queue->timeout)
+    _dbus_timeout_unref (queue->timeout);
+
+  dbus_free (queue);
+  return NULL;
+}
+
+static dbus_bool_t
+queue_entry (BusLogQueue     *queue,
+             BusLogWriteFunc  write_func,
+             void            *write_data,
+             const char      *text)
+{
+  BusLogEntry *entry;
+  size_t len;
+
+  len = strlen (text);
+  entry = dbus_malloc (sizeof (BusLogEntry) + len);
+
+  if (entry == NULL)
+    return FALSE;
+
+  entry->write_func = write_func;
+  entry->write_data = write_data;
+  memcpy (entry->text, text, len + 1);
+
+  if (!_dbus_list_append (&queue->entries, entry))
+    {
+      dbus_free (entry);
+      return FALSE;
+    }
+
+  bus_expire_timeout_set_interval (queue->timeout, 0);
+  return TRUE;
+}
+
+static void
+format_summary (BusLogQueue *queue,
+                char        *buf,
+                size_t       size)
+{
+  snprintf (buf, size, "%d more security messages suppressed",
+            queue->n_suppressed);
+}
+
+static void
+start_window_if_due (BusLogQueue *queue,
+                     long         now)
+{
+  char buf[64];
+
+  if (now - queue->window_start < WINDOW_MSEC)
+    return;
+
+  /* If there is no memory to report the suppressed messages, the count
+   * carries over to the next window */
+  if (queue->n_suppressed > 0)
+    {
+      format_summary (queue, buf, sizeof (buf));
+
+      if (queue_entry (queue, queue->summary_func, queue->summary_data, buf))
+        queue->n_suppressed = 0;
+    }
+
+  queue->window_start = now;
+  queue->n_in_window = 0;
+}
+
+static void
+log_queue_push_at (BusLogQueue     *queue,
+                   BusLogWriteFunc  write_func,
+                   void            *write_data,
+                   const char      *text,
+                   long             now)
+{
+  start_window_if_due (queue, now);
+
+  if (queue->n_in_window >= MAX_PER_WINDOW)
+    {
+      queue->n_suppressed += 1;
+
+      /* wake up at the end of the window to report it */
+      if (!dbus_timeout_get_enabled (queue->timeout))
+        bus_expire_timeout_set_interval (queue->timeout,
+            queue->window_start + WINDOW_MSEC - now);
+
+      return;
+    }
+
+  /* If there is no memory to queue it, it is reported as suppressed */
+  if (!queue_entry (queue, write_func, write_data, text))
+    queue->n_suppressed += 1;
+  else
+    queue->n_in_window += 1;
+}
+
+/**
+ * Queues a message to be written by write_func from the main loop,
+ * unless too many have been queued recently, in which case it is only
+ * counted.
+ *
+ * @param queue the queue
+ * @param write_func writes the message
+ * @param write_data passed to write_func
+ * @param text the message, which is copied
+ */
+void
+bus_log_queue_push (BusLogQueue     *queue,
+                    BusLogWriteFunc  write_func,
+                    void            *write_data,
+                    const char      *text)
+{
+  log_queue_push_at (queue, write_func, write_data, text, monotonic_msec ());
+}
+
+static void
+write_entries (BusLogQueue *queue)
+{
+  BusLogEntry *entry;
+
+  while ((entry = _dbus_list_pop_first (&queue->entries)) != NULL)
+    {
+      (* entry->write_func) (entry->text, entry->write_data);
+      dbus_free (entry);
+    }
+}
+
+static void
+log_queue_flush_at (BusLogQueue *queue,
+                    long         now)
+{
+  start_window_if_due (queue, now);
+  write_entries (queue);
+
+  if (queue->n_suppressed > 0)
+    bus_expire_timeout_set_interval (queue->timeout,
+        queue->window_start + WINDOW_MSEC - now);
+  else
+    bus_expire_timeout_set_interval (queue->timeout, -1);
+}
+
+/**
+ * Writes out everything that was queued. The summary of messages that
+ * were suppressed waits for the end of their window.
+ *
+ * @param queue the queue
+ */
+void
+bus_log_queue_flush (BusLogQueue *queue)
+{
+  log_queue_flush_at (queue, monotonic_msec ());
+}
+
+static dbus_bool_t
+log_queue_timeout_handler (void *data)
+{
+  BusLogQueue *queue = data;
+
+  log_queue_flush_at (queue, monotonic_msec ());
+  return TRUE;
+}
+
+void
+bus_log_queue_free (BusLogQueue *queue)
+{
+  char buf[64];
+
+  write_entries (queue);
+
+  if (queue->n_suppressed > 0)
+    {
+      format_summary (queue, buf, sizeof (buf));
+      (* queue->summary_func) (buf, queue->summary_data);
+    }
+
+  _dbus_loop_remove_timeout (queue->loop, queue->timeout);
+  _dbus_timeout_unref (queue->timeout);
+
+  dbus_free (queue);
+}
+
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+
+static void
+test_write (const char *text,
+            void       *data)
+{
+  DBusString *log = data;
+
+  if (!_dbus_string_append (log, text) ||
+      !_dbus_string_append_byte (log, '\n'))
+    _dbus_test_fatal ("out of memory");
+}
+
+dbus_bool_t
+bus_log_queue_test (const DBusString *test_data_dir)
+{
+  DBusLoop *loop;
+  BusLogQueue *queue;
+  DBusString log;
+  long now;
+  int i;
+
+  loop = _dbus_loop_new ();
+  _dbus_assert (loop != NULL);
+
+  if (!_dbus_string_init (&log))
+    _dbus_test_fatal ("out of memory");
+
+  queue = bus_log_queue_new (loop, test_write, &log);
+  if (queue == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  now = queue->window_start;
+
+  /* nothing is written until the queue is flushed */
+  log_queue_push_at (queue, test_write, &log, "first", now);
+  _dbus_assert (_dbus_string_get_length (&log) == 0);
+  _dbus_assert (dbus_timeout_get_enabled (queue->timeout));
+
+  log_queue_flush_at (queue, now);
+  _dbus_assert (_dbus_string_equal_c_str (&log, "first\n"));
+  _dbus_assert (!dbus_timeout_get_enabled (queue->timeout));
+
+  /* a burst is cut off, and the rest are summarized when the window
+   * is over */
+  for (i = 1; i < MAX_PER_WINDOW + 10; i++)
+    log_queue_push_at (queue, test_write, &log, "x", now + 1);
+
+  _dbus_assert (queue->n_suppressed == 10);
+  log_queue_flush_at (queue, now + 2);
+  _dbus_assert (queue->n_suppressed == 10);
+  _dbus_assert (dbus_timeout_get_enabled (queue->timeout));
+  _dbus_assert (dbus_timeout_get_interval (queue->timeout) ==
+                WINDOW_MSEC - 2);
+
+  log_queue_flush_at (queue, now + WINDOW_MSEC);
+  _dbus_assert (queue->n_suppressed == 0);
+  _dbus_assert (_dbus_string_ends_with_c_str (&log,
+                "x\n10 more security messages suppressed\n"));
+
+  /* the next window starts afresh, and a message that starts it goes
+   * after the summary of the previous one */
+  _dbus_string_set_length (&log, 0);
+
+  for (i = 0; i < MAX_PER_WINDOW + 1; i++)
+    log_queue_push_at (queue, test_write, &log, "y", now + WINDOW_MSEC + 1);
+
+  log_queue_push_at (queue, test_write, &log, "z", now + 2 * WINDOW_MSEC + 1);
+  _dbus_assert (_dbus_string_get_length (&log) == 0);
+  log_queue_flush_at (queue, now + 2 * WINDOW_MSEC + 1);
+  _dbus_assert (_dbus_string_ends_with_c_str (&log,
+                "y\n1 more security messages suppressed\nz\n"));
+  _dbus_string_set_length (&log, 0);
+
+  /* freeing the queue writes out whatever is left, summary and all */
+  for (i = 0; i < MAX_PER_WINDOW + 1; i++)
+    log_queue_push_at (queue, test_write, &log, "w", now + 2 * WINDOW_MSEC + 2);
+
+  bus_log_queue_free (queue);
+  _dbus_assert (_dbus_string_ends_with_c_str (&log,
+                "w\n2 more security messages suppressed\n"));
+
+  _dbus_string_free (&log);
+  _dbus_loop_unref (loop);
+  return TRUE;
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
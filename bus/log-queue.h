@@ -0,0 +1,47 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* log-queue.h  Rate-limited queue of security log messages
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_LOG_QUEUE_H
+#define BUS_LOG_QUEUE_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+
+typedef struct BusLogQueue BusLogQueue;
+
+/* Writes out one message, to syslog, the audit subsystem or wherever
+ * the code that queued it wanted it to go */
+typedef void (* BusLogWriteFunc) (const char *text,
+                                  void       *data);
+
+BusLogQueue *bus_log_queue_new   (DBusLoop        *loop,
+                                  BusLogWriteFunc  summary_func,
+                                  void            *summary_data);
+void         bus_log_queue_free  (BusLogQueue     *queue);
+void         bus_log_queue_push  (BusLogQueue     *queue,
+                                  BusLogWriteFunc  write_func,
+                                  void            *write_data,
+                                  const char      *text);
+void         bus_log_queue_flush (BusLogQueue     *queue);
+
+#endif /* BUS_LOG_QUEUE_H */
@@ -24,6 +24,7 @@
 #include <config.h>
 #include "bus.h"
 #include "driver.h"
+#include "handoff.h"
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-watch.h>
 #include <stdio.h>
@@ -61,7 +62,8 @@ static void close_reload_pipe (DBusWatch **);
 typedef enum
  {
    ACTION_RELOAD = 'r',
-   ACTION_QUIT = 'q'
+   ACTION_QUIT = 'q',
+   ACTION_HANDOFF = 'h'
  } SignalAction;
 
 static void
@@ -107,6 +109,27 @@ signal_handler (int sig)
       }
       break;
 
+    case SIGUSR2:
+      {
+        DBusString str;
+        char action[2] = { ACTION_HANDOFF, '\0' };
+
+        _dbus_string_init_const (&str, action);
+        if ((reload_pipe[RELOAD_WRITE_END].fd > 0) &&
+            !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
+          {
+            static const char message[] =
+              "Unable to write to reload pipe - buffer full?\n";
+
+            if (write (STDERR_FILENO, message, strlen (message)) !=
+                (ssize_t) strlen (message))
+              {
+                /* ignore failure to write out a warning */
+              }
+          }
+      }
+      break;
+
     case SIGTERM:
       {
         DBusString str;
@@ -308,6 +331,10 @@ handle_reload_watch (DBusWatch    *watch,
         }
       break;
 
+    case ACTION_HANDOFF:
+      bus_handoff_begin (context);
+      break;
+
     case ACTION_QUIT:
       {
         DBusLoop *loop;
@@ -402,8 +429,10 @@ main (int argc, char **argv)
   dbus_bool_t print_address;
   dbus_bool_t print_pid;
   BusContextFlags flags;
+  BusHandoff *handoff = NULL;
 #ifdef DBUS_UNIX
   const char *error_str;
+  int handoff_fd = -1;
 
   /* Redirect stdin from /dev/null since we will never need it, and
    * redirect stdout and stderr to /dev/null if not already open.
@@ -422,6 +451,9 @@ main (int argc, char **argv)
                error_str, _dbus_strerror (errno));
       return 1;
     }
+
+  /* If this fails, bus_handoff_begin() will say so */
+  bus_handoff_save_argv (argc, argv);
 #endif
 
   if (!_dbus_string_init (&config_file))
@@ -491,6 +523,26 @@ main (int argc, char **argv)
         {
           flags |= BUS_CONTEXT_FLAG_SYSTEMD_ACTIVATION;
         }
+      else if (strstr (arg, "--handoff-fd=") == arg)
+        {
+          /* Only used by bus_handoff_begin(), so not in usage() */
+          DBusString str;
+          long val;
+          int end;
+
+          _dbus_string_init_const (&str, strchr (arg, '=') + 1);
+
+          if (!_dbus_string_parse_int (&str, 0, &val, &end) ||
+              end != _dbus_string_get_length (&str) ||
+              val < 0 || val > _DBUS_INT_MAX)
+            {
+              fprintf (stderr, "Invalid file descriptor: \"%s\"\n",
+                       _dbus_string_get_const_data (&str));
+              exit (1);
+            }
+
+          handoff_fd = val;
+        }
 #endif
       else if (strcmp (arg, "--nopidfile") == 0)
         {
@@ -687,11 +739,33 @@ main (int argc, char **argv)
     }
 
   dbus_error_init (&error);
+
+#ifdef DBUS_UNIX
+  if (handoff_fd >= 0)
+    {
+      handoff = bus_handoff_load (handoff_fd, &error);
+
+      if (handoff == NULL)
+        {
+          _dbus_warn ("Failed to take over from the previous message bus: %s",
+                      error.message);
+          dbus_error_free (&error);
+          exit (1);
+        }
+    }
+#endif
+
   context = bus_context_new (&config_file, flags,
                              &print_addr_pipe, &print_pid_pipe,
                              _dbus_string_get_length(&address) > 0 ? &address : NULL,
-                             &error);
+                             handoff, &error);
   _dbus_string_free (&config_file);
+
+#ifdef DBUS_UNIX
+  if (handoff != NULL)
+    bus_handoff_free (handoff);
+#endif
+
   if (context == NULL)
     {
       _dbus_warn ("Failed to start message bus: %s",
@@ -713,6 +787,7 @@ main (int argc, char **argv)
 
   _dbus_set_signal_handler (SIGTERM, signal_handler);
   _dbus_set_signal_handler (SIGHUP, signal_handler);
+  _dbus_set_signal_handler (SIGUSR2, signal_handler);
 #endif /* DBUS_UNIX */
 
   _dbus_verbose ("We are on D-Bus...\n");
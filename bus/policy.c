@@ -23,6 +23,7 @@
 
 #include <config.h>
 #include "policy.h"
+#include "intern.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
@@ -30,6 +31,7 @@
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-test-tap.h>
 
 BusPolicyRule*
 bus_policy_rule_new (BusPolicyRuleType type,
@@ -100,15 +102,15 @@ bus_policy_rule_unref (BusPolicyRule *rule)
         {
         case BUS_POLICY_RULE_SEND:
           dbus_free (rule->d.send.path);
-          dbus_free (rule->d.send.interface);
-          dbus_free (rule->d.send.member);
+          bus_intern_release (rule->d.send.interface);
+          bus_intern_release (rule->d.send.member);
           dbus_free (rule->d.send.error);
           dbus_free (rule->d.send.destination);
           break;
         case BUS_POLICY_RULE_RECEIVE:
           dbus_free (rule->d.receive.path);
-          dbus_free (rule->d.receive.interface);
-          dbus_free (rule->d.receive.member);
+          bus_intern_release (rule->d.receive.interface);
+          bus_intern_release (rule->d.receive.member);
           dbus_free (rule->d.receive.error);
           dbus_free (rule->d.receive.origin);
           break;
@@ -137,6 +139,8 @@ struct BusPolicy
   DBusHashTable *rules_by_gid;     /**< per-GID policy rules */
   DBusList *at_console_true_rules; /**< console user policy rules where at_console="true"*/
   DBusList *at_console_false_rules; /**< console user policy rules where at_console="false"*/
+  DBusList *client_policies;       /**< Client policies created from this one, not referenced */
+  DBusHashTable *client_policies_by_credentials; /**< Credentials key => a member of client_policies */
 };
 
 static void
@@ -186,6 +190,11 @@ bus_policy_new (void)
   if (policy->rules_by_gid == NULL)
     goto failed;
 
+  policy->client_policies_by_credentials =
+    _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+  if (policy->client_policies_by_credentials == NULL)
+    goto failed;
+
   return policy;
   
  failed:
@@ -212,6 +221,9 @@ bus_policy_unref (BusPolicy *policy)
 
   if (policy->refcount == 0)
     {
+      /* each of them holds a reference to us */
+      _dbus_assert (policy->client_policies == NULL);
+
       _dbus_list_foreach (&policy->default_rules, free_rule_func, NULL);
       _dbus_list_clear (&policy->default_rules);
 
@@ -235,6 +247,12 @@ bus_policy_unref (BusPolicy *policy)
           _dbus_hash_table_unref (policy->rules_by_gid);
           policy->rules_by_gid = NULL;
         }
+
+      if (policy->client_policies_by_credentials)
+        {
+          _dbus_hash_table_unref (policy->client_policies_by_credentials);
+          policy->client_policies_by_credentials = NULL;
+        }
       
       dbus_free (policy);
     }
@@ -275,17 +293,117 @@ add_list_to_client (DBusList        **list,
   return TRUE;
 }
 
+static BusClientPolicy *bus_policy_share_client_policy (BusPolicy       *policy,
+                                                        BusClientPolicy *client);
+static void bus_client_policy_compile (BusClientPolicy *policy);
+static void bus_policy_intern_client_policy (BusPolicy       *policy,
+                                             BusClientPolicy *client,
+                                             DBusString      *key);
+
+/* Describe the credentials that decide which rules a connection gets,
+ * leaving out the ones that no rule mentions: the uid if it has its own
+ * rules, whether it is at the console, and the groups that have rules,
+ * in the order their rules will be added. */
+static dbus_bool_t
+append_credentials_key (BusPolicy           *policy,
+                        DBusString          *key,
+                        dbus_bool_t          have_uid,
+                        dbus_uid_t           uid,
+                        dbus_bool_t          at_console,
+                        const unsigned long *groups,
+                        int                  n_groups)
+{
+  int i;
+
+  if (!have_uid)
+    {
+      if (!_dbus_string_append (key, "u-"))
+        return FALSE;
+    }
+  else if (_dbus_hash_table_lookup_uintptr (policy->rules_by_uid, uid) != NULL)
+    {
+      if (!_dbus_string_append_printf (key, "u%lu,c%d",
+                                       (unsigned long) uid, at_console))
+        return FALSE;
+    }
+  else
+    {
+      if (!_dbus_string_append_printf (key, "u*,c%d", at_console))
+        return FALSE;
+    }
+
+  for (i = 0; i < n_groups; i++)
+    {
+      if (_dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                           groups[i]) == NULL)
+        continue;
+
+      if (!_dbus_string_append_printf (key, ",g%lu", groups[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 BusClientPolicy*
 bus_policy_create_client_policy (BusPolicy      *policy,
                                  DBusConnection *connection,
                                  DBusError      *error)
 {
   BusClientPolicy *client;
+  DBusString key;
+  unsigned long *groups;
+  int n_groups;
   dbus_uid_t uid;
+  dbus_bool_t have_uid;
   dbus_bool_t at_console;
 
   _dbus_assert (dbus_connection_get_is_authenticated (connection));
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  client = NULL;
+  groups = NULL;
+  n_groups = 0;
+  at_console = FALSE;
+
+  if (!_dbus_string_init (&key))
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  /* we avoid the overhead of looking up user's groups
+   * if we don't have any group rules anyway
+   */
+  if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
+    {
+      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
+        goto failed;
+    }
+
+  have_uid = dbus_connection_get_unix_user (connection, &uid);
+
+  if (have_uid)
+    {
+      at_console = _dbus_unix_user_is_at_console (uid, error);
+
+      if (!at_console && dbus_error_is_set (error))
+        goto failed;
+    }
+
+  if (!append_credentials_key (policy, &key, have_uid, uid, at_console,
+                               groups, n_groups))
+    goto nomem;
+
+  client = _dbus_hash_table_lookup_string (policy->client_policies_by_credentials,
+                                           _dbus_string_get_const_data (&key));
+
+  if (client != NULL)
+    {
+      dbus_free (groups);
+      _dbus_string_free (&key);
+      return bus_client_policy_ref (client);
+    }
   
   client = bus_client_policy_new ();
   if (client == NULL)
@@ -295,18 +413,10 @@ bus_policy_create_client_policy (BusPolicy      *policy,
                            client))
     goto nomem;
 
-  /* we avoid the overhead of looking up user's groups
-   * if we don't have any group rules anyway
-   */
-  if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
+  if (groups != NULL)
     {
-      unsigned long *groups;
-      int n_groups;
       int i;
       
-      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
-        goto failed;
-      
       i = 0;
       while (i < n_groups)
         {
@@ -318,19 +428,14 @@ bus_policy_create_client_policy (BusPolicy      *policy,
           if (list != NULL)
             {
               if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
+                goto nomem;
             }
           
           ++i;
         }
-
-      dbus_free (groups);
     }
   
-  if (dbus_connection_get_unix_user (connection, &uid))
+  if (have_uid)
     {
       if (_dbus_hash_table_get_n_entries (policy->rules_by_uid) > 0)
         {
@@ -347,17 +452,11 @@ bus_policy_create_client_policy (BusPolicy      *policy,
         }
 
       /* Add console rules */
-      at_console = _dbus_unix_user_is_at_console (uid, error);
-      
       if (at_console)
         {
           if (!add_list_to_client (&policy->at_console_true_rules, client))
             goto nomem;
         }
-      else if (dbus_error_is_set (error) == TRUE)
-        {
-          goto failed;
-        }
       else if (!add_list_to_client (&policy->at_console_false_rules, client))
         {
           goto nomem;
@@ -369,7 +468,13 @@ bus_policy_create_client_policy (BusPolicy      *policy,
     goto nomem;
 
   bus_client_policy_optimize (client);
-  
+
+  client = bus_policy_share_client_policy (policy, client);
+  bus_client_policy_compile (client);
+  bus_policy_intern_client_policy (policy, client, &key);
+
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return client;
 
  nomem:
@@ -378,6 +483,8 @@ bus_policy_create_client_policy (BusPolicy      *policy,
   _DBUS_ASSERT_ERROR_IS_SET (error);
   if (client)
     bus_client_policy_unref (client);
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return NULL;
 }
 
@@ -606,6 +713,16 @@ bus_policy_append_console_rule (BusPolicy      *policy,
 
 }
 
+static dbus_bool_t
+str_equal_or_null (const char *a,
+                   const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
 static dbus_bool_t
 append_copy_of_policy_list (DBusList **list,
                             DBusList **to_append)
@@ -696,108 +813,822 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+static dbus_bool_t
+bus_policy_rule_equal (const BusPolicyRule *a,
+                       const BusPolicyRule *b)
+{
+  if (a == b)
+    return TRUE;
+
+  if (a->type != b->type || a->allow != b->allow)
+    return FALSE;
+
+  switch (a->type)
+    {
+    case BUS_POLICY_RULE_SEND:
+      return a->d.send.message_type == b->d.send.message_type &&
+             str_equal_or_null (a->d.send.path, b->d.send.path) &&
+             a->d.send.interface == b->d.send.interface &&
+             a->d.send.member == b->d.send.member &&
+             str_equal_or_null (a->d.send.error, b->d.send.error) &&
+             str_equal_or_null (a->d.send.destination,
+                                b->d.send.destination) &&
+             a->d.send.max_fds == b->d.send.max_fds &&
+             a->d.send.min_fds == b->d.send.min_fds &&
+             a->d.send.eavesdrop == b->d.send.eavesdrop &&
+             a->d.send.requested_reply == b->d.send.requested_reply &&
+             a->d.send.log == b->d.send.log &&
+             a->d.send.broadcast == b->d.send.broadcast;
+
+    case BUS_POLICY_RULE_RECEIVE:
+      return a->d.receive.message_type == b->d.receive.message_type &&
+             str_equal_or_null (a->d.receive.path, b->d.receive.path) &&
+             a->d.receive.interface == b->d.receive.interface &&
+             a->d.receive.member == b->d.receive.member &&
+             str_equal_or_null (a->d.receive.error, b->d.receive.error) &&
+             str_equal_or_null (a->d.receive.origin, b->d.receive.origin) &&
+             a->d.receive.max_fds == b->d.receive.max_fds &&
+             a->d.receive.min_fds == b->d.receive.min_fds &&
+             a->d.receive.eavesdrop == b->d.receive.eavesdrop &&
+             a->d.receive.requested_reply == b->d.receive.requested_reply;
+
+    case BUS_POLICY_RULE_OWN:
+      return str_equal_or_null (a->d.own.service_name,
+                                b->d.own.service_name) &&
+             a->d.own.prefix == b->d.own.prefix;
+
+    case BUS_POLICY_RULE_USER:
+      return a->d.user.uid == b->d.user.uid;
+
+    case BUS_POLICY_RULE_GROUP:
+      return a->d.group.gid == b->d.group.gid;
+
+    default:
+      _dbus_assert_not_reached ("invalid rule");
+      return FALSE;
+    }
+}
+
+static dbus_bool_t
+policy_list_equal (DBusList **a,
+                   DBusList **b)
+{
+  DBusList *link_a;
+  DBusList *link_b;
+
+  link_a = _dbus_list_get_first_link (a);
+  link_b = _dbus_list_get_first_link (b);
+
+  while (link_a != NULL && link_b != NULL)
+    {
+      if (!bus_policy_rule_equal (link_a->data, link_b->data))
+        return FALSE;
+
+      link_a = _dbus_list_get_next_link (a, link_a);
+      link_b = _dbus_list_get_next_link (b, link_b);
+    }
+
+  return link_a == NULL && link_b == NULL;
+}
+
+static dbus_bool_t
+id_hash_equal (DBusHashTable *a,
+               DBusHashTable *b)
+{
+  DBusHashIter iter;
+
+  if (_dbus_hash_table_get_n_entries (a) !=
+      _dbus_hash_table_get_n_entries (b))
+    return FALSE;
+
+  _dbus_hash_iter_init (a, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      uintptr_t id = _dbus_hash_iter_get_uintptr_key (&iter);
+      DBusList **list = _dbus_hash_iter_get_value (&iter);
+      DBusList **other = _dbus_hash_table_lookup_uintptr (b, id);
+
+      if (other == NULL || !policy_list_equal (list, other))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Checks whether two policies contain the same rules in the same
+ * order, so that any connection would get the same client policy
+ * from either of them.
+ *
+ * @param policy a policy
+ * @param other another policy
+ * @returns #TRUE if the policies are equivalent
+ */
+dbus_bool_t
+bus_policy_equal (BusPolicy *policy,
+                  BusPolicy *other)
+{
+  if (policy == other)
+    return TRUE;
+
+  return policy_list_equal (&policy->default_rules,
+                            &other->default_rules) &&
+         policy_list_equal (&policy->mandatory_rules,
+                            &other->mandatory_rules) &&
+         policy_list_equal (&policy->at_console_true_rules,
+                            &other->at_console_true_rules) &&
+         policy_list_equal (&policy->at_console_false_rules,
+                            &other->at_console_false_rules) &&
+         id_hash_equal (policy->rules_by_uid, other->rules_by_uid) &&
+         id_hash_equal (policy->rules_by_gid, other->rules_by_gid);
+}
+
+/* The send or receive rules of a client policy that can apply to one
+ * message type, split up so that a check only looks at the rules that
+ * could apply to the message's interface. Each list is in config file
+ * order, like BusClientPolicy::rules, which owns the rules. */
+typedef struct
+{
+  /* interface => DBusList of rules for messages with that interface */
+  DBusHashTable *by_interface;
+  /* rules for messages with an interface not in by_interface */
+  DBusList *other_interface;
+  /* rules for messages with no interface */
+  DBusList *no_interface;
+} BusRuleIndex;
+
+/* Size of each client policy's send and receive verdict caches */
+#define BUS_VERDICT_CACHE_SIZE 8
+
+/* The inputs and result of one policy check. The strings are the
+ * message's header fields, or NULL if absent; they are copied into one
+ * allocation, @strings. */
+typedef struct
+{
+  char *strings;
+  const char *path;
+  const char *interface;
+  const char *member;
+  const char *error;
+  /* The name in the message that destination or origin rules check
+   * when there is no connection to check instead, if those rules exist */
+  const char *name;
+  /* The receiver or sender, if destination or origin rules exist */
+  DBusConnection *peer;
+  int message_type;
+  unsigned int n_fds;
+  unsigned int reply : 1;
+  unsigned int requested_reply : 1;
+  unsigned int broadcast : 1;
+  unsigned int eavesdropping : 1;
+
+  unsigned int allowed : 1;
+  unsigned int log : 1;
+  dbus_int32_t toggles;
+} BusPolicyVerdict;
+
+/* Recently computed verdicts, most recently used first */
+typedef struct
+{
+  BusPolicyVerdict entries[BUS_VERDICT_CACHE_SIZE];
+  int n_entries;
+  /* If the rules depend on name ownership, the registry's owners
+   * serial when the entries were computed */
+  dbus_uint64_t owners_serial;
+} BusVerdictCache;
+
 struct BusClientPolicy
 {
   int refcount;
 
   DBusList *rules;
+
+  /* The policy this was created from and our link in its
+   * client_policies, or NULL if this is not shared */
+  BusPolicy *policy;
+  DBusList *link_in_policy;
+  /* Our keys in policy->client_policies_by_credentials, owned by it */
+  DBusList *credentials_keys;
+
+  /* Compiled from rules, indexed by message type; either all set or
+   * all NULL, in which case checks walk the rules list instead */
+  BusRuleIndex *send_index[DBUS_NUM_MESSAGE_TYPES];
+  BusRuleIndex *receive_index[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Verdicts are only cached for compiled policies, since that is when
+   * we know whether the rules depend on who owns which names */
+  BusVerdictCache send_verdicts;
+  BusVerdictCache receive_verdicts;
+  unsigned int verdicts_cacheable : 1;
+  unsigned int send_checks_owners : 1;
+  unsigned int receive_checks_owners : 1;
 };
 
-BusClientPolicy*
-bus_client_policy_new (void)
+static void
+bus_verdict_cache_clear (BusVerdictCache *cache)
 {
-  BusClientPolicy *policy;
+  int i;
 
-  policy = dbus_new0 (BusClientPolicy, 1);
-  if (policy == NULL)
-    return NULL;
+  for (i = 0; i < cache->n_entries; i++)
+    dbus_free (cache->entries[i].strings);
 
-  policy->refcount = 1;
+  cache->n_entries = 0;
+}
 
-  return policy;
+static dbus_bool_t
+bus_policy_verdict_matches (const BusPolicyVerdict *verdict,
+                            const BusPolicyVerdict *key)
+{
+  return verdict->message_type == key->message_type &&
+         verdict->n_fds == key->n_fds &&
+         verdict->peer == key->peer &&
+         verdict->reply == key->reply &&
+         verdict->requested_reply == key->requested_reply &&
+         verdict->broadcast == key->broadcast &&
+         verdict->eavesdropping == key->eavesdropping &&
+         str_equal_or_null (verdict->member, key->member) &&
+         str_equal_or_null (verdict->interface, key->interface) &&
+         str_equal_or_null (verdict->path, key->path) &&
+         str_equal_or_null (verdict->error, key->error) &&
+         str_equal_or_null (verdict->name, key->name);
 }
 
-BusClientPolicy *
-bus_client_policy_ref (BusClientPolicy *policy)
+/* Describe a check of @message in @key. The strings point into the
+ * message until the key is added to a cache. */
+static void
+bus_policy_verdict_init_key (BusPolicyVerdict *key,
+                             DBusMessage      *message,
+                             dbus_bool_t       requested_reply,
+                             dbus_bool_t       eavesdropping,
+                             DBusConnection   *peer,
+                             const char       *name)
 {
-  _dbus_assert (policy->refcount > 0);
+  key->strings = NULL;
+  key->path = dbus_message_get_path (message);
+  key->interface = dbus_message_get_interface (message);
+  key->member = dbus_message_get_member (message);
+  key->error = dbus_message_get_error_name (message);
+  key->peer = peer;
+  key->name = peer == NULL ? name : NULL;
+  key->message_type = dbus_message_get_type (message);
+  key->n_fds = _dbus_message_get_n_unix_fds (message);
+  key->reply = dbus_message_get_reply_serial (message) != 0;
+  /* only relevant for replies */
+  key->requested_reply = key->reply && requested_reply;
+  key->broadcast = dbus_message_get_destination (message) == NULL &&
+    key->message_type == DBUS_MESSAGE_TYPE_SIGNAL;
+  key->eavesdropping = eavesdropping;
+}
 
-  policy->refcount += 1;
+/* Look up @key, flushing the cache first if names have changed owner
+ * and the rules care about that */
+static const BusPolicyVerdict *
+bus_verdict_cache_lookup (BusVerdictCache        *cache,
+                          BusRegistry            *registry,
+                          dbus_bool_t             checks_owners,
+                          const BusPolicyVerdict *key)
+{
+  int i;
 
-  return policy;
+  if (checks_owners)
+    {
+      dbus_uint64_t serial = bus_registry_get_owners_serial (registry);
+
+      if (serial != cache->owners_serial)
+        {
+          bus_verdict_cache_clear (cache);
+          cache->owners_serial = serial;
+        }
+    }
+
+  for (i = 0; i < cache->n_entries; i++)
+    {
+      if (bus_policy_verdict_matches (&cache->entries[i], key))
+        {
+          BusPolicyVerdict verdict = cache->entries[i];
+
+          /* move to the front */
+          memmove (&cache->entries[1], &cache->entries[0],
+                   i * sizeof (BusPolicyVerdict));
+          cache->entries[0] = verdict;
+          return &cache->entries[0];
+        }
+    }
+
+  return NULL;
 }
 
-static void
-rule_unref_foreach (void *data,
-                    void *user_data)
+static const char *
+copy_key_string (char       **p,
+                 const char  *str)
 {
-  BusPolicyRule *rule = data;
+  const char *copy = *p;
+  size_t len;
 
-  bus_policy_rule_unref (rule);
+  if (str == NULL)
+    return NULL;
+
+  len = strlen (str) + 1;
+  memcpy (*p, str, len);
+  *p += len;
+  return copy;
 }
 
-void
-bus_client_policy_unref (BusClientPolicy *policy)
+/* Remember a verdict, forgetting the least recently used one if the
+ * cache is full. This is only an optimization, so running out of
+ * memory is not an error. */
+static void
+bus_verdict_cache_add (BusVerdictCache        *cache,
+                       const BusPolicyVerdict *key)
 {
-  _dbus_assert (policy->refcount > 0);
-
-  policy->refcount -= 1;
+  BusPolicyVerdict *verdict;
+  size_t len;
+  char *p;
+
+  len = 0;
+
+#define KEY_STRING_SIZE(str) ((str) != NULL ? strlen (str) + 1 : 0)
+  len += KEY_STRING_SIZE (key->path);
+  len += KEY_STRING_SIZE (key->interface);
+  len += KEY_STRING_SIZE (key->member);
+  len += KEY_STRING_SIZE (key->error);
+  len += KEY_STRING_SIZE (key->name);
+#undef KEY_STRING_SIZE
+
+  p = dbus_malloc (len > 0 ? len : 1);
+  if (p == NULL)
+    return;
 
-  if (policy->refcount == 0)
+  if (cache->n_entries == BUS_VERDICT_CACHE_SIZE)
     {
-      _dbus_list_foreach (&policy->rules,
-                          rule_unref_foreach,
-                          NULL);
+      cache->n_entries -= 1;
+      dbus_free (cache->entries[cache->n_entries].strings);
+    }
 
-      _dbus_list_clear (&policy->rules);
+  memmove (&cache->entries[1], &cache->entries[0],
+           cache->n_entries * sizeof (BusPolicyVerdict));
+  cache->n_entries += 1;
+
+  verdict = &cache->entries[0];
+  *verdict = *key;
+  verdict->strings = p;
+  verdict->path = copy_key_string (&p, key->path);
+  verdict->interface = copy_key_string (&p, key->interface);
+  verdict->member = copy_key_string (&p, key->member);
+  verdict->error = copy_key_string (&p, key->error);
+  verdict->name = copy_key_string (&p, key->name);
+}
 
-      dbus_free (policy);
-    }
+static void
+free_rule_index_list (void *data)
+{
+  DBusList *list = data;
+
+  _dbus_list_clear (&list);
 }
 
 static void
-remove_rules_by_type_up_to (BusClientPolicy   *policy,
-                            BusPolicyRuleType  type,
-                            DBusList          *up_to)
+bus_rule_index_free (BusRuleIndex *rule_index)
 {
-  DBusList *link;
+  if (rule_index == NULL)
+    return;
 
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != up_to)
+  if (rule_index->by_interface != NULL)
+    _dbus_hash_table_unref (rule_index->by_interface);
+
+  _dbus_list_clear (&rule_index->other_interface);
+  _dbus_list_clear (&rule_index->no_interface);
+  dbus_free (rule_index);
+}
+
+static dbus_bool_t
+bus_rule_index_add_rule (BusRuleIndex  *rule_index,
+                         BusPolicyRule *rule,
+                         const char    *interface)
+{
+  DBusList *list;
+
+  if (interface == NULL)
     {
-      BusPolicyRule *rule = link->data;
-      DBusList *next = _dbus_list_get_next_link (&policy->rules, link);
+      DBusHashIter iter;
 
-      if (rule->type == type)
+      /* applies whatever the interface is */
+      _dbus_hash_iter_init (rule_index->by_interface, &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          _dbus_list_remove_link (&policy->rules, link);
-          bus_policy_rule_unref (rule);
+          list = _dbus_hash_iter_get_value (&iter);
+
+          /* appending to a non-empty list doesn't change its head */
+          if (!_dbus_list_append (&list, rule))
+            return FALSE;
+        }
+
+      return _dbus_list_append (&rule_index->other_interface, rule) &&
+             _dbus_list_append (&rule_index->no_interface, rule);
+    }
+
+  list = _dbus_hash_table_lookup_string (rule_index->by_interface, interface);
+
+  if (list == NULL)
+    {
+      /* First rule for this interface: it is preceded by the rules
+       * that apply to any interface so far */
+      if (!_dbus_list_copy (&rule_index->other_interface, &list))
+        return FALSE;
+
+      if (!_dbus_list_append (&list, rule) ||
+          !_dbus_hash_table_insert_string (rule_index->by_interface,
+                                           (char *) interface, list))
+        {
+          _dbus_list_clear (&list);
+          return FALSE;
         }
-      
-      link = next;
     }
+  else if (!_dbus_list_append (&list, rule))
+    {
+      return FALSE;
+    }
+
+  /* Deny rules with an interface also apply to messages without one;
+   * see send_rule_matches() */
+  if (!rule->allow && !_dbus_list_append (&rule_index->no_interface, rule))
+    return FALSE;
+
+  return TRUE;
 }
 
-void
-bus_client_policy_optimize (BusClientPolicy *policy)
+static BusRuleIndex *
+bus_rule_index_new (DBusList          **rules,
+                    BusPolicyRuleType   type,
+                    int                 message_type)
 {
+  BusRuleIndex *rule_index;
   DBusList *link;
 
-  /* The idea here is that if we have:
-   * 
-   * <allow send_interface="foo.bar"/>
-   * <deny send_interface="*"/>
-   *
-   * (for example) the deny will always override the allow.  So we
-   * delete the allow. Ditto for deny followed by allow, etc. This is
-   * a dumb thing to put in a config file, but the <include> feature
-   * of files allows for an "inheritance and override" pattern where
-   * it could make sense. If an included file wants to "start over"
-   * with a blanket deny, no point keeping the rules from the parent
-   * file.
-   */
+  rule_index = dbus_new0 (BusRuleIndex, 1);
+  if (rule_index == NULL)
+    return NULL;
 
-  _dbus_verbose ("Optimizing policy with %d rules\n",
+  rule_index->by_interface = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                              free_rule_index_list);
+  if (rule_index->by_interface == NULL)
+    goto failed;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+      int rule_message_type;
+      const char *interface;
+
+      if (rule->type != type)
+        continue;
+
+      if (type == BUS_POLICY_RULE_SEND)
+        {
+          rule_message_type = rule->d.send.message_type;
+          interface = rule->d.send.interface;
+        }
+      else
+        {
+          rule_message_type = rule->d.receive.message_type;
+          interface = rule->d.receive.interface;
+        }
+
+      if (rule_message_type != DBUS_MESSAGE_TYPE_INVALID &&
+          rule_message_type != message_type)
+        continue;
+
+      if (!bus_rule_index_add_rule (rule_index, rule, interface))
+        goto failed;
+    }
+
+  return rule_index;
+
+ failed:
+  bus_rule_index_free (rule_index);
+  return NULL;
+}
+
+static void
+bus_client_policy_free_indexes (BusClientPolicy *policy)
+{
+  int i;
+
+  for (i = 0; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      bus_rule_index_free (policy->send_index[i]);
+      policy->send_index[i] = NULL;
+      bus_rule_index_free (policy->receive_index[i]);
+      policy->receive_index[i] = NULL;
+    }
+}
+
+/* Sort the send and receive rules by message type and interface, so
+ * that checking a message doesn't have to consider every rule. This is
+ * only an optimization: if we run out of memory, checks just walk the
+ * whole list of rules, as they would for an uncompiled policy.
+ */
+static void
+bus_client_policy_compile (BusClientPolicy *policy)
+{
+  int i;
+
+  DBusList *link;
+
+  /* a shared policy is compiled already */
+  if (policy->send_index[DBUS_MESSAGE_TYPE_METHOD_CALL] != NULL)
+    return;
+
+  for (link = _dbus_list_get_first_link (&policy->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type == BUS_POLICY_RULE_SEND &&
+          rule->d.send.destination != NULL)
+        policy->send_checks_owners = TRUE;
+      else if (rule->type == BUS_POLICY_RULE_RECEIVE &&
+               rule->d.receive.origin != NULL)
+        policy->receive_checks_owners = TRUE;
+    }
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID + 1; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      policy->send_index[i] = bus_rule_index_new (&policy->rules,
+                                                  BUS_POLICY_RULE_SEND, i);
+      policy->receive_index[i] = bus_rule_index_new (&policy->rules,
+                                                     BUS_POLICY_RULE_RECEIVE,
+                                                     i);
+
+      if (policy->send_index[i] == NULL || policy->receive_index[i] == NULL)
+        {
+          _dbus_verbose ("Not enough memory to compile policy %p\n",
+                         policy);
+          bus_client_policy_free_indexes (policy);
+          return;
+        }
+    }
+
+  policy->verdicts_cacheable = TRUE;
+}
+
+/* If the policy is compiled, set *candidates to the rules that might
+ * apply to @message, in config file order, and return TRUE */
+static dbus_bool_t
+bus_client_policy_get_candidates (BusRuleIndex **indexes,
+                                  DBusMessage   *message,
+                                  DBusList     **candidates)
+{
+  BusRuleIndex *rule_index;
+  const char *interface;
+  int type;
+
+  type = dbus_message_get_type (message);
+
+  if (type <= DBUS_MESSAGE_TYPE_INVALID || type >= DBUS_NUM_MESSAGE_TYPES)
+    return FALSE;
+
+  rule_index = indexes[type];
+
+  if (rule_index == NULL)
+    return FALSE;
+
+  interface = dbus_message_get_interface (message);
+
+  if (interface == NULL)
+    {
+      *candidates = rule_index->no_interface;
+      return TRUE;
+    }
+
+  *candidates = _dbus_hash_table_lookup_string (rule_index->by_interface,
+                                                interface);
+
+  if (*candidates == NULL)
+    *candidates = rule_index->other_interface;
+
+  return TRUE;
+}
+
+BusClientPolicy*
+bus_client_policy_new (void)
+{
+  BusClientPolicy *policy;
+
+  policy = dbus_new0 (BusClientPolicy, 1);
+  if (policy == NULL)
+    return NULL;
+
+  policy->refcount = 1;
+
+  return policy;
+}
+
+BusClientPolicy *
+bus_client_policy_ref (BusClientPolicy *policy)
+{
+  _dbus_assert (policy->refcount > 0);
+
+  policy->refcount += 1;
+
+  return policy;
+}
+
+static void
+rule_unref_foreach (void *data,
+                    void *user_data)
+{
+  BusPolicyRule *rule = data;
+
+  bus_policy_rule_unref (rule);
+}
+
+void
+bus_client_policy_unref (BusClientPolicy *policy)
+{
+  _dbus_assert (policy->refcount > 0);
+
+  policy->refcount -= 1;
+
+  if (policy->refcount == 0)
+    {
+      if (policy->link_in_policy != NULL)
+        {
+          while (policy->credentials_keys != NULL)
+            {
+              char *key = _dbus_list_pop_first (&policy->credentials_keys);
+
+              /* frees key */
+              _dbus_hash_table_remove_string (
+                  policy->policy->client_policies_by_credentials, key);
+            }
+
+          _dbus_list_remove_link (&policy->policy->client_policies,
+                                  policy->link_in_policy);
+          bus_policy_unref (policy->policy);
+        }
+
+      bus_client_policy_free_indexes (policy);
+      bus_verdict_cache_clear (&policy->send_verdicts);
+      bus_verdict_cache_clear (&policy->receive_verdicts);
+
+      _dbus_list_foreach (&policy->rules,
+                          rule_unref_foreach,
+                          NULL);
+
+      _dbus_list_clear (&policy->rules);
+
+      dbus_free (policy);
+    }
+}
+
+static dbus_bool_t
+client_policy_rules_equal (BusClientPolicy *a,
+                           BusClientPolicy *b)
+{
+  DBusList *link_a;
+  DBusList *link_b;
+
+  link_a = _dbus_list_get_first_link (&a->rules);
+  link_b = _dbus_list_get_first_link (&b->rules);
+
+  while (link_a != NULL && link_b != NULL)
+    {
+      if (link_a->data != link_b->data)
+        return FALSE;
+
+      link_a = _dbus_list_get_next_link (&a->rules, link_a);
+      link_b = _dbus_list_get_next_link (&b->rules, link_b);
+    }
+
+  return link_a == NULL && link_b == NULL;
+}
+
+/* Connections with the same credentials end up with the same rules, so
+ * we give them the same BusClientPolicy. As well as saving memory, this
+ * lets a transaction remember the verdict of a policy check for all the
+ * recipients of a broadcast that share a policy.
+ *
+ * Takes ownership of @client, and returns either it or an existing
+ * equivalent policy. Sharing is only an optimization, so if we run out
+ * of memory we just don't share @client.
+ */
+static BusClientPolicy *
+bus_policy_share_client_policy (BusPolicy       *policy,
+                                BusClientPolicy *client)
+{
+  DBusList *link;
+
+  _dbus_assert (client->refcount == 1);
+  _dbus_assert (client->link_in_policy == NULL);
+
+  for (link = _dbus_list_get_first_link (&policy->client_policies);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->client_policies, link))
+    {
+      BusClientPolicy *existing = link->data;
+
+      if (client_policy_rules_equal (existing, client))
+        {
+          bus_client_policy_unref (client);
+          return bus_client_policy_ref (existing);
+        }
+    }
+
+  client->link_in_policy = _dbus_list_alloc_link (client);
+
+  if (client->link_in_policy != NULL)
+    {
+      _dbus_list_append_link (&policy->client_policies,
+                              client->link_in_policy);
+      client->policy = bus_policy_ref (policy);
+    }
+
+  return client;
+}
+
+/* Remember that connections with these credentials get @client, so the
+ * next one doesn't have to build its policy again. This is only an
+ * optimization, so running out of memory is not an error. */
+static void
+bus_policy_intern_client_policy (BusPolicy       *policy,
+                                 BusClientPolicy *client,
+                                 DBusString      *key)
+{
+  DBusList *link;
+  char *str;
+
+  /* only clients in client_policies remove themselves when freed */
+  if (client->policy != policy)
+    return;
+
+  if (!_dbus_string_steal_data (key, &str))
+    return;
+
+  link = _dbus_list_alloc_link (str);
+  if (link == NULL)
+    {
+      dbus_free (str);
+      return;
+    }
+
+  if (!_dbus_hash_table_insert_string (policy->client_policies_by_credentials,
+                                       str, client))
+    {
+      _dbus_list_free_link (link);
+      dbus_free (str);
+      return;
+    }
+
+  _dbus_list_append_link (&client->credentials_keys, link);
+}
+
+static void
+remove_rules_by_type_up_to (BusClientPolicy   *policy,
+                            BusPolicyRuleType  type,
+                            DBusList          *up_to)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&policy->rules);
+  while (link != up_to)
+    {
+      BusPolicyRule *rule = link->data;
+      DBusList *next = _dbus_list_get_next_link (&policy->rules, link);
+
+      if (rule->type == type)
+        {
+          _dbus_list_remove_link (&policy->rules, link);
+          bus_policy_rule_unref (rule);
+        }
+      
+      link = next;
+    }
+}
+
+void
+bus_client_policy_optimize (BusClientPolicy *policy)
+{
+  DBusList *link;
+
+  /* The idea here is that if we have:
+   * 
+   * <allow send_interface="foo.bar"/>
+   * <deny send_interface="*"/>
+   *
+   * (for example) the deny will always override the allow.  So we
+   * delete the allow. Ditto for deny followed by allow, etc. This is
+   * a dumb thing to put in a config file, but the <include> feature
+   * of files allows for an "inheritance and override" pattern where
+   * it could make sense. If an included file wants to "start over"
+   * with a blanket deny, no point keeping the rules from the parent
+   * file.
+   */
+
+  _dbus_verbose ("Optimizing policy with %d rules\n",
                  _dbus_list_get_length (&policy->rules));
   
   link = _dbus_list_get_first_link (&policy->rules);
@@ -864,6 +1695,9 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
 {
   _dbus_verbose ("Appending rule %p with type %d to policy %p\n",
                  rule, rule->type, policy);
+
+  /* can't change the rules once they have been compiled */
+  _dbus_assert (policy->send_index[DBUS_MESSAGE_TYPE_METHOD_CALL] == NULL);
   
   if (!_dbus_list_append (&policy->rules, rule))
     return FALSE;
@@ -873,17 +1707,264 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
   return TRUE;
 }
 
-dbus_bool_t
-bus_client_policy_check_can_send (BusClientPolicy *policy,
-                                  BusRegistry     *registry,
-                                  dbus_bool_t      requested_reply,
-                                  DBusConnection  *receiver,
-                                  DBusMessage     *message,
-                                  dbus_int32_t    *toggles,
-                                  dbus_bool_t     *log)
+#ifdef DBUS_ENABLE_STATS
+static BusPolicyCheckStats check_stats[BUS_POLICY_N_CHECK_KINDS];
+#endif
+
+static dbus_int64_t
+policy_check_start (void)
+{
+#ifdef DBUS_ENABLE_STATS
+  return _dbus_get_monotonic_usec ();
+#else
+  return 0;
+#endif
+}
+
+static void
+policy_check_done (BusPolicyCheckKind kind,
+                   dbus_int64_t       start)
+{
+#ifdef DBUS_ENABLE_STATS
+  check_stats[kind].checks++;
+  _dbus_latency_histogram_add (&check_stats[kind].latency,
+                               _dbus_get_monotonic_usec () - start);
+#endif
+}
+
+static void
+policy_count_cache_hit (BusPolicyCheckKind kind)
+{
+#ifdef DBUS_ENABLE_STATS
+  check_stats[kind].cache_hits++;
+#endif
+}
+
+/* Account for a walk over @n_scanned rules. @decided is the position
+ * of the rule that decided, counting back from the last rule scanned in
+ * config file order, or -1 if no rule applied. */
+static void
+policy_count_scan (BusPolicyCheckKind kind,
+                   int                n_scanned,
+                   int                decided)
+{
+#ifdef DBUS_ENABLE_STATS
+  check_stats[kind].rules_scanned += n_scanned;
+
+  if (decided < 0)
+    check_stats[kind].no_rule_applied++;
+  else
+    _dbus_latency_histogram_add (&check_stats[kind].deciding_rule, decided);
+#endif
+}
+
+#ifdef DBUS_ENABLE_STATS
+void
+bus_policy_get_check_stats (BusPolicyCheckKind   kind,
+                            BusPolicyCheckStats *stats)
+{
+  _dbus_assert (kind < BUS_POLICY_N_CHECK_KINDS);
+
+  *stats = check_stats[kind];
+}
+#endif
+
+static dbus_bool_t
+send_rule_matches (BusPolicyRule  *rule,
+                   BusRegistry    *registry,
+                   dbus_bool_t     requested_reply,
+                   DBusConnection *receiver,
+                   DBusMessage    *message)
+{
+  /* Rule is skipped if it specifies a different
+   * message name from the message, or a different
+   * destination from the message
+   */
+
+  if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.send.message_type)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
+        }
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
+        {
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
+        }
+
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
+        {
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.send.path) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
+        }
+    }
+  
+  if (rule->d.send.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
+
+      no_interface = dbus_message_get_interface (message) == NULL;
+      
+      if ((no_interface && rule->allow) ||
+          (!no_interface && 
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.send.interface) != 0))
+        {
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.send.member) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.send.error) != 0)
+        {
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.broadcast != BUS_POLICY_TRISTATE_ANY)
+    {
+      if (dbus_message_get_destination (message) == NULL &&
+          dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
+        {
+          /* it's a broadcast */
+          if (rule->d.send.broadcast == BUS_POLICY_TRISTATE_FALSE)
+            {
+              _dbus_verbose ("  (policy) skipping rule because message is a broadcast\n");
+              return FALSE;
+            }
+        }
+      /* else it isn't a broadcast: there is some destination */
+      else if (rule->d.send.broadcast == BUS_POLICY_TRISTATE_TRUE)
+        {
+          _dbus_verbose ("  (policy) skipping rule because message is not a broadcast\n");
+          return FALSE;
+        }
+    }
+
+  if (rule->d.send.destination != NULL)
+    {
+      /* receiver can be NULL for messages that are sent to the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but messages
+       * to them have a destination service name.
+       *
+       * Similarly, receiver can be NULL when we're deciding whether
+       * activation should be allowed; we make the authorization decision
+       * on the assumption that the activated service will have the
+       * requested name and no others.
+       */
+      if (receiver == NULL)
+        {
+          if (!dbus_message_has_destination (message,
+                                             rule->d.send.destination))
+            {
+              _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+        }
+      else
+        {
+          DBusString str;
+          BusService *service;
+          
+          _dbus_string_init_const (&str, rule->d.send.destination);
+          
+          service = bus_registry_lookup (registry, &str);
+          if (service == NULL)
+            {
+              _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+
+          if (!bus_service_has_owner (service, receiver))
+            {
+              _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
+                             rule->d.send.destination);
+              return FALSE;
+            }
+        }
+    }
+
+  if (rule->d.send.min_fds > 0 ||
+      rule->d.send.max_fds < DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
+    {
+      unsigned int n_fds = _dbus_message_get_n_unix_fds (message);
+
+      if (n_fds < rule->d.send.min_fds || n_fds > rule->d.send.max_fds)
+        {
+          _dbus_verbose ("  (policy) skipping rule because message has %u fds "
+                         "and that is outside range [%u,%u]",
+                         n_fds, rule->d.send.min_fds, rule->d.send.max_fds);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+bus_client_policy_check_can_send_uncached (BusClientPolicy *policy,
+                                           BusRegistry     *registry,
+                                           dbus_bool_t      requested_reply,
+                                           DBusConnection  *receiver,
+                                           DBusMessage     *message,
+                                           dbus_int32_t    *toggles,
+                                           dbus_bool_t     *log)
 {
   DBusList *link;
+  DBusList *candidates;
   dbus_bool_t allowed;
+  int n_scanned = 0;
+  int last_applied = 0;
   
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -893,6 +1974,50 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
   *toggles = 0;
   
   allowed = FALSE;
+
+  if (bus_client_policy_get_candidates (policy->send_index,
+                                        message, &candidates))
+    {
+      dbus_bool_t matched = FALSE;
+
+      /* The candidates are in config file order too, so walking them
+       * backwards, the first rule that applies is the one that wins. If
+       * it allows without logging we can stop there; otherwise we keep
+       * going to count how many rules applied, for the log message. */
+      for (link = _dbus_list_get_last_link (&candidates);
+           link != NULL;
+           link = _dbus_list_get_prev_link (&candidates, link))
+        {
+          BusPolicyRule *rule = link->data;
+
+          n_scanned++;
+
+          if (!send_rule_matches (rule, registry, requested_reply,
+                                  receiver, message))
+            continue;
+
+          (*toggles)++;
+
+          if (!matched)
+            {
+              matched = TRUE;
+              last_applied = n_scanned;
+              allowed = rule->allow;
+              *log = rule->d.send.log;
+
+              _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                             allowed);
+
+              if (allowed && !*log)
+                break;
+            }
+        }
+
+      policy_count_scan (BUS_POLICY_CHECK_SEND, n_scanned,
+                         last_applied - 1);
+      return allowed;
+    }
+
   link = _dbus_list_get_first_link (&policy->rules);
   while (link != NULL)
     {
@@ -900,216 +2025,297 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 
       link = _dbus_list_get_next_link (&policy->rules, link);
       
-      /* Rule is skipped if it specifies a different
-       * message name from the message, or a different
-       * destination from the message
-       */
-      
       if (rule->type != BUS_POLICY_RULE_SEND)
         {
           _dbus_verbose ("  (policy) skipping non-send rule\n");
           continue;
         }
 
-      if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
+      n_scanned++;
+
+      if (!send_rule_matches (rule, registry, requested_reply,
+                              receiver, message))
+        continue;
+
+      /* Use this rule */
+      allowed = rule->allow;
+      *log = rule->d.send.log;
+      (*toggles)++;
+      last_applied = n_scanned;
+
+      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                     allowed);
+    }
+
+  policy_count_scan (BUS_POLICY_CHECK_SEND, n_scanned,
+                     last_applied > 0 ? n_scanned - last_applied : -1);
+  return allowed;
+}
+
+static dbus_bool_t
+bus_client_policy_check_can_send_via_cache (BusClientPolicy *policy,
+                                            BusRegistry     *registry,
+                                            dbus_bool_t      requested_reply,
+                                            DBusConnection  *receiver,
+                                            DBusMessage     *message,
+                                            dbus_int32_t    *toggles,
+                                            dbus_bool_t     *log)
+{
+  const BusPolicyVerdict *cached;
+  BusPolicyVerdict key;
+  dbus_bool_t allowed;
+  dbus_bool_t rule_log = FALSE;
+
+  if (!policy->verdicts_cacheable || registry == NULL)
+    return bus_client_policy_check_can_send_uncached (policy, registry,
+                                                      requested_reply,
+                                                      receiver, message,
+                                                      toggles, log);
+
+  bus_policy_verdict_init_key (&key, message, requested_reply, FALSE,
+      policy->send_checks_owners ? receiver : NULL,
+      policy->send_checks_owners ? dbus_message_get_destination (message) : NULL);
+
+  cached = bus_verdict_cache_lookup (&policy->send_verdicts, registry,
+                                     policy->send_checks_owners, &key);
+
+  if (cached != NULL)
+    {
+      _dbus_verbose ("  (policy) reusing send verdict %d\n", cached->allowed);
+      policy_count_cache_hit (BUS_POLICY_CHECK_SEND);
+      *toggles = cached->toggles;
+
+      /* as if the rule that applied had been used again */
+      if (cached->toggles > 0)
+        *log = cached->log;
+
+      return cached->allowed;
+    }
+
+  allowed = bus_client_policy_check_can_send_uncached (policy, registry,
+                                                       requested_reply,
+                                                       receiver, message,
+                                                       toggles, &rule_log);
+
+  /* rule_log is only set if a rule applied */
+  if (*toggles > 0)
+    *log = rule_log;
+
+  key.allowed = allowed;
+  key.log = rule_log;
+  key.toggles = *toggles;
+  bus_verdict_cache_add (&policy->send_verdicts, &key);
+
+  return allowed;
+}
+
+dbus_bool_t
+bus_client_policy_check_can_send (BusClientPolicy *policy,
+                                  BusRegistry     *registry,
+                                  dbus_bool_t      requested_reply,
+                                  DBusConnection  *receiver,
+                                  DBusMessage     *message,
+                                  dbus_int32_t    *toggles,
+                                  dbus_bool_t     *log)
+{
+  dbus_int64_t start = policy_check_start ();
+  dbus_bool_t allowed;
+
+  allowed = bus_client_policy_check_can_send_via_cache (policy, registry,
+                                                        requested_reply,
+                                                        receiver, message,
+                                                        toggles, log);
+  policy_check_done (BUS_POLICY_CHECK_SEND, start);
+  return allowed;
+}
+
+static dbus_bool_t
+receive_rule_matches (BusPolicyRule  *rule,
+                      BusRegistry    *registry,
+                      dbus_bool_t     requested_reply,
+                      dbus_bool_t     eavesdropping,
+                      DBusConnection *sender,
+                      DBusMessage    *message)
+{
+  if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
+    {
+      if (dbus_message_get_type (message) != rule->d.receive.message_type)
         {
-          if (dbus_message_get_type (message) != rule->d.send.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different message type\n");
+          return FALSE;
         }
+    }
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
-        {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.send.requested_reply && !rule->d.send.eavesdrop)
-            {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+  /* for allow, eavesdrop=false means the rule doesn't apply when
+   * eavesdropping. eavesdrop=true means always allow.
+   */
+  if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
+      return FALSE;
+    }
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.send.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
+  /* for deny, eavesdrop=true means the rule applies only when
+   * eavesdropping; eavesdrop=false means always deny.
+   */
+  if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
+    {
+      _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
+      return FALSE;
+    }
+
+  /* If it's a reply, the requested_reply flag kicks in */
+  if (dbus_message_get_reply_serial (message) != 0)
+    {
+      /* for allow, requested_reply=true means the rule applies
+       * only when reply was requested. requested_reply=false means
+       * always allow.
+       */
+      if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
+        {
+          _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
+          return FALSE;
         }
-      
-      if (rule->d.send.path != NULL)
+
+      /* for deny, requested_reply=false means the rule applies only
+       * when the reply was not requested. requested_reply=true means the
+       * rule always applies.
+       */
+      if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.send.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
+          return FALSE;
         }
-      
-      if (rule->d.send.interface != NULL)
+    }
+  
+  if (rule->d.receive.path != NULL)
+    {
+      if (dbus_message_get_path (message) != NULL &&
+          strcmp (dbus_message_get_path (message),
+                  rule->d.receive.path) != 0)
         {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface && 
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.send.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different path\n");
+          return FALSE;
         }
+    }
+  
+  if (rule->d.receive.interface != NULL)
+    {
+      /* The interface is optional in messages. For allow rules, if the message
+       * has no interface we want to skip the rule (and thus not allow);
+       * for deny rules, if the message has no interface we want to use the
+       * rule (and thus deny).
+       */
+      dbus_bool_t no_interface;
 
-      if (rule->d.send.member != NULL)
+      no_interface = dbus_message_get_interface (message) == NULL;
+      
+      if ((no_interface && rule->allow) ||
+          (!no_interface &&
+           strcmp (dbus_message_get_interface (message),
+                   rule->d.receive.interface) != 0))
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.send.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different interface\n");
+          return FALSE;
         }
+    }      
 
-      if (rule->d.send.error != NULL)
+  if (rule->d.receive.member != NULL)
+    {
+      if (dbus_message_get_member (message) != NULL &&
+          strcmp (dbus_message_get_member (message),
+                  rule->d.receive.member) != 0)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.send.error) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different member\n");
+          return FALSE;
         }
+    }
 
-      if (rule->d.send.broadcast != BUS_POLICY_TRISTATE_ANY)
+  if (rule->d.receive.error != NULL)
+    {
+      if (dbus_message_get_error_name (message) != NULL &&
+          strcmp (dbus_message_get_error_name (message),
+                  rule->d.receive.error) != 0)
         {
-          if (dbus_message_get_destination (message) == NULL &&
-              dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
-            {
-              /* it's a broadcast */
-              if (rule->d.send.broadcast == BUS_POLICY_TRISTATE_FALSE)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message is a broadcast\n");
-                  continue;
-                }
-            }
-          /* else it isn't a broadcast: there is some destination */
-          else if (rule->d.send.broadcast == BUS_POLICY_TRISTATE_TRUE)
-            {
-              _dbus_verbose ("  (policy) skipping rule because message is not a broadcast\n");
-              continue;
-            }
+          _dbus_verbose ("  (policy) skipping rule for different error name\n");
+          return FALSE;
         }
-
-      if (rule->d.send.destination != NULL)
+    }
+  
+  if (rule->d.receive.origin != NULL)
+    {          
+      /* sender can be NULL for messages that originate from the
+       * message bus itself, we check the strings in that case as
+       * built-in services don't have a DBusConnection but will
+       * still set the sender on their messages.
+       */
+      if (sender == NULL)
         {
-          /* receiver can be NULL for messages that are sent to the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but messages
-           * to them have a destination service name.
-           *
-           * Similarly, receiver can be NULL when we're deciding whether
-           * activation should be allowed; we make the authorization decision
-           * on the assumption that the activated service will have the
-           * requested name and no others.
-           */
-          if (receiver == NULL)
+          if (!dbus_message_has_sender (message,
+                                        rule->d.receive.origin))
             {
-              if (!dbus_message_has_destination (message,
-                                                 rule->d.send.destination))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message dest is not %s\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-            }
-          else
-            {
-              DBusString str;
-              BusService *service;
-              
-              _dbus_string_init_const (&str, rule->d.send.destination);
-              
-              service = bus_registry_lookup (registry, &str);
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-
-              if (!bus_service_has_owner (service, receiver))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
+              _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
-
-      if (rule->d.send.min_fds > 0 ||
-          rule->d.send.max_fds < DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
+      else
         {
-          unsigned int n_fds = _dbus_message_get_n_unix_fds (message);
+          BusService *service;
+          DBusString str;
+
+          _dbus_string_init_const (&str, rule->d.receive.origin);
+          
+          service = bus_registry_lookup (registry, &str);
+          
+          if (service == NULL)
+            {
+              _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
+                             rule->d.receive.origin);
+              return FALSE;
+            }
 
-          if (n_fds < rule->d.send.min_fds || n_fds > rule->d.send.max_fds)
+          if (!bus_service_has_owner (service, sender))
             {
-              _dbus_verbose ("  (policy) skipping rule because message has %u fds "
-                             "and that is outside range [%u,%u]",
-                             n_fds, rule->d.send.min_fds, rule->d.send.max_fds);
-              continue;
+              _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
+                             rule->d.receive.origin);
+              return FALSE;
             }
         }
+    }
 
-      /* Use this rule */
-      allowed = rule->allow;
-      *log = rule->d.send.log;
-      (*toggles)++;
+  if (rule->d.receive.min_fds > 0 ||
+      rule->d.receive.max_fds < DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
+    {
+      unsigned int n_fds = _dbus_message_get_n_unix_fds (message);
 
-      _dbus_verbose ("  (policy) used rule, allow now = %d\n",
-                     allowed);
+      if (n_fds < rule->d.receive.min_fds || n_fds > rule->d.receive.max_fds)
+        {
+          _dbus_verbose ("  (policy) skipping rule because message has %u fds "
+                         "and that is outside range [%u,%u]",
+                         n_fds, rule->d.receive.min_fds,
+                         rule->d.receive.max_fds);
+          return FALSE;
+        }
     }
 
-  return allowed;
+  return TRUE;
 }
 
-/* See docs on what the args mean on bus_context_check_security_policy()
- * comment
- */
-dbus_bool_t
-bus_client_policy_check_can_receive (BusClientPolicy *policy,
-                                     BusRegistry     *registry,
-                                     dbus_bool_t      requested_reply,
-                                     DBusConnection  *sender,
-                                     DBusConnection  *addressed_recipient,
-                                     DBusConnection  *proposed_recipient,
-                                     DBusMessage     *message,
-                                     dbus_int32_t    *toggles)
+static dbus_bool_t
+bus_client_policy_check_can_receive_uncached (BusClientPolicy *policy,
+                                              BusRegistry     *registry,
+                                              dbus_bool_t      requested_reply,
+                                              dbus_bool_t      eavesdropping,
+                                              DBusConnection  *sender,
+                                              DBusMessage     *message,
+                                              dbus_int32_t    *toggles)
 {
   DBusList *link;
+  DBusList *candidates;
   dbus_bool_t allowed;
-  dbus_bool_t eavesdropping;
-
-  eavesdropping =
-    addressed_recipient != proposed_recipient &&
-    dbus_message_get_destination (message) != NULL;
+  int n_scanned = 0;
+  int last_applied = 0;
   
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -1119,200 +2325,169 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
   *toggles = 0;
   
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+
+  if (bus_client_policy_get_candidates (policy->receive_index,
+                                        message, &candidates))
     {
-      BusPolicyRule *rule = link->data;
+      dbus_bool_t matched = FALSE;
 
-      link = _dbus_list_get_next_link (&policy->rules, link);      
-      
-      if (rule->type != BUS_POLICY_RULE_RECEIVE)
+      /* As for sending; the toggles only matter if we deny */
+      for (link = _dbus_list_get_last_link (&candidates);
+           link != NULL;
+           link = _dbus_list_get_prev_link (&candidates, link))
         {
-          _dbus_verbose ("  (policy) skipping non-receive rule\n");
-          continue;
-        }
+          BusPolicyRule *rule = link->data;
 
-      if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
-        {
-          if (dbus_message_get_type (message) != rule->d.receive.message_type)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different message type\n");
-              continue;
-            }
-        }
+          n_scanned++;
 
-      /* for allow, eavesdrop=false means the rule doesn't apply when
-       * eavesdropping. eavesdrop=true means always allow.
-       */
-      if (eavesdropping && rule->allow && !rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping allow rule since it doesn't apply to eavesdropping\n");
-          continue;
-        }
+          if (!receive_rule_matches (rule, registry, requested_reply,
+                                     eavesdropping, sender, message))
+            continue;
 
-      /* for deny, eavesdrop=true means the rule applies only when
-       * eavesdropping; eavesdrop=false means always deny.
-       */
-      if (!eavesdropping && !rule->allow && rule->d.receive.eavesdrop)
-        {
-          _dbus_verbose ("  (policy) skipping deny rule since it only applies to eavesdropping\n");
-          continue;
-        }
+          (*toggles)++;
 
-      /* If it's a reply, the requested_reply flag kicks in */
-      if (dbus_message_get_reply_serial (message) != 0)
-        {
-          /* for allow, requested_reply=true means the rule applies
-           * only when reply was requested. requested_reply=false means
-           * always allow.
-           */
-          if (!requested_reply && rule->allow && rule->d.receive.requested_reply && !rule->d.receive.eavesdrop)
+          if (!matched)
             {
-              _dbus_verbose ("  (policy) skipping allow rule since it only applies to requested replies and does not allow eavesdropping\n");
-              continue;
-            }
+              matched = TRUE;
+              last_applied = n_scanned;
+              allowed = rule->allow;
 
-          /* for deny, requested_reply=false means the rule applies only
-           * when the reply was not requested. requested_reply=true means the
-           * rule always applies.
-           */
-          if (requested_reply && !rule->allow && !rule->d.receive.requested_reply)
-            {
-              _dbus_verbose ("  (policy) skipping deny rule since it only applies to unrequested replies\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.path != NULL)
-        {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.receive.path) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different path\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.interface != NULL)
-        {
-          /* The interface is optional in messages. For allow rules, if the message
-           * has no interface we want to skip the rule (and thus not allow);
-           * for deny rules, if the message has no interface we want to use the
-           * rule (and thus deny).
-           */
-          dbus_bool_t no_interface;
-
-          no_interface = dbus_message_get_interface (message) == NULL;
-          
-          if ((no_interface && rule->allow) ||
-              (!no_interface &&
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.receive.interface) != 0))
-            {
-              _dbus_verbose ("  (policy) skipping rule for different interface\n");
-              continue;
-            }
-        }      
+              _dbus_verbose ("  (policy) used rule, allow now = %d\n",
+                             allowed);
 
-      if (rule->d.receive.member != NULL)
-        {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.receive.member) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different member\n");
-              continue;
+              if (allowed)
+                break;
             }
         }
 
-      if (rule->d.receive.error != NULL)
-        {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.receive.error) != 0)
-            {
-              _dbus_verbose ("  (policy) skipping rule for different error name\n");
-              continue;
-            }
-        }
-      
-      if (rule->d.receive.origin != NULL)
-        {          
-          /* sender can be NULL for messages that originate from the
-           * message bus itself, we check the strings in that case as
-           * built-in services don't have a DBusConnection but will
-           * still set the sender on their messages.
-           */
-          if (sender == NULL)
-            {
-              if (!dbus_message_has_sender (message,
-                                            rule->d.receive.origin))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because message sender is not %s\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
-          else
-            {
-              BusService *service;
-              DBusString str;
+      policy_count_scan (BUS_POLICY_CHECK_RECEIVE, n_scanned,
+                         last_applied - 1);
+      return allowed;
+    }
 
-              _dbus_string_init_const (&str, rule->d.receive.origin);
-              
-              service = bus_registry_lookup (registry, &str);
-              
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
+  link = _dbus_list_get_first_link (&policy->rules);
+  while (link != NULL)
+    {
+      BusPolicyRule *rule = link->data;
 
-              if (!bus_service_has_owner (service, sender))
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-            }
+      link = _dbus_list_get_next_link (&policy->rules, link);      
+      
+      if (rule->type != BUS_POLICY_RULE_RECEIVE)
+        {
+          _dbus_verbose ("  (policy) skipping non-receive rule\n");
+          continue;
         }
 
-      if (rule->d.receive.min_fds > 0 ||
-          rule->d.receive.max_fds < DBUS_MAXIMUM_MESSAGE_UNIX_FDS)
-        {
-          unsigned int n_fds = _dbus_message_get_n_unix_fds (message);
+      n_scanned++;
 
-          if (n_fds < rule->d.receive.min_fds || n_fds > rule->d.receive.max_fds)
-            {
-              _dbus_verbose ("  (policy) skipping rule because message has %u fds "
-                             "and that is outside range [%u,%u]",
-                             n_fds, rule->d.receive.min_fds,
-                             rule->d.receive.max_fds);
-              continue;
-            }
-        }
+      if (!receive_rule_matches (rule, registry, requested_reply,
+                                 eavesdropping, sender, message))
+        continue;
 
       /* Use this rule */
       allowed = rule->allow;
       (*toggles)++;
+      last_applied = n_scanned;
 
       _dbus_verbose ("  (policy) used rule, allow now = %d\n",
                      allowed);
     }
 
+  policy_count_scan (BUS_POLICY_CHECK_RECEIVE, n_scanned,
+                     last_applied > 0 ? n_scanned - last_applied : -1);
   return allowed;
 }
 
 
 
+static dbus_bool_t
+bus_client_policy_check_can_receive_via_cache (BusClientPolicy *policy,
+                                               BusRegistry     *registry,
+                                               dbus_bool_t      requested_reply,
+                                               DBusConnection  *sender,
+                                               DBusConnection  *addressed_recipient,
+                                               DBusConnection  *proposed_recipient,
+                                               DBusMessage     *message,
+                                               dbus_int32_t    *toggles)
+{
+  const BusPolicyVerdict *cached;
+  BusPolicyVerdict key;
+  dbus_bool_t eavesdropping;
+
+  eavesdropping =
+    addressed_recipient != proposed_recipient &&
+    dbus_message_get_destination (message) != NULL;
+
+  if (!policy->verdicts_cacheable || registry == NULL)
+    return bus_client_policy_check_can_receive_uncached (policy, registry,
+                                                         requested_reply,
+                                                         eavesdropping,
+                                                         sender, message,
+                                                         toggles);
+
+  bus_policy_verdict_init_key (&key, message, requested_reply, eavesdropping,
+      policy->receive_checks_owners ? sender : NULL,
+      policy->receive_checks_owners ? dbus_message_get_sender (message) : NULL);
+
+  cached = bus_verdict_cache_lookup (&policy->receive_verdicts, registry,
+                                     policy->receive_checks_owners, &key);
+
+  if (cached != NULL)
+    {
+      _dbus_verbose ("  (policy) reusing receive verdict %d\n",
+                     cached->allowed);
+      policy_count_cache_hit (BUS_POLICY_CHECK_RECEIVE);
+      *toggles = cached->toggles;
+      return cached->allowed;
+    }
+
+  key.allowed = bus_client_policy_check_can_receive_uncached (policy,
+                                                              registry,
+                                                              requested_reply,
+                                                              eavesdropping,
+                                                              sender, message,
+                                                              toggles);
+  key.log = FALSE;
+  key.toggles = *toggles;
+  bus_verdict_cache_add (&policy->receive_verdicts, &key);
+
+  return key.allowed;
+}
+
+/* See docs on what the args mean on bus_context_check_security_policy()
+ * comment
+ */
+dbus_bool_t
+bus_client_policy_check_can_receive (BusClientPolicy *policy,
+                                     BusRegistry     *registry,
+                                     dbus_bool_t      requested_reply,
+                                     DBusConnection  *sender,
+                                     DBusConnection  *addressed_recipient,
+                                     DBusConnection  *proposed_recipient,
+                                     DBusMessage     *message,
+                                     dbus_int32_t    *toggles)
+{
+  dbus_int64_t start = policy_check_start ();
+  dbus_bool_t allowed;
+
+  allowed = bus_client_policy_check_can_receive_via_cache (policy, registry,
+                                                           requested_reply,
+                                                           sender,
+                                                           addressed_recipient,
+                                                           proposed_recipient,
+                                                           message, toggles);
+  policy_check_done (BUS_POLICY_CHECK_RECEIVE, start);
+  return allowed;
+}
+
 static dbus_bool_t
 bus_rules_check_can_own (DBusList *rules,
                          const DBusString *service_name)
 {
   DBusList *link;
   dbus_bool_t allowed;
+  int n_scanned = 0;
+  int last_applied = 0;
   
   /* rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -1333,6 +2508,8 @@ bus_rules_check_can_own (DBusList *rules,
       if (rule->type != BUS_POLICY_RULE_OWN)
         continue;
 
+      n_scanned++;
+
       if (!rule->d.own.prefix && rule->d.own.service_name != NULL)
         {
           if (!_dbus_string_equal_c_str (service_name,
@@ -1355,8 +2532,11 @@ bus_rules_check_can_own (DBusList *rules,
 
       /* Use this rule */
       allowed = rule->allow;
+      last_applied = n_scanned;
     }
 
+  policy_count_scan (BUS_POLICY_CHECK_OWN, n_scanned,
+                     last_applied > 0 ? n_scanned - last_applied : -1);
   return allowed;
 }
 
@@ -1364,7 +2544,12 @@ dbus_bool_t
 bus_client_policy_check_can_own (BusClientPolicy  *policy,
                                  const DBusString *service_name)
 {
-  return bus_rules_check_can_own (policy->rules, service_name);
+  dbus_int64_t start = policy_check_start ();
+  dbus_bool_t allowed;
+
+  allowed = bus_rules_check_can_own (policy->rules, service_name);
+  policy_check_done (BUS_POLICY_CHECK_OWN, start);
+  return allowed;
 }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -1374,5 +2559,325 @@ bus_policy_check_can_own (BusPolicy  *policy,
 {
   return bus_rules_check_can_own (policy->default_rules, service_name);
 }
+
+typedef struct
+{
+  BusPolicyRuleType type;
+  dbus_bool_t allow;
+  int message_type;
+  const char *interface;
+  const char *member;
+  dbus_bool_t log;
+  const char *destination;
+} TestRule;
+
+static const TestRule test_rules[] = {
+  { BUS_POLICY_RULE_SEND, FALSE, DBUS_MESSAGE_TYPE_INVALID, NULL, NULL },
+  { BUS_POLICY_RULE_SEND, TRUE, DBUS_MESSAGE_TYPE_INVALID, "org.example.A", NULL },
+  { BUS_POLICY_RULE_SEND, FALSE, DBUS_MESSAGE_TYPE_INVALID, "org.example.A", "Forbidden" },
+  { BUS_POLICY_RULE_SEND, TRUE, DBUS_MESSAGE_TYPE_SIGNAL, NULL, NULL },
+  { BUS_POLICY_RULE_SEND, FALSE, DBUS_MESSAGE_TYPE_INVALID, "org.example.B", NULL },
+  { BUS_POLICY_RULE_SEND, TRUE, DBUS_MESSAGE_TYPE_INVALID, NULL, "Ping" },
+  { BUS_POLICY_RULE_SEND, TRUE, DBUS_MESSAGE_TYPE_METHOD_CALL, "org.example.B", "Open", TRUE },
+  { BUS_POLICY_RULE_SEND, TRUE, DBUS_MESSAGE_TYPE_METHOD_RETURN, NULL, NULL },
+  { BUS_POLICY_RULE_SEND, FALSE, DBUS_MESSAGE_TYPE_INVALID, "org.example.C", NULL,
+    FALSE, "org.example.Dest" },
+  { BUS_POLICY_RULE_RECEIVE, TRUE, DBUS_MESSAGE_TYPE_INVALID, NULL, NULL },
+  { BUS_POLICY_RULE_RECEIVE, FALSE, DBUS_MESSAGE_TYPE_ERROR, NULL, NULL },
+  { BUS_POLICY_RULE_RECEIVE, FALSE, DBUS_MESSAGE_TYPE_INVALID, "org.example.A", "Secret" },
+  { BUS_POLICY_RULE_RECEIVE, TRUE, DBUS_MESSAGE_TYPE_SIGNAL, "org.example.A", NULL },
+  { BUS_POLICY_RULE_OWN, TRUE, DBUS_MESSAGE_TYPE_INVALID, NULL, NULL }
+};
+
+static const char * const test_interfaces[] = {
+  "org.example.A", "org.example.B", "org.example.C", NULL
+};
+
+static const char * const test_members[] = {
+  "Forbidden", "Open", "Ping", "Secret", "Other"
+};
+
+static BusPolicyRule *
+new_test_rule (const TestRule *t)
+{
+  BusPolicyRule *rule;
+
+  rule = bus_policy_rule_new (t->type, t->allow);
+  if (rule == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  if (t->type == BUS_POLICY_RULE_SEND)
+    {
+      rule->d.send.message_type = t->message_type;
+      rule->d.send.interface = bus_intern_string (t->interface);
+      rule->d.send.member = bus_intern_string (t->member);
+      rule->d.send.max_fds = DBUS_MAXIMUM_MESSAGE_UNIX_FDS;
+      rule->d.send.log = t->log;
+      rule->d.send.destination = _dbus_strdup (t->destination);
+
+      if ((t->interface != NULL && rule->d.send.interface == NULL) ||
+          (t->member != NULL && rule->d.send.member == NULL) ||
+          (t->destination != NULL && rule->d.send.destination == NULL))
+        _dbus_test_fatal ("out of memory");
+    }
+  else if (t->type == BUS_POLICY_RULE_RECEIVE)
+    {
+      rule->d.receive.message_type = t->message_type;
+      rule->d.receive.interface = bus_intern_string (t->interface);
+      rule->d.receive.member = bus_intern_string (t->member);
+      rule->d.receive.max_fds = DBUS_MAXIMUM_MESSAGE_UNIX_FDS;
+
+      if ((t->interface != NULL && rule->d.receive.interface == NULL) ||
+          (t->member != NULL && rule->d.receive.member == NULL))
+        _dbus_test_fatal ("out of memory");
+    }
+
+  return rule;
+}
+
+static void
+append_test_rules (BusClientPolicy *policy)
+{
+  unsigned int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (test_rules); i++)
+    {
+      BusPolicyRule *rule = new_test_rule (&test_rules[i]);
+
+      if (!bus_client_policy_append_rule (policy, rule))
+        _dbus_test_fatal ("out of memory");
+
+      bus_policy_rule_unref (rule);
+    }
+}
+
+/* Puts the first n_rules test rules in the default context and in
+ * the context of an arbitrary group */
+static BusPolicy *
+new_test_bus_policy (unsigned int n_rules)
+{
+  BusPolicy *policy;
+  unsigned int i;
+
+  policy = bus_policy_new ();
+  if (policy == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  for (i = 0; i < n_rules; i++)
+    {
+      BusPolicyRule *rule = new_test_rule (&test_rules[i]);
+
+      if (!bus_policy_append_default_rule (policy, rule) ||
+          !bus_policy_append_group_rule (policy, 42, rule))
+        _dbus_test_fatal ("out of memory");
+
+      bus_policy_rule_unref (rule);
+    }
+
+  return policy;
+}
+
+static void
+check_policy_equal (void)
+{
+  BusPolicy *policy;
+  BusPolicy *other;
+  BusPolicyRule *rule;
+
+  policy = new_test_bus_policy (_DBUS_N_ELEMENTS (test_rules));
+
+  other = new_test_bus_policy (_DBUS_N_ELEMENTS (test_rules));
+  if (!bus_policy_equal (policy, other))
+    _dbus_test_fatal ("identical policies should be equal");
+  bus_policy_unref (other);
+
+  other = new_test_bus_policy (_DBUS_N_ELEMENTS (test_rules) - 1);
+  if (bus_policy_equal (policy, other) || bus_policy_equal (other, policy))
+    _dbus_test_fatal ("policies with a missing rule should differ");
+  bus_policy_unref (other);
+
+  /* the same rule, but only in the group context */
+  other = new_test_bus_policy (_DBUS_N_ELEMENTS (test_rules) - 1);
+  rule = new_test_rule (&test_rules[_DBUS_N_ELEMENTS (test_rules) - 1]);
+  if (!bus_policy_append_group_rule (other, 42, rule))
+    _dbus_test_fatal ("out of memory");
+  bus_policy_rule_unref (rule);
+  if (bus_policy_equal (policy, other))
+    _dbus_test_fatal ("policies with rules in different contexts should differ");
+  bus_policy_unref (other);
+
+  other = new_test_bus_policy (_DBUS_N_ELEMENTS (test_rules));
+  rule = other->default_rules->data;
+  rule->allow = !rule->allow;
+  if (bus_policy_equal (policy, other))
+    _dbus_test_fatal ("policies with different rules should differ");
+  bus_policy_unref (other);
+
+  bus_policy_unref (policy);
+}
+
+static DBusMessage *
+new_test_message (int         type,
+                  const char *interface,
+                  const char *member,
+                  const char *destination)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new (type);
+  if (message == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  if (!dbus_message_set_path (message, "/") ||
+      (interface != NULL && !dbus_message_set_interface (message, interface)) ||
+      !dbus_message_set_member (message, member) ||
+      (destination != NULL &&
+       !dbus_message_set_destination (message, destination)))
+    _dbus_test_fatal ("out of memory");
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      type == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_set_reply_serial (message, 1))
+        _dbus_test_fatal ("out of memory");
+    }
+
+  if (type == DBUS_MESSAGE_TYPE_ERROR &&
+      !dbus_message_set_error_name (message, "org.example.Error"))
+    _dbus_test_fatal ("out of memory");
+
+  return message;
+}
+
+static const char *
+test_message_interface (DBusMessage *message)
+{
+  const char *interface = dbus_message_get_interface (message);
+
+  return interface != NULL ? interface : "(none)";
+}
+
+/* The compiled checks, whether or not their verdicts were cached, must
+ * give the same verdicts as walking the rules, and the same number of
+ * matching rules whenever that gets logged */
+static void
+check_compiled_policy (BusClientPolicy *compiled,
+                       BusClientPolicy *linear,
+                       BusRegistry     *registry,
+                       DBusMessage     *message,
+                       dbus_bool_t      requested_reply)
+{
+  dbus_int32_t toggles, linear_toggles;
+  dbus_bool_t log, linear_log;
+  dbus_bool_t allowed;
+
+  log = linear_log = FALSE;
+  allowed = bus_client_policy_check_can_send (compiled, registry,
+                                              requested_reply, NULL,
+                                              message, &toggles, &log);
+
+  if (allowed != bus_client_policy_check_can_send (linear, NULL,
+                                                   requested_reply, NULL,
+                                                   message, &linear_toggles,
+                                                   &linear_log) ||
+      log != linear_log ||
+      ((!allowed || log) && toggles != linear_toggles))
+    _dbus_test_fatal ("compiled send check differs for %s %s.%s",
+                      dbus_message_type_to_string (dbus_message_get_type (message)),
+                      test_message_interface (message),
+                      dbus_message_get_member (message));
+
+  allowed = bus_client_policy_check_can_receive (compiled, registry,
+                                                 requested_reply, NULL,
+                                                 NULL, NULL, message,
+                                                 &toggles);
+
+  if (allowed != bus_client_policy_check_can_receive (linear, NULL,
+                                                      requested_reply, NULL,
+                                                      NULL, NULL, message,
+                                                      &linear_toggles) ||
+      (!allowed && toggles != linear_toggles))
+    _dbus_test_fatal ("compiled receive check differs for %s %s.%s",
+                      dbus_message_type_to_string (dbus_message_get_type (message)),
+                      test_message_interface (message),
+                      dbus_message_get_member (message));
+}
+
+dbus_bool_t
+bus_policy_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusClientPolicy *compiled;
+  BusClientPolicy *linear;
+  BusRegistry *registry;
+  int type;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  registry = bus_context_get_registry (context);
+
+  compiled = bus_client_policy_new ();
+  linear = bus_client_policy_new ();
+
+  if (compiled == NULL || linear == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  append_test_rules (compiled);
+  append_test_rules (linear);
+
+  bus_client_policy_compile (compiled);
+
+  if (compiled->send_index[DBUS_MESSAGE_TYPE_METHOD_CALL] == NULL)
+    _dbus_test_fatal ("out of memory");
+
+  for (type = DBUS_MESSAGE_TYPE_INVALID + 1;
+       type < DBUS_NUM_MESSAGE_TYPES;
+       type++)
+    {
+      unsigned int i, j;
+
+      for (i = 0; i < _DBUS_N_ELEMENTS (test_interfaces); i++)
+        {
+          /* signals must have an interface */
+          if (test_interfaces[i] == NULL && type == DBUS_MESSAGE_TYPE_SIGNAL)
+            continue;
+
+          for (j = 0; j < _DBUS_N_ELEMENTS (test_members); j++)
+            {
+              DBusMessage *message;
+              int k;
+
+              message = new_test_message (type, test_interfaces[i],
+                                          test_members[j],
+                                          (j % 2) ? "org.example.Dest" : NULL);
+
+              /* the second time round, the verdicts are cached */
+              for (k = 0; k < 2; k++)
+                {
+                  check_compiled_policy (compiled, linear, registry,
+                                         message, FALSE);
+                  check_compiled_policy (compiled, linear, registry,
+                                         message, TRUE);
+                }
+
+              dbus_message_unref (message);
+            }
+        }
+    }
+
+  _dbus_assert (compiled->send_verdicts.n_entries > 0);
+  _dbus_assert (compiled->receive_verdicts.n_entries > 0);
+
+  check_policy_equal ();
+
+  bus_client_policy_unref (compiled);
+  bus_client_policy_unref (linear);
+  bus_context_unref (context);
+
+  return TRUE;
+}
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
 
@@ -28,6 +28,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-internals.h>
 #include "bus.h"
 
 typedef enum
@@ -39,6 +40,14 @@ typedef enum
   BUS_POLICY_RULE_GROUP
 } BusPolicyRuleType;
 
+typedef enum
+{
+  BUS_POLICY_CHECK_SEND,
+  BUS_POLICY_CHECK_RECEIVE,
+  BUS_POLICY_CHECK_OWN,
+  BUS_POLICY_N_CHECK_KINDS
+} BusPolicyCheckKind;
+
 typedef enum
 {
   BUS_POLICY_TRISTATE_ANY = 0,
@@ -66,8 +75,8 @@ struct BusPolicyRule
       int   message_type;
       /* any of these can be NULL meaning "any" */
       char *path;
-      char *interface;
-      char *member;
+      const char *interface; /* atom from bus_intern_string() */
+      const char *member;    /* atom from bus_intern_string() */
       char *error;
       char *destination;
       unsigned int max_fds;
@@ -84,8 +93,8 @@ struct BusPolicyRule
       int   message_type;
       /* any of these can be NULL meaning "any" */
       char *path;
-      char *interface;
-      char *member;
+      const char *interface; /* atom from bus_intern_string() */
+      const char *member;    /* atom from bus_intern_string() */
       char *error;
       char *origin;
       unsigned int max_fds;
@@ -148,6 +157,8 @@ dbus_bool_t      bus_policy_append_console_rule   (BusPolicy        *policy,
 
 dbus_bool_t      bus_policy_merge                 (BusPolicy        *policy,
                                                    BusPolicy        *to_absorb);
+dbus_bool_t      bus_policy_equal                 (BusPolicy        *policy,
+                                                   BusPolicy        *other);
 
 BusClientPolicy* bus_client_policy_new               (void);
 BusClientPolicy* bus_client_policy_ref               (BusClientPolicy  *policy);
@@ -173,6 +184,29 @@ dbus_bool_t      bus_client_policy_append_rule       (BusClientPolicy  *policy,
                                                       BusPolicyRule    *rule);
 void             bus_client_policy_optimize          (BusClientPolicy  *policy);
 
+#ifdef DBUS_ENABLE_STATS
+/* Bus-wide counters for one kind of policy check */
+typedef struct
+{
+  dbus_uint64_t checks;
+  /* checks answered from a verdict cache */
+  dbus_uint64_t cache_hits;
+  /* rules evaluated by checks that were not answered from a cache */
+  dbus_uint64_t rules_scanned;
+  /* checks where no rule applied, so the default (deny) was used */
+  dbus_uint64_t no_rule_applied;
+  /* Position of the rule that decided each uncached check among the
+   * rules it scanned, counting back from the last one in config file
+   * order; power-of-two buckets as for latencies, so bucket 0 is the
+   * last rule */
+  DBusLatencyHistogram deciding_rule;
+  DBusLatencyHistogram latency;
+} BusPolicyCheckStats;
+
+void             bus_policy_get_check_stats   (BusPolicyCheckKind   kind,
+                                               BusPolicyCheckStats *stats);
+#endif
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 dbus_bool_t      bus_policy_check_can_own     (BusPolicy  *policy,
                                                const DBusString *service_name);
@@ -48,6 +48,8 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <grp.h>
 #endif /* HAVE_SELINUX */
 #ifdef HAVE_LIBAUDIT
@@ -67,6 +69,27 @@ static struct avc_entry_ref aeref;
 /* Store the SID of the bus itself to use as the default. */
 static security_id_t bus_sid = SECSID_WILD;
 
+/* Checks that the AVC allowed without wanting them audited, so that
+ * repeating them needs neither its lock nor auxdata. The cache is
+ * direct-mapped. An entry only counts if its seqno is the current one,
+ * which the netlink thread bumps on policy reload, so it never has to
+ * touch the entries itself. */
+#define VERDICT_CACHE_SIZE 256
+
+typedef struct
+{
+  security_id_t ssid;
+  security_id_t tsid;
+  security_class_t tclass;
+  access_vector_t requested;
+  dbus_int32_t seqno;
+} CachedVerdict;
+
+static CachedVerdict verdict_cache[VERDICT_CACHE_SIZE];
+
+/* Starts at 1 so that unused entries, with seqno 0, never match */
+static DBusAtomic verdict_seqno = { 1 };
+
 /* Thread to listen for SELinux status changes via netlink. */
 static pthread_t avc_notify_thread;
 
@@ -162,7 +185,10 @@ policy_reload_callback (u_int32_t event, security_id_t ssid,
                         access_vector_t perms, access_vector_t *out_retained)
 {
   if (event == AVC_CALLBACK_RESET)
-    return raise (SIGHUP);
+    {
+      _dbus_atomic_inc (&verdict_seqno);
+      return raise (SIGHUP);
+    }
   
   return 0;
 }
@@ -418,6 +444,45 @@ bus_selinux_full_init (void)
  * @returns #TRUE if security policy allows the send.
  */
 #ifdef HAVE_SELINUX
+static CachedVerdict *
+verdict_cache_slot (security_id_t    ssid,
+                    security_id_t    tsid,
+                    security_class_t tclass,
+                    access_vector_t  requested)
+{
+  uintptr_t hash;
+
+  hash = (((uintptr_t) ssid) >> 4) * 31 + (((uintptr_t) tsid) >> 4);
+  hash = hash * 31 + tclass;
+  hash = hash * 31 + requested;
+  hash ^= hash >> 8;
+
+  return &verdict_cache[hash % VERDICT_CACHE_SIZE];
+}
+
+/**
+ * Returns #TRUE if the same check was allowed since the last policy
+ * reload, without anything asking for it to be audited. If so the
+ * caller can allow it again without asking the AVC.
+ */
+static dbus_bool_t
+bus_selinux_check_cached (BusSELinuxID        *sender_sid,
+                          BusSELinuxID        *override_sid,
+                          security_class_t     target_class,
+                          access_vector_t      requested)
+{
+  security_id_t ssid = SELINUX_SID_FROM_BUS (sender_sid);
+  security_id_t tsid = override_sid ?
+    SELINUX_SID_FROM_BUS (override_sid) : bus_sid;
+  CachedVerdict *slot;
+
+  slot = verdict_cache_slot (ssid, tsid, target_class, requested);
+
+  return slot->seqno == _dbus_atomic_get (&verdict_seqno) &&
+    slot->ssid == ssid && slot->tsid == tsid &&
+    slot->tclass == target_class && slot->requested == requested;
+}
+
 static dbus_bool_t
 bus_selinux_check (BusSELinuxID        *sender_sid,
                    BusSELinuxID        *override_sid,
@@ -425,15 +490,48 @@ bus_selinux_check (BusSELinuxID        *sender_sid,
                    access_vector_t      requested,
 		   DBusString          *auxdata)
 {
+  security_id_t ssid = SELINUX_SID_FROM_BUS (sender_sid);
+  security_id_t tsid = override_sid ?
+    SELINUX_SID_FROM_BUS (override_sid) : bus_sid;
+  struct av_decision avd;
+  dbus_int32_t seqno;
+  int result;
+  int errsave;
+
   if (!selinux_enabled)
     return TRUE;
 
-  /* Make the security check.  AVC checks enforcing mode here as well. */
-  if (avc_has_perm (SELINUX_SID_FROM_BUS (sender_sid),
-                    override_sid ?
-                    SELINUX_SID_FROM_BUS (override_sid) :
-                    bus_sid,
-                    target_class, requested, &aeref, auxdata) < 0)
+  /* Taken before asking, so that a verdict from a policy that is
+   * replaced meanwhile is cached under the old seqno */
+  seqno = _dbus_atomic_get (&verdict_seqno);
+
+  /* Make the security check.  AVC checks enforcing mode here as well.
+   * This is avc_has_perm() in two halves, so that we can see whether
+   * the verdict may be cached. */
+  memset (&avd, 0, sizeof (avd));
+  result = avc_has_perm_noaudit (ssid, tsid, target_class, requested,
+                                 &aeref, &avd);
+  errsave = errno;
+  avc_audit (ssid, tsid, target_class, requested, &avd, result, auxdata);
+  errno = errsave;
+
+  /* Only allowed checks that were not audited can be repeated silently;
+   * in permissive mode a denied one is let through, but logged */
+  if (result == 0 &&
+      (avd.allowed & requested) == requested &&
+      (avd.auditallow & requested) == 0)
+    {
+      CachedVerdict *slot;
+
+      slot = verdict_cache_slot (ssid, tsid, target_class, requested);
+      slot->ssid = ssid;
+      slot->tsid = tsid;
+      slot->tclass = target_class;
+      slot->requested = requested;
+      slot->seqno = seqno;
+    }
+
+  if (result < 0)
     {
     switch (errno)
       {
@@ -477,6 +575,11 @@ bus_selinux_allows_acquire_service (DBusConnection     *connection,
     return TRUE;
   
   connection_sid = bus_connection_get_selinux_id (connection);
+
+  if (bus_selinux_check_cached (connection_sid, service_sid,
+                                SECCLASS_DBUS, DBUS__ACQUIRE_SVC))
+    return TRUE;
+
   if (!dbus_connection_get_unix_process_id (connection, &spid))
     spid = 0;
 
@@ -553,6 +656,18 @@ bus_selinux_allows_send (DBusConnection     *sender,
   if (activation_entry)
     return TRUE;
 
+  sender_sid = bus_connection_get_selinux_id (sender);
+
+  /* A NULL proposed_recipient with no activation entry means the bus itself. */
+  if (proposed_recipient)
+    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
+  else
+    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+
+  if (bus_selinux_check_cached (sender_sid, recipient_sid,
+                                SECCLASS_DBUS, DBUS__SEND_MSG))
+    return TRUE;
+
   if (!sender || !dbus_connection_get_unix_process_id (sender, &spid))
     spid = 0;
   if (!proposed_recipient || !dbus_connection_get_unix_process_id (proposed_recipient, &tpid))
@@ -619,14 +734,6 @@ bus_selinux_allows_send (DBusConnection     *sender,
 	goto oom;
     }
 
-  sender_sid = bus_connection_get_selinux_id (sender);
-
-  /* A NULL proposed_recipient with no activation entry means the bus itself. */
-  if (proposed_recipient)
-    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
-  else
-    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
-
   ret = bus_selinux_check (sender_sid, 
 			   recipient_sid,
 			   SECCLASS_DBUS, 
@@ -980,6 +1087,9 @@ bus_selinux_shutdown (void)
     {
       bus_sid = SECSID_WILD;
 
+      /* The SIDs in the cache are about to be freed */
+      _dbus_atomic_inc (&verdict_seqno);
+
       bus_avc_print_stats ();
 
       avc_destroy ();
@@ -54,8 +54,15 @@ struct BusOwner
   BusService *service;
   DBusConnection *conn;
 
+  /* Our link in service->owners, whose data is this owner; allocated
+   * with the owner so that it can be queued again without allocating */
+  DBusList *queue_link;
+  /* Our link in the connection's list of owned services */
+  DBusList *connection_link;
+
   unsigned int allow_replacement : 1;
   unsigned int do_not_queue : 1;
+  unsigned int queued : 1; /* queue_link is in service->owners */
 };
 
 struct BusRegistry
@@ -69,6 +76,15 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  /* Incremented whenever the owner queue of any name changes, so that
+   * cached routing decisions that depend on name ownership can tell
+   * when they are stale */
+  dbus_uint64_t owners_serial;
+
+  /* Counters for bus_registry_new_unique_name() */
+  int next_major_number;
+  int next_minor_number;
 };
 
 BusRegistry*
@@ -140,6 +156,117 @@ bus_registry_unref  (BusRegistry *registry)
     }
 }
 
+static void
+bus_registry_owners_changed (BusRegistry *registry)
+{
+  registry->owners_serial += 1;
+}
+
+dbus_uint64_t
+bus_registry_get_owners_serial (BusRegistry *registry)
+{
+  return registry->owners_serial;
+}
+
+dbus_bool_t
+bus_registry_new_unique_name (BusRegistry *registry,
+                              DBusString  *str)
+{
+  /* We never want to use the same unique client name twice, because
+   * we want to guarantee that if you send a message to a given unique
+   * name, you always get the same application. So we use two numbers
+   * for INT_MAX * INT_MAX combinations, should be pretty safe against
+   * wraparound.
+   */
+  int len;
+
+  len = _dbus_string_get_length (str);
+
+  while (TRUE)
+    {
+      /* start out with 1-0, go to 1-1, 1-2, 1-3,
+       * up to 1-MAXINT, then 2-0, 2-1, etc.
+       */
+      if (registry->next_minor_number <= 0)
+        {
+          registry->next_major_number += 1;
+          registry->next_minor_number = 0;
+          if (registry->next_major_number <= 0)
+            _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
+        }
+
+      _dbus_assert (registry->next_major_number > 0);
+      _dbus_assert (registry->next_minor_number >= 0);
+
+      /* appname:MAJOR-MINOR */
+
+      if (!_dbus_string_append (str, ":"))
+        return FALSE;
+
+      if (!_dbus_string_append_int (str, registry->next_major_number))
+        return FALSE;
+
+      if (!_dbus_string_append (str, "."))
+        return FALSE;
+
+      if (!_dbus_string_append_int (str, registry->next_minor_number))
+        return FALSE;
+
+      registry->next_minor_number += 1;
+
+      /* Check if a client with the name exists */
+      if (bus_registry_lookup (registry, str) == NULL)
+	break;
+
+      /* drop the number again, try the next one. */
+      _dbus_string_set_length (str, len);
+    }
+
+  return TRUE;
+}
+
+/* Used to carry the unique name counter over when the bus is replaced
+ * by a new instance of itself, see handoff.c */
+void
+bus_registry_get_unique_name_counter (BusRegistry *registry,
+                                      int         *major,
+                                      int         *minor)
+{
+  *major = registry->next_major_number;
+  *minor = registry->next_minor_number;
+}
+
+void
+bus_registry_set_unique_name_counter (BusRegistry *registry,
+                                      int          major,
+                                      int          minor)
+{
+  registry->next_major_number = major;
+  registry->next_minor_number = minor;
+}
+
+#ifdef DBUS_ENABLE_STATS
+void
+bus_registry_get_service_pool_stats (BusRegistry   *registry,
+                                     dbus_uint32_t *in_use_p,
+                                     dbus_uint32_t *in_free_list_p,
+                                     dbus_uint32_t *allocated_p)
+{
+  _dbus_mem_pool_get_stats (registry->service_pool,
+                            in_use_p, in_free_list_p, allocated_p);
+}
+
+void
+bus_registry_get_owner_pool_stats (BusRegistry   *registry,
+                                   dbus_uint32_t *in_use_p,
+                                   dbus_uint32_t *in_free_list_p,
+                                   dbus_uint32_t *allocated_p)
+{
+  _dbus_mem_pool_get_stats (registry->owner_pool,
+                            in_use_p, in_free_list_p, allocated_p);
+}
+#endif
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
@@ -152,26 +279,21 @@ bus_registry_lookup (BusRegistry      *registry,
   return service;
 }
 
-static DBusList *
-_bus_service_find_owner_link (BusService *service,
-                              DBusConnection *connection)
+static BusOwner *
+bus_service_find_owner (BusService     *service,
+                        DBusConnection *connection)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&service->owners);
-
-  while (link != NULL)
-    {
-      BusOwner *bus_owner;
+  BusOwner *owner;
 
-      bus_owner = (BusOwner *) link->data;
-      if (bus_owner->conn == connection) 
-        break;
+  owner = bus_connection_get_owner (connection, service);
 
-      link = _dbus_list_get_next_link (&service->owners, link);
-    }
+  /* An owner that has left the queue can still be alive until the
+   * transaction that removed it is freed */
+  if (owner == NULL || !owner->queued)
+    return NULL;
 
-  return link;
+  _dbus_assert (owner->service == service);
+  return owner;
 }
 
 static void
@@ -206,12 +328,23 @@ bus_owner_new (BusService *service,
       result->conn = conn;
       result->service = service;
 
-      if (!bus_connection_add_owned_service (conn, service))
+      result->queue_link = _dbus_list_alloc_link (result);
+      if (result->queue_link == NULL)
         {
           _dbus_mem_pool_dealloc (service->registry->owner_pool, result);
           return NULL;
         }
-        
+
+      result->connection_link = bus_connection_add_owned_service (conn,
+                                                                  service,
+                                                                  result);
+      if (result->connection_link == NULL)
+        {
+          _dbus_list_free_link (result->queue_link);
+          _dbus_mem_pool_dealloc (service->registry->owner_pool, result);
+          return NULL;
+        }
+
       bus_owner_set_flags (result, flags);
     }
   return result;
@@ -234,11 +367,45 @@ bus_owner_unref  (BusOwner *owner)
 
   if (owner->refcount == 0)
     {
-      bus_connection_remove_owned_service (owner->conn, owner->service);
+      _dbus_assert (!owner->queued);
+      bus_connection_remove_owned_service (owner->conn, owner,
+                                           owner->connection_link);
+      _dbus_list_free_link (owner->queue_link);
       _dbus_mem_pool_dealloc (owner->service->registry->owner_pool, owner);
     }
 }
 
+/* Puts the owner in the queue before before_link, or at the end if
+ * before_link is NULL. The queue holds a reference to each owner. This
+ * can't fail. */
+static void
+bus_service_link_owner (BusService *service,
+                        BusOwner   *owner,
+                        DBusList   *before_link)
+{
+  _dbus_assert (owner->service == service);
+  _dbus_assert (!owner->queued);
+
+  _dbus_list_insert_before_link (&service->owners, before_link,
+                                 owner->queue_link);
+  owner->queued = TRUE;
+  bus_owner_ref (owner);
+  bus_registry_owners_changed (service->registry);
+}
+
+static void
+bus_service_unlink_owner (BusService *service,
+                          BusOwner   *owner)
+{
+  _dbus_assert (owner->service == service);
+  _dbus_assert (owner->queued);
+
+  _dbus_list_unlink (&service->owners, owner->queue_link);
+  owner->queued = FALSE;
+  bus_registry_owners_changed (service->registry);
+  bus_owner_unref (owner);
+}
+
 BusService*
 bus_registry_ensure (BusRegistry               *registry,
                      const DBusString          *service_name,
@@ -332,6 +499,71 @@ bus_registry_foreach (BusRegistry               *registry,
     }
 }
 
+/**
+ * Appends every well-known name's queue of owners to an array of
+ * structs of signature "(ssu)": the name, the unique name of the owner
+ * and the DBUS_NAME_FLAG_ALLOW_REPLACEMENT and DBUS_NAME_FLAG_DO_NOT_QUEUE
+ * flags it asked for. Each queue is in order, primary owner first, so
+ * that requesting the names again in the same order rebuilds it.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_registry_append_owners (BusRegistry     *registry,
+                            DBusMessageIter *array_iter)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (registry->service_hash, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusService *service = _dbus_hash_iter_get_value (&iter);
+      DBusList *link;
+
+      /* Unique names come with their connection */
+      if (service->name[0] == ':')
+        continue;
+
+      for (link = _dbus_list_get_first_link (&service->owners);
+           link != NULL;
+           link = _dbus_list_get_next_link (&service->owners, link))
+        {
+          BusOwner *owner = link->data;
+          DBusMessageIter struct_iter;
+          const char *owner_name;
+          dbus_uint32_t flags = 0;
+
+          owner_name = bus_connection_get_name (owner->conn);
+
+          if (owner->allow_replacement)
+            flags |= DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
+
+          if (owner->do_not_queue)
+            flags |= DBUS_NAME_FLAG_DO_NOT_QUEUE;
+
+          if (!dbus_message_iter_open_container (array_iter, DBUS_TYPE_STRUCT,
+                                                 NULL, &struct_iter))
+            return FALSE;
+
+          if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                               &service->name) ||
+              !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                               &owner_name) ||
+              !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                               &flags))
+            {
+              dbus_message_iter_abandon_container (array_iter, &struct_iter);
+              return FALSE;
+            }
+
+          if (!dbus_message_iter_close_container (array_iter, &struct_iter))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_registry_list_services (BusRegistry *registry,
                             char      ***listp,
@@ -542,19 +774,13 @@ bus_registry_acquire_service (BusRegistry      *registry,
 	   ((flags & DBUS_NAME_FLAG_DO_NOT_QUEUE) &&
            !(flags & DBUS_NAME_FLAG_REPLACE_EXISTING))) 
     {
-      DBusList *link;
       BusOwner *temp_owner;
     /* Since we can't be queued if we are already in the queue
        remove us */
 
-      link = _bus_service_find_owner_link (service, connection);
-      if (link != NULL)
-        {
-          _dbus_list_unlink (&service->owners, link);
-          temp_owner = (BusOwner *)link->data;
-          bus_owner_unref (temp_owner); 
-          _dbus_list_free_link (link);
-        }
+      temp_owner = bus_service_find_owner (service, connection);
+      if (temp_owner != NULL)
+        bus_service_unlink_owner (service, temp_owner);
       
       *result = DBUS_REQUEST_NAME_REPLY_EXISTS;
     }
@@ -719,14 +945,6 @@ bus_registry_set_service_context_table (BusRegistry   *registry,
   return TRUE;
 }
 
-static void
-bus_service_unlink_owner (BusService      *service,
-                          BusOwner        *owner)
-{
-  _dbus_list_remove_last (&service->owners, owner);
-  bus_owner_unref (owner);
-}
-
 static void
 bus_service_unlink (BusService *service)
 {
@@ -831,7 +1049,6 @@ bus_service_add_owner (BusService     *service,
                        DBusError      *error)
 {
   BusOwner *bus_owner;
-  DBusList *bus_owner_link;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -844,10 +1061,12 @@ bus_service_add_owner (BusService     *service,
         return FALSE;
     }
   
-  bus_owner_link = _bus_service_find_owner_link (service, connection);
+  bus_owner = bus_service_find_owner (service, connection);
   
-  if (bus_owner_link == NULL)
+  if (bus_owner == NULL)
     {
+      DBusList *before_link;
+
       bus_owner = bus_owner_new (service, connection, flags);
       if (bus_owner == NULL)
         {
@@ -857,26 +1076,14 @@ bus_service_add_owner (BusService     *service,
 
       bus_owner_set_flags (bus_owner, flags);
       if (!(flags & DBUS_NAME_FLAG_REPLACE_EXISTING) || service->owners == NULL)
-        {
-          if (!_dbus_list_append (&service->owners,
-                                  bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
-        }
+        before_link = NULL;
       else
-        {
-          if (!_dbus_list_insert_after (&service->owners,
-                                         _dbus_list_get_first_link (&service->owners),
-                                         bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
-        }      
+        before_link = _dbus_list_get_next_link (&service->owners,
+                                                _dbus_list_get_first_link (&service->owners));
+
+      /* the queue takes over our reference */
+      bus_service_link_owner (service, bus_owner, before_link);
+      bus_owner_unref (bus_owner);
     } 
   else 
     {
@@ -884,18 +1091,19 @@ bus_service_add_owner (BusService     *service,
        * No need for operations that can produce OOM
        */
 
-      bus_owner = (BusOwner *) bus_owner_link->data;
       if (flags & DBUS_NAME_FLAG_REPLACE_EXISTING)
         {
 	  DBusList *link;
-          _dbus_list_unlink (&service->owners, bus_owner_link);
+          _dbus_list_unlink (&service->owners, bus_owner->queue_link);
 	  link = _dbus_list_get_first_link (&service->owners);
 	  _dbus_assert (link != NULL);
 	  
-          _dbus_list_insert_after_link (&service->owners, link, bus_owner_link);
+          _dbus_list_insert_after_link (&service->owners, link,
+                                        bus_owner->queue_link);
         }
       
       bus_owner_set_flags (bus_owner, flags);
+      bus_registry_owners_changed (service->registry);
       return TRUE;
     }
 
@@ -916,9 +1124,8 @@ typedef struct
   BusOwner       *owner;
   BusService     *service;
   BusOwner       *before_owner; /* restore to position before this connection in owners list */
-  DBusList       *owner_link;
-  DBusList       *service_link;
   DBusPreallocatedHash *hash_entry;
+  dbus_bool_t     restored;
 } OwnershipRestoreData;
 
 static void
@@ -927,8 +1134,7 @@ restore_ownership (void *data)
   OwnershipRestoreData *d = data;
   DBusList *link;
 
-  _dbus_assert (d->service_link != NULL);
-  _dbus_assert (d->owner_link != NULL);
+  _dbus_assert (!d->restored);
   
   if (d->service->owners == NULL)
     {
@@ -944,28 +1150,17 @@ restore_ownership (void *data)
    * changes, since we're reverting something that was
    * cancelled (effectively never really happened)
    */
-  link = _dbus_list_get_first_link (&d->service->owners);
-  while (link != NULL)
-    {
-      if (link->data == d->before_owner)
-        break;
+  if (d->before_owner != NULL && d->before_owner->queued)
+    link = d->before_owner->queue_link;
+  else
+    link = NULL;
 
-      link = _dbus_list_get_next_link (&d->service->owners, link);
-    }
-  
-  _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  /* The owner stayed in the connection's list of owned services while
+   * it was out of the queue, because we hold a reference to it */
+  bus_service_link_owner (d->service, d->owner, link);
 
-  /* Note that removing then restoring this changes the order in which
-   * ServiceDeleted messages are sent on destruction of the
-   * connection.  This should be OK as the only guarantee there is
-   * that the base service is destroyed last, and we never even
-   * tentatively remove the base service.
-   */
-  bus_connection_add_owned_service_link (d->owner->conn, d->service_link);
-  
   d->hash_entry = NULL;
-  d->service_link = NULL;
-  d->owner_link = NULL;
+  d->restored = TRUE;
 }
 
 static void
@@ -973,16 +1168,14 @@ free_ownership_restore_data (void *data)
 {
   OwnershipRestoreData *d = data;
 
-  if (d->service_link)
-    _dbus_list_free_link (d->service_link);
-  if (d->owner_link)
-    _dbus_list_free_link (d->owner_link);
   if (d->hash_entry)
     _dbus_hash_table_free_preallocated_entry (d->service->registry->service_hash,
                                               d->hash_entry);
 
   dbus_connection_unref (d->owner->conn);
   bus_owner_unref (d->owner);
+  if (d->before_owner)
+    bus_owner_unref (d->before_owner);
   bus_service_unref (d->service);
   
   dbus_free (d);
@@ -1000,36 +1193,25 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   if (d == NULL)
     return FALSE;
   
+  _dbus_assert (owner->queued);
+
   d->service = service;
   d->owner = owner;
-  d->service_link = _dbus_list_alloc_link (service);
-  d->owner_link = _dbus_list_alloc_link (owner);
+  d->restored = FALSE;
   d->hash_entry = _dbus_hash_table_preallocate_entry (service->registry->service_hash);
   
   bus_service_ref (d->service);
   bus_owner_ref (d->owner);
   dbus_connection_ref (d->owner->conn);
 
-  d->before_owner = NULL;
-  link = _dbus_list_get_first_link (&service->owners);
-  while (link != NULL)
-    {
-      if (link->data == owner)
-        {
-          link = _dbus_list_get_next_link (&service->owners, link);
-
-          if (link)
-            d->before_owner = link->data;
+  link = _dbus_list_get_next_link (&service->owners, owner->queue_link);
 
-          break;
-        }
-      
-      link = _dbus_list_get_next_link (&service->owners, link);
-    }
+  if (link != NULL)
+    d->before_owner = bus_owner_ref (link->data);
+  else
+    d->before_owner = NULL;
   
-  if (d->service_link == NULL ||
-      d->owner_link == NULL ||
-      d->hash_entry == NULL ||
+  if (d->hash_entry == NULL ||
       !bus_transaction_add_cancel_hook (transaction, restore_ownership, d,
                                         free_ownership_restore_data))
     {
@@ -1113,6 +1295,7 @@ bus_service_swap_owner (BusService     *service,
   _dbus_list_insert_after_link (&service->owners,
                                 _dbus_list_get_first_link (&service->owners),
 				swap_link);
+  bus_registry_owners_changed (service->registry);
 
   return TRUE;
 }
@@ -1143,14 +1326,11 @@ bus_service_remove_owner (BusService     *service,
   else
     {
       /* if we are not the primary owner then just remove us from the queue */
-      DBusList *link;
       BusOwner *temp_owner;
 
-      link = _bus_service_find_owner_link (service, connection);
-      _dbus_list_unlink (&service->owners, link);
-      temp_owner = (BusOwner *)link->data;
-      bus_owner_unref (temp_owner); 
-      _dbus_list_free_link (link);
+      temp_owner = bus_service_find_owner (service, connection);
+      _dbus_assert (temp_owner != NULL);
+      bus_service_unlink_owner (service, temp_owner);
 
       return TRUE; 
     }
@@ -1277,14 +1457,7 @@ dbus_bool_t
 bus_service_has_owner (BusService     *service,
 		       DBusConnection *connection)
 {
-  DBusList *link;
-
-  link = _bus_service_find_owner_link (service, connection);
- 
-  if (link == NULL)
-    return FALSE;
-  else
-    return TRUE;
+  return bus_service_find_owner (service, connection) != NULL;
 }
 
 dbus_bool_t 
@@ -50,6 +50,8 @@ void         bus_registry_foreach         (BusRegistry                 *registry
 dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
                                            char                      ***listp,
                                            int                         *array_len);
+dbus_bool_t  bus_registry_append_owners   (BusRegistry                 *registry,
+                                           DBusMessageIter             *array_iter);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
@@ -65,6 +67,25 @@ dbus_bool_t  bus_registry_release_service (BusRegistry                 *registry
                                            DBusError                   *error);
 dbus_bool_t  bus_registry_set_service_context_table (BusRegistry           *registry,
 						     DBusHashTable         *table);
+dbus_uint64_t bus_registry_get_owners_serial (BusRegistry                *registry);
+dbus_bool_t  bus_registry_new_unique_name (BusRegistry                 *registry,
+                                           DBusString                  *str);
+void         bus_registry_get_unique_name_counter (BusRegistry         *registry,
+                                                   int                 *major,
+                                                   int                 *minor);
+void         bus_registry_set_unique_name_counter (BusRegistry         *registry,
+                                                   int                  major,
+                                                   int                  minor);
+
+/* called by stats.c, only present if DBUS_ENABLE_STATS */
+void bus_registry_get_service_pool_stats (BusRegistry   *registry,
+                                          dbus_uint32_t *in_use_p,
+                                          dbus_uint32_t *in_free_list_p,
+                                          dbus_uint32_t *allocated_p);
+void bus_registry_get_owner_pool_stats   (BusRegistry   *registry,
+                                          dbus_uint32_t *in_use_p,
+                                          dbus_uint32_t *in_free_list_p,
+                                          dbus_uint32_t *allocated_p);
 
 BusService*     bus_service_ref                       (BusService     *service);
 void            bus_service_unref                     (BusService     *service);
@@ -26,11 +26,17 @@
 #include <string.h>
 
 #include "signals.h"
+#include "intern.h"
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-test-tap.h>
 
+/* Enough for the common case of a rule on arg0, plus NULL termination */
+#define BUS_MATCH_INLINE_ARGS 2
+
 struct BusMatchRule
 {
   int refcount;       /**< reference count */
@@ -39,16 +45,36 @@ struct BusMatchRule
 
   unsigned int flags; /**< BusMatchFlags */
 
+  /* Set while the rule is in a matchmaker: the matchmaker (not
+   * referenced), our link in its list of rules, and our links in its
+   * lists of rules naming a unique name as sender or destination */
+  BusMatchmaker *matchmaker;
+  DBusList *link;
+  DBusList *sender_link;
+  DBusList *destination_link;
+
   int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
+  /* These are atoms from bus_intern_string(), shared with every
+   * other rule that mentions the same name */
+  const char *interface;
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
 
+  /* NULL-terminated; they point to inline_args and inline_arg_lens
+   * until a rule has more args than those can hold */
   unsigned int *arg_lens;
   char **args;
   int args_len;
+
+  char *inline_args[BUS_MATCH_INLINE_ARGS];
+  unsigned int inline_arg_lens[BUS_MATCH_INLINE_ARGS];
+
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint64_t n_evaluated; /**< Messages this rule was checked against */
+  dbus_uint64_t n_matched;   /**< Messages this rule matched */
+#endif
 };
 
 #define BUS_MATCH_ARG_NAMESPACE   0x4000000u
@@ -56,17 +82,41 @@ struct BusMatchRule
 
 #define BUS_MATCH_ARG_FLAGS (BUS_MATCH_ARG_NAMESPACE | BUS_MATCH_ARG_IS_PATH)
 
+/* Shared by all matchmakers, since a rule doesn't know which one it
+ * will be added to. It is freed along with the last rule, like the pool in
+ * dbus-list.c; the bus is single-threaded, so it needs no lock. */
+static DBusMemPool *rule_pool = NULL;
+
 BusMatchRule*
 bus_match_rule_new (DBusConnection *matches_go_to)
 {
   BusMatchRule *rule;
 
-  rule = dbus_new0 (BusMatchRule, 1);
-  if (rule == NULL)
-    return NULL;
+  if (rule_pool == NULL)
+    {
+      rule_pool = _dbus_mem_pool_new (sizeof (BusMatchRule), TRUE);
+      if (rule_pool == NULL)
+        return NULL;
+
+      rule = _dbus_mem_pool_alloc (rule_pool);
+      if (rule == NULL)
+        {
+          _dbus_mem_pool_free (rule_pool);
+          rule_pool = NULL;
+          return NULL;
+        }
+    }
+  else
+    {
+      rule = _dbus_mem_pool_alloc (rule_pool);
+      if (rule == NULL)
+        return NULL;
+    }
 
   rule->refcount = 1;
   rule->matches_go_to = matches_go_to;
+  rule->args = rule->inline_args;
+  rule->arg_lens = rule->inline_arg_lens;
 
 #ifndef DBUS_ENABLE_EMBEDDED_TESTS
   _dbus_assert (rule->matches_go_to != NULL);
@@ -93,12 +143,11 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
-      dbus_free (rule->arg_lens);
+      bus_intern_release (rule->interface);
+      bus_intern_release (rule->member);
+      bus_intern_release (rule->sender);
+      bus_intern_release (rule->destination);
+      bus_intern_release (rule->path);
 
       /* can't use dbus_free_string_array() since there
        * are embedded NULL
@@ -115,14 +164,31 @@ bus_match_rule_unref (BusMatchRule *rule)
               ++i;
             }
 
-          dbus_free (rule->args);
+          if (rule->args != rule->inline_args)
+            dbus_free (rule->args);
+        }
+
+      if (rule->arg_lens != rule->inline_arg_lens)
+        dbus_free (rule->arg_lens);
+
+      if (_dbus_mem_pool_dealloc (rule_pool, rule))
+        {
+          _dbus_mem_pool_free (rule_pool);
+          rule_pool = NULL;
         }
-      
-      dbus_free (rule);
     }
 }
 
-#if defined(DBUS_ENABLE_VERBOSE_MODE) || defined(DBUS_ENABLE_STATS)
+#ifdef DBUS_ENABLE_STATS
+void
+bus_match_rule_get_pool_stats (dbus_uint32_t *in_use_p,
+                               dbus_uint32_t *in_free_list_p,
+                               dbus_uint32_t *allocated_p)
+{
+  _dbus_mem_pool_get_stats (rule_pool, in_use_p, in_free_list_p, allocated_p);
+}
+#endif
+
 static dbus_bool_t
 append_key_and_escaped_value (DBusString *str, const char *token, const char *value)
 {
@@ -161,9 +227,9 @@ append_key_and_escaped_value (DBusString *str, const char *token, const char *va
   return TRUE;
 }
 
-/* returns NULL if no memory */
-static char*
-match_rule_to_string (BusMatchRule *rule)
+/* The inverse of bus_match_rule_parse(); returns NULL if no memory */
+char*
+bus_match_rule_to_string (BusMatchRule *rule)
 {
   DBusString str;
   char *ret;
@@ -312,7 +378,6 @@ match_rule_to_string (BusMatchRule *rule)
   _dbus_string_free (&str);
   return NULL;
 }
-#endif /* defined(DBUS_ENABLE_VERBOSE_MODE) || defined(DBUS_ENABLE_STATS) */
 
 dbus_bool_t
 bus_match_rule_set_message_type (BusMatchRule *rule,
@@ -329,16 +394,16 @@ dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_intern_string (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_intern_release (rule->interface);
   rule->interface = new;
 
   return TRUE;
@@ -348,16 +413,16 @@ dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_intern_string (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_intern_release (rule->member);
   rule->member = new;
 
   return TRUE;
@@ -367,16 +432,16 @@ dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_intern_string (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_intern_release (rule->sender);
   rule->sender = new;
 
   return TRUE;
@@ -386,16 +451,16 @@ dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_intern_string (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_intern_release (rule->destination);
   rule->destination = new;
 
   return TRUE;
@@ -425,11 +490,11 @@ bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path,
                          dbus_bool_t   is_namespace)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (path != NULL);
 
-  new = _dbus_strdup (path);
+  new = bus_intern_string (path);
   if (new == NULL)
     return FALSE;
 
@@ -440,7 +505,7 @@ bus_match_rule_set_path (BusMatchRule *rule,
   else
     rule->flags |= BUS_MATCH_PATH;
 
-  dbus_free (rule->path);
+  bus_intern_release (rule->path);
   rule->path = new;
 
   return TRUE;
@@ -471,11 +536,20 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
       new_args_len = arg + 1;
 
       /* add another + 1 here for null termination */
-      new_args = dbus_realloc (rule->args,
-                               sizeof (char *) * (new_args_len + 1));
+      if (new_args_len + 1 <= BUS_MATCH_INLINE_ARGS)
+        new_args = rule->args;
+      else if (rule->args == rule->inline_args)
+        new_args = dbus_new (char *, new_args_len + 1);
+      else
+        new_args = dbus_realloc (rule->args,
+                                 sizeof (char *) * (new_args_len + 1));
       if (new_args == NULL)
         return FALSE;
 
+      /* moving out of inline_args */
+      if (new_args != rule->args && rule->args == rule->inline_args)
+        memcpy (new_args, rule->args, sizeof (char *) * (rule->args_len + 1));
+
       /* NULL the new slots */
       i = rule->args_len;
       while (i <= new_args_len) /* <= for null termination */
@@ -487,12 +561,22 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
       rule->args = new_args;
 
       /* and now add to the lengths */
-      new_arg_lens = dbus_realloc (rule->arg_lens,
-                                   sizeof (int) * (new_args_len + 1));
+      if (new_args_len + 1 <= BUS_MATCH_INLINE_ARGS)
+        new_arg_lens = rule->arg_lens;
+      else if (rule->arg_lens == rule->inline_arg_lens)
+        new_arg_lens = dbus_new (unsigned int, new_args_len + 1);
+      else
+        new_arg_lens = dbus_realloc (rule->arg_lens,
+                                     sizeof (int) * (new_args_len + 1));
 
       if (new_arg_lens == NULL)
         return FALSE;
 
+      if (new_arg_lens != rule->arg_lens &&
+          rule->arg_lens == rule->inline_arg_lens)
+        memcpy (new_arg_lens, rule->arg_lens,
+                sizeof (int) * (rule->args_len + 1));
+
       /* zero the new slots */
       i = rule->args_len;
       while (i <= new_args_len) /* <= for null termination */
@@ -1163,93 +1247,353 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   return rule;
 }
 
+/* Within one RulePool bucket, each rule is filed under the most selective
+ * key it specifies, so that a message is only compared with rules that
+ * could possibly match it. We prefer arg0 (which usually names the subject
+ * of NameOwnerChanged and similar signals), then an exact path (typically
+ * unique per object, e.g. for PropertiesChanged), then arg0path, then the
+ * member, then the sender.
+ *
+ * The arg0namespace and arg0path tables are keyed by the rule's value, so
+ * they form a hashed trie: the rules matching a given arg0 are found by
+ * looking up each of its namespace or path prefixes, which costs
+ * O(number of components) however many such rules there are.
+ */
+typedef enum
+{
+  RULE_INDEX_ARG0,
+  RULE_INDEX_ARG0_NAMESPACE,
+  RULE_INDEX_PATH,
+  RULE_INDEX_ARG0_PATH,
+  RULE_INDEX_MEMBER,
+  RULE_INDEX_SENDER,
+  N_RULE_INDEX_TABLES,
+  RULE_INDEX_NONE = N_RULE_INDEX_TABLES
+} RuleIndexKey;
+
+typedef struct RuleIndex RuleIndex;
+struct RuleIndex
+{
+  /* Maps non-NULL arg0 values, paths, member names or sender names
+   * (depending on the RuleIndexKey) to non-NULL (DBusList **)s, each
+   * rule's key being copied from the rule. Each table is only created
+   * when the first rule with that key is added, and freed again when it
+   * becomes empty.
+   */
+  DBusHashTable *tables[N_RULE_INDEX_TABLES];
+
+  /* List of BusMatchRules which specify none of the indexed keys */
+  DBusList *rules_unindexed;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
+  /* Maps non-NULL interface names to non-NULL (RuleIndex *)s */
   DBusHashTable *rules_by_iface;
 
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* BusMatchRules which don't specify an interface */
+  RuleIndex rules_without_iface;
 };
 
+/* Upper bound on the number of routing tuples whose recipients we
+ * remember; the whole cache is dropped when it fills up */
+#define RECIPIENT_CACHE_MAX_ENTRIES 1024
+
+typedef struct
+{
+  DBusList *recipients; /* DBusConnection *, not referenced */
+#ifdef DBUS_ENABLE_STATS
+  /* BusMatchRule *, not referenced: the rules the search evaluated and
+   * the ones that matched, so that a hit is accounted like a search */
+  DBusList *evaluated;
+  DBusList *matched;
+#endif
+} RecipientCacheEntry;
+
 struct BusMatchmaker
 {
   int refcount;
 
+  /* Scratch copy of the arg0 of the message being routed */
+  DBusString arg0_prefix;
+
+  /* Recipients of broadcasts, keyed by a string made up of the message
+   * type, interface, member, path and sender. This is only used for
+   * messages whose candidate rules don't look at the body, and is
+   * emptied whenever a rule is added or removed, or the owner of any
+   * name changes (owners_serial is the registry's serial when it was
+   * last emptied). Created on first use. */
+  DBusHashTable *recipient_cache;
+  dbus_uint64_t owners_serial;
+  DBusString cache_key;
+
   /* Pools of rules, grouped by the type of message they match. 0
    * (DBUS_MESSAGE_TYPE_INVALID) represents rules that do not specify a message
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Rules whose sender or destination is a unique name, keyed by that
+   * name (an atom owned by the rules), so that they can be dropped when
+   * the name's owner disconnects without scanning every rule. Values
+   * are DBusList ** of BusMatchRule *, not referenced. Created on
+   * first use. */
+  DBusHashTable *rules_by_unique_name;
 };
 
+static RuleIndexKey
+rule_index_key_for_rule (BusMatchRule  *rule,
+                         const char   **key_p)
+{
+  unsigned int arg0_flags = 0;
+  unsigned int arg0_len = 0;
+
+  if ((rule->flags & BUS_MATCH_ARGS) && rule->args[0] != NULL)
+    {
+      arg0_flags = rule->arg_lens[0] & BUS_MATCH_ARG_FLAGS;
+      arg0_len = rule->arg_lens[0] & ~BUS_MATCH_ARG_FLAGS;
+
+      if (arg0_flags == 0)
+        {
+          *key_p = rule->args[0];
+          return RULE_INDEX_ARG0;
+        }
+
+      if (arg0_flags == BUS_MATCH_ARG_NAMESPACE)
+        {
+          *key_p = rule->args[0];
+          return RULE_INDEX_ARG0_NAMESPACE;
+        }
+    }
+
+  if (rule->flags & BUS_MATCH_PATH)
+    {
+      *key_p = rule->path;
+      return RULE_INDEX_PATH;
+    }
+
+  /* An empty arg0path has no prefixes, so leave it to the linear search */
+  if (arg0_flags == BUS_MATCH_ARG_IS_PATH && arg0_len > 0)
+    {
+      *key_p = rule->args[0];
+      return RULE_INDEX_ARG0_PATH;
+    }
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    {
+      *key_p = rule->member;
+      return RULE_INDEX_MEMBER;
+    }
+
+  if (rule->flags & BUS_MATCH_SENDER)
+    {
+      *key_p = rule->sender;
+      return RULE_INDEX_SENDER;
+    }
+
+  *key_p = NULL;
+  return RULE_INDEX_NONE;
+}
+
 #ifdef DBUS_ENABLE_STATS
-dbus_bool_t
-bus_match_rule_dump (BusMatchmaker *matchmaker,
-                     DBusConnection *conn_filter,
-                     DBusMessageIter *arr_iter)
+typedef dbus_bool_t (* RuleForeachFunction) (BusMatchRule *rule,
+                                             void         *data);
+
+static dbus_bool_t
+rule_list_foreach (DBusList            **list,
+                   RuleForeachFunction   function,
+                   void                 *data)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (list);
+       link != NULL;
+       link = _dbus_list_get_next_link (list, link))
+    {
+      if (!(* function) (link->data, data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+rule_index_foreach (RuleIndex           *index,
+                    RuleForeachFunction  function,
+                    void                *data)
+{
+  int k;
+
+  for (k = 0; k < N_RULE_INDEX_TABLES; k++)
+    {
+      DBusHashIter iter;
+
+      if (index->tables[k] == NULL)
+        continue;
+
+      _dbus_hash_iter_init (index->tables[k], &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusList **list = _dbus_hash_iter_get_value (&iter);
+
+          if (!rule_list_foreach (list, function, data))
+            return FALSE;
+        }
+    }
+
+  return rule_list_foreach (&index->rules_unindexed, function, data);
+}
+
+/* Calls @function on every rule, until it returns FALSE */
+static dbus_bool_t
+bus_matchmaker_foreach_rule (BusMatchmaker       *matchmaker,
+                             RuleForeachFunction  function,
+                             void                *data)
 {
   int i;
 
   for (i = 0 ; i < DBUS_NUM_MESSAGE_TYPES ; i++)
     {
       DBusHashIter iter;
-      DBusList **list;
-      DBusList *link;
 
       _dbus_hash_iter_init (matchmaker->rules_by_type[i].rules_by_iface, &iter);
       while (_dbus_hash_iter_next (&iter))
         {
-          list =  _dbus_hash_iter_get_value (&iter);
-          for (link = _dbus_list_get_first_link (list);
-               link != NULL;
-               link = _dbus_list_get_next_link (list, link))
-            {
-              BusMatchRule *rule = link->data;
+          RuleIndex *index = _dbus_hash_iter_get_value (&iter);
 
-              if (rule->matches_go_to == conn_filter)
-                {
-                  char *s = match_rule_to_string (rule);
+          if (!rule_index_foreach (index, function, data))
+            return FALSE;
+        }
 
-                  if (s == NULL)
-                    return FALSE;
+      if (!rule_index_foreach (&matchmaker->rules_by_type[i].rules_without_iface,
+                               function, data))
+        return FALSE;
+    }
 
-                  if (!dbus_message_iter_append_basic (arr_iter, DBUS_TYPE_STRING, &s))
-                    {
-                      dbus_free (s);
-                      return FALSE;
-                    }
-                  dbus_free (s);
-                }
-            }
-        }
-      list = &matchmaker->rules_by_type[i].rules_without_iface;
-      for (link = _dbus_list_get_first_link (list);
-           link != NULL;
-           link = _dbus_list_get_next_link (list, link))
-        {
-          BusMatchRule *rule = link->data;
+  return TRUE;
+}
 
-          if (rule->matches_go_to == conn_filter)
-            {
-              char *s = match_rule_to_string (rule);
+typedef struct
+{
+  DBusConnection *conn_filter;
+  DBusMessageIter *arr_iter;
+  dbus_bool_t with_stats;
+} RuleDumpData;
 
-              if (s == NULL)
-                return FALSE;
+static dbus_bool_t
+rule_dump (BusMatchRule *rule,
+           void         *data)
+{
+  RuleDumpData *d = data;
+  DBusMessageIter struct_iter;
+  char *s;
 
-              if (!dbus_message_iter_append_basic (arr_iter, DBUS_TYPE_STRING, &s))
-                {
-                  dbus_free (s);
-                  return FALSE;
-                }
-              dbus_free (s);
-            }
-        }
+  if (rule->matches_go_to != d->conn_filter)
+    return TRUE;
+
+  s = bus_match_rule_to_string (rule);
+
+  if (s == NULL)
+    return FALSE;
+
+  if (!d->with_stats)
+    {
+      if (!dbus_message_iter_append_basic (d->arr_iter, DBUS_TYPE_STRING, &s))
+        goto failed;
+
+      dbus_free (s);
+      return TRUE;
+    }
+
+  if (!dbus_message_iter_open_container (d->arr_iter, DBUS_TYPE_STRUCT, NULL,
+                                         &struct_iter))
+    goto failed;
+
+  if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &s) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &rule->n_evaluated) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &rule->n_matched))
+    {
+      dbus_message_iter_abandon_container (d->arr_iter, &struct_iter);
+      goto failed;
+    }
+
+  if (!dbus_message_iter_close_container (d->arr_iter, &struct_iter))
+    goto failed;
+
+  dbus_free (s);
+  return TRUE;
+
+failed:
+  dbus_free (s);
+  return FALSE;
+}
+
+/**
+ * Appends the rules of one connection to an array, as strings, or with
+ * @with_stats as (rule, evaluations, matches) structs.
+ */
+dbus_bool_t
+bus_match_rule_dump (BusMatchmaker   *matchmaker,
+                     DBusConnection  *conn_filter,
+                     dbus_bool_t      with_stats,
+                     DBusMessageIter *arr_iter)
+{
+  RuleDumpData d;
+
+  d.conn_filter = conn_filter;
+  d.arr_iter = arr_iter;
+  d.with_stats = with_stats;
+
+  return bus_matchmaker_foreach_rule (matchmaker, rule_dump, &d);
+}
+
+typedef struct
+{
+  DBusConnection *conn_filter;
+  dbus_uint64_t evaluated;
+  dbus_uint64_t matched;
+} RuleStatsData;
+
+static dbus_bool_t
+rule_add_stats (BusMatchRule *rule,
+                void         *data)
+{
+  RuleStatsData *d = data;
+
+  if (d->conn_filter == NULL || rule->matches_go_to == d->conn_filter)
+    {
+      d->evaluated += rule->n_evaluated;
+      d->matched += rule->n_matched;
     }
 
   return TRUE;
 }
+
+/**
+ * Adds up how often the current rules of a connection, or of every
+ * connection, were evaluated against a message and how often they
+ * matched one.
+ */
+void
+bus_matchmaker_get_rule_stats (BusMatchmaker  *matchmaker,
+                               DBusConnection *conn_filter,
+                               dbus_uint64_t  *evaluated_p,
+                               dbus_uint64_t  *matched_p)
+{
+  RuleStatsData d;
+
+  d.conn_filter = conn_filter;
+  d.evaluated = 0;
+  d.matched = 0;
+
+  bus_matchmaker_foreach_rule (matchmaker, rule_add_stats, &d);
+
+  *evaluated_p = d.evaluated;
+  *matched_p = d.matched;
+}
 #endif
 
 static void
@@ -1260,6 +1604,10 @@ rule_list_free (DBusList **rules)
       BusMatchRule *rule;
 
       rule = (*rules)->data;
+      rule->matchmaker = NULL;
+      rule->link = NULL;
+      rule->sender_link = NULL;
+      rule->destination_link = NULL;
       bus_match_rule_unref (rule);
       _dbus_list_remove_link (rules, *rules);
     }
@@ -1278,116 +1626,303 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
-BusMatchmaker*
-bus_matchmaker_new (void)
+static void
+rule_index_clear (RuleIndex *index)
 {
-  BusMatchmaker *matchmaker;
-  int i;
+  int k;
 
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
-  if (matchmaker == NULL)
-    return NULL;
-
-  matchmaker->refcount = 1;
-
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  for (k = 0; k < N_RULE_INDEX_TABLES; k++)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      if (index->tables[k] != NULL)
+        {
+          _dbus_hash_table_unref (index->tables[k]);
+          index->tables[k] = NULL;
+        }
+    }
 
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+  rule_list_free (&index->rules_unindexed);
+}
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+static void
+rule_index_ptr_free (RuleIndex *index)
+{
+  /* As for rule_list_ptr_free() */
+  if (index != NULL)
+    {
+      rule_index_clear (index);
+      dbus_free (index);
     }
+}
 
-  return matchmaker;
+static dbus_bool_t
+rule_index_is_empty (RuleIndex *index)
+{
+  int k;
 
- nomem:
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  for (k = 0; k < N_RULE_INDEX_TABLES; k++)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
-
-      if (p->rules_by_iface == NULL)
-        break;
-      else
-        _dbus_hash_table_unref (p->rules_by_iface);
+      if (index->tables[k] != NULL)
+        return FALSE;
     }
-  dbus_free (matchmaker);
 
-  return NULL;
+  return index->rules_unindexed == NULL;
 }
 
 static DBusList **
-bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
-                          int            message_type,
-                          const char    *interface,
-                          dbus_bool_t    create)
+rule_index_lookup (RuleIndex    *index,
+                   RuleIndexKey  which,
+                   const char   *key)
 {
-  RulePool *p;
+  _dbus_assert (which < N_RULE_INDEX_TABLES);
 
-  _dbus_assert (message_type >= 0);
-  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+  if (index->tables[which] == NULL)
+    return NULL;
 
-  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
-                 message_type,
-                 interface != NULL ? interface : "<null>");
+  return _dbus_hash_table_lookup_string (index->tables[which], key);
+}
 
-  p = matchmaker->rules_by_type + message_type;
+static DBusList **
+rule_index_get_rules (RuleIndex    *index,
+                      BusMatchRule *rule,
+                      dbus_bool_t   create)
+{
+  DBusList **list;
+  RuleIndexKey which;
+  const char *key;
+  char *dupped_key;
 
-  if (interface == NULL)
-    {
-      return &p->rules_without_iface;
-    }
-  else
-    {
-      DBusList **list;
+  which = rule_index_key_for_rule (rule, &key);
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+  if (which == RULE_INDEX_NONE)
+    return &index->rules_unindexed;
 
-      if (list == NULL && create)
-        {
-          char *dupped_interface;
+  list = rule_index_lookup (index, which, key);
 
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
-            return NULL;
+  if (list != NULL || !create)
+    return list;
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
-            {
-              dbus_free (list);
-              return NULL;
-            }
+  if (index->tables[which] == NULL)
+    {
+      index->tables[which] = _dbus_hash_table_new (DBUS_HASH_STRING,
+          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
 
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
-                         interface);
+      if (index->tables[which] == NULL)
+        return NULL;
+    }
 
-          if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
-            {
-              dbus_free (list);
-              dbus_free (dupped_interface);
-              return NULL;
-            }
-        }
+  list = dbus_new0 (DBusList *, 1);
+  if (list == NULL)
+    goto failed;
+
+  dupped_key = _dbus_strdup (key);
+  if (dupped_key == NULL)
+    {
+      dbus_free (list);
+      goto failed;
+    }
+
+  if (!_dbus_hash_table_insert_string (index->tables[which], dupped_key, list))
+    {
+      dbus_free (list);
+      dbus_free (dupped_key);
+      goto failed;
+    }
 
-      return list;
+  return list;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (index->tables[which]) == 0)
+    {
+      _dbus_hash_table_unref (index->tables[which]);
+      index->tables[which] = NULL;
     }
+
+  return NULL;
 }
 
 static void
-bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
+rule_index_gc_rules (RuleIndex    *index,
+                     BusMatchRule *rule,
+                     DBusList    **rules)
+{
+  RuleIndexKey which;
+  const char *key;
+
+  if (*rules != NULL)
+    return;
+
+  which = rule_index_key_for_rule (rule, &key);
+
+  if (which == RULE_INDEX_NONE)
+    return;
+
+  _dbus_assert (rule_index_lookup (index, which, key) == rules);
+
+  _dbus_hash_table_remove_string (index->tables[which], key);
+
+  if (_dbus_hash_table_get_n_entries (index->tables[which]) == 0)
+    {
+      _dbus_hash_table_unref (index->tables[which]);
+      index->tables[which] = NULL;
+    }
+}
+
+BusMatchmaker*
+bus_matchmaker_new (void)
+{
+  BusMatchmaker *matchmaker;
+  int i;
+
+  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  if (matchmaker == NULL)
+    return NULL;
+
+  matchmaker->refcount = 1;
+
+  if (!_dbus_string_init (&matchmaker->arg0_prefix))
+    {
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&matchmaker->cache_key))
+    {
+      _dbus_string_free (&matchmaker->arg0_prefix);
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
+          dbus_free, (DBusFreeFunction) rule_index_ptr_free);
+
+      if (p->rules_by_iface == NULL)
+        goto nomem;
+    }
+
+  return matchmaker;
+
+ nomem:
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      if (p->rules_by_iface == NULL)
+        break;
+      else
+        _dbus_hash_table_unref (p->rules_by_iface);
+    }
+  _dbus_string_free (&matchmaker->cache_key);
+  _dbus_string_free (&matchmaker->arg0_prefix);
+  dbus_free (matchmaker);
+
+  return NULL;
+}
+
+static void
+recipient_cache_entry_free (RecipientCacheEntry *entry)
+{
+  if (entry == NULL)
+    return;
+
+  _dbus_list_clear (&entry->recipients);
+#ifdef DBUS_ENABLE_STATS
+  _dbus_list_clear (&entry->evaluated);
+  _dbus_list_clear (&entry->matched);
+#endif
+  dbus_free (entry);
+}
+
+/* Forget all cached recipients, because the answer might have changed */
+static void
+bus_matchmaker_invalidate_cache (BusMatchmaker *matchmaker)
+{
+  if (matchmaker->recipient_cache != NULL)
+    _dbus_hash_table_remove_all (matchmaker->recipient_cache);
+}
+
+/* Free the recipient cache and any slack in the scratch strings; used when
+ * the bus is short of memory. The cache is recreated on demand. */
+void
+bus_matchmaker_compact (BusMatchmaker *matchmaker)
+{
+  if (matchmaker->recipient_cache != NULL)
+    {
+      _dbus_hash_table_unref (matchmaker->recipient_cache);
+      matchmaker->recipient_cache = NULL;
+    }
+
+  _dbus_string_set_length (&matchmaker->cache_key, 0);
+  _dbus_string_compact (&matchmaker->cache_key, 0);
+}
+
+static RuleIndex *
+bus_matchmaker_get_index (BusMatchmaker *matchmaker,
+                          int            message_type,
+                          const char    *interface,
+                          dbus_bool_t    create)
+{
+  RulePool *p;
+  RuleIndex *index;
+  char *dupped_interface;
+
+  _dbus_assert (message_type >= 0);
+  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+
+  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
+                 message_type,
+                 interface != NULL ? interface : "<null>");
+
+  p = matchmaker->rules_by_type + message_type;
+
+  if (interface == NULL)
+    return &p->rules_without_iface;
+
+  index = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+
+  if (index != NULL || !create)
+    return index;
+
+  index = dbus_new0 (RuleIndex, 1);
+  if (index == NULL)
+    return NULL;
+
+  dupped_interface = _dbus_strdup (interface);
+  if (dupped_interface == NULL)
+    {
+      dbus_free (index);
+      return NULL;
+    }
+
+  _dbus_verbose ("Adding index for type %d, iface %s\n", message_type,
+                 interface);
+
+  if (!_dbus_hash_table_insert_string (p->rules_by_iface,
+                                       dupped_interface, index))
+    {
+      dbus_free (index);
+      dbus_free (dupped_interface);
+      return NULL;
+    }
+
+  return index;
+}
+
+static void
+bus_matchmaker_gc_index (BusMatchmaker *matchmaker,
                          int            message_type,
                          const char    *interface,
-                         DBusList     **rules)
+                         RuleIndex     *index)
 {
   RulePool *p;
 
   if (interface == NULL)
     return;
 
-  if (*rules != NULL)
+  if (!rule_index_is_empty (index))
     return;
 
   _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
@@ -1396,11 +1931,58 @@ bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
   p = matchmaker->rules_by_type + message_type;
 
   _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
-      == rules);
+      == index);
 
   _dbus_hash_table_remove_string (p->rules_by_iface, interface);
 }
 
+/* Returns the list that @rule belongs in, or NULL if there is none
+ * (or on OOM, if @create is TRUE). The rule need not be in the list yet. */
+static DBusList **
+bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule,
+                          dbus_bool_t    create)
+{
+  RuleIndex *index;
+  DBusList **rules;
+
+  index = bus_matchmaker_get_index (matchmaker, rule->message_type,
+                                    rule->interface, create);
+
+  if (index == NULL)
+    return NULL;
+
+  rules = rule_index_get_rules (index, rule, create);
+
+  if (rules == NULL && create)
+    bus_matchmaker_gc_index (matchmaker, rule->message_type,
+                             rule->interface, index);
+
+  return rules;
+}
+
+/* Call this after removing a rule from the list returned by
+ * bus_matchmaker_get_rules(), to free the list and its containing
+ * index if they are now empty. */
+static void
+bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
+                         BusMatchRule  *rule,
+                         DBusList     **rules)
+{
+  RuleIndex *index;
+
+  if (*rules != NULL)
+    return;
+
+  index = bus_matchmaker_get_index (matchmaker, rule->message_type,
+                                    rule->interface, FALSE);
+  _dbus_assert (index != NULL);
+
+  rule_index_gc_rules (index, rule, rules);
+  bus_matchmaker_gc_index (matchmaker, rule->message_type, rule->interface,
+                           index);
+}
+
 BusMatchmaker *
 bus_matchmaker_ref (BusMatchmaker *matchmaker)
 {
@@ -1426,48 +2008,188 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           RulePool *p = matchmaker->rules_by_type + i;
 
           _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
+          rule_index_clear (&p->rules_without_iface);
         }
 
+      if (matchmaker->recipient_cache != NULL)
+        _dbus_hash_table_unref (matchmaker->recipient_cache);
+
+      if (matchmaker->rules_by_unique_name != NULL)
+        _dbus_hash_table_unref (matchmaker->rules_by_unique_name);
+
+      _dbus_string_free (&matchmaker->cache_key);
+      _dbus_string_free (&matchmaker->arg0_prefix);
       dbus_free (matchmaker);
     }
 }
 
+static void
+unique_name_rules_free (DBusList **list)
+{
+  /* See rule_list_ptr_free() */
+  if (list != NULL)
+    {
+      _dbus_list_clear (list);
+      dbus_free (list);
+    }
+}
+
+static dbus_bool_t
+bus_matchmaker_link_unique_name (BusMatchmaker  *matchmaker,
+                                 BusMatchRule   *rule,
+                                 const char     *name,
+                                 DBusList      **link_p)
+{
+  DBusList **list;
+
+  _dbus_assert (*link_p == NULL);
+
+  if (matchmaker->rules_by_unique_name == NULL)
+    {
+      matchmaker->rules_by_unique_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+          NULL, (DBusFreeFunction) unique_name_rules_free);
+
+      if (matchmaker->rules_by_unique_name == NULL)
+        return FALSE;
+    }
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                         name);
+
+  if (list == NULL)
+    {
+      list = dbus_new0 (DBusList *, 1);
+
+      if (list == NULL)
+        return FALSE;
+
+      /* The key is an atom, kept alive by the rules in the list */
+      if (!_dbus_hash_table_insert_string (matchmaker->rules_by_unique_name,
+                                           (char *) name, list))
+        {
+          dbus_free (list);
+          return FALSE;
+        }
+    }
+
+  *link_p = _dbus_list_alloc_link (rule);
+
+  if (*link_p == NULL)
+    {
+      if (*list == NULL)
+        _dbus_hash_table_remove_string (matchmaker->rules_by_unique_name,
+                                        name);
+      return FALSE;
+    }
+
+  _dbus_list_append_link (list, *link_p);
+  return TRUE;
+}
+
+static void
+bus_matchmaker_unlink_unique_name (BusMatchmaker  *matchmaker,
+                                   const char     *name,
+                                   DBusList      **link_p)
+{
+  DBusList **list;
+
+  if (*link_p == NULL)
+    return;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                         name);
+  _dbus_assert (list != NULL);
+
+  _dbus_list_remove_link (list, *link_p);
+  *link_p = NULL;
+
+  if (*list == NULL)
+    _dbus_hash_table_remove_string (matchmaker->rules_by_unique_name, name);
+}
+
+static void
+bus_matchmaker_unlink_unique_names (BusMatchmaker *matchmaker,
+                                    BusMatchRule  *rule)
+{
+  bus_matchmaker_unlink_unique_name (matchmaker, rule->sender,
+                                     &rule->sender_link);
+  bus_matchmaker_unlink_unique_name (matchmaker, rule->destination,
+                                     &rule->destination_link);
+}
+
+static dbus_bool_t
+bus_matchmaker_link_unique_names (BusMatchmaker *matchmaker,
+                                  BusMatchRule  *rule)
+{
+  if ((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':' &&
+      !bus_matchmaker_link_unique_name (matchmaker, rule, rule->sender,
+                                        &rule->sender_link))
+    return FALSE;
+
+  if ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':' &&
+      !bus_matchmaker_link_unique_name (matchmaker, rule, rule->destination,
+                                        &rule->destination_link))
+    {
+      bus_matchmaker_unlink_unique_names (matchmaker, rule);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /* The rule can't be modified after it's added. */
 dbus_bool_t
 bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                          BusMatchRule    *rule)
 {
   DBusList **rules;
+  DBusList *link;
 
   _dbus_assert (bus_connection_is_active (rule->matches_go_to));
+  _dbus_assert (rule->matchmaker == NULL);
 
   _dbus_verbose ("Adding rule with message_type %d, interface %s\n",
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
+  link = _dbus_list_alloc_link (rule);
 
-  if (rules == NULL)
+  if (link == NULL)
     return FALSE;
 
-  if (!_dbus_list_append (rules, rule))
-    return FALSE;
+  rules = bus_matchmaker_get_rules (matchmaker, rule, TRUE);
+
+  if (rules == NULL)
+    {
+      _dbus_list_free_link (link);
+      return FALSE;
+    }
+
+  if (!bus_matchmaker_link_unique_names (matchmaker, rule))
+    {
+      _dbus_list_free_link (link);
+      bus_matchmaker_gc_rules (matchmaker, rule, rules);
+      return FALSE;
+    }
 
   if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
     {
-      _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
+      bus_matchmaker_unlink_unique_names (matchmaker, rule);
+      _dbus_list_free_link (link);
+      bus_matchmaker_gc_rules (matchmaker, rule, rules);
       return FALSE;
     }
 
+  _dbus_list_append_link (rules, link);
+  rule->link = link;
+  rule->matchmaker = matchmaker;
+
   bus_match_rule_ref (rule);
+  bus_matchmaker_invalidate_cache (matchmaker);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
-    char *s = match_rule_to_string (rule);
+    char *s = bus_match_rule_to_string (rule);
 
     _dbus_verbose ("Added match rule %s to connection %p\n",
                    s ? s : "nomem", rule->matches_go_to);
@@ -1493,23 +2215,23 @@ match_rule_equal (BusMatchRule *a,
     return FALSE;
 
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+      a->path != b->path)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   /* we already compared the value of flags, and
@@ -1549,18 +2271,30 @@ match_rule_equal (BusMatchRule *a,
   return TRUE;
 }
 
+/* Remove a rule from the matchmaker and from its connection's list.
+ * The caller must invalidate the recipient cache. */
 static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
-                                 DBusList        *link)
+bus_matchmaker_unlink_rule (BusMatchmaker *matchmaker,
+                            BusMatchRule  *rule)
 {
-  BusMatchRule *rule = link->data;
-  
+  DBusList **rules;
+
+  _dbus_assert (rule->matchmaker == matchmaker);
+  _dbus_assert (rule->link != NULL);
+
+  rules = bus_matchmaker_get_rules (matchmaker, rule, FALSE);
+  _dbus_assert (rules != NULL);
+
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
+  bus_matchmaker_unlink_unique_names (matchmaker, rule);
+  _dbus_list_remove_link (rules, rule->link);
+  rule->link = NULL;
+  rule->matchmaker = NULL;
+  bus_matchmaker_gc_rules (matchmaker, rule, rules);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
-    char *s = match_rule_to_string (rule);
+    char *s = bus_match_rule_to_string (rule);
 
     _dbus_verbose ("Removed match rule %s for connection %p\n",
                    s ? s : "nomem", rule->matches_go_to);
@@ -1568,44 +2302,22 @@ bus_matchmaker_remove_rule_link (DBusList       **rules,
   }
 #endif
   
-  bus_match_rule_unref (rule);  
+  bus_match_rule_unref (rule);
 }
 
 void
 bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                             BusMatchRule    *rule)
 {
-  DBusList **rules;
-
   _dbus_verbose ("Removing rule with message_type %d, interface %s\n",
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
-
   /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
+   * added, so it should still be in this matchmaker.
    */
-  _dbus_assert (rules != NULL);
-
-  _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
-
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
-
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s ? s : "nomem", rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  bus_match_rule_unref (rule);
+  bus_matchmaker_unlink_rule (matchmaker, rule);
+  bus_matchmaker_invalidate_cache (matchmaker);
 }
 
 /* Remove a single rule which is equal to the given rule by value */
@@ -1621,8 +2333,7 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                  value->message_type,
                  value->interface != NULL ? value->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
+  rules = bus_matchmaker_get_rules (matchmaker, value, FALSE);
 
   if (rules != NULL)
     {
@@ -1633,18 +2344,16 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
       while (link != NULL)
         {
           BusMatchRule *rule;
-          DBusList *prev;
 
           rule = link->data;
-          prev = _dbus_list_get_prev_link (rules, link);
 
           if (match_rule_equal (rule, value))
             {
-              bus_matchmaker_remove_rule_link (rules, link);
+              bus_matchmaker_unlink_rule (matchmaker, rule);
               break;
             }
 
-          link = prev;
+          link = _dbus_list_get_prev_link (rules, link);
         }
     }
 
@@ -1655,91 +2364,65 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
+  bus_matchmaker_invalidate_cache (matchmaker);
 
   return TRUE;
 }
 
-static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
+void
+bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
+                             DBusConnection  *connection)
 {
+  DBusList **own_rules;
   DBusList *link;
+  const char *name;
 
-  link = _dbus_list_get_first_link (rules);
-  while (link != NULL)
-    {
-      BusMatchRule *rule;
-      DBusList *next;
+  _dbus_assert (bus_connection_is_active (connection));
 
-      rule = link->data;
-      next = _dbus_list_get_next_link (rules, link);
+  _dbus_verbose ("Removing all rules for connection %p\n", connection);
 
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
-        {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
+  /* Cached recipient lists might include the connection, or depend on
+   * rules that refer to it */
+  bus_matchmaker_invalidate_cache (matchmaker);
 
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
+  /* The connection's own rules. It can have rules in both the bus's
+   * matchmaker and the monitors' one while becoming a monitor, so skip
+   * the others. Walk backwards so that removing each rule from the
+   * connection's list finds it straight away. */
+  own_rules = bus_connection_get_match_rules (connection);
+  link = _dbus_list_get_last_link (own_rules);
+  while (link != NULL)
+    {
+      BusMatchRule *rule = link->data;
+      DBusList *prev = _dbus_list_get_prev_link (own_rules, link);
 
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
-        }
+      if (rule->matchmaker == matchmaker)
+        bus_matchmaker_unlink_rule (matchmaker, rule);
 
-      link = next;
+      link = prev;
     }
-}
-
-void
-bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
-                             DBusConnection  *connection)
-{
-  int i;
 
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
-   */
-
-  _dbus_assert (bus_connection_is_active (connection));
+  /* Rules from other connections that match to/from this connection's
+   * unique name, which will never be recycled */
+  if (matchmaker->rules_by_unique_name == NULL)
+    return;
 
-  _dbus_verbose ("Removing all rules for connection %p\n", connection);
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL); /* because we're an active connection */
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  while (TRUE)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
-
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
+      DBusList **list;
 
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
-        {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+      list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                             name);
 
-          rule_list_remove_by_connection (items, connection);
+      /* Unlinking the rule removes it from this list, and the list
+       * from the table when it was the last one */
+      if (list == NULL)
+        break;
 
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
-        }
+      bus_matchmaker_unlink_rule (matchmaker, (*list)->data);
     }
 }
 
@@ -1775,11 +2458,124 @@ str_has_prefix (const char *str, const char *prefix)
     return FALSE;
 }
 
+/* An argument of the message being matched */
+typedef struct
+{
+  int type;             /* DBUS_TYPE_INVALID past the end of the body */
+  const char *value;    /* NULL unless a string or object path */
+  int len;
+} MatchArg;
+
+/* The parts of a message that match rules look at, extracted once per
+ * message instead of once per rule that is tested against it */
+typedef struct
+{
+  DBusMessage *message;
+  DBusConnection *sender;   /* NULL for the bus driver */
+  const char *sender_name;  /* unique name of sender, or NULL */
+  int type;
+  /* Atoms, so that rules can compare them by address; NULL if the
+   * message has none, or if no rule could ever match it */
+  const char *interface;
+  const char *member;
+  const char *path;
+  const char *destination;
+
+  /* Arguments are only extracted when a rule first needs them, so
+   * n_args is the number extracted so far and iter points just past
+   * the last of those. Arguments that the message's body index can
+   * find directly are extracted on their own, and noted in
+   * args_from_index instead. */
+  DBusMessageIter iter;
+  int n_args;
+  dbus_uint64_t args_from_index;
+  MatchArg args[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+
+  /* Writable copy of arg0, for looking up its prefixes in place */
+  DBusString *arg0_prefix;
+} MatchSnapshot;
+
+static void
+match_snapshot_init (MatchSnapshot  *snapshot,
+                     DBusConnection *sender,
+                     DBusMessage    *message,
+                     DBusString     *arg0_prefix)
+{
+  snapshot->message = message;
+  snapshot->sender = sender;
+  snapshot->sender_name = NULL;
+  snapshot->type = dbus_message_get_type (message);
+  snapshot->interface = bus_intern_lookup (dbus_message_get_interface (message));
+  snapshot->member = bus_intern_lookup (dbus_message_get_member (message));
+  snapshot->path = dbus_message_get_path (message);
+  snapshot->destination = dbus_message_get_destination (message);
+  snapshot->n_args = 0;
+  snapshot->args_from_index = 0;
+  snapshot->arg0_prefix = arg0_prefix;
+
+  if (sender != NULL)
+    snapshot->sender_name = bus_connection_get_name (sender);
+
+  dbus_message_iter_init (message, &snapshot->iter);
+}
+
+static void
+match_arg_extract (MatchArg        *arg,
+                   DBusMessageIter *iter)
+{
+  arg->type = dbus_message_iter_get_arg_type (iter);
+  arg->value = NULL;
+  arg->len = 0;
+
+  if (arg->type == DBUS_TYPE_STRING || arg->type == DBUS_TYPE_OBJECT_PATH)
+    {
+      dbus_message_iter_get_basic (iter, &arg->value);
+      _dbus_assert (arg->value != NULL);
+      arg->len = strlen (arg->value);
+    }
+}
+
+static const MatchArg *
+match_snapshot_get_arg (MatchSnapshot *snapshot,
+                        int            i)
+{
+  dbus_uint64_t bit;
+  DBusMessageIter iter;
+
+  _dbus_assert (i >= 0);
+  _dbus_assert (i <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER);
+
+  bit = ((dbus_uint64_t) 1) << i;
+
+  if (i < snapshot->n_args || (snapshot->args_from_index & bit) != 0)
+    return &snapshot->args[i];
+
+  if (_dbus_message_iter_init_at_arg (snapshot->message, i, &iter))
+    {
+      match_arg_extract (&snapshot->args[i], &iter);
+      snapshot->args_from_index |= bit;
+      return &snapshot->args[i];
+    }
+
+  while (snapshot->n_args <= i)
+    {
+      MatchArg *arg = &snapshot->args[snapshot->n_args];
+
+      match_arg_extract (arg, &snapshot->iter);
+
+      if (arg->type != DBUS_TYPE_INVALID)
+        dbus_message_iter_next (&snapshot->iter);
+
+      snapshot->n_args += 1;
+    }
+
+  return &snapshot->args[i];
+}
+
 static dbus_bool_t
 match_rule_matches (BusMatchRule    *rule,
-                    DBusConnection  *sender,
                     DBusConnection  *addressed_recipient,
-                    DBusMessage     *message,
+                    MatchSnapshot   *snapshot,
                     BusMatchFlags    already_matched)
 {
   dbus_bool_t wants_to_eavesdrop = FALSE;
@@ -1804,35 +2600,23 @@ match_rule_matches (BusMatchRule    *rule,
     {
       _dbus_assert (rule->message_type != DBUS_MESSAGE_TYPE_INVALID);
 
-      if (rule->message_type != dbus_message_get_type (message))
+      if (rule->message_type != snapshot->type)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
-        return FALSE;
-
-      if (strcmp (iface, rule->interface) != 0)
+      if (snapshot->interface != rule->interface)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
-        return FALSE;
-
-      if (strcmp (member, rule->member) != 0)
+      if (snapshot->member != rule->member)
         return FALSE;
     }
 
@@ -1840,15 +2624,18 @@ match_rule_matches (BusMatchRule    *rule,
     {
       _dbus_assert (rule->sender != NULL);
 
-      if (sender == NULL)
+      if (snapshot->sender == NULL)
         {
           if (strcmp (rule->sender,
                       DBUS_SERVICE_DBUS) != 0)
             return FALSE;
         }
-      else
+      else if (snapshot->sender_name == NULL ||
+               strcmp (rule->sender, snapshot->sender_name) != 0)
         {
-          if (!connection_is_primary_owner (sender, rule->sender))
+          /* A connection is always the primary owner of its unique name,
+           * so we only need the registry for other names */
+          if (!connection_is_primary_owner (snapshot->sender, rule->sender))
             return FALSE;
         }
     }
@@ -1877,7 +2664,7 @@ match_rule_matches (BusMatchRule    *rule,
 
       _dbus_assert (rule->destination != NULL);
 
-      destination = dbus_message_get_destination (message);
+      destination = snapshot->destination;
       if (destination == NULL)
         /* broadcast, but this rule specified a destination: no match */
         return FALSE;
@@ -1912,7 +2699,7 @@ match_rule_matches (BusMatchRule    *rule,
 
         _dbus_assert (rule->destination == NULL);
 
-        msg_is_broadcast = (dbus_message_get_destination (message) == NULL);
+        msg_is_broadcast = (snapshot->destination == NULL);
 
         if (!wants_to_eavesdrop && !msg_is_broadcast)
           return FALSE;
@@ -1928,7 +2715,7 @@ match_rule_matches (BusMatchRule    *rule,
 
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
+      path = snapshot->path;
       if (path == NULL)
         return FALSE;
 
@@ -1943,7 +2730,7 @@ match_rule_matches (BusMatchRule    *rule,
 
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
+      path = snapshot->path;
       if (path == NULL)
         return FALSE;
 
@@ -1967,113 +2754,301 @@ match_rule_matches (BusMatchRule    *rule,
   if (flags & BUS_MATCH_ARGS)
     {
       int i;
-      DBusMessageIter iter;
-      
+
       _dbus_assert (rule->args != NULL);
 
-      dbus_message_iter_init (message, &iter);
-      
-      i = 0;
-      while (i < rule->args_len)
+      for (i = 0; i < rule->args_len; i++)
         {
-          int current_type;
+          const MatchArg *actual;
           const char *expected_arg;
+          const char *actual_arg;
           int expected_length;
+          int actual_length;
           dbus_bool_t is_path, is_namespace;
 
-          expected_arg = rule->args[i];
-          expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
-          is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
-          is_namespace = (rule->arg_lens[i] & BUS_MATCH_ARG_NAMESPACE) != 0;
-          
-          current_type = dbus_message_iter_get_arg_type (&iter);
+          expected_arg = rule->args[i];
+
+          if (expected_arg == NULL)
+            continue;
+
+          expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
+          is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
+          is_namespace = (rule->arg_lens[i] & BUS_MATCH_ARG_NAMESPACE) != 0;
+
+          actual = match_snapshot_get_arg (snapshot, i);
+
+          if (actual->type != DBUS_TYPE_STRING &&
+              (!is_path || actual->type != DBUS_TYPE_OBJECT_PATH))
+            return FALSE;
+
+          actual_arg = actual->value;
+          actual_length = actual->len;
+
+          if (is_path)
+            {
+              if (actual_length < expected_length &&
+                  actual_arg[actual_length - 1] != '/')
+                return FALSE;
+
+              if (expected_length < actual_length &&
+                  expected_arg[expected_length - 1] != '/')
+                return FALSE;
+
+              if (memcmp (actual_arg, expected_arg,
+                          MIN (actual_length, expected_length)) != 0)
+                return FALSE;
+            }
+          else if (is_namespace)
+            {
+              if (expected_length > actual_length)
+                return FALSE;
+
+              /* If the actual argument doesn't start with the expected
+               * namespace, then we don't match.
+               */
+              if (memcmp (expected_arg, actual_arg, expected_length) != 0)
+                return FALSE;
+
+              if (expected_length < actual_length)
+                {
+                  /* Check that the actual argument is within the expected
+                   * namespace, rather than just starting with that string,
+                   * by checking that the matched prefix ends in a '.'.
+                   *
+                   * This doesn't stop "foo.bar." matching "foo.bar..baz"
+                   * which is an invalid namespace, but at some point the
+                   * daemon can't cover up for broken services.
+                   */
+                  if (actual_arg[expected_length] != '.')
+                    return FALSE;
+                }
+              /* otherwise we had an exact match. */
+            }
+          else
+            {
+              if (expected_length != actual_length ||
+                  memcmp (expected_arg, actual_arg, expected_length) != 0)
+                return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+/* Called for each list of rules that might match a message, with the
+ * match flags that are known to be satisfied by every rule in it */
+typedef dbus_bool_t (* RuleListForeachFunction) (DBusList      **rules,
+                                                 BusMatchFlags   already_matched,
+                                                 void           *data);
+
+static dbus_bool_t
+rule_index_foreach_key (RuleIndex               *index,
+                        RuleIndexKey             which,
+                        const char              *key,
+                        BusMatchFlags            already_matched,
+                        RuleListForeachFunction  function,
+                        void                    *data)
+{
+  DBusList **rules;
+
+  rules = rule_index_lookup (index, which, key);
+
+  if (rules == NULL)
+    return TRUE;
+
+  return (* function) (rules, already_matched, data);
+}
+
+/* Visit the rules whose arg0namespace or arg0path value is a prefix of
+ * @arg0 ending at a component boundary, or @arg0 itself. */
+static dbus_bool_t
+rule_index_foreach_arg0_prefix (RuleIndex               *index,
+                                RuleIndexKey             which,
+                                const char              *arg0,
+                                DBusString              *arg0_prefix,
+                                BusMatchFlags            already_matched,
+                                RuleListForeachFunction  function,
+                                void                    *data)
+{
+  char separator;
+  char *prefix;
+  int len;
+  int i;
+
+  if (index->tables[which] == NULL)
+    return TRUE;
+
+  separator = (which == RULE_INDEX_ARG0_PATH ? '/' : '.');
+
+  if (!_dbus_string_append (arg0_prefix, arg0))
+    return FALSE;
+
+  prefix = _dbus_string_get_data (arg0_prefix);
+  len = _dbus_string_get_length (arg0_prefix);
+
+  for (i = 0; i < len; i++)
+    {
+      /* A namespace prefix stops before the '.', whereas a path
+       * prefix must end with the '/'. */
+      int cut = (separator == '/' ? i + 1 : i);
+      char saved;
+      dbus_bool_t ok;
+
+      if (prefix[i] != separator || cut == len)
+        continue;
+
+      saved = prefix[cut];
+      prefix[cut] = '\0';
+      ok = rule_index_foreach_key (index, which, prefix, already_matched,
+                                   function, data);
+      prefix[cut] = saved;
+
+      if (!ok)
+        goto failed;
+    }
+
+  if (!rule_index_foreach_key (index, which, prefix, already_matched,
+                               function, data))
+    goto failed;
+
+  /* An arg0 ending with '/' also matches longer arg0path values, which we
+   * can only find by looking at all of them. This is rare in practice,
+   * since the only object path ending with '/' is "/" itself. */
+  if (which == RULE_INDEX_ARG0_PATH && len > 0 && prefix[len - 1] == '/')
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (index->tables[which], &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          const char *key = _dbus_hash_iter_get_string_key (&iter);
+
+          if (strlen (key) > (size_t) len &&
+              strncmp (key, prefix, len) == 0 &&
+              !(* function) (_dbus_hash_iter_get_value (&iter),
+                             already_matched, data))
+            goto failed;
+        }
+    }
+
+  _dbus_string_set_length (arg0_prefix, 0);
+  return TRUE;
+
+ failed:
+  _dbus_string_set_length (arg0_prefix, 0);
+  return FALSE;
+}
 
-          if (expected_arg != NULL)
-            {
-              const char *actual_arg;
-              int actual_length;
+/* Visit every list in @index containing rules that could match the
+ * message. Each list is visited at most once. */
+static dbus_bool_t
+rule_index_foreach_candidate (RuleIndex               *index,
+                              MatchSnapshot           *snapshot,
+                              RuleListForeachFunction  function,
+                              void                    *data)
+{
+  const BusMatchFlags already_matched = (BUS_MATCH_MESSAGE_TYPE |
+                                         BUS_MATCH_INTERFACE);
+  const MatchArg *arg0;
 
-              if (current_type != DBUS_TYPE_STRING &&
-                  (!is_path || current_type != DBUS_TYPE_OBJECT_PATH))
-                return FALSE;
+  if (index == NULL)
+    return TRUE;
 
-              actual_arg = NULL;
-              dbus_message_iter_get_basic (&iter, &actual_arg);
-              _dbus_assert (actual_arg != NULL);
+  arg0 = match_snapshot_get_arg (snapshot, 0);
 
-              actual_length = strlen (actual_arg);
+  if (arg0->type == DBUS_TYPE_STRING)
+    {
+      if (!rule_index_foreach_key (index, RULE_INDEX_ARG0, arg0->value,
+                                   already_matched, function, data))
+        return FALSE;
 
-              if (is_path)
-                {
-                  if (actual_length < expected_length &&
-                      actual_arg[actual_length - 1] != '/')
-                    return FALSE;
+      if (!rule_index_foreach_arg0_prefix (index, RULE_INDEX_ARG0_NAMESPACE,
+                                           arg0->value, snapshot->arg0_prefix,
+                                           already_matched, function, data))
+        return FALSE;
+    }
 
-                  if (expected_length < actual_length &&
-                      expected_arg[expected_length - 1] != '/')
-                    return FALSE;
+  if (snapshot->path != NULL &&
+      !rule_index_foreach_key (index, RULE_INDEX_PATH, snapshot->path,
+                               already_matched | BUS_MATCH_PATH,
+                               function, data))
+    return FALSE;
 
-                  if (memcmp (actual_arg, expected_arg,
-                              MIN (actual_length, expected_length)) != 0)
-                    return FALSE;
-                }
-              else if (is_namespace)
-                {
-                  if (expected_length > actual_length)
-                    return FALSE;
+  /* arg0path matches both strings and object paths; an empty arg0 can
+   * only match an empty arg0path, which is never indexed */
+  if (arg0->value != NULL && arg0->len > 0 &&
+      !rule_index_foreach_arg0_prefix (index, RULE_INDEX_ARG0_PATH,
+                                       arg0->value, snapshot->arg0_prefix,
+                                       already_matched, function, data))
+    return FALSE;
 
-                  /* If the actual argument doesn't start with the expected
-                   * namespace, then we don't match.
-                   */
-                  if (memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
+  if (snapshot->member != NULL &&
+      !rule_index_foreach_key (index, RULE_INDEX_MEMBER, snapshot->member,
+                               already_matched | BUS_MATCH_MEMBER,
+                               function, data))
+    return FALSE;
 
-                  if (expected_length < actual_length)
-                    {
-                      /* Check that the actual argument is within the expected
-                       * namespace, rather than just starting with that string,
-                       * by checking that the matched prefix ends in a '.'.
-                       *
-                       * This doesn't stop "foo.bar." matching "foo.bar..baz"
-                       * which is an invalid namespace, but at some point the
-                       * daemon can't cover up for broken services.
-                       */
-                      if (actual_arg[expected_length] != '.')
-                        return FALSE;
-                    }
-                  /* otherwise we had an exact match. */
-                }
-              else
-                {
-                  if (expected_length != actual_length ||
-                      memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
-                }
+  if (index->tables[RULE_INDEX_SENDER] != NULL)
+    {
+      /* The sender rules we want are those naming the bus driver, or one
+       * of the names in the sender's queue; match_rule_matches() still
+       * checks that the sender is the primary owner of the name. */
+      if (snapshot->sender == NULL)
+        {
+          if (!rule_index_foreach_key (index, RULE_INDEX_SENDER,
+                                       DBUS_SERVICE_DBUS, already_matched,
+                                       function, data))
+            return FALSE;
+        }
+      else
+        {
+          DBusList **services;
+          DBusList *link;
 
-            }
-          
-          if (current_type != DBUS_TYPE_INVALID)
-            dbus_message_iter_next (&iter);
+          services = bus_connection_get_owned_services (snapshot->sender);
 
-          ++i;
+          for (link = _dbus_list_get_first_link (services);
+               link != NULL;
+               link = _dbus_list_get_next_link (services, link))
+            {
+              if (!rule_index_foreach_key (index, RULE_INDEX_SENDER,
+                                           bus_service_get_name (link->data),
+                                           already_matched, function, data))
+                return FALSE;
+            }
         }
     }
-  
+
+  if (index->rules_unindexed != NULL)
+    return (* function) (&index->rules_unindexed, already_matched, data);
+
   return TRUE;
 }
 
+typedef struct
+{
+  DBusConnection *addressed_recipient;
+  MatchSnapshot *snapshot;
+  DBusList **recipients_p;
+  dbus_bool_t saw_args;   /* a candidate rule looks at the message body */
+#ifdef DBUS_ENABLE_STATS
+  /* If the result may be cached, the rules evaluated and matched, for
+   * the cache entry; cleared if we ran out of memory recording them */
+  dbus_bool_t record_rules;
+  DBusList *evaluated;
+  DBusList *matched;
+#endif
+} RecipientSearch;
+
 static dbus_bool_t
-get_recipients_from_list (DBusList       **rules,
-                          DBusConnection  *sender,
-                          DBusConnection  *addressed_recipient,
-                          DBusMessage     *message,
-                          DBusList       **recipients_p)
+get_recipients_from_list (DBusList      **rules,
+                          BusMatchFlags   already_matched,
+                          void           *data)
 {
+  RecipientSearch *search = data;
   DBusList *link;
 
-  if (rules == NULL)
-    return TRUE;
-
   link = _dbus_list_get_first_link (rules);
   while (link != NULL)
     {
@@ -2081,9 +3056,12 @@ get_recipients_from_list (DBusList       **rules,
 
       rule = link->data;
 
+      if (rule->flags & BUS_MATCH_ARGS)
+        search->saw_args = TRUE;
+
 #ifdef DBUS_ENABLE_VERBOSE_MODE
       {
-        char *s = match_rule_to_string (rule);
+        char *s = bus_match_rule_to_string (rule);
 
         _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
                        s ? s : "nomem", rule->matches_go_to);
@@ -2091,16 +3069,32 @@ get_recipients_from_list (DBusList       **rules,
       }
 #endif
 
-      if (match_rule_matches (rule,
-                              sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
+#ifdef DBUS_ENABLE_STATS
+      rule->n_evaluated += 1;
+
+      if (search->record_rules &&
+          !_dbus_list_append (&search->evaluated, rule))
+        search->record_rules = FALSE;
+#endif
+
+      if (match_rule_matches (rule, search->addressed_recipient,
+                              search->snapshot, already_matched))
         {
           _dbus_verbose ("Rule matched\n");
 
+#ifdef DBUS_ENABLE_STATS
+          rule->n_matched += 1;
+
+          if (search->record_rules &&
+              !_dbus_list_append (&search->matched, rule))
+            search->record_rules = FALSE;
+#endif
+
           /* Append to the list if we haven't already */
           if (bus_connection_mark_stamp (rule->matches_go_to))
             {
-              if (!_dbus_list_append (recipients_p, rule->matches_go_to))
+              if (!_dbus_list_append (search->recipients_p,
+                                      rule->matches_go_to))
                 return FALSE;
             }
           else
@@ -2115,6 +3109,168 @@ get_recipients_from_list (DBusList       **rules,
   return TRUE;
 }
 
+/* The rules filed under arg0 can only be found by looking at the body of
+ * the message, so they rule out caching */
+static dbus_bool_t
+rule_index_has_arg0_keys (RuleIndex *index)
+{
+  if (index == NULL)
+    return FALSE;
+
+  return (index->tables[RULE_INDEX_ARG0] != NULL ||
+          index->tables[RULE_INDEX_ARG0_NAMESPACE] != NULL ||
+          index->tables[RULE_INDEX_ARG0_PATH] != NULL);
+}
+
+static dbus_bool_t
+append_cache_key_field (DBusString *key,
+                        const char *value)
+{
+  /* None of the fields can contain a space, and none of them can be
+   * empty, so "" can stand for NULL */
+  if (!_dbus_string_append_byte (key, ' '))
+    return FALSE;
+
+  return value == NULL || _dbus_string_append (key, value);
+}
+
+/* Puts the routing tuple of the message in matchmaker->cache_key */
+static dbus_bool_t
+bus_matchmaker_build_cache_key (BusMatchmaker *matchmaker,
+                                MatchSnapshot *snapshot)
+{
+  DBusString *key = &matchmaker->cache_key;
+  const char *sender_name;
+
+  if (snapshot->sender == NULL)
+    sender_name = DBUS_SERVICE_DBUS;
+  else
+    sender_name = snapshot->sender_name;
+
+  _dbus_assert (sender_name != NULL);
+
+  _dbus_string_set_length (key, 0);
+
+  return (_dbus_string_append_int (key, snapshot->type) &&
+          append_cache_key_field (key, snapshot->interface) &&
+          append_cache_key_field (key, snapshot->member) &&
+          append_cache_key_field (key, snapshot->path) &&
+          append_cache_key_field (key, sender_name));
+}
+
+static RecipientCacheEntry *
+bus_matchmaker_lookup_cache (BusMatchmaker  *matchmaker,
+                             BusConnections *connections)
+{
+  BusRegistry *registry;
+  dbus_uint64_t serial;
+
+  /* Rules naming the sender by a well-known name match or not depending
+   * on who owns it */
+  registry = bus_context_get_registry (bus_connections_get_context (connections));
+  serial = bus_registry_get_owners_serial (registry);
+
+  if (serial != matchmaker->owners_serial)
+    {
+      bus_matchmaker_invalidate_cache (matchmaker);
+      matchmaker->owners_serial = serial;
+    }
+
+  if (matchmaker->recipient_cache == NULL)
+    return NULL;
+
+  return _dbus_hash_table_lookup_string (matchmaker->recipient_cache,
+      _dbus_string_get_const_data (&matchmaker->cache_key));
+}
+
+#ifdef DBUS_ENABLE_STATS
+/* Counts a cache hit against the rules that the search which filled
+ * @entry evaluated, so the statistics don't depend on the cache */
+static void
+recipient_cache_entry_account (RecipientCacheEntry *entry)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&entry->evaluated);
+       link != NULL;
+       link = _dbus_list_get_next_link (&entry->evaluated, link))
+    {
+      BusMatchRule *rule = link->data;
+
+      rule->n_evaluated += 1;
+    }
+
+  for (link = _dbus_list_get_first_link (&entry->matched);
+       link != NULL;
+       link = _dbus_list_get_next_link (&entry->matched, link))
+    {
+      BusMatchRule *rule = link->data;
+
+      rule->n_matched += 1;
+    }
+}
+#endif
+
+/* Remembers the recipients found by @search for the tuple in
+ * matchmaker->cache_key. This is only an optimization, so failing to
+ * allocate memory is not an error. */
+static void
+bus_matchmaker_cache_recipients (BusMatchmaker   *matchmaker,
+                                 RecipientSearch *search)
+{
+  RecipientCacheEntry *entry;
+  char *key;
+
+  if (matchmaker->recipient_cache == NULL)
+    {
+      matchmaker->recipient_cache = _dbus_hash_table_new (DBUS_HASH_STRING,
+          dbus_free, (DBusFreeFunction) recipient_cache_entry_free);
+
+      if (matchmaker->recipient_cache == NULL)
+        return;
+    }
+
+#ifdef DBUS_ENABLE_STATS
+  if (!search->record_rules)
+    return;
+#endif
+
+  if (_dbus_hash_table_get_n_entries (matchmaker->recipient_cache) >=
+      RECIPIENT_CACHE_MAX_ENTRIES)
+    {
+      _dbus_verbose ("Recipient cache is full, emptying it\n");
+      _dbus_hash_table_remove_all (matchmaker->recipient_cache);
+    }
+
+  entry = dbus_new0 (RecipientCacheEntry, 1);
+  if (entry == NULL)
+    return;
+
+  key = _dbus_strdup (_dbus_string_get_const_data (&matchmaker->cache_key));
+  if (key == NULL)
+    {
+      dbus_free (entry);
+      return;
+    }
+
+  if (!_dbus_list_copy (search->recipients_p, &entry->recipients) ||
+      !_dbus_hash_table_insert_string (matchmaker->recipient_cache,
+                                       key, entry))
+    {
+      recipient_cache_entry_free (entry);
+      dbus_free (key);
+      return;
+    }
+
+#ifdef DBUS_ENABLE_STATS
+  /* The entry takes over the lists */
+  entry->evaluated = search->evaluated;
+  entry->matched = search->matched;
+  search->evaluated = NULL;
+  search->matched = NULL;
+#endif
+}
+
 dbus_bool_t
 bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                BusConnections  *connections,
@@ -2125,7 +3281,10 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
 {
   int type;
   const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  MatchSnapshot snapshot;
+  RecipientSearch search;
+  RuleIndex *neither, *just_type, *just_iface, *both;
+  dbus_bool_t cacheable;
 
   _dbus_assert (*recipients_p == NULL);
 
@@ -2142,38 +3301,90 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
   if (addressed_recipient != NULL)
     bus_connection_mark_stamp (addressed_recipient);
 
-  type = dbus_message_get_type (message);
-  interface = dbus_message_get_interface (message);
+  match_snapshot_init (&snapshot, sender, message, &matchmaker->arg0_prefix);
+  type = snapshot.type;
+  interface = snapshot.interface;
 
-  neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
+  search.addressed_recipient = addressed_recipient;
+  search.snapshot = &snapshot;
+  search.recipients_p = recipients_p;
+  search.saw_args = FALSE;
+
+  neither = bus_matchmaker_get_index (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
       NULL, FALSE);
   just_type = just_iface = both = NULL;
 
   if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
+    just_iface = bus_matchmaker_get_index (matchmaker,
         DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
 
   if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
     {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
+      just_type = bus_matchmaker_get_index (matchmaker, type, NULL, FALSE);
 
       if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
+        both = bus_matchmaker_get_index (matchmaker, type, interface, FALSE);
+    }
+
+  /* Only broadcasts are cached: who receives a unicast message (by
+   * eavesdropping) depends on who the addressed recipient is. */
+  cacheable = (addressed_recipient == NULL &&
+               snapshot.destination == NULL &&
+               (sender == NULL || snapshot.sender_name != NULL) &&
+               !rule_index_has_arg0_keys (neither) &&
+               !rule_index_has_arg0_keys (just_iface) &&
+               !rule_index_has_arg0_keys (just_type) &&
+               !rule_index_has_arg0_keys (both) &&
+               bus_matchmaker_build_cache_key (matchmaker, &snapshot));
+
+  if (cacheable)
+    {
+      RecipientCacheEntry *entry;
+
+      entry = bus_matchmaker_lookup_cache (matchmaker, connections);
+
+      if (entry != NULL)
+        {
+          _dbus_verbose ("Using cached recipients for %s\n",
+                         _dbus_string_get_const_data (&matchmaker->cache_key));
+#ifdef DBUS_ENABLE_STATS
+          recipient_cache_entry_account (entry);
+#endif
+          return _dbus_list_copy (&entry->recipients, recipients_p);
+        }
     }
 
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
+#ifdef DBUS_ENABLE_STATS
+  search.record_rules = cacheable;
+  search.evaluated = NULL;
+  search.matched = NULL;
+#endif
+
+  if (!(rule_index_foreach_candidate (neither, &snapshot,
+                                      get_recipients_from_list, &search) &&
+        rule_index_foreach_candidate (just_iface, &snapshot,
+                                      get_recipients_from_list, &search) &&
+        rule_index_foreach_candidate (just_type, &snapshot,
+                                      get_recipients_from_list, &search) &&
+        rule_index_foreach_candidate (both, &snapshot,
+                                      get_recipients_from_list, &search)))
     {
       _dbus_list_clear (recipients_p);
+#ifdef DBUS_ENABLE_STATS
+      _dbus_list_clear (&search.evaluated);
+      _dbus_list_clear (&search.matched);
+#endif
       return FALSE;
     }
 
+  if (cacheable && !search.saw_args)
+    bus_matchmaker_cache_recipients (matchmaker, &search);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_list_clear (&search.evaluated);
+  _dbus_list_clear (&search.matched);
+#endif
+
   return TRUE;
 }
 
@@ -2265,6 +3476,23 @@ test_parsing (void        *data,
       bus_match_rule_unref (rule);
     }
 
+  /* Rules share their interface and member names */
+  rule = check_parse (TRUE, "interface='org.Bar',member='Foo'");
+  if (rule != NULL)
+    {
+      BusMatchRule *other;
+
+      other = check_parse (TRUE, "member='Foo',interface='org.Bar'");
+      if (other != NULL)
+        {
+          _dbus_assert (other->interface == rule->interface);
+          _dbus_assert (other->member == rule->member);
+          _dbus_assert (match_rule_equal (rule, other));
+          bus_match_rule_unref (other);
+        }
+
+      bus_match_rule_unref (rule);
+    }
 
   /* A simple signal connection */
   rule = check_parse (TRUE, "type='signal',path='/foo',interface='org.Bar'");
@@ -2558,9 +3786,9 @@ test_equality (void)
         }
 
       /* Check match_rule_to_string */
-      first_str = match_rule_to_string (first);
+      first_str = bus_match_rule_to_string (first);
       _dbus_assert (first_str != NULL);
-      second_str = match_rule_to_string (second);
+      second_str = bus_match_rule_to_string (second);
       _dbus_assert (second_str != NULL);
       _dbus_assert (strcmp (first_str, second_str) == 0);
       first_reparsed = check_parse (TRUE, first_str);
@@ -2689,13 +3917,15 @@ check_matches (dbus_bool_t  expected_to_match,
                const char  *rule_text)
 {
   BusMatchRule *rule;
+  MatchSnapshot snapshot;
   dbus_bool_t matched;
 
   rule = check_parse (TRUE, rule_text);
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  match_snapshot_init (&snapshot, NULL, message, NULL);
+  matched = match_rule_matches (rule, NULL, &snapshot, 0);
 
   if (matched != expected_to_match)
     {
@@ -2812,6 +4042,7 @@ test_path_match (int type,
                  dbus_bool_t   should_match)
 {
   DBusMessage *message = dbus_message_new (DBUS_MESSAGE_TYPE_SIGNAL);
+  MatchSnapshot snapshot;
   dbus_bool_t matched;
 
   _dbus_assert (message != NULL);
@@ -2823,7 +4054,8 @@ test_path_match (int type,
                                  NULL))
     _dbus_test_fatal ("oom");
 
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  match_snapshot_init (&snapshot, NULL, message, NULL);
+  matched = match_rule_matches (rule, NULL, &snapshot, 0);
 
   if (matched != should_match)
     {
@@ -2962,6 +4194,253 @@ test_matching_path_namespace (void)
   dbus_message_unref (message1);
 }
 
+static void
+check_rule_index_key (RuleIndex    *index,
+                      const char   *rule_text,
+                      RuleIndexKey  expected_which,
+                      const char   *expected_key)
+{
+  BusMatchRule *rule;
+  DBusList **rules;
+
+  rule = check_parse (TRUE, rule_text);
+  _dbus_assert (rule != NULL);
+
+  rules = rule_index_get_rules (index, rule, TRUE);
+  if (rules == NULL)
+    _dbus_test_fatal ("oom");
+
+  if (!_dbus_list_append (rules, rule))
+    _dbus_test_fatal ("oom");
+
+  if (expected_which == RULE_INDEX_NONE)
+    {
+      _dbus_assert (rules == &index->rules_unindexed);
+    }
+  else
+    {
+      _dbus_assert (rule_index_lookup (index, expected_which,
+                                       expected_key) == rules);
+      _dbus_assert (_dbus_list_find_last (rules, rule) != NULL);
+    }
+}
+
+static void
+test_rule_index (void)
+{
+  RuleIndex index;
+  BusMatchRule *rule;
+  DBusList **rules;
+
+  memset (&index, '\0', sizeof (index));
+
+  check_rule_index_key (&index,
+                        "type='signal',path='/foo',member='Changed',sender=':1.1'",
+                        RULE_INDEX_PATH, "/foo");
+  check_rule_index_key (&index, "member='Changed',sender=':1.1'",
+                        RULE_INDEX_MEMBER, "Changed");
+  check_rule_index_key (&index, "sender=':1.1',arg1='x'",
+                        RULE_INDEX_SENDER, ":1.1");
+  check_rule_index_key (&index, "path_namespace='/foo'",
+                        RULE_INDEX_NONE, NULL);
+  check_rule_index_key (&index, "arg0namespace='com.example',path='/foo'",
+                        RULE_INDEX_ARG0_NAMESPACE, "com.example");
+  check_rule_index_key (&index, "arg0='com.example',path='/foo'",
+                        RULE_INDEX_ARG0, "com.example");
+  check_rule_index_key (&index, "arg0path='/aa/',path='/foo'",
+                        RULE_INDEX_PATH, "/foo");
+  check_rule_index_key (&index, "arg0path='/aa/',member='Changed'",
+                        RULE_INDEX_ARG0_PATH, "/aa/");
+  check_rule_index_key (&index, "arg1='x'", RULE_INDEX_NONE, NULL);
+
+  _dbus_assert (rule_index_lookup (&index, RULE_INDEX_PATH, "/bar") == NULL);
+  _dbus_assert (rule_index_lookup (&index, RULE_INDEX_MEMBER,
+                                   "Frobated") == NULL);
+  _dbus_assert (!rule_index_is_empty (&index));
+
+  /* Removing the only rule for a key discards that table again */
+  rule = check_parse (TRUE, "member='Changed',sender=':1.1'");
+  _dbus_assert (rule != NULL);
+  rules = rule_index_get_rules (&index, rule, FALSE);
+  _dbus_assert (rules != NULL);
+  bus_match_rule_unref (_dbus_list_pop_first (rules));
+  rule_index_gc_rules (&index, rule, rules);
+  _dbus_assert (index.tables[RULE_INDEX_MEMBER] == NULL);
+  bus_match_rule_unref (rule);
+
+  rule_index_clear (&index);
+  _dbus_assert (rule_index_is_empty (&index));
+}
+
+static const char *
+rule_index_candidates_rules[] = {
+  "arg0='com.example.Foo'",
+  "arg0='com.example'",
+  "arg0namespace='com.example'",
+  "arg0namespace='com'",
+  "arg0namespace='com.example.Foo.Bar'",
+  "arg0namespace='org'",
+  "arg0path='/aa/bb/'",
+  "arg0path='/aa/'",
+  "arg0path='/aa/bb/cc'",
+  "arg0path='/aa/b'",
+  "arg0path='/zz/'",
+  "arg0path='/'",
+  "arg0path='foobar'",
+  "path='/foo'",
+  "path='/bar'",
+  "member='Frobated'",
+  "member='Other'",
+  "sender='org.freedesktop.DBus'",
+  "sender=':1.1'",
+  "path_namespace='/foo'",
+  "arg1='x'",
+  "",
+  NULL
+};
+
+static dbus_bool_t
+collect_candidates (DBusList      **rules,
+                    BusMatchFlags   already_matched,
+                    void           *data)
+{
+  DBusList **candidates = data;
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      _dbus_assert (_dbus_list_find_last (candidates, link->data) == NULL);
+
+      if (!_dbus_list_append (candidates, link->data))
+        _dbus_test_fatal ("oom");
+    }
+
+  return TRUE;
+}
+
+/* Every rule that matches the message must be among the candidates
+ * visited by rule_index_foreach_candidate(). */
+static void
+check_rule_index_candidates (RuleIndex   *index,
+                             DBusList   **all_rules,
+                             DBusString  *arg0_prefix,
+                             int          arg0_type,
+                             const char  *arg0)
+{
+  DBusMessage *message;
+  MatchSnapshot snapshot;
+  DBusList *candidates = NULL;
+  DBusList *link;
+  int n_rules;
+
+  message = dbus_message_new_signal ("/foo", "com.example.Iface", "Frobated");
+  if (message == NULL)
+    _dbus_test_fatal ("oom");
+
+  if (arg0 != NULL &&
+      !dbus_message_append_args (message, arg0_type, &arg0, DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("oom");
+
+  match_snapshot_init (&snapshot, NULL, message, arg0_prefix);
+
+  if (!rule_index_foreach_candidate (index, &snapshot, collect_candidates,
+                                     &candidates))
+    _dbus_test_fatal ("oom");
+
+  n_rules = 0;
+
+  for (link = _dbus_list_get_first_link (all_rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (all_rules, link))
+    {
+      BusMatchRule *rule = link->data;
+
+      n_rules++;
+
+      if (match_rule_matches (rule, NULL, &snapshot, 0) &&
+          _dbus_list_find_last (&candidates, rule) == NULL)
+        {
+          char *text = bus_match_rule_to_string (rule);
+
+          _dbus_test_fatal ("Rule %s matches arg0 '%s' but was not a "
+                            "candidate", text, arg0 ? arg0 : "(none)");
+        }
+    }
+
+  /* We must have skipped at least member='Other' and path='/bar' */
+  _dbus_assert (_dbus_list_get_length (&candidates) <= n_rules - 2);
+  _dbus_assert (_dbus_string_get_length (arg0_prefix) == 0);
+
+  _dbus_list_clear (&candidates);
+  dbus_message_unref (message);
+}
+
+static void
+test_rule_index_candidates (void)
+{
+  RuleIndex index;
+  DBusList *all_rules = NULL;
+  DBusString arg0_prefix;
+  const char **text;
+
+  memset (&index, '\0', sizeof (index));
+
+  if (!_dbus_string_init (&arg0_prefix))
+    _dbus_test_fatal ("oom");
+
+  for (text = rule_index_candidates_rules; *text != NULL; text++)
+    {
+      BusMatchRule *rule = check_parse (TRUE, *text);
+      DBusList **rules;
+
+      _dbus_assert (rule != NULL);
+
+      rules = rule_index_get_rules (&index, rule, TRUE);
+
+      if (rules == NULL ||
+          !_dbus_list_append (rules, rule) ||
+          !_dbus_list_append (&all_rules, rule))
+        _dbus_test_fatal ("oom");
+    }
+
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_INVALID, NULL);
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "com.example.Foo");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "com.example");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "com.examplefoo");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "com..example");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "org.example");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "foobar");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "/aa/");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "/aa/bb/");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_STRING, "/aa/bb/cc/");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_OBJECT_PATH, "/");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_OBJECT_PATH, "/aa/bb/cc");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_OBJECT_PATH, "/aa/bb/cc/dd");
+  check_rule_index_candidates (&index, &all_rules, &arg0_prefix,
+                               DBUS_TYPE_OBJECT_PATH, "/aa/b");
+
+  _dbus_list_clear (&all_rules);
+  rule_index_clear (&index);
+  _dbus_string_free (&arg0_prefix);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -2979,6 +4458,8 @@ bus_signals_test (const DBusString *test_data_dir)
   test_matching ();
   test_path_matching ();
   test_matching_path_namespace ();
+  test_rule_index ();
+  test_rule_index_candidates ();
 
   return TRUE;
 }
@@ -78,11 +78,20 @@ dbus_bool_t bus_match_rule_get_client_is_eavesdropping (BusMatchRule *rule);
 BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
                                     const DBusString *rule_text,
                                     DBusError        *error);
+char*         bus_match_rule_to_string (BusMatchRule *rule);
 
 #ifdef DBUS_ENABLE_STATS
-dbus_bool_t bus_match_rule_dump (BusMatchmaker *matchmaker,
-                                 DBusConnection *conn_filter,
+dbus_bool_t bus_match_rule_dump (BusMatchmaker   *matchmaker,
+                                 DBusConnection  *conn_filter,
+                                 dbus_bool_t      with_stats,
                                  DBusMessageIter *arr_iter);
+void bus_matchmaker_get_rule_stats (BusMatchmaker  *matchmaker,
+                                    DBusConnection *conn_filter,
+                                    dbus_uint64_t  *evaluated_p,
+                                    dbus_uint64_t  *matched_p);
+void bus_match_rule_get_pool_stats (dbus_uint32_t *in_use_p,
+                                    dbus_uint32_t *in_free_list_p,
+                                    dbus_uint32_t *allocated_p);
 #endif
 
 BusMatchmaker* bus_matchmaker_new   (void);
@@ -98,6 +107,7 @@ void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
+void        bus_matchmaker_compact              (BusMatchmaker   *matchmaker);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
                                                  BusConnections  *connections,
                                                  DBusConnection  *sender,
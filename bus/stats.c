@@ -27,15 +27,40 @@
 #include <dbus/dbus-asv-util.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-message-internal.h>
 
 #include "connection.h"
+#include "dispatch.h"
 #include "driver.h"
+#include "policy.h"
 #include "services.h"
 #include "signals.h"
 #include "utils.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef DBUS_ENABLE_STATS
 
+static dbus_bool_t
+add_traffic_stats (DBusMessageIter       *arr_iter,
+                   const BusTrafficStats *traffic)
+{
+  return
+    _dbus_asv_add_uint64 (arr_iter, "MessagesReceived", traffic->messages_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "BytesReceived", traffic->bytes_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "MethodCallsReceived", traffic->method_calls_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "MethodReturnsReceived", traffic->method_returns_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "ErrorsReceived", traffic->errors_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "SignalsReceived", traffic->signals_received) &&
+    _dbus_asv_add_uint64 (arr_iter, "MessagesSent", traffic->messages_sent) &&
+    _dbus_asv_add_uint64 (arr_iter, "BytesSent", traffic->bytes_sent) &&
+    _dbus_asv_add_uint64 (arr_iter, "SignalsFannedOut", traffic->signals_fanned_out) &&
+    _dbus_asv_add_uint64 (arr_iter, "PolicyDenials", traffic->policy_denials) &&
+    _dbus_asv_add_uint64 (arr_iter, "MatchRuleDeliveries", traffic->match_rule_deliveries);
+}
+
 dbus_bool_t
 bus_stats_handle_get_stats (DBusConnection *connection,
                             BusTransaction *transaction,
@@ -44,10 +69,18 @@ bus_stats_handle_get_stats (DBusConnection *connection,
 {
   BusContext *context;
   BusConnections *connections;
+  BusRegistry *registry;
   DBusMessage *reply = NULL;
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
   dbus_uint32_t in_use, in_free_list, allocated;
+  dbus_uint32_t cache_hits, cache_misses, cached;
+  dbus_uint32_t in_pressure, message_bytes, peak_message_bytes;
+  dbus_uint32_t pressure_events, shed;
+  dbus_uint32_t hash_tables, hash_entries, hash_bytes;
+  BusTrafficStats traffic;
+  DBusLatencyHistogram routing_latency, queue_latency;
+  dbus_uint64_t rules_evaluated, rules_matched;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -62,11 +95,17 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   /* Globals */
 
   _dbus_list_get_stats (&in_use, &in_free_list, &allocated);
+  _dbus_message_get_cache_stats (&cache_hits, &cache_misses, &cached);
 
   if (!_dbus_asv_add_uint32 (&arr_iter, "Serial", stats_serial++) ||
       !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolUsedBytes", in_use) ||
       !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolCachedBytes", in_free_list) ||
-      !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolAllocatedBytes", allocated))
+      !_dbus_asv_add_uint32 (&arr_iter, "ListMemPoolAllocatedBytes", allocated) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheHits", cache_hits) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheMisses", cache_misses) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageCacheSize", cached) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "LiveMessages",
+                             _dbus_message_get_n_live ()))
     {
       _dbus_asv_abandon (&iter, &arr_iter);
       goto oom;
@@ -95,6 +134,118 @@ bus_stats_handle_get_stats (DBusConnection *connection,
       goto oom;
     }
 
+  /* Cumulative traffic */
+
+  bus_connections_get_traffic_stats (connections, &traffic);
+
+  if (!add_traffic_stats (&arr_iter, &traffic))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_matchmaker_get_rule_stats (bus_context_get_matchmaker (context), NULL,
+                                 &rules_evaluated, &rules_matched);
+
+  if (!_dbus_asv_add_uint64 (&arr_iter, "MatchRuleEvaluations", rules_evaluated) ||
+      !_dbus_asv_add_uint64 (&arr_iter, "MatchRuleMatches", rules_matched))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_connections_get_routing_latency (connections, &routing_latency);
+  bus_connections_get_queue_latency (connections, &queue_latency);
+
+  if (!_dbus_asv_add_uint32_array (&arr_iter, "RoutingLatencyHistogram",
+                                   routing_latency.buckets,
+                                   _DBUS_LATENCY_HISTOGRAM_BUCKETS) ||
+      !_dbus_asv_add_uint32_array (&arr_iter, "OutgoingQueueLatencyHistogram",
+                                   queue_latency.buckets,
+                                   _DBUS_LATENCY_HISTOGRAM_BUCKETS))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  /* Memory pressure */
+
+  bus_connections_get_memory_pressure_stats (connections, &in_pressure,
+                                             &message_bytes,
+                                             &peak_message_bytes,
+                                             &pressure_events, &shed);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "MemoryPressure", in_pressure) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessageBytes", message_bytes) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "PeakMessageBytes", peak_message_bytes) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MemoryPressureEvents", pressure_events) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessagesShed", shed) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessagesRateLimited",
+        bus_connections_get_messages_rate_limited (connections)))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  /* Memory pools, one per object size */
+
+  registry = bus_context_get_registry (context);
+
+  bus_registry_get_service_pool_stats (registry, &in_use, &in_free_list,
+                                       &allocated);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "ServiceMemPoolUsedBytes", in_use) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "ServiceMemPoolCachedBytes", in_free_list) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "ServiceMemPoolAllocatedBytes", allocated))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_registry_get_owner_pool_stats (registry, &in_use, &in_free_list,
+                                     &allocated);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "OwnerMemPoolUsedBytes", in_use) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "OwnerMemPoolCachedBytes", in_free_list) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "OwnerMemPoolAllocatedBytes", allocated))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_connections_get_pending_reply_pool_stats (connections, &in_use,
+                                                &in_free_list, &allocated);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "PendingReplyMemPoolUsedBytes", in_use) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "PendingReplyMemPoolCachedBytes", in_free_list) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "PendingReplyMemPoolAllocatedBytes", allocated))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_match_rule_get_pool_stats (&in_use, &in_free_list, &allocated);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "MatchRuleMemPoolUsedBytes", in_use) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MatchRuleMemPoolCachedBytes", in_free_list) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MatchRuleMemPoolAllocatedBytes", allocated))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  /* Hash tables, which have a memory pool each */
+
+  _dbus_hash_get_stats (&hash_tables, &hash_entries, &hash_bytes);
+
+  if (!_dbus_asv_add_uint32 (&arr_iter, "HashTables", hash_tables) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "HashEntries", hash_entries) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "HashTableBytes", hash_bytes))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
   /* end */
 
   if (!_dbus_asv_close (&iter, &arr_iter))
@@ -127,6 +278,9 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
   dbus_uint32_t in_messages, in_bytes, in_fds, in_peak_bytes, in_peak_fds;
   dbus_uint32_t out_messages, out_bytes, out_fds, out_peak_bytes, out_peak_fds;
   DBusConnection *stats_connection;
+  BusTrafficStats traffic;
+  DBusLatencyHistogram queue_latency;
+  dbus_uint64_t rules_evaluated, rules_matched;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -169,6 +323,10 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
         bus_connection_get_n_services_owned (stats_connection)) ||
       !_dbus_asv_add_uint32 (&arr_iter, "PeakBusNames",
         bus_connection_get_peak_bus_names (stats_connection)) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "MessagesRateLimited",
+        bus_connection_get_messages_rate_limited (stats_connection)) ||
+      !_dbus_asv_add_uint32 (&arr_iter, "SignalsCoalesced",
+        bus_connection_get_signals_coalesced (stats_connection)) ||
       !_dbus_asv_add_string (&arr_iter, "UniqueName",
         bus_connection_get_name (stats_connection)))
     {
@@ -199,6 +357,35 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
       goto oom;
     }
 
+  bus_connection_get_traffic_stats (stats_connection, &traffic);
+
+  if (!add_traffic_stats (&arr_iter, &traffic))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  bus_matchmaker_get_rule_stats (
+      bus_context_get_matchmaker (bus_transaction_get_context (transaction)),
+      stats_connection, &rules_evaluated, &rules_matched);
+
+  if (!_dbus_asv_add_uint64 (&arr_iter, "MatchRuleEvaluations", rules_evaluated) ||
+      !_dbus_asv_add_uint64 (&arr_iter, "MatchRuleMatches", rules_matched))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
+  _dbus_connection_get_queue_latency (stats_connection, &queue_latency);
+
+  if (!_dbus_asv_add_uint32_array (&arr_iter, "OutgoingQueueLatencyHistogram",
+                                   queue_latency.buckets,
+                                   _DBUS_LATENCY_HISTOGRAM_BUCKETS))
+    {
+      _dbus_asv_abandon (&iter, &arr_iter);
+      goto oom;
+    }
+
   /* end */
 
   if (!_dbus_asv_close (&iter, &arr_iter))
@@ -222,11 +409,14 @@ failed:
 }
 
 
-dbus_bool_t
-bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
-                                      BusTransaction *transaction,
-                                      DBusMessage    *message,
-                                      DBusError      *error)
+/* Replies with every connection's match rules, as strings or with
+ * @with_stats as (rule, evaluations, matches) structs */
+static dbus_bool_t
+handle_get_all_match_rules (DBusConnection *caller_connection,
+                            BusTransaction *transaction,
+                            DBusMessage    *message,
+                            dbus_bool_t     with_stats,
+                            DBusError      *error)
 {
   BusContext *context;
   DBusString bus_name_str;
@@ -254,7 +444,8 @@ bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
 
   dbus_message_iter_init_append (reply, &iter);
 
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sas}",
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         with_stats ? "{sa(stt)}" : "{sas}",
                                          &hash_iter))
     goto oom;
 
@@ -287,7 +478,8 @@ bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
           goto oom;
         }
 
-      if (!dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY, "s",
+      if (!dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY,
+                                             with_stats ? "(stt)" : "s",
                                              &arr_iter))
         {
           dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
@@ -295,7 +487,8 @@ bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
           goto oom;
         }
 
-      if (!bus_match_rule_dump (matchmaker, conn_filter, &arr_iter))
+      if (!bus_match_rule_dump (matchmaker, conn_filter, with_stats,
+                                &arr_iter))
         {
           dbus_message_iter_abandon_container (&entry_iter, &arr_iter);
           dbus_message_iter_abandon_container (&hash_iter, &entry_iter);
@@ -337,4 +530,396 @@ oom:
   return FALSE;
 }
 
+dbus_bool_t
+bus_stats_handle_get_all_match_rules (DBusConnection *caller_connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  return handle_get_all_match_rules (caller_connection, transaction, message,
+                                     FALSE, error);
+}
+
+dbus_bool_t
+bus_stats_handle_get_all_match_rule_stats (DBusConnection *caller_connection,
+                                           BusTransaction *transaction,
+                                           DBusMessage    *message,
+                                           DBusError      *error)
+{
+  return handle_get_all_match_rules (caller_connection, transaction, message,
+                                     TRUE, error);
+}
+
+
+/* Keys for each BusPolicyCheckKind; own checks are never cached */
+static const struct
+{
+  const char *checks;
+  const char *cache_hits;
+  const char *rules_scanned;
+  const char *no_rule_applied;
+  const char *deciding_rule;
+  const char *latency;
+} policy_stats_keys[BUS_POLICY_N_CHECK_KINDS] = {
+  { "SendChecks", "SendCacheHits", "SendRulesScanned", "SendNoRuleApplied",
+    "SendDecidingRuleHistogram", "SendLatencyHistogram" },
+  { "ReceiveChecks", "ReceiveCacheHits", "ReceiveRulesScanned",
+    "ReceiveNoRuleApplied", "ReceiveDecidingRuleHistogram",
+    "ReceiveLatencyHistogram" },
+  { "OwnChecks", NULL, "OwnRulesScanned", "OwnNoRuleApplied",
+    "OwnDecidingRuleHistogram", "OwnLatencyHistogram" }
+};
+
+dbus_bool_t
+bus_stats_handle_get_policy_stats (DBusConnection *caller_connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter;
+  int kind;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  reply = _dbus_asv_new_method_return (message, &iter, &arr_iter);
+
+  if (reply == NULL)
+    goto oom;
+
+  for (kind = 0; kind < BUS_POLICY_N_CHECK_KINDS; kind++)
+    {
+      BusPolicyCheckStats stats;
+
+      bus_policy_get_check_stats (kind, &stats);
+
+      if (!_dbus_asv_add_uint64 (&arr_iter, policy_stats_keys[kind].checks,
+                                 stats.checks) ||
+          (policy_stats_keys[kind].cache_hits != NULL &&
+           !_dbus_asv_add_uint64 (&arr_iter,
+                                  policy_stats_keys[kind].cache_hits,
+                                  stats.cache_hits)) ||
+          !_dbus_asv_add_uint64 (&arr_iter,
+                                 policy_stats_keys[kind].rules_scanned,
+                                 stats.rules_scanned) ||
+          !_dbus_asv_add_uint64 (&arr_iter,
+                                 policy_stats_keys[kind].no_rule_applied,
+                                 stats.no_rule_applied) ||
+          !_dbus_asv_add_uint32_array (&arr_iter,
+                                       policy_stats_keys[kind].deciding_rule,
+                                       stats.deciding_rule.buckets,
+                                       _DBUS_LATENCY_HISTOGRAM_BUCKETS) ||
+          !_dbus_asv_add_uint32_array (&arr_iter,
+                                       policy_stats_keys[kind].latency,
+                                       stats.latency.buckets,
+                                       _DBUS_LATENCY_HISTOGRAM_BUCKETS))
+        {
+          _dbus_asv_abandon (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!_dbus_asv_close (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller_connection,
+                                         reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/* Bounded "space-saving" heavy-hitters table: once it is full, a key
+ * that is not in it replaces the entry with the fewest messages and
+ * inherits its counts, so every count is an overestimate by at most
+ * that entry's error, but the heaviest keys are never lost. Names are
+ * at most DBUS_MAXIMUM_NAME_LENGTH bytes, so entries need no allocation.
+ */
+#define MAX_TOP_TALKERS 64
+
+typedef struct
+{
+  dbus_uint32_t hash;
+  char sender[DBUS_MAXIMUM_NAME_LENGTH + 1];
+  char interface[DBUS_MAXIMUM_NAME_LENGTH + 1];
+  char member[DBUS_MAXIMUM_NAME_LENGTH + 1];
+  dbus_uint64_t messages;
+  dbus_uint64_t bytes;
+  dbus_uint64_t error; /**< messages counted for keys this entry replaced */
+} TopTalker;
+
+static TopTalker top_talkers[MAX_TOP_TALKERS];
+static int n_top_talkers = 0;
+
+static dbus_uint32_t
+hash_name (dbus_uint32_t  hash,
+           const char    *name)
+{
+  /* FNV-1a, with the terminating nul so that the three names
+   * cannot run into each other */
+  do
+    {
+      hash ^= (unsigned char) *name;
+      hash *= 16777619;
+    }
+  while (*name++ != '\0');
+
+  return hash;
+}
+
+static void
+copy_name (char       *dest,
+           const char *name)
+{
+  strncpy (dest, name, DBUS_MAXIMUM_NAME_LENGTH);
+  dest[DBUS_MAXIMUM_NAME_LENGTH] = '\0';
+}
+
+/**
+ * Counts a message received by the bus towards the heaviest
+ * (sender, interface, member) keys.
+ *
+ * @param sender_connection the connection that sent the message
+ * @param message the message
+ */
+void
+bus_stats_count_message (DBusConnection *sender_connection,
+                         DBusMessage    *message)
+{
+  const char *sender, *interface, *member;
+  dbus_uint32_t hash;
+  TopTalker *entry;
+  int i;
+
+  sender = bus_connection_get_name (sender_connection);
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+
+  if (sender == NULL)
+    sender = "";
+  if (interface == NULL)
+    interface = "";
+  if (member == NULL)
+    member = "";
+
+  hash = hash_name (hash_name (hash_name (2166136261u, sender),
+                               interface),
+                    member);
+
+  for (i = 0; i < n_top_talkers; i++)
+    {
+      entry = &top_talkers[i];
+
+      if (entry->hash == hash &&
+          strcmp (entry->member, member) == 0 &&
+          strcmp (entry->interface, interface) == 0 &&
+          strcmp (entry->sender, sender) == 0)
+        goto found;
+    }
+
+  if (n_top_talkers < MAX_TOP_TALKERS)
+    {
+      entry = &top_talkers[n_top_talkers++];
+      entry->messages = 0;
+      entry->bytes = 0;
+      entry->error = 0;
+    }
+  else
+    {
+      entry = &top_talkers[0];
+
+      for (i = 1; i < n_top_talkers; i++)
+        {
+          if (top_talkers[i].messages < entry->messages)
+            entry = &top_talkers[i];
+        }
+
+      entry->error = entry->messages;
+    }
+
+  entry->hash = hash;
+  copy_name (entry->sender, sender);
+  copy_name (entry->interface, interface);
+  copy_name (entry->member, member);
+
+found:
+  entry->messages += 1;
+  entry->bytes += _dbus_message_get_size (message);
+}
+
+static int
+compare_top_talkers (const void *a,
+                     const void *b)
+{
+  const TopTalker *ta = *(const TopTalker * const *) a;
+  const TopTalker *tb = *(const TopTalker * const *) b;
+
+  if (ta->messages > tb->messages)
+    return -1;
+  else if (ta->messages < tb->messages)
+    return 1;
+  else
+    return 0;
+}
+
+dbus_bool_t
+bus_stats_handle_get_top_talkers (DBusConnection *caller_connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter, struct_iter;
+  const TopTalker *sorted[MAX_TOP_TALKERS];
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  for (i = 0; i < n_top_talkers; i++)
+    sorted[i] = &top_talkers[i];
+
+  qsort (sorted, n_top_talkers, sizeof (sorted[0]), compare_top_talkers);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sssttt)",
+                                         &arr_iter))
+    goto oom;
+
+  for (i = 0; i < n_top_talkers; i++)
+    {
+      const char *sender = sorted[i]->sender;
+      const char *interface = sorted[i]->interface;
+      const char *member = sorted[i]->member;
+
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_STRUCT, NULL,
+                                             &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &sender) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &interface) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING, &member) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &sorted[i]->messages) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &sorted[i]->bytes) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64, &sorted[i]->error))
+        {
+          dbus_message_iter_abandon_container (&arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&arr_iter, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, caller_connection,
+                                         reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+
+/**
+ * Broadcasts OutgoingQueueHigh or OutgoingQueueLow for a connection
+ * whose outgoing queue has crossed a watermark.
+ *
+ * @param connection the connection whose queue crossed the watermark
+ * @param above #TRUE if it reached the high watermark, #FALSE if it
+ *  drained to the low watermark
+ * @param transaction the transaction to send the signal in
+ * @param error return location for an error
+ * @returns #FALSE with error set on failure
+ */
+dbus_bool_t
+bus_stats_send_queue_watermark (DBusConnection *connection,
+                                dbus_bool_t     above,
+                                BusTransaction *transaction,
+                                DBusError      *error)
+{
+  DBusMessage *message;
+  const char *name;
+  unsigned long uid;
+  dbus_uint32_t uid32, queued_messages, queued_bytes;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL);
+
+  if (dbus_connection_get_unix_user (connection, &uid))
+    uid32 = uid;
+  else
+    uid32 = _DBUS_UINT32_MAX;
+
+  _dbus_connection_get_stats (connection, NULL, NULL, NULL, NULL, NULL,
+                              &queued_messages, &queued_bytes,
+                              NULL, NULL, NULL);
+
+  message = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                     BUS_INTERFACE_STATS,
+                                     above ? "OutgoingQueueHigh" :
+                                             "OutgoingQueueLow");
+
+  if (message == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_message_set_sender (message, DBUS_SERVICE_DBUS))
+    goto oom;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UINT32, &uid32,
+                                 DBUS_TYPE_UINT32, &queued_bytes,
+                                 DBUS_TYPE_UINT32, &queued_messages,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (!bus_transaction_capture (transaction, NULL, NULL, message))
+    goto oom;
+
+  retval = bus_dispatch_matches (transaction, NULL, NULL, message, error);
+  dbus_message_unref (message);
+
+  return retval;
+
+ oom:
+  dbus_message_unref (message);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
 #endif
@@ -40,4 +40,27 @@ dbus_bool_t bus_stats_handle_get_all_match_rules (DBusConnection *caller_connect
                                                   DBusMessage    *message,
                                                   DBusError      *error);
 
+dbus_bool_t bus_stats_handle_get_all_match_rule_stats (DBusConnection *caller_connection,
+                                                       BusTransaction *transaction,
+                                                       DBusMessage    *message,
+                                                       DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_top_talkers (DBusConnection *caller_connection,
+                                              BusTransaction *transaction,
+                                              DBusMessage    *message,
+                                              DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_policy_stats (DBusConnection *caller_connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error);
+
+void bus_stats_count_message (DBusConnection *sender_connection,
+                              DBusMessage    *message);
+
+dbus_bool_t bus_stats_send_queue_watermark (DBusConnection *connection,
+                                            dbus_bool_t     above,
+                                            BusTransaction *transaction,
+                                            DBusError      *error);
+
 #endif /* multiple-inclusion guard */
@@ -118,14 +118,30 @@ main (int argc, char **argv)
     _dbus_test_fatal ("OOM initializing debug threads");
 
   test_one ("expire-list", bus_expire_list_test);
+  test_one ("log-queue", bus_log_queue_test);
   test_one ("config-parser", bus_config_parser_test);
+  test_one ("policy", bus_policy_test);
   test_one ("signals", bus_signals_test);
   test_one ("dispatch-sha1", bus_dispatch_sha1_test);
   test_one ("dispatch", bus_dispatch_test);
   test_one ("activation-service-reload", bus_activation_service_reload_test);
+  test_one ("add-matches", bus_add_matches_test);
+  test_one ("list-names-paged", bus_list_names_paged_test);
+  test_one ("flow-control", bus_flow_control_test);
+  test_one ("coalesce-signals", bus_coalesce_signals_test);
+  test_one ("prioritize-replies", bus_prioritize_replies_test);
+  test_one ("rate-limits", bus_rate_limits_test);
+  test_one ("lossy-monitor", bus_lossy_monitor_test);
+#ifdef DBUS_ENABLE_STATS
+  test_one ("match-stats", bus_match_stats_test);
+#endif
+#ifdef DBUS_UNIX
+  test_one ("in-process-connection", bus_in_process_connection_test);
+#endif
 
 #ifdef HAVE_UNIX_FD_PASSING
   test_one ("unix-fds-passing", bus_unix_fds_passing_test);
+  test_one ("peer-connection", bus_peer_connection_test);
 #else
   _dbus_test_skip ("fd-passing not supported on this platform");
 #endif
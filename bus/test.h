@@ -36,7 +36,22 @@ dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_d
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_log_queue_test        (const DBusString             *test_data_dir);
+dbus_bool_t bus_policy_test           (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
+dbus_bool_t bus_add_matches_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_list_names_paged_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_flow_control_test     (const DBusString             *test_data_dir);
+dbus_bool_t bus_coalesce_signals_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_prioritize_replies_test (const DBusString           *test_data_dir);
+dbus_bool_t bus_rate_limits_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_lossy_monitor_test     (const DBusString             *test_data_dir);
+#ifdef DBUS_ENABLE_STATS
+dbus_bool_t bus_match_stats_test      (const DBusString             *test_data_dir);
+#endif
+#ifdef DBUS_UNIX
+dbus_bool_t bus_in_process_connection_test (const DBusString        *test_data_dir);
+#endif
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
                                        void                         *data);
@@ -50,6 +65,7 @@ BusContext* bus_context_new_test      (const DBusString             *test_data_d
 
 #ifdef HAVE_UNIX_FD_PASSING
 dbus_bool_t bus_unix_fds_passing_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_peer_connection_test  (const DBusString             *test_data_dir);
 #endif
 
 #endif
@@ -62,6 +62,9 @@ check_symbol_exists(inotify_init1 "sys/inotify.h"           HAVE_INOTIFY_INIT1)
 check_symbol_exists(SCM_RIGHTS    "sys/types.h;sys/socket.h;sys/un.h" HAVE_UNIX_FD_PASSING)
 check_symbol_exists(prctl        "sys/prctl.h"              HAVE_PRCTL)
 check_symbol_exists(raise        "signal.h"                 HAVE_RAISE)
+check_symbol_exists(vfork        "unistd.h"                 HAVE_VFORK)          #  dbus-spawn-unix.c
+check_symbol_exists(getrandom    "sys/random.h"             HAVE_GETRANDOM)      #  dbus-sysdeps-unix.c
+check_symbol_exists(arc4random_buf "stdlib.h"               HAVE_ARC4RANDOM_BUF) #  dbus-sysdeps-unix.c
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
@@ -29,6 +29,9 @@
 
 #cmakedefine DBUS_ENABLE_STATS
 #cmakedefine DBUS_ENABLE_CONTAINERS
+#cmakedefine DBUS_ENABLE_USDT
+#cmakedefine DBUS_ENABLE_TRACE_RING
+#cmakedefine DBUS_ENABLE_COMPRESSION
 
 #define TEST_LISTEN       "@TEST_LISTEN@"
 
@@ -207,6 +210,9 @@
 #cmakedefine HAVE_DIRFD 1
 #cmakedefine HAVE_INOTIFY_INIT1 1
 #cmakedefine HAVE_UNIX_FD_PASSING 1
+#cmakedefine HAVE_VFORK 1
+#cmakedefine HAVE_GETRANDOM 1
+#cmakedefine HAVE_ARC4RANDOM_BUF 1
 
 // structs
 /* Define to 1 if you have struct cmsgred */
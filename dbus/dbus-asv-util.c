@@ -223,6 +223,42 @@ _dbus_asv_add_uint32 (DBusMessageIter *arr_iter,
   return TRUE;
 }
 
+/**
+ * Create a new entry in an a{sv} (map from string to variant)
+ * with a 64-bit unsigned integer value.
+ *
+ * If this function fails, the a{sv} must be abandoned, for instance
+ * with _dbus_asv_abandon().
+ *
+ * @param arr_iter the iterator which is appending to the array
+ * @param key a UTF-8 key for the map
+ * @param value the value
+ * @returns #TRUE on success, or #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_asv_add_uint64 (DBusMessageIter *arr_iter,
+                      const char *key,
+                      dbus_uint64_t value)
+{
+  DBusMessageIter entry_iter, var_iter;
+
+  if (!_dbus_asv_open_entry (arr_iter, &entry_iter, key,
+                             DBUS_TYPE_UINT64_AS_STRING, &var_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&var_iter, DBUS_TYPE_UINT64,
+                                       &value))
+    {
+      _dbus_asv_abandon_entry (arr_iter, &entry_iter, &var_iter);
+      return FALSE;
+    }
+
+  if (!_dbus_asv_close_entry (arr_iter, &entry_iter, &var_iter))
+    return FALSE;
+
+  return TRUE;
+}
+
 /**
  * Create a new entry in an a{sv} (map from string to variant)
  * with a UTF-8 string value.
@@ -295,6 +331,44 @@ _dbus_asv_add_object_path (DBusMessageIter *arr_iter,
   return TRUE;
 }
 
+/**
+ * Create a new entry in an a{sv} (map from string to variant)
+ * with a Unix file descriptor value. The message gets its own
+ * duplicate of the file descriptor.
+ *
+ * If this function fails, the a{sv} must be abandoned, for instance
+ * with _dbus_asv_abandon().
+ *
+ * @param arr_iter the iterator which is appending to the array
+ * @param key a UTF-8 key for the map
+ * @param value the file descriptor
+ * @returns #TRUE on success, or #FALSE if not enough memory or the
+ *  file descriptor could not be duplicated
+ */
+dbus_bool_t
+_dbus_asv_add_unix_fd (DBusMessageIter *arr_iter,
+                       const char *key,
+                       int value)
+{
+  DBusMessageIter entry_iter, var_iter;
+
+  if (!_dbus_asv_open_entry (arr_iter, &entry_iter, key,
+                             DBUS_TYPE_UNIX_FD_AS_STRING, &var_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&var_iter, DBUS_TYPE_UNIX_FD,
+                                       &value))
+    {
+      _dbus_asv_abandon_entry (arr_iter, &entry_iter, &var_iter);
+      return FALSE;
+    }
+
+  if (!_dbus_asv_close_entry (arr_iter, &entry_iter, &var_iter))
+    return FALSE;
+
+  return TRUE;
+}
+
 /**
  * Create a new entry in an a{sv} (map from string to variant)
  * with a byte array value.
@@ -348,3 +422,57 @@ _dbus_asv_add_byte_array (DBusMessageIter *arr_iter,
 
   return TRUE;
 }
+
+/**
+ * Create a new entry in an a{sv} (map from string to variant)
+ * with a 32-bit unsigned integer array value.
+ *
+ * If this function fails, the a{sv} must be abandoned, for instance
+ * with _dbus_asv_abandon().
+ *
+ * @param arr_iter the iterator which is appending to the array
+ * @param key a UTF-8 key for the map
+ * @param value the value
+ * @param n_elements the number of elements to append
+ * @returns #TRUE on success, or #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_asv_add_uint32_array (DBusMessageIter     *arr_iter,
+                            const char          *key,
+                            const dbus_uint32_t *value,
+                            int                  n_elements)
+{
+  DBusMessageIter entry_iter;
+  DBusMessageIter var_iter;
+  DBusMessageIter uint32_array_iter;
+
+  if (!_dbus_asv_open_entry (arr_iter, &entry_iter, key, "au", &var_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (&var_iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_UINT32_AS_STRING,
+                                         &uint32_array_iter))
+    {
+      _dbus_asv_abandon_entry (arr_iter, &entry_iter, &var_iter);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_append_fixed_array (&uint32_array_iter, DBUS_TYPE_UINT32,
+                                             &value, n_elements))
+    {
+      dbus_message_iter_abandon_container (&var_iter, &uint32_array_iter);
+      _dbus_asv_abandon_entry (arr_iter, &entry_iter, &var_iter);
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (&var_iter, &uint32_array_iter))
+    {
+      _dbus_asv_abandon_entry (arr_iter, &entry_iter, &var_iter);
+      return FALSE;
+    }
+
+  if (!_dbus_asv_close_entry (arr_iter, &entry_iter, &var_iter))
+    return FALSE;
+
+  return TRUE;
+}
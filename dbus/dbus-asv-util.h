@@ -39,16 +39,26 @@ void         _dbus_asv_abandon           (DBusMessageIter *iter,
 dbus_bool_t  _dbus_asv_add_uint32        (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           dbus_uint32_t    value);
+dbus_bool_t  _dbus_asv_add_uint64        (DBusMessageIter *arr_iter,
+                                          const char      *key,
+                                          dbus_uint64_t    value);
 dbus_bool_t  _dbus_asv_add_string        (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           const char      *value);
 dbus_bool_t  _dbus_asv_add_object_path   (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           const char      *value);
+dbus_bool_t  _dbus_asv_add_unix_fd       (DBusMessageIter *arr_iter,
+                                          const char      *key,
+                                          int              value);
 dbus_bool_t  _dbus_asv_add_byte_array    (DBusMessageIter *arr_iter,
                                           const char      *key,
                                           const void      *value,
                                           int              n_elements);
+dbus_bool_t  _dbus_asv_add_uint32_array  (DBusMessageIter     *arr_iter,
+                                          const char          *key,
+                                          const dbus_uint32_t *value,
+                                          int                  n_elements);
 dbus_bool_t  _dbus_asv_open_entry        (DBusMessageIter *arr_iter,
                                           DBusMessageIter *entry_iter,
                                           const char      *key,
@@ -270,6 +270,7 @@ _dbus_auth_script_run (const DBusString *filename)
   DBusAuthState state;
   DBusString context;
   DBusString guid;
+  DBusString encoded;
   
   retval = FALSE;
   auth = NULL;
@@ -293,6 +294,14 @@ _dbus_auth_script_run (const DBusString *filename)
       return FALSE;
     }
 
+  if (!_dbus_string_init (&encoded))
+    {
+      _dbus_string_free (&file);
+      _dbus_string_free (&line);
+      _dbus_string_free (&from_auth);
+      return FALSE;
+    }
+
   if (!_dbus_file_get_contents (&file, filename, &error))    {
       _dbus_warn ("Getting contents of %s failed: %s",
                   _dbus_string_get_const_data (filename), error.message);
@@ -371,6 +380,23 @@ _dbus_auth_script_run (const DBusString *filename)
           retval = TRUE;
           goto out;
         }
+#endif
+#ifndef DBUS_ENABLE_COMPRESSION
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "COMPRESSION_ONLY"))
+        {
+          /* skip this file */
+          _dbus_test_diag ("skipping auth script that needs compression");
+          retval = TRUE;
+          goto out;
+        }
+#else
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "COMPRESSION_ONLY"))
+        {
+          /* Ignore this line */
+          goto next_iteration;
+        }
 #endif
       else if (_dbus_string_starts_with_c_str (&line,
                                                "CLIENT"))
@@ -479,6 +505,84 @@ _dbus_auth_script_run (const DBusString *filename)
         {
           auth_set_unix_credentials (auth, 4312, DBUS_PID_UNSET);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "UNIX_FD_POSSIBLE"))
+        {
+          _dbus_auth_set_unix_fd_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "WANT_VALIDATED_BODIES"))
+        {
+          _dbus_auth_set_want_validated_bodies (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "VALIDATES_BODIES"))
+        {
+          _dbus_auth_set_validates_bodies (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "COMPRESSION_POSSIBLE"))
+        {
+          _dbus_auth_set_compression_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "MAX_DECODED_LENGTH"))
+        {
+          long max;
+
+          _dbus_string_delete_first_word (&line);
+
+          if (!_dbus_string_parse_int (&line, 0, &max, NULL))
+            {
+              _dbus_warn ("bad length given to MAX_DECODED_LENGTH");
+              goto parse_failed;
+            }
+
+          _dbus_auth_set_max_decoded_length (auth, max);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "ENCODE"))
+        {
+          DBusString plaintext;
+
+          _dbus_string_delete_first_word (&line);
+
+          if (!_dbus_string_init (&plaintext))
+            {
+              _dbus_warn ("no memory to allocate string");
+              goto out;
+            }
+
+          if (!append_quoted_string (&plaintext, &line))
+            {
+              _dbus_warn ("failed to append quoted string line %d",
+                          line_no);
+              _dbus_string_free (&plaintext);
+              goto out;
+            }
+
+          /* What we encode is what the peer would have sent us */
+          if (!_dbus_auth_encode_data (auth, &plaintext, &encoded))
+            {
+              _dbus_warn ("failed to encode data on line %d", line_no);
+              _dbus_string_free (&plaintext);
+              goto out;
+            }
+
+          _dbus_string_free (&plaintext);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "SEND_ENCODED"))
+        {
+          _dbus_string_delete_first_word (&line);
+
+          if (!append_quoted_string (&encoded, &line))
+            {
+              _dbus_warn ("failed to append quoted string line %d",
+                          line_no);
+              goto out;
+            }
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "ALLOWED_MECHS"))
         {
@@ -702,6 +806,84 @@ _dbus_auth_script_run (const DBusString *filename)
               goto out;
             }
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_DECODED"))
+        {
+          DBusString expected;
+          DBusString decoded;
+
+          _dbus_string_delete_first_word (&line);
+
+          if (!_dbus_string_init (&expected))
+            {
+              _dbus_warn ("no mem to allocate string expected");
+              goto out;
+            }
+
+          if (!_dbus_string_init (&decoded))
+            {
+              _dbus_warn ("no mem to allocate string decoded");
+              _dbus_string_free (&expected);
+              goto out;
+            }
+
+          if (!append_quoted_string (&expected, &line))
+            {
+              _dbus_warn ("failed to append quoted string line %d",
+                          line_no);
+              _dbus_string_free (&expected);
+              _dbus_string_free (&decoded);
+              goto out;
+            }
+
+          if (!_dbus_auth_decode_data (auth, &encoded, &decoded))
+            {
+              _dbus_warn ("failed to decode data on line %d%s", line_no,
+                          _dbus_auth_get_stream_corrupted (auth) ?
+                          ": stream corrupt" : "");
+              _dbus_string_free (&expected);
+              _dbus_string_free (&decoded);
+              goto out;
+            }
+
+          _dbus_string_set_length (&encoded, 0);
+
+          if (!_dbus_string_equal (&expected, &decoded))
+            {
+              _dbus_warn ("Expected decoded bytes '%s' and have '%s'",
+                          _dbus_string_get_const_data (&expected),
+                          _dbus_string_get_const_data (&decoded));
+              _dbus_string_free (&expected);
+              _dbus_string_free (&decoded);
+              goto out;
+            }
+
+          _dbus_string_free (&expected);
+          _dbus_string_free (&decoded);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "EXPECT_DECODE_CORRUPT"))
+        {
+          DBusString decoded;
+
+          if (!_dbus_string_init (&decoded))
+            {
+              _dbus_warn ("no mem to allocate string decoded");
+              goto out;
+            }
+
+          if (_dbus_auth_decode_data (auth, &encoded, &decoded) ||
+              !_dbus_auth_get_stream_corrupted (auth))
+            {
+              _dbus_warn ("Expected decoding to find a corrupt stream on line %d",
+                          line_no);
+              _dbus_string_free (&decoded);
+              goto out;
+            }
+
+          _dbus_string_set_length (&encoded, 0);
+          _dbus_string_free (&decoded);
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "EXPECT_HAVE_NO_CREDENTIALS"))
         {
@@ -794,6 +976,12 @@ _dbus_auth_script_run (const DBusString *filename)
         }
     }
 
+  if (_dbus_string_get_length (&encoded) > 0)
+    {
+      _dbus_warn ("script did not have EXPECT_DECODED or EXPECT_DECODE_CORRUPT for all the encoded data");
+      goto out;
+    }
+
   if (_dbus_string_get_length (&from_auth) > 0)
     {
       _dbus_warn ("script did not have EXPECT_ statements for all the data received from the DBusAuth");
@@ -810,6 +998,7 @@ _dbus_auth_script_run (const DBusString *filename)
   _dbus_string_free (&file);
   _dbus_string_free (&line);
   _dbus_string_free (&from_auth);
+  _dbus_string_free (&encoded);
   
   return retval;
 }
@@ -31,6 +31,10 @@
 #include "dbus-protocol.h"
 #include "dbus-credentials.h"
 
+#ifdef DBUS_ENABLE_COMPRESSION
+#include <zlib.h>
+#endif
+
 /**
  * @defgroup DBusAuth Authentication
  * @ingroup  DBusInternals
@@ -48,9 +52,6 @@
  * from the other end, e.g. if there's an error during
  * DBUS_COOKIE_SHA1.
  *
- * @todo the cookie keyring needs to be cached globally not just
- * per-auth (which raises threadsafety issues too)
- * 
  * @todo grep FIXME in dbus-auth.c
  */
 
@@ -126,7 +127,11 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION,
+  DBUS_AUTH_COMMAND_AGREE_COMPRESSION,
+  DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES,
+  DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES
 } DBusAuthCommand;
 
 /**
@@ -191,6 +196,38 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+  unsigned int unix_fd_pipelined : 1; /**< Client sent NEGOTIATE_UNIX_FD right
+                                       *   behind AUTH and awaits the outcome
+                                       */
+  unsigned int n_errors_to_ignore : 2; /**< Client expects this many
+                                        *   ERRORs for pipelined NEGOTIATE_*
+                                        *   commands that arrived before
+                                        *   authentication
+                                        */
+
+  unsigned int validates_bodies : 1; /**< Server validates every message it sends us */
+  unsigned int validated_bodies_wanted : 1; /**< Client would trust the server's validation */
+  unsigned int validated_bodies_pipelined : 1; /**< Client sent NEGOTIATE_VALIDATED_BODIES
+                                                *   right behind NEGOTIATE_UNIX_FD
+                                                */
+  unsigned int validated_bodies_negotiated : 1; /**< Server agreed that it validates
+                                                 *   what it sends
+                                                 */
+
+  unsigned int compression_possible : 1;   /**< This side could compress the stream */
+  unsigned int compression_negotiated : 1; /**< Compression was successfully negotiated */
+  unsigned int compression_corrupt : 1;    /**< Peer sent data we could not inflate */
+
+#ifdef DBUS_ENABLE_COMPRESSION
+  z_stream *deflater;               /**< Compresses what we send */
+  z_stream *inflater;               /**< Decompresses what we receive */
+  int deflate_level;                /**< Level @c deflater is currently set to */
+  int decode_consumed;              /**< Bytes of the block being decoded that
+                                     *   were inflated before we ran out of
+                                     *   memory
+                                     */
+  long max_decoded_length;          /**< Most that one block may inflate to */
+#endif
 };
 
 /**
@@ -234,6 +271,11 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_negotiate_compression_or_begin (DBusAuth *auth);
+static dbus_bool_t send_agree_compression    (DBusAuth *auth);
+static dbus_bool_t send_agree_validated_bodies (DBusAuth *auth);
+static dbus_bool_t continue_after_unix_fd    (DBusAuth *auth);
+static dbus_bool_t wait_for_agree_validated_bodies_or_continue (DBusAuth *auth);
 
 /**
  * Client states
@@ -272,9 +314,15 @@ static dbus_bool_t handle_client_state_waiting_for_ok     (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                                     DBusAuthCommand   command,
+                                                                     const DBusString *args);
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_validated_bodies (DBusAuth         *auth,
+                                                                          DBusAuthCommand   command,
+                                                                          const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -294,6 +342,12 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_agree_compression = {
+  "WaitingForAgreeCompression", handle_client_state_waiting_for_agree_compression
+};
+static const DBusAuthStateData client_state_waiting_for_agree_validated_bodies = {
+  "WaitingForAgreeValidatedBodies", handle_client_state_waiting_for_agree_validated_bodies
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -350,6 +404,10 @@ _dbus_auth_new (int size)
   
   auth->keyring = NULL;
   auth->cookie_id = -1;
+
+#ifdef DBUS_ENABLE_COMPRESSION
+  auth->max_decoded_length = DBUS_MAXIMUM_MESSAGE_LENGTH;
+#endif
   
   /* note that we don't use the max string length feature,
    * because you can't use that feature if you're going to
@@ -574,9 +632,9 @@ sha1_handle_first_client_response (DBusAuth         *auth,
       return FALSE;
     }
 
-  /* we cache the keyring for speed, so here we drop it if it's the
-   * wrong one. FIXME caching the keyring here is useless since we use
-   * a different DBusAuth for every connection.
+  /* we hold on to the keyring, so here we drop it if it's the
+   * wrong one; getting it again is cheap, because dbus-keyring.c
+   * caches keyrings for all DBusAuth objects in the process.
    */
   if (auth->keyring &&
       !_dbus_keyring_is_for_credentials (auth->keyring,
@@ -777,6 +835,11 @@ sha1_handle_second_client_response (DBusAuth         *auth,
                                          DBUS_CREDENTIAL_UNIX_PROCESS_ID,
                                          auth->credentials))
     goto out_3;
+
+  if (!_dbus_credentials_add_credential (auth->authorized_identity,
+                                         DBUS_CREDENTIAL_UNIX_PROCESS_FD,
+                                         auth->credentials))
+    goto out_3;
   
   if (!send_ok (auth))
     goto out_3;
@@ -1160,6 +1223,16 @@ handle_server_data_external_mech (DBusAuth         *auth,
                                              auth->credentials))
         return FALSE;
 
+      if (!_dbus_credentials_add_credential (auth->authorized_identity,
+                                             DBUS_CREDENTIAL_UNIX_PROCESS_FD,
+                                             auth->credentials))
+        return FALSE;
+
+      if (!_dbus_credentials_add_credential (auth->authorized_identity,
+                                             DBUS_CREDENTIAL_UNIX_GROUP_IDS,
+                                             auth->credentials))
+        return FALSE;
+
       if (!_dbus_credentials_add_credential (auth->authorized_identity,
                                              DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID,
                                              auth->credentials))
@@ -1273,6 +1346,11 @@ handle_server_data_anonymous_mech (DBusAuth         *auth,
                                          DBUS_CREDENTIAL_UNIX_PROCESS_ID,
                                          auth->credentials))
     return FALSE;
+
+  if (!_dbus_credentials_add_credential (auth->authorized_identity,
+                                         DBUS_CREDENTIAL_UNIX_PROCESS_FD,
+                                         auth->credentials))
+    return FALSE;
   
   /* Anonymous is always allowed */
   if (!send_ok (auth))
@@ -1406,9 +1484,10 @@ static dbus_bool_t
 send_auth (DBusAuth *auth, const DBusAuthMechanismHandler *mech)
 {
   DBusString auth_command;
+  char auth_command_buffer[128];
 
-  if (!_dbus_string_init (&auth_command))
-    return FALSE;
+  _dbus_string_init_with_buffer (&auth_command, auth_command_buffer,
+                                 sizeof (auth_command_buffer));
       
   if (!_dbus_string_append (&auth_command,
                             "AUTH "))
@@ -1628,11 +1707,19 @@ process_ok(DBusAuth *auth,
   _dbus_verbose ("Got GUID '%s' from the server\n",
                  _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
 
+  if (auth->unix_fd_pipelined)
+    {
+      /* The answer to our NEGOTIATE_UNIX_FD is already on its way */
+      auth->unix_fd_pipelined = FALSE;
+      goto_state (auth, &client_state_waiting_for_agree_unix_fd);
+      return TRUE;
+    }
+
   if (auth->unix_fd_possible)
     return send_negotiate_unix_fd(auth);
 
   _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  return send_negotiate_compression_or_begin (auth);
 }
 
 static dbus_bool_t
@@ -1654,9 +1741,10 @@ process_data (DBusAuth             *auth,
 {
   int end;
   DBusString decoded;
+  char decoded_buffer[64];
 
-  if (!_dbus_string_init (&decoded))
-    return FALSE;
+  _dbus_string_init_with_buffer (&decoded, decoded_buffer,
+                                 sizeof (decoded_buffer));
 
   if (!_dbus_string_hex_decode (args, 0, &end, &decoded, 0))
     {
@@ -1694,14 +1782,66 @@ process_data (DBusAuth             *auth,
 static dbus_bool_t
 send_negotiate_unix_fd (DBusAuth *auth)
 {
+  int orig_len = _dbus_string_get_length (&auth->outgoing);
+
   if (!_dbus_string_append (&auth->outgoing,
                             "NEGOTIATE_UNIX_FD\r\n"))
     return FALSE;
 
+  /* the answers come back together */
+  if (auth->validated_bodies_wanted)
+    {
+      if (!_dbus_string_append (&auth->outgoing,
+                                "NEGOTIATE_VALIDATED_BODIES\r\n"))
+        {
+          _dbus_string_set_length (&auth->outgoing, orig_len);
+          return FALSE;
+        }
+
+      auth->validated_bodies_pipelined = TRUE;
+    }
+
   goto_state (auth, &client_state_waiting_for_agree_unix_fd);
   return TRUE;
 }
 
+/* What a client does once the server has answered NEGOTIATE_UNIX_FD */
+static dbus_bool_t
+continue_after_unix_fd (DBusAuth *auth)
+{
+  if (auth->unix_fd_negotiated)
+    return send_begin (auth);
+  else
+    return send_negotiate_compression_or_begin (auth);
+}
+
+static dbus_bool_t
+wait_for_agree_validated_bodies_or_continue (DBusAuth *auth)
+{
+  if (auth->validated_bodies_pipelined)
+    {
+      /* The answer to our NEGOTIATE_VALIDATED_BODIES is next */
+      auth->validated_bodies_pipelined = FALSE;
+      goto_state (auth, &client_state_waiting_for_agree_validated_bodies);
+      return TRUE;
+    }
+
+  return continue_after_unix_fd (auth);
+}
+
+static dbus_bool_t
+send_agree_validated_bodies (DBusAuth *auth)
+{
+  _dbus_assert (auth->validates_bodies);
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_VALIDATED_BODIES\r\n"))
+    return FALSE;
+
+  _dbus_verbose ("Agreed that we validate what we send\n");
+  return TRUE;
+}
+
 static dbus_bool_t
 send_agree_unix_fd (DBusAuth *auth)
 {
@@ -1718,6 +1858,290 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+#ifdef DBUS_ENABLE_COMPRESSION
+/* The threshold below which a block is sent as stored rather than
+ * compressed: deflating a small header costs more than the few bytes
+ * it saves.
+ */
+#define COMPRESSION_MIN_BLOCK_SIZE 512
+
+static voidpf
+compression_alloc (voidpf opaque,
+                   uInt   items,
+                   uInt   size)
+{
+  return dbus_malloc ((size_t) items * size);
+}
+
+static void
+compression_free (voidpf opaque,
+                  voidpf address)
+{
+  dbus_free (address);
+}
+
+static void
+free_compression_streams (DBusAuth *auth)
+{
+  if (auth->deflater != NULL)
+    {
+      deflateEnd (auth->deflater);
+      dbus_free (auth->deflater);
+      auth->deflater = NULL;
+    }
+
+  if (auth->inflater != NULL)
+    {
+      inflateEnd (auth->inflater);
+      dbus_free (auth->inflater);
+      auth->inflater = NULL;
+    }
+}
+
+/* Safe to call again after it failed for lack of memory */
+static dbus_bool_t
+init_compression_streams (DBusAuth *auth)
+{
+  if (auth->deflater == NULL)
+    {
+      auth->deflater = dbus_new0 (z_stream, 1);
+
+      if (auth->deflater == NULL)
+        return FALSE;
+
+      auth->deflater->zalloc = compression_alloc;
+      auth->deflater->zfree = compression_free;
+      auth->deflate_level = Z_BEST_SPEED;
+
+      if (deflateInit (auth->deflater, auth->deflate_level) != Z_OK)
+        {
+          dbus_free (auth->deflater);
+          auth->deflater = NULL;
+          return FALSE;
+        }
+    }
+
+  if (auth->inflater == NULL)
+    {
+      auth->inflater = dbus_new0 (z_stream, 1);
+
+      if (auth->inflater == NULL)
+        return FALSE;
+
+      auth->inflater->zalloc = compression_alloc;
+      auth->inflater->zfree = compression_free;
+
+      if (inflateInit (auth->inflater) != Z_OK)
+        {
+          dbus_free (auth->inflater);
+          auth->inflater = NULL;
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Each block is compressed and flushed on its own, so that the peer
+ * can decode it as soon as it arrives. All the output space is
+ * reserved up front: once deflate() has consumed the input we could
+ * not take it back if we ran out of memory half way.
+ */
+static dbus_bool_t
+compress_data (DBusAuth         *auth,
+               const DBusString *plaintext,
+               DBusString       *encoded)
+{
+  z_stream *stream = auth->deflater;
+  int len = _dbus_string_get_length (plaintext);
+  int orig_len = _dbus_string_get_length (encoded);
+  int bound;
+  int level;
+
+  if (len == 0)
+    return TRUE;
+
+  bound = len + len / 8 + len / 64 + 128;
+
+  if (!_dbus_string_lengthen (encoded, bound))
+    return FALSE;
+
+  stream->next_in = NULL;
+  stream->avail_in = 0;
+  stream->next_out = (Bytef *) _dbus_string_get_data_len (encoded,
+                                                          orig_len, bound);
+  stream->avail_out = bound;
+
+  level = len < COMPRESSION_MIN_BLOCK_SIZE ? Z_NO_COMPRESSION : Z_BEST_SPEED;
+
+  /* deflateParams() compresses any input it is given at the old level,
+   * so the new block is only handed over once the level is set */
+  if (level != auth->deflate_level)
+    {
+      if (deflateParams (stream, level, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+          _dbus_string_set_length (encoded, orig_len);
+          return FALSE;
+        }
+
+      auth->deflate_level = level;
+    }
+
+  stream->next_in = (Bytef *) _dbus_string_get_const_data (plaintext);
+  stream->avail_in = len;
+
+  if (deflate (stream, Z_SYNC_FLUSH) != Z_OK ||
+      stream->avail_in != 0 || stream->avail_out == 0)
+    {
+      _dbus_string_set_length (encoded, orig_len);
+      return FALSE;
+    }
+
+  _dbus_string_set_length (encoded, orig_len + bound - stream->avail_out);
+  return TRUE;
+}
+
+/* Unlike compress_data(), this can fail part way through, with some
+ * output already appended to @p plaintext; we remember how much of
+ * @p encoded was consumed, so that the caller can retry with the same
+ * block once memory is available.
+ *
+ * A block that inflates to more than max_decoded_length is treated
+ * like a corrupt stream, so that a few kilobytes from the peer can't
+ * make us allocate without bound.
+ */
+static dbus_bool_t
+decompress_data (DBusAuth         *auth,
+                 const DBusString *encoded,
+                 DBusString       *plaintext)
+{
+  z_stream *stream = auth->inflater;
+  int len = _dbus_string_get_length (encoded);
+  long produced = 0;
+
+  if (auth->compression_corrupt)
+    return FALSE;
+
+  _dbus_assert (auth->decode_consumed <= len);
+
+  stream->next_in = (Bytef *) _dbus_string_get_const_data (encoded) +
+    auth->decode_consumed;
+  stream->avail_in = len - auth->decode_consumed;
+  stream->avail_out = 0;
+
+  while (stream->avail_in > 0 || stream->avail_out == 0)
+    {
+      int orig_len = _dbus_string_get_length (plaintext);
+      int chunk = 4 * (int) stream->avail_in + 4096;
+      int ret;
+
+      /* One byte more than we allow, so that we notice going over */
+      if (chunk > auth->max_decoded_length - produced + 1)
+        chunk = auth->max_decoded_length - produced + 1;
+
+      if (!_dbus_string_lengthen (plaintext, chunk))
+        {
+          auth->decode_consumed = len - stream->avail_in;
+          return FALSE;
+        }
+
+      stream->next_out = (Bytef *) _dbus_string_get_data_len (plaintext,
+                                                              orig_len, chunk);
+      stream->avail_out = chunk;
+
+      ret = inflate (stream, Z_SYNC_FLUSH);
+
+      _dbus_string_set_length (plaintext,
+                               orig_len + chunk - stream->avail_out);
+      produced += chunk - stream->avail_out;
+
+      if (produced > auth->max_decoded_length)
+        {
+          _dbus_verbose ("%s: peer's compressed block inflates to more than %ld bytes\n",
+                         DBUS_AUTH_NAME (auth), auth->max_decoded_length);
+          auth->compression_corrupt = TRUE;
+          return FALSE;
+        }
+
+      if (ret == Z_MEM_ERROR)
+        {
+          auth->decode_consumed = len - stream->avail_in;
+          return FALSE;
+        }
+      else if (ret == Z_BUF_ERROR)
+        {
+          /* No progress possible: everything we had is inflated */
+          break;
+        }
+      else if (ret != Z_OK)
+        {
+          _dbus_verbose ("%s: peer sent a corrupt compressed stream: %s\n",
+                         DBUS_AUTH_NAME (auth),
+                         stream->msg != NULL ? stream->msg : "unknown error");
+          auth->compression_corrupt = TRUE;
+          return FALSE;
+        }
+    }
+
+  auth->decode_consumed = 0;
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_COMPRESSION */
+
+static dbus_bool_t
+compression_acceptable (DBusAuth *auth)
+{
+  /* Compression is implemented as an encoding of the stream, so it
+   * can't be combined with a mechanism that has an encoding of its own,
+   * nor with unix fds, which can't be carried by an encoded stream.
+   */
+  if (!auth->compression_possible || auth->unix_fd_negotiated)
+    return FALSE;
+
+  if (auth->mech == NULL)
+    return TRUE;
+
+  if (DBUS_AUTH_IS_CLIENT (auth))
+    return auth->mech->client_encode_func == NULL;
+  else
+    return auth->mech->server_encode_func == NULL;
+}
+
+static dbus_bool_t
+send_negotiate_compression_or_begin (DBusAuth *auth)
+{
+  if (!compression_acceptable (auth))
+    return send_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_COMPRESSION zlib\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_compression);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_compression (DBusAuth *auth)
+{
+  _dbus_assert (compression_acceptable (auth));
+
+#ifdef DBUS_ENABLE_COMPRESSION
+  if (!init_compression_streams (auth))
+    return FALSE;
+#endif
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_COMPRESSION zlib\r\n"))
+    return FALSE;
+
+  auth->compression_negotiated = TRUE;
+  _dbus_verbose ("Agreed to zlib compression\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1734,18 +2158,18 @@ handle_auth (DBusAuth *auth, const DBusString *args)
       int i;
       DBusString mech;
       DBusString hex_response;
-      
+      /* "EXTERNAL" and a hex-encoded uid fit in these, so the usual
+       * AUTH doesn't allocate */
+      char mech_buffer[32];
+      char hex_response_buffer[64];
+
       _dbus_string_find_blank (args, 0, &i);
 
-      if (!_dbus_string_init (&mech))
-        return FALSE;
+      _dbus_string_init_with_buffer (&mech, mech_buffer,
+                                     sizeof (mech_buffer));
+      _dbus_string_init_with_buffer (&hex_response, hex_response_buffer,
+                                     sizeof (hex_response_buffer));
 
-      if (!_dbus_string_init (&hex_response))
-        {
-          _dbus_string_free (&mech);
-          return FALSE;
-        }
-      
       if (!_dbus_string_copy_len (args, 0, i, &mech, 0))
         goto failed;
 
@@ -1810,12 +2234,16 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1843,12 +2271,16 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1872,15 +2304,30 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
-      if (auth->unix_fd_possible)
+      if (auth->unix_fd_possible && !auth->compression_negotiated)
         return send_agree_unix_fd(auth);
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+      if (compression_acceptable (auth) &&
+          _dbus_string_equal_c_str (args, "zlib"))
+        return send_agree_compression (auth);
+      else
+        return send_error (auth, "Compression not supported or not possible on this connection");
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+      if (auth->validates_bodies)
+        return send_agree_validated_bodies (auth);
+      else
+        return send_error (auth, "Messages are not validated before being sent on this connection");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
 
@@ -2056,6 +2503,10 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2084,6 +2535,10 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2108,6 +2563,10 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -2125,12 +2584,93 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
       _dbus_verbose("Successfully negotiated UNIX FD passing\n");
-      return send_begin (auth);
+      return wait_for_agree_validated_bodies_or_continue (auth);
 
     case DBUS_AUTH_COMMAND_ERROR:
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = FALSE;
       _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      return wait_for_agree_validated_bodies_or_continue (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_validated_bodies (DBusAuth         *auth,
+                                                        DBusAuthCommand   command,
+                                                        const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
+      _dbus_assert (auth->validated_bodies_wanted);
+      auth->validated_bodies_negotiated = TRUE;
+      _dbus_verbose ("Server validates the messages it sends us\n");
+      return continue_after_unix_fd (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_verbose ("Server doesn't validate the messages it sends us\n");
+      return continue_after_unix_fd (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+      _dbus_assert (auth->compression_possible);
+
+      if (!_dbus_string_equal_c_str (args, "zlib"))
+        {
+          _dbus_verbose ("Server agreed to an unexpected compression method\n");
+          goto_state (auth, &common_state_need_disconnect);
+          return TRUE;
+        }
+
+#ifdef DBUS_ENABLE_COMPRESSION
+      if (!init_compression_streams (auth))
+        return FALSE;
+#endif
+
+      auth->compression_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated zlib compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_verbose ("Failed to negotiate compression\n");
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_OK:
@@ -2141,6 +2681,10 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES:
+    case DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2163,7 +2707,11 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "NEGOTIATE_COMPRESSION", DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION },
+  { "AGREE_COMPRESSION", DBUS_AUTH_COMMAND_AGREE_COMPRESSION },
+  { "NEGOTIATE_VALIDATED_BODIES", DBUS_AUTH_COMMAND_NEGOTIATE_VALIDATED_BODIES },
+  { "AGREE_VALIDATED_BODIES", DBUS_AUTH_COMMAND_AGREE_VALIDATED_BODIES }
 };
 
 static DBusAuthCommand
@@ -2200,6 +2748,9 @@ process_command (DBusAuth *auth)
   DBusAuthCommand command;
   DBusString line;
   DBusString args;
+  /* most commands fit in these; longer ones move to the heap */
+  char line_buffer[128];
+  char args_buffer[128];
   int eol;
   int i, j;
   dbus_bool_t retval;
@@ -2212,18 +2763,8 @@ process_command (DBusAuth *auth)
   if (!_dbus_string_find (&auth->incoming, 0, "\r\n", &eol))
     return FALSE;
   
-  if (!_dbus_string_init (&line))
-    {
-      auth->needed_memory = TRUE;
-      return FALSE;
-    }
-
-  if (!_dbus_string_init (&args))
-    {
-      _dbus_string_free (&line);
-      auth->needed_memory = TRUE;
-      return FALSE;
-    }
+  _dbus_string_init_with_buffer (&line, line_buffer, sizeof (line_buffer));
+  _dbus_string_init_with_buffer (&args, args_buffer, sizeof (args_buffer));
   
   if (!_dbus_string_copy_len (&auth->incoming, 0, eol, &line, 0))
     goto out;
@@ -2257,6 +2798,26 @@ process_command (DBusAuth *auth)
    */
   
   command = lookup_command_from_name (&line);
+
+  /* A server that didn't accept our initial AUTH straight away also
+   * answered the NEGOTIATE_UNIX_FD (and NEGOTIATE_VALIDATED_BODIES) we
+   * sent behind it, with errors that must not disturb the rest of the
+   * conversation; we'll ask again once we get an OK. */
+  if (auth->n_errors_to_ignore > 0 && command == DBUS_AUTH_COMMAND_ERROR)
+    {
+      _dbus_verbose ("%s: ignoring error for pipelined NEGOTIATE_*\n",
+                     DBUS_AUTH_NAME (auth));
+      auth->n_errors_to_ignore -= 1;
+      goto next_command;
+    }
+
+  if (auth->unix_fd_pipelined && command != DBUS_AUTH_COMMAND_OK)
+    {
+      auth->unix_fd_pipelined = FALSE;
+      auth->n_errors_to_ignore = auth->validated_bodies_pipelined ? 2 : 1;
+      auth->validated_bodies_pipelined = FALSE;
+    }
+
   if (!(* auth->state->handler) (auth, command, &args))
     goto out;
 
@@ -2335,6 +2896,11 @@ _dbus_auth_server_new (const DBusString *guid)
    */
   server_auth->failures = 0;
   server_auth->max_failures = 6;
+
+#ifdef DBUS_ENABLE_COMPRESSION
+  /* Only ever used if a client asks for it */
+  auth->compression_possible = TRUE;
+#endif
   
   return auth;
 }
@@ -2425,6 +2991,10 @@ _dbus_auth_unref (DBusAuth *auth)
       if (auth->keyring)
         _dbus_keyring_unref (auth->keyring);
 
+#ifdef DBUS_ENABLE_COMPRESSION
+      free_compression_streams (auth);
+#endif
+
       _dbus_string_free (&auth->context);
       _dbus_string_free (&auth->challenge);
       _dbus_string_free (&auth->identity);
@@ -2649,6 +3219,9 @@ _dbus_auth_needs_encoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
   
   if (auth->mech != NULL)
     {
@@ -2681,6 +3254,11 @@ _dbus_auth_encode_data (DBusAuth         *auth,
   if (auth->state != &common_state_authenticated)
     return FALSE;
   
+#ifdef DBUS_ENABLE_COMPRESSION
+  if (auth->compression_negotiated)
+    return compress_data (auth, plaintext, encoded);
+#endif
+
   if (_dbus_auth_needs_encoding (auth))
     {
       if (DBUS_AUTH_IS_CLIENT (auth))
@@ -2708,6 +3286,9 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
     
   if (auth->mech != NULL)
     {
@@ -2726,8 +3307,9 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
  * the peer. If no encoding was negotiated, just copies the bytes (you
  * can avoid this by checking _dbus_auth_needs_decoding()).
  *
- * @todo 1.0? We need to be able to distinguish "out of memory" error
- * from "the data is hosed" error.
+ * If this fails, _dbus_auth_get_stream_corrupted() tells apart running
+ * out of memory, after which the same data should be passed in again,
+ * from the peer having sent something that can't be decoded.
  *
  * @param auth the auth conversation
  * @param encoded the encoded data
@@ -2744,6 +3326,11 @@ _dbus_auth_decode_data (DBusAuth         *auth,
   if (auth->state != &common_state_authenticated)
     return FALSE;
   
+#ifdef DBUS_ENABLE_COMPRESSION
+  if (auth->compression_negotiated)
+    return decompress_data (auth, encoded, plaintext);
+#endif
+
   if (_dbus_auth_needs_decoding (auth))
     {
       if (DBUS_AUTH_IS_CLIENT (auth))
@@ -2802,6 +3389,40 @@ _dbus_auth_get_identity (DBusAuth               *auth)
     }
 }
 
+/**
+ * Puts a server's auth conversation straight into the authenticated
+ * state, for a connection that was authenticated by another process
+ * which then handed it over to us, as a message bus does when it
+ * replaces itself.
+ *
+ * @param auth the auth conversation, which must not have started
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was agreed
+ * @param validated_bodies_negotiated whether we promised to validate
+ *   everything we send
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+_dbus_auth_set_authenticated (DBusAuth        *auth,
+                              DBusCredentials *identity,
+                              dbus_bool_t      unix_fd_negotiated,
+                              dbus_bool_t      validated_bodies_negotiated)
+{
+  _dbus_assert (DBUS_AUTH_IS_SERVER (auth));
+  _dbus_assert (_dbus_string_get_length (&auth->incoming) == 0);
+
+  _dbus_credentials_clear (auth->authorized_identity);
+
+  if (!_dbus_credentials_add_credentials (auth->authorized_identity,
+                                          identity))
+    return FALSE;
+
+  auth->unix_fd_negotiated = unix_fd_negotiated;
+  auth->validated_bodies_negotiated = validated_bodies_negotiated;
+  goto_state (auth, &common_state_authenticated);
+  return TRUE;
+}
+
 /**
  * Gets the GUID from the server if we've authenticated; gets
  * #NULL otherwise.
@@ -2839,6 +3460,12 @@ _dbus_auth_set_context (DBusAuth               *auth,
  * Sets whether unix fd passing is potentially on the transport and
  * hence shall be negotiated.
  *
+ * On the client side, if the initial AUTH EXTERNAL has not been
+ * answered yet, NEGOTIATE_UNIX_FD is queued right behind it, so that
+ * OK and AGREE_UNIX_FD come back in a single round-trip. Servers
+ * answer a NEGOTIATE_UNIX_FD received before authentication with an
+ * error, which the client then ignores before falling back as usual.
+ *
  * @param auth the auth conversation
  * @param b TRUE when unix fd passing shall be negotiated, otherwise FALSE
  */
@@ -2846,6 +3473,17 @@ void
 _dbus_auth_set_unix_fd_possible(DBusAuth *auth, dbus_bool_t b)
 {
   auth->unix_fd_possible = b;
+
+  if (b && DBUS_AUTH_IS_CLIENT (auth) &&
+      auth->state == &client_state_waiting_for_data &&
+      auth->mech == &all_mechanisms[0] &&
+      !auth->unix_fd_pipelined &&
+      !auth->already_got_mechanisms)
+    {
+      /* If there's no memory, we'll just negotiate after OK instead */
+      if (_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n"))
+        auth->unix_fd_pipelined = TRUE;
+    }
 }
 
 /**
@@ -2860,6 +3498,123 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Sets whether the client would skip validating the messages it
+ * receives if the server promises to have validated them already.
+ * NEGOTIATE_VALIDATED_BODIES is only ever sent right behind
+ * NEGOTIATE_UNIX_FD, so it does not cost a round-trip of its own;
+ * call this after _dbus_auth_set_unix_fd_possible().
+ *
+ * @param auth the auth conversation
+ * @param b TRUE if the server's validation would be trusted
+ */
+void
+_dbus_auth_set_want_validated_bodies (DBusAuth    *auth,
+                                      dbus_bool_t  b)
+{
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  auth->validated_bodies_wanted = b;
+
+  if (b && auth->unix_fd_pipelined && !auth->validated_bodies_pipelined)
+    {
+      /* If there's no memory, we'll just ask after OK instead */
+      if (_dbus_string_append (&auth->outgoing,
+                               "NEGOTIATE_VALIDATED_BODIES\r\n"))
+        auth->validated_bodies_pipelined = TRUE;
+    }
+}
+
+/**
+ * Sets whether the server validates every message it sends, so that
+ * it can agree to a client's NEGOTIATE_VALIDATED_BODIES.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE if everything sent on this connection has been validated
+ */
+void
+_dbus_auth_set_validates_bodies (DBusAuth    *auth,
+                                 dbus_bool_t  b)
+{
+  _dbus_assert (DBUS_AUTH_IS_SERVER (auth));
+
+  auth->validates_bodies = b;
+}
+
+/**
+ * Queries whether the server agreed that it validates everything it
+ * sends, in which case the client need not validate it again.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if validated bodies were negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_validated_bodies_negotiated (DBusAuth *auth)
+{
+  return auth->validated_bodies_negotiated;
+}
+
+/**
+ * Sets whether the client shall ask the server to compress the stream
+ * once authenticated. Servers agree whenever libdbus was built with
+ * compression support, so this only matters on the client side. Has
+ * no effect if libdbus was built without it.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when compression shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_compression_possible (DBusAuth    *auth,
+                                     dbus_bool_t  b)
+{
+#ifdef DBUS_ENABLE_COMPRESSION
+  auth->compression_possible = b;
+#endif
+}
+
+/**
+ * Sets the most that one block passed to _dbus_auth_decode_data() may
+ * decompress to. A peer sending more than that is treated as sending
+ * a corrupt stream; see _dbus_auth_get_stream_corrupted().
+ *
+ * @param auth the auth conversation
+ * @param max the maximum length in bytes
+ */
+void
+_dbus_auth_set_max_decoded_length (DBusAuth *auth,
+                                   long      max)
+{
+#ifdef DBUS_ENABLE_COMPRESSION
+  auth->max_decoded_length = max;
+#endif
+}
+
+/**
+ * Queries whether compression was successfully negotiated.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when the stream is compressed
+ */
+dbus_bool_t
+_dbus_auth_get_compression_negotiated (DBusAuth *auth)
+{
+  return auth->compression_negotiated;
+}
+
+/**
+ * Queries whether _dbus_auth_decode_data() failed because the peer
+ * sent data that can't be decoded, rather than for lack of memory.
+ * Once this happens, the connection can't recover.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the incoming stream is corrupt
+ */
+dbus_bool_t
+_dbus_auth_get_stream_corrupted (DBusAuth *auth)
+{
+  return auth->compression_corrupt;
+}
+
 /**
  * Queries whether the given auth mechanism is supported.
  *
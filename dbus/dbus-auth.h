@@ -85,6 +85,10 @@ dbus_bool_t   _dbus_auth_set_credentials     (DBusAuth               *auth,
                                               DBusCredentials        *credentials);
 DBUS_PRIVATE_EXPORT
 DBusCredentials* _dbus_auth_get_identity     (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_set_authenticated   (DBusAuth               *auth,
+                                              DBusCredentials        *identity,
+                                              dbus_bool_t             unix_fd_negotiated,
+                                              dbus_bool_t             validated_bodies_negotiated);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_auth_set_context         (DBusAuth               *auth,
                                               const DBusString       *context);
@@ -93,6 +97,19 @@ const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
 DBUS_PRIVATE_EXPORT
+void          _dbus_auth_set_want_validated_bodies (DBusAuth         *auth,
+                                                    dbus_bool_t       b);
+DBUS_PRIVATE_EXPORT
+void          _dbus_auth_set_validates_bodies      (DBusAuth         *auth,
+                                                    dbus_bool_t       b);
+dbus_bool_t   _dbus_auth_get_validated_bodies_negotiated (DBusAuth   *auth);
+void          _dbus_auth_set_compression_possible (DBusAuth          *auth,
+                                                   dbus_bool_t        b);
+void          _dbus_auth_set_max_decoded_length (DBusAuth            *auth,
+                                                 long                 max);
+dbus_bool_t   _dbus_auth_get_compression_negotiated (DBusAuth        *auth);
+dbus_bool_t   _dbus_auth_get_stream_corrupted (DBusAuth              *auth);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_auth_is_supported_mechanism(DBusString           *name);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_auth_dump_supported_mechanisms(DBusString        *buffer);
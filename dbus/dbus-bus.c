@@ -27,11 +27,15 @@
 #include "dbus-protocol.h"
 #include "dbus-internals.h"
 #include "dbus-message.h"
+#include "dbus-pending-call.h"
+#include "dbus-pending-call-internal.h"
 #include "dbus-marshal-validate.h"
 #include "dbus-misc.h"
 #include "dbus-threads-internal.h"
 #include "dbus-connection-internal.h"
+#include "dbus-hash.h"
 #include "dbus-string.h"
+#include "dbus-transport-socket.h"
 
 /**
  * @defgroup DBusBus Message bus APIs
@@ -49,6 +53,17 @@
  * you can send the method call messages manually in the same way
  * you would any other method call message.
  *
+ * In particular, a service that would otherwise spend one round trip
+ * each on Hello, RequestName and several AddMatch calls can pipeline
+ * its whole setup. dbus_connection_open_private() does not wait for
+ * authentication to finish, and messages queued meanwhile are sent
+ * once it has. Send Hello with dbus_connection_send_with_reply(), then
+ * queue RequestName the same way and add match rules with
+ * dbus_bus_add_match() and a #NULL error, which does not block. The
+ * bus processes them in order, so they all follow Hello. When the
+ * Hello reply arrives, record the unique name with
+ * dbus_bus_set_unique_name().
+ *
  * This module is the only one in libdbus that's specific to
  * communicating with the message bus daemon. The rest of the API can
  * also be used for connecting to another application directly.
@@ -78,10 +93,23 @@ typedef struct
 {
   DBusConnection *connection; /**< Connection we're associated with */
   char *unique_name; /**< Unique name of this connection */
+  DBusHashTable *name_owners; /**< Watched bus name => #WatchedName, or #NULL */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
+  unsigned int filtering_owners : 1; /**< name_owner_filter() has been added */
 } BusData;
 
+/**
+ * The cached owner of a bus name watched with
+ * dbus_bus_watch_name_owner().
+ */
+typedef struct
+{
+  int watches;          /**< Number of calls to dbus_bus_watch_name_owner() not yet undone */
+  char *owner;          /**< Unique name of the owner, or #NULL if none */
+  dbus_uint32_t serial; /**< Serial number of the message owner came from */
+} WatchedName;
+
 /** The slot we have reserved to store BusData.
  */
 static dbus_int32_t bus_data_slot = -1;
@@ -333,12 +361,139 @@ bus_data_free (void *data)
       _DBUS_UNLOCK (bus);
     }
   
+  if (bd->name_owners != NULL)
+    _dbus_hash_table_unref (bd->name_owners);
+
   dbus_free (bd->unique_name);
   dbus_free (bd);
 
   dbus_connection_free_data_slot (&bus_data_slot);
 }
 
+static void
+watched_name_free (void *data)
+{
+  WatchedName *watched = data;
+
+  /* the hash table calls this with NULL when inserting a new key */
+  if (watched == NULL)
+    return;
+
+  dbus_free (watched->owner);
+  dbus_free (watched);
+}
+
+/* Keeps the owners of watched names up to date. The bus sends us its
+ * messages in order, so one with a lower serial number than the one
+ * the cached owner came from is older, and is ignored: that happens to
+ * signals that were queued before the GetNameOwner reply we started
+ * from. */
+static DBusHandlerResult
+name_owner_filter (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *user_data)
+{
+  const char *name, *old_owner, *new_owner;
+  WatchedName *watched;
+  BusData *bd;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!_DBUS_LOCK (bus_datas))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+
+  if (bd == NULL || bd->name_owners == NULL)
+    goto out;
+
+  watched = _dbus_hash_table_lookup_string (bd->name_owners, name);
+
+  if (watched == NULL ||
+      dbus_message_get_serial (message) < watched->serial)
+    goto out;
+
+  dbus_free (watched->owner);
+  /* If this fails, the name looks unowned until it changes again,
+   * which is the best we can do */
+  watched->owner = new_owner[0] != '\0' ? _dbus_strdup (new_owner) : NULL;
+  watched->serial = dbus_message_get_serial (message);
+
+out:
+  _DBUS_UNLOCK (bus_datas);
+  /* other filters and handlers might be interested too */
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Returns the match rule for a name's NameOwnerChanged signals */
+static char *
+name_owner_rule (const char *name)
+{
+  DBusString rule;
+  char *ret = NULL;
+
+  if (!_dbus_string_init (&rule))
+    return NULL;
+
+  if (_dbus_string_append_printf (&rule,
+          "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+          "interface='" DBUS_INTERFACE_DBUS "',"
+          "member='NameOwnerChanged',arg0='%s'", name))
+    _dbus_string_steal_data (&rule, &ret);
+
+  _dbus_string_free (&rule);
+  return ret;
+}
+
+/* Looks up a watched name. Returns #FALSE if it is not watched;
+ * otherwise returns #TRUE and sets *has_owner. If owner is not #NULL,
+ * also sets *owner to a copy of the owner, or to #NULL with error set
+ * if it has none or we are out of memory. */
+static dbus_bool_t
+get_cached_name_owner (DBusConnection  *connection,
+                       const char      *name,
+                       char           **owner,
+                       dbus_bool_t     *has_owner,
+                       DBusError       *error)
+{
+  WatchedName *watched = NULL;
+  BusData *bd;
+
+  if (!_DBUS_LOCK (bus_datas))
+    return FALSE;
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+
+  if (bd != NULL && bd->name_owners != NULL)
+    watched = _dbus_hash_table_lookup_string (bd->name_owners, name);
+
+  if (watched != NULL)
+    *has_owner = (watched->owner != NULL);
+
+  if (watched != NULL && owner != NULL)
+    {
+      *owner = NULL;
+
+      if (watched->owner == NULL)
+        dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                        "Could not get owner of name '%s': no such name",
+                        name);
+      else if ((*owner = _dbus_strdup (watched->owner)) == NULL)
+        _DBUS_SET_OOM (error);
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+  return watched != NULL;
+}
+
 static BusData*
 ensure_bus_data (DBusConnection *connection)
 {
@@ -1288,6 +1443,9 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   _dbus_return_val_if_fail (name != NULL, FALSE);
   _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
   _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (get_cached_name_owner (connection, name, NULL, &exists, NULL))
+    return exists;
   
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
@@ -1330,6 +1488,330 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   return exists;
 }
 
+/**
+ * Asks the bus for the unique name of the connection that owns a
+ * bus name. If the name is being watched with
+ * dbus_bus_watch_name_owner(), the answer comes from the cache instead,
+ * without a round trip.
+ *
+ * Like dbus_bus_name_has_owner(), this is racy: the owner can change
+ * as soon as this returns.
+ *
+ * @param connection the connection
+ * @param name the name
+ * @param error location to store any errors; if the name has no owner,
+ *  this is #DBUS_ERROR_NAME_HAS_NO_OWNER
+ * @returns the owner's unique name, to be freed with dbus_free(), or
+ *  #NULL on error
+ */
+char *
+dbus_bus_get_name_owner (DBusConnection *connection,
+                         const char     *name,
+                         DBusError      *error)
+{
+  DBusMessage *message, *reply;
+  dbus_bool_t has_owner;
+  const char *owner;
+  char *ret;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (get_cached_name_owner (connection, name, &ret, &has_owner, error))
+    return ret;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwner");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
+                                                     error);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  if (!dbus_message_get_args (reply, error,
+                              DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  ret = _dbus_strdup (owner);
+  dbus_message_unref (reply);
+
+  if (ret == NULL)
+    _DBUS_SET_OOM (error);
+
+  return ret;
+}
+
+/**
+ * Starts caching the owner of a bus name, so that
+ * dbus_bus_get_name_owner() and dbus_bus_name_has_owner() can answer
+ * for it without a round trip to the bus.
+ *
+ * The first call for a name adds a match rule for its NameOwnerChanged
+ * signal and asks the bus for its current owner, blocking until both
+ * have been answered. From then on the cache follows the signals as
+ * the connection is dispatched, so it is as up to date as the messages
+ * that have been dispatched. Each call must be balanced by a call to
+ * dbus_bus_unwatch_name_owner().
+ *
+ * @param connection the connection
+ * @param name the name to watch
+ * @param error location to store any errors
+ * @returns #TRUE on success, #FALSE with error set on failure
+ */
+dbus_bool_t
+dbus_bus_watch_name_owner (DBusConnection *connection,
+                           const char     *name,
+                           DBusError      *error)
+{
+  DBusMessage *message = NULL, *reply = NULL;
+  DBusPendingCall *pending = NULL;
+  WatchedName *watched = NULL;
+  char *key = NULL, *rule = NULL;
+  const char *owner = NULL;
+  DBusError local_error = DBUS_ERROR_INIT;
+  dbus_bool_t locked = FALSE;
+  dbus_bool_t added_match = FALSE;
+  BusData *bd;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (name != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!_DBUS_LOCK (bus_datas))
+    goto oom;
+
+  bd = ensure_bus_data (connection);
+
+  if (bd == NULL)
+    {
+      _DBUS_UNLOCK (bus_datas);
+      goto oom;
+    }
+
+  if (bd->name_owners != NULL)
+    watched = _dbus_hash_table_lookup_string (bd->name_owners, name);
+
+  if (watched != NULL)
+    {
+      watched->watches++;
+      _DBUS_UNLOCK (bus_datas);
+      return TRUE;
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  /* Match the signal first, so that no change can be missed between
+   * the owner we are told about and the first signal we see */
+  rule = name_owner_rule (name);
+
+  if (rule == NULL)
+    goto oom;
+
+  dbus_bus_add_match (connection, rule, &local_error);
+
+  if (dbus_error_is_set (&local_error))
+    goto out;
+
+  added_match = TRUE;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwner");
+
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  /* Not dbus_connection_send_with_reply_and_block(), because we need
+   * the serial number of the reply even if it is an error */
+  if (!dbus_connection_send_with_reply (connection, message, &pending, -1))
+    goto oom;
+
+  if (pending == NULL)
+    {
+      dbus_set_error (&local_error, DBUS_ERROR_DISCONNECTED,
+                      "Connection is closed");
+      goto out;
+    }
+
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (pending);
+
+  if (dbus_message_is_error (reply, DBUS_ERROR_NAME_HAS_NO_OWNER))
+    owner = NULL;
+  else if (dbus_set_error_from_message (&local_error, reply) ||
+           !dbus_message_get_args (reply, &local_error,
+                                   DBUS_TYPE_STRING, &owner,
+                                   DBUS_TYPE_INVALID))
+    goto out;
+
+  watched = dbus_new0 (WatchedName, 1);
+  key = _dbus_strdup (name);
+
+  if (watched == NULL || key == NULL)
+    goto oom;
+
+  watched->watches = 1;
+  watched->serial = dbus_message_get_serial (reply);
+
+  if (owner != NULL && (watched->owner = _dbus_strdup (owner)) == NULL)
+    goto oom;
+
+  if (!_DBUS_LOCK (bus_datas))
+    goto oom;
+
+  locked = TRUE;
+  bd = ensure_bus_data (connection);
+
+  if (bd == NULL)
+    goto oom;
+
+  if (bd->name_owners == NULL)
+    {
+      bd->name_owners = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free,
+                                              watched_name_free);
+
+      if (bd->name_owners == NULL)
+        goto oom;
+    }
+
+  if (!bd->filtering_owners)
+    {
+      if (!dbus_connection_add_filter (connection, name_owner_filter, NULL,
+                                       NULL))
+        goto oom;
+
+      bd->filtering_owners = TRUE;
+    }
+
+  if (_dbus_hash_table_lookup_string (bd->name_owners, name) != NULL)
+    {
+      /* Another thread got there first, and its match rule will do */
+      ((WatchedName *) _dbus_hash_table_lookup_string (bd->name_owners,
+                                                       name))->watches++;
+      goto out;
+    }
+
+  if (!_dbus_hash_table_insert_string (bd->name_owners, key, watched))
+    goto oom;
+
+  key = NULL;
+  watched = NULL;
+  added_match = FALSE;
+  goto out;
+
+oom:
+  _DBUS_SET_OOM (&local_error);
+
+out:
+  if (locked)
+    _DBUS_UNLOCK (bus_datas);
+
+  if (added_match)
+    dbus_bus_remove_match (connection, rule, NULL);
+
+  if (message != NULL)
+    dbus_message_unref (message);
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  watched_name_free (watched);
+  dbus_free (key);
+  dbus_free (rule);
+  if (dbus_error_is_set (&local_error))
+    {
+      dbus_move_error (&local_error, error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Undoes one call to dbus_bus_watch_name_owner(). When every call
+ * for a name has been undone, its owner is no longer cached and its
+ * match rule is removed, without waiting for the bus to reply.
+ *
+ * @param connection the connection
+ * @param name the watched name
+ */
+void
+dbus_bus_unwatch_name_owner (DBusConnection *connection,
+                             const char     *name)
+{
+  WatchedName *watched = NULL;
+  dbus_bool_t last = FALSE;
+  BusData *bd;
+  char *rule;
+
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (name != NULL);
+
+  if (!_DBUS_LOCK (bus_datas))
+    return;
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+
+  if (bd != NULL && bd->name_owners != NULL)
+    watched = _dbus_hash_table_lookup_string (bd->name_owners, name);
+
+  if (watched != NULL && --watched->watches == 0)
+    {
+      _dbus_hash_table_remove_string (bd->name_owners, name);
+      last = TRUE;
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  _dbus_return_if_fail (watched != NULL);
+
+  if (!last)
+    return;
+
+  /* If this fails, the rule stays: that costs some traffic, but is
+   * otherwise harmless */
+  rule = name_owner_rule (name);
+
+  if (rule != NULL)
+    dbus_bus_remove_match (connection, rule, NULL);
+
+  dbus_free (rule);
+}
+
 /**
  * Starts a service that will request ownership of the given name.
  * The returned result will be one of be one of
@@ -1555,6 +2037,161 @@ dbus_bus_add_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+static void
+add_matches_notify (DBusPendingCall *pending,
+                    void            *user_data)
+{
+  char **rules = user_data;
+  DBusConnection *connection;
+  DBusMessage *reply;
+  int i;
+
+  reply = dbus_pending_call_steal_reply (pending);
+
+  /* A bus older than AddMatches: add the rules one by one instead,
+   * still without waiting for the replies */
+  if (reply != NULL &&
+      dbus_message_is_error (reply, DBUS_ERROR_UNKNOWN_METHOD))
+    {
+      connection = _dbus_pending_call_get_connection_unlocked (pending);
+
+      for (i = 0; rules[i] != NULL; i++)
+        dbus_bus_add_match (connection, rules[i], NULL);
+    }
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+}
+
+/**
+ * Adds several match rules at once, in a single AddMatches call to the
+ * message bus. Each element of "rules" is the string form of a match
+ * rule, as described for dbus_bus_add_match().
+ *
+ * The bus adds either all of the rules or none of them: if any rule
+ * cannot be parsed, or adding them all would exceed the connection's
+ * quota, the call fails and no rule is added.
+ *
+ * As with dbus_bus_add_match(), if you pass #NULL for the error this
+ * function will not block, and you won't find out about errors. If
+ * you pass non-#NULL for the error it will block until the bus replies.
+ *
+ * If the bus is too old to support AddMatches, this function falls
+ * back to one AddMatch call per rule, which is not atomic: when
+ * blocking, rules before the first failing one remain added.
+ *
+ * @param connection connection to the message bus
+ * @param rules array of textual match rules
+ * @param n_rules number of elements in rules
+ * @param error location to store any errors
+ */
+void
+dbus_bus_add_matches (DBusConnection    *connection,
+                      const char *const *rules,
+                      int                n_rules,
+                      DBusError         *error)
+{
+  DBusMessage *msg;
+  DBusPendingCall *pending;
+  char **copy;
+  int i;
+
+  _dbus_return_if_fail (rules != NULL || n_rules == 0);
+  _dbus_return_if_fail (n_rules >= 0);
+
+  if (n_rules == 0)
+    return;
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      "AddMatches");
+
+  if (msg == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return;
+    }
+
+  if (!dbus_message_append_args (msg,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (msg);
+      _DBUS_SET_OOM (error);
+      return;
+    }
+
+  if (error)
+    {
+      DBusError local_error = DBUS_ERROR_INIT;
+      DBusMessage *reply;
+
+      reply = dbus_connection_send_with_reply_and_block (connection, msg,
+                                                         -1, &local_error);
+      dbus_message_unref (msg);
+
+      if (reply != NULL)
+        {
+          dbus_message_unref (reply);
+          return;
+        }
+
+      if (!dbus_error_has_name (&local_error, DBUS_ERROR_UNKNOWN_METHOD))
+        {
+          dbus_move_error (&local_error, error);
+          return;
+        }
+
+      dbus_error_free (&local_error);
+
+      for (i = 0; i < n_rules; i++)
+        {
+          dbus_bus_add_match (connection, rules[i], error);
+
+          if (dbus_error_is_set (error))
+            return;
+        }
+
+      return;
+    }
+
+  /* Without an error to report, don't block; but we still need to see
+   * the reply to know whether to fall back to AddMatch */
+  copy = dbus_new0 (char *, n_rules + 1);
+
+  if (copy == NULL)
+    goto out;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      copy[i] = _dbus_strdup (rules[i]);
+
+      if (copy[i] == NULL)
+        goto out;
+    }
+
+  if (!dbus_connection_send_with_reply (connection, msg, &pending, -1) ||
+      pending == NULL)
+    goto out;
+
+  if (!dbus_pending_call_set_notify (pending, add_matches_notify, copy,
+                                     (DBusFreeFunction) dbus_free_string_array))
+    {
+      dbus_pending_call_cancel (pending);
+      dbus_pending_call_unref (pending);
+      goto out;
+    }
+
+  copy = NULL;
+  dbus_pending_call_unref (pending);
+
+ out:
+  dbus_free_string_array (copy);
+  dbus_message_unref (msg);
+}
+
 /**
  * Removes a previously-added match rule "by value" (the most
  * recently-added identical rule gets removed).  The "rule" argument
@@ -1599,4 +2236,268 @@ dbus_bus_remove_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+#ifdef DBUS_UNIX
+static dbus_bool_t
+allow_any_unix_user (DBusConnection *connection,
+                     unsigned long   uid,
+                     void           *data)
+{
+  return TRUE;
+}
+#endif
+
+/**
+ * Sets whether the message bus may hand this connection peer
+ * connections opened by other clients with
+ * dbus_bus_open_peer_connection(). Each one arrives as a
+ * PeerConnectionOffered signal from the bus, which should be passed to
+ * dbus_bus_accept_peer_connection().
+ *
+ * As with dbus_bus_add_match(), this function blocks only if error is
+ * not #NULL.
+ *
+ * @param connection connection to the message bus
+ * @param accept #TRUE to accept peer connections
+ * @param error location to store any errors
+ */
+void
+dbus_bus_set_accept_peer_connections (DBusConnection *connection,
+                                      dbus_bool_t     accept,
+                                      DBusError      *error)
+{
+  DBusMessage *msg;
+
+  _dbus_return_if_fail (connection != NULL);
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      "AcceptPeerConnections");
+
+  if (msg == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return;
+    }
+
+  if (!dbus_message_append_args (msg, DBUS_TYPE_BOOLEAN, &accept,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (msg);
+      _DBUS_SET_OOM (error);
+      return;
+    }
+
+  send_no_return_values (connection, msg, error);
+
+  dbus_message_unref (msg);
+}
+
+/* Takes ownership of fd. If server is TRUE, we authenticate the other
+ * end of the socketpair; otherwise it authenticates us. */
+static DBusConnection *
+connection_for_peer_fd (int          fd,
+                        dbus_bool_t  server,
+                        DBusError   *error)
+{
+#ifdef DBUS_UNIX
+  DBusSocket sock = { fd };
+  DBusTransport *transport;
+  DBusConnection *peer;
+  DBusString guid = _DBUS_STRING_INIT_INVALID;
+  DBusString address;
+  DBusGUID uuid;
+
+  if (server)
+    {
+      if (!_dbus_generate_uuid (&uuid, error))
+        goto failed;
+
+      if (!_dbus_string_init (&guid) ||
+          !_dbus_uuid_encode (&uuid, &guid))
+        {
+          _DBUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  /* There is no address to reconnect to, but the client side of a
+   * transport must have one */
+  _dbus_string_init_const (&address, "peer:");
+  transport = _dbus_transport_new_for_socket (sock, server ? &guid : NULL,
+                                              server ? NULL : &address);
+  _dbus_string_free (&guid);
+
+  if (transport == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* fd now belongs to the transport */
+  peer = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  if (peer == NULL)
+    _DBUS_SET_OOM (error);
+  else if (server)
+    /* The bus already applied its policy to this connection. The
+     * initiator created the socketpair, so the credentials on it are
+     * the initiator's, for the application to check if it wants to */
+    dbus_connection_set_unix_user_function (peer, allow_any_unix_user,
+                                            NULL, NULL);
+
+  return peer;
+
+ failed:
+  _dbus_string_free (&guid);
+  _dbus_close_socket (sock, NULL);
+  return NULL;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Peer connections need Unix fd passing");
+  return NULL;
+#endif
+}
+
+/**
+ * Asks the message bus for a private connection to the owner of a
+ * name, which must have called dbus_bus_set_accept_peer_connections().
+ * Messages on it go directly between the two processes, without being
+ * copied and checked by the bus, so this suits pairs of clients that
+ * exchange a lot of messages. The bus checks its security policy once,
+ * when it sets up the connection: the caller must be allowed to send
+ * the name's owner an org.freedesktop.DBus.OpenPeerConnection method
+ * call.
+ *
+ * The result is like one from dbus_connection_open_private(): there is
+ * no bus on the other end, so the bus-specific functions such as
+ * dbus_bus_add_match() must not be used on it, and the caller must
+ * close it with dbus_connection_close() before dropping the last
+ * reference. This function always blocks.
+ *
+ * @param connection connection to the message bus
+ * @param name the name whose owner to connect to
+ * @param error location to store any errors
+ * @returns the new connection, or #NULL on error
+ */
+DBusConnection *
+dbus_bus_open_peer_connection (DBusConnection *connection,
+                               const char     *name,
+                               DBusError      *error)
+{
+#ifdef DBUS_UNIX
+  DBusSocket fds[2] = { DBUS_SOCKET_INIT, DBUS_SOCKET_INIT };
+  DBusMessage *msg, *reply;
+  int fd;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Peer connections need Unix fd passing");
+      return NULL;
+    }
+
+  /* We create the socketpair, so that the peer sees our credentials
+   * on it rather than the bus's */
+  if (!_dbus_socketpair (&fds[0], &fds[1], FALSE, error))
+    return NULL;
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      "OpenPeerConnection");
+  fd = _dbus_socket_get_int (fds[1]);
+
+  if (msg == NULL ||
+      !dbus_message_append_args (msg,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UNIX_FD, &fd,
+                                 DBUS_TYPE_INVALID))
+    {
+      if (msg != NULL)
+        dbus_message_unref (msg);
+
+      _dbus_close_socket (fds[0], NULL);
+      _dbus_close_socket (fds[1], NULL);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  /* The message holds its own duplicate of the peer's end */
+  _dbus_close_socket (fds[1], NULL);
+  reply = dbus_connection_send_with_reply_and_block (connection, msg, -1,
+                                                     error);
+  dbus_message_unref (msg);
+
+  if (reply == NULL)
+    {
+      _dbus_close_socket (fds[0], NULL);
+      return NULL;
+    }
+
+  dbus_message_unref (reply);
+  return connection_for_peer_fd (_dbus_socket_get_int (fds[0]), FALSE,
+                                 error);
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Peer connections need Unix fd passing");
+  return NULL;
+#endif
+}
+
+/**
+ * Accepts a peer connection offered by the message bus after another
+ * client called dbus_bus_open_peer_connection(). The offer is the
+ * org.freedesktop.DBus.PeerConnectionOffered signal; its first argument
+ * is the unique name of the client at the other end. No match rule is
+ * needed, because the signal is sent to this connection only.
+ *
+ * The result is a private connection, as for
+ * dbus_bus_open_peer_connection(). It still has to authenticate the
+ * other end, so dispatch it before expecting messages on it. The
+ * initiator created the socket, so once it has authenticated,
+ * dbus_connection_get_unix_user() and dbus_connection_get_unix_process_id()
+ * return the initiator's credentials. Any user is allowed to
+ * authenticate, since the bus already applied its policy.
+ *
+ * @param connection connection to the message bus
+ * @param offer the PeerConnectionOffered signal
+ * @param error location to store any errors
+ * @returns the new connection, or #NULL on error
+ */
+DBusConnection *
+dbus_bus_accept_peer_connection (DBusConnection *connection,
+                                 DBusMessage    *offer,
+                                 DBusError      *error)
+{
+  const char *initiator;
+  int fd;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (offer != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (!dbus_message_is_signal (offer, DBUS_INTERFACE_DBUS,
+                               "PeerConnectionOffered") ||
+      !dbus_message_has_sender (offer, DBUS_SERVICE_DBUS))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Not a peer connection offer from the message bus");
+      return NULL;
+    }
+
+  if (!dbus_message_get_args (offer, error,
+                              DBUS_TYPE_STRING, &initiator,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    return NULL;
+
+  return connection_for_peer_fd (fd, TRUE, error);
+}
+
 /** @} */
@@ -71,6 +71,17 @@ DBUS_EXPORT
 dbus_bool_t     dbus_bus_name_has_owner   (DBusConnection *connection,
 					   const char     *name,
 					   DBusError      *error);
+DBUS_EXPORT
+char*           dbus_bus_get_name_owner   (DBusConnection *connection,
+                                           const char     *name,
+                                           DBusError      *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_watch_name_owner (DBusConnection *connection,
+                                           const char     *name,
+                                           DBusError      *error);
+DBUS_EXPORT
+void            dbus_bus_unwatch_name_owner (DBusConnection *connection,
+                                             const char     *name);
 
 DBUS_EXPORT
 dbus_bool_t     dbus_bus_start_service_by_name (DBusConnection *connection,
@@ -84,10 +95,28 @@ void            dbus_bus_add_match        (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
 DBUS_EXPORT
+void            dbus_bus_add_matches      (DBusConnection    *connection,
+                                           const char *const *rules,
+                                           int                n_rules,
+                                           DBusError         *error);
+DBUS_EXPORT
 void            dbus_bus_remove_match     (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
 
+DBUS_EXPORT
+void            dbus_bus_set_accept_peer_connections (DBusConnection *connection,
+                                                      dbus_bool_t     accept,
+                                                      DBusError      *error);
+DBUS_EXPORT
+DBusConnection *dbus_bus_open_peer_connection   (DBusConnection *connection,
+                                                 const char     *name,
+                                                 DBusError      *error);
+DBUS_EXPORT
+DBusConnection *dbus_bus_accept_peer_connection (DBusConnection *connection,
+                                                 DBusMessage    *offer,
+                                                 DBusError      *error);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -45,6 +45,8 @@ typedef enum
 #define _DBUS_DEFAULT_TIMEOUT_VALUE (25 * 1000)
 
 typedef void (* DBusPendingFdsChangeFunction) (void *data);
+typedef void (* DBusThrottleChangeFunction) (void        *data,
+                                             dbus_bool_t  throttled);
 
 DBUS_PRIVATE_EXPORT
 void              _dbus_connection_lock                        (DBusConnection     *connection);
@@ -58,6 +60,9 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent_unlocked       (DBusConnection     *connection,
                                                                 DBusMessage        *message);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
@@ -113,10 +118,51 @@ DBUS_PRIVATE_EXPORT
 void              _dbus_connection_set_pending_fds_function       (DBusConnection *connection,
                                                                    DBusPendingFdsChangeFunction callback,
                                                                    void *data);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_throttle_function          (DBusConnection *connection,
+                                                                   DBusThrottleChangeFunction callback,
+                                                                   void *data);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_validates_bodies           (DBusConnection *connection,
+                                                                   dbus_bool_t     validates);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t       _dbus_connection_get_linux_security_label       (DBusConnection  *connection,
                                                                    char           **label_p);
+DBUS_PRIVATE_EXPORT
+DBusCredentials  *_dbus_connection_get_credentials                (DBusConnection  *connection);
+
+DBUS_PRIVATE_EXPORT
+long              _dbus_connection_get_incoming_size              (DBusConnection  *connection);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_get_pollable                   (DBusConnection  *connection,
+                                                                   DBusPollable    *fd);
+DBUS_PRIVATE_EXPORT
+int               _dbus_connection_drop_outgoing                  (DBusConnection  *connection,
+                                                                   long             max_bytes);
+DBUS_PRIVATE_EXPORT
+int               _dbus_connection_drop_superseded_signals        (DBusConnection  *connection,
+                                                                   DBusMessage     *signal);
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_replies_first             (DBusConnection  *connection,
+                                                                   dbus_bool_t      enabled);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_get_replies_first             (DBusConnection  *connection);
+
+#ifdef DBUS_UNIX
+DBUS_PRIVATE_EXPORT
+void              _dbus_connection_set_reading_paused             (DBusConnection  *connection,
+                                                                   dbus_bool_t      paused);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_can_hand_off                   (DBusConnection  *connection);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t       _dbus_connection_append_handoff                 (DBusConnection  *connection,
+                                                                   DBusMessageIter *iter);
+DBUS_PRIVATE_EXPORT
+DBusConnection   *_dbus_connection_new_from_handoff               (DBusMessageIter  *iter,
+                                                                   const DBusString *server_guid,
+                                                                   DBusError        *error);
+#endif
 
 /* if DBUS_ENABLE_STATS */
 DBUS_PRIVATE_EXPORT
@@ -131,6 +177,9 @@ void _dbus_connection_get_stats (DBusConnection *connection,
                                  dbus_uint32_t  *out_fds,
                                  dbus_uint32_t  *out_peak_bytes,
                                  dbus_uint32_t  *out_peak_fds);
+DBUS_PRIVATE_EXPORT
+void _dbus_connection_get_queue_latency (DBusConnection       *connection,
+                                         DBusLatencyHistogram *histogram);
 
 
 /* if DBUS_ENABLE_EMBEDDED_TESTS */
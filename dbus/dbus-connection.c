@@ -44,6 +44,12 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-credentials.h"
+
+#ifdef DBUS_UNIX
+#include "dbus-sysdeps-unix.h"
+#include "dbus-transport-socket.h"
+#endif
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -231,6 +237,10 @@ struct DBusMessageFilter
   DBusHandleMessageFunction function; /**< Function to call to filter */
   void *user_data; /**< User data for the function */
   DBusFreeFunction free_user_data_function; /**< Function to free the user data */
+  unsigned long position; /**< When the filter was added, relative to the others */
+  int message_type; /**< Message type to run on, or #DBUS_MESSAGE_TYPE_INVALID for any */
+  char *interface; /**< Interface to run on, or #NULL for a filter in filter_list */
+  char *member; /**< Member to run on, or #NULL for any */
 };
 
 
@@ -250,60 +260,50 @@ static dbus_bool_t _dbus_modify_sigpipe = FALSE;
 static dbus_bool_t _dbus_modify_sigpipe = TRUE;
 #endif
 
+/**
+ * Number of pending calls a connection can look up by reply serial
+ * without hashing. Serials are allocated in order and most replies
+ * arrive soon, so a pending call rarely finds its slot taken by one
+ * that is #PENDING_REPLY_WINDOW calls older. Must be a power of 2.
+ */
+#define PENDING_REPLY_WINDOW 64
+
 /**
  * Implementation details of DBusConnection. All fields are private.
  */
 struct DBusConnection
 {
+  /* Fields used for every message sent or received come first, so that
+   * a busy connection touches as few cache lines as possible; callbacks,
+   * configuration and bookkeeping for rare events follow them. */
+
   DBusAtomic refcount; /**< Reference count. */
 
   DBusRMutex *mutex; /**< Lock on the entire DBusConnection */
 
-  DBusCMutex *dispatch_mutex;     /**< Protects dispatch_acquired */
-  DBusCondVar *dispatch_cond;    /**< Notify when dispatch_acquired is available */
-  DBusCMutex *io_path_mutex;      /**< Protects io_path_acquired */
-  DBusCondVar *io_path_cond;     /**< Notify when io_path_acquired is available */
-  
+  DBusTransport *transport;    /**< Object that sends/receives messages over network. */
+
   DBusList *outgoing_messages; /**< Queue of messages we need to send, send the end of the list first. */
   DBusList *incoming_messages; /**< Queue of messages we have received, end of the list received most recently. */
   DBusList *expired_messages;  /**< Messages that will be released when we next unlock. */
 
-  DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
-                                  *   dispatch_acquired will be set by the borrower
-                                  */
-  
   int n_outgoing;              /**< Length of outgoing queue. */
   int n_incoming;              /**< Length of incoming queue. */
 
   DBusCounter *outgoing_counter; /**< Counts size of outgoing messages. */
-  
-  DBusTransport *transport;    /**< Object that sends/receives messages over network. */
-  DBusWatchList *watches;      /**< Stores active watches. */
-  DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
-  
-  DBusList *filter_list;        /**< List of filters. */
 
-  DBusRMutex *slot_mutex;        /**< Lock on slot_list so overall connection lock need not be taken */
-  DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
-
-  DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
-  
   dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
-  DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
-
-  DBusWakeupMainFunction wakeup_main_function; /**< Function to wake up the mainloop  */
-  void *wakeup_main_data; /**< Application data for wakeup_main_function */
-  DBusFreeFunction free_wakeup_main_data; /**< free wakeup_main_data */
-
-  DBusDispatchStatusFunction dispatch_status_function; /**< Function on dispatch status changes  */
-  void *dispatch_status_data; /**< Application data for dispatch_status_function */
-  DBusFreeFunction free_dispatch_status_data; /**< free dispatch_status_data */
 
   DBusDispatchStatus last_dispatch_status; /**< The last dispatch status we reported to the application. */
 
-  DBusObjectTree *objects; /**< Object path handlers registered with this connection */
+  DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
+                                  *   dispatch_acquired will be set by the borrower
+                                  */
 
-  char *server_guid; /**< GUID of server if we are in shared_connections, #NULL if server GUID is unknown or connection is private */
+  DBusCMutex *dispatch_mutex;     /**< Protects dispatch_acquired */
+  DBusCondVar *dispatch_cond;    /**< Notify when dispatch_acquired is available */
+  DBusCMutex *io_path_mutex;      /**< Protects io_path_acquired */
+  DBusCondVar *io_path_cond;     /**< Notify when io_path_acquired is available */
 
   /* These two MUST be bools and not bitfields, because they are protected by a separate lock
    * from connection->mutex and all bitfields in a word have to be read/written together.
@@ -311,7 +311,22 @@ struct DBusConnection
    */
   dbus_bool_t dispatch_acquired; /**< Someone has dispatch path (can drain incoming queue) */
   dbus_bool_t io_path_acquired;  /**< Someone has transport io path (can use the transport to read/write messages) */
-  
+
+  DBusList *filter_list;        /**< List of filters. */
+  DBusHashTable *indexed_filters; /**< Filters that only run on one interface, from interface to a DBusList ** of them, or #NULL */
+  DBusObjectTree *objects; /**< Object path handlers registered with this connection */
+  DBusPendingCall *pending_window[PENDING_REPLY_WINDOW]; /**< Pending calls by reply serial modulo #PENDING_REPLY_WINDOW */
+  int n_pending_window;            /**< Number of pending calls in pending_window */
+  DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall, for those whose window slot was taken */
+
+  DBusRMutex *slot_mutex;        /**< Lock on slot_list so overall connection lock need not be taken */
+  DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
+
+  DBusDispatchStatusFunction dispatch_status_function; /**< Function on dispatch status changes  */
+  void *dispatch_status_data; /**< Application data for dispatch_status_function */
+  DBusWakeupMainFunction wakeup_main_function; /**< Function to wake up the mainloop  */
+  void *wakeup_main_data; /**< Application data for wakeup_main_function */
+
   unsigned int shareable : 1; /**< #TRUE if libdbus owns a reference to the connection and can return it from dbus_connection_open() more than once */
   
   unsigned int exit_on_disconnect : 1; /**< If #TRUE, exit after handling disconnect signal */
@@ -325,11 +340,43 @@ struct DBusConnection
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
+
+  unsigned int wakeup_pending : 1; /**< wakeup_main_function was called and the main loop has not been back since */
+
+  unsigned int reply_timeout_added : 1;      /**< reply_timeout is in the timeout list */
+  unsigned int reply_timeout_programmed : 1; /**< reply_timeout_sec/usec hold the deadline reply_timeout fires at */
+
+  unsigned int replies_first : 1; /**< Queued replies and errors overtake queued signals from other senders */
   
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
 #endif
 
+  DBusConnectionStats stats; /**< Totals for dbus_connection_get_stats(); the queue fields are unused */
+
+  /* Rarely used from here on */
+
+  DBusWatchList *watches;      /**< Stores active watches. */
+  DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
+  
+  unsigned long n_filters_added; /**< Position of the next filter added */
+
+  DBusList *pending_timeouts;      /**< Pending calls that can time out, soonest deadline first */
+  DBusTimeout *reply_timeout;      /**< Single timeout expiring everything in pending_timeouts */
+  long reply_timeout_sec;          /**< Deadline reply_timeout is programmed for, seconds */
+  long reply_timeout_usec;         /**< Deadline reply_timeout is programmed for, microseconds */
+  
+  DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
+
+  DBusFreeFunction free_wakeup_main_data; /**< free wakeup_main_data */
+  DBusFreeFunction free_dispatch_status_data; /**< free dispatch_status_data */
+
+  char *server_guid; /**< GUID of server if we are in shared_connections, #NULL if server GUID is unknown or connection is private */
+
+#ifdef DBUS_ENABLE_STATS
+  DBusLatencyHistogram queue_latency; /**< Time messages spent in outgoing_messages before being written */
+#endif
+
 #if defined(DBUS_ENABLE_CHECKS) || defined(DBUS_ENABLE_ASSERT)
   int generation; /**< _dbus_current_generation that should correspond to this connection */
 #endif 
@@ -345,7 +392,11 @@ static DBusDispatchStatus _dbus_connection_flush_unlocked                    (DB
 static void               _dbus_connection_close_possibly_shared_and_unlock  (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
-                                                                              dbus_uint32_t       client_serial);
+                                                                              DBusPendingCall    *pending);
+static void               _dbus_connection_remove_pending_timeout_unlocked   (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending);
+static DBusPendingCall   *pending_replies_lookup                             (DBusConnection     *connection,
+                                                                              dbus_uint32_t       reply_serial);
 
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
@@ -374,7 +425,9 @@ _dbus_message_filter_unref (DBusMessageFilter *filter)
     {
       if (filter->free_user_data_function)
         (* filter->free_user_data_function) (filter->user_data);
-      
+
+      dbus_free (filter->interface);
+      dbus_free (filter->member);
       dbus_free (filter);
     }
 }
@@ -435,8 +488,15 @@ _dbus_connection_unlock (DBusConnection *connection)
 static void
 _dbus_connection_wakeup_mainloop (DBusConnection *connection)
 {
+  /* A wakeup the main loop hasn't reacted to yet already covers this */
+  if (connection->wakeup_pending)
+    return;
+
   if (connection->wakeup_main_function)
-    (*connection->wakeup_main_function) (connection->wakeup_main_data);
+    {
+      connection->wakeup_pending = TRUE;
+      (*connection->wakeup_main_function) (connection->wakeup_main_data);
+    }
 }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -494,21 +554,19 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
   reply_serial = dbus_message_get_reply_serial (message);
   if (reply_serial != 0)
     {
-      pending = _dbus_hash_table_lookup_int (connection->pending_replies,
-                                             reply_serial);
+      pending = pending_replies_lookup (connection, reply_serial);
       if (pending != NULL)
 	{
-	  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-            _dbus_connection_remove_timeout_unlocked (connection,
-                                                      _dbus_pending_call_get_timeout_unlocked (pending));
-
-	  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+	  _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+	  _dbus_pending_call_set_reply_queued_unlocked (pending, TRUE);
 	}
     }
   
   
 
   connection->n_incoming += 1;
+  connection->stats.messages_received += 1;
+  connection->stats.bytes_received += _dbus_message_get_size (message);
 
   _dbus_connection_wakeup_mainloop (connection);
   
@@ -613,6 +671,41 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets up to max_messages of the messages that are next in line to
+ * be sent, in the order they will be sent, so that the transport can
+ * write several at once. The first one is the message
+ * _dbus_connection_get_message_to_send() would return. They remain
+ * in the outgoing queue until _dbus_connection_message_sent_unlocked()
+ * is called for each, in order.
+ *
+ * @param connection the connection.
+ * @param messages array to fill in
+ * @param max_messages size of the array
+ * @returns number of messages filled in
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  int n;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  while (link != NULL && n < max_messages)
+    {
+      messages[n++] = link->data;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n;
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -644,6 +737,21 @@ _dbus_connection_message_sent_unlocked (DBusConnection *connection,
 
   connection->n_outgoing -= 1;
 
+  /* This is also how the queue is emptied on disconnection, but
+   * those messages were never written */
+  if (_dbus_transport_get_is_connected (connection->transport))
+    {
+      connection->stats.messages_sent += 1;
+      connection->stats.bytes_sent += _dbus_message_get_size (message);
+
+#ifdef DBUS_ENABLE_STATS
+      if (_dbus_message_get_locked_usec (message) != 0)
+        _dbus_latency_histogram_add (&connection->queue_latency,
+                                     _dbus_get_monotonic_usec () -
+                                     _dbus_message_get_locked_usec (message));
+#endif
+    }
+
   _dbus_verbose ("Message %p (%s %s %s %s '%s') removed from outgoing queue %p, %d left to send\n",
                  message,
                  dbus_message_type_to_string (dbus_message_get_type (message)),
@@ -912,143 +1020,384 @@ _dbus_connection_toggle_timeout_unlocked (DBusConnection   *connection,
                             enabled);
 }
 
+/* TRUE if deadline a is strictly later than deadline b */
 static dbus_bool_t
-_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
-                                               DBusPendingCall *pending)
+deadline_after (long a_sec,
+                long a_usec,
+                long b_sec,
+                long b_usec)
 {
-  dbus_uint32_t reply_serial;
-  DBusTimeout *timeout;
+  return a_sec > b_sec || (a_sec == b_sec && a_usec > b_usec);
+}
 
-  HAVE_LOCK_CHECK (connection);
+/*
+ * Points reply_timeout at the earliest deadline in pending_timeouts.
+ * The timeout is only in the connection's timeout list while some
+ * pending call can time out, as the per-call timeouts used to be.
+ * While it is in the list its interval can only change by toggling
+ * it, so that the main loop sees the change; that costs nothing when
+ * the head deadline is the one already programmed, the common case.
+ */
+static dbus_bool_t
+reply_timeout_reprogram_unlocked (DBusConnection *connection)
+{
+  DBusPendingCall *first;
+  long deadline_sec, deadline_usec;
+  long now_sec, now_usec;
+  long interval;
 
-  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+  first = _dbus_list_get_first (&connection->pending_timeouts);
 
-  _dbus_assert (reply_serial != 0);
+  if (first == NULL)
+    {
+      connection->reply_timeout_programmed = FALSE;
+
+      if (connection->reply_timeout_added)
+        {
+          connection->reply_timeout_added = FALSE;
+          _dbus_connection_remove_timeout_unlocked (connection,
+                                                    connection->reply_timeout);
+        }
+
+      return TRUE;
+    }
 
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  _dbus_pending_call_get_deadline_unlocked (first, &deadline_sec,
+                                            &deadline_usec);
 
-  if (timeout)
+  if (connection->reply_timeout_programmed &&
+      !deadline_after (connection->reply_timeout_sec,
+                       connection->reply_timeout_usec,
+                       deadline_sec, deadline_usec))
+    return TRUE;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  /* Round up so that the timeout never fires before the deadline */
+  interval = (deadline_sec - now_sec) * 1000 +
+    (deadline_usec - now_usec + 999) / 1000;
+
+  if (interval < 0)
+    interval = 0;
+
+  if (connection->reply_timeout_added)
+    {
+      _dbus_connection_toggle_timeout_unlocked (connection,
+                                                connection->reply_timeout,
+                                                FALSE);
+      _dbus_timeout_set_interval (connection->reply_timeout, interval);
+      _dbus_connection_toggle_timeout_unlocked (connection,
+                                                connection->reply_timeout,
+                                                TRUE);
+    }
+  else
     {
-      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
+      _dbus_timeout_set_interval (connection->reply_timeout, interval);
+
+      if (!_dbus_connection_add_timeout_unlocked (connection,
+                                                  connection->reply_timeout))
         return FALSE;
-      
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          _dbus_connection_remove_timeout_unlocked (connection, timeout);
 
-          _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+      connection->reply_timeout_added = TRUE;
+    }
+
+  connection->reply_timeout_sec = deadline_sec;
+  connection->reply_timeout_usec = deadline_usec;
+  connection->reply_timeout_programmed = TRUE;
+
+  return TRUE;
+}
+
+static dbus_bool_t
+_dbus_connection_add_pending_timeout_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  DBusList *link;
+  long deadline_sec, deadline_usec;
+  long sec, usec;
+  int interval;
+
+  interval = _dbus_pending_call_get_timeout_interval_unlocked (pending);
+  _dbus_assert (interval != DBUS_TIMEOUT_INFINITE);
+
+  _dbus_get_monotonic_time (&deadline_sec, &deadline_usec);
+  deadline_sec += interval / 1000;
+  deadline_usec += (interval % 1000) * 1000;
+
+  if (deadline_usec >= 1000000)
+    {
+      deadline_sec += 1;
+      deadline_usec -= 1000000;
+    }
+
+  /* Most calls use the default timeout, so the new deadline nearly
+   * always belongs at the end and the scan stops straight away.
+   */
+  link = _dbus_list_get_last_link (&connection->pending_timeouts);
+
+  while (link != NULL)
+    {
+      _dbus_pending_call_get_deadline_unlocked (link->data, &sec, &usec);
+
+      if (!deadline_after (sec, usec, deadline_sec, deadline_usec))
+        break;
+
+      link = _dbus_list_get_prev_link (&connection->pending_timeouts, link);
+    }
+
+  if (link == NULL)
+    {
+      if (!_dbus_list_prepend (&connection->pending_timeouts, pending))
+        return FALSE;
     }
   else
     {
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
+      if (!_dbus_list_insert_after (&connection->pending_timeouts, link,
+                                    pending))
+        return FALSE;
     }
 
-  _dbus_pending_call_ref_unlocked (pending);
+  _dbus_pending_call_set_deadline_unlocked (pending, deadline_sec,
+                                            deadline_usec);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+
+  if (!reply_timeout_reprogram_unlocked (connection))
+    {
+      _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+      return FALSE;
+    }
 
-  HAVE_LOCK_CHECK (connection);
-  
   return TRUE;
 }
 
 static void
-free_pending_call_on_hash_removal (void *data)
+_dbus_connection_remove_pending_timeout_unlocked (DBusConnection  *connection,
+                                                  DBusPendingCall *pending)
 {
-  DBusPendingCall *pending;
-  DBusConnection  *connection;
-  
-  if (data == NULL)
+  if (!_dbus_pending_call_is_timeout_added_unlocked (pending))
     return;
 
-  pending = data;
+  /* Replies mostly arrive in the order the calls were made, so this
+   * usually finds the pending call at the head of the list.
+   * reply_timeout is left armed for an earlier deadline than it needs
+   * until it fires, unless there is nothing left for it to expire.
+   */
+  _dbus_list_remove (&connection->pending_timeouts, pending);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
 
-  connection = _dbus_pending_call_get_connection_unlocked (pending);
+  if (connection->pending_timeouts == NULL)
+    reply_timeout_reprogram_unlocked (connection);
+}
 
-  HAVE_LOCK_CHECK (connection);
-  
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
+static dbus_bool_t
+reply_timeout_expired (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+  DBusPendingCall *pending;
+  long now_sec, now_usec;
+  long sec, usec;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  /* Time out every call whose deadline has passed, in one go */
+  while ((pending = _dbus_list_get_first (&connection->pending_timeouts)) != NULL)
     {
-      _dbus_connection_remove_timeout_unlocked (connection,
-                                                _dbus_pending_call_get_timeout_unlocked (pending));
-      
+      _dbus_pending_call_get_deadline_unlocked (pending, &sec, &usec);
+
+      if (deadline_after (sec, usec, now_sec, now_usec))
+        break;
+
+      _dbus_list_pop_first (&connection->pending_timeouts);
       _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+      _dbus_pending_call_queue_timeout_error_unlocked (pending, connection);
     }
 
-  /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
-   * here, but the pending call finalizer could in principle call out to 
-   * application code so we pretty much have to... some larger code reorg 
-   * might be needed.
-   */
-  _dbus_connection_ref_unlocked (connection);
-  _dbus_pending_call_unref_and_unlock (pending);
-  CONNECTION_LOCK (connection);
-  _dbus_connection_unref_unlocked (connection);
+  /* The timeout would otherwise repeat at its old interval; it is
+   * still in the timeout list, so reprogramming it cannot fail */
+  connection->reply_timeout_programmed = FALSE;
+  reply_timeout_reprogram_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+  dbus_connection_unref (connection);
+
+  return TRUE;
 }
 
-static void
-_dbus_connection_detach_pending_call_unlocked (DBusConnection  *connection,
-                                               DBusPendingCall *pending)
+static DBusPendingCall **
+pending_window_slot (DBusConnection *connection,
+                     dbus_uint32_t   reply_serial)
 {
-  /* This ends up unlocking to call the pending call finalizer, which is unexpected to
-   * say the least.
-   */
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+  return &connection->pending_window[reply_serial & (PENDING_REPLY_WINDOW - 1)];
 }
 
-static void
-_dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
-                                                 DBusPendingCall *pending)
+static DBusPendingCall *
+pending_replies_lookup (DBusConnection *connection,
+                        dbus_uint32_t   reply_serial)
 {
-  /* The idea here is to avoid finalizing the pending call
-   * with the lock held, since there's a destroy notifier
-   * in pending call that goes out to application code.
-   *
-   * There's an extra unlock inside the hash table
-   * "free pending call" function FIXME...
-   */
-  _dbus_pending_call_ref_unlocked (pending);
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
-
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-      _dbus_connection_remove_timeout_unlocked (connection,
-              _dbus_pending_call_get_timeout_unlocked (pending));
+  DBusPendingCall *pending = *pending_window_slot (connection, reply_serial);
 
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  if (pending != NULL &&
+      _dbus_pending_call_get_reply_serial_unlocked (pending) == reply_serial)
+    return pending;
 
-  _dbus_pending_call_unref_and_unlock (pending);
+  return _dbus_hash_table_lookup_int (connection->pending_replies,
+                                      reply_serial);
 }
 
-/**
- * Removes a pending call from the connection, such that
- * the pending reply will be ignored. May drop the last
- * reference to the pending call.
- *
- * @param connection the connection
- * @param pending the pending call
- */
-void
-_dbus_connection_remove_pending_call (DBusConnection  *connection,
-                                      DBusPendingCall *pending)
+static int
+pending_replies_count (DBusConnection *connection)
 {
-  CONNECTION_LOCK (connection);
-  _dbus_connection_detach_pending_call_and_unlock (connection, pending);
+  return connection->n_pending_window +
+    _dbus_hash_table_get_n_entries (connection->pending_replies);
 }
 
-/**
+static void free_pending_call_on_removal (void *data);
+
+/* May drop the lock to finalize the pending call */
+static void
+pending_replies_remove (DBusConnection *connection,
+                        dbus_uint32_t   reply_serial)
+{
+  DBusPendingCall **slot = pending_window_slot (connection, reply_serial);
+  DBusPendingCall *pending = *slot;
+
+  if (pending != NULL &&
+      _dbus_pending_call_get_reply_serial_unlocked (pending) == reply_serial)
+    {
+      *slot = NULL;
+      connection->n_pending_window -= 1;
+      free_pending_call_on_removal (pending);
+    }
+  else
+    {
+      _dbus_hash_table_remove_int (connection->pending_replies, reply_serial);
+    }
+}
+
+static dbus_bool_t
+_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  dbus_uint32_t reply_serial;
+
+  HAVE_LOCK_CHECK (connection);
+
+  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+
+  _dbus_assert (reply_serial != 0);
+
+  if (_dbus_pending_call_get_timeout_interval_unlocked (pending) !=
+      DBUS_TIMEOUT_INFINITE &&
+      !_dbus_connection_add_pending_timeout_unlocked (connection, pending))
+    {
+      HAVE_LOCK_CHECK (connection);
+      return FALSE;
+    }
+
+  if (*pending_window_slot (connection, reply_serial) == NULL)
+    {
+      *pending_window_slot (connection, reply_serial) = pending;
+      connection->n_pending_window += 1;
+    }
+  else if (!_dbus_hash_table_insert_int (connection->pending_replies,
+                                         reply_serial,
+                                         pending))
+    {
+      _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+      HAVE_LOCK_CHECK (connection);
+      return FALSE;
+    }
+
+  _dbus_pending_call_ref_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  return TRUE;
+}
+
+static void
+free_pending_call_on_removal (void *data)
+{
+  DBusPendingCall *pending;
+  DBusConnection  *connection;
+  
+  if (data == NULL)
+    return;
+
+  pending = data;
+
+  connection = _dbus_pending_call_get_connection_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+
+  /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
+   * here, but the pending call finalizer could in principle call out to 
+   * application code so we pretty much have to... some larger code reorg 
+   * might be needed.
+   */
+  _dbus_connection_ref_unlocked (connection);
+  _dbus_pending_call_unref_and_unlock (pending);
+  CONNECTION_LOCK (connection);
+  _dbus_connection_unref_unlocked (connection);
+}
+
+static void
+_dbus_connection_detach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  /* This ends up unlocking to call the pending call finalizer, which is unexpected to
+   * say the least.
+   */
+  pending_replies_remove (connection,
+                          _dbus_pending_call_get_reply_serial_unlocked (pending));
+}
+
+static void
+_dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
+                                                 DBusPendingCall *pending)
+{
+  /* The idea here is to avoid finalizing the pending call
+   * with the lock held, since there's a destroy notifier
+   * in pending call that goes out to application code.
+   *
+   * There's an extra unlock inside the hash table
+   * "free pending call" function FIXME...
+   */
+  _dbus_pending_call_ref_unlocked (pending);
+  pending_replies_remove (connection,
+                          _dbus_pending_call_get_reply_serial_unlocked (pending));
+
+  _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+
+  _dbus_pending_call_unref_and_unlock (pending);
+}
+
+/**
+ * Removes a pending call from the connection, such that
+ * the pending reply will be ignored. May drop the last
+ * reference to the pending call.
+ *
+ * @param connection the connection
+ * @param pending the pending call
+ */
+void
+_dbus_connection_remove_pending_call (DBusConnection  *connection,
+                                      DBusPendingCall *pending)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_connection_detach_pending_call_and_unlock (connection, pending);
+}
+
+/**
  * Acquire the transporter I/O path. This must be done before
  * doing any I/O in the transporter. May sleep and drop the
  * IO path mutex while waiting for the I/O path.
@@ -1065,6 +1414,28 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
   
   HAVE_LOCK_CHECK (connection);
 
+  if (timeout_milliseconds == 0)
+    {
+      /* Just trying, as dbus_connection_send() does for every message.
+       * The io_path_mutex nests inside our lock (see
+       * _dbus_connection_release_io_path()), so there is no need to drop
+       * the lock, letting every other sending thread in before we get it
+       * back, only to find the I/O path busy. If it is, the message stays
+       * queued for the thread holding the I/O path to write out.
+       */
+      _dbus_cmutex_lock (connection->io_path_mutex);
+
+      we_acquired = !connection->io_path_acquired;
+      connection->io_path_acquired = TRUE;
+
+      _dbus_cmutex_unlock (connection->io_path_mutex);
+
+      _dbus_verbose ("tried connection->io_path_acquired, we_acquired = %d\n",
+                     we_acquired);
+
+      return we_acquired;
+    }
+
   /* We don't want the connection to vanish */
   _dbus_connection_ref_unlocked (connection);
 
@@ -1217,8 +1588,7 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
           _dbus_verbose ("pending call completed while acquiring I/O path");
         }
       else if ( (pending != NULL) &&
-                _dbus_connection_peek_for_reply_unlocked (connection,
-                                                          _dbus_pending_call_get_reply_serial_unlocked (pending)))
+                _dbus_connection_peek_for_reply_unlocked (connection, pending))
         {
           _dbus_verbose ("pending call completed while acquiring I/O path (reply found in queue)");
         }
@@ -1256,11 +1626,13 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   DBusMessage *disconnect_message;
   DBusCounter *outgoing_counter;
   DBusObjectTree *objects;
+  DBusTimeout *reply_timeout;
   
   watch_list = NULL;
   connection = NULL;
   pending_replies = NULL;
   timeout_list = NULL;
+  reply_timeout = NULL;
   disconnect_link = NULL;
   disconnect_message = NULL;
   outgoing_counter = NULL;
@@ -1277,7 +1649,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   pending_replies =
     _dbus_hash_table_new (DBUS_HASH_INT,
 			  NULL,
-                          (DBusFreeFunction)free_pending_call_on_hash_removal);
+                          (DBusFreeFunction)free_pending_call_on_removal);
   if (pending_replies == NULL)
     goto error;
   
@@ -1309,6 +1681,15 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (connection->slot_mutex == NULL)
     goto error;
 
+  /* One timeout covers every pending call; it is only added to the
+   * timeout list once a call that can time out is attached.
+   */
+  reply_timeout = _dbus_timeout_new (_DBUS_DEFAULT_TIMEOUT_VALUE,
+                                     reply_timeout_expired,
+                                     connection, NULL);
+  if (reply_timeout == NULL)
+    goto error;
+
   disconnect_message = dbus_message_new_signal (DBUS_PATH_LOCAL,
                                                 DBUS_INTERFACE_LOCAL,
                                                 "Disconnected");
@@ -1336,6 +1717,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->transport = transport;
   connection->watches = watch_list;
   connection->timeouts = timeout_list;
+  connection->reply_timeout = reply_timeout;
   connection->pending_replies = pending_replies;
   connection->outgoing_counter = outgoing_counter;
   connection->filter_list = NULL;
@@ -1399,6 +1781,9 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (timeout_list)
     _dbus_timeout_list_free (timeout_list);
 
+  if (reply_timeout)
+    _dbus_timeout_unref (reply_timeout);
+
   if (outgoing_counter)
     _dbus_counter_unref (outgoing_counter);
 
@@ -1497,6 +1882,8 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
   
   CONNECTION_LOCK (connection);
 
+  connection->wakeup_pending = FALSE;
+
   if (!_dbus_connection_acquire_io_path (connection, 1))
     {
       /* another thread is handling the message */
@@ -1989,18 +2376,64 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   return NULL;
 }
 
-/* Called with lock held, does not update dispatch status */
+static dbus_bool_t header_strings_equal (const char *a,
+                                         const char *b);
+
+/*
+ * Find the link that a reply or error should be queued just ahead of,
+ * for a connection with replies_first set: the newest message that it
+ * may not overtake. It may overtake signals, but not those from its
+ * own sender, whose messages must arrive in the order they were sent,
+ * nor those from the message bus, which announce changes of name
+ * ownership that a caller might need to see before the reply. It never
+ * overtakes the message that is next in line to be sent, since that
+ * might have been partly written. Returns NULL if the queue is empty.
+ */
+static DBusList *
+find_reply_queue_position (DBusConnection *connection,
+                           DBusMessage    *reply)
+{
+  const char *sender = dbus_message_get_sender (reply);
+  DBusList *last = _dbus_list_get_last_link (&connection->outgoing_messages);
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&connection->outgoing_messages);
+       link != last;
+       link = _dbus_list_get_next_link (&connection->outgoing_messages, link))
+    {
+      DBusMessage *queued = link->data;
+      const char *queued_sender = dbus_message_get_sender (queued);
+
+      if (dbus_message_get_type (queued) != DBUS_MESSAGE_TYPE_SIGNAL ||
+          header_strings_equal (queued_sender, sender) ||
+          header_strings_equal (queued_sender, DBUS_SERVICE_DBUS))
+        break;
+    }
+
+  return link;
+}
+
+/* Called with lock held, only puts the message on the outgoing queue */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+_dbus_connection_queue_preallocated_unlocked (DBusConnection       *connection,
+                                              DBusPreallocatedSend *preallocated,
+                                              DBusMessage          *message,
+                                              dbus_uint32_t        *client_serial)
 {
   dbus_uint32_t serial;
 
   preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
+
+  if (connection->replies_first &&
+      (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+       dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR))
+    _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                   find_reply_queue_position (connection,
+                                                              message),
+                                   preallocated->queue_link);
+  else
+    _dbus_list_prepend_link (&connection->outgoing_messages,
+                             preallocated->queue_link);
 
   /* It's OK that we'll never call the notify function, because for the
    * outgoing limit, there isn't one */
@@ -2051,6 +2484,16 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
   
   dbus_message_lock (message);
 
+  /* If it has to wait behind other messages, it might wait a long time
+   * for a slow reader, so don't let it hold on to spare buffer space */
+  if (connection->n_outgoing > 1)
+    _dbus_message_compact (message);
+}
+
+/* Called with lock held, tries to write out whatever has been queued */
+static void
+_dbus_connection_write_queued_unlocked (DBusConnection *connection)
+{
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
    */
@@ -2064,6 +2507,18 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
     _dbus_connection_wakeup_mainloop (connection);
 }
 
+/* Called with lock held, does not update dispatch status */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  _dbus_connection_queue_preallocated_unlocked (connection, preallocated,
+                                                message, client_serial);
+  _dbus_connection_write_queued_unlocked (connection);
+}
+
 static void
 _dbus_connection_send_preallocated_and_unlock (DBusConnection       *connection,
 					       DBusPreallocatedSend *preallocated,
@@ -2229,15 +2684,24 @@ generate_local_error_message (dbus_uint32_t serial,
 }
 
 /*
- * Peek the incoming queue to see if we got reply for a specific serial
+ * Find the reply to a pending call in the incoming queue. The queue
+ * is only searched if a reply has arrived since it was last searched
+ * in vain, so that a caller blocking behind a long backlog of other
+ * messages doesn't pay for walking it on every wakeup.
  */
-static dbus_bool_t
-_dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
-                                          dbus_uint32_t   client_serial)
+static DBusList *
+find_reply_link_unlocked (DBusConnection  *connection,
+                          DBusPendingCall *pending)
 {
   DBusList *link;
+  dbus_uint32_t client_serial;
+
   HAVE_LOCK_CHECK (connection);
 
+  if (!_dbus_pending_call_get_reply_queued_unlocked (pending))
+    return NULL;
+
+  client_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
   link = _dbus_list_get_first_link (&connection->incoming_messages);
 
   while (link != NULL)
@@ -2245,13 +2709,30 @@ _dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
       DBusMessage *reply = link->data;
 
       if (dbus_message_get_reply_serial (reply) == client_serial)
-        {
-          _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME, client_serial);
-          return TRUE;
-        }
+        return link;
+
       link = _dbus_list_get_next_link (&connection->incoming_messages, link);
     }
 
+  /* Someone else popped it */
+  _dbus_pending_call_set_reply_queued_unlocked (pending, FALSE);
+  return NULL;
+}
+
+/*
+ * Peek the incoming queue to see if we got the reply to a pending call
+ */
+static dbus_bool_t
+_dbus_connection_peek_for_reply_unlocked (DBusConnection  *connection,
+                                          DBusPendingCall *pending)
+{
+  if (find_reply_link_unlocked (connection, pending) != NULL)
+    {
+      _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME,
+                     _dbus_pending_call_get_reply_serial_unlocked (pending));
+      return TRUE;
+    }
+
   return FALSE;
 }
 
@@ -2259,58 +2740,60 @@ _dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
  * the dispatch lock.
  */
 static DBusMessage*
-check_for_reply_unlocked (DBusConnection *connection,
-                          dbus_uint32_t   client_serial)
+check_for_reply_unlocked (DBusConnection  *connection,
+                          DBusPendingCall *pending)
 {
   DBusList *link;
+  DBusMessage *reply;
 
-  HAVE_LOCK_CHECK (connection);
-  
-  link = _dbus_list_get_first_link (&connection->incoming_messages);
-
-  while (link != NULL)
-    {
-      DBusMessage *reply = link->data;
+  link = find_reply_link_unlocked (connection, pending);
 
-      if (dbus_message_get_reply_serial (reply) == client_serial)
-	{
-	  _dbus_list_remove_link (&connection->incoming_messages, link);
-	  connection->n_incoming  -= 1;
-	  return reply;
-	}
-      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
-    }
+  if (link == NULL)
+    return NULL;
 
-  return NULL;
+  reply = link->data;
+  _dbus_list_remove_link (&connection->incoming_messages, link);
+  connection->n_incoming  -= 1;
+  _dbus_pending_call_set_reply_queued_unlocked (pending, FALSE);
+  return reply;
 }
 
 static void
 connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *connection)
 {
-   /* We can't iterate over the hash in the normal way since we'll be
-    * dropping the lock for each item. So we restart the
-    * iter each time as we drain the hash table.
+   /* We can't iterate over the hash or the window in the normal way
+    * since we'll be dropping the lock for each item. So we restart
+    * from the beginning each time as we drain them.
     */
    
-   while (_dbus_hash_table_get_n_entries (connection->pending_replies) > 0)
+   while (pending_replies_count (connection) > 0)
     {
-      DBusPendingCall *pending;
-      DBusHashIter iter;
-      
-      _dbus_hash_iter_init (connection->pending_replies, &iter);
-      _dbus_hash_iter_next (&iter);
-       
-      pending = _dbus_hash_iter_get_value (&iter);
+      DBusPendingCall *pending = NULL;
+      int i;
+
+      for (i = 0; pending == NULL && connection->n_pending_window > 0; i++)
+        {
+          _dbus_assert (i < PENDING_REPLY_WINDOW);
+          pending = connection->pending_window[i];
+        }
+
+      if (pending == NULL)
+        {
+          DBusHashIter iter;
+
+          _dbus_hash_iter_init (connection->pending_replies, &iter);
+          _dbus_hash_iter_next (&iter);
+          pending = _dbus_hash_iter_get_value (&iter);
+        }
+
       _dbus_pending_call_ref_unlocked (pending);
        
       _dbus_pending_call_queue_timeout_error_unlocked (pending, 
                                                        connection);
 
-      if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-          _dbus_connection_remove_timeout_unlocked (connection,
-                                                    _dbus_pending_call_get_timeout_unlocked (pending));
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);       
-      _dbus_hash_iter_remove_entry (&iter);
+      _dbus_connection_remove_pending_timeout_unlocked (connection, pending);
+      pending_replies_remove (connection,
+                              _dbus_pending_call_get_reply_serial_unlocked (pending));
 
       _dbus_pending_call_unref_and_unlock (pending);
       CONNECTION_LOCK (connection);
@@ -2339,8 +2822,7 @@ check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
   DBusMessage *reply;
   DBusDispatchStatus status;
 
-  reply = check_for_reply_unlocked (connection, 
-                                    _dbus_pending_call_get_reply_serial_unlocked (pending));
+  reply = check_for_reply_unlocked (connection, pending);
   if (reply != NULL)
     {
       _dbus_verbose ("checked for reply\n");
@@ -2361,29 +2843,14 @@ check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
   return FALSE;
 }
 
-/**
- * Blocks until a pending call times out or gets a reply.
- *
- * Does not re-enter the main loop or run filter/path-registered
- * callbacks. The reply to the message will not be seen by
- * filter callbacks.
- *
- * Returns immediately if pending call already got a reply.
- * 
- * @todo could use performance improvements (it keeps scanning
- * the whole message queue for example)
- *
- * @param pending the pending call we block for a reply on
- */
-void
-_dbus_connection_block_pending_call (DBusPendingCall *pending)
+static void
+connection_block_pending_call (DBusPendingCall *pending)
 {
   long start_tv_sec, start_tv_usec;
   long tv_sec, tv_usec;
   DBusDispatchStatus status;
   DBusConnection *connection;
   dbus_uint32_t client_serial;
-  DBusTimeout *timeout;
   int timeout_milliseconds, elapsed_milliseconds;
 
   _dbus_assert (pending != NULL);
@@ -2404,12 +2871,10 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
    * in _dbus_pending_call_new() so overflows aren't possible
    * below
    */
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  timeout_milliseconds = _dbus_pending_call_get_timeout_interval_unlocked (pending);
   _dbus_get_monotonic_time (&start_tv_sec, &start_tv_usec);
-  if (timeout)
+  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
     {
-      timeout_milliseconds = dbus_timeout_get_interval (timeout);
-
       _dbus_verbose ("dbus_connection_send_with_reply_and_block(): will block %d milliseconds for reply serial %u from %ld sec %ld usec\n",
                      timeout_milliseconds,
                      client_serial,
@@ -2483,7 +2948,7 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
     }
   else if (connection->disconnect_message_link == NULL)
     _dbus_verbose ("dbus_connection_send_with_reply_and_block(): disconnected\n");
-  else if (timeout == NULL)
+  else if (timeout_milliseconds == -1)
     {
        if (status == DBUS_DISPATCH_NEED_MEMORY)
         {
@@ -2525,9 +2990,13 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
         }
       else
         {          
-          /* block again, we don't have the reply buffered yet. */
+          /* block again, we don't have the reply buffered yet. Pass
+           * the pending call, so that if another thread reads our
+           * reply while we wait for the I/O path, we notice it instead
+           * of polling for the rest of the timeout.
+           */
           _dbus_connection_do_iteration_unlocked (connection,
-                                                  NULL,
+                                                  pending,
                                                   DBUS_ITERATION_DO_READING |
                                                   DBUS_ITERATION_BLOCK,
                                                   timeout_milliseconds - elapsed_milliseconds);
@@ -2552,32 +3021,112 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
 }
 
 /**
- * Return how many file descriptors are pending in the loader
+ * Blocks until a pending call times out or gets a reply.
  *
- * @param connection the connection
- */
-int
-_dbus_connection_get_pending_fds_count (DBusConnection *connection)
-{
-  return _dbus_transport_get_pending_fds_count (connection->transport);
-}
-
-/**
- * Register a function to be called whenever the number of pending file
- * descriptors in the loader change.
+ * Does not re-enter the main loop or run filter/path-registered
+ * callbacks. The reply to the message will not be seen by
+ * filter callbacks.
  *
- * @param connection the connection
- * @param callback the callback
+ * Returns immediately if pending call already got a reply.
+ * 
+ * @todo could use performance improvements (it keeps scanning
+ * the whole message queue for example)
+ *
+ * @param pending the pending call we block for a reply on
  */
 void
-_dbus_connection_set_pending_fds_function (DBusConnection *connection,
-                                           DBusPendingFdsChangeFunction callback,
-                                           void *data)
+_dbus_connection_block_pending_call (DBusPendingCall *pending)
+{
+  DBusConnection *connection;
+  long start_sec, start_usec, sec, usec;
+
+  _dbus_assert (pending != NULL);
+
+  if (dbus_pending_call_get_completed (pending))
+    return;
+
+  /* keep the connection alive to count the wait, whatever happens to
+   * the pending call meanwhile */
+  connection = _dbus_pending_call_get_connection_and_lock (pending);
+  _dbus_connection_ref_unlocked (connection);
+  CONNECTION_UNLOCK (connection);
+
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+  connection_block_pending_call (pending);
+  _dbus_get_monotonic_time (&sec, &usec);
+
+  CONNECTION_LOCK (connection);
+  connection->stats.blocking_waits += 1;
+  connection->stats.blocking_wait_usec +=
+    (sec - start_sec) * 1000000 + (usec - start_usec);
+  CONNECTION_UNLOCK (connection);
+
+  dbus_connection_unref (connection);
+}
+
+/**
+ * Return how many file descriptors are pending in the loader
+ *
+ * @param connection the connection
+ */
+int
+_dbus_connection_get_pending_fds_count (DBusConnection *connection)
+{
+  return _dbus_transport_get_pending_fds_count (connection->transport);
+}
+
+/**
+ * Register a function to be called whenever the number of pending file
+ * descriptors in the loader change.
+ *
+ * @param connection the connection
+ * @param callback the callback
+ */
+void
+_dbus_connection_set_pending_fds_function (DBusConnection *connection,
+                                           DBusPendingFdsChangeFunction callback,
+                                           void *data)
 {
   _dbus_transport_set_pending_fds_function (connection->transport,
                                             callback, data);
 }
 
+/**
+ * Register a function to be called when we stop reading from this
+ * connection because too much of what it sent is still queued, and
+ * again when we resume. It is called with the connection lock held,
+ * so it must not call back into the connection.
+ *
+ * @param connection the connection
+ * @param callback the callback, or #NULL
+ * @param data data for the callback
+ */
+void
+_dbus_connection_set_throttle_function (DBusConnection *connection,
+                                        DBusThrottleChangeFunction callback,
+                                        void *data)
+{
+  _dbus_transport_set_throttle_function (connection->transport,
+                                         callback, data);
+}
+
+/**
+ * Declares that every message sent on this server-side connection has
+ * been validated, so that a client that trusts us may skip validating
+ * it again. Has no effect once authentication has completed.
+ *
+ * @param connection the connection
+ * @param validates #TRUE if every message sent on it has been validated
+ */
+void
+_dbus_connection_set_validates_bodies (DBusConnection *connection,
+                                       dbus_bool_t     validates)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_validates_bodies (connection->transport, validates);
+  CONNECTION_UNLOCK (connection);
+}
+
 /** @} */
 
 /**
@@ -2715,7 +3264,7 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_verbose ("Finalizing connection %p\n", connection);
 
-  _dbus_assert (_dbus_atomic_get (&connection->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&connection->refcount) == 0);
 
   /* You have to disconnect the connection before unref:ing it. Otherwise
    * you won't get the disconnected message.
@@ -2752,13 +3301,41 @@ _dbus_connection_last_unref (DBusConnection *connection)
       link = next;
     }
   _dbus_list_clear (&connection->filter_list);
+
+  if (connection->indexed_filters != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (connection->indexed_filters, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusList **filters = _dbus_hash_iter_get_value (&iter);
+          DBusMessageFilter *filter;
+
+          while ((filter = _dbus_list_pop_first (filters)) != NULL)
+            {
+              filter->function = NULL;
+              _dbus_message_filter_unref (filter); /* calls app callback */
+            }
+        }
+
+      _dbus_hash_table_unref (connection->indexed_filters);
+      connection->indexed_filters = NULL;
+    }
   
   /* ---- Done with stuff that invokes application callbacks */
 
   _dbus_object_tree_unref (connection->objects);  
 
+  /* Each pending call holds a reference to us */
+  _dbus_assert (connection->n_pending_window == 0);
   _dbus_hash_table_unref (connection->pending_replies);
   connection->pending_replies = NULL;
+
+  _dbus_assert (connection->pending_timeouts == NULL);
+  _dbus_assert (!connection->reply_timeout_added);
+  _dbus_timeout_unref (connection->reply_timeout);
+  connection->reply_timeout = NULL;
   
   _dbus_list_foreach (&connection->outgoing_messages,
                       free_outgoing_message,
@@ -3327,30 +3904,92 @@ dbus_connection_send (DBusConnection *connection,
 					   serial);
 }
 
-static dbus_bool_t
-reply_handler_timeout (void *data)
+/**
+ * Adds several messages to the outgoing message queue, as if
+ * dbus_connection_send() had been called on each of them in turn,
+ * but taking the connection lock and waking up the main loop only
+ * once for the whole batch. Messages that do not have a serial yet
+ * are given consecutive serials in array order, and the transport
+ * gets the chance to write them out together.
+ *
+ * Either all of the messages are queued or none of them are. As with
+ * dbus_connection_send(), the function only fails for lack of memory,
+ * or if one of the messages carries unix file descriptors that the
+ * connection cannot pass.
+ *
+ * @param connection the connection.
+ * @param messages the messages to write.
+ * @param n_messages the number of elements in messages
+ * @param serials array of n_messages elements to return the message
+ *  serials in, or #NULL if you don't care
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+dbus_connection_send_many (DBusConnection  *connection,
+                           DBusMessage    **messages,
+                           int              n_messages,
+                           dbus_uint32_t   *serials)
 {
-  DBusConnection *connection;
+  DBusPreallocatedSend **preallocated;
   DBusDispatchStatus status;
-  DBusPendingCall *pending = data;
+  int i;
 
-  connection = _dbus_pending_call_get_connection_and_lock (pending);
-  _dbus_connection_ref_unlocked (connection);
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (n_messages >= 0, FALSE);
+  _dbus_return_val_if_fail (messages != NULL || n_messages == 0, FALSE);
 
-  _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                   connection);
-  _dbus_connection_remove_timeout_unlocked (connection,
-				            _dbus_pending_call_get_timeout_unlocked (pending));
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  for (i = 0; i < n_messages; i++)
+    _dbus_return_val_if_fail (messages[i] != NULL, FALSE);
+
+  if (n_messages == 0)
+    return TRUE;
+
+  preallocated = dbus_new0 (DBusPreallocatedSend *, n_messages);
+  if (preallocated == NULL)
+    return FALSE;
+
+  CONNECTION_LOCK (connection);
+
+  for (i = 0; i < n_messages; i++)
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      /* Refuse the whole batch, as dbus_connection_send() would
+       * refuse the message on its own */
+      if (!_dbus_transport_can_pass_unix_fd (connection->transport) &&
+          messages[i]->n_unix_fds > 0)
+        goto failed;
+#endif
+
+      preallocated[i] = _dbus_connection_preallocate_send_unlocked (connection);
+      if (preallocated[i] == NULL)
+        goto failed;
+    }
+
+  for (i = 0; i < n_messages; i++)
+    _dbus_connection_queue_preallocated_unlocked (connection,
+                                                  preallocated[i],
+                                                  messages[i],
+                                                  serials ? &serials[i] : NULL);
+
+  dbus_free (preallocated);
+
+  _dbus_connection_write_queued_unlocked (connection);
 
-  _dbus_verbose ("middle\n");
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
 
-  /* Unlocks, and calls out to user code */
+  /* this calls out to user code */
   _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  dbus_connection_unref (connection);
-  
+
   return TRUE;
+
+ failed:
+  for (i = 0; i < n_messages && preallocated[i] != NULL; i++)
+    dbus_connection_free_preallocated_send (connection, preallocated[i]);
+
+  CONNECTION_UNLOCK (connection);
+  dbus_free (preallocated);
+
+  return FALSE;
 }
 
 /**
@@ -3437,8 +4076,7 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
     }
 
   pending = _dbus_pending_call_new_unlocked (connection,
-                                             timeout_milliseconds,
-                                             reply_handler_timeout);
+                                             timeout_milliseconds);
 
   if (pending == NULL)
     {
@@ -4385,6 +5023,7 @@ dbus_connection_get_dispatch_status (DBusConnection *connection)
   
   CONNECTION_LOCK (connection);
 
+  connection->wakeup_pending = FALSE;
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
   
   CONNECTION_UNLOCK (connection);
@@ -4529,6 +5168,84 @@ _dbus_connection_run_builtin_filters_unlocked_no_update (DBusConnection *connect
   return _dbus_connection_peer_filter_unlocked_no_update (connection, message);
 }
 
+/**
+ * Copies the filters that should run on a message into a list, in the
+ * order they were added: all those added with
+ * dbus_connection_add_filter(), and the ones added with
+ * dbus_connection_add_interface_filter() that match the message.
+ * Filters for other interfaces are never looked at.
+ *
+ * @param connection the connection
+ * @param message the message being dispatched
+ * @param dest list to fill in
+ * @returns #FALSE if not enough memory
+ */
+static dbus_bool_t
+_dbus_connection_copy_filters_unlocked (DBusConnection *connection,
+                                        DBusMessage    *message,
+                                        DBusList      **dest)
+{
+  DBusList **indexed = NULL;
+  DBusList *link, *indexed_link;
+  const char *interface;
+  const char *member;
+  int message_type;
+
+  HAVE_LOCK_CHECK (connection);
+
+  interface = dbus_message_get_interface (message);
+
+  if (connection->indexed_filters != NULL && interface != NULL)
+    indexed = _dbus_hash_table_lookup_string (connection->indexed_filters,
+                                              interface);
+
+  if (indexed == NULL)
+    return _dbus_list_copy (&connection->filter_list, dest);
+
+  member = dbus_message_get_member (message);
+  message_type = dbus_message_get_type (message);
+
+  *dest = NULL;
+  link = _dbus_list_get_first_link (&connection->filter_list);
+  indexed_link = _dbus_list_get_first_link (indexed);
+
+  /* Both lists are in the order the filters were added, so merge them */
+  while (link != NULL || indexed_link != NULL)
+    {
+      DBusMessageFilter *filter;
+
+      if (indexed_link == NULL ||
+          (link != NULL &&
+           ((DBusMessageFilter *) link->data)->position <
+           ((DBusMessageFilter *) indexed_link->data)->position))
+        {
+          filter = link->data;
+          link = _dbus_list_get_next_link (&connection->filter_list, link);
+        }
+      else
+        {
+          filter = indexed_link->data;
+          indexed_link = _dbus_list_get_next_link (indexed, indexed_link);
+
+          if (filter->message_type != DBUS_MESSAGE_TYPE_INVALID &&
+              filter->message_type != message_type)
+            continue;
+
+          if (filter->member != NULL &&
+              (member == NULL || strcmp (filter->member, member) != 0))
+            continue;
+        }
+
+      if (!_dbus_list_append (dest, filter))
+        {
+          _dbus_list_clear (dest);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 /**
  * Processes any incoming data.
  *
@@ -4581,12 +5298,14 @@ dbus_connection_dispatch (DBusConnection *connection)
   dbus_int32_t reply_serial;
   DBusDispatchStatus status;
   dbus_bool_t found_object;
+  long start_sec, start_usec;
 
   _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
 
   _dbus_verbose ("\n");
   
   CONNECTION_LOCK (connection);
+  connection->wakeup_pending = FALSE;
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
   if (status != DBUS_DISPATCH_DATA_REMAINS)
     {
@@ -4622,6 +5341,7 @@ dbus_connection_dispatch (DBusConnection *connection)
     }
 
   message = message_link->data;
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
 
   _dbus_verbose (" dispatching message %p (%s %s %s '%s')\n",
                  message,
@@ -4644,8 +5364,7 @@ dbus_connection_dispatch (DBusConnection *connection)
    */
   
   reply_serial = dbus_message_get_reply_serial (message);
-  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
-                                         reply_serial);
+  pending = pending_replies_lookup (connection, reply_serial);
   if (pending)
     {
       _dbus_verbose ("Dispatching a pending reply\n");
@@ -4662,7 +5381,8 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     goto out;
  
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
+  if (!_dbus_connection_copy_filters_unlocked (connection, message,
+                                               &filter_list_copy))
     {
       _dbus_connection_release_dispatch (connection);
       HAVE_LOCK_CHECK (connection);
@@ -4853,7 +5573,14 @@ dbus_connection_dispatch (DBusConnection *connection)
     }
   else
     {
+      long sec, usec;
+
       _dbus_verbose (" ... done dispatching\n");
+
+      _dbus_get_monotonic_time (&sec, &usec);
+      connection->stats.messages_dispatched += 1;
+      connection->stats.dispatch_usec +=
+        (sec - start_sec) * 1000000 + (usec - start_usec);
     }
 
   _dbus_connection_release_dispatch (connection);
@@ -5044,6 +5771,13 @@ dbus_connection_set_timeout_functions   (DBusConnection            *connection,
  * results in a call to QEventLoop::wakeUp().  When using GLib, it
  * would call g_main_context_wakeup().
  *
+ * Repeated wakeups are coalesced: once the function has been called,
+ * it is not called again until the main loop has come back to the
+ * connection, by calling dbus_connection_get_dispatch_status() or
+ * dbus_connection_dispatch(), or by handling one of its watches.
+ * Main loop integrations normally do one of these every time they
+ * wake up.
+ *
  * @param connection the connection.
  * @param wakeup_main_function function to wake up the mainloop
  * @param data data to pass wakeup_main_function
@@ -5067,6 +5801,7 @@ dbus_connection_set_wakeup_main_function (DBusConnection            *connection,
   connection->wakeup_main_function = wakeup_main_function;
   connection->wakeup_main_data = data;
   connection->free_wakeup_main_data = free_data_function;
+  connection->wakeup_pending = FALSE;
   
   CONNECTION_UNLOCK (connection);
 
@@ -5379,6 +6114,33 @@ _dbus_connection_get_linux_security_label (DBusConnection  *connection,
   return result;
 }
 
+/**
+ * Gets the credentials of the connection, if it has been authenticated.
+ * The result is owned by the connection and must not be modified; it
+ * remains valid until the connection is finalized.
+ *
+ * @param connection the connection
+ * @returns the credentials, or #NULL if not authenticated yet
+ */
+DBusCredentials *
+_dbus_connection_get_credentials (DBusConnection *connection)
+{
+  DBusCredentials *result;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_try_to_authenticate (connection->transport))
+    result = NULL;
+  else
+    result = _dbus_transport_get_credentials (connection->transport);
+
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
 /**
  * Gets the Windows user SID of the connection if known.  Returns
  * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
@@ -5599,17 +6361,133 @@ dbus_connection_add_filter (DBusConnection            *connection,
   filter->function = function;
   filter->user_data = user_data;
   filter->free_user_data_function = free_data_function;
+  filter->position = connection->n_filters_added++;
         
   CONNECTION_UNLOCK (connection);
   return TRUE;
 }
 
+/**
+ * Adds a message filter that only runs on messages with the given
+ * interface, and optionally the given member and message type. This
+ * is equivalent to adding a filter with dbus_connection_add_filter()
+ * that returns #DBUS_HANDLER_RESULT_NOT_YET_HANDLED for every other
+ * message, but the connection keeps these filters indexed by
+ * interface, so dispatching a message never calls, or even looks at,
+ * the filters for other interfaces.
+ *
+ * Filters added with either function run together, in the order that
+ * they were added. Remove the filter with
+ * dbus_connection_remove_filter().
+ *
+ * @param connection the connection
+ * @param message_type the message type to run on, or #DBUS_MESSAGE_TYPE_INVALID for any
+ * @param interface the interface to run on
+ * @param member the member to run on, or #NULL for any
+ * @param function function to handle messages
+ * @param user_data user data to pass to the function
+ * @param free_data_function function to use for freeing user data
+ * @returns #TRUE on success, #FALSE if not enough memory.
+ */
+dbus_bool_t
+dbus_connection_add_interface_filter (DBusConnection            *connection,
+                                      int                        message_type,
+                                      const char                *interface,
+                                      const char                *member,
+                                      DBusHandleMessageFunction  function,
+                                      void                      *user_data,
+                                      DBusFreeFunction           free_data_function)
+{
+  DBusMessageFilter *filter;
+  DBusList **filters;
+  char *key = NULL;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (interface != NULL, FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+
+  filter = dbus_new0 (DBusMessageFilter, 1);
+  if (filter == NULL)
+    return FALSE;
+
+  _dbus_atomic_inc (&filter->refcount);
+  filter->message_type = message_type;
+  filter->interface = _dbus_strdup (interface);
+
+  if (filter->interface == NULL)
+    goto nomem;
+
+  if (member != NULL)
+    {
+      filter->member = _dbus_strdup (member);
+
+      if (filter->member == NULL)
+        goto nomem;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  if (connection->indexed_filters == NULL)
+    {
+      connection->indexed_filters = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                          dbus_free,
+                                                          dbus_free);
+
+      if (connection->indexed_filters == NULL)
+        goto nomem_locked;
+    }
+
+  filters = _dbus_hash_table_lookup_string (connection->indexed_filters,
+                                            interface);
+
+  if (filters == NULL)
+    {
+      key = _dbus_strdup (interface);
+      filters = dbus_new0 (DBusList *, 1);
+
+      if (key == NULL || filters == NULL ||
+          !_dbus_hash_table_insert_string (connection->indexed_filters,
+                                           key, filters))
+        {
+          dbus_free (key);
+          dbus_free (filters);
+          goto nomem_locked;
+        }
+    }
+
+  if (!_dbus_list_append (filters, filter))
+    {
+      if (*filters == NULL)
+        _dbus_hash_table_remove_string (connection->indexed_filters,
+                                        interface);
+
+      goto nomem_locked;
+    }
+
+  /* As in dbus_connection_add_filter(), only fill in the callback
+   * once nothing can fail */
+  filter->function = function;
+  filter->user_data = user_data;
+  filter->free_user_data_function = free_data_function;
+  filter->position = connection->n_filters_added++;
+
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+
+ nomem_locked:
+  CONNECTION_UNLOCK (connection);
+ nomem:
+  _dbus_message_filter_unref (filter);
+  return FALSE;
+}
+
 /**
  * Removes a previously-added message filter. It is a programming
  * error to call this function for a handler that has not been added
  * as a filter. If the given handler was added more than once, only
  * one instance of it will be removed (the most recently-added
- * instance).
+ * instance). This also removes filters added with
+ * dbus_connection_add_interface_filter().
  *
  * @param connection the connection
  * @param function the handler to remove
@@ -5622,6 +6500,8 @@ dbus_connection_remove_filter (DBusConnection            *connection,
                                void                      *user_data)
 {
   DBusList *link;
+  DBusList **found_list = NULL;
+  DBusList *found_link = NULL;
   DBusMessageFilter *filter;
   
   _dbus_return_if_fail (connection != NULL);
@@ -5639,15 +6519,56 @@ dbus_connection_remove_filter (DBusConnection            *connection,
       if (filter->function == function &&
           filter->user_data == user_data)
         {
-          _dbus_list_remove_link (&connection->filter_list, link);
-          filter->function = NULL;
-          
+          found_list = &connection->filter_list;
+          found_link = link;
           break;
         }
         
       link = _dbus_list_get_prev_link (&connection->filter_list, link);
       filter = NULL;
     }
+
+  if (connection->indexed_filters != NULL)
+    {
+      DBusHashIter iter;
+
+      /* The most recently-added instance may be in any of the lists */
+      _dbus_hash_iter_init (connection->indexed_filters, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusList **filters = _dbus_hash_iter_get_value (&iter);
+
+          link = _dbus_list_get_last_link (filters);
+          while (link != NULL)
+            {
+              DBusMessageFilter *candidate = link->data;
+
+              if (filter != NULL && candidate->position < filter->position)
+                break;
+
+              if (candidate->function == function &&
+                  candidate->user_data == user_data)
+                {
+                  filter = candidate;
+                  found_list = filters;
+                  found_link = link;
+                  break;
+                }
+
+              link = _dbus_list_get_prev_link (filters, link);
+            }
+        }
+    }
+
+  if (filter != NULL)
+    {
+      _dbus_list_remove_link (found_list, found_link);
+      filter->function = NULL;
+
+      if (*found_list == NULL && filter->interface != NULL)
+        _dbus_hash_table_remove_string (connection->indexed_filters,
+                                        filter->interface);
+    }
   
   CONNECTION_UNLOCK (connection);
 
@@ -5717,6 +6638,13 @@ _dbus_connection_register_object_path (DBusConnection              *connection,
  * Registers a handler for a given path in the object hierarchy.
  * The given vtable handles messages sent to exactly the given path.
  *
+ * An element of @p path that is exactly "*" matches any single
+ * element of a message's path, so one handler registered for
+ * "/org/example/device/ * /channel" (without the spaces) serves the
+ * channel object of every device. Where both could apply, an element
+ * registered by name is preferred over "*". Matching is done without
+ * allocating memory.
+ *
  * @param connection the connection
  * @param path a '/' delimited string of path elements
  * @param vtable the virtual table
@@ -5787,6 +6715,9 @@ dbus_connection_register_object_path (DBusConnection              *connection,
  * path. You can use this to establish a default message handling
  * policy for a whole "subdirectory."
  *
+ * As with dbus_connection_try_register_object_path(), "*" elements
+ * in @p path match any single element.
+ *
  * @param connection the connection
  * @param path a '/' delimited string of path elements
  * @param vtable the virtual table
@@ -6079,6 +7010,12 @@ dbus_connection_get_data (DBusConnection   *connection,
   _dbus_return_val_if_fail (connection != NULL, NULL);
   _dbus_return_val_if_fail (slot >= 0, NULL);
 
+#ifdef DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE
+  /* Only writers need to be serialized */
+  res = _dbus_data_slot_list_get (&slot_allocator,
+                                  &connection->slot_list,
+                                  slot);
+#else
   SLOTS_LOCK (connection);
 
   res = _dbus_data_slot_list_get (&slot_allocator,
@@ -6086,6 +7023,7 @@ dbus_connection_get_data (DBusConnection   *connection,
                                   slot);
   
   SLOTS_UNLOCK (connection);
+#endif
 
   return res;
 }
@@ -6181,13 +7119,60 @@ dbus_connection_get_max_message_unix_fds (DBusConnection *connection)
 }
 
 /**
- * Sets the maximum total number of bytes that can be used for all messages
- * received on this connection. Messages count toward the maximum until
- * they are finalized. When the maximum is reached, the connection will
- * not read more data until some messages are finalized.
+ * Specifies whether the bodies of messages received on this
+ * connection are trusted to be well-formed. By default every
+ * received message is fully validated; if this is set, only the
+ * message header is validated and the body is taken as-is.
+ *
+ * This saves a pass over every received message, but a peer that
+ * sends a malformed body can then crash the application or make
+ * it read out of bounds while iterating the message. Only enable
+ * this for a connection to a peer that is known to validate what
+ * it sends, such as a dbus-daemon reached over a socket that
+ * nobody else can impersonate.
  *
- * The semantics of the maximum are: if outstanding messages are
- * already above the maximum, additional messages will not be read.
+ * @param connection a #DBusConnection
+ * @param trust #TRUE to skip validation of received message bodies
+ */
+void
+dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                          dbus_bool_t     trust)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_message_bodies (connection->transport,
+                                            trust);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the value set by dbus_connection_set_trust_message_bodies().
+ *
+ * @param connection the connection
+ * @returns #TRUE if received message bodies are not validated
+ */
+dbus_bool_t
+dbus_connection_get_trust_message_bodies (DBusConnection *connection)
+{
+  dbus_bool_t res;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_trust_message_bodies (connection->transport);
+  CONNECTION_UNLOCK (connection);
+  return res;
+}
+
+/**
+ * Sets the maximum total number of bytes that can be used for all messages
+ * received on this connection. Messages count toward the maximum until
+ * they are finalized. When the maximum is reached, the connection will
+ * not read more data until some messages are finalized.
+ *
+ * The semantics of the maximum are: if outstanding messages are
+ * already above the maximum, additional messages will not be read.
  * The semantics are not: if the next message would cause us to exceed
  * the maximum, we don't read it. The reason is that we don't know the
  * size of a message until after we read it.
@@ -6301,6 +7286,570 @@ dbus_connection_get_outgoing_size (DBusConnection *connection)
   return res;
 }
 
+/**
+ * Gets the approximate size in bytes of all messages received on
+ * this connection that have not been freed yet. On a message bus,
+ * this includes messages that are queued for sending to other
+ * connections.
+ *
+ * @param connection the connection
+ * @returns the number of bytes received and still alive
+ */
+long
+_dbus_connection_get_incoming_size (DBusConnection *connection)
+{
+  long res;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_live_messages_size (connection->transport);
+  CONNECTION_UNLOCK (connection);
+  return res;
+}
+
+/**
+ * Gets the socket a connection's transport polls, for a main loop that
+ * needs to recognise it among others.
+ *
+ * @param connection the connection
+ * @param fd return location for the socket
+ * @returns #FALSE if the transport has no socket
+ */
+dbus_bool_t
+_dbus_connection_get_pollable (DBusConnection *connection,
+                               DBusPollable   *fd)
+{
+  DBusSocket s = DBUS_SOCKET_INIT;
+  dbus_bool_t res;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  res = _dbus_transport_get_socket_fd (connection->transport, &s);
+  CONNECTION_UNLOCK (connection);
+
+  if (res)
+    *fd = _dbus_socket_get_pollable (s);
+
+  return res;
+}
+
+/**
+ * Discards queued outgoing messages, oldest first, until no more than
+ * max_bytes are queued. The message that is next in line to be sent
+ * is never discarded, since it might have been partly written.
+ *
+ * This is for a message bus that would rather lose messages for a
+ * connection that is not keeping up than let its queue grow.
+ *
+ * @param connection the connection
+ * @param max_bytes the number of bytes that may remain queued
+ * @returns the number of messages discarded
+ */
+int
+_dbus_connection_drop_outgoing (DBusConnection *connection,
+                                long            max_bytes)
+{
+  DBusList *link;
+  int n_dropped = 0;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  if (link != NULL)
+    link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+  while (link != NULL &&
+         _dbus_counter_get_size_value (connection->outgoing_counter) >
+         max_bytes)
+    {
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages,
+                                                 link);
+
+      _dbus_list_unlink (&connection->outgoing_messages, link);
+      connection->n_outgoing -= 1;
+      _dbus_message_remove_counter (link->data, connection->outgoing_counter);
+      /* released when we unlock */
+      _dbus_list_prepend_link (&connection->expired_messages, link);
+      n_dropped++;
+      link = prev;
+    }
+
+  CONNECTION_UNLOCK (connection);
+  return n_dropped;
+}
+
+static dbus_bool_t
+header_strings_equal (const char *a,
+                      const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+/**
+ * Discards queued outgoing signals that have the same sender, path,
+ * interface and member as the given signal, which is about to be
+ * queued and so supersedes them. As with
+ * _dbus_connection_drop_outgoing(), the message that is next in line
+ * to be sent is never discarded, and other kinds of message are never
+ * touched.
+ *
+ * This is for a message bus delivering to a connection that has said
+ * it only needs the most recent of a series of signals, such as
+ * PropertiesChanged, when it is not keeping up.
+ *
+ * @param connection the connection
+ * @param signal the signal that supersedes the queued ones
+ * @returns the number of messages discarded
+ */
+int
+_dbus_connection_drop_superseded_signals (DBusConnection *connection,
+                                          DBusMessage    *signal)
+{
+  const char *sender, *path, *interface, *member;
+  DBusList *link;
+  int n_dropped = 0;
+
+  _dbus_assert (connection != NULL);
+  _dbus_assert (dbus_message_get_type (signal) == DBUS_MESSAGE_TYPE_SIGNAL);
+
+  sender = dbus_message_get_sender (signal);
+  path = dbus_message_get_path (signal);
+  interface = dbus_message_get_interface (signal);
+  member = dbus_message_get_member (signal);
+
+  CONNECTION_LOCK (connection);
+
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  if (link != NULL)
+    link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+  while (link != NULL)
+    {
+      DBusMessage *queued = link->data;
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages,
+                                                 link);
+
+      if (dbus_message_get_type (queued) == DBUS_MESSAGE_TYPE_SIGNAL &&
+          header_strings_equal (dbus_message_get_member (queued), member) &&
+          header_strings_equal (dbus_message_get_path (queued), path) &&
+          header_strings_equal (dbus_message_get_interface (queued), interface) &&
+          header_strings_equal (dbus_message_get_sender (queued), sender))
+        {
+          _dbus_list_unlink (&connection->outgoing_messages, link);
+          connection->n_outgoing -= 1;
+          _dbus_message_remove_counter (queued, connection->outgoing_counter);
+          /* released when we unlock */
+          _dbus_list_prepend_link (&connection->expired_messages, link);
+          n_dropped++;
+        }
+
+      link = prev;
+    }
+
+  CONNECTION_UNLOCK (connection);
+  return n_dropped;
+}
+
+/**
+ * Lets method returns and errors queued from now on overtake signals
+ * that are already queued, so that a connection receiving a lot of
+ * signals can still get the replies to its method calls promptly.
+ * Signals from the reply's own sender, and from the message bus, are
+ * never overtaken, and the order of replies relative to each other,
+ * and of signals relative to each other, is kept.
+ *
+ * This is for a message bus, where the messages queued for a
+ * connection come from many senders; a client's own outgoing queue
+ * must stay in order.
+ *
+ * @param connection the connection
+ * @param enabled #TRUE to let replies overtake signals
+ */
+void
+_dbus_connection_set_replies_first (DBusConnection *connection,
+                                    dbus_bool_t     enabled)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->replies_first = (enabled != FALSE);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the value set with _dbus_connection_set_replies_first().
+ *
+ * @param connection the connection
+ * @returns #TRUE if replies may overtake signals
+ */
+dbus_bool_t
+_dbus_connection_get_replies_first (DBusConnection *connection)
+{
+  dbus_bool_t enabled;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  enabled = connection->replies_first;
+  CONNECTION_UNLOCK (connection);
+
+  return enabled;
+}
+
+#ifdef DBUS_UNIX
+/**
+ * Stops or resumes reading messages from the connection. While
+ * reading is paused, messages that were already read can still be
+ * dispatched, and outgoing messages are still written.
+ *
+ * @param connection the connection
+ * @param paused #TRUE to stop reading
+ */
+void
+_dbus_connection_set_reading_paused (DBusConnection *connection,
+                                     dbus_bool_t     paused)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_reading_paused (connection->transport, paused);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Checks whether the connection's socket could be handed over to
+ * another process with _dbus_connection_append_handoff(): it must be
+ * an authenticated server-side connection that has nothing queued in
+ * either direction and no partially-read message.
+ *
+ * @param connection the connection
+ * @returns #TRUE if the connection is idle and can be handed over
+ */
+dbus_bool_t
+_dbus_connection_can_hand_off (DBusConnection *connection)
+{
+  dbus_bool_t result;
+
+  CONNECTION_LOCK (connection);
+  result = connection->n_incoming == 0 &&
+    connection->n_outgoing == 0 &&
+    connection->message_borrowed == NULL &&
+    _dbus_transport_get_is_connected (connection->transport) &&
+    _dbus_transport_can_hand_off (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return result;
+}
+
+/**
+ * Appends what another process needs to take over the connection
+ * with _dbus_connection_new_from_handoff(), as a single struct of
+ * signature "(iibbuxxaussay)": the socket, the peer's pidfd or -1,
+ * whether fd passing and body validation were negotiated, the next
+ * serial to use, and the peer's authorized identity.
+ *
+ * The socket and pidfd are made to survive exec; the caller is
+ * expected to exec the new process before any other use of the
+ * connection. Only valid if _dbus_connection_can_hand_off() returned
+ * #TRUE.
+ *
+ * @param connection the connection
+ * @param iter where to append the struct
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+_dbus_connection_append_handoff (DBusConnection  *connection,
+                                 DBusMessageIter *iter)
+{
+  DBusMessageIter sub, array;
+  DBusCredentials *identity;
+  DBusSocket socket;
+  dbus_bool_t unix_fd, validated;
+  dbus_uint32_t serial;
+  dbus_int32_t fd, pid_fd;
+  dbus_int64_t uid, pid;
+  const dbus_gid_t *gids = NULL;
+  size_t n_gids = 0;
+  size_t i;
+  const char *label, *sid;
+  const unsigned char *audit;
+  dbus_int32_t audit_size;
+  dbus_bool_t result = FALSE;
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_get_socket_fd (connection->transport, &socket))
+    _dbus_assert_not_reached ("connection cannot be handed off");
+
+  _dbus_transport_get_handoff_state (connection->transport, &identity,
+                                     &unix_fd, &validated);
+
+  fd = _dbus_socket_get_int (socket);
+  pid_fd = _dbus_credentials_get_pid_fd (identity);
+  serial = connection->client_serial;
+
+  if (_dbus_credentials_include (identity, DBUS_CREDENTIAL_UNIX_USER_ID))
+    uid = _dbus_credentials_get_unix_uid (identity);
+  else
+    uid = -1;
+
+  if (_dbus_credentials_include (identity, DBUS_CREDENTIAL_UNIX_PROCESS_ID))
+    pid = _dbus_credentials_get_pid (identity);
+  else
+    pid = -1;
+
+  _dbus_credentials_get_unix_gids (identity, &gids, &n_gids);
+
+  label = _dbus_credentials_get_linux_security_label (identity);
+  sid = _dbus_credentials_get_windows_sid (identity);
+  audit = _dbus_credentials_get_adt_audit_data (identity);
+  audit_size = _dbus_credentials_get_adt_audit_data_size (identity);
+
+  if (label == NULL)
+    label = "";
+
+  if (sid == NULL)
+    sid = "";
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_STRUCT, NULL, &sub))
+    goto out;
+
+  if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT32, &fd) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT32, &pid_fd) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_BOOLEAN, &unix_fd) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_BOOLEAN, &validated) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_UINT32, &serial) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT64, &uid) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_INT64, &pid))
+    goto abandon;
+
+  if (!dbus_message_iter_open_container (&sub, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_UINT32_AS_STRING, &array))
+    goto abandon;
+
+  for (i = 0; i < n_gids; i++)
+    {
+      dbus_uint32_t gid = gids[i];
+
+      if (!dbus_message_iter_append_basic (&array, DBUS_TYPE_UINT32, &gid))
+        {
+          dbus_message_iter_abandon_container (&sub, &array);
+          goto abandon;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&sub, &array) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING, &label) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING, &sid))
+    goto abandon;
+
+  if (!dbus_message_iter_open_container (&sub, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING, &array))
+    goto abandon;
+
+  if (!dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &audit,
+                                             audit == NULL ? 0 : audit_size))
+    {
+      dbus_message_iter_abandon_container (&sub, &array);
+      goto abandon;
+    }
+
+  if (!dbus_message_iter_close_container (&sub, &array) ||
+      !dbus_message_iter_close_container (iter, &sub))
+    goto abandon;
+
+  _dbus_fd_clear_close_on_exec (fd);
+
+  if (pid_fd >= 0)
+    _dbus_fd_clear_close_on_exec (pid_fd);
+
+  result = TRUE;
+  goto out;
+
+abandon:
+  dbus_message_iter_abandon_container (iter, &sub);
+out:
+  CONNECTION_UNLOCK (connection);
+  return result;
+}
+
+/**
+ * Takes over a connection that another process described with
+ * _dbus_connection_append_handoff(). The new connection is already
+ * authenticated as the identity that was handed over; the usual
+ * unix user function checks still run the first time
+ * dbus_connection_get_is_authenticated() is called.
+ *
+ * If this fails, the handed-over file descriptors are closed.
+ *
+ * @param iter an iterator pointing to the struct
+ * @param server_guid the GUID of the server that takes the connection
+ * @param error return location for an error
+ * @returns the new connection, or #NULL with @p error set
+ */
+DBusConnection *
+_dbus_connection_new_from_handoff (DBusMessageIter  *iter,
+                                   const DBusString *server_guid,
+                                   DBusError        *error)
+{
+  DBusMessageIter sub, array;
+  DBusCredentials *identity = NULL;
+  DBusTransport *transport = NULL;
+  DBusConnection *connection = NULL;
+  DBusSocket socket;
+  dbus_bool_t unix_fd, validated;
+  dbus_uint32_t serial;
+  dbus_int32_t fd, pid_fd;
+  dbus_int64_t uid, pid;
+  const char *label, *sid;
+  const unsigned char *audit;
+  int audit_size;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  /* The caller is expected to have checked the signature */
+  if (dbus_message_iter_get_arg_type (iter) != DBUS_TYPE_STRUCT)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Handed-over connection is not a struct");
+      return NULL;
+    }
+
+  dbus_message_iter_recurse (iter, &sub);
+  dbus_message_iter_get_basic (&sub, &fd);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &pid_fd);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &unix_fd);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &validated);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &serial);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &uid);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &pid);
+  dbus_message_iter_next (&sub);
+
+  /* From here on, the fds are ours to close */
+  _dbus_fd_set_close_on_exec (fd);
+  socket = _dbus_socket_get_invalid ();
+  socket.fd = fd;
+
+  identity = _dbus_credentials_new ();
+
+  if (identity == NULL)
+    goto oom;
+
+  if (pid_fd >= 0)
+    {
+      _dbus_fd_set_close_on_exec (pid_fd);
+      _dbus_credentials_take_pid_fd (identity, pid_fd);
+      pid_fd = -1;
+    }
+
+  if (uid >= 0 && !_dbus_credentials_add_unix_uid (identity, uid))
+    goto oom;
+
+  if (pid >= 0 && !_dbus_credentials_add_pid (identity, pid))
+    goto oom;
+
+  dbus_message_iter_recurse (&sub, &array);
+
+  if (dbus_message_iter_get_arg_type (&array) != DBUS_TYPE_INVALID)
+    {
+      dbus_gid_t *gids;
+      size_t n_gids = 0;
+
+      gids = dbus_new (dbus_gid_t,
+                       dbus_message_iter_get_element_count (&sub));
+
+      if (gids == NULL)
+        goto oom;
+
+      while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_UINT32)
+        {
+          dbus_uint32_t gid;
+
+          dbus_message_iter_get_basic (&array, &gid);
+          gids[n_gids++] = gid;
+          dbus_message_iter_next (&array);
+        }
+
+      _dbus_credentials_take_unix_gids (identity, gids, n_gids);
+    }
+
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &label);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_get_basic (&sub, &sid);
+  dbus_message_iter_next (&sub);
+  dbus_message_iter_recurse (&sub, &array);
+  dbus_message_iter_get_fixed_array (&array, &audit, &audit_size);
+
+  if (label[0] != '\0' &&
+      !_dbus_credentials_add_linux_security_label (identity, label))
+    goto oom;
+
+  if (sid[0] != '\0' && !_dbus_credentials_add_windows_sid (identity, sid))
+    goto oom;
+
+  if (audit_size > 0 &&
+      !_dbus_credentials_add_adt_audit_data (identity, (void *) audit,
+                                             audit_size))
+    goto oom;
+
+  transport = _dbus_transport_new_for_socket (socket, server_guid, NULL);
+
+  if (transport == NULL)
+    goto oom;
+
+  /* the socket now belongs to the transport */
+  socket = _dbus_socket_get_invalid ();
+
+  if (!_dbus_transport_set_handed_off (transport, identity, unix_fd,
+                                       validated))
+    goto oom;
+
+  connection = _dbus_connection_new_for_transport (transport);
+
+  if (connection == NULL)
+    goto oom;
+
+  CONNECTION_LOCK (connection);
+  connection->client_serial = serial;
+  CONNECTION_UNLOCK (connection);
+
+  _dbus_transport_unref (transport);
+  _dbus_credentials_unref (identity);
+  return connection;
+
+oom:
+  _DBUS_SET_OOM (error);
+
+  if (transport != NULL)
+    _dbus_transport_unref (transport);
+
+  if (_dbus_socket_is_valid (socket))
+    _dbus_close_socket (socket, NULL);
+
+  if (pid_fd >= 0)
+    _dbus_close (pid_fd, NULL);
+
+  if (identity != NULL)
+    _dbus_credentials_unref (identity);
+
+  return NULL;
+}
+#endif /* DBUS_UNIX */
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_connection_get_stats (DBusConnection *connection,
@@ -6340,6 +7889,22 @@ _dbus_connection_get_stats (DBusConnection *connection,
 
   CONNECTION_UNLOCK (connection);
 }
+
+/**
+ * Gets the histogram of how long messages spent in the outgoing
+ * queue, from being queued until written to the transport.
+ *
+ * @param connection the connection
+ * @param histogram return location for a copy of the histogram
+ */
+void
+_dbus_connection_get_queue_latency (DBusConnection       *connection,
+                                    DBusLatencyHistogram *histogram)
+{
+  CONNECTION_LOCK (connection);
+  *histogram = connection->queue_latency;
+  CONNECTION_UNLOCK (connection);
+}
 #endif /* DBUS_ENABLE_STATS */
 
 /**
@@ -6362,6 +7927,39 @@ dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
   return res;
 }
 
+/**
+ * Gets counters describing the traffic on the connection: totals of
+ * the messages and bytes received and sent, the current lengths of
+ * the incoming and outgoing queues, the number of method calls still
+ * waiting for a reply, the time spent dispatching messages, and the
+ * number of times and time spent blocking for a reply, for instance
+ * in dbus_connection_send_with_reply_and_block().
+ *
+ * This is cheap enough to call regularly, for example to export the
+ * counters to a monitoring system.
+ *
+ * @param connection the connection
+ * @param stats return location for the counters
+ */
+void
+dbus_connection_get_stats (DBusConnection      *connection,
+                           DBusConnectionStats *stats)
+{
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (stats != NULL);
+
+  CONNECTION_LOCK (connection);
+  *stats = connection->stats;
+  stats->incoming_messages = connection->n_incoming;
+  stats->incoming_bytes =
+    _dbus_transport_get_live_messages_size (connection->transport);
+  stats->outgoing_messages = connection->n_outgoing;
+  stats->outgoing_bytes =
+    _dbus_counter_get_size_value (connection->outgoing_counter);
+  stats->pending_calls = pending_replies_count (connection);
+  CONNECTION_UNLOCK (connection);
+}
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 /**
  * Returns the address of the transport object of this connection
@@ -52,6 +52,8 @@ typedef struct DBusPendingCall DBusPendingCall;
 typedef struct DBusConnection DBusConnection;
 /** Set of functions that must be implemented to handle messages sent to a particular object path. */
 typedef struct DBusObjectPathVTable DBusObjectPathVTable;
+/** Counters describing the traffic on a connection. */
+typedef struct DBusConnectionStats DBusConnectionStats;
 
 /**
  * Indicates the status of a #DBusWatch.
@@ -226,6 +228,11 @@ dbus_bool_t        dbus_connection_send                         (DBusConnection
                                                                  DBusMessage                *message,
                                                                  dbus_uint32_t              *client_serial);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_send_many                    (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 dbus_uint32_t              *serials);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  DBusPendingCall           **pending_return,
@@ -298,6 +305,14 @@ dbus_bool_t dbus_connection_add_filter    (DBusConnection            *connection
                                            void                      *user_data,
                                            DBusFreeFunction           free_data_function);
 DBUS_EXPORT
+dbus_bool_t dbus_connection_add_interface_filter (DBusConnection            *connection,
+                                                  int                        message_type,
+                                                  const char                *interface,
+                                                  const char                *member,
+                                                  DBusHandleMessageFunction  function,
+                                                  void                      *user_data,
+                                                  DBusFreeFunction           free_data_function);
+DBUS_EXPORT
 void        dbus_connection_remove_filter (DBusConnection            *connection,
                                            DBusHandleMessageFunction  function,
                                            void                      *user_data);
@@ -337,6 +352,11 @@ void dbus_connection_set_max_message_unix_fds (DBusConnection *connection,
 DBUS_EXPORT
 long dbus_connection_get_max_message_unix_fds (DBusConnection *connection);
 DBUS_EXPORT
+void dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                               dbus_bool_t     trust);
+DBUS_EXPORT
+dbus_bool_t dbus_connection_get_trust_message_bodies (DBusConnection *connection);
+DBUS_EXPORT
 void dbus_connection_set_max_received_unix_fds(DBusConnection *connection,
                                                long            n);
 DBUS_EXPORT
@@ -347,6 +367,36 @@ long dbus_connection_get_outgoing_size     (DBusConnection *connection);
 DBUS_EXPORT
 long dbus_connection_get_outgoing_unix_fds (DBusConnection *connection);
 
+/**
+ * Counters describing the traffic on a connection, filled in by
+ * dbus_connection_get_stats(). The totals count from when the
+ * connection was created. Times are in microseconds.
+ */
+struct DBusConnectionStats
+{
+  dbus_uint64_t messages_received;   /**< Messages read from the transport */
+  dbus_uint64_t bytes_received;      /**< Bytes in those messages */
+  dbus_uint64_t messages_sent;       /**< Messages written to the transport */
+  dbus_uint64_t bytes_sent;          /**< Bytes in those messages */
+
+  dbus_uint64_t incoming_messages;   /**< Messages received but not yet dispatched */
+  dbus_uint64_t incoming_bytes;      /**< Bytes in received messages that are still alive */
+  dbus_uint64_t outgoing_messages;   /**< Messages queued but not yet sent */
+  dbus_uint64_t outgoing_bytes;      /**< Bytes in those messages */
+  dbus_uint64_t pending_calls;       /**< Method calls still waiting for a reply */
+
+  dbus_uint64_t messages_dispatched; /**< Messages handled by dbus_connection_dispatch() */
+  dbus_uint64_t dispatch_usec;       /**< Time spent in handlers for those messages */
+  dbus_uint64_t blocking_waits;      /**< Times a caller blocked waiting for a reply */
+  dbus_uint64_t blocking_wait_usec;  /**< Time spent blocked */
+
+  dbus_uint64_t dbus_internal_pad[8]; /**< Reserved for future expansion */
+};
+
+DBUS_EXPORT
+void dbus_connection_get_stats             (DBusConnection      *connection,
+                                            DBusConnectionStats *stats);
+
 DBUS_EXPORT
 DBusPreallocatedSend* dbus_connection_preallocate_send       (DBusConnection       *connection);
 DBUS_EXPORT
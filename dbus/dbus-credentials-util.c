@@ -38,6 +38,12 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static DBusCredentials*
 make_credentials(dbus_uid_t  unix_uid,
                  dbus_pid_t  pid,
@@ -184,11 +190,84 @@ _dbus_credentials_test (const char *test_data_dir)
   
   _dbus_credentials_unref (creds2);
 
+  /* Group IDs are copied, and compared as a whole */
+  {
+    dbus_gid_t *gids;
+    const dbus_gid_t *got;
+    size_t n_got;
+
+    gids = dbus_new (dbus_gid_t, 2);
+    if (gids == NULL)
+      _dbus_test_fatal ("oom");
+
+    gids[0] = 42;
+    gids[1] = 1000;
+    _dbus_credentials_take_unix_gids (creds, gids, 2);
+
+    _dbus_assert (_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_GROUP_IDS));
+    _dbus_assert (_dbus_credentials_get_unix_gids (creds, &got, &n_got));
+    _dbus_assert (got == gids);
+    _dbus_assert (n_got == 2);
+
+    creds2 = _dbus_credentials_copy (creds);
+    if (creds2 == NULL)
+      _dbus_test_fatal ("oom");
+
+    _dbus_assert (_dbus_credentials_get_unix_gids (creds2, &got, &n_got));
+    _dbus_assert (got != gids);
+    _dbus_assert (n_got == 2);
+    _dbus_assert (got[0] == 42);
+    _dbus_assert (got[1] == 1000);
+    _dbus_assert (_dbus_credentials_are_superset (creds, creds2));
+
+    gids = dbus_new (dbus_gid_t, 1);
+    if (gids == NULL)
+      _dbus_test_fatal ("oom");
+
+    gids[0] = 42;
+    _dbus_credentials_take_unix_gids (creds2, gids, 1);
+    _dbus_assert (!_dbus_credentials_are_superset (creds, creds2));
+
+    _dbus_credentials_unref (creds2);
+  }
+
+#ifdef DBUS_UNIX
+  /* A process fd is owned by the credentials and duplicated on copy */
+  {
+    int fds[2];
+    int copied;
+
+    if (pipe (fds) != 0)
+      _dbus_test_fatal ("pipe: %s", strerror (errno));
+
+    close (fds[1]);
+    _dbus_credentials_take_pid_fd (creds, fds[0]);
+    _dbus_assert (_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_PROCESS_FD));
+    _dbus_assert (_dbus_credentials_get_pid_fd (creds) == fds[0]);
+
+    creds2 = _dbus_credentials_copy (creds);
+    if (creds2 == NULL)
+      _dbus_test_fatal ("oom");
+
+    copied = _dbus_credentials_get_pid_fd (creds2);
+    _dbus_assert (copied >= 0);
+    _dbus_assert (copied != fds[0]);
+    _dbus_assert (_dbus_credentials_are_superset (creds, creds2));
+
+    _dbus_credentials_unref (creds2);
+    _dbus_assert (fcntl (copied, F_GETFD) == -1 && errno == EBADF);
+    _dbus_assert (fcntl (fds[0], F_GETFD) != -1);
+  }
+#endif
+
   /* Clearing credentials works */
   _dbus_credentials_clear (creds);
 
+  _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_GROUP_IDS));
+
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_USER_ID));
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_PROCESS_ID));
+  _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_PROCESS_FD));
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_WINDOWS_SID));
 
   _dbus_assert (_dbus_credentials_get_unix_uid (creds) == DBUS_UID_UNSET);
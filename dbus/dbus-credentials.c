@@ -25,6 +25,10 @@
 #include "dbus-credentials.h"
 #include "dbus-internals.h"
 
+#ifdef DBUS_UNIX
+#include "dbus-sysdeps-unix.h"
+#endif
+
 /**
  * @defgroup DBusCredentials Credentials provable through authentication
  * @ingroup  DBusInternals
@@ -48,7 +52,11 @@
 struct DBusCredentials {
   int refcount;
   dbus_uid_t unix_uid;
+  dbus_gid_t *unix_gids;
+  size_t n_unix_gids;
   dbus_pid_t pid;
+  /* Owned pidfd referring to the process with this pid, or -1 */
+  int pid_fd;
   char *windows_sid;
   char *linux_security_label;
   void *adt_audit_data;
@@ -78,7 +86,10 @@ _dbus_credentials_new (void)
   
   creds->refcount = 1;
   creds->unix_uid = DBUS_UID_UNSET;
+  creds->unix_gids = NULL;
+  creds->n_unix_gids = 0;
   creds->pid = DBUS_PID_UNSET;
+  creds->pid_fd = -1;
   creds->windows_sid = NULL;
   creds->linux_security_label = NULL;
   creds->adt_audit_data = NULL;
@@ -134,6 +145,8 @@ _dbus_credentials_unref (DBusCredentials    *credentials)
   credentials->refcount -= 1;
   if (credentials->refcount == 0)
     {
+      _dbus_credentials_take_pid_fd (credentials, -1);
+      dbus_free (credentials->unix_gids);
       dbus_free (credentials->windows_sid);
       dbus_free (credentials->linux_security_label);
       dbus_free (credentials->adt_audit_data);
@@ -156,6 +169,30 @@ _dbus_credentials_add_pid (DBusCredentials    *credentials,
   return TRUE;
 }
 
+/**
+ * Add a process file descriptor (on Linux, a pidfd) to the credentials,
+ * replacing any that was already there. Unlike the process ID, this
+ * keeps referring to the same process even after it has exited and
+ * its process ID has been reused.
+ *
+ * @param credentials the object
+ * @param pid_fd the file descriptor, whose ownership is transferred to
+ *  the credentials, or -1 to remove it
+ */
+void
+_dbus_credentials_take_pid_fd (DBusCredentials    *credentials,
+                               int                 pid_fd)
+{
+#ifdef DBUS_UNIX
+  if (credentials->pid_fd >= 0)
+    _dbus_close (credentials->pid_fd, NULL);
+#else
+  _dbus_assert (pid_fd < 0);
+#endif
+
+  credentials->pid_fd = pid_fd;
+}
+
 /**
  * Add a UNIX user ID to the credentials.
  *
@@ -172,6 +209,46 @@ _dbus_credentials_add_unix_uid(DBusCredentials    *credentials,
 
 }
 
+/**
+ * Add UNIX group IDs to the credentials, replacing any group IDs that
+ * might already have been present.
+ *
+ * @param credentials the object
+ * @param gids the group IDs, which will be freed by the DBusCredentials object
+ * @param n_gids the number of group IDs
+ */
+void
+_dbus_credentials_take_unix_gids (DBusCredentials *credentials,
+                                  dbus_gid_t      *gids,
+                                  size_t           n_gids)
+{
+  dbus_free (credentials->unix_gids);
+  credentials->unix_gids = gids;
+  credentials->n_unix_gids = n_gids;
+}
+
+/**
+ * Get the UNIX group IDs.
+ *
+ * @param credentials the object
+ * @param gids the group IDs, which remain owned by the DBusCredentials object
+ * @param n_gids the number of group IDs
+ * @returns #TRUE if group IDs are included
+ */
+dbus_bool_t
+_dbus_credentials_get_unix_gids (DBusCredentials   *credentials,
+                                 const dbus_gid_t **gids,
+                                 size_t            *n_gids)
+{
+  if (gids != NULL)
+    *gids = credentials->unix_gids;
+
+  if (n_gids != NULL)
+    *n_gids = credentials->n_unix_gids;
+
+  return credentials->unix_gids != NULL;
+}
+
 /**
  * Add a Windows user SID to the credentials.
  *
@@ -259,8 +336,12 @@ _dbus_credentials_include (DBusCredentials    *credentials,
     {
     case DBUS_CREDENTIAL_UNIX_PROCESS_ID:
       return credentials->pid != DBUS_PID_UNSET;
+    case DBUS_CREDENTIAL_UNIX_PROCESS_FD:
+      return credentials->pid_fd >= 0;
     case DBUS_CREDENTIAL_UNIX_USER_ID:
       return credentials->unix_uid != DBUS_UID_UNSET;
+    case DBUS_CREDENTIAL_UNIX_GROUP_IDS:
+      return credentials->unix_gids != NULL;
     case DBUS_CREDENTIAL_WINDOWS_SID:
       return credentials->windows_sid != NULL;
     case DBUS_CREDENTIAL_LINUX_SECURITY_LABEL:
@@ -286,6 +367,20 @@ _dbus_credentials_get_pid (DBusCredentials    *credentials)
   return credentials->pid;
 }
 
+/**
+ * Gets the process file descriptor in the credentials, or -1 if
+ * the credentials object doesn't contain one. It remains owned by
+ * the credentials.
+ *
+ * @param credentials the object
+ * @returns a borrowed file descriptor, or -1
+ */
+int
+_dbus_credentials_get_pid_fd (DBusCredentials    *credentials)
+{
+  return credentials->pid_fd;
+}
+
 /**
  * Gets the UNIX user ID in the credentials, or #DBUS_UID_UNSET if
  * the credentials object doesn't contain a user ID.
@@ -368,6 +463,10 @@ _dbus_credentials_are_superset (DBusCredentials    *credentials,
      possible_subset->pid == credentials->pid) &&
     (possible_subset->unix_uid == DBUS_UID_UNSET ||
      possible_subset->unix_uid == credentials->unix_uid) &&
+    (possible_subset->unix_gids == NULL ||
+     (possible_subset->n_unix_gids == credentials->n_unix_gids &&
+      memcmp (possible_subset->unix_gids, credentials->unix_gids,
+              sizeof (dbus_gid_t) * credentials->n_unix_gids) == 0)) &&
     (possible_subset->windows_sid == NULL ||
      (credentials->windows_sid && strcmp (possible_subset->windows_sid,
                                           credentials->windows_sid) == 0)) &&
@@ -393,6 +492,7 @@ _dbus_credentials_are_empty (DBusCredentials    *credentials)
   return
     credentials->pid == DBUS_PID_UNSET &&
     credentials->unix_uid == DBUS_UID_UNSET &&
+    credentials->unix_gids == NULL &&
     credentials->windows_sid == NULL &&
     credentials->linux_security_label == NULL &&
     credentials->adt_audit_data == NULL;
@@ -428,9 +528,15 @@ _dbus_credentials_add_credentials (DBusCredentials    *credentials,
     _dbus_credentials_add_credential (credentials,
                                       DBUS_CREDENTIAL_UNIX_PROCESS_ID,
                                       other_credentials) &&
+    _dbus_credentials_add_credential (credentials,
+                                      DBUS_CREDENTIAL_UNIX_PROCESS_FD,
+                                      other_credentials) &&
     _dbus_credentials_add_credential (credentials,
                                       DBUS_CREDENTIAL_UNIX_USER_ID,
                                       other_credentials) &&
+    _dbus_credentials_add_credential (credentials,
+                                      DBUS_CREDENTIAL_UNIX_GROUP_IDS,
+                                      other_credentials) &&
     _dbus_credentials_add_credential (credentials,
                                       DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID,
                                       other_credentials) &&
@@ -465,12 +571,41 @@ _dbus_credentials_add_credential (DBusCredentials    *credentials,
       if (!_dbus_credentials_add_pid (credentials, other_credentials->pid))
         return FALSE;
     }
+#ifdef DBUS_UNIX
+  else if (which == DBUS_CREDENTIAL_UNIX_PROCESS_FD &&
+           other_credentials->pid_fd >= 0)
+    {
+      int pid_fd = _dbus_dup (other_credentials->pid_fd, NULL);
+
+      /* Running out of file descriptors is not OOM, and the pidfd is
+       * only ever an optimization over the process ID, so just go
+       * without it */
+      if (pid_fd >= 0)
+        _dbus_credentials_take_pid_fd (credentials, pid_fd);
+    }
+#endif
   else if (which == DBUS_CREDENTIAL_UNIX_USER_ID &&
            other_credentials->unix_uid != DBUS_UID_UNSET)
     {
       if (!_dbus_credentials_add_unix_uid (credentials, other_credentials->unix_uid))
         return FALSE;
     }
+  else if (which == DBUS_CREDENTIAL_UNIX_GROUP_IDS &&
+           other_credentials->unix_gids != NULL)
+    {
+      dbus_gid_t *gids;
+
+      gids = dbus_new (dbus_gid_t, other_credentials->n_unix_gids);
+
+      if (gids == NULL)
+        return FALSE;
+
+      memcpy (gids, other_credentials->unix_gids,
+              sizeof (dbus_gid_t) * other_credentials->n_unix_gids);
+
+      _dbus_credentials_take_unix_gids (credentials, gids,
+                                        other_credentials->n_unix_gids);
+    }
   else if (which == DBUS_CREDENTIAL_WINDOWS_SID &&
            other_credentials->windows_sid != NULL)
     {
@@ -503,7 +638,11 @@ void
 _dbus_credentials_clear (DBusCredentials    *credentials)
 {
   credentials->pid = DBUS_PID_UNSET;
+  _dbus_credentials_take_pid_fd (credentials, -1);
   credentials->unix_uid = DBUS_UID_UNSET;
+  dbus_free (credentials->unix_gids);
+  credentials->unix_gids = NULL;
+  credentials->n_unix_gids = 0;
   dbus_free (credentials->windows_sid);
   credentials->windows_sid = NULL;
   dbus_free (credentials->linux_security_label);
@@ -582,6 +721,20 @@ _dbus_credentials_to_string_append (DBusCredentials    *credentials,
         goto oom;
       join = TRUE;
     }
+  if (credentials->unix_gids != NULL)
+    {
+      size_t i;
+
+      for (i = 0; i < credentials->n_unix_gids; i++)
+        {
+          if (!_dbus_string_append_printf (string, "%sgid=" DBUS_GID_FORMAT,
+                                           join ? " " : "",
+                                           credentials->unix_gids[i]))
+            goto oom;
+
+          join = TRUE;
+        }
+    }
   if (credentials->pid != DBUS_PID_UNSET)
     {
       if (!_dbus_string_append_printf (string, "%spid=" DBUS_PID_FORMAT, join ? " " : "", credentials->pid))
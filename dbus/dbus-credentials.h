@@ -33,9 +33,11 @@ DBUS_BEGIN_DECLS
 typedef enum {
   DBUS_CREDENTIAL_UNIX_PROCESS_ID,
   DBUS_CREDENTIAL_UNIX_USER_ID,
+  DBUS_CREDENTIAL_UNIX_GROUP_IDS,
   DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID,
   DBUS_CREDENTIAL_LINUX_SECURITY_LABEL,
-  DBUS_CREDENTIAL_WINDOWS_SID
+  DBUS_CREDENTIAL_WINDOWS_SID,
+  DBUS_CREDENTIAL_UNIX_PROCESS_FD
 } DBusCredentialType;
 
 DBUS_PRIVATE_EXPORT
@@ -50,9 +52,16 @@ DBUS_PRIVATE_EXPORT
 dbus_bool_t      _dbus_credentials_add_pid                  (DBusCredentials    *credentials,
                                                              dbus_pid_t          pid);
 DBUS_PRIVATE_EXPORT
+void             _dbus_credentials_take_pid_fd              (DBusCredentials    *credentials,
+                                                             int                 pid_fd);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t      _dbus_credentials_add_unix_uid             (DBusCredentials    *credentials,
                                                              dbus_uid_t          uid);
 DBUS_PRIVATE_EXPORT
+void             _dbus_credentials_take_unix_gids           (DBusCredentials    *credentials,
+                                                             dbus_gid_t         *gids,
+                                                             size_t              n_gids);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t      _dbus_credentials_add_windows_sid          (DBusCredentials    *credentials,
                                                              const char         *windows_sid);
 dbus_bool_t      _dbus_credentials_add_linux_security_label (DBusCredentials    *credentials,
@@ -66,8 +75,14 @@ dbus_bool_t      _dbus_credentials_include                  (DBusCredentials
 DBUS_PRIVATE_EXPORT
 dbus_pid_t       _dbus_credentials_get_pid                  (DBusCredentials    *credentials);
 DBUS_PRIVATE_EXPORT
+int              _dbus_credentials_get_pid_fd               (DBusCredentials    *credentials);
+DBUS_PRIVATE_EXPORT
 dbus_uid_t       _dbus_credentials_get_unix_uid             (DBusCredentials    *credentials);
 DBUS_PRIVATE_EXPORT
+dbus_bool_t      _dbus_credentials_get_unix_gids            (DBusCredentials    *credentials,
+                                                             const dbus_gid_t  **gids,
+                                                             size_t             *n_gids);
+DBUS_PRIVATE_EXPORT
 const char*      _dbus_credentials_get_windows_sid          (DBusCredentials    *credentials);
 const char *     _dbus_credentials_get_linux_security_label (DBusCredentials    *credentials);
 void *           _dbus_credentials_get_adt_audit_data       (DBusCredentials    *credentials);
@@ -26,6 +26,8 @@
 #include "dbus-threads-internal.h"
 #include <dbus/dbus-test-tap.h>
 
+#include <string.h>
+
 /**
  * @defgroup DBusDataSlot Data slots
  * @ingroup  DBusInternals
@@ -199,6 +201,7 @@ _dbus_data_slot_list_init (DBusDataSlotList *list)
 {
   list->slots = NULL;
   list->n_slots = 0;
+  list->retired = NULL;
 }
 
 /**
@@ -246,20 +249,47 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
       DBusDataSlot *tmp;
       int i;
       
+#ifdef DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE
+      /* A reader might be looking at the old array right now, so copy
+       * it instead of realloc()ing it, and keep it until the list is
+       * freed. There are only ever a handful of slots, so this is
+       * rare and cheap. */
+      tmp = dbus_new (DBusDataSlot, slot + 1);
+      if (tmp == NULL)
+        return FALSE;
+
+      if (list->slots != NULL &&
+          !_dbus_list_prepend (&list->retired, list->slots))
+        {
+          dbus_free (tmp);
+          return FALSE;
+        }
+
+      if (list->n_slots > 0)
+        memcpy (tmp, list->slots, sizeof (DBusDataSlot) * list->n_slots);
+#else
       tmp = dbus_realloc (list->slots,
                           sizeof (DBusDataSlot) * (slot + 1));
       if (tmp == NULL)
         return FALSE;
-      
-      list->slots = tmp;
+#endif
+
       i = list->n_slots;
-      list->n_slots = slot + 1;
-      while (i < list->n_slots)
+      while (i < slot + 1)
         {
-          list->slots[i].data = NULL;
-          list->slots[i].free_data_func = NULL;
+          tmp[i].data = NULL;
+          tmp[i].free_data_func = NULL;
           ++i;
         }
+
+#ifdef DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE
+      /* A reader that sees the new size must also see the new array */
+      __atomic_store_n (&list->slots, tmp, __ATOMIC_RELEASE);
+      __atomic_store_n (&list->n_slots, slot + 1, __ATOMIC_RELEASE);
+#else
+      list->slots = tmp;
+      list->n_slots = slot + 1;
+#endif
     }
 
   _dbus_assert (slot < list->n_slots);
@@ -267,7 +297,11 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
   *old_data = list->slots[slot].data;
   *old_free_func = list->slots[slot].free_data_func;
 
+#ifdef DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE
+  __atomic_store_n (&list->slots[slot].data, data, __ATOMIC_RELEASE);
+#else
   list->slots[slot].data = data;
+#endif
   list->slots[slot].free_data_func = free_data_func;
 
   return TRUE;
@@ -277,6 +311,9 @@ _dbus_data_slot_list_set  (DBusDataSlotAllocator *allocator,
  * Retrieves data previously set with _dbus_data_slot_list_set_data().
  * The slot must still be allocated (must not have been freed).
  *
+ * If #DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE is defined, this may be
+ * called while another thread is in _dbus_data_slot_list_set().
+ *
  * @param allocator the allocator slot was allocated from
  * @param list the data slot list
  * @param slot the slot to get data from
@@ -302,10 +339,19 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
   _dbus_unlock (allocator->lock);
 #endif
 
+#ifdef DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE
+  if (slot >= __atomic_load_n (&list->n_slots, __ATOMIC_ACQUIRE))
+    return NULL;
+  else
+    return __atomic_load_n (&__atomic_load_n (&list->slots,
+                                              __ATOMIC_ACQUIRE)[slot].data,
+                            __ATOMIC_ACQUIRE);
+#else
   if (slot >= list->n_slots)
     return NULL;
   else
     return list->slots[slot].data;
+#endif
 }
 
 /**
@@ -345,6 +391,9 @@ _dbus_data_slot_list_free (DBusDataSlotList *list)
   dbus_free (list->slots);
   list->slots = NULL;
   list->n_slots = 0;
+
+  _dbus_list_foreach (&list->retired, (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&list->retired);
 }
 
 /** @} */
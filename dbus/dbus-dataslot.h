@@ -24,6 +24,7 @@
 #define DBUS_DATASLOT_H
 
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
 
 DBUS_BEGIN_DECLS
 
@@ -70,8 +71,18 @@ struct DBusDataSlotList
 {
   DBusDataSlot *slots;   /**< Data slots */
   int           n_slots; /**< Slots we have storage for in data_slots */
+  DBusList     *retired; /**< Arrays replaced by a bigger one, which a
+                              concurrent _dbus_data_slot_list_get() might
+                              still be reading; freed with the list */
 };
 
+/* With the __atomic builtins, _dbus_data_slot_list_get() can run
+ * concurrently with _dbus_data_slot_list_set(), so a reader need not
+ * take the lock that serializes writers. */
+#if defined(__ATOMIC_ACQUIRE) && defined(__ATOMIC_RELEASE)
+#define DBUS_DATA_SLOT_LIST_GET_IS_LOCK_FREE 1
+#endif
+
 dbus_bool_t _dbus_data_slot_allocator_init  (DBusDataSlotAllocator  *allocator,
                                              DBusGlobalLock          lock);
 dbus_bool_t _dbus_data_slot_allocator_alloc (DBusDataSlotAllocator  *allocator,
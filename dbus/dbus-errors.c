@@ -80,6 +80,54 @@ typedef struct
 
 _DBUS_STATIC_ASSERT (sizeof (DBusRealError) == sizeof (DBusError));
 
+/**
+ * Well-known errors and the longer messages describing them.
+ */
+static const struct
+{
+  const char *name;    /**< error name */
+  const char *message; /**< longer message */
+} well_known_errors[] =
+{
+  { DBUS_ERROR_FAILED, "Unknown error" },
+  { DBUS_ERROR_NO_MEMORY, "Not enough memory available" },
+  { DBUS_ERROR_IO_ERROR, "Error reading or writing data" },
+  { DBUS_ERROR_BAD_ADDRESS, "Could not parse address" },
+  { DBUS_ERROR_NOT_SUPPORTED, "Feature not supported" },
+  { DBUS_ERROR_LIMITS_EXCEEDED, "Resource limits exceeded" },
+  { DBUS_ERROR_ACCESS_DENIED, "Permission denied" },
+  { DBUS_ERROR_AUTH_FAILED, "Could not authenticate to server" },
+  { DBUS_ERROR_NO_SERVER, "No server available at address" },
+  { DBUS_ERROR_TIMEOUT, "Connection timed out" },
+  { DBUS_ERROR_NO_NETWORK, "Network unavailable" },
+  { DBUS_ERROR_ADDRESS_IN_USE, "Address already in use" },
+  { DBUS_ERROR_DISCONNECTED, "Disconnected." },
+  { DBUS_ERROR_INVALID_ARGS, "Invalid arguments." },
+  { DBUS_ERROR_NO_REPLY, "Did not get a reply message." },
+  { DBUS_ERROR_FILE_NOT_FOUND, "File doesn't exist." },
+  { DBUS_ERROR_OBJECT_PATH_IN_USE, "Object path already in use" }
+};
+
+/**
+ * Looks up a well-known error name.
+ *
+ * @param error the error name
+ * @returns its index in well_known_errors, or -1 if unknown
+ */
+static int
+find_well_known_error (const char *error)
+{
+  int i;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (well_known_errors); i++)
+    {
+      if (strcmp (error, well_known_errors[i].name) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
 /**
  * Returns a longer message describing an error name.
  * If the error name is unknown, returns the name
@@ -91,42 +139,12 @@ _DBUS_STATIC_ASSERT (sizeof (DBusRealError) == sizeof (DBusError));
 static const char*
 message_from_error (const char *error)
 {
-  if (strcmp (error, DBUS_ERROR_FAILED) == 0)
-    return "Unknown error";
-  else if (strcmp (error, DBUS_ERROR_NO_MEMORY) == 0)
-    return "Not enough memory available";
-  else if (strcmp (error, DBUS_ERROR_IO_ERROR) == 0)
-    return "Error reading or writing data";
-  else if (strcmp (error, DBUS_ERROR_BAD_ADDRESS) == 0)
-    return "Could not parse address";
-  else if (strcmp (error, DBUS_ERROR_NOT_SUPPORTED) == 0)
-    return "Feature not supported";
-  else if (strcmp (error, DBUS_ERROR_LIMITS_EXCEEDED) == 0)
-    return "Resource limits exceeded";
-  else if (strcmp (error, DBUS_ERROR_ACCESS_DENIED) == 0)
-    return "Permission denied";
-  else if (strcmp (error, DBUS_ERROR_AUTH_FAILED) == 0)
-    return "Could not authenticate to server";
-  else if (strcmp (error, DBUS_ERROR_NO_SERVER) == 0)
-    return "No server available at address";
-  else if (strcmp (error, DBUS_ERROR_TIMEOUT) == 0)
-    return "Connection timed out";
-  else if (strcmp (error, DBUS_ERROR_NO_NETWORK) == 0)
-    return "Network unavailable";
-  else if (strcmp (error, DBUS_ERROR_ADDRESS_IN_USE) == 0)
-    return "Address already in use";
-  else if (strcmp (error, DBUS_ERROR_DISCONNECTED) == 0)
-    return "Disconnected.";
-  else if (strcmp (error, DBUS_ERROR_INVALID_ARGS) == 0)
-    return "Invalid arguments.";
-  else if (strcmp (error, DBUS_ERROR_NO_REPLY) == 0)
-    return "Did not get a reply message.";
-  else if (strcmp (error, DBUS_ERROR_FILE_NOT_FOUND) == 0)
-    return "File doesn't exist.";
-  else if (strcmp (error, DBUS_ERROR_OBJECT_PATH_IN_USE) == 0)
-    return "Object path already in use";
-  else
+  int i = find_well_known_error (error);
+
+  if (i < 0)
     return error;
+
+  return well_known_errors[i].message;
 }
 
 /** @} */ /* End of internals */
@@ -387,13 +405,39 @@ _dbus_set_error_valist (DBusError  *error,
   _dbus_assert (error->name == NULL);
   _dbus_assert (error->message == NULL);
 
+  real = (DBusRealError *)error;
+
+  if (format == NULL)
+    {
+      int i = find_well_known_error (name);
+
+      /* Both strings are ours and constant, so there is nothing to
+       * allocate; this is the common case for out-of-memory and
+       * access-denied errors */
+      if (i >= 0)
+        {
+          real->name = (char *) well_known_errors[i].name;
+          real->message = (char *) well_known_errors[i].message;
+          real->const_message = TRUE;
+          return;
+        }
+    }
+
   if (!_dbus_string_init (&str))
     goto nomem;
   
   if (format == NULL)
     {
-      if (!_dbus_string_append (&str,
-                                message_from_error (name)))
+      if (!_dbus_string_append (&str, name))
+        {
+          _dbus_string_free (&str);
+          goto nomem;
+        }
+    }
+  else if (strchr (format, '%') == NULL)
+    {
+      /* Nothing to format */
+      if (!_dbus_string_append (&str, format))
         {
           _dbus_string_free (&str);
           goto nomem;
@@ -408,8 +452,6 @@ _dbus_set_error_valist (DBusError  *error,
         }
     }
 
-  real = (DBusRealError *)error;
-
   if (!_dbus_string_steal_data (&str, &real->message))
     {
       _dbus_string_free (&str);
@@ -149,6 +149,9 @@ struct DBusHashEntry
                            */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
+  unsigned int hash;      /**< string_hash() of the key, for
+                           * #DBUS_HASH_STRING tables only
+                           */
 };
 
 /**
@@ -272,6 +275,13 @@ static void           free_entry_data           (DBusHashTable          *table,
  * Indicates the type of a key in the hash table.
  */
 
+#ifdef DBUS_ENABLE_STATS
+/* Totals over all hash tables in this process, which may be used from
+ * several threads */
+static DBusAtomic stats_n_tables = { 0 };
+static DBusAtomic stats_n_entries = { 0 };
+#endif
+
 /**
  * Constructs a new hash table. Should be freed with
  * _dbus_hash_table_unref(). If memory cannot be
@@ -334,6 +344,10 @@ _dbus_hash_table_new (DBusHashType     type,
   table->free_key_function = key_free_function;
   table->free_value_function = value_free_function;
 
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_inc (&stats_n_tables);
+#endif
+
   return table;
 }
 
@@ -394,13 +408,20 @@ _dbus_hash_table_unref (DBusHashTable *table)
           while (entry != NULL)
             {
               free_entry_data (table, entry);
-              
+#ifdef DBUS_ENABLE_STATS
+              _dbus_atomic_dec (&stats_n_entries);
+#endif
+
               entry = entry->next;
             }
         }
       /* We can do this very quickly with memory pools ;-) */
       _dbus_mem_pool_free (table->entry_pool);
 #endif
+
+#ifdef DBUS_ENABLE_STATS
+      _dbus_atomic_dec (&stats_n_tables);
+#endif
       
       /* Free the bucket array, if it was dynamically allocated. */
       if (table->buckets != table->static_buckets)
@@ -480,6 +501,9 @@ remove_entry (DBusHashTable  *table,
     }
   
   table->n_entries -= 1;
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_dec (&stats_n_entries);
+#endif
   free_entry (table, entry);
 }
 
@@ -781,12 +805,14 @@ static void
 add_allocated_entry (DBusHashTable   *table,
                      DBusHashEntry   *entry,
                      unsigned int     idx,
+                     unsigned int     hash,
                      void            *key,
                      DBusHashEntry ***bucket)
 {
   DBusHashEntry **b;  
   
   entry->key = key;
+  entry->hash = hash;
   
   b = &(table->buckets[idx]);
   entry->next = *b;
@@ -796,6 +822,9 @@ add_allocated_entry (DBusHashTable   *table,
     *bucket = b;
   
   table->n_entries += 1;
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_inc (&stats_n_entries);
+#endif
 
   /* note we ONLY rebuild when ADDING - because you can iterate over a
    * table and remove entries safely.
@@ -808,6 +837,7 @@ add_allocated_entry (DBusHashTable   *table,
 static DBusHashEntry*
 add_entry (DBusHashTable        *table, 
            unsigned int          idx,
+           unsigned int          hash,
            void                 *key,
            DBusHashEntry      ***bucket,
            DBusPreallocatedHash *preallocated)
@@ -829,7 +859,7 @@ add_entry (DBusHashTable        *table,
       entry = (DBusHashEntry*) preallocated;
     }
 
-  add_allocated_entry (table, entry, idx, key, bucket);
+  add_allocated_entry (table, entry, idx, hash, key, bucket);
 
   return entry;
 }
@@ -857,6 +887,7 @@ static DBusHashEntry*
 find_generic_function (DBusHashTable        *table,
                        void                 *key,
                        unsigned int          idx,
+                       unsigned int          hash,
                        KeyCompareFunc        compare_func,
                        dbus_bool_t           create_if_not_found,
                        DBusHashEntry      ***bucket,
@@ -871,8 +902,11 @@ find_generic_function (DBusHashTable        *table,
   entry = table->buckets[idx];
   while (entry != NULL)
     {
+      /* keys with different hashes can't be equal, so only
+       * compare keys whose stored hash matches */
       if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+          (compare_func != NULL && hash == entry->hash &&
+           (* compare_func) (key, entry->key) == 0))
         {
           if (bucket)
             *bucket = &(table->buckets[idx]);
@@ -887,7 +921,7 @@ find_generic_function (DBusHashTable        *table,
     }
 
   if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
+    entry = add_entry (table, idx, hash, key, bucket, preallocated);
   else if (preallocated)
     _dbus_hash_table_free_preallocated_entry (table, preallocated);
   
@@ -901,11 +935,11 @@ find_string_function (DBusHashTable        *table,
                       DBusHashEntry      ***bucket,
                       DBusPreallocatedHash *preallocated)
 {
-  unsigned int idx;
+  unsigned int hash;
   
-  idx = string_hash (key) & table->mask;
+  hash = string_hash (key);
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, hash & table->mask, hash,
                                 (KeyCompareFunc) strcmp, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -922,7 +956,7 @@ find_direct_function (DBusHashTable        *table,
   idx = RANDOM_INDEX (table, key) & table->mask;
 
 
-  return find_generic_function (table, key, idx,
+  return find_generic_function (table, key, idx, 0,
                                 NULL, create_if_not_found, bucket,
                                 preallocated);
 }
@@ -1023,7 +1057,8 @@ rebuild_table (DBusHashTable *table)
           switch (table->key_type)
             {
             case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
+              /* no need to hash the string again */
+              idx = entry->hash & table->mask;
               break;
             case DBUS_HASH_INT:
             case DBUS_HASH_UINTPTR:
@@ -1410,6 +1445,28 @@ _dbus_hash_table_get_n_entries (DBusHashTable *table)
   return table->n_entries;
 }
 
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets the number of hash tables and hash entries in this process,
+ * and the memory used for them, not counting the bucket arrays of
+ * tables that have grown or memory pool overhead.
+ *
+ * @param n_tables_p return location for the number of tables
+ * @param n_entries_p return location for the number of entries
+ * @param bytes_p return location for the number of bytes
+ */
+void
+_dbus_hash_get_stats (dbus_uint32_t *n_tables_p,
+                      dbus_uint32_t *n_entries_p,
+                      dbus_uint32_t *bytes_p)
+{
+  *n_tables_p = _dbus_atomic_get_relaxed (&stats_n_tables);
+  *n_entries_p = _dbus_atomic_get_relaxed (&stats_n_entries);
+  *bytes_p = *n_tables_p * sizeof (DBusHashTable) +
+             *n_entries_p * sizeof (DBusHashEntry);
+}
+#endif
+
 /**
  * Imports a string array into a hash table
  * The hash table needs to be initialized with string keys,
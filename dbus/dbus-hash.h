@@ -135,6 +135,12 @@ dbus_bool_t    _dbus_hash_table_insert_uintptr     (DBusHashTable    *table,
 DBUS_PRIVATE_EXPORT
 int            _dbus_hash_table_get_n_entries      (DBusHashTable    *table);
 
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+void           _dbus_hash_get_stats                (dbus_uint32_t    *n_tables_p,
+                                                    dbus_uint32_t    *n_entries_p,
+                                                    dbus_uint32_t    *bytes_p);
+
 DBUS_PRIVATE_EXPORT
 char **        _dbus_hash_table_to_array           (DBusHashTable     *table,
                                                     char               delimiter);
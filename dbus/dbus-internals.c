@@ -525,6 +525,68 @@ _dbus_trace_ref (const char *obj_name,
 
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 
+#ifdef DBUS_ENABLE_STATS
+/**
+ * Gets the current monotonic time as a single count of microseconds,
+ * for measuring intervals.
+ *
+ * @returns microseconds since an arbitrary point in the past
+ */
+dbus_int64_t
+_dbus_get_monotonic_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return ((dbus_int64_t) tv_sec) * 1000000 + tv_usec;
+}
+
+/**
+ * Counts one latency sample in a histogram. Negative latencies,
+ * which can only come from timestamps that were never set, count
+ * as zero.
+ *
+ * @param histogram the histogram
+ * @param usec the latency in microseconds
+ */
+void
+_dbus_latency_histogram_add (DBusLatencyHistogram *histogram,
+                             dbus_int64_t          usec)
+{
+  int bucket = 0;
+
+  while (usec > 0 && bucket < _DBUS_LATENCY_HISTOGRAM_BUCKETS - 1)
+    {
+      usec >>= 1;
+      bucket++;
+    }
+
+  if (histogram->buckets[bucket] < _DBUS_UINT32_MAX)
+    histogram->buckets[bucket]++;
+}
+
+/**
+ * Adds the counts of one histogram to another.
+ *
+ * @param histogram the histogram to add to
+ * @param other the histogram to add
+ */
+void
+_dbus_latency_histogram_merge (DBusLatencyHistogram       *histogram,
+                               const DBusLatencyHistogram *other)
+{
+  int i;
+
+  for (i = 0; i < _DBUS_LATENCY_HISTOGRAM_BUCKETS; i++)
+    {
+      if (histogram->buckets[i] > _DBUS_UINT32_MAX - other->buckets[i])
+        histogram->buckets[i] = _DBUS_UINT32_MAX;
+      else
+        histogram->buckets[i] += other->buckets[i];
+    }
+}
+#endif /* DBUS_ENABLE_STATS */
+
 /**
  * Duplicates a string. Result must be freed with
  * dbus_free(). Returns #NULL if memory allocation fails.
@@ -358,10 +358,15 @@ typedef enum
   _DBUS_LOCK_shutdown_funcs,
   _DBUS_LOCK_system_users,
   _DBUS_LOCK_message_cache,
-  /* index 10-12 */
+  /* index 10-14 */
   _DBUS_LOCK_shared_connections,
   _DBUS_LOCK_machine_uuid,
   _DBUS_LOCK_sysdeps,
+  _DBUS_LOCK_signature_cache,
+  _DBUS_LOCK_message_bodies,
+  /* index 15-19 */
+  _DBUS_LOCK_keyrings,
+  _DBUS_LOCK_nonce_cache,
 
   _DBUS_N_GLOBAL_LOCKS
 } DBusGlobalLock;
@@ -424,6 +429,30 @@ dbus_bool_t _dbus_get_local_machine_uuid_encoded (DBusString *uuid_str,
   typedef struct { char _assertion[(expr) ? 1 : -1]; } \
   _DBUS_PASTE (_DBUS_STATIC_ASSERT_, __LINE__) _DBUS_GNUC_UNUSED
 
+/** Number of buckets in a #DBusLatencyHistogram */
+#define _DBUS_LATENCY_HISTOGRAM_BUCKETS 32
+
+/**
+ * Counts of latencies in logarithmic buckets. Bucket 0 counts
+ * latencies of 0 microseconds and bucket n > 0 counts latencies
+ * of 2**(n-1) up to 2**n - 1 microseconds; the last bucket also
+ * counts anything longer.
+ */
+typedef struct
+{
+  dbus_uint32_t buckets[_DBUS_LATENCY_HISTOGRAM_BUCKETS]; /**< Count of samples per bucket */
+} DBusLatencyHistogram;
+
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+dbus_int64_t _dbus_get_monotonic_usec     (void);
+DBUS_PRIVATE_EXPORT
+void         _dbus_latency_histogram_add   (DBusLatencyHistogram       *histogram,
+                                            dbus_int64_t                usec);
+DBUS_PRIVATE_EXPORT
+void         _dbus_latency_histogram_merge (DBusLatencyHistogram       *histogram,
+                                            const DBusLatencyHistogram *other);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_INTERNALS_H */
@@ -118,8 +118,19 @@ struct DBusKeyring
   DBusKey *keys; /**< Keys loaded from the file */
   int n_keys;    /**< Number of keys */
   DBusCredentials *credentials; /**< Credentials containing user the keyring is for */
+  DBusStat file_stat; /**< The keyring file as of when keys were loaded */
+  dbus_bool_t have_file_stat; /**< #TRUE if file_stat can be trusted */
 };
 
+/**
+ * Keyrings that have been loaded, so that authenticating each connection
+ * doesn't have to read the cookie file again unless it has changed.
+ * Each holds a reference. Keyrings are shared between threads through
+ * this list, so it and everything about the keyrings in it is protected
+ * by _DBUS_LOCK (keyrings).
+ */
+static DBusList *keyring_cache = NULL;
+
 static DBusKeyring*
 _dbus_keyring_new (void)
 {
@@ -141,6 +152,7 @@ _dbus_keyring_new (void)
   keyring->refcount = 1;
   keyring->keys = NULL;
   keyring->n_keys = 0;
+  keyring->have_file_stat = FALSE;
 
   return keyring;
 
@@ -373,6 +385,55 @@ add_new_key (DBusKey  **keys_p,
   return retval;
 }
 
+/*
+ * Remember what the keyring file looked like when we read or wrote it.
+ * A file modified during the current second might be modified again
+ * within that second without its timestamps changing, so we don't
+ * trust the stamp until it is old enough to tell such changes apart.
+ */
+static void
+keyring_note_file_stat (DBusKeyring *keyring,
+                        long         now)
+{
+  keyring->have_file_stat =
+    _dbus_stat (&keyring->filename, &keyring->file_stat, NULL) &&
+    (long) keyring->file_stat.mtime < now &&
+    (long) keyring->file_stat.ctime < now;
+}
+
+/* TRUE if the keyring file might differ from the keys we loaded */
+static dbus_bool_t
+keyring_file_changed (DBusKeyring *keyring)
+{
+  DBusStat st;
+
+  if (!keyring->have_file_stat)
+    return TRUE;
+
+  if (!_dbus_stat (&keyring->filename, &st, NULL))
+    return TRUE;
+
+  return st.mtime != keyring->file_stat.mtime ||
+         st.ctime != keyring->file_stat.ctime ||
+         st.size != keyring->file_stat.size;
+}
+
+static DBusKey *
+find_recent_key_in (DBusKey *keys,
+                    int      n_keys,
+                    long     now)
+{
+  int i;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      if ((now - NEW_KEY_TIMEOUT_SECONDS) < keys[i].creation_time)
+        return &keys[i];
+    }
+
+  return NULL;
+}
+
 /**
  * Reloads the keyring file, optionally adds one new key to the file,
  * removes all expired keys from the file iff a key was added, then
@@ -380,7 +441,8 @@ add_new_key (DBusKey  **keys_p,
  * Note that the file is only resaved (written to) if a key is added,
  * this means that only servers ever write to the file and need to
  * lock it, which avoids a lot of lock contention at login time and
- * such.
+ * such. If another process added a recent-enough key while we were
+ * waiting for the lock, we use that one and leave the file alone.
  *
  * @param keyring the keyring
  * @param add_new #TRUE to add a new key to the file, expire keys, and resave
@@ -439,6 +501,10 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       have_lock = TRUE;
     }
 
+  /* Stat before reading, so that if the file changes in between we
+   * will notice next time */
+  keyring_note_file_stat (keyring, now);
+
   dbus_error_init (&tmp_error);
   if (!_dbus_file_get_contents (&contents, 
                                 &keyring->filename,
@@ -555,6 +621,12 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   _dbus_verbose ("Successfully loaded %d existing keys\n",
                  n_keys);
 
+  if (add_new && find_recent_key_in (keys, n_keys, now) != NULL)
+    {
+      _dbus_verbose ("Another process added a recent key, not adding one\n");
+      add_new = FALSE;
+    }
+
   if (add_new)
     {
       if (!add_new_key (&keys, &n_keys, error))
@@ -602,6 +674,8 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       if (!_dbus_string_save_to_file (&contents, &keyring->filename,
                                       FALSE, error))
         goto out;
+
+      keyring_note_file_stat (keyring, now);
     }
 
   if (keyring->keys)
@@ -663,8 +737,13 @@ _dbus_keyring_reload (DBusKeyring *keyring,
 DBusKeyring *
 _dbus_keyring_ref (DBusKeyring *keyring)
 {
+  /* Can't fail: we already took this lock to create the keyring */
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("keyrings lock was usable before");
+
   keyring->refcount += 1;
 
+  _DBUS_UNLOCK (keyrings);
   return keyring;
 }
 
@@ -677,9 +756,17 @@ _dbus_keyring_ref (DBusKeyring *keyring)
 void
 _dbus_keyring_unref (DBusKeyring *keyring)
 {
+  dbus_bool_t last;
+
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("keyrings lock was usable before");
+
   keyring->refcount -= 1;
+  last = (keyring->refcount == 0);
+
+  _DBUS_UNLOCK (keyrings);
 
-  if (keyring->refcount == 0)
+  if (last)
     {
       if (keyring->credentials)
         _dbus_credentials_unref (keyring->credentials);
@@ -692,11 +779,43 @@ _dbus_keyring_unref (DBusKeyring *keyring)
     }
 }
 
+static void
+keyring_cache_shutdown (void *data)
+{
+  DBusKeyring *keyring;
+
+  while ((keyring = _dbus_list_pop_first (&keyring_cache)) != NULL)
+    _dbus_keyring_unref (keyring);
+}
+
+/* Called with _DBUS_LOCK (keyrings) held */
+static DBusKeyring *
+keyring_cache_lookup (const DBusString *filename)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&keyring_cache);
+       link != NULL;
+       link = _dbus_list_get_next_link (&keyring_cache, link))
+    {
+      DBusKeyring *keyring = link->data;
+
+      if (_dbus_string_equal (&keyring->filename, filename))
+        return keyring;
+    }
+
+  return NULL;
+}
+
 /**
  * Creates a new keyring that lives in the ~/.dbus-keyrings directory
  * of the user represented by @p credentials. If the @p credentials are
  * #NULL or empty, uses those of the current process.
  *
+ * Keyrings are cached for the lifetime of the process: asking for the
+ * same keyring again returns the cached one, re-reading the cookie file
+ * only if it has changed since it was last read.
+ *
  * @param credentials a set of credentials representing a user or #NULL
  * @param context which keyring to get
  * @param error return location for errors
@@ -712,6 +831,7 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   dbus_bool_t error_set;
   DBusError tmp_error;
   DBusCredentials *our_credentials;
+  DBusKeyring *cached;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -726,8 +846,15 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   error_set = FALSE;
   our_credentials = NULL;
   
+  if (!_DBUS_LOCK (keyrings))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return NULL;
+    }
+
   if (!_dbus_string_init (&ringdir))
     {
+      _DBUS_UNLOCK (keyrings);
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       return NULL;
     }
@@ -794,6 +921,39 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   if (!_dbus_string_append (&keyring->filename_lock, ".lock"))
     goto failed;
 
+  cached = keyring_cache_lookup (&keyring->filename);
+
+  if (cached != NULL)
+    {
+      _dbus_keyring_unref (keyring);
+      keyring = _dbus_keyring_ref (cached);
+
+      if (keyring_file_changed (keyring))
+        {
+          dbus_error_init (&tmp_error);
+
+          if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+            {
+              _dbus_verbose ("didn't reload cached keyring: %s\n",
+                             tmp_error.message);
+              dbus_error_free (&tmp_error);
+            }
+        }
+
+      _dbus_string_free (&ringdir);
+      _DBUS_UNLOCK (keyrings);
+      return keyring;
+    }
+
+  if (keyring_cache == NULL &&
+      !_dbus_register_shutdown_func (keyring_cache_shutdown, NULL))
+    goto failed;
+
+  if (!_dbus_list_append (&keyring_cache, keyring))
+    goto failed;
+
+  _dbus_keyring_ref (keyring);
+
   /* Reload keyring */
   dbus_error_init (&tmp_error);
   if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
@@ -817,6 +977,7 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
     }
 
   _dbus_string_free (&ringdir);
+  _DBUS_UNLOCK (keyrings);
   
   return keyring;
   
@@ -830,6 +991,7 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   if (keyring)
     _dbus_keyring_unref (keyring);
   _dbus_string_free (&ringdir);
+  _DBUS_UNLOCK (keyrings);
   return NULL;
 
 }
@@ -909,26 +1071,10 @@ _dbus_keyring_validate_context (const DBusString *context)
 static DBusKey*
 find_recent_key (DBusKeyring *keyring)
 {
-  int i;
-  long tv_sec, tv_usec;
-
-  _dbus_get_real_time (&tv_sec, &tv_usec);
-  
-  i = 0;
-  while (i < keyring->n_keys)
-    {
-      DBusKey *key = &keyring->keys[i];
-
-      _dbus_verbose ("Key %d is %ld seconds old\n",
-                     i, tv_sec - key->creation_time);
-      
-      if ((tv_sec - NEW_KEY_TIMEOUT_SECONDS) < key->creation_time)
-        return key;
-      
-      ++i;
-    }
+  long tv_sec;
 
-  return NULL;
+  _dbus_get_real_time (&tv_sec, NULL);
+  return find_recent_key_in (keyring->keys, keyring->n_keys, tv_sec);
 }
 
 /**
@@ -948,29 +1094,38 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
 {
   DBusKey *key;
 
+  int id = -1;
+
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("keyrings lock was usable before");
   
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    {
+      id = key->id;
+      goto out;
+    }
 
   /* All our keys are too old, or we've never loaded the
    * keyring. Create a new one.
    */
   if (!_dbus_keyring_reload (keyring, TRUE,
                              error))
-    return -1;
+    goto out;
 
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    id = key->id;
   else
-    {
-      dbus_set_error_const (error,
-                            DBUS_ERROR_FAILED,
-                            "No recent-enough key found in keyring, and unable to create a new key");
-      return -1;
-    }
+    dbus_set_error_const (error,
+                          DBUS_ERROR_FAILED,
+                          "No recent-enough key found in keyring, and unable to create a new key");
+
+out:
+  _DBUS_UNLOCK (keyrings);
+  return id;
 }
 
 /**
@@ -1006,16 +1161,36 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                            DBusString        *hex_key)
 {
   DBusKey *key;
+  dbus_bool_t ret;
+
+  if (!_DBUS_LOCK (keyrings))
+    _dbus_assert_not_reached ("keyrings lock was usable before");
 
   key = find_key_by_id (keyring->keys,
                         keyring->n_keys,
                         key_id);
+
+  /* The key might have been added by another process since we cached
+   * the keyring */
+  if (key == NULL && keyring_file_changed (keyring))
+    {
+      DBusError tmp_error = DBUS_ERROR_INIT;
+
+      if (_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+        key = find_key_by_id (keyring->keys, keyring->n_keys, key_id);
+      else
+        dbus_error_free (&tmp_error);
+    }
+
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    ret = TRUE; /* had enough memory, so TRUE */
+  else
+    ret = _dbus_string_hex_encode (&key->secret, 0,
+                                   hex_key,
+                                   _dbus_string_get_length (hex_key));
 
-  return _dbus_string_hex_encode (&key->secret, 0,
-                                  hex_key,
-                                  _dbus_string_get_length (hex_key));
+  _DBUS_UNLOCK (keyrings);
+  return ret;
 }
 
 /** @} */ /* end of exposed API */
@@ -1131,6 +1306,39 @@ _dbus_keyring_test (void)
 
   _dbus_test_diag (" %d keys in test", ring1->n_keys);
 
+  /* The second keyring came from the cache */
+  _dbus_assert (ring1 == ring2);
+
+  /* A key that another process adds to the file is picked up the next
+   * time the keyring is asked for */
+  {
+    DBusString contents;
+    DBusKeyring *ring3;
+    long now;
+
+    _dbus_get_real_time (&now, NULL);
+
+    if (!_dbus_string_init (&contents))
+      _dbus_test_fatal ("no memory");
+
+    /* Put it first, so that it isn't beyond MAX_KEYS_IN_FILE */
+    if (!_dbus_string_append_printf (&contents, "%d %ld 0123456789abcdef\n",
+                                     _DBUS_INT32_MAX, now) ||
+        !_dbus_file_get_contents (&contents, &ring1->filename, &error) ||
+        !_dbus_string_save_to_file (&contents, &ring1->filename, FALSE,
+                                    &error))
+      _dbus_test_fatal ("Could not rewrite keyring: %s",
+                        error.name != NULL ? error.message : "no memory");
+
+    _dbus_string_free (&contents);
+
+    ring3 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
+    _dbus_assert (ring3 == ring1);
+    _dbus_assert (find_key_by_id (ring3->keys, ring3->n_keys,
+                                  _DBUS_INT32_MAX) != NULL);
+    _dbus_keyring_unref (ring3);
+  }
+
   /* Test ref/unref */
   _dbus_keyring_ref (ring1);
   _dbus_keyring_ref (ring2);
@@ -51,31 +51,26 @@ static DBusMemPool *list_pool;
 
 /* the mem pool is probably a speed hit, with the thread
  * lock, though it does still save memory - unknown.
+ * Functions that allocate or free many links at once take the
+ * lock once and use the _unlocked variants.
  */
 static DBusList*
-alloc_link (void *data)
+alloc_link_unlocked (void *data)
 {
   DBusList *link;
 
-  if (!_DBUS_LOCK (list))
-    return FALSE;
-
   if (list_pool == NULL)
     {      
       list_pool = _dbus_mem_pool_new (sizeof (DBusList), TRUE);
 
       if (list_pool == NULL)
-        {
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
+        return NULL;
 
       link = _dbus_mem_pool_alloc (list_pool);
       if (link == NULL)
         {
           _dbus_mem_pool_free (list_pool);
           list_pool = NULL;
-          _DBUS_UNLOCK (list);
           return NULL;
         }
     }
@@ -86,6 +81,29 @@ alloc_link (void *data)
 
   if (link)
     link->data = data;
+
+  return link;
+}
+
+static void
+free_link_unlocked (DBusList *link)
+{
+  if (_dbus_mem_pool_dealloc (list_pool, link))
+    {
+      _dbus_mem_pool_free (list_pool);
+      list_pool = NULL;
+    }
+}
+
+static DBusList*
+alloc_link (void *data)
+{
+  DBusList *link;
+
+  if (!_DBUS_LOCK (list))
+    return FALSE;
+
+  link = alloc_link_unlocked (data);
   
   _DBUS_UNLOCK (list);
 
@@ -99,11 +117,7 @@ free_link (DBusList *link)
     _dbus_assert_not_reached ("we should have initialized global locks "
         "before we allocated a linked-list link");
 
-  if (_dbus_mem_pool_dealloc (list_pool, link))
-    {
-      _dbus_mem_pool_free (list_pool);
-      list_pool = NULL;
-    }
+  free_link_unlocked (link);
   
   _DBUS_UNLOCK (list);
 }
@@ -544,16 +558,25 @@ _dbus_list_clear (DBusList **list)
 {
   DBusList *link;
 
+  if (*list == NULL)
+    return;
+
+  if (!_DBUS_LOCK (list))
+    _dbus_assert_not_reached ("we should have initialized global locks "
+        "before we allocated a linked-list link");
+
   link = *list;
   while (link != NULL)
     {
       DBusList *next = _dbus_list_get_next_link (list, link);
       
-      free_link (link);
+      free_link_unlocked (link);
       
       link = next;
     }
 
+  _DBUS_UNLOCK (list);
+
   *list = NULL;
 }
 
@@ -703,20 +726,37 @@ _dbus_list_copy (DBusList **list,
   _dbus_assert (list != dest);
 
   *dest = NULL;
-  
+
+  if (*list == NULL)
+    return TRUE;
+
+  if (!_DBUS_LOCK (list))
+    return FALSE;
+
   link = *list;
   while (link != NULL)
     {
-      if (!_dbus_list_append (dest, link->data))
+      DBusList *copy;
+
+      copy = alloc_link_unlocked (link->data);
+
+      if (copy == NULL)
         {
+          _DBUS_UNLOCK (list);
           /* free what we have so far */
           _dbus_list_clear (dest);
           return FALSE;
         }
+
+      /* append: prepend, then make the new link the tail */
+      link_before (dest, *dest, copy);
+      *dest = (*dest)->next;
       
       link = _dbus_list_get_next_link (list, link);
     }
 
+  _DBUS_UNLOCK (list);
+
   return TRUE;
 }
 
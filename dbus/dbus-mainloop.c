@@ -41,44 +41,102 @@ struct DBusLoop
   /** DBusPollable => dbus_malloc'd DBusList ** of references to DBusWatch */
   DBusHashTable *watches;
   DBusSocketSet *socket_set;
-  DBusList *timeouts;
+  /** DBusTimeout => TimeoutCallback, for all timeouts */
+  DBusHashTable *timeouts;
+  /** Enabled timeouts, as a binary min-heap ordered by deadline */
+  struct TimeoutCallback **timeout_heap;
+  int n_timeout_heap_allocated;
+  int n_enabled_timeouts;
+  /** Incremented each time we check for expired timeouts */
+  unsigned int timeout_pass;
   int callback_list_serial;
   int watch_count;
   int timeout_count;
   int depth; /**< number of recursive runs */
   DBusList *need_dispatch;
+  /** Connections to dispatch before anything in need_dispatch */
+  DBusList *need_priority_dispatch;
+  /** DBusPollable => DBusLoopPriority, for descriptors whose priority
+   * is not DBUS_LOOP_PRIORITY_NORMAL */
+  DBusHashTable *priority_fds;
+  /** How many low-priority descriptors to handle per iteration, or 0
+   * for no limit */
+  int low_priority_budget;
+  /** Where in the list of ready descriptors to start next time, so that
+   * one whose callback changes the watches can't keep the rest waiting */
+  unsigned int ready_rotation;
+  /** Monotonic time when the loop last woke up, valid while now_valid */
+  dbus_int64_t now_usec;
+  /** TRUE while callbacks are running for a single wakeup, so they can
+   * share one clock read instead of making their own */
+  unsigned now_valid : 1;
   /** TRUE if we will skip a watch next time because it was OOM; becomes
    * FALSE between polling, and dealing with the results of the poll */
   unsigned oom_watch_pending : 1;
 };
 
-typedef struct
+typedef struct TimeoutCallback
 {
   DBusTimeout *timeout;
-  long last_tv_sec;
-  long last_tv_usec;
+  dbus_int64_t last_usec;    /**< When the interval started */
+  dbus_int64_t deadline_usec; /**< When it ends, if enabled */
+  int heap_index;            /**< Position in timeout_heap, or -1 */
+  unsigned int fired_pass;   /**< timeout_pass when it last fired */
 } TimeoutCallback;
 
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
 
+static dbus_int64_t
+monotonic_usec (void)
+{
+  long tv_sec;
+  long tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return (dbus_int64_t) tv_sec * 1000000 + tv_usec;
+}
+
+/* The time of the current wakeup if there is one, or a fresh reading */
+static dbus_int64_t
+loop_now_usec (DBusLoop *loop)
+{
+  if (loop->now_valid)
+    return loop->now_usec;
+
+  return monotonic_usec ();
+}
+
+static void
+refresh_now (DBusLoop *loop)
+{
+  loop->now_usec = monotonic_usec ();
+  loop->now_valid = TRUE;
+}
+
 static TimeoutCallback*
-timeout_callback_new (DBusTimeout         *timeout)
+timeout_callback_new (DBusLoop            *loop,
+                      DBusTimeout         *timeout)
 {
   TimeoutCallback *cb;
 
-  cb = dbus_new (TimeoutCallback, 1);
+  cb = dbus_new0 (TimeoutCallback, 1);
   if (cb == NULL)
     return NULL;
 
   cb->timeout = timeout;
-  _dbus_get_monotonic_time (&cb->last_tv_sec,
-                            &cb->last_tv_usec);
+  cb->last_usec = loop_now_usec (loop);
+  cb->heap_index = -1;
   return cb;
 }
 
 static void
 timeout_callback_free (TimeoutCallback *cb)
 {
+  /* DBusHashTable sometimes calls free_function(NULL) */
+  if (cb == NULL)
+    return;
+
+  _dbus_timeout_set_changed_function (cb->timeout, NULL, NULL);
   dbus_free (cb);
 }
 
@@ -116,13 +174,25 @@ _dbus_loop_new (void)
   loop->watches = _dbus_hash_table_new (DBUS_HASH_POLLABLE, NULL,
                                         free_watch_table_entry);
 
+  loop->priority_fds = _dbus_hash_table_new (DBUS_HASH_POLLABLE, NULL, NULL);
+
+  loop->timeouts = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL,
+                                         (DBusFreeFunction) timeout_callback_free);
+
   loop->socket_set = _dbus_socket_set_new (0);
 
-  if (loop->watches == NULL || loop->socket_set == NULL)
+  if (loop->watches == NULL || loop->priority_fds == NULL ||
+      loop->timeouts == NULL || loop->socket_set == NULL)
     {
       if (loop->watches != NULL)
         _dbus_hash_table_unref (loop->watches);
 
+      if (loop->timeouts != NULL)
+        _dbus_hash_table_unref (loop->timeouts);
+
+      if (loop->priority_fds != NULL)
+        _dbus_hash_table_unref (loop->priority_fds);
+
       if (loop->socket_set != NULL)
         _dbus_socket_set_free (loop->socket_set);
 
@@ -162,7 +232,17 @@ _dbus_loop_unref (DBusLoop *loop)
           dbus_connection_unref (connection);
         }
 
+      while (loop->need_priority_dispatch)
+        {
+          DBusConnection *connection = _dbus_list_pop_first (&loop->need_priority_dispatch);
+
+          dbus_connection_unref (connection);
+        }
+
       _dbus_hash_table_unref (loop->watches);
+      _dbus_hash_table_unref (loop->priority_fds);
+      _dbus_hash_table_unref (loop->timeouts);
+      dbus_free (loop->timeout_heap);
       _dbus_socket_set_free (loop->socket_set);
       dbus_free (loop);
     }
@@ -213,6 +293,7 @@ cull_watches_for_invalid_fd (DBusLoop     *loop,
     }
 
   _dbus_hash_table_remove_pollable (loop->watches, fd);
+  _dbus_hash_table_remove_pollable (loop->priority_fds, fd);
 }
 
 static dbus_bool_t
@@ -229,6 +310,8 @@ gc_watch_table_entry (DBusLoop      *loop,
     return FALSE;
 
   _dbus_hash_table_remove_pollable (loop->watches, fd);
+  /* the descriptor number may be reused for something else */
+  _dbus_hash_table_remove_pollable (loop->priority_fds, fd);
   return TRUE;
 }
 
@@ -367,27 +450,191 @@ _dbus_loop_remove_watch (DBusLoop         *loop,
   _dbus_warn ("could not find watch %p to remove", watch);
 }
 
+static void
+heap_set (DBusLoop        *loop,
+          int              i,
+          TimeoutCallback *tcb)
+{
+  loop->timeout_heap[i] = tcb;
+  tcb->heap_index = i;
+}
+
+static void
+heap_sift_up (DBusLoop        *loop,
+              TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+
+      if (loop->timeout_heap[parent]->deadline_usec <= tcb->deadline_usec)
+        break;
+
+      heap_set (loop, i, loop->timeout_heap[parent]);
+      i = parent;
+    }
+
+  heap_set (loop, i, tcb);
+}
+
+static void
+heap_sift_down (DBusLoop        *loop,
+                TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+
+  while (TRUE)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= loop->n_enabled_timeouts)
+        break;
+
+      if (child + 1 < loop->n_enabled_timeouts &&
+          loop->timeout_heap[child + 1]->deadline_usec <
+          loop->timeout_heap[child]->deadline_usec)
+        child++;
+
+      if (tcb->deadline_usec <= loop->timeout_heap[child]->deadline_usec)
+        break;
+
+      heap_set (loop, i, loop->timeout_heap[child]);
+      i = child;
+    }
+
+  heap_set (loop, i, tcb);
+}
+
+static void
+heap_remove (DBusLoop        *loop,
+             TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+  TimeoutCallback *last;
+
+  _dbus_assert (i >= 0 && i < loop->n_enabled_timeouts);
+
+  tcb->heap_index = -1;
+  loop->n_enabled_timeouts -= 1;
+
+  if (i == loop->n_enabled_timeouts)
+    return;
+
+  last = loop->timeout_heap[loop->n_enabled_timeouts];
+  heap_set (loop, i, last);
+  heap_sift_up (loop, last);
+  heap_sift_down (loop, last);
+}
+
+/* Put tcb where its enabled state and deadline say it should be. The
+ * heap always has room for every timeout, so this cannot fail. */
+static void
+update_timeout (DBusLoop        *loop,
+                TimeoutCallback *tcb)
+{
+  if (!dbus_timeout_get_enabled (tcb->timeout))
+    {
+      if (tcb->heap_index >= 0)
+        heap_remove (loop, tcb);
+
+      return;
+    }
+
+  /* A restart only counts from when the timeout is next enabled */
+  if (_dbus_timeout_needs_restart (tcb->timeout))
+    {
+      tcb->last_usec = loop_now_usec (loop);
+      _dbus_timeout_restarted (tcb->timeout);
+    }
+
+  tcb->deadline_usec = tcb->last_usec +
+    (dbus_int64_t) dbus_timeout_get_interval (tcb->timeout) * 1000;
+
+  if (tcb->heap_index < 0)
+    {
+      _dbus_assert (loop->n_enabled_timeouts < loop->n_timeout_heap_allocated);
+      tcb->heap_index = loop->n_enabled_timeouts++;
+    }
+
+  heap_sift_up (loop, tcb);
+  heap_sift_down (loop, tcb);
+}
+
+/* Called from whatever changed the timeout, which must be running on the
+ * loop's thread: the heap has no lock. */
+static void
+timeout_changed (DBusTimeout *timeout,
+                 void        *data)
+{
+  DBusLoop *loop = data;
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+  _dbus_assert (tcb != NULL);
+  update_timeout (loop, tcb);
+}
+
+/*
+ * Watch timeout until it is removed. From now on, anything that enables,
+ * disables or restarts it, or changes its interval, moves it in the
+ * loop's heap at once, so that may only be done on the thread that runs
+ * the loop, like adding and removing it.
+ *
+ * Adding a timeout that was already added is an error; it stays added
+ * once.
+ */
 dbus_bool_t
 _dbus_loop_add_timeout (DBusLoop           *loop,
                         DBusTimeout        *timeout)
 {
   TimeoutCallback *tcb;
+  int n_timeouts;
 
-  tcb = timeout_callback_new (timeout);
-  if (tcb == NULL)
-    return FALSE;
+  if (_dbus_hash_table_lookup_uintptr (loop->timeouts,
+                                       (uintptr_t) timeout) != NULL)
+    {
+      _dbus_warn ("timeout %p was already added", timeout);
+      return TRUE;
+    }
 
-  if (_dbus_list_append (&loop->timeouts, tcb))
+  n_timeouts = _dbus_hash_table_get_n_entries (loop->timeouts) + 1;
+
+  /* Make room now, so that enabling a timeout never needs memory */
+  if (n_timeouts > loop->n_timeout_heap_allocated)
     {
-      loop->callback_list_serial += 1;
-      loop->timeout_count += 1;
+      int n = MAX (16, loop->n_timeout_heap_allocated * 2);
+      TimeoutCallback **heap;
+
+      heap = dbus_realloc (loop->timeout_heap, n * sizeof (TimeoutCallback *));
+
+      if (heap == NULL)
+        return FALSE;
+
+      loop->timeout_heap = heap;
+      loop->n_timeout_heap_allocated = n;
     }
-  else
+
+  tcb = timeout_callback_new (loop, timeout);
+  if (tcb == NULL)
+    return FALSE;
+
+  if (!_dbus_hash_table_insert_uintptr (loop->timeouts, (uintptr_t) timeout,
+                                        tcb))
     {
-      timeout_callback_free (tcb);
+      dbus_free (tcb);
       return FALSE;
     }
-  
+
+  loop->callback_list_serial += 1;
+  loop->timeout_count += 1;
+
+  /* Adding it starts the interval, so any pending restart is moot */
+  _dbus_timeout_restarted (timeout);
+  _dbus_timeout_set_changed_function (timeout, timeout_changed, loop);
+  update_timeout (loop, tcb);
+
   return TRUE;
 }
 
@@ -395,158 +642,166 @@ void
 _dbus_loop_remove_timeout (DBusLoop           *loop,
                            DBusTimeout        *timeout)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->timeouts);
-  while (link != NULL)
-    {
-      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-      TimeoutCallback *this = link->data;
+  TimeoutCallback *tcb;
 
-      if (this->timeout == timeout)
-        {
-          _dbus_list_remove_link (&loop->timeouts, link);
-          loop->callback_list_serial += 1;
-          loop->timeout_count -= 1;
-          timeout_callback_free (this);
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
 
-          return;
-        }
-      
-      link = next;
+  if (tcb == NULL)
+    {
+      _dbus_warn ("could not find timeout %p to remove", timeout);
+      return;
     }
 
-  _dbus_warn ("could not find timeout %p to remove", timeout);
+  if (tcb->heap_index >= 0)
+    heap_remove (loop, tcb);
+
+  /* this frees tcb */
+  _dbus_hash_table_remove_uintptr (loop->timeouts, (uintptr_t) timeout);
+  loop->callback_list_serial += 1;
+  loop->timeout_count -= 1;
 }
 
-/* Convolutions from GLib, there really must be a better way
- * to do this.
- */
-static dbus_bool_t
-check_timeout (long            tv_sec,
-               long            tv_usec,
-               TimeoutCallback *tcb,
-               int             *timeout)
-{
-  long sec_remaining;
-  long msec_remaining;
-  long expiration_tv_sec;
-  long expiration_tv_usec;
-  long interval_seconds;
-  long interval_milliseconds;
-  int interval;
-
-  /* I'm pretty sure this function could suck (a lot) less */
-  
-  interval = dbus_timeout_get_interval (tcb->timeout);
-  
-  interval_seconds = interval / 1000L;
-  interval_milliseconds = interval % 1000L;
-  
-  expiration_tv_sec = tcb->last_tv_sec + interval_seconds;
-  expiration_tv_usec = tcb->last_tv_usec + interval_milliseconds * 1000;
-  if (expiration_tv_usec >= 1000000)
-    {
-      expiration_tv_usec -= 1000000;
-      expiration_tv_sec += 1;
-    }
-  
-  sec_remaining = expiration_tv_sec - tv_sec;
-  msec_remaining = (expiration_tv_usec - tv_usec) / 1000L;
+/* How many milliseconds until the earliest timeout expires, or -1 */
+static long
+get_poll_timeout (DBusLoop     *loop,
+                  dbus_int64_t  now)
+{
+  TimeoutCallback *tcb;
+  dbus_int64_t remaining;
 
-#if MAINLOOP_SPEW
-  _dbus_verbose ("Interval is %ld seconds %ld msecs\n",
-                 interval_seconds,
-                 interval_milliseconds);
-  _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
-                 tv_sec, tv_usec);
-  _dbus_verbose ("Last is %lu seconds %lu usecs\n",
-                 tcb->last_tv_sec, tcb->last_tv_usec);
-  _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
-                 expiration_tv_sec, expiration_tv_usec);
-  _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
-                 sec_remaining, msec_remaining);
-#endif
-  
-  /* We do the following in a rather convoluted fashion to deal with
-   * the fact that we don't have an integral type big enough to hold
-   * the difference of two timevals in milliseconds.
-   */
-  if (sec_remaining < 0 || (sec_remaining == 0 && msec_remaining < 0))
-    {
-      *timeout = 0;
-    }
-  else
-    {
-      if (msec_remaining < 0)
-	{
-	  msec_remaining += 1000;
-	  sec_remaining -= 1;
-	}
+  if (loop->n_enabled_timeouts == 0)
+    return -1;
 
-      if (sec_remaining > (_DBUS_INT_MAX / 1000) ||
-          msec_remaining > _DBUS_INT_MAX)
-        *timeout = _DBUS_INT_MAX;
-      else
-        *timeout = sec_remaining * 1000 + msec_remaining;        
-    }
+  tcb = loop->timeout_heap[0];
+  remaining = tcb->deadline_usec - now;
 
-  if (*timeout > interval)
+  if (remaining > (dbus_int64_t) dbus_timeout_get_interval (tcb->timeout) * 1000)
     {
       /* This indicates that the system clock probably moved backward */
       _dbus_verbose ("System clock set backward! Resetting timeout.\n");
-      
-      tcb->last_tv_sec = tv_sec;
-      tcb->last_tv_usec = tv_usec;
 
-      *timeout = interval;
+      tcb->last_usec = now;
+      update_timeout (loop, tcb);
+      return get_poll_timeout (loop, now);
     }
-  
-#if MAINLOOP_SPEW
-  _dbus_verbose ("  timeout expires in %d milliseconds\n", *timeout);
-#endif
-  
-  return *timeout == 0;
+
+  if (remaining <= 0)
+    return 0;
+
+  /* Round up, so that we don't wake up just before it expires */
+  remaining = (remaining + 999) / 1000;
+
+  if (remaining > _DBUS_INT_MAX)
+    return _DBUS_INT_MAX;
+
+  return (long) remaining;
 }
 
-dbus_bool_t
-_dbus_loop_dispatch (DBusLoop *loop)
+/* The most messages a connection may dispatch before each of the other
+ * connections that were waiting gets a turn */
+#define MAX_DISPATCHES_PER_TURN 16
+
+/* Dispatch everything a connection has queued */
+static void
+dispatch_all (DBusConnection *connection)
+{
+  while (TRUE)
+    {
+      DBusDispatchStatus status;
+
+      status = dbus_connection_dispatch (connection);
+
+      if (status == DBUS_DISPATCH_COMPLETE)
+        return;
+
+      if (status == DBUS_DISPATCH_NEED_MEMORY)
+        _dbus_wait_for_memory ();
+    }
+}
+
+/* Dispatch the priority connections completely, then give each other
+ * connection that was waiting for dispatch a turn of at most
+ * MAX_DISPATCHES_PER_TURN messages. Those with messages left over go
+ * to the back of the queue, behind connections queued in the meantime.
+ * Returns TRUE if there was anything to dispatch. */
+static dbus_bool_t
+dispatch_round (DBusLoop *loop)
 {
+  int n_waiting;
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
+  _dbus_verbose ("  %d+%d connections to dispatch\n",
+                 _dbus_list_get_length (&loop->need_priority_dispatch),
+                 _dbus_list_get_length (&loop->need_dispatch));
 #endif
-  
-  if (loop->need_dispatch == NULL)
+
+  if (loop->need_dispatch == NULL && loop->need_priority_dispatch == NULL)
     return FALSE;
-  
- next:
-  while (loop->need_dispatch != NULL)
+
+  while (loop->need_priority_dispatch != NULL)
     {
-      DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
-      
+      DBusConnection *connection = _dbus_list_pop_first (&loop->need_priority_dispatch);
+
+      dispatch_all (connection);
+      dbus_connection_unref (connection);
+    }
+
+  n_waiting = _dbus_list_get_length (&loop->need_dispatch);
+
+  while (n_waiting > 0 && loop->need_dispatch != NULL)
+    {
+      DBusList *link = _dbus_list_pop_first_link (&loop->need_dispatch);
+      DBusConnection *connection = link->data;
+      DBusDispatchStatus status;
+      int n_dispatched;
+
+      n_waiting -= 1;
+      n_dispatched = 0;
+
       while (TRUE)
         {
-          DBusDispatchStatus status;
-          
           status = dbus_connection_dispatch (connection);
 
-          if (status == DBUS_DISPATCH_COMPLETE)
+          if (status == DBUS_DISPATCH_NEED_MEMORY)
             {
-              dbus_connection_unref (connection);
-              goto next;
-            }
-          else
-            {
-              if (status == DBUS_DISPATCH_NEED_MEMORY)
-                _dbus_wait_for_memory ();
+              _dbus_wait_for_memory ();
+              continue;
             }
+
+          n_dispatched += 1;
+
+          if (status == DBUS_DISPATCH_COMPLETE ||
+              n_dispatched >= MAX_DISPATCHES_PER_TURN)
+            break;
+        }
+
+      if (status == DBUS_DISPATCH_COMPLETE)
+        {
+          _dbus_list_free_link (link);
+          dbus_connection_unref (connection);
+        }
+      else
+        {
+          /* Keep the reference the queue already owns */
+          _dbus_list_append_link (&loop->need_dispatch, link);
         }
     }
 
   return TRUE;
 }
 
+dbus_bool_t
+_dbus_loop_dispatch (DBusLoop *loop)
+{
+  if (loop->need_dispatch == NULL && loop->need_priority_dispatch == NULL)
+    return FALSE;
+
+  while (dispatch_round (loop))
+    ;
+
+  return TRUE;
+}
+
 dbus_bool_t
 _dbus_loop_queue_dispatch (DBusLoop       *loop,
                            DBusConnection *connection)
@@ -560,6 +815,93 @@ _dbus_loop_queue_dispatch (DBusLoop       *loop,
     return FALSE;
 }
 
+/*
+ * Like _dbus_loop_queue_dispatch(), but the connection is dispatched
+ * completely, before any connection queued with that.
+ */
+dbus_bool_t
+_dbus_loop_queue_priority_dispatch (DBusLoop       *loop,
+                                    DBusConnection *connection)
+{
+  if (_dbus_list_append (&loop->need_priority_dispatch, connection))
+    {
+      dbus_connection_ref (connection);
+      return TRUE;
+    }
+  else
+    return FALSE;
+}
+
+/*
+ * Whether to handle the watches for fd before or after others that are
+ * ready at the same time. This is forgotten when the last watch for fd
+ * is removed.
+ *
+ * Returns FALSE if not enough memory.
+ */
+dbus_bool_t
+_dbus_loop_set_priority (DBusLoop         *loop,
+                         DBusPollable      fd,
+                         DBusLoopPriority  priority)
+{
+  if (priority == DBUS_LOOP_PRIORITY_NORMAL)
+    {
+      _dbus_hash_table_remove_pollable (loop->priority_fds, fd);
+      return TRUE;
+    }
+
+  return _dbus_hash_table_insert_pollable (loop->priority_fds, fd,
+                                           _DBUS_INT_TO_POINTER (priority));
+}
+
+/*
+ * Handle at most budget low-priority descriptors per iteration, so
+ * that a burst of them cannot delay the others for long. The rest stay
+ * ready and are handled in later iterations. 0 means no limit.
+ */
+void
+_dbus_loop_set_low_priority_budget (DBusLoop *loop,
+                                    int       budget)
+{
+  loop->low_priority_budget = budget;
+}
+
+/*
+ * Get the monotonic time, as _dbus_get_monotonic_time() would, but
+ * while a callback is running, return the time at which the loop woke
+ * up to run it. Use this for timestamps that only need to be as precise
+ * as the loop's own timeouts, such as when something should expire, so
+ * that a wakeup that handles many messages reads the clock once.
+ * Latency measurements should keep using _dbus_get_monotonic_time().
+ */
+void
+_dbus_loop_get_monotonic_time (DBusLoop *loop,
+                               long     *tv_sec,
+                               long     *tv_usec)
+{
+  dbus_int64_t now = loop_now_usec (loop);
+
+  *tv_sec = (long) (now / 1000000);
+  *tv_usec = (long) (now % 1000000);
+}
+
+/*
+ * The same as _dbus_loop_get_monotonic_time(), in microseconds.
+ */
+dbus_int64_t
+_dbus_loop_get_monotonic_usec (DBusLoop *loop)
+{
+  return loop_now_usec (loop);
+}
+
+static DBusLoopPriority
+get_priority (DBusLoop     *loop,
+              DBusPollable  fd)
+{
+  return _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_pollable (loop->priority_fds,
+                                                                 fd));
+}
+
 /* Returns TRUE if we invoked any timeouts or have ready file
  * descriptors, which is just used in test code as a debug hack
  */
@@ -588,61 +930,20 @@ _dbus_loop_iterate (DBusLoop     *loop,
 #endif
 
   if (_dbus_hash_table_get_n_entries (loop->watches) == 0 &&
-      loop->timeouts == NULL)
+      loop->timeout_count == 0)
     goto next_iteration;
 
-  timeout = -1;
-  if (loop->timeout_count > 0)
-    {
-      long tv_sec;
-      long tv_usec;
-      
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
-
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
-        {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
-
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-
-              if (_dbus_timeout_needs_restart (tcb->timeout))
-                {
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
-                  _dbus_timeout_restarted (tcb->timeout);
-                }
-
-              check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
-
-              if (timeout < 0)
-                timeout = msecs_remaining;
-              else
-                timeout = MIN (msecs_remaining, timeout);
+  refresh_now (loop);
+  timeout = get_poll_timeout (loop, loop->now_usec);
 
 #if MAINLOOP_SPEW
-              _dbus_verbose ("  timeout added, %d remaining, aggregate timeout %ld\n",
-                             msecs_remaining, timeout);
+  _dbus_verbose ("  %d of %d timeouts enabled, first expires in %ld\n",
+                 loop->n_enabled_timeouts, loop->timeout_count, timeout);
 #endif
-              
-              _dbus_assert (timeout >= 0);
-            }
-#if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping disabled timeout\n");
-            }
-#endif
-          
-          link = next;
-        }
-    }
 
   /* Never block if we have stuff to dispatch */
-  if (!block || loop->need_dispatch != NULL)
+  if (!block || loop->need_dispatch != NULL ||
+      loop->need_priority_dispatch != NULL)
     {
       timeout = 0;
 #if MAINLOOP_SPEW
@@ -663,6 +964,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
   n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
                                    _DBUS_N_ELEMENTS (ready_fds), timeout);
 
+  /* Everything we do for this wakeup shares one clock read */
+  refresh_now (loop);
+
   /* re-enable any watches we skipped this time */
   if (loop->oom_watch_pending)
     {
@@ -705,19 +1009,22 @@ _dbus_loop_iterate (DBusLoop     *loop,
 
   initial_serial = loop->callback_list_serial;
 
-  if (loop->timeout_count > 0)
+  if (loop->n_enabled_timeouts > 0)
     {
-      long tv_sec;
-      long tv_usec;
+      dbus_int64_t now = loop->now_usec;
 
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      /* Fire each expired timeout once, earliest first. One with a
+       * short interval may expire again straight away; it waits for
+       * the next iteration. */
+      loop->timeout_pass += 1;
 
-      /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      while (loop->n_enabled_timeouts > 0)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
+          TimeoutCallback *tcb = loop->timeout_heap[0];
+
+          if (tcb->deadline_usec > now ||
+              tcb->fired_pass == loop->timeout_pass)
+            break;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
@@ -725,55 +1032,76 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
 
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
-              
-              if (check_timeout (tv_sec, tv_usec,
-                                 tcb, &msecs_remaining))
-                {
-                  /* Save last callback time and fire this timeout */
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
+          /* Save last callback time and fire this timeout */
+          tcb->fired_pass = loop->timeout_pass;
+          tcb->last_usec = now;
+          update_timeout (loop, tcb);
 
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  invoking timeout\n");
+          _dbus_verbose ("  invoking timeout\n");
 #endif
 
-                  /* can theoretically return FALSE on OOM, but we just
-                   * let it fire again later - in practice that's what
-                   * every wrapper callback in dbus-daemon used to do */
-                  dbus_timeout_handle (tcb->timeout);
+          /* can theoretically return FALSE on OOM, but we just
+           * let it fire again later - in practice that's what
+           * every wrapper callback in dbus-daemon used to do */
+          dbus_timeout_handle (tcb->timeout);
 
-                  retval = TRUE;
-                }
-              else
-                {
-#if MAINLOOP_SPEW
-                  _dbus_verbose ("  timeout has not expired\n");
-#endif
-                }
-            }
-#if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping invocation of disabled timeout\n");
-            }
-#endif
-
-          link = next;
+          retval = TRUE;
         }
     }
 
   if (n_ready > 0)
     {
-      for (i = 0; i < n_ready; i++)
+      int first = (int) (loop->ready_rotation++ % (unsigned int) n_ready);
+      int order[N_STACK_DESCRIPTORS];
+      int n_ordered = 0;
+      int k;
+
+      /* Descriptors with high priority go first and those with low
+       * priority last, within the budget; within each group, start
+       * somewhere different each time */
+      if (_dbus_hash_table_get_n_entries (loop->priority_fds) > 0)
+        {
+          int priority;
+          int n_low = 0;
+
+          for (priority = DBUS_LOOP_PRIORITY_HIGH;
+               priority >= DBUS_LOOP_PRIORITY_LOW;
+               priority--)
+            {
+              for (k = 0; k < n_ready; k++)
+                {
+                  i = (first + k) % n_ready;
+
+                  if ((int) get_priority (loop, ready_fds[i].fd) != priority)
+                    continue;
+
+                  if (priority == DBUS_LOOP_PRIORITY_LOW &&
+                      loop->low_priority_budget > 0 &&
+                      n_low++ >= loop->low_priority_budget)
+                    break;
+
+                  order[n_ordered++] = i;
+                }
+            }
+        }
+      else
+        {
+          for (k = 0; k < n_ready; k++)
+            order[n_ordered++] = (first + k) % n_ready;
+        }
+
+      _dbus_assert (n_ordered <= n_ready);
+
+      for (k = 0; k < n_ordered; k++)
         {
           DBusList **watches;
           DBusList *next;
           unsigned int condition;
           dbus_bool_t any_oom;
 
+          i = order[k];
+
           /* FIXME I think this "restart if we change the watches"
            * approach could result in starving watches
            * toward the end of the list.
@@ -859,8 +1187,13 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  moving to next iteration\n");
 #endif
 
-  if (_dbus_loop_dispatch (loop))
+  /* Only one round, so that anything left over waits until we have read
+   * from the other descriptors again; we won't block while it waits */
+  if (dispatch_round (loop))
     retval = TRUE;
+
+  /* Whatever runs between iterations reads the clock for itself */
+  loop->now_valid = FALSE;
   
 #if MAINLOOP_SPEW
   _dbus_verbose ("Returning %d\n", retval);
@@ -919,4 +1252,438 @@ _dbus_wait_for_memory (void)
   _dbus_sleep_milliseconds (_dbus_get_oom_wait ());
 }
 
+#ifdef DBUS_ENABLE_EMBEDDED_TESTS
+#include "dbus-test.h"
+#include <dbus/dbus-test-tap.h>
+
+#define N_TEST_TIMEOUTS 20
+
+/* Checks that the enabled timeouts, and only those, form a heap
+ * ordered by deadline, and that each knows where it is */
+static void
+check_timeout_heap (DBusLoop *loop)
+{
+  DBusHashIter iter;
+  int n_enabled = 0;
+  int i;
+
+  for (i = 0; i < loop->n_enabled_timeouts; i++)
+    {
+      TimeoutCallback *tcb = loop->timeout_heap[i];
+
+      _dbus_assert (tcb->heap_index == i);
+      _dbus_assert (dbus_timeout_get_enabled (tcb->timeout));
+
+      if (i > 0)
+        _dbus_assert (loop->timeout_heap[(i - 1) / 2]->deadline_usec <=
+                      tcb->deadline_usec);
+    }
+
+  _dbus_hash_iter_init (loop->timeouts, &iter);
+
+  while (_dbus_hash_iter_next (&iter))
+    {
+      TimeoutCallback *tcb = _dbus_hash_iter_get_value (&iter);
+
+      if (dbus_timeout_get_enabled (tcb->timeout))
+        {
+          _dbus_assert (tcb->heap_index >= 0);
+          n_enabled++;
+        }
+      else
+        {
+          _dbus_assert (tcb->heap_index == -1);
+        }
+    }
+
+  _dbus_assert (n_enabled == loop->n_enabled_timeouts);
+  _dbus_assert (_dbus_hash_table_get_n_entries (loop->timeouts) ==
+                loop->timeout_count);
+}
+
+static TimeoutCallback *
+get_timeout_callback (DBusLoop    *loop,
+                      DBusTimeout *timeout)
+{
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+  _dbus_assert (tcb != NULL);
+  return tcb;
+}
+
+typedef struct
+{
+  int id;
+  int n_fired;
+  int *order;     /* where to record the ids of timeouts as they fire */
+  int *n_order;
+} TestTimeout;
+
+static dbus_bool_t
+test_timeout_fired (void *data)
+{
+  TestTimeout *t = data;
+
+  t->n_fired++;
+
+  if (t->order != NULL)
+    t->order[(*t->n_order)++] = t->id;
+
+  return TRUE;
+}
+
+/* Enabling, disabling, restarting and removing timeouts keeps the heap
+ * in order, and the earliest enabled timeout is always on top */
+static dbus_bool_t
+test_timeout_heap (void)
+{
+  DBusLoop *loop;
+  DBusTimeout *timeouts[N_TEST_TIMEOUTS];
+  TestTimeout data[N_TEST_TIMEOUTS];
+  dbus_int64_t last_deadline;
+  dbus_int64_t before, after;
+  TimeoutCallback *tcb;
+  int i;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    return FALSE;
+
+  for (i = 0; i < N_TEST_TIMEOUTS; i++)
+    {
+      /* Long enough not to expire during the test, and added in no
+       * particular order of interval */
+      int interval = 1000000 + ((i * 7) % N_TEST_TIMEOUTS) * 1000;
+
+      data[i].id = i;
+      data[i].n_fired = 0;
+      data[i].order = NULL;
+      data[i].n_order = NULL;
+      timeouts[i] = _dbus_timeout_new (interval, test_timeout_fired,
+                                       &data[i], NULL);
+
+      if (timeouts[i] == NULL || !_dbus_loop_add_timeout (loop, timeouts[i]))
+        _dbus_test_fatal ("no memory for timeouts");
+
+      check_timeout_heap (loop);
+    }
+
+  _dbus_assert (loop->n_enabled_timeouts == N_TEST_TIMEOUTS);
+
+  /* Disabling the earliest each time visits them in deadline order */
+  last_deadline = 0;
+
+  while (loop->n_enabled_timeouts > 0)
+    {
+      tcb = loop->timeout_heap[0];
+      _dbus_assert (tcb->deadline_usec >= last_deadline);
+      last_deadline = tcb->deadline_usec;
+
+      _dbus_timeout_disable (tcb->timeout);
+      _dbus_assert (tcb->heap_index == -1);
+      check_timeout_heap (loop);
+    }
+
+  /* Re-arming counts the interval from now, with the new interval */
+  for (i = 0; i < N_TEST_TIMEOUTS; i++)
+    {
+      int interval = 2000000 - i * 1000;
+
+      before = monotonic_usec ();
+      _dbus_timeout_restart (timeouts[i], interval);
+      after = monotonic_usec ();
+
+      tcb = get_timeout_callback (loop, timeouts[i]);
+      _dbus_assert (tcb->heap_index >= 0);
+      _dbus_assert (tcb->deadline_usec >= before + interval * 1000);
+      _dbus_assert (tcb->deadline_usec <= after + interval * 1000);
+      check_timeout_heap (loop);
+    }
+
+  /* The last one now has the shortest interval */
+  _dbus_assert (loop->timeout_heap[0]->timeout ==
+                timeouts[N_TEST_TIMEOUTS - 1]);
+
+  /* A new interval takes effect straight away */
+  _dbus_timeout_set_interval (timeouts[0], 1);
+  _dbus_assert (loop->timeout_heap[0]->timeout == timeouts[0]);
+  check_timeout_heap (loop);
+
+  /* Disabling something in the middle of the heap */
+  _dbus_timeout_disable (timeouts[N_TEST_TIMEOUTS / 2]);
+  check_timeout_heap (loop);
+
+  /* Removing enabled and disabled timeouts, from anywhere in the heap */
+  for (i = 0; i < N_TEST_TIMEOUTS; i++)
+    {
+      int j = (i * 7) % N_TEST_TIMEOUTS;
+
+      _dbus_loop_remove_timeout (loop, timeouts[j]);
+      check_timeout_heap (loop);
+    }
+
+  _dbus_assert (loop->timeout_count == 0);
+  _dbus_assert (loop->n_enabled_timeouts == 0);
+
+  /* Once removed, changing a timeout does not touch the loop */
+  _dbus_timeout_restart (timeouts[0], 1);
+  check_timeout_heap (loop);
+
+  for (i = 0; i < N_TEST_TIMEOUTS; i++)
+    {
+      _dbus_assert (data[i].n_fired == 0);
+      _dbus_timeout_unref (timeouts[i]);
+    }
+
+  _dbus_loop_unref (loop);
+  return TRUE;
+}
+
+/* Expired timeouts fire earliest first, at most once per iteration,
+ * and are re-armed; disabled ones don't fire */
+static dbus_bool_t
+test_timeout_firing (void)
+{
+  DBusLoop *loop;
+  DBusTimeout *timeouts[3];
+  TestTimeout data[3];
+  int order[10];
+  int n_order = 0;
+  dbus_int64_t old_deadline;
+  TimeoutCallback *tcb;
+  int i;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    return FALSE;
+
+  for (i = 0; i < 3; i++)
+    {
+      data[i].id = i;
+      data[i].n_fired = 0;
+      data[i].order = order;
+      data[i].n_order = &n_order;
+
+      /* 0 expires after 20ms, 1 after 10ms, 2 after an hour */
+      timeouts[i] = _dbus_timeout_new (i == 2 ? 3600 * 1000 : (2 - i) * 10,
+                                       test_timeout_fired, &data[i], NULL);
+
+      if (timeouts[i] == NULL || !_dbus_loop_add_timeout (loop, timeouts[i]))
+        _dbus_test_fatal ("no memory for timeouts");
+    }
+
+  _dbus_sleep_milliseconds (50);
+  tcb = get_timeout_callback (loop, timeouts[1]);
+  old_deadline = tcb->deadline_usec;
+  _dbus_loop_iterate (loop, FALSE);
+
+  if (n_order != 2 || order[0] != 1 || order[1] != 0)
+    _dbus_test_fatal ("expected timeouts 1 then 0 to fire, got %d: %d, %d",
+                      n_order, order[0], order[1]);
+
+  /* Fired timeouts stay enabled, with a later deadline */
+  _dbus_assert (tcb->heap_index >= 0);
+  _dbus_assert (tcb->deadline_usec > old_deadline);
+  _dbus_assert (data[2].n_fired == 0);
+  check_timeout_heap (loop);
+
+  /* A timeout that expires straight away fires once per iteration */
+  _dbus_timeout_restart (timeouts[1], 0);
+  _dbus_loop_iterate (loop, FALSE);
+  _dbus_assert (data[1].n_fired == 2);
+  _dbus_loop_iterate (loop, FALSE);
+  _dbus_assert (data[1].n_fired == 3);
+
+  /* Disabled timeouts don't fire */
+  _dbus_timeout_disable (timeouts[0]);
+  _dbus_timeout_disable (timeouts[1]);
+  _dbus_sleep_milliseconds (5);
+  _dbus_loop_iterate (loop, FALSE);
+  _dbus_assert (data[0].n_fired == 1);
+  _dbus_assert (data[1].n_fired == 3);
+  check_timeout_heap (loop);
+
+  /* Until they are re-armed */
+  _dbus_timeout_restart (timeouts[0], 0);
+  _dbus_loop_iterate (loop, FALSE);
+  _dbus_assert (data[0].n_fired == 2);
+  _dbus_assert (data[1].n_fired == 3);
+
+  for (i = 0; i < 3; i++)
+    {
+      _dbus_loop_remove_timeout (loop, timeouts[i]);
+      _dbus_timeout_unref (timeouts[i]);
+    }
+
+  _dbus_loop_unref (loop);
+  return TRUE;
+}
+
+#define N_TEST_WATCHES 8
+#define TEST_LOW_PRIORITY_BUDGET 2
+
+typedef struct
+{
+  int id;
+  DBusSocket sock;
+  int *order;     /* where to record the ids of watches as they are handled */
+  int *n_order;
+} TestWatch;
+
+static dbus_bool_t
+test_watch_handled (DBusWatch    *watch,
+                    unsigned int  flags,
+                    void         *data)
+{
+  TestWatch *w = data;
+  DBusString buf;
+
+  w->order[(*w->n_order)++] = w->id;
+
+  /* Consume the byte, so that the socket is no longer readable */
+  if (!_dbus_string_init (&buf))
+    _dbus_test_fatal ("no memory for read buffer");
+
+  if (_dbus_read_socket (w->sock, &buf, 1) != 1)
+    _dbus_test_fatal ("failed to read from test socket");
+
+  _dbus_string_free (&buf);
+  return TRUE;
+}
+
+static DBusLoopPriority
+test_watch_priority (int id)
+{
+  /* 0 and 1 are high priority, 2 and 3 normal, the rest low */
+  if (id < 2)
+    return DBUS_LOOP_PRIORITY_HIGH;
+  else if (id < 4)
+    return DBUS_LOOP_PRIORITY_NORMAL;
+  else
+    return DBUS_LOOP_PRIORITY_LOW;
+}
+
+/* Descriptors that are ready together are handled high priority first
+ * and low priority last, and no more low priority ones than the budget
+ * allows per iteration; the rest are handled in the next one */
+static dbus_bool_t
+test_watch_priorities (void)
+{
+  DBusLoop *loop;
+  DBusSocket peers[N_TEST_WATCHES];
+  DBusWatch *watches[N_TEST_WATCHES];
+  TestWatch data[N_TEST_WATCHES];
+  int order[N_TEST_WATCHES];
+  int n_order;
+  DBusString byte;
+  int round;
+  int i;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    return FALSE;
+
+  _dbus_loop_set_low_priority_budget (loop, TEST_LOW_PRIORITY_BUDGET);
+  _dbus_string_init_const (&byte, "x");
+
+  for (i = 0; i < N_TEST_WATCHES; i++)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      DBusPollable fd;
+
+      if (!_dbus_socketpair (&data[i].sock, &peers[i], FALSE, &error))
+        _dbus_test_fatal ("socketpair failed: %s", error.message);
+
+      data[i].id = i;
+      data[i].order = order;
+      data[i].n_order = &n_order;
+
+      fd = _dbus_socket_get_pollable (data[i].sock);
+      watches[i] = _dbus_watch_new (fd, DBUS_WATCH_READABLE, TRUE,
+                                    test_watch_handled, &data[i], NULL);
+
+      if (watches[i] == NULL ||
+          !_dbus_loop_add_watch (loop, watches[i]) ||
+          !_dbus_loop_set_priority (loop, fd, test_watch_priority (i)))
+        _dbus_test_fatal ("no memory for watches");
+    }
+
+  /* The order within each group rotates, so try a few times */
+  for (round = 0; round < 3; round++)
+    {
+      dbus_bool_t seen[N_TEST_WATCHES] = { FALSE };
+
+      for (i = 0; i < N_TEST_WATCHES; i++)
+        {
+          if (_dbus_write_socket (peers[i], &byte, 0, 1) != 1)
+            _dbus_test_fatal ("failed to write to test socket");
+        }
+
+      n_order = 0;
+      _dbus_loop_iterate (loop, TRUE);
+
+      if (n_order != 4 + TEST_LOW_PRIORITY_BUDGET)
+        _dbus_test_fatal ("expected %d watches to be handled, got %d",
+                          4 + TEST_LOW_PRIORITY_BUDGET, n_order);
+
+      for (i = 0; i < n_order; i++)
+        {
+          DBusLoopPriority expected;
+
+          if (i < 2)
+            expected = DBUS_LOOP_PRIORITY_HIGH;
+          else if (i < 4)
+            expected = DBUS_LOOP_PRIORITY_NORMAL;
+          else
+            expected = DBUS_LOOP_PRIORITY_LOW;
+
+          if (test_watch_priority (order[i]) != expected)
+            _dbus_test_fatal ("watch %d handled out of order at %d",
+                              order[i], i);
+
+          _dbus_assert (!seen[order[i]]);
+          seen[order[i]] = TRUE;
+        }
+
+      /* The low priority descriptors left over are still ready */
+      n_order = 0;
+      _dbus_loop_iterate (loop, FALSE);
+
+      if (n_order != 4 - TEST_LOW_PRIORITY_BUDGET)
+        _dbus_test_fatal ("expected %d leftover watches to be handled, got %d",
+                          4 - TEST_LOW_PRIORITY_BUDGET, n_order);
+
+      for (i = 0; i < n_order; i++)
+        {
+          _dbus_assert (!seen[order[i]]);
+          seen[order[i]] = TRUE;
+        }
+
+      for (i = 0; i < N_TEST_WATCHES; i++)
+        _dbus_assert (seen[i]);
+    }
+
+  for (i = 0; i < N_TEST_WATCHES; i++)
+    {
+      _dbus_loop_remove_watch (loop, watches[i]);
+      _dbus_watch_invalidate (watches[i]);
+      _dbus_watch_unref (watches[i]);
+      _dbus_close_socket (data[i].sock, NULL);
+      _dbus_close_socket (peers[i], NULL);
+    }
+
+  _dbus_loop_unref (loop);
+  return TRUE;
+}
+
+dbus_bool_t
+_dbus_mainloop_test (void)
+{
+  return test_timeout_heap () && test_timeout_firing () &&
+    test_watch_priorities ();
+}
+
+#endif /* DBUS_ENABLE_EMBEDDED_TESTS */
+
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
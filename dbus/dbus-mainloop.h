@@ -27,9 +27,17 @@
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
 
 typedef struct DBusLoop DBusLoop;
 
+typedef enum
+{
+  DBUS_LOOP_PRIORITY_LOW = -1,    /**< After others, within the low-priority budget */
+  DBUS_LOOP_PRIORITY_NORMAL = 0,
+  DBUS_LOOP_PRIORITY_HIGH = 1     /**< Before others */
+} DBusLoopPriority;
+
 typedef dbus_bool_t (* DBusWatchFunction)   (DBusWatch     *watch,
                                              unsigned int   condition,
                                              void          *data);
@@ -50,6 +58,17 @@ void        _dbus_loop_remove_timeout (DBusLoop            *loop,
 
 dbus_bool_t _dbus_loop_queue_dispatch (DBusLoop            *loop,
                                        DBusConnection      *connection);
+dbus_bool_t _dbus_loop_queue_priority_dispatch (DBusLoop       *loop,
+                                                DBusConnection *connection);
+dbus_bool_t _dbus_loop_set_priority   (DBusLoop            *loop,
+                                       DBusPollable         fd,
+                                       DBusLoopPriority     priority);
+void        _dbus_loop_set_low_priority_budget (DBusLoop *loop,
+                                                int       budget);
+void        _dbus_loop_get_monotonic_time (DBusLoop *loop,
+                                           long     *tv_sec,
+                                           long     *tv_usec);
+dbus_int64_t _dbus_loop_get_monotonic_usec (DBusLoop *loop);
 
 void        _dbus_loop_run            (DBusLoop            *loop);
 void        _dbus_loop_quit           (DBusLoop            *loop);
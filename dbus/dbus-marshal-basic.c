@@ -1068,6 +1068,63 @@ _dbus_marshal_write_fixed_multi (DBusString *str,
   return FALSE;
 }
 
+/**
+ * Makes room for a block of values of fixed-length type, so that the
+ * caller can fill it in directly instead of marshaling from a separate
+ * array. The space is aligned as for _dbus_marshal_write_fixed_multi()
+ * and zero-filled; the values must be written in the string's byte
+ * order.
+ *
+ * @param str string to marshal to
+ * @param insert_at where to insert the values
+ * @param element_type type of array elements
+ * @param n_elements number of elements to make room for
+ * @param array_start_p return location for where the first element goes
+ * @param pos_after #NULL or the position after the values
+ * @returns #TRUE on success
+ **/
+dbus_bool_t
+_dbus_marshal_reserve_fixed_multi (DBusString *str,
+                                   int         insert_at,
+                                   int         element_type,
+                                   int         n_elements,
+                                   int        *array_start_p,
+                                   int        *pos_after)
+{
+  int old_string_len;
+  int array_start;
+  int alignment;
+
+  _dbus_assert (dbus_type_is_fixed (element_type));
+  _dbus_assert (n_elements >= 0);
+
+  alignment = _dbus_type_get_alignment (element_type);
+
+  _dbus_assert (n_elements <= DBUS_MAXIMUM_ARRAY_LENGTH / alignment);
+
+  old_string_len = _dbus_string_get_length (str);
+  array_start = insert_at;
+
+  if (!_dbus_string_insert_alignment (str, &array_start, alignment))
+    goto error;
+
+  if (!_dbus_string_insert_bytes (str, array_start,
+                                  n_elements * alignment, '\0'))
+    goto error;
+
+  *array_start_p = array_start;
+
+  if (pos_after)
+    *pos_after = array_start + n_elements * alignment;
+
+  return TRUE;
+
+ error:
+  _dbus_string_delete (str, insert_at,
+                       _dbus_string_get_length (str) - old_string_len);
+
+  return FALSE;
+}
 
 /**
  * Skips over a basic-typed value, reporting the following position.
@@ -31,6 +31,43 @@
  * @{
  */
 
+/*
+ * If the elements of an array are structs or dict entries whose
+ * members are all fixed-size basic types of one size, returns that
+ * size, otherwise 0. Such an array is, for byteswapping purposes, a
+ * plain array of values of that size: the inter-element padding up to
+ * the next 8-byte boundary is a whole number of values and is nul.
+ */
+static int
+uniform_fixed_struct_member_size (DBusTypeReader *array_reader)
+{
+  DBusTypeReader elem;
+  DBusTypeReader member;
+  int size;
+
+  _dbus_type_reader_recurse (array_reader, &elem);
+  _dbus_type_reader_recurse (&elem, &member);
+
+  size = 0;
+
+  do
+    {
+      int member_type = _dbus_type_reader_get_current_type (&member);
+
+      if (!dbus_type_is_fixed (member_type) ||
+          member_type == DBUS_TYPE_UNIX_FD)
+        return 0;
+
+      if (size == 0)
+        size = _dbus_type_get_alignment (member_type);
+      else if (size != _dbus_type_get_alignment (member_type))
+        return 0;
+    }
+  while (_dbus_type_reader_next (&member));
+
+  return size;
+}
+
 static void
 byteswap_body_helper (DBusTypeReader       *reader,
                       dbus_bool_t           walk_reader_to_end,
@@ -95,6 +132,7 @@ byteswap_body_helper (DBusTypeReader       *reader,
               {
                 int elem_type;
                 int alignment;
+                int member_size;
 
                 elem_type = _dbus_type_reader_get_element_type (reader);
                 alignment = _dbus_type_get_alignment (elem_type);
@@ -109,6 +147,14 @@ byteswap_body_helper (DBusTypeReader       *reader,
 		      _dbus_swap_array (p, array_len / alignment, alignment);
 		    p += array_len;
                   }
+                else if ((elem_type == DBUS_TYPE_STRUCT ||
+                          elem_type == DBUS_TYPE_DICT_ENTRY) &&
+                         (member_size = uniform_fixed_struct_member_size (reader)) != 0)
+                  {
+                    if (member_size > 1)
+                      _dbus_swap_array (p, array_len / member_size, member_size);
+                    p += array_len;
+                  }
                 else
                   {
                     DBusTypeReader sub;
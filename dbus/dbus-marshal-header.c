@@ -26,6 +26,9 @@
 #include "dbus-marshal-header.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-marshal-byteswap.h"
+#include "dbus-signature.h"
+
+#include <string.h>
 
 /**
  * @addtogroup DBusMarshal
@@ -146,38 +149,77 @@ _dbus_header_cache_invalidate_all (DBusHeader *header)
 }
 
 /**
- * Caches one field
+ * Returns the header's byte order.
  *
  * @param header the header
- * @param field_code the field
- * @param variant_reader the reader for the variant in the field
+ * @returns the byte order
  */
-static void
-_dbus_header_cache_one (DBusHeader     *header,
-                        int             field_code,
-                        DBusTypeReader *variant_reader)
+char
+_dbus_header_get_byte_order (const DBusHeader *header)
 {
-  header->fields[field_code].value_pos =
-    _dbus_type_reader_get_value_pos (variant_reader);
+  _dbus_assert (_dbus_string_get_length (&header->data) > BYTE_ORDER_OFFSET);
 
-#if 0
-  _dbus_verbose ("cached value_pos %d for field %d\n",
-                 header->fields[field_code].value_pos, field_code)
-#endif
+  return (char) _dbus_string_get_byte (&header->data, BYTE_ORDER_OFFSET);
 }
 
 /**
- * Returns the header's byte order.
+ * Steps over one { byte, variant } struct of a fields array that is
+ * known to be well-formed. Every field defined by the spec holds a
+ * single basic value, which is skipped directly; only unknown fields
+ * with more complicated contents need a #DBusTypeReader.
  *
- * @param header the header
- * @returns the byte order
+ * @param str the string containing the header
+ * @param byte_order the header's byte order
+ * @param pos the 8-aligned start of the struct
+ * @param field_code return location for the field code
+ * @param type return location for the type of the value
+ * @param value_pos return location for the start of the value
+ * @returns the position just after the value
  */
-char
-_dbus_header_get_byte_order (const DBusHeader *header)
+static int
+step_over_header_field (const DBusString *str,
+                        int               byte_order,
+                        int               pos,
+                        unsigned char    *field_code,
+                        int              *type,
+                        int              *value_pos)
 {
-  _dbus_assert (_dbus_string_get_length (&header->data) > BYTE_ORDER_OFFSET);
+  const unsigned char *data = _dbus_string_get_const_udata (str);
+  int sig_len;
+  int sig_pos;
+  int end;
 
-  return (char) _dbus_string_get_byte (&header->data, BYTE_ORDER_OFFSET);
+  _dbus_assert (_DBUS_ALIGN_VALUE (pos, 8) == (unsigned) pos);
+
+  *field_code = data[pos];
+  sig_len = data[pos + 1];
+  sig_pos = pos + 2;
+
+  /* The signature is followed by its nul */
+  end = sig_pos + sig_len + 1;
+
+  if (sig_len == 1 && dbus_type_is_basic (data[sig_pos]))
+    {
+      *type = data[sig_pos];
+      *value_pos = _DBUS_ALIGN_VALUE (end, _dbus_type_get_alignment (*type));
+      _dbus_marshal_skip_basic (str, *type, byte_order, &end);
+    }
+  else
+    {
+      DBusString sig;
+      DBusTypeReader reader;
+
+      _dbus_string_init_const_len (&sig, (const char *) data + sig_pos,
+                                   sig_len);
+      *type = _dbus_first_type_in_signature (&sig, 0);
+      *value_pos = _DBUS_ALIGN_VALUE (end, _dbus_type_get_alignment (*type));
+
+      _dbus_type_reader_init (&reader, byte_order, &sig, 0, str, *value_pos);
+      _dbus_type_reader_next (&reader);
+      end = _dbus_type_reader_get_value_pos (&reader);
+    }
+
+  return end;
 }
 
 /**
@@ -188,8 +230,9 @@ _dbus_header_get_byte_order (const DBusHeader *header)
 static void
 _dbus_header_cache_revalidate (DBusHeader *header)
 {
-  DBusTypeReader array;
-  DBusTypeReader reader;
+  int byte_order;
+  int fields_end;
+  int pos;
   int i;
 
   i = 0;
@@ -199,39 +242,27 @@ _dbus_header_cache_revalidate (DBusHeader *header)
       ++i;
     }
 
-  _dbus_type_reader_init (&reader,
-                          _dbus_header_get_byte_order (header),
-                          &_dbus_header_signature_str,
-                          FIELDS_ARRAY_SIGNATURE_OFFSET,
-                          &header->data,
-                          FIELDS_ARRAY_LENGTH_OFFSET);
+  byte_order = _dbus_header_get_byte_order (header);
+  fields_end = FIRST_FIELD_OFFSET +
+    _dbus_marshal_read_uint32 (&header->data, FIELDS_ARRAY_LENGTH_OFFSET,
+                               byte_order, NULL);
 
-  _dbus_type_reader_recurse (&reader, &array);
+  pos = FIRST_FIELD_OFFSET;
 
-  while (_dbus_type_reader_get_current_type (&array) != DBUS_TYPE_INVALID)
+  while (pos < fields_end)
     {
-      DBusTypeReader sub;
-      DBusTypeReader variant;
       unsigned char field_code;
+      int type;
+      int value_pos;
 
-      _dbus_type_reader_recurse (&array, &sub);
-
-      _dbus_assert (_dbus_type_reader_get_current_type (&sub) == DBUS_TYPE_BYTE);
-      _dbus_type_reader_read_basic (&sub, &field_code);
+      pos = step_over_header_field (&header->data, byte_order, pos,
+                                    &field_code, &type, &value_pos);
 
       /* Unknown fields should be ignored */
-      if (field_code > DBUS_HEADER_FIELD_LAST)
-        goto next_field;
-
-      _dbus_type_reader_next (&sub);
+      if (field_code <= DBUS_HEADER_FIELD_LAST)
+        header->fields[field_code].value_pos = value_pos;
 
-      _dbus_assert (_dbus_type_reader_get_current_type (&sub) == DBUS_TYPE_VARIANT);
-      _dbus_type_reader_recurse (&sub, &variant);
-
-      _dbus_header_cache_one (header, field_code, &variant);
-
-    next_field:
-      _dbus_type_reader_next (&array);
+      pos = _DBUS_ALIGN_VALUE (pos, 8);
     }
 }
 
@@ -481,8 +512,10 @@ _dbus_header_free (DBusHeader *header)
 }
 
 /**
- * Initializes dest with a copy of the given header.
- * Resets the message serial to 0 on the copy.
+ * Replaces the contents of dest, which must have been initialized
+ * with _dbus_header_init(), with a copy of the given header. Resets
+ * the message serial to 0 on the copy. On failure dest is left empty
+ * but still initialized.
  *
  * @param header header to copy
  * @param dest destination for copy
@@ -492,17 +525,14 @@ dbus_bool_t
 _dbus_header_copy (const DBusHeader *header,
                    DBusHeader       *dest)
 {
-  *dest = *header;
+  _dbus_header_reinit (dest);
 
-  if (!_dbus_string_init_preallocated (&dest->data,
-                                       _dbus_string_get_length (&header->data)))
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
     return FALSE;
 
-  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
-    {
-      _dbus_string_free (&dest->data);
-      return FALSE;
-    }
+  memcpy (dest->fields, header->fields, sizeof (dest->fields));
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
 
   /* Reset the serial */
   _dbus_header_set_serial (dest, 0);
@@ -784,14 +814,13 @@ check_mandatory_fields (DBusHeader *header)
 }
 
 static DBusValidity
-load_and_validate_field (DBusHeader     *header,
-                         int             field,
-                         DBusTypeReader *variant_reader)
+load_and_validate_field (DBusHeader       *header,
+                         int               field,
+                         int               type,
+                         const DBusString *value_str,
+                         int               value_pos)
 {
-  int type;
   int expected_type;
-  const DBusString *value_str;
-  int value_pos;
   int str_data_pos;
   dbus_uint32_t v_UINT32;
   int bad_string_code;
@@ -803,8 +832,6 @@ load_and_validate_field (DBusHeader     *header,
   _dbus_assert (field != DBUS_HEADER_FIELD_INVALID);
 
   /* Before we can cache a field, we need to know it has the right type */
-  type = _dbus_type_reader_get_current_type (variant_reader);
-
   _dbus_assert (_dbus_header_field_types[field].code == field);
 
   expected_type = EXPECTED_TYPE_OF_FIELD (field);
@@ -824,28 +851,25 @@ load_and_validate_field (DBusHeader     *header,
 
   /* Now we can cache and look at the field content */
   _dbus_verbose ("initially caching field %d\n", field);
-  _dbus_header_cache_one (header, field, variant_reader);
+  header->fields[field].value_pos = value_pos;
 
   string_validation_func = NULL;
 
   /* make compiler happy that all this is initialized */
   v_UINT32 = 0;
-  value_str = NULL;
-  value_pos = -1;
   str_data_pos = -1;
   bad_string_code = DBUS_VALID;
 
   if (expected_type == DBUS_TYPE_UINT32)
     {
-      _dbus_header_get_field_basic (header, field, expected_type,
-                                    &v_UINT32);
+      v_UINT32 = _dbus_marshal_read_uint32 (value_str, value_pos,
+                                            _dbus_header_get_byte_order (header),
+                                            NULL);
     }
   else if (expected_type == DBUS_TYPE_STRING ||
            expected_type == DBUS_TYPE_OBJECT_PATH ||
            expected_type == DBUS_TYPE_SIGNATURE)
     {
-      _dbus_header_get_field_raw (header, field,
-                                  &value_str, &value_pos);
       str_data_pos = _DBUS_ALIGN_VALUE (value_pos, 4) + 4;
     }
   else
@@ -981,12 +1005,8 @@ _dbus_header_load (DBusHeader        *header,
 {
   int leftover;
   DBusValidity v;
-  DBusTypeReader reader;
-  DBusTypeReader array_reader;
-  unsigned char v_byte;
-  dbus_uint32_t v_uint32;
-  dbus_uint32_t serial;
   int padding_start;
+  int pos;
   int padding_len;
   int i;
   int len;
@@ -1045,95 +1065,48 @@ _dbus_header_load (DBusHeader        *header,
       return TRUE;
     }
 
-  /* We now know the data is well-formed, but we have to check that
-   * it's valid.
+  /* We now know the data is well-formed, so the fixed part and the
+   * fields can be read directly, but we have to check that it's valid.
    */
 
-  _dbus_type_reader_init (&reader,
-                          byte_order,
-                          &_dbus_header_signature_str, 0,
-                          str, 0);
-
-  /* BYTE ORDER */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == BYTE_ORDER_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &v_byte);
-  _dbus_type_reader_next (&reader);
-
-  _dbus_assert (v_byte == byte_order);
-
-  /* MESSAGE TYPE */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == TYPE_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &v_byte);
-  _dbus_type_reader_next (&reader);
+  _dbus_assert (_dbus_string_get_byte (str, BYTE_ORDER_OFFSET) == byte_order);
 
   /* unknown message types are supposed to be ignored, so only validation here is
    * that it isn't invalid
    */
-  if (v_byte == DBUS_MESSAGE_TYPE_INVALID)
+  if (_dbus_string_get_byte (str, TYPE_OFFSET) == DBUS_MESSAGE_TYPE_INVALID)
     {
       *validity = DBUS_INVALID_BAD_MESSAGE_TYPE;
       goto invalid;
     }
 
-  /* FLAGS */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == FLAGS_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &v_byte);
-  _dbus_type_reader_next (&reader);
-
   /* unknown flags should be ignored */
 
-  /* PROTOCOL VERSION */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == VERSION_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &v_byte);
-  _dbus_type_reader_next (&reader);
-
-  if (v_byte != DBUS_MAJOR_PROTOCOL_VERSION)
+  if (_dbus_string_get_byte (str, VERSION_OFFSET) != DBUS_MAJOR_PROTOCOL_VERSION)
     {
       *validity = DBUS_INVALID_BAD_PROTOCOL_VERSION;
       goto invalid;
     }
 
-  /* BODY LENGTH */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_UINT32);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == BODY_LENGTH_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &v_uint32);
-  _dbus_type_reader_next (&reader);
-
-  _dbus_assert (body_len == (signed) v_uint32);
+  _dbus_assert (body_len == (signed) _dbus_marshal_read_uint32 (str, BODY_LENGTH_OFFSET,
+                                                                byte_order, NULL));
 
-  /* SERIAL */
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_UINT32);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == SERIAL_OFFSET);
-  _dbus_type_reader_read_basic (&reader, &serial);
-  _dbus_type_reader_next (&reader);
-
-  if (serial == 0)
+  if (_dbus_marshal_read_uint32 (str, SERIAL_OFFSET, byte_order, NULL) == 0)
     {
       *validity = DBUS_INVALID_BAD_SERIAL;
       goto invalid;
     }
 
-  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_ARRAY);
-  _dbus_assert (_dbus_type_reader_get_value_pos (&reader) == FIELDS_ARRAY_LENGTH_OFFSET);
+  pos = FIRST_FIELD_OFFSET;
 
-  _dbus_type_reader_recurse (&reader, &array_reader);
-  while (_dbus_type_reader_get_current_type (&array_reader) != DBUS_TYPE_INVALID)
+  while (pos < padding_start)
     {
-      DBusTypeReader struct_reader;
-      DBusTypeReader variant_reader;
       unsigned char field_code;
+      int type;
+      int value_pos;
 
-      _dbus_assert (_dbus_type_reader_get_current_type (&array_reader) == DBUS_TYPE_STRUCT);
-
-      _dbus_type_reader_recurse (&array_reader, &struct_reader);
-
-      _dbus_assert (_dbus_type_reader_get_current_type (&struct_reader) == DBUS_TYPE_BYTE);
-      _dbus_type_reader_read_basic (&struct_reader, &field_code);
-      _dbus_type_reader_next (&struct_reader);
+      pos = step_over_header_field (str, byte_order, pos,
+                                    &field_code, &type, &value_pos);
 
       if (field_code == DBUS_HEADER_FIELD_INVALID)
         {
@@ -1149,10 +1122,7 @@ _dbus_header_load (DBusHeader        *header,
           goto next_field;
         }
 
-      _dbus_assert (_dbus_type_reader_get_current_type (&struct_reader) == DBUS_TYPE_VARIANT);
-      _dbus_type_reader_recurse (&struct_reader, &variant_reader);
-
-      v = load_and_validate_field (header, field_code, &variant_reader);
+      v = load_and_validate_field (header, field_code, type, str, value_pos);
       if (v != DBUS_VALID)
         {
           _dbus_verbose ("Field %d was invalid\n", field_code);
@@ -1161,7 +1131,7 @@ _dbus_header_load (DBusHeader        *header,
         }
 
     next_field:
-      _dbus_type_reader_next (&array_reader);
+      pos = _DBUS_ALIGN_VALUE (pos, 8);
     }
 
   /* Anything we didn't fill in is now known not to exist */
@@ -1278,11 +1248,48 @@ _dbus_header_set_field_basic (DBusHeader       *header,
                               int               type,
                               const void       *value)
 {
+  int appended_pos;
+
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  /* The dbus-daemon overwrites the sender of every message it routes,
+   * and the new name usually has the same length as whatever is there.
+   * Rewriting the characters in place then leaves both the layout and
+   * the fields cache untouched.
+   */
+  if ((type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) &&
+      _dbus_header_cache_check (header, field))
+    {
+      const char *v_STRING = *(const char * const *) value;
+      int value_pos = header->fields[field].value_pos;
+      size_t len = strlen (v_STRING);
+
+      if (len == _dbus_marshal_read_uint32 (&header->data, value_pos,
+                                            _dbus_header_get_byte_order (header),
+                                            NULL))
+        {
+          memcpy (_dbus_string_get_data_len (&header->data, value_pos + 4, len),
+                  v_STRING, len);
+          return TRUE;
+        }
+    }
+
+  /* Likewise a fixed-length value, such as the reply serial of a reply
+   * copied from a template, can just be overwritten */
+  if (type == DBUS_TYPE_UINT32 && _dbus_header_cache_check (header, field))
+    {
+      _dbus_marshal_set_uint32 (&header->data,
+                                header->fields[field].value_pos,
+                                *(const dbus_uint32_t *) value,
+                                _dbus_header_get_byte_order (header));
+      return TRUE;
+    }
+
   if (!reserve_header_padding (header))
     return FALSE;
 
+  appended_pos = -1;
+
   /* If the field exists we set, otherwise we append */
   if (_dbus_header_cache_check (header, field))
     {
@@ -1321,6 +1328,8 @@ _dbus_header_set_field_basic (DBusHeader       *header,
       _dbus_assert (array.u.array.start_pos == FIRST_FIELD_OFFSET);
       _dbus_assert (array.value_pos == HEADER_END_BEFORE_PADDING (header));
 
+      appended_pos = _DBUS_ALIGN_VALUE (array.value_pos, 8);
+
       if (!write_basic_field (&array,
                               field, type, value))
         return FALSE;
@@ -1331,11 +1340,23 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 
   correct_header_padding (header);
 
-  /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
-   */
-  _dbus_header_cache_invalidate_all (header);
+  if (appended_pos >= 0)
+    {
+      /* Appending moved nothing, so only the new field needs caching;
+       * its value follows the field code and the one-character variant
+       * signature, i.e. 4 bytes into the 8-aligned struct.
+       */
+      header->fields[field].value_pos =
+        _DBUS_ALIGN_VALUE (appended_pos + 4, _dbus_type_get_alignment (type));
+    }
+  else
+    {
+      /* We could be smarter about this (only invalidate fields after the
+       * one we modified, or even only if the one we modified changed
+       * length). But this hack is a start.
+       */
+      _dbus_header_cache_invalidate_all (header);
+    }
 
   return TRUE;
 }
@@ -973,6 +973,123 @@ _dbus_type_reader_read_fixed_multi (const DBusTypeReader  *reader,
 #endif
 }
 
+/**
+ * Reads the structs from the current position to the end of an array
+ * of structs whose fields are all fixed-length basic types, such as
+ * "a(iiu)", into a C array, in a single pass. Each field is converted
+ * to host byte order and stored at the corresponding offset of
+ * field_offsets within its element.
+ *
+ * Like _dbus_type_reader_read_fixed_multi(), this doesn't move the
+ * reader.
+ *
+ * @param reader the reader, which must be inside the array
+ * @param elements where to store the structs
+ * @param element_size the size of one C struct
+ * @param field_offsets the offset of each field within the C struct
+ * @param max_elements the most structs to store
+ * @returns the number of structs stored
+ */
+int
+_dbus_type_reader_read_fixed_struct_multi (const DBusTypeReader *reader,
+                                           void                 *elements,
+                                           int                   element_size,
+                                           const int            *field_offsets,
+                                           int                   max_elements)
+{
+  const unsigned char *fields;
+  const unsigned char *data;
+  unsigned char *out;
+  int n_fields;
+  int end_pos;
+  int pos;
+  int n;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+
+  fields = _dbus_string_get_const_udata_len (reader->type_str,
+                                             reader->type_pos, 0);
+  _dbus_assert (*fields == DBUS_STRUCT_BEGIN_CHAR);
+  fields++;
+
+  for (n_fields = 0; fields[n_fields] != DBUS_STRUCT_END_CHAR; n_fields++)
+    _dbus_assert (dbus_type_is_fixed (fields[n_fields]));
+
+  data = _dbus_string_get_const_udata (reader->value_str);
+  end_pos = reader->u.array.start_pos + array_reader_get_array_len (reader);
+  pos = reader->value_pos;
+  out = elements;
+
+  for (n = 0; n < max_elements && pos < end_pos; n++)
+    {
+      int i;
+
+      pos = _DBUS_ALIGN_VALUE (pos, 8);
+
+      for (i = 0; i < n_fields; i++)
+        {
+          unsigned char *field = out + field_offsets[i];
+
+          switch (_dbus_type_get_alignment (fields[i]))
+            {
+            case 1:
+              *field = data[pos];
+              pos += 1;
+              break;
+
+            case 2:
+              {
+                dbus_uint16_t v;
+
+                pos = _DBUS_ALIGN_VALUE (pos, 2);
+                memcpy (&v, data + pos, 2);
+                if (reader->byte_order != DBUS_COMPILER_BYTE_ORDER)
+                  v = DBUS_UINT16_SWAP_LE_BE (v);
+                memcpy (field, &v, 2);
+                pos += 2;
+              }
+              break;
+
+            case 4:
+              {
+                dbus_uint32_t v;
+
+                pos = _DBUS_ALIGN_VALUE (pos, 4);
+                memcpy (&v, data + pos, 4);
+                if (reader->byte_order != DBUS_COMPILER_BYTE_ORDER)
+                  v = DBUS_UINT32_SWAP_LE_BE (v);
+                memcpy (field, &v, 4);
+                pos += 4;
+              }
+              break;
+
+            case 8:
+              {
+                dbus_uint64_t v;
+
+                pos = _DBUS_ALIGN_VALUE (pos, 8);
+                memcpy (&v, data + pos, 8);
+                if (reader->byte_order != DBUS_COMPILER_BYTE_ORDER)
+                  v = DBUS_UINT64_SWAP_LE_BE (v);
+                memcpy (field, &v, 8);
+                pos += 8;
+              }
+              break;
+
+            default:
+              _dbus_assert_not_reached ("unexpected alignment of fixed type");
+              break;
+            }
+        }
+
+      _dbus_assert (pos <= end_pos);
+      out += element_size;
+    }
+
+  return n;
+}
+
 /**
  * Initialize a new reader pointing to the first type and
  * corresponding value that's a child of the current container. It's
@@ -2395,6 +2512,48 @@ _dbus_type_writer_write_fixed_multi (DBusTypeWriter        *writer,
   return TRUE;
 }
 
+/**
+ * Like _dbus_type_writer_write_fixed_multi(), but only makes
+ * zero-filled room for the values, and reports where in the value
+ * string they go so the caller can fill them in. Nothing is reserved
+ * if the writer is disabled, in which case *array_start_p is -1.
+ *
+ * @param writer a writer
+ * @param element_type type of stuff in the array
+ * @param n_elements number of elements to make room for
+ * @param array_start_p return location for the position of the first element
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_type_writer_reserve_fixed_multi (DBusTypeWriter        *writer,
+                                       int                    element_type,
+                                       int                    n_elements,
+                                       int                   *array_start_p)
+{
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (dbus_type_is_fixed (element_type));
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (n_elements >= 0);
+
+  if (!write_or_verify_typecode (writer, element_type))
+    _dbus_assert_not_reached ("OOM should not happen if only verifying typecode");
+
+  *array_start_p = -1;
+
+  if (writer->enabled)
+    {
+      if (!_dbus_marshal_reserve_fixed_multi (writer->value_str,
+                                              writer->value_pos,
+                                              element_type,
+                                              n_elements,
+                                              array_start_p,
+                                              &writer->value_pos))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 enable_if_after (DBusTypeWriter       *writer,
                  DBusTypeReader       *reader,
@@ -121,6 +121,11 @@ DBUS_PRIVATE_EXPORT
 void        _dbus_type_reader_read_fixed_multi          (const DBusTypeReader  *reader,
                                                          void                  *value,
                                                          int                   *n_elements);
+int         _dbus_type_reader_read_fixed_struct_multi   (const DBusTypeReader  *reader,
+                                                         void                  *elements,
+                                                         int                    element_size,
+                                                         const int             *field_offsets,
+                                                         int                    max_elements);
 void        _dbus_type_reader_read_raw                  (const DBusTypeReader  *reader,
                                                          const unsigned char  **value_location);
 DBUS_PRIVATE_EXPORT
@@ -179,6 +184,10 @@ dbus_bool_t _dbus_type_writer_write_fixed_multi    (DBusTypeWriter        *write
                                                     int                    element_type,
                                                     const void            *value,
                                                     int                    n_elements);
+dbus_bool_t _dbus_type_writer_reserve_fixed_multi  (DBusTypeWriter        *writer,
+                                                    int                    element_type,
+                                                    int                    n_elements,
+                                                    int                   *array_start_p);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_type_writer_recurse              (DBusTypeWriter        *writer,
                                                     int                    container_type,
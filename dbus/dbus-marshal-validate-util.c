@@ -68,6 +68,8 @@ static const ValidityTest signature_tests[] = {
   { "b", DBUS_VALID },
   { "ai", DBUS_VALID },
   { "(i)", DBUS_VALID },
+  { "a{sv}", DBUS_VALID },
+  { "sa{sv}as", DBUS_VALID },
   { "w", DBUS_INVALID_UNKNOWN_TYPECODE },
   { "a", DBUS_INVALID_MISSING_ARRAY_ELEMENT_TYPE },
   { "aaaaaa", DBUS_INVALID_MISSING_ARRAY_ELEMENT_TYPE },
@@ -220,6 +222,10 @@ _dbus_marshal_validate_test (void)
 
   /* Signature with reason */
 
+  run_validity_tests (signature_tests, _DBUS_N_ELEMENTS (signature_tests),
+                      _dbus_validate_signature_with_reason);
+
+  /* Again, now that the valid ones are in the signature cache */
   run_validity_tests (signature_tests, _DBUS_N_ELEMENTS (signature_tests),
                       _dbus_validate_signature_with_reason);
 
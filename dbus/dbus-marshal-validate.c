@@ -35,22 +35,10 @@
  * @{
  */
 
-/**
- * Verifies that the range of type_str from type_pos to type_end is a
- * valid signature.  If this function returns #TRUE, it will be safe
- * to iterate over the signature with a types-only #DBusTypeReader.
- * The range passed in should NOT include the terminating
- * nul/DBUS_TYPE_INVALID.
- *
- * @param type_str the string
- * @param type_pos where the typecodes start
- * @param len length of typecodes
- * @returns #DBUS_VALID if valid, reason why invalid otherwise
- */
-DBusValidity
-_dbus_validate_signature_with_reason (const DBusString *type_str,
-                                      int               type_pos,
-                                      int               len)
+static DBusValidity
+validate_signature_uncached (const DBusString *type_str,
+                             int               type_pos,
+                             int               len)
 {
   const unsigned char *p;
   const unsigned char *end;
@@ -291,6 +279,127 @@ out:
   return result;
 }
 
+/*
+ * A small direct-mapped cache of short signatures that were recently
+ * found to be valid. Message bodies keep carrying the same handful of
+ * signatures ("a{sv}", "sa{sv}as" and so on), each of which would
+ * otherwise be re-parsed, with a list allocation per container, for
+ * every message and every variant. Invalid signatures are never cached,
+ * so a hit can only ever say DBUS_VALID.
+ */
+#define SIGNATURE_CACHE_SIZE 64
+#define SIGNATURE_CACHE_MAX_LENGTH 31
+
+typedef struct
+{
+  unsigned char len;  /* 0 for an unused slot */
+  unsigned char typecodes[SIGNATURE_CACHE_MAX_LENGTH];
+} SignatureCacheEntry;
+
+/* Protected by _DBUS_LOCK (signature_cache) */
+static SignatureCacheEntry signature_cache[SIGNATURE_CACHE_SIZE];
+
+static unsigned int
+signature_cache_slot (const unsigned char *p,
+                      int                  len)
+{
+  unsigned int h = 2166136261u;
+  int i;
+
+  /* FNV-1a */
+  for (i = 0; i < len; i++)
+    h = (h ^ p[i]) * 16777619u;
+
+  return h % SIGNATURE_CACHE_SIZE;
+}
+
+/**
+ * Verifies that the range of type_str from type_pos to type_end is a
+ * valid signature.  If this function returns #TRUE, it will be safe
+ * to iterate over the signature with a types-only #DBusTypeReader.
+ * The range passed in should NOT include the terminating
+ * nul/DBUS_TYPE_INVALID.
+ *
+ * Single complete types that need no parsing are accepted straight
+ * away, and other short signatures are looked up in a process-wide
+ * cache of signatures already found to be valid.
+ *
+ * @param type_str the string
+ * @param type_pos where the typecodes start
+ * @param len length of typecodes
+ * @returns #DBUS_VALID if valid, reason why invalid otherwise
+ */
+DBusValidity
+_dbus_validate_signature_with_reason (const DBusString *type_str,
+                                      int               type_pos,
+                                      int               len)
+{
+  const unsigned char *p;
+  SignatureCacheEntry *entry;
+  DBusValidity result;
+
+  _dbus_assert (type_str != NULL);
+  _dbus_assert (len >= 0);
+  _dbus_assert (type_pos >= 0);
+
+  if (len == 0 || len > SIGNATURE_CACHE_MAX_LENGTH)
+    return validate_signature_uncached (type_str, type_pos, len);
+
+  p = _dbus_string_get_const_udata_len (type_str, type_pos, len);
+
+  if (len == 1)
+    {
+      /* By far the most common case: the signature of a variant
+       * holding a basic type */
+      switch (*p)
+        {
+        case DBUS_TYPE_BYTE:
+        case DBUS_TYPE_BOOLEAN:
+        case DBUS_TYPE_INT16:
+        case DBUS_TYPE_UINT16:
+        case DBUS_TYPE_INT32:
+        case DBUS_TYPE_UINT32:
+        case DBUS_TYPE_UNIX_FD:
+        case DBUS_TYPE_INT64:
+        case DBUS_TYPE_UINT64:
+        case DBUS_TYPE_DOUBLE:
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        case DBUS_TYPE_SIGNATURE:
+        case DBUS_TYPE_VARIANT:
+          return DBUS_VALID;
+
+        default:
+          return validate_signature_uncached (type_str, type_pos, len);
+        }
+    }
+
+  entry = &signature_cache[signature_cache_slot (p, len)];
+
+  /* If the lock can't be taken, we just do without the cache */
+  if (_DBUS_LOCK (signature_cache))
+    {
+      dbus_bool_t hit;
+
+      hit = (entry->len == len && memcmp (entry->typecodes, p, len) == 0);
+      _DBUS_UNLOCK (signature_cache);
+
+      if (hit)
+        return DBUS_VALID;
+    }
+
+  result = validate_signature_uncached (type_str, type_pos, len);
+
+  if (result == DBUS_VALID && _DBUS_LOCK (signature_cache))
+    {
+      memcpy (entry->typecodes, p, len);
+      entry->len = len;
+      _DBUS_UNLOCK (signature_cache);
+    }
+
+  return result;
+}
+
 /* note: this function is also used to validate the header's values,
  * since the header is a valid body with a particular signature.
  */
@@ -467,22 +576,41 @@ validate_body_helper (DBusTypeReader       *reader,
                      */
                     if (array_elem_type == DBUS_TYPE_BOOLEAN)
                       {
-                        dbus_uint32_t v;
-                        alignment = _dbus_type_get_alignment (array_elem_type);
-
+                        dbus_uint32_t acc;
+
+                        /* Checking the length once up front also keeps the
+                         * loop below from reading past array_end.
+                         */
+                        if (claimed_len % 4 != 0)
+                          return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+
+                        /* OR the raw elements together and look at the
+                         * result once; byte-swapping commutes with OR, so
+                         * the array is valid iff the combined value,
+                         * unpacked in the message's byte order, is 0 or 1.
+                         * p is 4-aligned here, see above.
+                         */
+                        acc = 0;
                         while (p < array_end)
                           {
-                            v = _dbus_unpack_uint32 (byte_order, p);
-
-                            if (!(v == 0 || v == 1))
-                              return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
-
-                            p += alignment;
+                            acc |= *(const dbus_uint32_t *) (const void *) p;
+                            p += 4;
                           }
+
+                        if (_dbus_unpack_uint32 (byte_order,
+                                                 (const unsigned char *) &acc) > 1)
+                          return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
                       }
 
                     else
                       {
+                        /* No per-element checks, so one length check stands
+                         * in for walking the elements; for fixed types the
+                         * alignment is also the element size.
+                         */
+                        if (claimed_len % alignment != 0)
+                          return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+
                         p = array_end;
                       }
                   }
@@ -679,6 +807,497 @@ validate_body_helper (DBusTypeReader       *reader,
   return DBUS_VALID;
 }
 
+/*
+ * Most message bodies are a short run of basic values, sometimes with
+ * an array of strings: "s", "u", "su", "sss" for NameOwnerChanged, "as"
+ * and so on. For those, walking a DBusTypeReader costs more than the
+ * checks themselves, so they get a loop of their own. It must give
+ * exactly the same verdicts as validate_body_helper().
+ */
+static dbus_bool_t
+signature_is_flat (const unsigned char *sig,
+                   const unsigned char *sig_end)
+{
+  const unsigned char *s;
+
+  for (s = sig; s != sig_end; s++)
+    {
+      switch (*s)
+        {
+        case DBUS_TYPE_BYTE:
+        case DBUS_TYPE_BOOLEAN:
+        case DBUS_TYPE_INT16:
+        case DBUS_TYPE_UINT16:
+        case DBUS_TYPE_INT32:
+        case DBUS_TYPE_UINT32:
+        case DBUS_TYPE_UNIX_FD:
+        case DBUS_TYPE_INT64:
+        case DBUS_TYPE_UINT64:
+        case DBUS_TYPE_DOUBLE:
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+        case DBUS_TYPE_SIGNATURE:
+          break;
+
+        case DBUS_TYPE_ARRAY:
+          if (s + 1 == sig_end ||
+              (s[1] != DBUS_TYPE_STRING && s[1] != DBUS_TYPE_OBJECT_PATH))
+            return FALSE;
+
+          s++;
+          break;
+
+        default:
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static DBusValidity
+validate_flat_string (int                   type,
+                      int                   byte_order,
+                      const unsigned char **p_inout,
+                      const unsigned char  *end)
+{
+  const unsigned char *p = *p_inout;
+  const unsigned char *a;
+  dbus_uint32_t claimed_len;
+  DBusString str;
+
+  if (p == end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  a = _DBUS_ALIGN_ADDRESS (p, 4);
+  if (a + 4 > end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  claimed_len = _dbus_unpack_uint32 (byte_order, p);
+  p += 4;
+
+  if (claimed_len > (unsigned long) (end - p))
+    return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
+
+  _dbus_string_init_const_len (&str, (const char *) p, claimed_len);
+
+  if (type == DBUS_TYPE_OBJECT_PATH)
+    {
+      if (!_dbus_validate_path (&str, 0, claimed_len))
+        return DBUS_INVALID_BAD_PATH;
+    }
+  else
+    {
+      if (!_dbus_string_validate_utf8 (&str, 0, claimed_len))
+        return DBUS_INVALID_BAD_UTF8_IN_STRING;
+    }
+
+  p += claimed_len;
+
+  if (p == end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  if (*p != '\0')
+    return DBUS_INVALID_STRING_MISSING_NUL;
+
+  *p_inout = p + 1;
+  return DBUS_VALID;
+}
+
+static void
+index_add (DBusBodyIndex       *index,
+           const unsigned char *sig,
+           const unsigned char *s,
+           const unsigned char *start,
+           const unsigned char *p)
+{
+  if (index == NULL || index->n_offsets > DBUS_BODY_INDEX_MAX_ARGS)
+    return;
+
+  index->value_offsets[index->n_offsets] = p - start;
+  index->type_offsets[index->n_offsets] = s - sig;
+  index->n_offsets += 1;
+}
+
+static DBusValidity
+validate_flat_body (const unsigned char  *sig,
+                    const unsigned char  *sig_end,
+                    int                   byte_order,
+                    const unsigned char  *p,
+                    const unsigned char  *end,
+                    const unsigned char **new_p,
+                    DBusBodyIndex        *index)
+{
+  const unsigned char *start = p;
+  const unsigned char *s;
+  DBusValidity validity;
+
+  for (s = sig; s != sig_end; s++)
+    {
+      const unsigned char *a;
+      int alignment;
+
+      index_add (index, sig, s, start, p);
+
+      if (p == end)
+        return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+      switch (*s)
+        {
+        case DBUS_TYPE_BYTE:
+          ++p;
+          break;
+
+        case DBUS_TYPE_STRING:
+        case DBUS_TYPE_OBJECT_PATH:
+          validity = validate_flat_string (*s, byte_order, &p, end);
+          if (validity != DBUS_VALID)
+            return validity;
+          break;
+
+        case DBUS_TYPE_SIGNATURE:
+          {
+            dbus_uint32_t claimed_len;
+            DBusString str;
+
+            claimed_len = *p;
+            ++p;
+
+            /* 1 is for nul termination */
+            if (claimed_len + 1 > (unsigned long) (end - p))
+              return DBUS_INVALID_SIGNATURE_LENGTH_OUT_OF_BOUNDS;
+
+            _dbus_string_init_const_len (&str, (const char *) p, claimed_len);
+            validity = _dbus_validate_signature_with_reason (&str, 0,
+                                                             claimed_len);
+            if (validity != DBUS_VALID)
+              return validity;
+
+            p += claimed_len;
+
+            if (*p != DBUS_TYPE_INVALID)
+              return DBUS_INVALID_SIGNATURE_MISSING_NUL;
+
+            ++p;
+          }
+          break;
+
+        case DBUS_TYPE_ARRAY:
+          {
+            dbus_uint32_t claimed_len;
+            const unsigned char *array_end;
+
+            s++;
+
+            a = _DBUS_ALIGN_ADDRESS (p, 4);
+            if (a + 4 > end)
+              return DBUS_INVALID_NOT_ENOUGH_DATA;
+            while (p != a)
+              {
+                if (*p != '\0')
+                  return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+                ++p;
+              }
+
+            claimed_len = _dbus_unpack_uint32 (byte_order, p);
+            p += 4;
+
+            /* Elements are strings, which are 4-aligned like the length
+             * before them, so there is never any padding here */
+            if (claimed_len > (unsigned long) (end - p))
+              return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
+
+            if (claimed_len > 0)
+              {
+                if (claimed_len > DBUS_MAXIMUM_ARRAY_LENGTH)
+                  return DBUS_INVALID_ARRAY_LENGTH_EXCEEDS_MAXIMUM;
+
+                array_end = p + claimed_len;
+
+                while (p < array_end)
+                  {
+                    validity = validate_flat_string (*s, byte_order, &p, end);
+                    if (validity != DBUS_VALID)
+                      return validity;
+                  }
+
+                if (p != array_end)
+                  return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+              }
+          }
+          break;
+
+        default:
+          alignment = _dbus_type_get_alignment (*s);
+          a = _DBUS_ALIGN_ADDRESS (p, alignment);
+          if (a >= end)
+            return DBUS_INVALID_NOT_ENOUGH_DATA;
+          while (p != a)
+            {
+              if (*p != '\0')
+                return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+              ++p;
+            }
+
+          if (*s == DBUS_TYPE_BOOLEAN)
+            {
+              dbus_uint32_t v = _dbus_unpack_uint32 (byte_order, p);
+
+              if (!(v == 0 || v == 1))
+                return DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE;
+            }
+
+          p += alignment;
+
+          if (p > end)
+            return DBUS_INVALID_NOT_ENOUGH_DATA;
+          break;
+        }
+    }
+
+  index_add (index, sig, s, start, p);
+  *new_p = p;
+  return DBUS_VALID;
+}
+
+/*
+ * Every message header is checked against DBUS_HEADER_SIGNATURE, whose
+ * fields array a(yv) is not flat. But nearly every field holds a single
+ * u, s, o or g, so the array gets a walker of its own, which hands
+ * anything else to validate_body_helper(). Again the verdicts must be
+ * exactly those of validate_body_helper().
+ */
+static DBusValidity
+validate_header_field (int                   byte_order,
+                       const unsigned char  *p,
+                       const unsigned char  *end,
+                       const unsigned char **new_p)
+{
+  const unsigned char *a;
+  const unsigned char *s;
+
+  if (p == end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  /* A field code, a variant signature with one typecode, and its nul */
+  a = _DBUS_ALIGN_ADDRESS (p, 8);
+  s = a + 2;
+
+  if (a + 4 > end || a[1] != 1 || a[3] != DBUS_TYPE_INVALID ||
+      (*s != DBUS_TYPE_UINT32 && *s != DBUS_TYPE_STRING &&
+       *s != DBUS_TYPE_OBJECT_PATH && *s != DBUS_TYPE_SIGNATURE))
+    {
+      DBusString sig;
+      DBusTypeReader reader;
+
+      _dbus_string_init_const (&sig, DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+                                     DBUS_TYPE_BYTE_AS_STRING
+                                     DBUS_TYPE_VARIANT_AS_STRING
+                                     DBUS_STRUCT_END_CHAR_AS_STRING);
+      _dbus_type_reader_init_types_only (&reader, &sig, 0);
+      return validate_body_helper (&reader, byte_order, FALSE, 1,
+                                   p, end, new_p);
+    }
+
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  /* Step over the field code and the variant signature */
+  p += 4;
+
+  a = _DBUS_ALIGN_ADDRESS (p, _dbus_type_get_alignment (*s));
+  if (a > end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  return validate_flat_body (s, s + 1, byte_order, p, end, new_p, NULL);
+}
+
+static DBusValidity
+validate_header_fields (int                   byte_order,
+                        const unsigned char  *p,
+                        const unsigned char  *end,
+                        const unsigned char **new_p)
+{
+  const unsigned char *a;
+  const unsigned char *array_end;
+  dbus_uint32_t claimed_len;
+  DBusValidity validity;
+
+  if (p == end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+
+  a = _DBUS_ALIGN_ADDRESS (p, 4);
+  if (a + 4 > end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  claimed_len = _dbus_unpack_uint32 (byte_order, p);
+  p += 4;
+
+  /* The elements are structs */
+  a = _DBUS_ALIGN_ADDRESS (p, 8);
+  if (a > end)
+    return DBUS_INVALID_NOT_ENOUGH_DATA;
+  while (p != a)
+    {
+      if (*p != '\0')
+        return DBUS_INVALID_ALIGNMENT_PADDING_NOT_NUL;
+      ++p;
+    }
+
+  if (claimed_len > (unsigned long) (end - p))
+    return DBUS_INVALID_LENGTH_OUT_OF_BOUNDS;
+
+  if (claimed_len > 0)
+    {
+      if (claimed_len > DBUS_MAXIMUM_ARRAY_LENGTH)
+        return DBUS_INVALID_ARRAY_LENGTH_EXCEEDS_MAXIMUM;
+
+      array_end = p + claimed_len;
+
+      while (p < array_end)
+        {
+          validity = validate_header_field (byte_order, p, end, &p);
+          if (validity != DBUS_VALID)
+            return validity;
+        }
+
+      if (p != array_end)
+        return DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+    }
+
+  *new_p = p;
+  return DBUS_VALID;
+}
+
+static dbus_bool_t
+signature_is_header (const unsigned char *sig,
+                     const unsigned char *sig_end)
+{
+  return (sig_end - sig == (int) strlen (DBUS_HEADER_SIGNATURE) &&
+          memcmp (sig, DBUS_HEADER_SIGNATURE, sig_end - sig) == 0);
+}
+
+static DBusValidity
+validate_body (const DBusString *expected_signature,
+               int               expected_signature_start,
+               int               byte_order,
+               int              *bytes_remaining,
+               const DBusString *value_str,
+               int               value_pos,
+               int               len,
+               DBusBodyIndex    *index)
+{
+  DBusTypeReader reader;
+  const unsigned char *sig;
+  const unsigned char *sig_end;
+  const unsigned char *start;
+  const unsigned char *p;
+  const unsigned char *end;
+  DBusValidity validity;
+
+  _dbus_assert (len >= 0);
+  _dbus_assert (value_pos >= 0);
+  _dbus_assert (value_pos <= _dbus_string_get_length (value_str) - len);
+
+  _dbus_verbose ("validating body from pos %d len %d sig '%s'\n",
+                 value_pos, len, _dbus_string_get_const_data_len (expected_signature,
+                                                                  expected_signature_start,
+                                                                  0));
+
+  start = p = _dbus_string_get_const_udata_len (value_str, value_pos, len);
+  end = p + len;
+
+  sig = _dbus_string_get_const_udata (expected_signature) +
+    expected_signature_start;
+  sig_end = (const unsigned char *) strchr ((const char *) sig, '\0');
+
+  if (index != NULL)
+    index->n_offsets = 0;
+
+  if (signature_is_flat (sig, sig_end))
+    {
+      validity = validate_flat_body (sig, sig_end, byte_order, p, end, &p,
+                                     index);
+    }
+  else if (index == NULL && signature_is_header (sig, sig_end))
+    {
+      /* The fixed part, yyyyuu, is flat */
+      validity = validate_flat_body (sig, sig + 6, byte_order, p, end, &p,
+                                     NULL);
+
+      if (validity == DBUS_VALID)
+        validity = validate_header_fields (byte_order, p, end, &p);
+    }
+  else
+    {
+      _dbus_type_reader_init_types_only (&reader, expected_signature,
+                                         expected_signature_start);
+
+      if (index == NULL)
+        {
+          validity = validate_body_helper (&reader, byte_order, TRUE, 0,
+                                           p, end, &p);
+        }
+      else
+        {
+          /* One complete type at a time, noting where each starts */
+          validity = DBUS_VALID;
+
+          while (validity == DBUS_VALID)
+            {
+              index_add (index, sig,
+                         sig + reader.type_pos - expected_signature_start,
+                         start, p);
+
+              if (_dbus_type_reader_get_current_type (&reader) ==
+                  DBUS_TYPE_INVALID)
+                break;
+
+              validity = validate_body_helper (&reader, byte_order, FALSE, 0,
+                                               p, end, &p);
+              _dbus_type_reader_next (&reader);
+            }
+        }
+    }
+
+  if (validity == DBUS_VALID)
+    {
+      if (bytes_remaining)
+        *bytes_remaining = end - p;
+      else if (p < end)
+        validity = DBUS_INVALID_TOO_MUCH_DATA;
+      else
+        _dbus_assert (p == end);
+    }
+
+  if (validity != DBUS_VALID && index != NULL)
+    index->n_offsets = 0;
+
+  return validity;
+}
+
 /**
  * Verifies that the range of value_str from value_pos to value_end is
  * a legitimate value of type expected_signature.  If this function
@@ -708,42 +1327,39 @@ _dbus_validate_body_with_reason (const DBusString *expected_signature,
                                  int               value_pos,
                                  int               len)
 {
-  DBusTypeReader reader;
-  const unsigned char *p;
-  const unsigned char *end;
-  DBusValidity validity;
-
-  _dbus_assert (len >= 0);
-  _dbus_assert (value_pos >= 0);
-  _dbus_assert (value_pos <= _dbus_string_get_length (value_str) - len);
-
-  _dbus_verbose ("validating body from pos %d len %d sig '%s'\n",
-                 value_pos, len, _dbus_string_get_const_data_len (expected_signature,
-                                                                  expected_signature_start,
-                                                                  0));
-
-  _dbus_type_reader_init_types_only (&reader,
-                                     expected_signature, expected_signature_start);
+  return validate_body (expected_signature, expected_signature_start,
+                        byte_order, bytes_remaining, value_str, value_pos,
+                        len, NULL);
+}
 
-  p = _dbus_string_get_const_udata_len (value_str, value_pos, len);
-  end = p + len;
+/**
+ * Like _dbus_validate_body_with_reason() with no bytes_remaining, but
+ * also records in index where the first #DBUS_BODY_INDEX_MAX_ARGS
+ * arguments start, while it is walking over them anyway. If the body
+ * is not valid, the index is left empty.
+ *
+ * @param expected_signature the expected types in the value_str
+ * @param expected_signature_start where in expected_signature is the signature
+ * @param byte_order the byte order
+ * @param value_str the string containing the body
+ * @param value_pos where the values start
+ * @param len length of values after value_pos
+ * @param index the index to fill in
+ * @returns #DBUS_VALID if valid, reason why invalid otherwise
+ */
+DBusValidity
+_dbus_validate_body_indexed (const DBusString *expected_signature,
+                             int               expected_signature_start,
+                             int               byte_order,
+                             const DBusString *value_str,
+                             int               value_pos,
+                             int               len,
+                             DBusBodyIndex    *index)
+{
+  _dbus_assert (index != NULL);
 
-  validity = validate_body_helper (&reader, byte_order, TRUE, 0, p, end, &p);
-  if (validity != DBUS_VALID)
-    return validity;
-  
-  if (bytes_remaining)
-    {
-      *bytes_remaining = end - p;
-      return DBUS_VALID;
-    }
-  else if (p < end)
-    return DBUS_INVALID_TOO_MUCH_DATA;
-  else
-    {
-      _dbus_assert (p == end);
-      return DBUS_VALID;
-    }
+  return validate_body (expected_signature, expected_signature_start,
+                        byte_order, NULL, value_str, value_pos, len, index);
 }
 
 /**
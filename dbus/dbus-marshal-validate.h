@@ -116,6 +116,22 @@ typedef enum
   DBUS_VALIDITY_LAST
 } DBusValidity;
 
+/** How many arguments of a body _dbus_validate_body_indexed() records */
+#define DBUS_BODY_INDEX_MAX_ARGS 8
+
+/**
+ * Where the first few arguments of a validated body start, so that
+ * they can be read without walking over the ones before them. If the
+ * body has n_args <= #DBUS_BODY_INDEX_MAX_ARGS arguments, entry n_args
+ * is the end of the body and of the signature.
+ */
+typedef struct
+{
+  int n_offsets; /**< Number of entries in use, or 0 if there is no index */
+  dbus_uint32_t value_offsets[DBUS_BODY_INDEX_MAX_ARGS + 1]; /**< Start of each argument, from the start of the values */
+  unsigned char type_offsets[DBUS_BODY_INDEX_MAX_ARGS + 1]; /**< Start of each argument's type, from the start of the signature */
+} DBusBodyIndex;
+
 DBUS_PRIVATE_EXPORT
 DBusValidity _dbus_validate_signature_with_reason (const DBusString *type_str,
                                                    int               type_pos,
@@ -128,6 +144,14 @@ DBusValidity _dbus_validate_body_with_reason      (const DBusString *expected_si
                                                    const DBusString *value_str,
                                                    int               value_pos,
                                                    int               len);
+DBUS_PRIVATE_EXPORT
+DBusValidity _dbus_validate_body_indexed          (const DBusString *expected_signature,
+                                                   int               expected_signature_start,
+                                                   int               byte_order,
+                                                   const DBusString *value_str,
+                                                   int               value_pos,
+                                                   int               len,
+                                                   DBusBodyIndex    *index);
 
 const char *_dbus_validity_to_error_message (DBusValidity validity);
 
@@ -29,6 +29,7 @@
 #include "dbus-threads.h"
 #include <dbus/dbus-test-tap.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @defgroup DBusMemory Memory Allocation
@@ -305,7 +306,7 @@ _dbus_decrement_fail_alloc_counter (void)
 int
 _dbus_get_malloc_blocks_outstanding (void)
 {
-  return _dbus_atomic_get (&n_blocks_outstanding);
+  return _dbus_atomic_get_relaxed (&n_blocks_outstanding);
 }
 
 /**
@@ -438,6 +439,72 @@ set_guards (void       *real_block,
 
 #endif
 
+/* Set at most once, before libdbus allocates anything */
+static DBusMallocFunction custom_malloc = NULL;
+static DBusReallocFunction custom_realloc = NULL;
+static DBusFreeFunction custom_free = NULL;
+/* TRUE once anything has been allocated */
+static dbus_bool_t memory_functions_frozen = FALSE;
+
+static inline void
+freeze_memory_functions (void)
+{
+  /* only ever changes from FALSE to TRUE, so checking first avoids
+   * writing to a shared cache line on every allocation */
+  if (_DBUS_UNLIKELY (!memory_functions_frozen))
+    memory_functions_frozen = TRUE;
+}
+
+static inline void *
+call_malloc (size_t bytes)
+{
+  freeze_memory_functions ();
+
+  if (custom_malloc != NULL)
+    return (* custom_malloc) (bytes);
+
+  return malloc (bytes);
+}
+
+static inline void *
+call_calloc (size_t bytes)
+{
+  void *mem;
+
+  freeze_memory_functions ();
+
+  if (custom_malloc == NULL)
+    return calloc (bytes, 1);
+
+  mem = (* custom_malloc) (bytes);
+
+  if (mem != NULL)
+    memset (mem, '\0', bytes);
+
+  return mem;
+}
+
+static inline void *
+call_realloc (void   *memory,
+              size_t  bytes)
+{
+  freeze_memory_functions ();
+
+  if (custom_realloc != NULL)
+    return (* custom_realloc) (memory, bytes);
+
+  return realloc (memory, bytes);
+}
+
+static inline void
+call_free (void *memory)
+{
+  if (custom_free != NULL)
+    (* custom_free) (memory);
+  else
+    free (memory);
+}
+
 /** @} */ /* End of internals docs */
 
 
@@ -447,6 +514,58 @@ set_guards (void       *real_block,
  * @{
  */
 
+/**
+ * Replaces the functions that dbus_malloc(), dbus_malloc0(),
+ * dbus_realloc() and dbus_free() use to get memory, which are
+ * malloc(), realloc() and free() from the C library by default.
+ * For example, an application can use this to put all libdbus
+ * allocations in its own arena, or to account for them.
+ *
+ * This must be called before libdbus allocates any memory, which
+ * means before calling any other libdbus function, and before any
+ * other thread can be using libdbus. Otherwise it fails and returns
+ * #FALSE, because memory from the old functions would later be given
+ * to the new ones. It also fails if custom functions have already
+ * been set. Once set, the functions are used for the rest of the
+ * process lifetime, including after dbus_shutdown().
+ *
+ * The functions must behave like their C library equivalents,
+ * except that they are never called with a size of zero, and
+ * @p free_function is never called with #NULL. dbus_malloc0()
+ * clears memory from @p malloc_function itself.
+ *
+ * @param malloc_function replacement for malloc()
+ * @param realloc_function replacement for realloc()
+ * @param free_function replacement for free()
+ * @returns #TRUE if the functions were set
+ */
+dbus_bool_t
+dbus_set_memory_functions (DBusMallocFunction  malloc_function,
+                           DBusReallocFunction realloc_function,
+                           DBusFreeFunction    free_function)
+{
+  dbus_bool_t ret = FALSE;
+
+  _dbus_return_val_if_fail (malloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (realloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (free_function != NULL, FALSE);
+
+  _dbus_threads_lock_platform_specific ();
+
+  if (!memory_functions_frozen)
+    {
+      custom_malloc = malloc_function;
+      custom_realloc = realloc_function;
+      custom_free = free_function;
+      memory_functions_frozen = TRUE;
+      ret = TRUE;
+    }
+
+  _dbus_threads_unlock_platform_specific ();
+
+  return ret;
+}
+
 /**
  * Allocates the given number of bytes, as with standard
  * malloc(). Guaranteed to return #NULL if bytes is zero
@@ -481,7 +600,7 @@ dbus_malloc (size_t bytes)
     {
       void *block;
 
-      block = malloc (bytes + GUARD_EXTRA_SIZE);
+      block = call_malloc (bytes + GUARD_EXTRA_SIZE);
       if (block)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
@@ -499,7 +618,7 @@ dbus_malloc (size_t bytes)
   else
     {
       void *mem;
-      mem = malloc (bytes);
+      mem = call_malloc (bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem)
@@ -552,7 +671,7 @@ dbus_malloc0 (size_t bytes)
     {
       void *block;
 
-      block = calloc (bytes + GUARD_EXTRA_SIZE, 1);
+      block = call_calloc (bytes + GUARD_EXTRA_SIZE);
 
       if (block)
         {
@@ -571,7 +690,7 @@ dbus_malloc0 (size_t bytes)
   else
     {
       void *mem;
-      mem = calloc (bytes, 1);
+      mem = call_calloc (bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem)
@@ -631,8 +750,8 @@ dbus_realloc (void  *memory,
           
           check_guards (memory, FALSE);
           
-          block = realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
-                           bytes + GUARD_EXTRA_SIZE);
+          block = call_realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
+                                bytes + GUARD_EXTRA_SIZE);
 
           if (block == NULL)
             {
@@ -657,7 +776,7 @@ dbus_realloc (void  *memory,
         {
           void *block;
           
-          block = malloc (bytes + GUARD_EXTRA_SIZE);
+          block = call_malloc (bytes + GUARD_EXTRA_SIZE);
 
           if (block)
             {
@@ -677,7 +796,7 @@ dbus_realloc (void  *memory,
   else
     {
       void *mem;
-      mem = realloc (memory, bytes);
+      mem = call_realloc (memory, bytes);
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
       if (mem == NULL && malloc_cannot_fail)
@@ -717,7 +836,7 @@ dbus_free (void  *memory)
           _dbus_assert (old_value >= 1);
 #endif
 
-          free (((unsigned char*)memory) - GUARD_START_OFFSET);
+          call_free (((unsigned char*)memory) - GUARD_START_OFFSET);
         }
       
       return;
@@ -737,7 +856,7 @@ dbus_free (void  *memory)
 #endif
 #endif
 
-      free (memory);
+      call_free (memory);
     }
 }
 
@@ -955,6 +1074,11 @@ _dbus_memory_test (void)
     }
   dbus_free (p);
   guards = old_guards;
+
+  /* too late to change allocator now that we have allocated */
+  if (dbus_set_memory_functions (malloc, realloc, free))
+    _dbus_test_fatal ("replaced the allocator after first use");
+
   return TRUE;
 }
 
@@ -28,6 +28,7 @@
 #define DBUS_MEMORY_H
 
 #include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
 #include <stddef.h>
 
 DBUS_BEGIN_DECLS
@@ -62,6 +63,14 @@ DBUS_EXPORT
 void dbus_free_string_array (char **str_array);
 
 typedef void (* DBusFreeFunction) (void *memory);
+typedef void *(* DBusMallocFunction) (size_t bytes);
+typedef void *(* DBusReallocFunction) (void   *memory,
+                                       size_t  bytes);
+
+DBUS_EXPORT
+dbus_bool_t dbus_set_memory_functions (DBusMallocFunction  malloc_function,
+                                       DBusReallocFunction realloc_function,
+                                       DBusFreeFunction    free_function);
 
 DBUS_EXPORT
 void dbus_shutdown (void);
@@ -25,6 +25,7 @@
 #include "dbus-mempool.h"
 #include "dbus-internals.h"
 #include "dbus-valgrind-internal.h"
+#include <dbus/dbus-test-tap.h>
 
 /**
  * @defgroup DBusMemPool memory pools
@@ -405,6 +406,71 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
     }
 }
 
+/**
+ * Allocates several objects from the memory pool at once. Either
+ * all of them are allocated or, on failure, none of them are.
+ * Each object must be freed with _dbus_mem_pool_dealloc() or
+ * _dbus_mem_pool_dealloc_n().
+ *
+ * Like the rest of DBusMemPool, this does no locking; a pool shared
+ * between threads must be protected by its owner, as the one in
+ * dbus-list.c is.
+ *
+ * @param pool the memory pool
+ * @param n_elements number of objects to allocate
+ * @param elements array of at least n_elements pointers to fill in
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_mem_pool_alloc_n (DBusMemPool  *pool,
+                        int           n_elements,
+                        void        **elements)
+{
+  int i;
+
+  _dbus_assert (n_elements >= 0);
+
+  for (i = 0; i < n_elements; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+
+      if (elements[i] == NULL)
+        {
+          /* give back what we have so far; the pool can't become
+           * empty here unless it was empty when we were called */
+          _dbus_mem_pool_dealloc_n (pool, i, elements);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * Deallocates several objects previously created with
+ * _dbus_mem_pool_alloc() or _dbus_mem_pool_alloc_n(). They
+ * must all have come from this same pool.
+ *
+ * @param pool the memory pool
+ * @param n_elements number of objects to free
+ * @param elements array of n_elements objects
+ * @returns #TRUE if there are no remaining allocated elements
+ */
+dbus_bool_t
+_dbus_mem_pool_dealloc_n (DBusMemPool  *pool,
+                          int           n_elements,
+                          void        **elements)
+{
+  int i;
+
+  _dbus_assert (n_elements >= 0);
+
+  for (i = 0; i < n_elements; i++)
+    _dbus_mem_pool_dealloc (pool, elements[i]);
+
+  return pool->allocated_elements == 0;
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_mem_pool_get_stats (DBusMemPool   *pool,
@@ -623,6 +689,43 @@ time_for_size (int size)
 #endif
 }
 
+static void
+check_batches (int size)
+{
+#define BATCH_SIZE 37
+  void *batch[BATCH_SIZE];
+  DBusMemPool *pool;
+  int i;
+
+  pool = _dbus_mem_pool_new (size, TRUE);
+  _dbus_assert (pool != NULL);
+
+  for (i = 0; i < 4; i++)
+    {
+      int j;
+
+      if (!_dbus_mem_pool_alloc_n (pool, BATCH_SIZE, batch))
+        _dbus_test_fatal ("could not allocate a batch of %d", BATCH_SIZE);
+
+      for (j = 0; j < BATCH_SIZE; j++)
+        {
+          _dbus_assert (batch[j] != NULL);
+          _dbus_assert (j == 0 || batch[j] != batch[j - 1]);
+          _dbus_assert (((unsigned char *) batch[j])[0] == '\0');
+          memset (batch[j], 'x', size);
+        }
+
+      /* the last batch empties the pool */
+      _dbus_assert (_dbus_mem_pool_dealloc_n (pool, BATCH_SIZE, batch));
+    }
+
+  _dbus_assert (_dbus_mem_pool_alloc_n (pool, 0, batch));
+  _dbus_assert (_dbus_mem_pool_dealloc_n (pool, 0, batch));
+
+  _dbus_mem_pool_free (pool);
+#undef BATCH_SIZE
+}
+
 /**
  * @ingroup DBusMemPoolInternals
  * Unit test for DBusMemPool
@@ -638,6 +741,7 @@ _dbus_mem_pool_test (void)
   while (i < _DBUS_N_ELEMENTS (element_sizes))
     {
       time_for_size (element_sizes[i]);
+      check_batches (element_sizes[i]);
       ++i;
     }
   
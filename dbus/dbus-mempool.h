@@ -42,8 +42,17 @@ void*        _dbus_mem_pool_alloc   (DBusMemPool *pool);
 DBUS_PRIVATE_EXPORT
 dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
                                      void        *element);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t  _dbus_mem_pool_alloc_n   (DBusMemPool  *pool,
+                                       int           n_elements,
+                                       void        **elements);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t  _dbus_mem_pool_dealloc_n (DBusMemPool  *pool,
+                                       int           n_elements,
+                                       void        **elements);
 
 /* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
 void         _dbus_mem_pool_get_stats (DBusMemPool   *pool,
                                        dbus_uint32_t *in_use_p,
                                        dbus_uint32_t *in_free_list_p,
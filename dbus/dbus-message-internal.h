@@ -47,6 +47,7 @@ void _dbus_message_trace_ref (DBusMessage *message,
 
 typedef struct DBusMessageLoader DBusMessageLoader;
 
+DBUS_PRIVATE_EXPORT
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
 				      const DBusString **body);
@@ -56,8 +57,12 @@ void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       unsigned *n_fds);
 
 unsigned int _dbus_message_get_n_unix_fds       (DBusMessage  *message);
+DBUS_PRIVATE_EXPORT
+int         _dbus_message_get_size              (DBusMessage  *message);
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
+void        _dbus_message_compact               (DBusMessage  *message);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_message_add_counter           (DBusMessage  *message,
                                                  DBusCounter  *counter);
 void        _dbus_message_add_counter_link      (DBusMessage  *message,
@@ -65,7 +70,20 @@ void        _dbus_message_add_counter_link      (DBusMessage  *message,
 void        _dbus_message_remove_counter        (DBusMessage  *message,
                                                  DBusCounter  *counter);
 DBUS_PRIVATE_EXPORT
+void        _dbus_message_cache_flush           (void);
+DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_message_remove_unknown_fields (DBusMessage  *message);
+DBUS_PRIVATE_EXPORT
+DBusMessage *_dbus_message_copy_header          (DBusMessage  *message);
+DBUS_PRIVATE_EXPORT
+char         _dbus_message_get_byte_order       (DBusMessage  *message);
+DBUS_PRIVATE_EXPORT
+DBusMessage *_dbus_message_copy_in_byte_order   (DBusMessage  *message,
+                                                 char          byte_order);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t  _dbus_message_iter_init_at_arg     (DBusMessage     *message,
+                                                 int              n,
+                                                 DBusMessageIter *iter);
 
 DBUS_PRIVATE_EXPORT
 DBusMessageLoader* _dbus_message_loader_new                   (void);
@@ -117,7 +135,11 @@ long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader
 void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoader  *loader,
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
+void               _dbus_message_loader_set_trust_bodies      (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         trust);
+dbus_bool_t        _dbus_message_loader_get_trust_bodies      (DBusMessageLoader  *loader);
 int                _dbus_message_loader_get_pending_fds_count (DBusMessageLoader  *loader);
+dbus_bool_t        _dbus_message_loader_is_empty      (DBusMessageLoader  *loader);
 void               _dbus_message_loader_set_pending_fds_function (DBusMessageLoader *loader,
                                                                   void (* callback) (void *),
                                                                   void *data);
@@ -143,6 +165,17 @@ _dbus_clear_variant (DBusVariant **variant_p)
   _dbus_clear_pointer_impl (DBusVariant, variant_p, _dbus_variant_free);
 }
 
+/* if DBUS_ENABLE_STATS */
+DBUS_PRIVATE_EXPORT
+void               _dbus_message_get_cache_stats (dbus_uint32_t *hits_p,
+                                                  dbus_uint32_t *misses_p,
+                                                  dbus_uint32_t *cached_p);
+DBUS_PRIVATE_EXPORT
+dbus_uint32_t      _dbus_message_get_n_live      (void);
+DBUS_PRIVATE_EXPORT
+dbus_int64_t       _dbus_message_get_received_usec (DBusMessage *message);
+dbus_int64_t       _dbus_message_get_locked_usec   (DBusMessage *message);
+
 typedef struct DBusInitialFDs DBusInitialFDs;
 DBusInitialFDs *_dbus_check_fdleaks_enter (void);
 void            _dbus_check_fdleaks_leave (DBusInitialFDs *fds);
@@ -28,6 +28,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-dataslot.h>
 #include <dbus/dbus-marshal-header.h>
+#include <dbus/dbus-marshal-validate.h>
 
 DBUS_BEGIN_DECLS
 
@@ -74,6 +75,10 @@ struct DBusMessageLoader
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
+  unsigned int trust_bodies : 1; /**< Skip body validation, the peer is trusted */
+
+  unsigned int partial_header_checked : 1; /**< The header of the incomplete message at the end of data is known to be valid */
+
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
@@ -104,6 +109,11 @@ struct DBusMessage
 
   DBusString body;   /**< Body network data. */
 
+  DBusMessage *body_owner; /**< If not #NULL, body is a constant string borrowing this message's body */
+  int n_body_borrowers; /**< How many copies borrow our body; protected by the message_bodies lock */
+
+  DBusBodyIndex body_index; /**< Where the first arguments start, if the body was validated on receipt */
+
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
 #ifndef DBUS_DISABLE_CHECKS
@@ -131,6 +141,11 @@ struct DBusMessage
 
   long unix_fd_counter_delta; /**< Size we incremented the unix fd counter by */
 #endif
+
+#ifdef DBUS_ENABLE_STATS
+  dbus_int64_t received_usec; /**< Monotonic time the message was loaded, or 0 */
+  dbus_int64_t locked_usec;   /**< Monotonic time the message was first locked, or 0 */
+#endif
 };
 
 DBUS_PRIVATE_EXPORT
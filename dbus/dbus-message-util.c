@@ -26,12 +26,17 @@
 #include "dbus-internals.h"
 #include "dbus-test.h"
 #include "dbus-message-private.h"
+#include "dbus-marshal-byteswap.h"
 #include "dbus-marshal-recursive.h"
+#include "dbus-signature.h"
 #include "dbus-string.h"
+#define DBUS_CAN_USE_DBUS_STRING_PRIVATE 1
+#include "dbus-string-private.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
 #endif
 #include <dbus/dbus-test-tap.h>
+#include <stddef.h>
 
 #ifdef __linux__
 /* Necessary for the Linux-specific fd leak checking code only */
@@ -1170,6 +1175,679 @@ verify_test_message_memleak (DBusMessage *message)
   _dbus_check_fdleaks_leave (initial_fds);
 }
 
+static DBusMessageLoader *
+load_with_trust (const char  *marshalled,
+                 int          len,
+                 dbus_bool_t  trust)
+{
+  DBusMessageLoader *loader;
+  DBusString *buffer;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_test_fatal ("no memory for loader");
+
+  _dbus_message_loader_set_trust_bodies (loader, trust);
+  _dbus_assert (_dbus_message_loader_get_trust_bodies (loader) == trust);
+
+  _dbus_message_loader_get_buffer (loader, &buffer, NULL, NULL);
+  if (!_dbus_string_append_len (buffer, marshalled, len))
+    _dbus_test_fatal ("no memory for loader buffer");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_test_fatal ("no memory to queue messages");
+
+  return loader;
+}
+
+/* A body that fails validation is only let through if the loader
+ * was told to trust bodies; a bad header is always rejected.
+ */
+static void
+check_trusted_bodies (void)
+{
+  DBusMessage *message;
+  DBusMessageLoader *loader;
+  dbus_bool_t v_BOOLEAN = TRUE;
+  char *marshalled;
+  int len;
+
+  message = dbus_message_new_signal ("/", "com.example.Trust", "Test");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for message");
+
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_test_fatal ("failed to marshal message");
+
+  dbus_message_unref (message);
+
+  /* the boolean is the last thing in the body; make it 2 */
+  _dbus_assert (len >= 4);
+  marshalled[len - 4] = marshalled[len - 1] = 0;
+  marshalled[len - 4 + (marshalled[0] == DBUS_LITTLE_ENDIAN ? 0 : 3)] = 2;
+
+  loader = load_with_trust (marshalled, len, FALSE);
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_assert (_dbus_message_loader_get_corruption_reason (loader) ==
+                DBUS_INVALID_BOOLEAN_NOT_ZERO_OR_ONE);
+  _dbus_message_loader_unref (loader);
+
+  loader = load_with_trust (marshalled, len, TRUE);
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  dbus_message_unref (message);
+  _dbus_message_loader_unref (loader);
+
+  /* a bad protocol version is a header error */
+  marshalled[3] = DBUS_MAJOR_PROTOCOL_VERSION + 1;
+  loader = load_with_trust (marshalled, len, TRUE);
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_message_loader_unref (loader);
+
+  dbus_free (marshalled);
+}
+
+/* Feeds a message to a loader in two parts, checking whether the
+ * loader already gave up on it after the first part.
+ */
+static void
+check_partial_message (const char  *marshalled,
+                       int          len,
+                       int          first_part,
+                       dbus_bool_t  valid)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString *buffer;
+
+  loader = load_with_trust (marshalled, first_part, FALSE);
+  _dbus_assert (_dbus_message_loader_peek_message (loader) == NULL);
+
+  if (!valid)
+    {
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+      _dbus_assert (_dbus_message_loader_get_corruption_reason (loader) ==
+                    DBUS_INVALID_BAD_SERIAL);
+      _dbus_message_loader_unref (loader);
+      return;
+    }
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  _dbus_message_loader_get_buffer (loader, &buffer, NULL, NULL);
+  if (!_dbus_string_append_len (buffer, marshalled + first_part,
+                                len - first_part))
+    _dbus_test_fatal ("no memory for loader buffer");
+  _dbus_message_loader_return_buffer (loader, buffer);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_test_fatal ("no memory to queue messages");
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  dbus_message_unref (message);
+  _dbus_message_loader_unref (loader);
+}
+
+/* A bad header is noticed as soon as it has arrived, without waiting
+ * for the body.
+ */
+static void
+check_partial_header (void)
+{
+  DBusMessage *message;
+  char *big;
+  char *marshalled;
+  int len;
+
+  big = dbus_malloc (10000);
+  if (big == NULL)
+    _dbus_test_fatal ("no memory for string");
+
+  memset (big, 'x', 9999);
+  big[9999] = '\0';
+
+  message = dbus_message_new_signal ("/", "com.example.Partial", "Test");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &big,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for message");
+
+  dbus_free (big);
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_test_fatal ("failed to marshal message");
+
+  dbus_message_unref (message);
+
+  /* not even the whole header yet, then the header and part of the body */
+  check_partial_message (marshalled, len, DBUS_MINIMUM_HEADER_SIZE + 8, TRUE);
+  check_partial_message (marshalled, len, len - 5000, TRUE);
+
+  /* a serial of 0 is only found by validating the header */
+  memset (marshalled + 8, 0, 4);
+  check_partial_message (marshalled, len, len - 5000, FALSE);
+
+  dbus_free (marshalled);
+}
+
+static void
+check_reserve_fixed_array (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array;
+  unsigned char v_BYTE = 42;
+  dbus_int32_t *reserved;
+  const dbus_int32_t *got;
+  int n_got;
+  int i;
+
+  message = dbus_message_new_signal ("/", "com.example.Reserve", "Test");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  /* a leading byte makes the elements need alignment padding */
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for byte");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_INT32_AS_STRING, &array) ||
+      !dbus_message_iter_reserve_fixed_array (&array, DBUS_TYPE_INT32,
+                                              100, &reserved))
+    _dbus_test_fatal ("no memory for array");
+
+  for (i = 0; i < 100; i++)
+    {
+      _dbus_assert (reserved[i] == 0);
+      reserved[i] = i * 3;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    _dbus_test_fatal ("no memory to close array");
+
+  _dbus_assert (strcmp (dbus_message_get_signature (message), "yai") == 0);
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array);
+  dbus_message_iter_get_fixed_array (&array, &got, &n_got);
+
+  _dbus_assert (n_got == 100);
+
+  for (i = 0; i < n_got; i++)
+    _dbus_assert (got[i] == i * 3);
+
+  dbus_message_unref (message);
+}
+
+typedef struct
+{
+  dbus_uint64_t t;
+  double d;
+  dbus_bool_t b;
+  unsigned char y;
+} FixedStructSample;
+
+static void
+check_fixed_struct_array_in_order (DBusMessage *message)
+{
+  static const int offsets[] = {
+    offsetof (FixedStructSample, y),
+    offsetof (FixedStructSample, b),
+    offsetof (FixedStructSample, t),
+    offsetof (FixedStructSample, d)
+  };
+  FixedStructSample got[60];
+  DBusMessageIter iter, array, s;
+  dbus_bool_t b;
+  int n;
+  int i;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_next (&iter);
+  _dbus_assert (dbus_message_iter_get_element_count (&iter) == 50);
+  dbus_message_iter_recurse (&iter, &array);
+
+  /* a limit smaller than the array */
+  memset (got, 0, sizeof (got));
+  n = dbus_message_iter_get_fixed_struct_array (&array, got,
+                                                sizeof (FixedStructSample),
+                                                offsets, 10);
+  _dbus_assert (n == 10);
+  _dbus_assert (got[10].t == 0);
+
+  /* from part way through, to the end */
+  dbus_message_iter_next (&array);
+  dbus_message_iter_next (&array);
+  n = dbus_message_iter_get_fixed_struct_array (&array, got,
+                                                sizeof (FixedStructSample),
+                                                offsets, 60);
+  _dbus_assert (n == 48);
+
+  for (i = 0; i < n; i++)
+    {
+      int j = i + 2;
+
+      _dbus_assert (got[i].y == (unsigned char) j);
+      _dbus_assert (got[i].b == (j & 1));
+      _dbus_assert (got[i].t == ((dbus_uint64_t) j << 40) + j);
+      _dbus_assert (got[i].d == j / 4.0);
+    }
+
+  /* the same as reading the fields one by one */
+  dbus_message_iter_recurse (&array, &s);
+  dbus_message_iter_next (&s);
+  dbus_message_iter_get_basic (&s, &b);
+  _dbus_assert (b == got[0].b);
+
+  /* nothing is left at the end of the array */
+  while (dbus_message_iter_next (&array))
+    ;
+
+  _dbus_assert (dbus_message_iter_get_fixed_struct_array (&array, got,
+                                                          sizeof (FixedStructSample),
+                                                          offsets, 60) == 0);
+}
+
+static void
+check_fixed_struct_array (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array, s;
+  DBusString signature;
+  unsigned char v_BYTE = 42;
+  int i;
+
+  message = dbus_message_new_signal ("/", "com.example.FixedStruct", "Test");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  /* a leading byte makes the array need alignment padding */
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for byte");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "(ybtd)", &array))
+    _dbus_test_fatal ("no memory for array");
+
+  for (i = 0; i < 50; i++)
+    {
+      unsigned char y = i;
+      dbus_bool_t b = i & 1;
+      dbus_uint64_t t = ((dbus_uint64_t) i << 40) + i;
+      double d = i / 4.0;
+
+      if (!dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT,
+                                             NULL, &s) ||
+          !dbus_message_iter_append_basic (&s, DBUS_TYPE_BYTE, &y) ||
+          !dbus_message_iter_append_basic (&s, DBUS_TYPE_BOOLEAN, &b) ||
+          !dbus_message_iter_append_basic (&s, DBUS_TYPE_UINT64, &t) ||
+          !dbus_message_iter_append_basic (&s, DBUS_TYPE_DOUBLE, &d) ||
+          !dbus_message_iter_close_container (&array, &s))
+        _dbus_test_fatal ("no memory for struct");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    _dbus_test_fatal ("no memory to close array");
+
+  check_fixed_struct_array_in_order (message);
+
+  /* and again as if it had come from a peer of the other endianness */
+  _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+  _dbus_marshal_byteswap (&signature, 0, DBUS_COMPILER_BYTE_ORDER,
+                          DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+                          DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN,
+                          &message->body, 0);
+  _dbus_header_byteswap (&message->header,
+                         DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+                         DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+  check_fixed_struct_array_in_order (message);
+
+  dbus_message_unref (message);
+}
+
+/* A copy of a locked message borrows its body until it is appended to */
+static void
+check_copy_shares_body (void)
+{
+  DBusMessage *message, *copy, *copy2;
+  DBusMessageIter iter;
+  dbus_uint32_t v_UINT32 = 0xdeadbeef;
+  const char *got;
+  char *big;
+  int len;
+
+  message = dbus_message_new_signal ("/", "com.example.CopyOnWrite", "Test");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  big = dbus_malloc (10000);
+  if (big == NULL)
+    _dbus_test_fatal ("no memory for string");
+
+  memset (big, 'x', 9999);
+  big[9999] = '\0';
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &big,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for string");
+
+  dbus_free (big);
+  len = _dbus_string_get_length (&message->body);
+
+  /* an unlocked message might still change, so it is copied */
+  copy = dbus_message_copy (message);
+  if (copy == NULL)
+    _dbus_test_fatal ("no memory for copy");
+
+  _dbus_assert (copy->body_owner == NULL);
+  dbus_message_unref (copy);
+
+  dbus_message_lock (message);
+  copy = dbus_message_copy (message);
+  if (copy == NULL)
+    _dbus_test_fatal ("no memory for copy");
+
+  _dbus_assert (copy->body_owner == message);
+  _dbus_assert (message->n_body_borrowers == 1);
+  _dbus_assert (_dbus_string_get_const_data (&copy->body) ==
+                _dbus_string_get_const_data (&message->body));
+
+  /* changing the header leaves the body shared */
+  if (!dbus_message_set_destination (copy, "com.example.Elsewhere"))
+    _dbus_test_fatal ("no memory for destination");
+
+  _dbus_assert (copy->body_owner == message);
+
+  /* copying the copy borrows from the original too */
+  dbus_message_lock (copy);
+  copy2 = dbus_message_copy (copy);
+  if (copy2 == NULL)
+    _dbus_test_fatal ("no memory for copy");
+
+  _dbus_assert (copy2->body_owner == message);
+  _dbus_assert (message->n_body_borrowers == 2);
+  dbus_message_unref (copy);
+
+  /* the body outlives the message it came from */
+  dbus_message_unref (message);
+  _dbus_assert (message->n_body_borrowers == 1);
+
+  /* appending takes a private copy of the body first */
+  dbus_message_iter_init_append (copy2, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &v_UINT32))
+    _dbus_test_fatal ("no memory to append");
+
+  _dbus_assert (copy2->body_owner == NULL);
+  _dbus_assert (_dbus_string_get_length (&copy2->body) == len + 4);
+
+  if (!dbus_message_get_args (copy2, NULL,
+                              DBUS_TYPE_STRING, &got,
+                              DBUS_TYPE_UINT32, &v_UINT32,
+                              DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("failed to get arguments back");
+
+  _dbus_assert (strlen (got) == 9999);
+  _dbus_assert (v_UINT32 == 0xdeadbeef);
+  dbus_message_unref (copy2);
+}
+
+/* Each indexed argument is where walking the body would have found it */
+static void
+check_body_index_of (DBusMessage *built,
+                     int          n_args)
+{
+  DBusMessage *message;
+  DBusMessageIter walked, jumped;
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_uint32_t v_UINT32 = 0;
+  char *marshalled;
+  int len, n;
+
+  /* a message we built has no index */
+  _dbus_assert (!_dbus_message_iter_init_at_arg (built, 0, &jumped));
+
+  dbus_message_set_serial (built, 1);
+
+  if (!dbus_message_marshal (built, &marshalled, &len))
+    _dbus_test_fatal ("no memory to marshal");
+
+  message = dbus_message_demarshal (marshalled, len, &error);
+  if (message == NULL)
+    _dbus_test_fatal ("failed to demarshal: %s", error.message);
+
+  dbus_free (marshalled);
+  dbus_message_iter_init (message, &walked);
+
+  for (n = 0; n <= n_args; n++)
+    {
+      int type = dbus_message_iter_get_arg_type (&walked);
+
+      if (!_dbus_message_iter_init_at_arg (message, n, &jumped))
+        {
+          _dbus_assert (n >= DBUS_BODY_INDEX_MAX_ARGS);
+          dbus_message_iter_next (&walked);
+          continue;
+        }
+
+      _dbus_assert (n <= DBUS_BODY_INDEX_MAX_ARGS);
+      _dbus_assert (dbus_message_iter_get_arg_type (&jumped) == type);
+
+      if (type == DBUS_TYPE_STRING)
+        {
+          const char *a, *b;
+
+          dbus_message_iter_get_basic (&walked, &a);
+          dbus_message_iter_get_basic (&jumped, &b);
+          _dbus_assert (a == b);
+        }
+      else if (dbus_type_is_basic (type))
+        {
+          DBusBasicValue a, b;
+
+          memset (&a, 0, sizeof (a));
+          memset (&b, 0, sizeof (b));
+          dbus_message_iter_get_basic (&walked, &a);
+          dbus_message_iter_get_basic (&jumped, &b);
+          _dbus_assert (memcmp (&a, &b, sizeof (a)) == 0);
+        }
+
+      dbus_message_iter_next (&walked);
+    }
+
+  /* appending moves the end of the body */
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory to append");
+
+  _dbus_assert (!_dbus_message_iter_init_at_arg (message, 0, &jumped));
+  dbus_message_unref (message);
+}
+
+static void
+check_body_index (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, sub;
+  const char *strings[] = { "a", "bc" };
+  const char **v_ARRAY = strings;
+  const char *v_STRING = "hello";
+  dbus_uint32_t v_UINT32 = 0xdeadbeef;
+  dbus_int64_t v_INT64 = -42;
+  double v_DOUBLE = 3.5;
+  unsigned char v_BYTE = 7;
+  int i;
+
+  /* flat, with fewer arguments than the index holds */
+  message = dbus_message_new_signal ("/", "com.example.Index", "Flat");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_BYTE, &v_BYTE,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &v_ARRAY, 2,
+                                 DBUS_TYPE_INT64, &v_INT64,
+                                 DBUS_TYPE_INVALID))
+    _dbus_test_fatal ("no memory for message");
+
+  check_body_index_of (message, 4);
+  dbus_message_unref (message);
+
+  /* with containers, and more arguments than the index holds */
+  message = dbus_message_new_signal ("/", "com.example.Index", "Nested");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  for (i = 0; i < DBUS_BODY_INDEX_MAX_ARGS; i++)
+    {
+      if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_BYTE, &v_BYTE) ||
+          !dbus_message_iter_open_container (&iter, DBUS_TYPE_VARIANT, "d",
+                                             &sub) ||
+          !dbus_message_iter_append_basic (&sub, DBUS_TYPE_DOUBLE, &v_DOUBLE) ||
+          !dbus_message_iter_close_container (&iter, &sub) ||
+          !dbus_message_iter_open_container (&iter, DBUS_TYPE_STRUCT, NULL,
+                                             &sub) ||
+          !dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING, &v_STRING) ||
+          !dbus_message_iter_close_container (&iter, &sub) ||
+          !dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &v_UINT32))
+        _dbus_test_fatal ("no memory to append");
+    }
+
+  check_body_index_of (message, 4 * DBUS_BODY_INDEX_MAX_ARGS);
+  dbus_message_unref (message);
+}
+
+static void
+check_compact (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusRealString *body;
+  char *big;
+  const char *got;
+
+  message = dbus_message_new_signal ("/", "com.example.Compact", "Test");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  big = dbus_malloc (1000);
+  if (big == NULL)
+    _dbus_test_fatal ("no memory for string");
+
+  memset (big, 'x', 999);
+  big[999] = '\0';
+
+  dbus_message_iter_init_append (message, &iter);
+
+  /* over-reserve, so there is plenty of slack to give back */
+  if (!dbus_message_iter_reserve (&iter, 100000) ||
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &big))
+    _dbus_test_fatal ("no memory to append string");
+
+  dbus_message_lock (message);
+
+  /* peek inside to check the slack is gone */
+  body = (DBusRealString *) &message->body;
+  _dbus_message_compact (message);
+  _dbus_assert (body->allocated < 2000);
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &got);
+  _dbus_assert (strcmp (got, big) == 0);
+
+  dbus_free (big);
+  dbus_message_unref (message);
+}
+
+static void
+check_reserve (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, dict, entry, variant;
+  const char *body_data;
+  const char *key = "Key";
+  dbus_uint32_t value;
+  int n_entries;
+
+  message = dbus_message_new_signal ("/", "com.example.Reserve", "Test");
+  if (message == NULL)
+    _dbus_test_fatal ("no memory for message");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  /* each entry is 4 + 4 bytes of key, 3 of signature, 1 of padding
+   * and 4 of value, so 24 is plenty */
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict) ||
+      !dbus_message_iter_reserve (&dict, 100 * 24))
+    _dbus_test_fatal ("no memory for dict");
+
+  /* peek inside to make sure appending does not reallocate */
+  body_data = _dbus_string_get_const_data (&message->body);
+
+  for (value = 0; value < 100; value++)
+    {
+      if (!dbus_message_iter_open_container (&dict, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry) ||
+          !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &key) ||
+          !dbus_message_iter_open_container (&entry, DBUS_TYPE_VARIANT,
+                                             DBUS_TYPE_UINT32_AS_STRING,
+                                             &variant) ||
+          !dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32,
+                                           &value) ||
+          !dbus_message_iter_close_container (&entry, &variant) ||
+          !dbus_message_iter_close_container (&dict, &entry))
+        _dbus_test_fatal ("no memory for entry");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict))
+    _dbus_test_fatal ("no memory to close dict");
+
+  if (_dbus_string_get_const_data (&message->body) != body_data)
+    _dbus_test_fatal ("body was reallocated despite the reservation");
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_recurse (&iter, &dict);
+  n_entries = 0;
+
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+      dbus_message_iter_get_basic (&variant, &value);
+      _dbus_assert (value == (dbus_uint32_t) n_entries);
+      n_entries++;
+      dbus_message_iter_next (&dict);
+    }
+
+  _dbus_assert (n_entries == 100);
+
+  dbus_message_unref (message);
+}
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1786,6 +2464,15 @@ _dbus_message_test (const char *test_data_dir)
     print_validities_seen (TRUE);
   }
 
+  check_trusted_bodies ();
+  check_partial_header ();
+  check_reserve_fixed_array ();
+  check_fixed_struct_array ();
+  check_reserve ();
+  check_compact ();
+  check_copy_shares_body ();
+  check_body_index ();
+
   check_memleaks ();
   _dbus_check_fdleaks_leave (initial_fds);
 
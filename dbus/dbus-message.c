@@ -31,6 +31,7 @@
 #include "dbus-signature.h"
 #include "dbus-message-private.h"
 #include "dbus-object-tree.h"
+#include "dbus-probes-internal.h"
 #include "dbus-memory.h"
 #include "dbus-list.h"
 #include "dbus-threads-internal.h"
@@ -179,34 +180,49 @@ get_const_signature (DBusHeader        *header,
 }
 
 /**
- * Swaps the message to compiler byte order if required
+ * Swaps the body and header of a message to the given byte order,
+ * which must not be the one it is in already.
  *
  * @param message the message
+ * @param new_byte_order the byte order to swap to
  */
 static void
-_dbus_message_byteswap (DBusMessage *message)
+swap_byte_order (DBusMessage *message,
+                 char         new_byte_order)
 {
   const DBusString *type_str;
   int type_pos;
   char byte_order;
 
   byte_order = _dbus_header_get_byte_order (&message->header);
+  _dbus_assert (byte_order != new_byte_order);
 
-  if (byte_order == DBUS_COMPILER_BYTE_ORDER)
-    return;
-
-  _dbus_verbose ("Swapping message into compiler byte order\n");
-  
   get_const_signature (&message->header, &type_str, &type_pos);
   
   _dbus_marshal_byteswap (type_str, type_pos,
                           byte_order,
-                          DBUS_COMPILER_BYTE_ORDER,
+                          new_byte_order,
                           &message->body, 0);
 
-  _dbus_header_byteswap (&message->header, DBUS_COMPILER_BYTE_ORDER);
+  _dbus_header_byteswap (&message->header, new_byte_order);
   _dbus_assert (_dbus_header_get_byte_order (&message->header) ==
-                DBUS_COMPILER_BYTE_ORDER);
+                new_byte_order);
+}
+
+/**
+ * Swaps the message to compiler byte order if required
+ *
+ * @param message the message
+ */
+static void
+_dbus_message_byteswap (DBusMessage *message)
+{
+  if (_dbus_header_get_byte_order (&message->header) == DBUS_COMPILER_BYTE_ORDER)
+    return;
+
+  _dbus_verbose ("Swapping message into compiler byte order\n");
+
+  swap_byte_order (message, DBUS_COMPILER_BYTE_ORDER);
 }
 
 /** byte-swap the message if it doesn't match our byte order.
@@ -238,6 +254,22 @@ _dbus_message_get_network_data (DBusMessage          *message,
   *body = &message->body;
 }
 
+/**
+ * Gets the number of bytes of header and body in the message, which is
+ * what counts towards the limits on how much a connection may queue.
+ * Unlike _dbus_message_get_network_data(), the message does not need
+ * to be locked.
+ *
+ * @param message the message
+ * @returns its size in bytes
+ */
+int
+_dbus_message_get_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body);
+}
+
 /**
  * Gets the unix fds to be sent over the network for this message.
  * This function is guaranteed to always return the same data once a
@@ -428,9 +460,96 @@ dbus_message_lock (DBusMessage  *message)
                     dbus_message_get_signature (message) != NULL);
 
       message->locked = TRUE;
+#ifdef DBUS_ENABLE_STATS
+      message->locked_usec = _dbus_get_monotonic_usec ();
+#endif
     }
 }
 
+/** Slack allowed in the strings of a message waiting in a queue */
+#define MAX_QUEUED_MESSAGE_WASTE 64
+
+/**
+ * Gives back to malloc any space that was allocated while building or
+ * loading the message but is not needed to hold it. This is worth
+ * doing for messages that may sit in an outgoing queue for a long time,
+ * since buffers grown by doubling, or taken over from the loader, can
+ * be much larger than the message. If there is no memory to shrink
+ * them, they are left as they are.
+ *
+ * @param message the message, which must be locked
+ */
+void
+_dbus_message_compact (DBusMessage *message)
+{
+  _dbus_assert (message->locked);
+
+  _dbus_string_compact (&message->header.data, MAX_QUEUED_MESSAGE_WASTE);
+
+  /* a borrowed body is a constant string, and a body lent to copies
+   * must stay where it is */
+  if (message->body_owner != NULL || !_DBUS_LOCK (message_bodies))
+    return;
+
+  if (message->n_body_borrowers == 0)
+    _dbus_string_compact (&message->body, MAX_QUEUED_MESSAGE_WASTE);
+
+  _DBUS_UNLOCK (message_bodies);
+}
+
+/*
+ * Stops borrowing the body of another message. The body string is left
+ * pointing at memory we no longer hold a reference to, so it must be
+ * replaced or be about to be freed.
+ */
+static void
+release_body_owner (DBusMessage *message)
+{
+  DBusMessage *owner = message->body_owner;
+
+  if (owner == NULL)
+    return;
+
+  message->body_owner = NULL;
+
+  if (_DBUS_LOCK (message_bodies))
+    {
+      _dbus_assert (owner->n_body_borrowers > 0);
+      owner->n_body_borrowers -= 1;
+      _DBUS_UNLOCK (message_bodies);
+    }
+
+  dbus_message_unref (owner);
+}
+
+/*
+ * Gives a copy made by dbus_message_copy() a body of its own, if it
+ * was borrowing the original's, so that it can be modified.
+ */
+static dbus_bool_t
+ensure_body_owned (DBusMessage *message)
+{
+  DBusString body;
+
+  if (_DBUS_LIKELY (message->body_owner == NULL))
+    return TRUE;
+
+  if (!_dbus_string_init (&body))
+    return FALSE;
+
+  if (!_dbus_string_copy (&message->body, 0, &body, 0))
+    {
+      _dbus_string_free (&body);
+      return FALSE;
+    }
+
+  /* iterators point at message->body, so replace its contents rather
+   * than moving it */
+  message->body = body;
+  release_body_owner (message);
+  return TRUE;
+}
+
 static dbus_bool_t
 set_or_delete_string_field (DBusMessage *message,
                             int          field,
@@ -492,16 +611,34 @@ set_or_delete_string_field (DBusMessage *message,
  * mempool).
  */
 
+/* Both limits can be overridden at build time, for instance with
+ * CFLAGS=-DDBUS_MESSAGE_CACHE_SIZE=16, by applications that allocate
+ * messages at a high rate. */
+
 /** Avoid caching huge messages */
+#ifdef DBUS_MESSAGE_CACHE_MAX_BYTES
+#define MAX_MESSAGE_SIZE_TO_CACHE DBUS_MESSAGE_CACHE_MAX_BYTES
+#else
 #define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
+#endif
 
 /** Avoid caching too many messages */
+#ifdef DBUS_MESSAGE_CACHE_SIZE
+#define MAX_MESSAGE_CACHE_SIZE    DBUS_MESSAGE_CACHE_SIZE
+#else
 #define MAX_MESSAGE_CACHE_SIZE    5
+#endif
 
 /* Protected by _DBUS_LOCK (message_cache) */
 static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
 static int message_cache_count = 0;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
+#ifdef DBUS_ENABLE_STATS
+static dbus_uint32_t message_cache_hits = 0;
+static dbus_uint32_t message_cache_misses = 0;
+/* messages handed out and not yet cached or finalized */
+static DBusAtomic n_live_messages = { 0 };
+#endif
 
 static void
 dbus_message_cache_shutdown (void *data)
@@ -553,6 +690,9 @@ dbus_message_get_cached (void)
 
   if (message_cache_count == 0)
     {
+#ifdef DBUS_ENABLE_STATS
+      message_cache_misses += 1;
+#endif
       _DBUS_UNLOCK (message_cache);
       return NULL;
     }
@@ -579,15 +719,107 @@ dbus_message_get_cached (void)
   _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
   _dbus_assert (message != NULL);
 
-  _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&message->refcount) == 0);
 
   _dbus_assert (message->counters == NULL);
-  
+
+#ifdef DBUS_ENABLE_STATS
+  message_cache_hits += 1;
+#endif
+
   _DBUS_UNLOCK (message_cache);
 
   return message;
 }
 
+/**
+ * Frees every message in the message cache, for example because the
+ * process is short of memory.
+ */
+void
+_dbus_message_cache_flush (void)
+{
+  int i;
+
+  if (!_DBUS_LOCK (message_cache))
+    return;
+
+  if (message_cache_shutdown_registered)
+    {
+      for (i = 0; i < MAX_MESSAGE_CACHE_SIZE; i++)
+        {
+          if (message_cache[i])
+            {
+              dbus_message_finalize (message_cache[i]);
+              message_cache[i] = NULL;
+            }
+        }
+
+      message_cache_count = 0;
+    }
+
+  _DBUS_UNLOCK (message_cache);
+}
+
+#ifdef DBUS_ENABLE_STATS
+void
+_dbus_message_get_cache_stats (dbus_uint32_t *hits_p,
+                               dbus_uint32_t *misses_p,
+                               dbus_uint32_t *cached_p)
+{
+  if (!_DBUS_LOCK (message_cache))
+    {
+      *hits_p = 0;
+      *misses_p = 0;
+      *cached_p = 0;
+      return;
+    }
+
+  *hits_p = message_cache_hits;
+  *misses_p = message_cache_misses;
+  *cached_p = message_cache_count;
+  _DBUS_UNLOCK (message_cache);
+}
+
+/**
+ * Gets the number of messages that currently exist in this process,
+ * not counting those in the message cache.
+ *
+ * @returns the number of messages
+ */
+dbus_uint32_t
+_dbus_message_get_n_live (void)
+{
+  return _dbus_atomic_get_relaxed (&n_live_messages);
+}
+
+/**
+ * Gets the monotonic time at which a message was loaded from a
+ * transport.
+ *
+ * @param message the message
+ * @returns the time in microseconds, or 0 if it was not loaded
+ */
+dbus_int64_t
+_dbus_message_get_received_usec (DBusMessage *message)
+{
+  return message->received_usec;
+}
+
+/**
+ * Gets the monotonic time at which a message was first locked, which
+ * for a message being sent is when it was first queued.
+ *
+ * @param message the message
+ * @returns the time in microseconds, or 0 if it was never locked
+ */
+dbus_int64_t
+_dbus_message_get_locked_usec (DBusMessage *message)
+{
+  return message->locked_usec;
+}
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
 static void
 close_unix_fds(int *fds, unsigned *n_fds)
@@ -642,7 +874,11 @@ dbus_message_cache_or_finalize (DBusMessage *message)
   dbus_bool_t was_cached;
   int i;
 
-  _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&message->refcount) == 0);
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_dec (&n_live_messages);
+#endif
 
   /* This calls application code and has to be done first thing
    * without holding the lock
@@ -694,6 +930,11 @@ dbus_message_cache_or_finalize (DBusMessage *message)
       MAX_MESSAGE_SIZE_TO_CACHE)
     goto out;
 
+  /* a borrowed body can't be reused, and the owner has to be released
+   * without the cache lock held */
+  if (message->body_owner != NULL)
+    goto out;
+
   if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
     goto out;
 
@@ -713,7 +954,7 @@ dbus_message_cache_or_finalize (DBusMessage *message)
 #endif
 
  out:
-  _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&message->refcount) == 0);
 
   _DBUS_UNLOCK (message_cache);
   
@@ -834,6 +1075,7 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
   va_list copy_args;
 
   _dbus_assert (_dbus_message_iter_check (real));
+  _dbus_assert (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER);
 
   retval = FALSE;
 
@@ -847,7 +1089,10 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
 
   while (spec_type != DBUS_TYPE_INVALID)
     {
-      msg_type = dbus_message_iter_get_arg_type (iter);
+      /* the iterator was checked on entry and is only advanced by us,
+       * so skip the public accessor's per-argument checks
+       */
+      msg_type = _dbus_type_reader_get_current_type (&real->u.reader);
 
       if (msg_type != spec_type)
         {
@@ -1212,7 +1457,7 @@ dbus_message_get_reply_serial  (DBusMessage *message)
 static void
 dbus_message_finalize (DBusMessage *message)
 {
-  _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&message->refcount) == 0);
 
   /* This calls application callbacks! */
   _dbus_data_slot_list_free (&message->slot_list);
@@ -1223,13 +1468,14 @@ dbus_message_finalize (DBusMessage *message)
 
   _dbus_header_free (&message->header);
   _dbus_string_free (&message->body);
+  release_body_owner (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
   dbus_free(message->unix_fds);
 #endif
 
-  _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (_dbus_atomic_get_relaxed (&message->refcount) == 0);
 
   dbus_free (message);
 }
@@ -1270,9 +1516,16 @@ dbus_message_new_empty_header (void)
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
+  message->body_owner = NULL;
+  message->n_body_borrowers = 0;
+  message->body_index.n_offsets = 0;
   message->counters = NULL;
   message->size_counter_delta = 0;
   message->changed_stamp = 0;
+#ifdef DBUS_ENABLE_STATS
+  message->received_usec = 0;
+  message->locked_usec = 0;
+#endif
 
 #ifdef HAVE_UNIX_FD_PASSING
   message->n_unix_fds = 0;
@@ -1304,6 +1557,10 @@ dbus_message_new_empty_header (void)
         }
     }
 
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_inc (&n_live_messages);
+#endif
+
   return message;
 }
 
@@ -1604,6 +1861,10 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
   return message;
 }
 
+/** Bodies shorter than this are copied by dbus_message_copy(); it's
+ * cheaper than sharing them, and lets the copy go to the message cache
+ */
+#define COPY_SHARE_MIN_BODY_LEN 2048
 
 /**
  * Creates a new message that is an exact replica of the message
@@ -1612,6 +1873,19 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
  * outgoing message queue and thus not modifiable) the new message
  * will not be locked.
  *
+ * Copying is also the cheap way to send many messages of the same
+ * shape: build a message with the path, interface, member and any
+ * other header fields once, keep it as a template without appending
+ * arguments, and copy it for each emission. The copy takes the
+ * already-marshalled header as-is (and a recycled message from the
+ * message cache when one is available), so only the arguments and
+ * the serial remain to be filled in.
+ *
+ * Copying a locked message with a large body doesn't copy the body:
+ * the new message shares it with the original until the new message
+ * is appended to, so copying a message only to change its header
+ * costs about as much as the header.
+ *
  * @todo This function can't be used in programs that try to recover from OOM errors.
  *
  * @param message the message
@@ -1621,39 +1895,50 @@ DBusMessage *
 dbus_message_copy (const DBusMessage *message)
 {
   DBusMessage *retval;
+  DBusMessage *owner;
 
   _dbus_return_val_if_fail (message != NULL, NULL);
 
-  retval = dbus_new0 (DBusMessage, 1);
+  retval = dbus_message_new_empty_header ();
   if (retval == NULL)
     return NULL;
 
-  _dbus_atomic_inc (&retval->refcount);
-
-  retval->locked = FALSE;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
 
   if (!_dbus_header_copy (&message->header, &retval->header))
-    {
-      dbus_free (retval);
-      return NULL;
-    }
+    goto failed_copy;
+
+  /* A locked message's body doesn't change any more, except that it
+   * might be byteswapped in place, so only native-endian ones are
+   * shared. Copies of a copy borrow from the same owner. */
+  owner = message->body_owner != NULL ?
+    message->body_owner : (DBusMessage *) message;
 
-  if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+  if (message->locked &&
+      _dbus_string_get_length (&message->body) >= COPY_SHARE_MIN_BODY_LEN &&
+      _dbus_header_get_byte_order (&message->header) == DBUS_COMPILER_BYTE_ORDER &&
+      _DBUS_LOCK (message_bodies))
     {
-      _dbus_header_free (&retval->header);
-      dbus_free (retval);
-      return NULL;
-    }
+      owner->n_body_borrowers += 1;
+      _DBUS_UNLOCK (message_bodies);
 
-  if (!_dbus_string_copy (&message->body, 0,
-			  &retval->body, 0))
+      _dbus_string_free (&retval->body);
+      _dbus_string_init_const_len (&retval->body,
+                                   _dbus_string_get_const_data (&message->body),
+                                   _dbus_string_get_length (&message->body));
+      retval->body_owner = dbus_message_ref (owner);
+    }
+  else if (!_dbus_string_copy (&message->body, 0,
+                               &retval->body, 0))
     goto failed_copy;
 
+  retval->body_index = message->body_index;
+
 #ifdef HAVE_UNIX_FD_PASSING
+  /* a recycled message may still have an fd array from its last use */
+  dbus_free (retval->unix_fds);
   retval->unix_fds = dbus_new(int, message->n_unix_fds);
   if (retval->unix_fds == NULL && message->n_unix_fds > 0)
     goto failed_copy;
@@ -1676,15 +1961,8 @@ dbus_message_copy (const DBusMessage *message)
   return retval;
 
  failed_copy:
-  _dbus_header_free (&retval->header);
-  _dbus_string_free (&retval->body);
-
-#ifdef HAVE_UNIX_FD_PASSING
-  close_unix_fds(retval->unix_fds, &retval->n_unix_fds);
-  dbus_free(retval->unix_fds);
-#endif
-
-  dbus_free (retval);
+  /* closes whatever fds were already duplicated */
+  dbus_message_unref (retval);
 
   return NULL;
 }
@@ -2491,6 +2769,115 @@ dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
                                       value, n_elements);
 }
 
+#ifndef DBUS_DISABLE_CHECKS
+/* Whether the struct at type_pos has only fixed-length basic fields
+ * other than unix fds, each of which fits within element_size at its
+ * offset */
+static dbus_bool_t
+struct_fits_fixed_layout (const DBusString *type_str,
+                          int               type_pos,
+                          int               element_size,
+                          const int        *field_offsets)
+{
+  const unsigned char *p;
+  int i;
+
+  p = _dbus_string_get_const_udata_len (type_str, type_pos, 0);
+
+  if (*p != DBUS_STRUCT_BEGIN_CHAR)
+    return FALSE;
+
+  for (i = 0, p++; *p != DBUS_STRUCT_END_CHAR; i++, p++)
+    {
+      if (!dbus_type_is_fixed (*p) || *p == DBUS_TYPE_UNIX_FD)
+        return FALSE;
+
+      if (field_offsets[i] < 0 ||
+          field_offsets[i] > element_size - _dbus_type_get_alignment (*p))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+#endif
+
+/**
+ * Reads the structs in an array of structs whose fields are all
+ * fixed-length basic types, such as "a(iiu)" or "a(dd)", into a C
+ * array, converting each field to host byte order on the way. This
+ * spares recursing into each struct and reading its fields one by one,
+ * which is slow for large arrays.
+ *
+ * As with dbus_message_iter_get_fixed_array(), the message iter should
+ * be "in" the array. The structs from the current position to the end
+ * of the array are read, up to max_elements of them, and the iterator
+ * is not moved. dbus_message_iter_get_element_count() on the array
+ * tells how large the C array must be to read them all.
+ *
+ * Since the layout of a C struct is up to the compiler, it is
+ * described by element_size, normally sizeof() the struct, and by
+ * field_offsets, which gives the offsetof() the member each field of
+ * the D-Bus struct is stored in, in signature order. Fields are stored
+ * as the same C types dbus_message_iter_get_basic() would use, so a
+ * BOOLEAN needs a #dbus_bool_t member. Nested structs and
+ * DBUS_TYPE_UNIX_FD fields are not supported.
+ *
+ * @code
+ * struct sample { dbus_int32_t x, y; dbus_uint32_t flags; };
+ * static const int offsets[] = {
+ *   offsetof (struct sample, x),
+ *   offsetof (struct sample, y),
+ *   offsetof (struct sample, flags)
+ * };
+ *
+ * n = dbus_message_iter_get_element_count (&iter);
+ * samples = malloc (n * sizeof (struct sample));
+ * dbus_message_iter_recurse (&iter, &array);
+ * n = dbus_message_iter_get_fixed_struct_array (&array, samples,
+ *                                               sizeof (struct sample),
+ *                                               offsets, n);
+ * @endcode
+ *
+ * @param iter the iterator, inside an array of structs
+ * @param elements where to store the structs
+ * @param element_size the size of one element of elements
+ * @param field_offsets the offset within an element of each field
+ * @param max_elements the most structs to store
+ * @returns the number of structs stored
+ */
+int
+dbus_message_iter_get_fixed_struct_array (DBusMessageIter *iter,
+                                          void            *elements,
+                                          int              element_size,
+                                          const int       *field_offsets,
+                                          int              max_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int subtype;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), 0);
+  _dbus_return_val_if_fail (elements != NULL || max_elements == 0, 0);
+  _dbus_return_val_if_fail (element_size > 0, 0);
+  _dbus_return_val_if_fail (field_offsets != NULL, 0);
+  _dbus_return_val_if_fail (max_elements >= 0, 0);
+
+  subtype = _dbus_type_reader_get_current_type (&real->u.reader);
+
+  if (subtype == DBUS_TYPE_INVALID)
+    return 0;
+
+  _dbus_return_val_if_fail (subtype == DBUS_TYPE_STRUCT, 0);
+  _dbus_return_val_if_fail (struct_fits_fixed_layout (real->u.reader.type_str,
+                                                      real->u.reader.type_pos,
+                                                      element_size,
+                                                      field_offsets), 0);
+
+  return _dbus_type_reader_read_fixed_struct_multi (&real->u.reader,
+                                                    elements, element_size,
+                                                    field_offsets,
+                                                    max_elements);
+}
+
 /**
  * Initializes a #DBusMessageIter for appending arguments to the end
  * of a message.
@@ -2548,6 +2935,12 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
       return TRUE;
     }
 
+  if (!ensure_body_owned (real->message))
+    return FALSE;
+
+  /* Appending moves the end of the body and signature */
+  real->message->body_index.n_offsets = 0;
+
   str = dbus_new (DBusString, 1);
   if (str == NULL)
     return FALSE;
@@ -2928,6 +3321,112 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
   return ret;
 }
 
+/**
+ * Like dbus_message_iter_append_fixed_array(), but instead of copying
+ * the elements from the caller's array, makes room for them in the
+ * message and returns a pointer to that room, so that large payloads
+ * can be produced directly into the message without an intermediate
+ * buffer and an extra copy.
+ *
+ * The elements are zero-initialized. They are in the native byte
+ * order of this machine and can be written through the returned
+ * pointer until anything else is appended to the message, or it is
+ * sent or locked, after which the pointer is no longer valid.
+ *
+ * Booleans are not supported, since only 0 and 1 would be valid
+ * values.
+ *
+ * @code
+ * unsigned char *frame;
+ *
+ * if (!dbus_message_iter_reserve_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+ *                                             frame_size, &frame))
+ *   oom ();
+ *
+ * read_frame_into (frame, frame_size);
+ * @endcode
+ *
+ * @param iter the append iterator
+ * @param element_type the type of the array elements
+ * @param n_elements the number of elements to make room for
+ * @param value return location for the address of the first element
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_reserve_fixed_array (DBusMessageIter *iter,
+                                       int              element_type,
+                                       int              n_elements,
+                                       void            *value)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int array_start;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) &&
+                            element_type != DBUS_TYPE_UNIX_FD &&
+                            element_type != DBUS_TYPE_BOOLEAN, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+  _dbus_return_val_if_fail (_dbus_header_get_byte_order (&real->message->header) ==
+                            DBUS_COMPILER_BYTE_ORDER, FALSE);
+
+  if (!_dbus_type_writer_reserve_fixed_multi (&real->u.writer, element_type,
+                                              n_elements, &array_start))
+    return FALSE;
+
+  _dbus_assert (array_start >= 0);
+
+  *(void **) value =
+    _dbus_string_get_data_len (&real->message->body, array_start,
+                               n_elements * _dbus_type_get_alignment (element_type));
+
+  return TRUE;
+}
+
+/**
+ * Tells the message that roughly @p n_bytes more of marshalled data
+ * are about to be appended through this iterator, so that the message
+ * body can be enlarged once up front instead of repeatedly as each
+ * item is appended. This helps when building large containers item by
+ * item, such as an a{sv} with many entries.
+ *
+ * The estimate does not have to be exact: appending less wastes the
+ * difference until the message is freed, and appending more is handled
+ * as usual. The contents of the message are not changed.
+ *
+ * @code
+ * if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+ *                                        &dict) ||
+ *     !dbus_message_iter_reserve (&dict, n_entries * 32))
+ *   oom ();
+ * @endcode
+ *
+ * @param iter the append iterator
+ * @param n_bytes how many bytes of data are expected to be appended
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_reserve (DBusMessageIter *iter,
+                           int              n_bytes)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes <= DBUS_MAXIMUM_MESSAGE_LENGTH, FALSE);
+
+  if (!ensure_body_owned (real->message))
+    return FALSE;
+
+  return _dbus_string_reserve (&real->message->body, n_bytes);
+}
+
 /**
  * Appends a container-typed value to the message. On success, you are
  * required to append the contents of the container using the returned
@@ -4077,6 +4576,137 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  * @{
  */
 
+/**
+ * Creates a new message with a copy of the header of the given
+ * message, including its serial, but no body. The signature and the
+ * number of file descriptors are removed from the copy's header, so
+ * that it is a valid message with no arguments.
+ *
+ * @param message the message
+ * @returns the new message, or #NULL if not enough memory
+ */
+DBusMessage *
+_dbus_message_copy_header (DBusMessage *message)
+{
+  DBusMessage *retval;
+
+  retval = dbus_message_new_empty_header ();
+  if (retval == NULL)
+    return NULL;
+
+#ifndef DBUS_DISABLE_CHECKS
+  retval->generation = message->generation;
+#endif
+
+  if (!_dbus_header_copy (&message->header, &retval->header) ||
+      !_dbus_header_delete_field (&retval->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE) ||
+      !_dbus_header_delete_field (&retval->header,
+                                  DBUS_HEADER_FIELD_UNIX_FDS))
+    {
+      dbus_message_unref (retval);
+      return NULL;
+    }
+
+  /* unlike dbus_message_copy(), keep the serial: this is the same
+   * message, not a new one to be sent */
+  _dbus_header_set_serial (&retval->header,
+                           _dbus_header_get_serial (&message->header));
+  _dbus_header_update_lengths (&retval->header, 0);
+
+  _dbus_message_trace_ref (retval, 0, 1, "copy_header");
+  return retval;
+}
+
+/**
+ * Gets the byte order a message is encoded in.
+ *
+ * @param message the message
+ * @returns #DBUS_LITTLE_ENDIAN or #DBUS_BIG_ENDIAN
+ */
+char
+_dbus_message_get_byte_order (DBusMessage *message)
+{
+  return _dbus_header_get_byte_order (&message->header);
+}
+
+/**
+ * Copies a message and re-encodes the copy in the given byte order,
+ * so that a recipient in that byte order need not swap it. Like
+ * _dbus_message_copy_header(), and unlike dbus_message_copy(), the
+ * copy keeps the serial: it is the same message in another encoding.
+ *
+ * @param message the message
+ * @param byte_order #DBUS_LITTLE_ENDIAN or #DBUS_BIG_ENDIAN
+ * @returns the copy, or #NULL if not enough memory
+ */
+DBusMessage *
+_dbus_message_copy_in_byte_order (DBusMessage *message,
+                                  char         byte_order)
+{
+  DBusMessage *retval;
+
+  retval = dbus_message_copy (message);
+  if (retval == NULL)
+    return NULL;
+
+  /* don't swap a body that is shared with the original */
+  if (!ensure_body_owned (retval))
+    {
+      dbus_message_unref (retval);
+      return NULL;
+    }
+
+  _dbus_header_set_serial (&retval->header,
+                           _dbus_header_get_serial (&message->header));
+
+  if (_dbus_header_get_byte_order (&retval->header) != byte_order)
+    swap_byte_order (retval, byte_order);
+
+  return retval;
+}
+
+/**
+ * Initializes a #DBusMessageIter for reading, like
+ * dbus_message_iter_init(), but positioned at argument n without
+ * walking over the ones before it. That is only possible if the body
+ * was validated when the message was received and n is among the
+ * first #DBUS_BODY_INDEX_MAX_ARGS arguments, or is the number of
+ * arguments; otherwise the iterator is not touched.
+ *
+ * @param message the message
+ * @param n the number of the argument, counting from 0
+ * @param iter pointer to an iterator to initialize
+ * @returns #FALSE if there is no index to find argument n with
+ */
+dbus_bool_t
+_dbus_message_iter_init_at_arg (DBusMessage     *message,
+                                int              n,
+                                DBusMessageIter *iter)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  const DBusString *type_str;
+  int type_pos;
+
+  _dbus_assert (n >= 0);
+
+  if (n >= message->body_index.n_offsets)
+    return FALSE;
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  _dbus_message_iter_init_common (message, real,
+                                  DBUS_MESSAGE_ITER_TYPE_READER);
+
+  _dbus_type_reader_init (&real->u.reader,
+                          _dbus_header_get_byte_order (&message->header),
+                          type_str,
+                          type_pos + message->body_index.type_offsets[n],
+                          &message->body,
+                          message->body_index.value_offsets[n]);
+  return TRUE;
+}
+
 /**
  * The initial buffer size of the message loader.
  *
@@ -4408,9 +5038,22 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  *
  * load_message() returns FALSE if not enough memory OR the loader was corrupted
  */
+/**
+ * Bodies at least this long are handed over from the loader's buffer
+ * instead of being copied, when they are the last thing buffered.
+ */
+#define LOADER_HANDOFF_MIN_BODY_LEN 2048
+
+/*
+ * Loads the message that starts *consumed_p bytes into the loader's
+ * buffer; on success, *consumed_p is advanced past it.  The caller
+ * deletes consumed bytes, so *consumed_p must be 8-aligned for the
+ * message to be aligned in memory like the validators expect.
+ */
 static dbus_bool_t
 load_message (DBusMessageLoader *loader,
               DBusMessage       *message,
+              int               *consumed_p,
               int                byte_order,
               int                fields_array_len,
               int                header_len,
@@ -4422,18 +5065,28 @@ load_message (DBusMessageLoader *loader,
   int type_pos;
   DBusValidationMode mode;
   dbus_uint32_t n_unix_fds = 0;
+  DBusString data;
+  int start;
 
   mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
   
   oom = FALSE;
 
+  start = *consumed_p;
+  _dbus_assert (_DBUS_ALIGN_VALUE (start, 8) == (unsigned) start);
+
+  /* everything below sees only this message and what follows it */
+  _dbus_string_init_const_len (&data,
+                               _dbus_string_get_const_data_len (&loader->data, start, 0),
+                               _dbus_string_get_length (&loader->data) - start);
+
 #if 0
-  _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
+  _dbus_verbose_bytes_of_string (&data, 0, header_len /* + body_len */);
 #endif
 
   /* 1. VALIDATE AND COPY OVER HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&data));
 
   if (!_dbus_header_load (&message->header,
                           mode,
@@ -4442,7 +5095,7 @@ load_message (DBusMessageLoader *loader,
                           fields_array_len,
                           header_len,
                           body_len,
-                          &loader->data))
+                          &data))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -4462,21 +5115,30 @@ load_message (DBusMessageLoader *loader,
 
   _dbus_assert (validity == DBUS_VALID);
 
-  /* 2. VALIDATE BODY */
+  /* 2. VALIDATE BODY
+   *
+   * The header is always validated, since we rely on it to find the
+   * body and to route the message; only the body validation is skipped
+   * for a trusted peer.
+   */
+  if (loader->trust_bodies)
+    mode = DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY;
+
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
       get_const_signature (&message->header, &type_str, &type_pos);
       
-      /* Because the bytes_remaining arg is NULL, this validates that the
-       * body is the right length
+      /* This also validates that the body is the right length, and
+       * notes where the first arguments start for
+       * _dbus_message_iter_init_at_arg()
        */
-      validity = _dbus_validate_body_with_reason (type_str,
-                                                  type_pos,
-                                                  byte_order,
-                                                  NULL,
-                                                  &loader->data,
-                                                  header_len,
-                                                  body_len);
+      validity = _dbus_validate_body_indexed (type_str,
+                                              type_pos,
+                                              byte_order,
+                                              &data,
+                                              header_len,
+                                              body_len,
+                                              &message->body_index);
       if (validity != DBUS_VALID)
         {
           _dbus_verbose ("Failed to validate message body code %d\n", validity);
@@ -4546,6 +5208,10 @@ load_message (DBusMessageLoader *loader,
 
   /* 3. COPY OVER BODY AND QUEUE MESSAGE */
 
+#ifdef DBUS_ENABLE_STATS
+  message->received_usec = _dbus_get_monotonic_usec ();
+#endif
+
   if (!_dbus_list_append (&loader->messages, message))
     {
       _dbus_verbose ("Failed to append new message to loader queue\n");
@@ -4554,25 +5220,42 @@ load_message (DBusMessageLoader *loader,
     }
 
   _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
+  _dbus_assert (_dbus_string_get_length (&data) >=
                 (header_len + body_len));
 
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
+  if (body_len >= LOADER_HANDOFF_MIN_BODY_LEN &&
+      _dbus_string_get_length (&data) == header_len + body_len)
     {
-      _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
-    }
+      /* Nothing else is buffered, so rather than allocating a second
+       * large buffer and copying the body into it, drop the header
+       * (already copied out above) and give the loader's buffer to the
+       * message; the loader takes over the message's empty one, which
+       * also saves compacting a large loader buffer afterwards.
+       */
+      _dbus_string_delete (&loader->data, 0, start + header_len);
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+      if (!_dbus_string_move (&loader->data, 0, &message->body, 0))
+        _dbus_assert_not_reached ("moving a whole string into an empty one can't fail");
 
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
+      *consumed_p = 0;
+    }
+  else
+    {
+      if (!_dbus_string_copy_len (&data, header_len, body_len, &message->body, 0))
+        {
+          _dbus_verbose ("Failed to move body into new message\n");
+          oom = TRUE;
+          goto failed;
+        }
+
+      *consumed_p += header_len + body_len;
+    }
 
   _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
 
   _dbus_verbose ("Loaded message %p\n", message);
+  _DBUS_PROBE_MESSAGE (message__read, message);
 
   _dbus_assert (!oom);
   _dbus_assert (!loader->corrupted);
@@ -4593,11 +5276,70 @@ load_message (DBusMessageLoader *loader,
   else
     _dbus_assert (loader->corrupted);
 
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+  _dbus_verbose_bytes_of_string (&data, 0, _dbus_string_get_length (&data));
 
   return FALSE;
 }
 
+/*
+ * Validates the header of a message whose body is still arriving, so
+ * that a sender of an invalid header is disconnected as soon as the
+ * header is in, rather than after the loader has buffered a body of
+ * up to max_message_size bytes that would then be thrown away.
+ * Returns FALSE on OOM only; the header is checked again by
+ * load_message() once the whole message is in.
+ */
+static dbus_bool_t
+check_partial_header (DBusMessageLoader *loader,
+                      int                start,
+                      int                byte_order,
+                      int                fields_array_len,
+                      int                header_len,
+                      int                body_len)
+{
+  DBusHeader header;
+  DBusValidity validity;
+  DBusString data;
+
+  if (loader->partial_header_checked)
+    return TRUE;
+
+  if (_dbus_string_get_length (&loader->data) - start < header_len)
+    return TRUE;
+
+  if (!_dbus_header_init (&header))
+    return FALSE;
+
+  _dbus_string_init_const_len (&data,
+                               _dbus_string_get_const_data_len (&loader->data, start, 0),
+                               header_len);
+
+  if (!_dbus_header_load (&header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity,
+                          byte_order,
+                          fields_array_len,
+                          header_len,
+                          body_len,
+                          &data))
+    {
+      _dbus_header_free (&header);
+
+      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        return FALSE;
+
+      _dbus_verbose ("Header of partially received message is invalid, code %d\n",
+                     validity);
+      loader->corrupted = TRUE;
+      loader->corruption_reason = validity;
+      return TRUE;
+    }
+
+  _dbus_header_free (&header);
+  loader->partial_header_checked = TRUE;
+  return TRUE;
+}
+
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
@@ -4615,20 +5357,36 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  dbus_bool_t retval = TRUE;
+  int consumed = 0;
+
+  /* Messages are parsed in place, and the consumed bytes are deleted
+   * from the front of the buffer once at the end rather than after
+   * every message; doing the latter moves the rest of the buffer each
+   * time, which is quadratic in the number of messages per read. A
+   * message has to start 8-aligned in memory though, so the bytes
+   * consumed so far are deleted early when they don't add up to that.
+   */
   while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+         _dbus_string_get_length (&loader->data) - consumed >= DBUS_MINIMUM_HEADER_SIZE)
     {
       DBusValidity validity;
       int byte_order, fields_array_len, header_len, body_len;
 
+      if (_DBUS_ALIGN_VALUE (consumed, 8) != (unsigned) consumed)
+        {
+          _dbus_string_delete (&loader->data, 0, consumed);
+          consumed = 0;
+        }
+
       if (_dbus_header_have_message_untrusted (loader->max_message_size,
                                                &validity,
                                                &byte_order,
                                                &fields_array_len,
                                                &header_len,
                                                &body_len,
-                                               &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+                                               &loader->data, consumed,
+                                               _dbus_string_get_length (&loader->data) - consumed))
         {
           DBusMessage *message;
 
@@ -4636,9 +5394,12 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 
           message = dbus_message_new_empty_header ();
           if (message == NULL)
-            return FALSE;
+            {
+              retval = FALSE;
+              break;
+            }
 
-          if (!load_message (loader, message,
+          if (!load_message (loader, message, &consumed,
                              byte_order, fields_array_len,
                              header_len, body_len))
             {
@@ -4646,11 +5407,14 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               /* load_message() returns false if corrupted or OOM; if
                * corrupted then return TRUE for not OOM
                */
-              return loader->corrupted;
+              retval = loader->corrupted;
+              break;
             }
 
           _dbus_assert (loader->messages != NULL);
           _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+
+          loader->partial_header_checked = FALSE;
 	}
       else
         {
@@ -4661,11 +5425,23 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
-          return TRUE;
+          else if (!check_partial_header (loader, consumed, byte_order,
+                                          fields_array_len, header_len,
+                                          body_len))
+            {
+              retval = FALSE;
+            }
+          break;
         }
     }
 
-  return TRUE;
+  if (consumed > 0)
+    _dbus_string_delete (&loader->data, 0, consumed);
+
+  /* don't waste more than 2k of memory */
+  _dbus_string_compact (&loader->data, 2048);
+
+  return retval;
 }
 
 /**
@@ -4819,6 +5595,32 @@ _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
   return loader->max_message_unix_fds;
 }
 
+/**
+ * Sets whether message bodies received by the loader are trusted
+ * to be valid. If so, only the header is validated.
+ *
+ * @param loader the loader
+ * @param trust #TRUE to skip body validation
+ */
+void
+_dbus_message_loader_set_trust_bodies (DBusMessageLoader  *loader,
+                                       dbus_bool_t         trust)
+{
+  loader->trust_bodies = (trust != FALSE);
+}
+
+/**
+ * Gets whether message bodies received by the loader are trusted.
+ *
+ * @param loader the loader
+ * @returns #TRUE if body validation is skipped
+ */
+dbus_bool_t
+_dbus_message_loader_get_trust_bodies (DBusMessageLoader  *loader)
+{
+  return loader->trust_bodies;
+}
+
 /**
  * Return how many file descriptors are pending in the loader
  *
@@ -4834,6 +5636,21 @@ _dbus_message_loader_get_pending_fds_count (DBusMessageLoader *loader)
 #endif
 }
 
+/**
+ * Checks whether the loader holds nothing at all: no complete
+ * messages, no bytes of an incomplete one and no file descriptors.
+ *
+ * @param loader the loader
+ * @returns #TRUE if the loader is empty
+ */
+dbus_bool_t
+_dbus_message_loader_is_empty (DBusMessageLoader *loader)
+{
+  return loader->messages == NULL &&
+    _dbus_string_get_length (&loader->data) == 0 &&
+    _dbus_message_loader_get_pending_fds_count (loader) == 0;
+}
+
 /**
  * Register a function to be called whenever the number of pending file
  * descriptors in the loader change.
@@ -274,6 +274,12 @@ DBUS_EXPORT
 void        dbus_message_iter_get_fixed_array  (DBusMessageIter *iter,
                                                 void            *value,
                                                 int             *n_elements);
+DBUS_EXPORT
+int         dbus_message_iter_get_fixed_struct_array (DBusMessageIter *iter,
+                                                      void            *elements,
+                                                      int              element_size,
+                                                      const int       *field_offsets,
+                                                      int              max_elements);
 
 
 DBUS_EXPORT
@@ -289,6 +295,14 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   const void      *value,
                                                   int              n_elements);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_reserve_fixed_array (DBusMessageIter *iter,
+                                                   int              element_type,
+                                                   int              n_elements,
+                                                   void            *value);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_reserve            (DBusMessageIter *iter,
+                                                  int              n_bytes);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
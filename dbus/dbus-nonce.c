@@ -29,13 +29,23 @@
 #include "dbus-sysdeps.h"
 
 #include <stdio.h>
+#include <string.h>
 
 struct DBusNonceFile
 {
   DBusString path;
   DBusString dir;
+  DBusString nonce; /**< what we wrote to path, so we never read it back */
 };
 
+/* The nonce file a client most recently read, so that connecting to the
+ * same nonce-tcp server again only costs a stat(). Protected by
+ * _DBUS_LOCK (nonce_cache). */
+static char *cached_nonce_path = NULL;
+static DBusStat cached_nonce_stat;
+static char cached_nonce[16];
+static dbus_bool_t cached_nonce_shutdown_registered = FALSE;
+
 static dbus_bool_t
 do_check_nonce (DBusSocket fd, const DBusString *nonce, DBusError *error)
 {
@@ -171,64 +181,120 @@ _dbus_read_nonce (const DBusString *fname, DBusString *nonce, DBusError* error)
 DBusSocket
 _dbus_accept_with_noncefile (DBusSocket listen_fd, const DBusNonceFile *noncefile)
 {
-  DBusSocket fd = _dbus_socket_get_invalid ();
-  DBusString nonce;
+  DBusSocket fd;
 
   _dbus_assert (noncefile != NULL);
 
-  /* Make it valid to "free" this even if _dbus_string_init() runs
-   * out of memory: see comment in do_check_nonce() */
-  _dbus_string_init_const (&nonce, "");
-
-  if (!_dbus_string_init (&nonce))
-    goto out;
-
-  //PENDING(kdab): set better errors
-  if (_dbus_read_nonce (_dbus_noncefile_get_path(noncefile), &nonce, NULL) != TRUE)
-    goto out;
-
   fd = _dbus_accept (listen_fd);
 
   if (!_dbus_socket_is_valid (fd))
-    goto out;
+    return fd;
 
-  if (do_check_nonce(fd, &nonce, NULL) != TRUE) {
+  //PENDING(kdab): set better errors
+  if (do_check_nonce(fd, &noncefile->nonce, NULL) != TRUE) {
     _dbus_verbose ("nonce check failed. Closing socket.\n");
     _dbus_close_socket(fd, NULL);
     _dbus_socket_invalidate (&fd);
-    goto out;
   }
 
-out:
-  _dbus_string_free (&nonce);
   return fd;
 }
 
 static dbus_bool_t
-generate_and_write_nonce (const DBusString *filename, DBusError *error)
+generate_and_write_nonce (const DBusString *filename,
+                          DBusString       *nonce,
+                          DBusError        *error)
 {
-  DBusString nonce;
-  dbus_bool_t ret;
-
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!_dbus_string_init (&nonce))
+  if (!_dbus_generate_random_bytes (nonce, 16, error))
+    return FALSE;
+
+  return _dbus_string_save_to_file (nonce, filename, FALSE, error);
+}
+
+static void
+nonce_cache_shutdown (void *data)
+{
+  dbus_free (cached_nonce_path);
+  cached_nonce_path = NULL;
+  cached_nonce_shutdown_registered = FALSE;
+}
+
+/* Like _dbus_read_nonce(), but if the file has the same path and stamps
+ * as last time, reuse what we read then */
+static dbus_bool_t
+read_nonce_cached (const DBusString *fname,
+                   DBusString       *nonce,
+                   DBusError        *error)
+{
+  DBusStat st;
+  dbus_bool_t have_stat;
+  dbus_bool_t found = FALSE;
+  long now_sec;
+  long now_usec;
+
+  have_stat = _dbus_stat (fname, &st, NULL);
+
+  if (have_stat && _DBUS_LOCK (nonce_cache))
     {
-      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
-      return FALSE;
+      if (cached_nonce_path != NULL &&
+          strcmp (cached_nonce_path, _dbus_string_get_const_data (fname)) == 0 &&
+          st.mtime == cached_nonce_stat.mtime &&
+          st.ctime == cached_nonce_stat.ctime &&
+          st.size == cached_nonce_stat.size)
+        found = TRUE;
+
+      if (found &&
+          !_dbus_string_append_len (nonce, cached_nonce, sizeof cached_nonce))
+        {
+          _DBUS_UNLOCK (nonce_cache);
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          return FALSE;
+        }
+
+      _DBUS_UNLOCK (nonce_cache);
+
+      if (found)
+        return TRUE;
     }
 
-  if (!_dbus_generate_random_bytes (&nonce, 16, error))
+  if (!_dbus_read_nonce (fname, nonce, error))
+    return FALSE;
+
+  /* A file written during the current second could be rewritten without
+   * its stamps changing, so don't remember it yet */
+  _dbus_get_real_time (&now_sec, &now_usec);
+
+  if (have_stat &&
+      (long) st.mtime < now_sec &&
+      (long) st.ctime < now_sec &&
+      _dbus_string_get_length (nonce) >= (int) sizeof cached_nonce &&
+      _DBUS_LOCK (nonce_cache))
     {
-      _dbus_string_free (&nonce);
-      return FALSE;
-    }
+      if (cached_nonce_shutdown_registered ||
+          _dbus_register_shutdown_func (nonce_cache_shutdown, NULL))
+        {
+          char *path = _dbus_strdup (_dbus_string_get_const_data (fname));
 
-  ret = _dbus_string_save_to_file (&nonce, filename, FALSE, error);
+          cached_nonce_shutdown_registered = TRUE;
 
-  _dbus_string_free (&nonce);
+          if (path != NULL)
+            {
+              dbus_free (cached_nonce_path);
+              cached_nonce_path = path;
+              cached_nonce_stat = st;
+              memcpy (cached_nonce,
+                      _dbus_string_get_const_data (nonce) +
+                        _dbus_string_get_length (nonce) - sizeof cached_nonce,
+                      sizeof cached_nonce);
+            }
+        }
 
-  return ret;
+      _DBUS_UNLOCK (nonce_cache);
+    }
+
+  return TRUE;
 }
 
 /**
@@ -260,7 +326,7 @@ _dbus_send_nonce (DBusSocket        fd,
       return FALSE;
     }
 
-  read_result = _dbus_read_nonce (noncefile, &nonce, error);
+  read_result = read_nonce_cached (noncefile, &nonce, error);
   if (!read_result)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -312,6 +378,7 @@ do_noncefile_create (DBusNonceFile **noncefile_out,
     _dbus_string_init_const (&randomStr, "");
     _dbus_string_init_const (&noncefile->dir, "");
     _dbus_string_init_const (&noncefile->path, "");
+    _dbus_string_init_const (&noncefile->nonce, "");
 
     if (!_dbus_string_init (&randomStr))
       {
@@ -369,7 +436,13 @@ do_noncefile_create (DBusNonceFile **noncefile_out,
 
       }
 
-    if (!generate_and_write_nonce (&noncefile->path, error))
+    if (!_dbus_string_init (&noncefile->nonce))
+      {
+        dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+        goto on_error;
+      }
+
+    if (!generate_and_write_nonce (&noncefile->path, &noncefile->nonce, error))
       {
         _DBUS_ASSERT_ERROR_IS_SET (error);
         if (use_subdir)
@@ -387,6 +460,7 @@ do_noncefile_create (DBusNonceFile **noncefile_out,
       _dbus_delete_directory (&noncefile->dir, NULL);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     dbus_free (noncefile);
     _dbus_string_free (&randomStr);
     return FALSE;
@@ -438,6 +512,7 @@ _dbus_noncefile_delete (DBusNonceFile **noncefile_location,
     _dbus_delete_file (&noncefile->path, error);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     dbus_free (noncefile);
     return TRUE;
 }
@@ -489,6 +564,7 @@ _dbus_noncefile_delete (DBusNonceFile **noncefile_location,
     _dbus_delete_directory (&noncefile->dir, error);
     _dbus_string_free (&noncefile->dir);
     _dbus_string_free (&noncefile->path);
+    _dbus_string_free (&noncefile->nonce);
     dbus_free (noncefile);
     return TRUE;
 }
@@ -523,7 +599,8 @@ _dbus_noncefile_check_nonce (DBusSocket fd,
                              const DBusNonceFile *noncefile,
                              DBusError* error)
 {
-    return do_check_nonce (fd, _dbus_noncefile_get_path (noncefile), error);
+    _dbus_assert (noncefile);
+    return do_check_nonce (fd, &noncefile->nonce, error);
 }
 
 
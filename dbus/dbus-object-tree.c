@@ -46,7 +46,8 @@
 /** Subnode of the object hierarchy */
 typedef struct DBusObjectSubtree DBusObjectSubtree;
 
-static DBusObjectSubtree* _dbus_object_subtree_new   (const char                  *name,
+static DBusObjectSubtree* _dbus_object_subtree_new   (const char                  *parent_path,
+                                                      const char                  *name,
                                                       const DBusObjectPathVTable  *vtable,
                                                       void                        *user_data);
 static DBusObjectSubtree* _dbus_object_subtree_ref   (DBusObjectSubtree           *subtree);
@@ -61,6 +62,8 @@ struct DBusObjectTree
   DBusConnection     *connection; /**< Connection this tree belongs to */
 
   DBusObjectSubtree  *root;       /**< Root of the tree ("/" node) */
+  DBusHashTable      *index;      /**< Every node in the tree, by full object path */
+  unsigned int        has_patterns : 1; /**< Whether any path was registered with a "*" element */
 };
 
 /**
@@ -79,6 +82,8 @@ struct DBusObjectSubtree
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
   unsigned int                       invoke_as_fallback : 1; /**< Whether to invoke message_function when child nodes don't handle the message */
+  const char                        *path;    /**< Full object path, stored after name */
+  char                              *introspect_xml; /**< Cached default Introspect() reply, or #NULL */
   char                               name[1]; /**< Allocated as large as necessary */
 };
 
@@ -105,16 +110,30 @@ _dbus_object_tree_new (DBusConnection *connection)
 
   tree->refcount = 1;
   tree->connection = connection;
-  tree->root = _dbus_object_subtree_new ("/", NULL, NULL);
+  tree->index = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (tree->index == NULL)
+    goto oom;
+
+  tree->root = _dbus_object_subtree_new (NULL, "/", NULL, NULL);
   if (tree->root == NULL)
     goto oom;
   tree->root->invoke_as_fallback = TRUE;
+
+  if (!_dbus_hash_table_insert_string (tree->index, (char *) tree->root->path,
+                                       tree->root))
+    goto oom;
   
   return tree;
 
  oom:
   if (tree)
     {
+      if (tree->root)
+        _dbus_object_subtree_unref (tree->root);
+
+      if (tree->index)
+        _dbus_hash_table_unref (tree->index);
+
       dbus_free (tree);
     }
 
@@ -155,6 +174,15 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
     }
 }
 
+/* The default Introspect() reply only lists child nodes, so it is
+ * only stale once the children change */
+static void
+invalidate_introspect_xml (DBusObjectSubtree *subtree)
+{
+  dbus_free (subtree->introspect_xml);
+  subtree->introspect_xml = NULL;
+}
+
 /** Set to 1 to get a bunch of debug spew about finding the
  * subtree nodes
  */
@@ -163,10 +191,11 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
 static DBusObjectSubtree*
 find_subtree_recurse (DBusObjectSubtree  *subtree,
                       const char        **path,
-                      dbus_bool_t         create_if_not_found,
+                      DBusHashTable      *index,
                       int                *index_in_parent,
                       dbus_bool_t        *exact_match)
 {
+  dbus_bool_t create_if_not_found = index != NULL;
   int i, j;
   dbus_bool_t return_deepest_match;
 
@@ -220,7 +249,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
               DBusObjectSubtree *next;
 
               next = find_subtree_recurse (subtree->subtrees[k],
-                                           &path[1], create_if_not_found, 
+                                           &path[1], index,
                                            index_in_parent, exact_match);
               if (next == NULL &&
                   subtree->invoke_as_fallback)
@@ -238,7 +267,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
             }
           else
             return find_subtree_recurse (subtree->subtrees[k],
-                                         &path[1], create_if_not_found, 
+                                         &path[1], index,
                                          index_in_parent, exact_match);
         }
       else if (v < 0)
@@ -266,7 +295,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
                      path[0]);
 #endif
       
-      child = _dbus_object_subtree_new (path[0],
+      child = _dbus_object_subtree_new (subtree->path, path[0],
                                         NULL, NULL);
       if (child == NULL)
         return NULL;
@@ -289,6 +318,12 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
           subtree->max_subtrees = new_max_subtrees;
         }
 
+      if (!_dbus_hash_table_insert_string (index, (char *) child->path, child))
+        {
+          _dbus_object_subtree_unref (child);
+          return NULL;
+        }
+
       /* The binary search failed, so i == j points to the 
          place the child should be inserted. */
       child_pos = i;
@@ -307,9 +342,10 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
         *index_in_parent = child_pos;
       subtree->n_subtrees = new_n_subtrees;
       child->parent = subtree;
+      invalidate_introspect_xml (subtree);
 
       return find_subtree_recurse (child,
-                                   &path[1], create_if_not_found, 
+                                   &path[1], index,
                                    index_in_parent, exact_match);
     }
   else
@@ -332,7 +368,7 @@ find_subtree (DBusObjectTree *tree,
   _dbus_verbose ("Looking for exact registered subtree\n");
 #endif
   
-  subtree = find_subtree_recurse (tree->root, path, FALSE, index_in_parent, NULL);
+  subtree = find_subtree_recurse (tree->root, path, NULL, index_in_parent, NULL);
 
   if (subtree && subtree->message_function == NULL)
     return NULL;
@@ -348,7 +384,7 @@ lookup_subtree (DBusObjectTree *tree,
 #if VERBOSE_FIND
   _dbus_verbose ("Looking for subtree\n");
 #endif
-  return find_subtree_recurse (tree->root, path, FALSE, NULL, NULL);
+  return find_subtree_recurse (tree->root, path, NULL, NULL, NULL);
 }
 
 static DBusObjectSubtree*
@@ -363,7 +399,148 @@ find_handler (DBusObjectTree *tree,
 
   *exact_match = FALSE; /* ensure always initialized */
   
-  return find_subtree_recurse (tree->root, path, FALSE, NULL, exact_match);
+  return find_subtree_recurse (tree->root, path, NULL, NULL, exact_match);
+}
+
+/* The path element that matches any single element of a message's path */
+#define PATTERN_WILDCARD "*"
+
+/*
+ * Binary search of subtree's children for the path element of length
+ * len at element, which need not be nul-terminated.
+ */
+static DBusObjectSubtree*
+find_child_by_element (DBusObjectSubtree *subtree,
+                       const char        *element,
+                       int                len)
+{
+  int i, j;
+
+  i = 0;
+  j = subtree->n_subtrees;
+  while (i < j)
+    {
+      const char *name;
+      int k, v;
+
+      k = (i + j) / 2;
+      name = subtree->subtrees[k]->name;
+      v = strncmp (element, name, len);
+
+      if (v == 0 && name[len] != '\0')
+        v = -1;
+
+      if (v == 0)
+        return subtree->subtrees[k];
+      else if (v < 0)
+        j = k;
+      else
+        i = k + 1;
+    }
+
+  return NULL;
+}
+
+/*
+ * Finds the deepest node below subtree whose handler applies to the
+ * rest of a message's path, which starts at path just past a '/'. A
+ * child named exactly like the next element is tried before a "*"
+ * child; "*" sorts before every character allowed in a path, so it
+ * can only be the first child. Everything happens on the stack, one
+ * frame per path element.
+ */
+static DBusObjectSubtree*
+match_path_recurse (DBusObjectSubtree *subtree,
+                    const char        *path,
+                    dbus_bool_t       *exact_match)
+{
+  DBusObjectSubtree *child;
+  DBusObjectSubtree *found;
+  const char *next;
+  int len;
+
+  if (*path == '\0')
+    {
+      *exact_match = TRUE;
+      return subtree->message_function != NULL ? subtree : NULL;
+    }
+
+  next = strchr (path, '/');
+  if (next != NULL)
+    {
+      len = next - path;
+      next++;
+    }
+  else
+    {
+      len = strlen (path);
+      next = path + len;
+    }
+
+  child = find_child_by_element (subtree, path, len);
+  if (child != NULL)
+    {
+      found = match_path_recurse (child, next, exact_match);
+      if (found != NULL)
+        return found;
+    }
+
+  if (subtree->n_subtrees > 0 &&
+      strcmp (subtree->subtrees[0]->name, PATTERN_WILDCARD) == 0 &&
+      subtree->subtrees[0] != child)
+    {
+      found = match_path_recurse (subtree->subtrees[0], next, exact_match);
+      if (found != NULL)
+        return found;
+    }
+
+  if (subtree->message_function != NULL && subtree->invoke_as_fallback)
+    {
+      *exact_match = FALSE;
+      return subtree;
+    }
+
+  return NULL;
+}
+
+/*
+ * Like find_handler(), but for a path that has not been decomposed,
+ * and honouring "*" elements in registered paths. A registered object
+ * is found with a single lookup in the index; otherwise the tree is
+ * walked along the path without allocating. The root is returned if
+ * no handler applies, since dispatch walks up from the returned node
+ * to the fallbacks anyway.
+ */
+static DBusObjectSubtree*
+find_handler_by_path (DBusObjectTree *tree,
+                      const char     *path,
+                      dbus_bool_t    *exact_match)
+{
+  DBusObjectSubtree *subtree;
+
+  _dbus_assert (path[0] == '/');
+
+  subtree = _dbus_hash_table_lookup_string (tree->index, path);
+
+  /* Without patterns, the parents of the exact node are exactly the
+   * nodes a walk would consider; with them, an exact node with no
+   * handler of its own may still be covered by a "*" elsewhere. */
+  if (subtree != NULL &&
+      (subtree->message_function != NULL || !tree->has_patterns))
+    {
+      *exact_match = TRUE;
+      return subtree;
+    }
+
+  subtree = match_path_recurse (tree->root, path + 1, exact_match);
+
+  if (subtree == NULL)
+    {
+      *exact_match = FALSE;
+      subtree = tree->root;
+    }
+
+  return subtree;
 }
 
 static DBusObjectSubtree*
@@ -373,7 +550,7 @@ ensure_subtree (DBusObjectTree *tree,
 #if VERBOSE_FIND
   _dbus_verbose ("Ensuring subtree\n");
 #endif
-  return find_subtree_recurse (tree->root, path, TRUE, NULL, NULL);
+  return find_subtree_recurse (tree->root, path, tree->index, NULL, NULL);
 }
 
 static char *flatten_path (const char **path);
@@ -433,6 +610,12 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   subtree->user_data = user_data;
   subtree->invoke_as_fallback = fallback != FALSE;
 
+  for (; *path != NULL; path++)
+    {
+      if (strcmp (*path, PATTERN_WILDCARD) == 0)
+        tree->has_patterns = TRUE;
+    }
+
   return TRUE;
 }
 
@@ -488,12 +671,14 @@ unregister_subtree (DBusObjectSubtree                 *subtree,
  * stop attempting to remove ancestors, i.e., that no ancestors of the
  * specified child are eligible for removal.
  *
+ * @param tree the tree whose index the child is removed from
  * @param parent parent from which to remove child
  * @param child_index parent->subtrees index of child to remove
  * @return #TRUE if removal and free succeed, #FALSE otherwise
  */
 static dbus_bool_t
-attempt_child_removal (DBusObjectSubtree  *parent,
+attempt_child_removal (DBusObjectTree     *tree,
+                       DBusObjectSubtree  *parent,
                        int child_index)
 {
   /* Candidate for removal */
@@ -517,6 +702,8 @@ attempt_child_removal (DBusObjectSubtree  *parent,
                (parent->n_subtrees - child_index - 1)
                * sizeof (parent->subtrees[0]));
       parent->n_subtrees -= 1;
+      _dbus_hash_table_remove_string (tree->index, candidate->path);
+      invalidate_introspect_xml (parent);
 
       /* ... and free it */
       candidate->parent = NULL;
@@ -557,6 +744,7 @@ attempt_child_removal (DBusObjectSubtree  *parent,
  * freed, then even though A has become childless, it can't be freed because it
  * refers to a path that is still registered.
  *
+ * @param tree the object tree
  * @param subtree subtree from which to start the search, root for initial call
  * @param path path to subtree (same as _dbus_object_tree_unregister_and_unlock)
  * @param continue_removal_attempts pointer to a bool, #TRUE for initial call
@@ -566,7 +754,8 @@ attempt_child_removal (DBusObjectSubtree  *parent,
  */
 static dbus_bool_t
 unregister_and_free_path_recurse
-(DBusObjectSubtree                 *subtree,
+(DBusObjectTree                    *tree,
+ DBusObjectSubtree                 *subtree,
  const char                       **path,
  dbus_bool_t                       *continue_removal_attempts,
  DBusObjectPathUnregisterFunction  *unregister_function_out,
@@ -594,13 +783,14 @@ unregister_and_free_path_recurse
       if (v == 0)
         {
           dbus_bool_t freed;
-          freed = unregister_and_free_path_recurse (subtree->subtrees[k],
+          freed = unregister_and_free_path_recurse (tree,
+                                                    subtree->subtrees[k],
                                                     &path[1],
                                                     continue_removal_attempts,
                                                     unregister_function_out,
                                                     user_data_out);
           if (freed && *continue_removal_attempts)
-            *continue_removal_attempts = attempt_child_removal (subtree, k);
+            *continue_removal_attempts = attempt_child_removal (tree, subtree, k);
           return freed;
         }
       else if (v < 0)
@@ -639,7 +829,8 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
   unregister_function = NULL;
   user_data = NULL;
 
-  found_subtree = unregister_and_free_path_recurse (tree->root,
+  found_subtree = unregister_and_free_path_recurse (tree,
+                                                    tree->root,
                                                     path,
                                                     &continue_removal_attempts,
                                                     &unregister_function,
@@ -720,6 +911,11 @@ free_subtree_recurse (DBusConnection    *connection,
 void
 _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 {
+  /* The index's keys belong to the nodes, so it goes first */
+  if (tree->index)
+    _dbus_hash_table_unref (tree->index);
+  tree->index = NULL;
+
   if (tree->root)
     free_subtree_recurse (tree->connection,
                           tree->root);
@@ -727,19 +923,15 @@ _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 }
 
 static dbus_bool_t
-_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
-                                            const char    **parent_path,
-                                            char         ***child_entries)
+list_children (DBusObjectSubtree *subtree,
+               char            ***child_entries)
 {
-  DBusObjectSubtree *subtree;
   char **retval;
-  
-  _dbus_assert (parent_path != NULL);
+
   _dbus_assert (child_entries != NULL);
 
   *child_entries = NULL;
   
-  subtree = lookup_subtree (tree, parent_path);
   if (subtree == NULL)
     {
       retval = dbus_new0 (char *, 1);
@@ -770,14 +962,25 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
   return retval != NULL;
 }
 
+static dbus_bool_t
+_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
+                                            const char    **parent_path,
+                                            char         ***child_entries)
+{
+  _dbus_assert (parent_path != NULL);
+
+  return list_children (lookup_subtree (tree, parent_path), child_entries);
+}
+
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
                                       DBusMessage             *message,
-                                      const char             **path)
+                                      const char              *path)
 {
   DBusString xml;
   DBusHandlerResult result;
-  char **children;
+  DBusObjectSubtree *subtree;
+  const char *xml_data;
   int i;
   DBusMessage *reply;
   DBusMessageIter iter;
@@ -824,35 +1027,45 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
-    goto out;
-
-  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
-    goto out;
-  
-  if (!_dbus_string_append (&xml, "<node>\n"))
-    goto out;
+  /* Look the path up again, since the handlers we just ran were free
+   * to unregister objects */
+  subtree = _dbus_hash_table_lookup_string (tree->index, path);
 
-  i = 0;
-  while (children[i] != NULL)
+  if (subtree != NULL && subtree->introspect_xml != NULL)
+    {
+      xml_data = subtree->introspect_xml;
+    }
+  else
     {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
+      if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
         goto out;
 
-      ++i;
-    }
+      if (!_dbus_string_append (&xml, "<node>\n"))
+        goto out;
 
-  if (!_dbus_string_append (&xml, "</node>\n"))
-    goto out;
+      for (i = 0; subtree != NULL && i < subtree->n_subtrees; i++)
+        {
+          if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
+                                           subtree->subtrees[i]->name))
+            goto out;
+        }
+
+      if (!_dbus_string_append (&xml, "</node>\n"))
+        goto out;
+
+      xml_data = _dbus_string_get_const_data (&xml);
+
+      /* Failing to cache it only means building it again next time */
+      if (subtree != NULL)
+        subtree->introspect_xml = _dbus_strdup (xml_data);
+    }
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto out;
 
   dbus_message_iter_init_append (reply, &iter);
-  v_STRING = _dbus_string_get_const_data (&xml);
+  v_STRING = xml_data;
   if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &v_STRING))
     goto out;
   
@@ -881,7 +1094,6 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
   
   _dbus_string_free (&xml);
-  dbus_free_string_array (children);
   if (reply)
     dbus_message_unref (reply);
   
@@ -907,7 +1119,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message,
                                        dbus_bool_t             *found_object)
 {
-  char **path;
+  const char *path;
   dbus_bool_t exact_match;
   DBusList *list;
   DBusList *link;
@@ -918,21 +1130,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
-    {
-#ifdef DBUS_ENABLE_EMBEDDED_TESTS
-      if (tree->connection)
-#endif
-        {
-          _dbus_verbose ("unlock\n");
-          _dbus_connection_unlock (tree->connection);
-        }
-      
-      _dbus_verbose ("No memory to get decomposed path\n");
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
-    }
+  path = dbus_message_get_path (message);
 
   if (path == NULL)
     {
@@ -949,7 +1147,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     }
   
   /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
+  subtree = find_handler_by_path (tree, path, &exact_match);
   
   if (found_object)
     *found_object = !!subtree;
@@ -1040,8 +1238,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message, path);
     }
   else
     {
@@ -1060,8 +1257,6 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       _dbus_object_subtree_unref (link->data);
       _dbus_list_remove_link (&list, link);
     }
-  
-  dbus_free_string_array (path);
 
   return result;
 }
@@ -1097,40 +1292,72 @@ _dbus_object_tree_get_user_data_unlocked (DBusObjectTree *tree,
 }
 
 /**
- * Allocates a subtree object.
+ * Allocates a subtree object. Its full path is stored in the same
+ * block, straight after its name.
  *
+ * @param parent_path full path of the parent, or #NULL for the root
  * @param name name to duplicate.
  * @returns newly-allocated subtree
  */
 static DBusObjectSubtree*
-allocate_subtree_object (const char *name)
+allocate_subtree_object (const char *parent_path,
+                         const char *name)
 {
-  int len;
+  int len, parent_len, path_len;
   DBusObjectSubtree *subtree;
+  char *path;
   const size_t front_padding = _DBUS_STRUCT_OFFSET (DBusObjectSubtree, name);
 
   _dbus_assert (name != NULL);
 
   len = strlen (name);
 
-  subtree = dbus_malloc0 (MAX (front_padding + (len + 1), sizeof (DBusObjectSubtree)));
+  /* The root's path is its name; below it, children of "/" must not
+   * get a second separator */
+  if (parent_path == NULL)
+    {
+      parent_len = 0;
+      path_len = 0;
+    }
+  else
+    {
+      parent_len = strcmp (parent_path, "/") == 0 ? 0 : strlen (parent_path);
+      path_len = parent_len + 1 + len + 1;
+    }
+
+  subtree = dbus_malloc0 (MAX (front_padding + (len + 1) + path_len,
+                               sizeof (DBusObjectSubtree)));
 
   if (subtree == NULL)
     return NULL;
 
   memcpy (subtree->name, name, len + 1);
 
+  if (parent_path == NULL)
+    {
+      subtree->path = subtree->name;
+    }
+  else
+    {
+      path = subtree->name + len + 1;
+      memcpy (path, parent_path, parent_len);
+      path[parent_len] = '/';
+      memcpy (path + parent_len + 1, name, len + 1);
+      subtree->path = path;
+    }
+
   return subtree;
 }
 
 static DBusObjectSubtree*
-_dbus_object_subtree_new (const char                  *name,
+_dbus_object_subtree_new (const char                  *parent_path,
+                          const char                  *name,
                           const DBusObjectPathVTable  *vtable,
                           void                        *user_data)
 {
   DBusObjectSubtree *subtree;
 
-  subtree = allocate_subtree_object (name);
+  subtree = allocate_subtree_object (parent_path, name);
   if (subtree == NULL)
     goto oom;
 
@@ -1190,6 +1417,7 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
 
+      dbus_free (subtree->introspect_xml);
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
@@ -1521,6 +1749,19 @@ do_register (DBusObjectTree *tree,
   return TRUE;
 }
 
+static int
+count_subtrees (DBusObjectSubtree *subtree)
+{
+  int i, n;
+
+  n = 1;
+
+  for (i = 0; i < subtree->n_subtrees; i++)
+    n += count_subtrees (subtree->subtrees[i]);
+
+  return n;
+}
+
 static dbus_bool_t
 do_test_dispatch (DBusObjectTree *tree,
                   const char    **path,
@@ -1539,6 +1780,12 @@ do_test_dispatch (DBusObjectTree *tree,
   if (flat == NULL)
     goto oom;
 
+  /* The index must agree with the tree */
+  _dbus_assert (_dbus_hash_table_lookup_string (tree->index, flat) ==
+                find_subtree_recurse (tree->root, path, NULL, NULL, NULL));
+  _dbus_assert (_dbus_hash_table_get_n_entries (tree->index) ==
+                count_subtrees (tree->root));
+
   message = dbus_message_new_method_call (NULL,
                                           flat,
                                           "org.freedesktop.TestInterface",
@@ -1593,6 +1840,163 @@ do_test_dispatch (DBusObjectTree *tree,
   return FALSE;
 }
 
+/* Collects the handlers that dispatch would call, deepest first, when
+ * the lookup returned subtree and exact_match */
+static int
+collect_handlers (DBusObjectSubtree  *subtree,
+                  dbus_bool_t         exact_match,
+                  DBusObjectSubtree **handlers,
+                  int                 max_handlers)
+{
+  int n = 0;
+
+  while (subtree != NULL)
+    {
+      if (subtree->message_function != NULL &&
+          (exact_match || subtree->invoke_as_fallback))
+        {
+          _dbus_assert (n < max_handlers);
+          handlers[n++] = subtree;
+        }
+
+      exact_match = FALSE;
+      subtree = subtree->parent;
+    }
+
+  return n;
+}
+
+/* Checks that looking path up in the index, as dispatch does, finds
+ * the same handlers as walking the tree element by element */
+static dbus_bool_t
+check_index_lookup (DBusObjectTree *tree,
+                    const char    **path)
+{
+  DBusObjectSubtree *by_walk[20];
+  DBusObjectSubtree *by_index[20];
+  DBusObjectSubtree *subtree;
+  dbus_bool_t exact_match;
+  int n_by_walk, n_by_index;
+  int i;
+  char *flat;
+
+  flat = flatten_path (path);
+  if (flat == NULL)
+    return FALSE;
+
+  subtree = find_handler (tree, path, &exact_match);
+  n_by_walk = collect_handlers (subtree, exact_match, by_walk,
+                                _DBUS_N_ELEMENTS (by_walk));
+
+  subtree = find_handler_by_path (tree, flat, &exact_match);
+  n_by_index = collect_handlers (subtree, exact_match, by_index,
+                                 _DBUS_N_ELEMENTS (by_index));
+
+  if (n_by_walk != n_by_index)
+    _dbus_test_fatal ("%s: %d handlers by walking the tree, %d by index",
+                      flat, n_by_walk, n_by_index);
+
+  for (i = 0; i < n_by_walk; i++)
+    {
+      if (by_walk[i] != by_index[i])
+        _dbus_test_fatal ("%s: handler %d is %s by walking the tree, %s by "
+                          "index", flat, i, by_walk[i]->path,
+                          by_index[i]->path);
+    }
+
+  dbus_free (flat);
+  return TRUE;
+}
+
+/* Runs check_index_lookup() on the root, on each of the NULL-terminated
+ * paths, registered or not, and on a path below each of them */
+static dbus_bool_t
+check_index_lookups (DBusObjectTree *tree,
+                     const char   ***paths)
+{
+  const char *root[] = { NULL };
+  int i;
+
+  if (!check_index_lookup (tree, root))
+    return FALSE;
+
+  for (i = 0; paths[i] != NULL; i++)
+    {
+      const char *below[20];
+      int len;
+
+      len = _dbus_string_array_length (paths[i]);
+      _dbus_assert (len + 2 <= (int) _DBUS_N_ELEMENTS (below));
+      memcpy (below, paths[i], len * sizeof (below[0]));
+      below[len] = "below";
+      below[len + 1] = NULL;
+
+      if (!check_index_lookup (tree, paths[i]) ||
+          !check_index_lookup (tree, below))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Runs the default Introspect() handler on path and checks whether
+ * the cached reply lists child; under OOM there may be no cache */
+static dbus_bool_t
+do_test_introspect (DBusObjectTree *tree,
+                    const char    **path,
+                    const char     *child,
+                    dbus_bool_t     expect_child)
+{
+  DBusObjectSubtree *subtree;
+  DBusMessage *message;
+  DBusHandlerResult result;
+  DBusString node;
+  char *flat;
+
+  flat = flatten_path (path);
+  if (flat == NULL)
+    return FALSE;
+
+  message = dbus_message_new_method_call (NULL, flat,
+                                          DBUS_INTERFACE_INTROSPECTABLE,
+                                          "Introspect");
+  dbus_free (flat);
+  if (message == NULL)
+    return FALSE;
+
+  /* The reply needs something to refer back to */
+  dbus_message_set_serial (message, 1);
+
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message, NULL);
+  dbus_message_unref (message);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    return FALSE;
+
+  _dbus_assert (result == DBUS_HANDLER_RESULT_HANDLED);
+
+  subtree = find_subtree_recurse (tree->root, path, NULL, NULL, NULL);
+  _dbus_assert (subtree != NULL);
+
+  if (subtree->introspect_xml == NULL)
+    return FALSE;
+
+  if (!_dbus_string_init (&node))
+    return FALSE;
+
+  if (!_dbus_string_append_printf (&node, "  <node name=\"%s\"/>\n", child))
+    {
+      _dbus_string_free (&node);
+      return FALSE;
+    }
+
+  _dbus_assert ((strstr (subtree->introspect_xml,
+                         _dbus_string_get_const_data (&node)) != NULL) == expect_child);
+  _dbus_string_free (&node);
+
+  return TRUE;
+}
+
 typedef struct
 {
   const char *path;
@@ -1668,11 +2072,82 @@ find_subtree_registered_or_unregistered (DBusObjectTree *tree,
   _dbus_verbose ("Looking for exact subtree, registered or unregistered\n");
 #endif
 
-  return find_subtree_recurse (tree->root, path, FALSE, NULL, NULL);
+  return find_subtree_recurse (tree->root, path, NULL, NULL, NULL);
 }
 
 /* Returns TRUE if the right thing happens, but the right thing might
  * be OOM. */
+/* Checks that "*" elements of registered paths match any one element
+ * of a message's path, and that named elements are preferred */
+static dbus_bool_t
+do_test_patterns (void)
+{
+  const char *pattern0[] = { "dev", "*", NULL };
+  const char *pattern1[] = { "dev", "*", "chan", NULL };
+  const char *pattern2[] = { "dev", "sda", "chan", "x", NULL };
+  DBusObjectTree *tree;
+  TreeTestData test_data[3];
+  DBusObjectSubtree *subtree;
+  DBusMessage *message;
+  DBusHandlerResult result;
+  dbus_bool_t exact_match;
+  dbus_bool_t ok = FALSE;
+
+  tree = _dbus_object_tree_new (NULL);
+  if (tree == NULL)
+    return FALSE;
+
+  if (!do_register (tree, pattern0, FALSE, 0, test_data) ||
+      !do_register (tree, pattern1, TRUE, 1, test_data) ||
+      !do_register (tree, pattern2, FALSE, 2, test_data))
+    goto out;
+
+  subtree = find_handler_by_path (tree, "/dev/sdb", &exact_match);
+  _dbus_assert (subtree->user_data == &test_data[0] && exact_match);
+
+  subtree = find_handler_by_path (tree, "/dev/sdb/chan/3", &exact_match);
+  _dbus_assert (subtree->user_data == &test_data[1] && !exact_match);
+
+  /* /dev/sda/chan only exists as a parent of pattern2 */
+  subtree = find_handler_by_path (tree, "/dev/sda/chan", &exact_match);
+  _dbus_assert (subtree->user_data == &test_data[1] && exact_match);
+
+  subtree = find_handler_by_path (tree, "/dev/sda/chan/x", &exact_match);
+  _dbus_assert (subtree->user_data == &test_data[2] && exact_match);
+
+  subtree = find_handler_by_path (tree, "/dev/sdb/other", &exact_match);
+  _dbus_assert (subtree == tree->root && !exact_match);
+
+  subtree = find_handler_by_path (tree, "/dev", &exact_match);
+  _dbus_assert (subtree == tree->root && !exact_match);
+
+  message = dbus_message_new_method_call (NULL, "/dev/sdc/chan/7",
+                                          "org.freedesktop.TestInterface",
+                                          "Foo");
+  if (message == NULL)
+    goto out;
+
+  test_data[0].message_handled = FALSE;
+  test_data[1].message_handled = FALSE;
+  test_data[2].message_handled = FALSE;
+
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message, NULL);
+  dbus_message_unref (message);
+
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    goto out;
+
+  _dbus_assert (!test_data[0].message_handled);
+  _dbus_assert (test_data[1].message_handled);
+  _dbus_assert (!test_data[2].message_handled);
+
+  ok = TRUE;
+
+ out:
+  _dbus_object_tree_unref (tree);
+  return ok;
+}
+
 static dbus_bool_t
 object_tree_test_iteration (void        *data,
                             dbus_bool_t  have_memory)
@@ -1692,6 +2167,9 @@ object_tree_test_iteration (void        *data,
   const char *path12[] = { "blah", "a", "d", NULL };
   const char *path13[] = { "blah", "b", "d", NULL };
   const char *path14[] = { "blah", "c", "d", NULL };
+  const char **all_paths[] = { path0, path1, path2, path3, path4, path5,
+                               path6, path7, path8, path9, path10, path11,
+                               path12, path13, path14, NULL };
   DBusObjectPathVTable test_vtable = { NULL, test_message_function, NULL };
   DBusObjectTree *tree;
   TreeTestData tree_test_data[9];
@@ -1938,8 +2416,13 @@ object_tree_test_iteration (void        *data,
   if (!do_register (tree, path8, TRUE, 8, tree_test_data))
     goto out;
 
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
+
   _dbus_object_tree_unregister_and_unlock (tree, path0);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path0) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (find_subtree (tree, path1, NULL));
@@ -1953,6 +2436,8 @@ object_tree_test_iteration (void        *data,
   
   _dbus_object_tree_unregister_and_unlock (tree, path1);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path1) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -1966,6 +2451,8 @@ object_tree_test_iteration (void        *data,
 
   _dbus_object_tree_unregister_and_unlock (tree, path2);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path2) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -1979,6 +2466,8 @@ object_tree_test_iteration (void        *data,
   
   _dbus_object_tree_unregister_and_unlock (tree, path3);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path3) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -1992,6 +2481,8 @@ object_tree_test_iteration (void        *data,
   
   _dbus_object_tree_unregister_and_unlock (tree, path4);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path4) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -2005,6 +2496,8 @@ object_tree_test_iteration (void        *data,
   
   _dbus_object_tree_unregister_and_unlock (tree, path5);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path5) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -2018,6 +2511,8 @@ object_tree_test_iteration (void        *data,
   
   _dbus_object_tree_unregister_and_unlock (tree, path6);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path6) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -2031,6 +2526,8 @@ object_tree_test_iteration (void        *data,
 
   _dbus_object_tree_unregister_and_unlock (tree, path7);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path7) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -2044,6 +2541,8 @@ object_tree_test_iteration (void        *data,
 
   _dbus_object_tree_unregister_and_unlock (tree, path8);
   _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path8) == NULL);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree (tree, path0, NULL));
   _dbus_assert (!find_subtree (tree, path1, NULL));
@@ -2194,8 +2693,12 @@ object_tree_test_iteration (void        *data,
     goto out;
 
   _dbus_assert (find_subtree (tree, path14, NULL));
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_object_tree_unregister_and_unlock (tree, path12);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (!find_subtree_registered_or_unregistered (tree, path12));
   _dbus_assert (find_subtree (tree, path13, NULL));
@@ -2212,6 +2715,8 @@ object_tree_test_iteration (void        *data,
   _dbus_assert (find_subtree (tree, path12, NULL));
 
   _dbus_object_tree_unregister_and_unlock (tree, path13);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (find_subtree (tree, path12, NULL));
   _dbus_assert (!find_subtree_registered_or_unregistered (tree, path13));
@@ -2228,6 +2733,8 @@ object_tree_test_iteration (void        *data,
   _dbus_assert (find_subtree (tree, path13, NULL));
 
   _dbus_object_tree_unregister_and_unlock (tree, path14);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
 
   _dbus_assert (find_subtree (tree, path12, NULL));
   _dbus_assert (find_subtree (tree, path13, NULL));
@@ -2282,6 +2789,9 @@ object_tree_test_iteration (void        *data,
   spew_tree (tree);
 #endif
 
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
+
   if (!do_test_dispatch (tree, path0, 0, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
     goto out;
   if (!do_test_dispatch (tree, path1, 1, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
@@ -2300,6 +2810,38 @@ object_tree_test_iteration (void        *data,
     goto out;
   if (!do_test_dispatch (tree, path8, 8, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
     goto out;
+
+  /* The cached Introspect() reply must follow changes to the children */
+  if (!do_test_introspect (tree, path1, "bar", TRUE))
+    goto out;
+
+  _dbus_object_tree_unregister_and_unlock (tree, path3);
+  _dbus_object_tree_unregister_and_unlock (tree, path4);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
+
+  if (!do_test_introspect (tree, path1, "bar", TRUE))
+    goto out;
+  if (!do_test_introspect (tree, path2, "baz", FALSE))
+    goto out;
+
+  _dbus_object_tree_unregister_and_unlock (tree, path2);
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
+
+  if (!do_test_introspect (tree, path1, "bar", FALSE))
+    goto out;
+
+  if (!do_register (tree, path2, TRUE, 2, tree_test_data))
+    goto out;
+  if (!check_index_lookups (tree, all_paths))
+    goto out;
+
+  if (!do_test_introspect (tree, path1, "bar", TRUE))
+    goto out;
+
+  if (!do_test_patterns ())
+    goto out;
   
  out:
   if (tree)
@@ -34,7 +34,16 @@ DBUS_BEGIN_DECLS
 dbus_bool_t      _dbus_pending_call_is_timeout_added_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_timeout_added_unlocked   (DBusPendingCall    *pending,
                                                                   dbus_bool_t         is_added);
-DBusTimeout    * _dbus_pending_call_get_timeout_unlocked         (DBusPendingCall    *pending);
+dbus_bool_t      _dbus_pending_call_get_reply_queued_unlocked    (DBusPendingCall    *pending);
+void             _dbus_pending_call_set_reply_queued_unlocked    (DBusPendingCall    *pending,
+                                                                  dbus_bool_t         is_queued);
+int              _dbus_pending_call_get_timeout_interval_unlocked (DBusPendingCall  *pending);
+void             _dbus_pending_call_set_deadline_unlocked        (DBusPendingCall    *pending,
+                                                                  long                tv_sec,
+                                                                  long                tv_usec);
+void             _dbus_pending_call_get_deadline_unlocked        (DBusPendingCall    *pending,
+                                                                  long               *tv_sec,
+                                                                  long               *tv_usec);
 dbus_uint32_t    _dbus_pending_call_get_reply_serial_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_serial_unlocked    (DBusPendingCall    *pending,
                                                                   dbus_uint32_t       serial);
@@ -51,8 +60,7 @@ dbus_bool_t      _dbus_pending_call_set_timeout_error_unlocked   (DBusPendingCal
                                                                   dbus_uint32_t       serial);
 DBUS_PRIVATE_EXPORT
 DBusPendingCall* _dbus_pending_call_new_unlocked                 (DBusConnection     *connection,
-                                                                  int                 timeout_milliseconds,
-                                                                  DBusTimeoutHandler  timeout_handler);
+                                                                  int                 timeout_milliseconds);
 DBUS_PRIVATE_EXPORT
 DBusPendingCall* _dbus_pending_call_ref_unlocked                 (DBusPendingCall    *pending);
 DBUS_PRIVATE_EXPORT
@@ -69,7 +69,9 @@ struct DBusPendingCall
 
   DBusConnection *connection;                     /**< Connections we're associated with */
   DBusMessage *reply;                             /**< Reply (after we've received it) */
-  DBusTimeout *timeout;                           /**< Timeout */
+  int timeout_milliseconds;                       /**< Reply timeout, or #DBUS_TIMEOUT_INFINITE */
+  long deadline_sec;                              /**< Monotonic time the call times out, seconds */
+  long deadline_usec;                             /**< Monotonic time the call times out, microseconds */
 
   DBusList *timeout_link;                         /**< Preallocated timeout response */
   
@@ -77,6 +79,7 @@ struct DBusPendingCall
 
   unsigned int completed : 1;                     /**< TRUE if completed */
   unsigned int timeout_added : 1;                 /**< Have added the timeout */
+  unsigned int reply_queued : 1;                  /**< A message with our reply serial may be in the incoming queue */
 };
 
 static void
@@ -102,16 +105,13 @@ static dbus_int32_t notify_user_data_slot = -1;
  * @param timeout_milliseconds length of timeout, -1 (or
  *  #DBUS_TIMEOUT_USE_DEFAULT) for default,
  *  #DBUS_TIMEOUT_INFINITE for no timeout
- * @param timeout_handler timeout handler, takes pending call as data
  * @returns a new #DBusPendingCall or #NULL if no memory.
  */
 DBusPendingCall*
 _dbus_pending_call_new_unlocked (DBusConnection    *connection,
-                                 int                timeout_milliseconds,
-                                 DBusTimeoutHandler timeout_handler)
+                                 int                timeout_milliseconds)
 {
   DBusPendingCall *pending;
-  DBusTimeout *timeout;
 
   _dbus_assert (timeout_milliseconds >= 0 || timeout_milliseconds == -1);
  
@@ -129,25 +129,7 @@ _dbus_pending_call_new_unlocked (DBusConnection    *connection,
       return NULL;
     }
 
-  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
-    {
-      timeout = _dbus_timeout_new (timeout_milliseconds,
-                                   timeout_handler,
-                                   pending, NULL);  
-
-      if (timeout == NULL)
-        {
-          dbus_pending_call_free_data_slot (&notify_user_data_slot);
-          dbus_free (pending);
-          return NULL;
-        }
-
-      pending->timeout = timeout;
-    }
-  else
-    {
-      pending->timeout = NULL;
-    }
+  pending->timeout_milliseconds = timeout_milliseconds;
 
   _dbus_atomic_inc (&pending->refcount);
   pending->connection = connection;
@@ -235,6 +217,7 @@ _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall *pending,
       _dbus_connection_queue_synthesized_message_link (connection,
 						       pending->timeout_link);
       pending->timeout_link = NULL;
+      pending->reply_queued = TRUE;
     }
 }
 
@@ -268,19 +251,89 @@ _dbus_pending_call_set_timeout_added_unlocked (DBusPendingCall  *pending,
   pending->timeout_added = is_added;
 }
 
+/**
+ * Checks whether a message with the pending call's reply serial may
+ * be in the connection's incoming queue, so that a caller blocking on
+ * the reply only needs to look for it there when one has arrived.
+ *
+ * @param pending the pending_call
+ * @returns #TRUE if a reply was queued since it was last cleared
+ */
+dbus_bool_t
+_dbus_pending_call_get_reply_queued_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->reply_queued;
+}
+
+/**
+ * Sets whether a message with the pending call's reply serial may be
+ * in the connection's incoming queue.
+ *
+ * @param pending the pending_call
+ * @param is_queued whether a reply may be queued
+ */
+void
+_dbus_pending_call_set_reply_queued_unlocked (DBusPendingCall *pending,
+                                              dbus_bool_t      is_queued)
+{
+  _dbus_assert (pending != NULL);
+
+  pending->reply_queued = is_queued;
+}
+
+
+/**
+ * Retrieves the reply timeout of the pending call
+ *
+ * @param pending the pending_call
+ * @returns the timeout in milliseconds, or #DBUS_TIMEOUT_INFINITE
+ */
+int
+_dbus_pending_call_get_timeout_interval_unlocked (DBusPendingCall  *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->timeout_milliseconds;
+}
 
 /**
- * Retrives the timeout
+ * Records the monotonic time at which the pending call times out.
+ * The connection keeps its pending calls sorted by this deadline.
  *
  * @param pending the pending_call
- * @returns a timeout object or NULL if call has no timeout
+ * @param tv_sec seconds of the deadline
+ * @param tv_usec microseconds of the deadline
  */
-DBusTimeout *
-_dbus_pending_call_get_timeout_unlocked (DBusPendingCall  *pending)
+void
+_dbus_pending_call_set_deadline_unlocked (DBusPendingCall *pending,
+                                          long             tv_sec,
+                                          long             tv_usec)
 {
   _dbus_assert (pending != NULL);
 
-  return pending->timeout;
+  pending->deadline_sec = tv_sec;
+  pending->deadline_usec = tv_usec;
+}
+
+/**
+ * Retrieves the deadline set with
+ * _dbus_pending_call_set_deadline_unlocked().
+ *
+ * @param pending the pending_call
+ * @param tv_sec return location for seconds of the deadline
+ * @param tv_usec return location for microseconds of the deadline
+ */
+void
+_dbus_pending_call_get_deadline_unlocked (DBusPendingCall *pending,
+                                          long            *tv_sec,
+                                          long            *tv_usec)
+{
+  _dbus_assert (pending != NULL);
+
+  *tv_sec = pending->deadline_sec;
+  *tv_usec = pending->deadline_usec;
 }
 
 /**
@@ -418,9 +471,6 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
   /* this assumes we aren't holding connection lock... */
   _dbus_data_slot_list_free (&pending->slot_list);
 
-  if (pending->timeout != NULL)
-    _dbus_timeout_unref (pending->timeout);
-      
   if (pending->timeout_link)
     {
       dbus_message_unref ((DBusMessage *)pending->timeout_link->data);
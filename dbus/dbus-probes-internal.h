@@ -0,0 +1,97 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-probes-internal.h - USDT tracepoints on the message path
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_PROBES_INTERNAL_H
+#define DBUS_PROBES_INTERNAL_H
+
+#include "config.h"
+#include "dbus-internals.h"
+#include "dbus-message-internal.h"
+
+/*
+ * Statically-defined tracepoints in provider "dbus", for tools such as
+ * bpftrace or SystemTap, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/bin/dbus-daemon:dbus:dispatch__start
+ *                { printf ("%s\n", str (arg4)); }'
+ *
+ * Every message probe has the arguments serial, sender, destination,
+ * interface, member and size in bytes; the strings may be NULL.
+ * _DBUS_PROBE_MESSAGE_COUNT() adds a count as a seventh argument.
+ *
+ * With DBUS_ENABLE_TRACE_RING, each probe also records the serial, size
+ * and count in the trace ring, which is printed if the process aborts.
+ *
+ * With neither, the probes expand to nothing, so their arguments are
+ * not evaluated.
+ */
+#ifdef DBUS_ENABLE_USDT
+#   include <sys/sdt.h>
+
+#   define _DBUS_USDT_MESSAGE(name, message) \
+  DTRACE_PROBE6 (dbus, name, \
+                 dbus_message_get_serial (message), \
+                 dbus_message_get_sender (message), \
+                 dbus_message_get_destination (message), \
+                 dbus_message_get_interface (message), \
+                 dbus_message_get_member (message), \
+                 _dbus_message_get_size (message))
+
+#   define _DBUS_USDT_MESSAGE_COUNT(name, message, count) \
+  DTRACE_PROBE7 (dbus, name, \
+                 dbus_message_get_serial (message), \
+                 dbus_message_get_sender (message), \
+                 dbus_message_get_destination (message), \
+                 dbus_message_get_interface (message), \
+                 dbus_message_get_member (message), \
+                 _dbus_message_get_size (message), \
+                 (count))
+#else
+#   define _DBUS_USDT_MESSAGE(name, message) do { } while (0)
+#   define _DBUS_USDT_MESSAGE_COUNT(name, message, count) do { } while (0)
+#endif /* DBUS_ENABLE_USDT */
+
+#ifdef DBUS_ENABLE_TRACE_RING
+#   include "dbus-trace-ring.h"
+
+#   define _DBUS_TRACE_RING_MESSAGE(name, message, count) \
+  _dbus_trace_ring_record (#name, \
+                           dbus_message_get_serial (message), \
+                           (dbus_uint32_t) _dbus_message_get_size (message), \
+                           (count))
+#else
+#   define _DBUS_TRACE_RING_MESSAGE(name, message, count) do { } while (0)
+#endif /* DBUS_ENABLE_TRACE_RING */
+
+#define _DBUS_PROBE_MESSAGE(name, message) do { \
+    _DBUS_USDT_MESSAGE (name, message); \
+    _DBUS_TRACE_RING_MESSAGE (name, message, -1); \
+  } while (0)
+
+#define _DBUS_PROBE_MESSAGE_COUNT(name, message, count) do { \
+    _DBUS_USDT_MESSAGE_COUNT (name, message, count); \
+    _DBUS_TRACE_RING_MESSAGE (name, message, (dbus_int32_t) (count)); \
+  } while (0)
+
+#endif /* header guard */
@@ -0,0 +1,685 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-property-cache.c  Client-side cache of a remote object's properties
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-property-cache.h"
+
+#include "dbus-bus.h"
+#include "dbus-hash.h"
+#include "dbus-internals.h"
+#include "dbus-pending-call.h"
+#include "dbus-protocol.h"
+#include "dbus-string.h"
+#include "dbus-sysdeps.h"
+
+/**
+ * @defgroup DBusPropertyCache DBusPropertyCache
+ * @ingroup  DBus
+ * @brief Client-side cache of a remote object's properties
+ *
+ * A DBusPropertyCache answers org.freedesktop.DBus.Properties.Get
+ * for one interface of one remote object without a round-trip for each
+ * lookup. It is filled by a single GetAll call and kept up to date by
+ * the PropertiesChanged signal, and it is emptied when the bus name it
+ * follows changes owner.
+ *
+ * The cache only sees signals when the connection is dispatched, so
+ * the application must dispatch it as usual. Properties that the
+ * remote object does not announce in PropertiesChanged (those with the
+ * org.freedesktop.DBus.Property.EmitsChangedSignal annotation set to
+ * "false" or "const") will not be updated; properties it announces as
+ * invalidated are fetched with Get the next time they are looked up.
+ *
+ * A cache must only be used by one thread at a time, the one that
+ * dispatches the connection.
+ *
+ * @{
+ */
+
+/**
+ * A cached property: the message it came from, and an iterator
+ * pointing to its value in that message.
+ */
+typedef struct
+{
+  DBusMessage *message;    /**< GetAll or Get reply, or PropertiesChanged */
+  DBusMessageIter value;   /**< the property's VARIANT in message */
+} CachedProperty;
+
+/**
+ * Internals of DBusPropertyCache
+ */
+struct DBusPropertyCache
+{
+  DBusAtomic refcount;             /**< reference count */
+  DBusConnection *connection;      /**< connection to the bus */
+  char *bus_name;                  /**< name of the remote object's owner */
+  char *owner;                     /**< unique name of the current owner, or #NULL if unknown */
+  char *path;                      /**< the remote object's path */
+  char *interface;                 /**< the interface whose properties are cached */
+  char *properties_rule;           /**< match rule for PropertiesChanged */
+  char *owner_rule;                /**< match rule for NameOwnerChanged */
+  DBusHashTable *properties;       /**< property name => CachedProperty */
+  DBusPendingCall *get_all;        /**< GetAll call in progress, or #NULL */
+  DBusMessage *get_all_error;      /**< error reply to the last GetAll, or #NULL */
+  unsigned int active : 1;         /**< #TRUE if the filter and match rules are in place */
+  unsigned int populated : 1;      /**< #TRUE if properties holds GetAll's result */
+};
+
+static void
+cached_property_free (void *data)
+{
+  CachedProperty *cached = data;
+
+  /* the hash table calls this with NULL when inserting a new key */
+  if (cached == NULL)
+    return;
+
+  dbus_message_unref (cached->message);
+  dbus_free (cached);
+}
+
+/* Takes a VARIANT iterator, and stores it as the value of the property */
+static dbus_bool_t
+cache_property (DBusPropertyCache *cache,
+                const char        *name,
+                DBusMessage       *message,
+                DBusMessageIter   *value)
+{
+  CachedProperty *cached;
+  char *key;
+
+  cached = dbus_new (CachedProperty, 1);
+  key = _dbus_strdup (name);
+
+  if (cached == NULL || key == NULL)
+    goto oom;
+
+  cached->message = dbus_message_ref (message);
+  cached->value = *value;
+
+  if (!_dbus_hash_table_insert_string (cache->properties, key, cached))
+    {
+      dbus_message_unref (message);
+      goto oom;
+    }
+
+  return TRUE;
+
+oom:
+  dbus_free (cached);
+  dbus_free (key);
+  return FALSE;
+}
+
+/* Stores each property in an a{sv}; returns #FALSE if out of memory
+ * or the message was malformed */
+static dbus_bool_t
+cache_dict (DBusPropertyCache *cache,
+            DBusMessage       *message,
+            DBusMessageIter   *dict)
+{
+  DBusMessageIter entry;
+
+  if (dbus_message_iter_get_arg_type (dict) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type (dict) != DBUS_TYPE_DICT_ENTRY)
+    return FALSE;
+
+  dbus_message_iter_recurse (dict, &entry);
+
+  while (dbus_message_iter_get_arg_type (&entry) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter kv;
+      const char *name;
+
+      dbus_message_iter_recurse (&entry, &kv);
+
+      if (dbus_message_iter_get_arg_type (&kv) != DBUS_TYPE_STRING)
+        return FALSE;
+
+      dbus_message_iter_get_basic (&kv, &name);
+      dbus_message_iter_next (&kv);
+
+      if (dbus_message_iter_get_arg_type (&kv) != DBUS_TYPE_VARIANT ||
+          !cache_property (cache, name, message, &kv))
+        return FALSE;
+
+      dbus_message_iter_next (&entry);
+    }
+
+  return TRUE;
+}
+
+/* Forgets everything, because the owner changed or we were told to */
+static void
+cache_clear (DBusPropertyCache *cache)
+{
+  if (cache->get_all != NULL)
+    {
+      dbus_pending_call_cancel (cache->get_all);
+      dbus_pending_call_unref (cache->get_all);
+      cache->get_all = NULL;
+    }
+
+  if (cache->get_all_error != NULL)
+    {
+      dbus_message_unref (cache->get_all_error);
+      cache->get_all_error = NULL;
+    }
+
+  _dbus_hash_table_remove_all (cache->properties);
+  cache->populated = FALSE;
+}
+
+static void
+get_all_notify (DBusPendingCall *pending,
+                void            *user_data)
+{
+  DBusPropertyCache *cache = user_data;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+
+  _dbus_assert (pending == cache->get_all);
+
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (cache->get_all);
+  cache->get_all = NULL;
+
+  if (reply == NULL)
+    return;
+
+  /* Signals that arrived before the reply are older than it, so only
+   * now do we need to know whose signals to listen to */
+  if (cache->owner == NULL &&
+      dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+      dbus_message_get_sender (reply) != NULL)
+    cache->owner = _dbus_strdup (dbus_message_get_sender (reply));
+
+  _dbus_hash_table_remove_all (cache->properties);
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+      dbus_message_iter_init (reply, &iter) &&
+      cache_dict (cache, reply, &iter))
+    {
+      cache->populated = TRUE;
+      dbus_message_unref (reply);
+    }
+  else
+    {
+      /* Out of memory or an error: lookups report the error, if any,
+       * and try again */
+      _dbus_hash_table_remove_all (cache->properties);
+
+      if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+        cache->get_all_error = reply;
+      else
+        dbus_message_unref (reply);
+    }
+}
+
+static dbus_bool_t
+start_get_all (DBusPropertyCache *cache)
+{
+  DBusMessage *call;
+  DBusPendingCall *pending = NULL;
+  dbus_bool_t ret = FALSE;
+
+  _dbus_assert (cache->get_all == NULL);
+
+  call = dbus_message_new_method_call (cache->bus_name, cache->path,
+                                       DBUS_INTERFACE_PROPERTIES, "GetAll");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call,
+                                 DBUS_TYPE_STRING, &cache->interface,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send_with_reply (cache->connection, call, &pending,
+                                        DBUS_TIMEOUT_USE_DEFAULT) ||
+      pending == NULL)
+    goto out;
+
+  if (!dbus_pending_call_set_notify (pending, get_all_notify, cache, NULL))
+    {
+      dbus_pending_call_cancel (pending);
+      dbus_pending_call_unref (pending);
+      goto out;
+    }
+
+  cache->get_all = pending;
+  ret = TRUE;
+
+out:
+  if (call != NULL)
+    dbus_message_unref (call);
+
+  return ret;
+}
+
+static void
+properties_changed (DBusPropertyCache *cache,
+                    DBusMessage       *message)
+{
+  DBusMessageIter iter, invalidated;
+  const char *interface;
+
+  if (!dbus_message_iter_init (message, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_STRING)
+    return;
+
+  dbus_message_iter_get_basic (&iter, &interface);
+
+  if (strcmp (interface, cache->interface) != 0)
+    return;
+
+  dbus_message_iter_next (&iter);
+
+  if (!cache_dict (cache, message, &iter))
+    {
+      /* Out of memory or malformed: we can't trust what we have */
+      cache_clear (cache);
+      return;
+    }
+
+  dbus_message_iter_next (&iter);
+
+  if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type (&iter) != DBUS_TYPE_STRING)
+    return;
+
+  dbus_message_iter_recurse (&iter, &invalidated);
+
+  while (dbus_message_iter_get_arg_type (&invalidated) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+
+      dbus_message_iter_get_basic (&invalidated, &name);
+      _dbus_hash_table_remove_string (cache->properties, name);
+      dbus_message_iter_next (&invalidated);
+    }
+}
+
+static DBusHandlerResult
+property_cache_filter (DBusConnection *connection,
+                       DBusMessage    *message,
+                       void           *user_data)
+{
+  DBusPropertyCache *cache = user_data;
+  const char *sender = dbus_message_get_sender (message);
+
+  if (sender == NULL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_PROPERTIES,
+                              "PropertiesChanged"))
+    {
+      if (cache->owner != NULL &&
+          strcmp (sender, cache->owner) == 0 &&
+          dbus_message_has_path (message, cache->path))
+        properties_changed (cache, message);
+    }
+  else if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                   "NameOwnerChanged") &&
+           strcmp (sender, DBUS_SERVICE_DBUS) == 0)
+    {
+      const char *name, *old_owner, *new_owner;
+
+      if (dbus_message_get_args (message, NULL,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_STRING, &old_owner,
+                                 DBUS_TYPE_STRING, &new_owner,
+                                 DBUS_TYPE_INVALID) &&
+          strcmp (name, cache->bus_name) == 0 &&
+          /* the GetAll reply may already have told us about this owner */
+          (cache->owner == NULL || strcmp (new_owner, cache->owner) != 0))
+        {
+          cache_clear (cache);
+          dbus_free (cache->owner);
+          /* if this fails, we wait for the next GetAll reply instead */
+          cache->owner = new_owner[0] != '\0' ? _dbus_strdup (new_owner) : NULL;
+        }
+    }
+
+  /* other filters and handlers might be interested too */
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static char *
+format_rule (const char *format,
+             ...)
+{
+  DBusString str;
+  va_list args;
+  char *rule = NULL;
+
+  if (!_dbus_string_init (&str))
+    return NULL;
+
+  va_start (args, format);
+
+  if (_dbus_string_append_printf_valist (&str, format, args))
+    _dbus_string_steal_data (&str, &rule);
+
+  va_end (args);
+  _dbus_string_free (&str);
+  return rule;
+}
+
+/**
+ * Creates a cache of the properties of one interface of a remote
+ * object, and starts filling it with an asynchronous GetAll call.
+ *
+ * This adds two match rules, using dbus_bus_add_match(), which blocks
+ * until the bus has replied. If the cache is created before the
+ * connection is dispatched, the first lookup will usually find GetAll's
+ * reply already waiting.
+ *
+ * @param connection a connection to a message bus
+ * @param bus_name the name of the remote object's owner
+ * @param path the remote object's path
+ * @param interface the interface whose properties are to be cached
+ * @param error error return
+ * @returns a new cache, or #NULL with error set
+ */
+DBusPropertyCache *
+dbus_property_cache_new (DBusConnection *connection,
+                         const char     *bus_name,
+                         const char     *path,
+                         const char     *interface,
+                         DBusError      *error)
+{
+  DBusPropertyCache *cache;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (bus_name != NULL, NULL);
+  _dbus_return_val_if_fail (path != NULL, NULL);
+  _dbus_return_val_if_fail (interface != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  cache = dbus_new0 (DBusPropertyCache, 1);
+
+  if (cache == NULL)
+    goto oom;
+
+  cache->refcount.value = 1;
+  cache->connection = dbus_connection_ref (connection);
+  cache->active = FALSE;
+  cache->bus_name = _dbus_strdup (bus_name);
+  cache->path = _dbus_strdup (path);
+  cache->interface = _dbus_strdup (interface);
+  cache->properties = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free,
+                                            cached_property_free);
+
+  if (cache->bus_name == NULL || cache->path == NULL ||
+      cache->interface == NULL || cache->properties == NULL)
+    goto oom;
+
+  /* A unique name never changes owner, so its signals can be trusted
+   * straight away */
+  if (bus_name[0] == ':')
+    {
+      cache->owner = _dbus_strdup (bus_name);
+
+      if (cache->owner == NULL)
+        goto oom;
+    }
+
+  cache->properties_rule = format_rule (
+      "type='signal',sender='%s',path='%s',"
+      "interface='" DBUS_INTERFACE_PROPERTIES "',"
+      "member='PropertiesChanged',arg0='%s'",
+      bus_name, path, interface);
+  cache->owner_rule = format_rule (
+      "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+      "interface='" DBUS_INTERFACE_DBUS "',"
+      "member='NameOwnerChanged',arg0='%s'",
+      bus_name);
+
+  if (cache->properties_rule == NULL || cache->owner_rule == NULL)
+    goto oom;
+
+  dbus_bus_add_match (connection, cache->properties_rule, error);
+
+  if (dbus_error_is_set (error))
+    goto failed;
+
+  dbus_bus_add_match (connection, cache->owner_rule, error);
+
+  if (dbus_error_is_set (error))
+    {
+      dbus_bus_remove_match (connection, cache->properties_rule, NULL);
+      goto failed;
+    }
+
+  if (!dbus_connection_add_filter (connection, property_cache_filter, cache,
+                                   NULL))
+    {
+      dbus_bus_remove_match (connection, cache->properties_rule, NULL);
+      dbus_bus_remove_match (connection, cache->owner_rule, NULL);
+      goto oom;
+    }
+
+  cache->active = TRUE;
+
+  /* If this fails, the first lookup will try again */
+  start_get_all (cache);
+  return cache;
+
+oom:
+  _DBUS_SET_OOM (error);
+
+failed:
+  if (cache != NULL)
+    dbus_property_cache_unref (cache);
+
+  return NULL;
+}
+
+/**
+ * Increments the reference count of a property cache.
+ *
+ * @param cache the cache
+ * @returns the cache
+ */
+DBusPropertyCache *
+dbus_property_cache_ref (DBusPropertyCache *cache)
+{
+  _dbus_return_val_if_fail (cache != NULL, NULL);
+
+  _dbus_atomic_inc (&cache->refcount);
+  return cache;
+}
+
+/**
+ * Decrements the reference count of a property cache. When it
+ * reaches zero, the cache removes its match rules, without waiting
+ * for the bus to reply, and is freed.
+ *
+ * @param cache the cache
+ */
+void
+dbus_property_cache_unref (DBusPropertyCache *cache)
+{
+  _dbus_return_if_fail (cache != NULL);
+
+  if (_dbus_atomic_dec (&cache->refcount) != 1)
+    return;
+
+  if (cache->active)
+    {
+      dbus_connection_remove_filter (cache->connection,
+                                     property_cache_filter, cache);
+      dbus_bus_remove_match (cache->connection, cache->properties_rule, NULL);
+      dbus_bus_remove_match (cache->connection, cache->owner_rule, NULL);
+    }
+
+  if (cache->properties != NULL)
+    {
+      cache_clear (cache);
+      _dbus_hash_table_unref (cache->properties);
+    }
+
+  dbus_connection_unref (cache->connection);
+  dbus_free (cache->properties_rule);
+  dbus_free (cache->owner_rule);
+  dbus_free (cache->bus_name);
+  dbus_free (cache->owner);
+  dbus_free (cache->path);
+  dbus_free (cache->interface);
+  dbus_free (cache);
+}
+
+/**
+ * Looks up a property. If the cache has not been filled yet, this
+ * blocks until the GetAll call it made has been answered. If the
+ * property is not in the cache, because it was invalidated or because
+ * GetAll did not include it, this makes a blocking Get call and caches
+ * the result.
+ *
+ * On success, message_out holds a new reference to a message, which
+ * the caller must unref, and value_iter points to the property's value
+ * in that message, as a #DBUS_TYPE_VARIANT. The iterator remains valid
+ * as long as the message does, even if the cache changes or is freed.
+ *
+ * @param cache the cache
+ * @param property the name of the property
+ * @param message_out return location for the message holding the value
+ * @param value_iter return location for an iterator pointing to the value
+ * @param error error return
+ * @returns #TRUE on success, #FALSE with error set on failure
+ */
+dbus_bool_t
+dbus_property_cache_get (DBusPropertyCache  *cache,
+                         const char         *property,
+                         DBusMessage       **message_out,
+                         DBusMessageIter    *value_iter,
+                         DBusError          *error)
+{
+  CachedProperty *cached;
+  DBusPendingCall *pending;
+  DBusMessage *call, *reply;
+  DBusMessageIter iter;
+
+  _dbus_return_val_if_fail (cache != NULL, FALSE);
+  _dbus_return_val_if_fail (property != NULL, FALSE);
+  _dbus_return_val_if_fail (message_out != NULL, FALSE);
+  _dbus_return_val_if_fail (value_iter != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!cache->populated)
+    {
+      if (cache->get_all == NULL)
+        {
+          /* an error from the last attempt has been reported already */
+          if (cache->get_all_error != NULL)
+            {
+              dbus_message_unref (cache->get_all_error);
+              cache->get_all_error = NULL;
+            }
+
+          if (!start_get_all (cache))
+            {
+              _DBUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+
+      /* This calls get_all_notify(), which drops the cache's reference */
+      pending = dbus_pending_call_ref (cache->get_all);
+      dbus_pending_call_block (pending);
+      dbus_pending_call_unref (pending);
+
+      if (cache->get_all_error != NULL)
+        {
+          dbus_set_error_from_message (error, cache->get_all_error);
+          return FALSE;
+        }
+    }
+
+  cached = _dbus_hash_table_lookup_string (cache->properties, property);
+
+  if (cached != NULL)
+    {
+      *message_out = dbus_message_ref (cached->message);
+      *value_iter = cached->value;
+      return TRUE;
+    }
+
+  call = dbus_message_new_method_call (cache->bus_name, cache->path,
+                                       DBUS_INTERFACE_PROPERTIES, "Get");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call,
+                                 DBUS_TYPE_STRING, &cache->interface,
+                                 DBUS_TYPE_STRING, &property,
+                                 DBUS_TYPE_INVALID))
+    {
+      if (call != NULL)
+        dbus_message_unref (call);
+
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (cache->connection, call,
+                                                     DBUS_TIMEOUT_USE_DEFAULT,
+                                                     error);
+  dbus_message_unref (call);
+
+  if (reply == NULL)
+    return FALSE;
+
+  if (!dbus_message_iter_init (reply, &iter) ||
+      dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_VARIANT)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_SIGNATURE,
+                      "Properties.Get reply has signature \"%s\", not \"v\"",
+                      dbus_message_get_signature (reply));
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  /* Not being able to cache it isn't fatal: we have the answer */
+  if (cache->populated)
+    cache_property (cache, property, reply, &iter);
+
+  *message_out = reply;
+  *value_iter = iter;
+  return TRUE;
+}
+
+/**
+ * Empties the cache, so that the next lookup fetches every property
+ * again with GetAll. This is only necessary if the remote object
+ * changes properties without announcing them.
+ *
+ * @param cache the cache
+ */
+void
+dbus_property_cache_invalidate (DBusPropertyCache *cache)
+{
+  _dbus_return_if_fail (cache != NULL);
+
+  cache_clear (cache);
+}
+
+/** @} */
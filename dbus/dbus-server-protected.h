@@ -96,6 +96,10 @@ dbus_bool_t _dbus_server_init_base      (DBusServer             *server,
                                          const DBusString       *address,
                                          DBusError              *error);
 void        _dbus_server_finalize_base  (DBusServer             *server);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_server_set_guid       (DBusServer             *server,
+                                         const char             *guid_hex,
+                                         DBusError              *error);
 void        _dbus_server_disconnect_unlocked (DBusServer        *server);
 dbus_bool_t _dbus_server_add_watch      (DBusServer             *server,
                                          DBusWatch              *watch);
@@ -57,6 +57,9 @@ struct DBusServerSocket
   DBusNonceFile *noncefile; /**< Nonce file used to authenticate clients */
 };
 
+/** Most clients to accept from one listening socket per main loop wakeup */
+#define MAX_ACCEPTS_PER_WAKEUP 32
+
 static void
 socket_finalize (DBusServer *server)
 {
@@ -168,6 +171,10 @@ socket_handle_watch (DBusWatch    *watch,
 
   SERVER_LOCK (server);
 
+  /* The new-connection function runs unlocked and could drop what
+   * would otherwise be the last reference */
+  _dbus_server_ref_unlocked (server);
+
 #ifndef DBUS_DISABLE_ASSERT
   for (i = 0 ; i < socket_server->n_fds ; i++)
     {
@@ -181,35 +188,48 @@ socket_handle_watch (DBusWatch    *watch,
 
   if (flags & DBUS_WATCH_READABLE)
     {
-      DBusSocket client_fd;
       DBusSocket listen_fd;
-      int saved_errno;
+      int n_accepted;
 
       listen_fd = _dbus_watch_get_socket (watch);
 
-      if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
-
-      saved_errno = _dbus_save_socket_errno ();
-
-      if (!_dbus_socket_is_valid (client_fd))
+      /* Accept a batch of clients per wakeup, so that a burst of new
+       * connections does not cost a trip around the main loop each.
+       * The batch is bounded so that existing connections still get
+       * their turn, and we stop if the new-connection function
+       * disabled our watch because a connection limit was reached. */
+      for (n_accepted = 0; n_accepted < MAX_ACCEPTS_PER_WAKEUP; n_accepted++)
         {
-          /* EINTR handled for us */
+          DBusSocket client_fd;
+          int saved_errno;
+
+          if (server->disconnected || !_dbus_watch_get_enabled (watch))
+            break;
 
-          if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
-            _dbus_verbose ("No client available to accept after all\n");
+          if (socket_server->noncefile)
+            client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror (saved_errno));
+            client_fd = _dbus_accept (listen_fd);
+
+          saved_errno = _dbus_save_socket_errno ();
+
+          if (!_dbus_socket_is_valid (client_fd))
+            {
+              /* EINTR handled for us */
+
+              if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno))
+                _dbus_verbose ("No client available to accept after all\n");
+              else
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror (saved_errno));
+
+              break;
+            }
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
             _dbus_verbose ("Rejected client connection due to lack of memory\n");
+
+          SERVER_LOCK (server);
         }
     }
 
@@ -219,6 +239,9 @@ socket_handle_watch (DBusWatch    *watch,
   if (flags & DBUS_WATCH_HANGUP)
     _dbus_verbose ("Hangup on server listening socket\n");
 
+  SERVER_UNLOCK (server);
+  dbus_server_unref (server);
+
   return TRUE;
 }
 
@@ -594,6 +617,33 @@ _dbus_server_socket_own_filename (DBusServer *server,
   socket_server->socket_name = filename;
 }
 
+/**
+ * Gets the listening sockets of a socket server, so that another
+ * process can keep accepting connections on them with
+ * _dbus_server_new_for_socket(). Servers that need a nonce file are
+ * not supported, since the nonce file is removed with the server.
+ *
+ * @param server a server
+ * @param fds_p return location for the sockets, owned by the server
+ * @param n_fds_p return location for the number of sockets
+ * @returns #FALSE if the server is not a plain socket server
+ */
+dbus_bool_t
+_dbus_server_socket_get_fds (DBusServer         *server,
+                             const DBusSocket  **fds_p,
+                             int                *n_fds_p)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+
+  if (server->vtable != &socket_vtable ||
+      socket_server->noncefile != NULL)
+    return FALSE;
+
+  *fds_p = socket_server->fds;
+  *n_fds_p = socket_server->n_fds;
+  return TRUE;
+}
+
 
 /** @} */
 
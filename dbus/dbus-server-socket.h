@@ -29,6 +29,7 @@
 
 DBUS_BEGIN_DECLS
 
+DBUS_PRIVATE_EXPORT
 DBusServer* _dbus_server_new_for_socket           (DBusSocket       *fds,
                                                    int               n_fds,
                                                    const DBusString *address,
@@ -48,8 +49,13 @@ DBusServerListenResult _dbus_server_listen_socket (DBusAddressEntry  *entry,
                                                    DBusError         *error);
 
 
+DBUS_PRIVATE_EXPORT
 void _dbus_server_socket_own_filename (DBusServer *server,
                                        char       *filename);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t _dbus_server_socket_get_fds (DBusServer         *server,
+                                         const DBusSocket  **fds_p,
+                                         int                *n_fds_p);
 
 DBUS_END_DECLS
 
@@ -26,6 +26,7 @@
 #include "dbus-internals.h"
 #include "dbus-server-win.h"
 #include "dbus-server-socket.h"
+#include "dbus-sysdeps-win.h"
 
 /**
  * @defgroup DBusServerWin DBusServer implementations for Windows
@@ -85,6 +86,29 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
           return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
         }
     }
+  else if (strcmp (method, "unix") == 0)
+    {
+      const char *path = dbus_address_entry_get_value (entry, "path");
+
+      if (path == NULL)
+        {
+          _dbus_set_bad_address (error, "unix", "path", NULL);
+          return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+        }
+
+      *server_p = _dbus_server_new_for_win_unix_socket (path, error);
+
+      if (*server_p != NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          return DBUS_SERVER_LISTEN_OK;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+    }
   else
     {
        _DBUS_ASSERT_ERROR_IS_CLEAR(error);
@@ -92,5 +116,75 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
     }
 }
 
+/**
+ * Creates a new server listening on the given AF_UNIX socket path.
+ * The socket file is removed again when the server disconnects.
+ *
+ * @param path the path for the socket file
+ * @param error location to store reason for failure.
+ * @returns the new server, or #NULL on failure.
+ */
+DBusServer *
+_dbus_server_new_for_win_unix_socket (const char *path,
+                                      DBusError  *error)
+{
+  DBusServer *server;
+  DBusSocket listen_fd;
+  DBusString address;
+  DBusString path_str;
+  char *path_copy;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&address))
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  _dbus_string_init_const (&path_str, path);
+
+  if (!_dbus_string_append (&address, "unix:path=") ||
+      !_dbus_address_append_escaped (&address, &path_str))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed_0;
+    }
+
+  path_copy = _dbus_strdup (path);
+  if (path_copy == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto failed_0;
+    }
+
+  listen_fd = _dbus_win_listen_unix_socket (path, error);
+
+  if (!_dbus_socket_is_valid (listen_fd))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_1;
+    }
+
+  server = _dbus_server_new_for_socket (&listen_fd, 1, &address, 0, error);
+  if (server == NULL)
+    goto failed_2;
+
+  _dbus_server_socket_own_filename (server, path_copy);
+  _dbus_string_free (&address);
+
+  return server;
+
+ failed_2:
+  _dbus_close_socket (listen_fd, NULL);
+  _dbus_delete_file (&path_str, NULL);
+ failed_1:
+  dbus_free (path_copy);
+ failed_0:
+  _dbus_string_free (&address);
+
+  return NULL;
+}
+
 /** @} */
 
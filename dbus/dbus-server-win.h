@@ -29,7 +29,8 @@
 
 DBUS_BEGIN_DECLS
 
-/* add definitions here */
+DBusServer *_dbus_server_new_for_win_unix_socket (const char *path,
+                                                  DBusError  *error);
 
 DBUS_END_DECLS
 
@@ -32,6 +32,8 @@
 #include "dbus-address.h"
 #include "dbus-protocol.h"
 
+#include <string.h>
+
 /**
  * @defgroup DBusServer DBusServer
  * @ingroup  DBus
@@ -225,6 +227,79 @@ _dbus_server_finalize_base (DBusServer *server)
   _dbus_string_free (&server->guid_hex);
 }
 
+/**
+ * Replaces the GUID of a server that has not published its address
+ * yet, so that a server listening on sockets taken over from another
+ * process keeps the GUID clients already have in their address.
+ *
+ * @param server the server.
+ * @param guid_hex the hex-encoded GUID
+ * @param error location to store reason for failure
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_server_set_guid (DBusServer *server,
+                       const char *guid_hex,
+                       DBusError  *error)
+{
+  DBusString hex, decoded, address;
+  char *new_address;
+  int end;
+
+  _dbus_assert (!server->published_address);
+
+  _dbus_string_init_const (&hex, guid_hex);
+
+  if (!_dbus_string_init (&decoded))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_hex_decode (&hex, 0, &end, &decoded, 0))
+    {
+      _dbus_string_free (&decoded);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (end != DBUS_UUID_LENGTH_HEX ||
+      _dbus_string_get_length (&hex) != DBUS_UUID_LENGTH_HEX ||
+      _dbus_string_get_length (&decoded) != DBUS_UUID_LENGTH_BYTES)
+    {
+      _dbus_string_free (&decoded);
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Invalid server GUID \"%s\"", guid_hex);
+      return FALSE;
+    }
+
+  /* The address ends with ",guid=" and the GUID we are replacing */
+  _dbus_string_init_const_len (&address, server->address,
+                               strlen (server->address) -
+                               DBUS_UUID_LENGTH_HEX - strlen (",guid="));
+  new_address = copy_address_with_guid_appended (&address, &hex);
+
+  if (new_address == NULL ||
+      !_dbus_string_copy (&hex, 0, &server->guid_hex, 0))
+    {
+      dbus_free (new_address);
+      _dbus_string_free (&decoded);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_string_set_length (&server->guid_hex, DBUS_UUID_LENGTH_HEX);
+  memcpy (server->guid.as_bytes, _dbus_string_get_const_data (&decoded),
+          DBUS_UUID_LENGTH_BYTES);
+  dbus_free (server->address);
+  server->address = new_address;
+  _dbus_string_free (&decoded);
+
+  _dbus_verbose ("Server is now on address %s\n", server->address);
+
+  return TRUE;
+}
+
 
 /** Function to be called in protected_change_watch() with refcount held */
 typedef dbus_bool_t (* DBusWatchAddFunction)     (DBusWatchList *list,
@@ -1190,7 +1265,6 @@ dbus_server_get_data (DBusServer   *server,
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include "dbus-test.h"
-#include <string.h>
 
 dbus_bool_t
 _dbus_server_test (void)
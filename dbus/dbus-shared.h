@@ -111,6 +111,11 @@ typedef enum
 #define DBUS_NAME_FLAG_REPLACE_EXISTING  0x2 /**< Request to replace the current primary owner */
 #define DBUS_NAME_FLAG_DO_NOT_QUEUE      0x4 /**< If we can not become the primary owner do not place us in the queue */
 
+/* Monitor flags */
+#define DBUS_MONITOR_FLAG_HEADERS_ONLY   0x1 /**< Deliver only the header of each message, without the body or file descriptors */
+#define DBUS_MONITOR_FLAG_LOSSY          0x2 /**< If the monitor falls behind, drop the oldest messages queued for it and report how many were dropped */
+#define DBUS_MONITOR_SAMPLE_SHIFT        16  /**< The top 16 bits of the flags are N: if greater than 1, deliver only one message in every N */
+
 /* Replies to request for a name */
 #define DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER  1 /**< Service has become the primary owner of the requested name */
 #define DBUS_REQUEST_NAME_REPLY_IN_QUEUE       2 /**< Service could not become the primary owner and has been placed in the queue */
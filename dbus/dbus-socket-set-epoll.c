@@ -34,14 +34,28 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+/* What we last told the kernel about an fd, and what we want it to be */
+typedef struct {
+    uint32_t applied;
+    uint32_t wanted;
+    unsigned int added : 1;
+    unsigned int queued : 1;
+} EpollInterest;
+
 typedef struct {
     DBusSocketSet parent;
     int epfd;
+    /* indexed by fd; both arrays have n_interests elements */
+    EpollInterest *interests;
+    int *dirty;
+    int n_interests;
+    int n_dirty;
 } DBusSocketSetEpoll;
 
 static inline DBusSocketSetEpoll *
@@ -63,6 +77,8 @@ socket_set_epoll_free (DBusSocketSet *set)
   if (self->epfd != -1)
     close (self->epfd);
 
+  dbus_free (self->interests);
+  dbus_free (self->dirty);
   dbus_free (self);
 }
 
@@ -104,6 +120,48 @@ _dbus_socket_set_epoll_new (void)
   return (DBusSocketSet *) self;
 }
 
+/* Make room to track fd; this is where adding a socket can run out of
+ * memory, so that enabling and disabling it later cannot */
+static dbus_bool_t
+ensure_interests (DBusSocketSetEpoll *self,
+                  DBusPollable        fd)
+{
+  EpollInterest *interests;
+  int *dirty;
+  int n;
+
+  if (fd < 0)
+    return TRUE; /* let epoll_ctl() complain about it */
+
+  if (fd < self->n_interests)
+    return TRUE;
+
+  n = MAX (fd + 1, self->n_interests * 2);
+  n = MAX (n, 64);
+
+  interests = dbus_realloc (self->interests, n * sizeof (EpollInterest));
+
+  if (interests == NULL)
+    return FALSE;
+
+  memset (interests + self->n_interests, 0,
+          (n - self->n_interests) * sizeof (EpollInterest));
+  self->interests = interests;
+
+  dirty = dbus_realloc (self->dirty, n * sizeof (int));
+
+  if (dirty == NULL)
+    {
+      /* keep the larger table, but only use as much of it as we can
+       * queue changes for */
+      return FALSE;
+    }
+
+  self->dirty = dirty;
+  self->n_interests = n;
+  return TRUE;
+}
+
 static uint32_t
 watch_flags_to_epoll_events (unsigned int flags)
 {
@@ -144,6 +202,9 @@ socket_set_epoll_add (DBusSocketSet  *set,
   struct epoll_event event;
   int err;
 
+  if (!ensure_interests (self, fd))
+    return FALSE;
+
   _DBUS_ZERO (event);
   event.data.fd = fd;
 
@@ -159,7 +220,14 @@ socket_set_epoll_add (DBusSocketSet  *set,
     }
 
   if (epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event) == 0)
-    return TRUE;
+    {
+      EpollInterest *interest = &self->interests[fd];
+
+      interest->applied = event.events;
+      interest->wanted = event.events;
+      interest->added = TRUE;
+      return TRUE;
+    }
 
   /* Anything except ENOMEM, ENOSPC means we have an internal error. */
   err = errno;
@@ -189,44 +257,42 @@ socket_set_epoll_add (DBusSocketSet  *set,
 }
 
 static void
-socket_set_epoll_enable (DBusSocketSet  *set,
-                         DBusPollable    fd,
-                         unsigned int    flags)
+set_wanted_events (DBusSocketSetEpoll *self,
+                   DBusPollable        fd,
+                   uint32_t            events)
 {
-  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
-
-  _DBUS_ZERO (event);
-  event.data.fd = fd;
-  event.events = watch_flags_to_epoll_events (flags);
+  EpollInterest *interest;
 
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
+  if (fd < 0 || fd >= self->n_interests || !self->interests[fd].added)
+    {
+      _dbus_warn ("fd %d enabled before it was added", fd);
+      return;
+    }
 
-  err = errno;
+  interest = &self->interests[fd];
+  interest->wanted = events;
 
-  /* Enabling a file descriptor isn't allowed to fail, even for OOM, so we
-   * do our best to avoid all of these. */
-  switch (err)
+  if (!interest->queued && interest->wanted != interest->applied)
     {
-      case EBADF:
-        _dbus_warn ("Bad fd %d", fd);
-        break;
-
-      case ENOENT:
-        _dbus_warn ("fd %d enabled before it was added", fd);
-        break;
+      /* each fd is queued at most once, so this can't overflow */
+      _dbus_assert (self->n_dirty < self->n_interests);
+      self->dirty[self->n_dirty++] = fd;
+      interest->queued = TRUE;
+    }
+}
 
-      case ENOMEM:
-        _dbus_warn ("Insufficient memory to change watch for fd %d", fd);
-        break;
+static void
+socket_set_epoll_enable (DBusSocketSet  *set,
+                         DBusPollable    fd,
+                         unsigned int    flags)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
 
-      default:
-        _dbus_warn ("Misc error when trying to watch fd %d: %s", fd,
-                    strerror (err));
-        break;
-    }
+  /* The kernel is only told in socket_set_epoll_poll(), so that a watch
+   * that is enabled and disabled again while dispatching (as the write
+   * watch is, whenever a queued message gets written out straight away)
+   * costs no epoll_ctl() at all. */
+  set_wanted_events (self, fd, watch_flags_to_epoll_events (flags));
 }
 
 static void
@@ -234,8 +300,6 @@ socket_set_epoll_disable (DBusSocketSet  *set,
                           DBusPollable    fd)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event event;
-  int err;
 
   /* The naive thing to do would be EPOLL_CTL_DEL, but that'll probably
    * free resources in the kernel. When we come to do socket_set_epoll_enable,
@@ -253,16 +317,63 @@ socket_set_epoll_disable (DBusSocketSet  *set,
    * work on 2.6.32). Compile this file with -DTEST_BEHAVIOUR_OF_EPOLLET for
    * test code.
    */
-  _DBUS_ZERO (event);
-  event.data.fd = fd;
-  event.events = EPOLLET;
+  set_wanted_events (self, fd, EPOLLET);
+}
 
-  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
-    return;
+/* Push the interest changes queued since the last poll to the kernel */
+static void
+flush_wanted_events (DBusSocketSetEpoll *self)
+{
+  int i;
 
-  err = errno;
-  _dbus_warn ("Error when trying to watch fd %d: %s", fd,
-              strerror (err));
+  for (i = 0; i < self->n_dirty; i++)
+    {
+      int fd = self->dirty[i];
+      EpollInterest *interest = &self->interests[fd];
+      struct epoll_event event;
+      int err;
+
+      interest->queued = FALSE;
+
+      if (!interest->added || interest->wanted == interest->applied)
+        continue;
+
+      _DBUS_ZERO (event);
+      event.data.fd = fd;
+      event.events = interest->wanted;
+
+      if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
+        {
+          interest->applied = interest->wanted;
+          continue;
+        }
+
+      err = errno;
+
+      /* Enabling a file descriptor isn't allowed to fail, even for OOM, so we
+       * do our best to avoid all of these. */
+      switch (err)
+        {
+          case EBADF:
+            _dbus_warn ("Bad fd %d", fd);
+            break;
+
+          case ENOENT:
+            _dbus_warn ("fd %d enabled before it was added", fd);
+            break;
+
+          case ENOMEM:
+            _dbus_warn ("Insufficient memory to change watch for fd %d", fd);
+            break;
+
+          default:
+            _dbus_warn ("Misc error when trying to watch fd %d: %s", fd,
+                        strerror (err));
+            break;
+        }
+    }
+
+  self->n_dirty = 0;
 }
 
 static void
@@ -276,6 +387,11 @@ socket_set_epoll_remove (DBusSocketSet  *set,
   struct epoll_event dummy;
   _DBUS_ZERO (dummy);
 
+  /* This can't wait for the next poll: the fd is probably about to be
+   * closed, and its number reused */
+  if (fd >= 0 && fd < self->n_interests)
+    self->interests[fd].added = FALSE;
+
   if (epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, &dummy) == 0)
     return;
 
@@ -301,6 +417,8 @@ socket_set_epoll_poll (DBusSocketSet   *set,
 
   _dbus_assert (max_events > 0);
 
+  flush_wanted_events (self);
+
   n_ready = epoll_wait (self->epfd, events,
                         MIN (_DBUS_N_ELEMENTS (events), max_events),
                         timeout_ms);
@@ -25,6 +25,7 @@
 #include <config.h>
 #include "dbus-socket-set.h"
 
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
@@ -38,6 +39,10 @@ typedef struct {
     int                n_fds;
     int                n_reserved;
     int                n_allocated;
+    /* DBusPollable => 1 + its index in fds if enabled, or NULL, for
+     * each fd that was added, so enabling and disabling do not have to
+     * search fds */
+    DBusHashTable     *index;
 } DBusSocketSetPoll;
 
 #define REALLOC_INCREMENT 8
@@ -63,6 +68,9 @@ socket_set_poll_free (DBusSocketSet *set)
 {
   DBusSocketSetPoll *self = socket_set_poll_cast (set);
 
+  if (self->index != NULL)
+    _dbus_hash_table_unref (self->index);
+
   dbus_free (self->fds);
   dbus_free (self);
   _dbus_verbose ("freed socket set %p\n", self);
@@ -86,8 +94,9 @@ _dbus_socket_set_poll_new (int size_hint)
   ret->n_allocated = size_hint;
 
   ret->fds = dbus_new0 (DBusPollFD, size_hint);
+  ret->index = _dbus_hash_table_new (DBUS_HASH_POLLABLE, NULL, NULL);
 
-  if (ret->fds == NULL)
+  if (ret->fds == NULL || ret->index == NULL)
     {
       /* socket_set_poll_free specifically supports half-constructed
        * socket sets */
@@ -112,6 +121,29 @@ watch_flags_to_poll_events (unsigned int flags)
   return events;
 }
 
+static int
+get_index (DBusSocketSetPoll *self,
+           DBusPollable       fd)
+{
+  return _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_pollable (self->index,
+                                                                 fd)) - 1;
+}
+
+/* fd is already in the table, so this only replaces a value and
+ * cannot fail */
+static void
+set_index (DBusSocketSetPoll *self,
+           DBusPollable       fd,
+           int                i)
+{
+  dbus_bool_t ok;
+
+  ok = _dbus_hash_table_insert_pollable (self->index, fd,
+                                         _DBUS_INT_TO_POINTER (i + 1));
+  _dbus_assert (ok);
+  (void) ok;
+}
+
 static dbus_bool_t
 socket_set_poll_add (DBusSocketSet  *set,
                      DBusPollable    fd,
@@ -119,12 +151,8 @@ socket_set_poll_add (DBusSocketSet  *set,
                      dbus_bool_t     enabled)
 {
   DBusSocketSetPoll *self = socket_set_poll_cast (set);
-#ifndef DBUS_DISABLE_ASSERT
-  int i;
 
-  for (i = 0; i < self->n_fds; i++)
-    _dbus_assert (!_dbus_pollable_equals (self->fds[i].fd, fd));
-#endif
+  _dbus_assert (_dbus_hash_table_lookup_pollable (self->index, fd) == NULL);
 
   if (self->n_reserved >= self->n_allocated)
     {
@@ -147,12 +175,17 @@ socket_set_poll_add (DBusSocketSet  *set,
   _dbus_assert (self->n_reserved >= self->n_fds);
   _dbus_assert (self->n_allocated > self->n_reserved);
 
+  if (!_dbus_hash_table_insert_pollable (self->index, fd,
+                                         _DBUS_INT_TO_POINTER (0)))
+    return FALSE;
+
   self->n_reserved++;
 
   if (enabled)
     {
       self->fds[self->n_fds].fd = fd;
       self->fds[self->n_fds].events = watch_flags_to_poll_events (flags);
+      set_index (self, fd, self->n_fds);
       self->n_fds++;
     }
 
@@ -167,13 +200,13 @@ socket_set_poll_enable (DBusSocketSet *set,
   DBusSocketSetPoll *self = socket_set_poll_cast (set);
   int i;
 
-  for (i = 0; i < self->n_fds; i++)
+  i = get_index (self, fd);
+
+  if (i >= 0)
     {
-      if (_dbus_pollable_equals (self->fds[i].fd, fd))
-        {
-          self->fds[i].events = watch_flags_to_poll_events (flags);
-          return;
-        }
+      _dbus_assert (_dbus_pollable_equals (self->fds[i].fd, fd));
+      self->fds[i].events = watch_flags_to_poll_events (flags);
+      return;
     }
 
   /* we allocated space when the socket was added */
@@ -182,6 +215,7 @@ socket_set_poll_enable (DBusSocketSet *set,
 
   self->fds[self->n_fds].fd = fd;
   self->fds[self->n_fds].events = watch_flags_to_poll_events (flags);
+  set_index (self, fd, self->n_fds);
   self->n_fds++;
 }
 
@@ -192,20 +226,22 @@ socket_set_poll_disable (DBusSocketSet *set,
   DBusSocketSetPoll *self = socket_set_poll_cast (set);
   int i;
 
-  for (i = 0; i < self->n_fds; i++)
-    {
-      if (_dbus_pollable_equals (self->fds[i].fd, fd))
-        {
-          if (i != self->n_fds - 1)
-            {
-              self->fds[i].fd = self->fds[self->n_fds - 1].fd;
-              self->fds[i].events = self->fds[self->n_fds - 1].events;
-            }
+  i = get_index (self, fd);
 
-          self->n_fds--;
-          return;
-        }
+  if (i < 0)
+    return;
+
+  _dbus_assert (_dbus_pollable_equals (self->fds[i].fd, fd));
+
+  if (i != self->n_fds - 1)
+    {
+      self->fds[i].fd = self->fds[self->n_fds - 1].fd;
+      self->fds[i].events = self->fds[self->n_fds - 1].events;
+      set_index (self, self->fds[i].fd, i);
     }
+
+  set_index (self, fd, -1);
+  self->n_fds--;
 }
 
 static void
@@ -215,6 +251,7 @@ socket_set_poll_remove (DBusSocketSet *set,
   DBusSocketSetPoll *self = socket_set_poll_cast (set);
 
   socket_set_poll_disable (set, fd);
+  _dbus_hash_table_remove_pollable (self->index, fd);
   self->n_reserved--;
 
   _dbus_verbose ("after removing fd %" DBUS_POLLABLE_FORMAT " from %p, %d en/%d res/%d alloc\n",
@@ -278,9 +315,7 @@ socket_set_poll_poll (DBusSocketSet   *set,
 
   _dbus_assert (max_events > 0);
 
-  for (i = 0; i < self->n_fds; i++)
-    self->fds[i].revents = 0;
-
+  /* _dbus_poll() sets every revents when it succeeds */
   n_ready = _dbus_poll (self->fds, self->n_fds, timeout_ms);
 
   if (n_ready <= 0)
@@ -288,7 +323,8 @@ socket_set_poll_poll (DBusSocketSet   *set,
 
   n_events = 0;
 
-  for (i = 0; i < self->n_fds; i++)
+  /* Stop looking once we have seen every descriptor that is ready */
+  for (i = 0; i < self->n_fds && n_events < n_ready; i++)
     {
       if (self->fds[i].revents != 0)
         {
@@ -993,15 +993,35 @@ do_write (int fd, const void *buf, size_t count)
 
 static void write_err_and_exit (int fd, int msg) _DBUS_GNUC_NORETURN;
 
+/*
+ * Reports a failure in the grandchild to the parent. This can run in a
+ * vfork()ed child, so unlike do_write() it only makes async-signal-safe
+ * system calls, and gives up silently if the parent has gone away.
+ */
 static void
 write_err_and_exit (int fd, int msg)
 {
-  int en = errno;
+  int data[2] = { msg, errno };
+  size_t bytes_written = 0;
 
-  do_write (fd, &msg, sizeof (msg));
-  do_write (fd, &en, sizeof (en));
+  while (bytes_written < sizeof (data))
+    {
+      ssize_t ret = write (fd, ((const char *) data) + bytes_written,
+                           sizeof (data) - bytes_written);
 
-  exit (1);
+      if (ret < 0 && errno == EINTR)
+        continue;
+
+      if (ret <= 0)
+        break;
+
+      bytes_written += ret;
+    }
+
+  /* Not exit(), which would run our parent's atexit handlers and flush
+   * its stdio buffers; and in a vfork()ed grandchild, that would be
+   * done to memory that the babysitter is still using */
+  _exit (1);
 }
 
 static void
@@ -1030,28 +1050,36 @@ static void do_exec (int                       child_err_report_fd,
                      char             * const *argv,
                      char             * const *envp,
                      DBusSpawnChildSetupFunc   child_setup,
-                     void                     *user_data) _DBUS_GNUC_NORETURN;
+                     void                     *user_data,
+                     dbus_bool_t               vforked) _DBUS_GNUC_NORETURN;
 
 static void
 do_exec (int                       child_err_report_fd,
 	 char             * const *argv,
 	 char             * const *envp,
 	 DBusSpawnChildSetupFunc   child_setup,
-	 void                     *user_data)
+	 void                     *user_data,
+	 dbus_bool_t               vforked)
 {
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   int i, max_open;
 #endif
 
-  _dbus_verbose_reset ();
-  _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
-                 _dbus_getpid ());
+  if (!vforked)
+    {
+      _dbus_verbose_reset ();
+      _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
+                     _dbus_getpid ());
+    }
 
   if (child_setup)
-    (* child_setup) (user_data);
+    {
+      _dbus_assert (!vforked);
+      (* child_setup) (user_data);
+    }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
-  max_open = sysconf (_SC_OPEN_MAX);
+  max_open = vforked ? 0 : sysconf (_SC_OPEN_MAX);
 
   for (i = 3; i < max_open; i++)
     {
@@ -1081,6 +1109,82 @@ do_exec (int                       child_err_report_fd,
                       CHILD_EXEC_FAILED);
 }
 
+static void exec_grandchild (int                       child_err_report_fd,
+                             int                       parent_pipe,
+                             int                       fd_out,
+                             int                       fd_err,
+                             char             * const *argv,
+                             char             * const *envp,
+                             DBusSpawnChildSetupFunc   child_setup,
+                             void                     *user_data,
+                             dbus_bool_t               vforked) _DBUS_GNUC_NORETURN;
+
+/*
+ * Set up the grandchild and exec() it. If @vforked, this is running in
+ * a vfork()ed child that shares the babysitter's memory, so it must
+ * only touch its own arguments and locals, never the babysitter's
+ * variables, must only make async-signal-safe system calls (no logging,
+ * no child_setup), and must leave with exec() or _exit().
+ */
+static void
+exec_grandchild (int                       child_err_report_fd,
+                 int                       parent_pipe,
+                 int                       fd_out,
+                 int                       fd_err,
+                 char             * const *argv,
+                 char             * const *envp,
+                 DBusSpawnChildSetupFunc   child_setup,
+                 void                     *user_data,
+                 dbus_bool_t               vforked)
+{
+#ifdef __linux__
+  int fd = -1;
+
+#ifdef O_CLOEXEC
+  fd = open ("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+#endif
+
+  if (fd < 0)
+    {
+      fd = open ("/proc/self/oom_score_adj", O_WRONLY);
+
+      if (fd >= 0)
+        fcntl (fd, F_SETFD, FD_CLOEXEC);
+    }
+
+  if (fd >= 0)
+    {
+      if (write (fd, "0", sizeof (char)) < 0 && !vforked)
+        _dbus_warn ("writing oom_score_adj error: %s", strerror (errno));
+      close (fd);
+    }
+#endif
+  /* Go back to ignoring SIGPIPE, since it's evil
+   */
+  signal (SIGPIPE, SIG_IGN);
+
+  close (parent_pipe);
+
+  /* Redirect stdout, stderr to systemd Journal or /dev/null
+   * as requested, if possible */
+  if (fd_out >= 0)
+    {
+      dup2 (fd_out, STDOUT_FILENO);
+      close (fd_out);
+    }
+  if (fd_err >= 0)
+    {
+      dup2 (fd_err, STDERR_FILENO);
+      close (fd_err);
+    }
+
+  do_exec (child_err_report_fd,
+           argv,
+           envp,
+           child_setup, user_data,
+           vforked);
+}
+
 static void
 check_babysit_events (pid_t grandchild_pid,
                       int   parent_pipe,
@@ -1231,7 +1335,9 @@ babysit (pid_t grandchild_pid,
  *
  * On Unix platforms, the child_setup function is passed the given
  * user_data and is run in the child after fork() but before calling exec().
- * This can be used to change uid, resource limits and so on.
+ * This can be used to change uid, resource limits and so on. The child
+ * is only started with vfork() when there is no child_setup function,
+ * so child_setup is free to log or allocate.
  * On Windows, this functionality does not fit the multi-processing model
  * (Windows does the equivalent of fork() and exec() in a single API call),
  * and the child_setup function and its user_data are ignored.
@@ -1403,6 +1509,7 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
     {
       /* Immediate child, this is the babysitter process. */
       int grandchild_pid;
+      dbus_bool_t use_vfork = FALSE;
 
       /* Be sure we crash if the parent exits
        * and we write to the err_report_pipe
@@ -1416,8 +1523,20 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       fflush (stdout);
       fflush (stderr);
 
-      /* Create the child that will exec () */
-      grandchild_pid = fork ();
+      /* Create the child that will exec (). We are a copy of the whole
+       * parent process, so fork() would copy its page tables a second
+       * time; with vfork() the grandchild borrows ours until it execs.
+       * The vfork()ed child may only make async-signal-safe system
+       * calls, so a child_setup function, which is free to log or
+       * allocate, or verbose logging mean we need a real fork(). */
+#ifdef HAVE_VFORK
+      use_vfork = (child_setup == NULL && !_dbus_is_verbose ());
+#endif
+
+      if (use_vfork)
+        grandchild_pid = vfork ();
+      else
+        grandchild_pid = fork ();
 
       if (grandchild_pid < 0)
 	{
@@ -1426,48 +1545,13 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
           _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
 	}
       else if (grandchild_pid == 0)
-      {
-#ifdef __linux__
-          int fd = -1;
-
-#ifdef O_CLOEXEC
-          fd = open ("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
-#endif
-
-          if (fd < 0)
-            {
-              fd = open ("/proc/self/oom_score_adj", O_WRONLY);
-              _dbus_fd_set_close_on_exec (fd);
-            }
-
-          if (fd >= 0)
-            {
-              if (write (fd, "0", sizeof (char)) < 0)
-                _dbus_warn ("writing oom_score_adj error: %s", strerror (errno));
-              _dbus_close (fd, NULL);
-            }
-#endif
-          /* Go back to ignoring SIGPIPE, since it's evil
-           */
-          signal (SIGPIPE, SIG_IGN);
-
-          close_and_invalidate (&babysitter_pipe[1].fd);
-
-          /* Redirect stdout, stderr to systemd Journal or /dev/null
-           * as requested, if possible */
-	  if (fd_out >= 0)
-            dup2 (fd_out, STDOUT_FILENO);
-	  if (fd_err >= 0)
-            dup2 (fd_err, STDERR_FILENO);
-          close_and_invalidate (&fd_out);
-          close_and_invalidate (&fd_err);
-
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   env,
-		   child_setup, user_data);
+        {
+          exec_grandchild (child_err_report_pipe[WRITE_END],
+                           babysitter_pipe[1].fd, fd_out, fd_err,
+                           argv, env, child_setup, user_data,
+                           use_vfork);
           _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
-	}
+        }
       else
 	{
           close_and_invalidate (&child_err_report_pipe[WRITE_END]);
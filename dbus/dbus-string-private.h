@@ -49,6 +49,7 @@ typedef struct
   unsigned int   locked : 1;     /**< DBusString has been locked and can't be changed */
   unsigned int   valid : 1;      /**< DBusString is valid (initialized and not freed) */
   unsigned int   align_offset : 3; /**< str - align_offset is the actual malloc block */
+  unsigned int   borrowed : 1;   /**< Block is a caller-supplied buffer, not malloc'd */
 } DBusRealString;
 
 _DBUS_STATIC_ASSERT (sizeof (DBusRealString) == sizeof (DBusString));
@@ -864,6 +864,65 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  {
+    char buffer[24];
+    char *stolen;
+
+    _dbus_string_init_with_buffer (&str, buffer, sizeof (buffer));
+
+    if (!_dbus_string_append (&str, "abcdefghij"))
+      _dbus_test_fatal ("failed to append to buffer");
+
+    /* peek inside to make sure we didn't allocate */
+    if (!((DBusRealString *) &str)->borrowed)
+      _dbus_test_fatal ("short string left the caller's buffer");
+
+    if (!_dbus_string_init (&other))
+      _dbus_test_fatal ("no memory");
+
+    /* moving copies, so the buffer stays with str */
+    if (!_dbus_string_move (&str, 0, &other, 0))
+      _dbus_test_fatal ("failed to move out of buffer");
+
+    if (!((DBusRealString *) &str)->borrowed ||
+        ((DBusRealString *) &other)->borrowed)
+      _dbus_test_fatal ("buffer was moved to another string");
+
+    if (_dbus_string_get_length (&str) != 0 ||
+        !_dbus_string_equal_c_str (&other, "abcdefghij"))
+      _dbus_test_fatal ("unexpected content after move");
+
+    _dbus_string_free (&other);
+
+    /* growing past the buffer spills to the heap */
+    if (!_dbus_string_append (&str, "abcdefghijklmnopqrstuvwxyz"))
+      _dbus_test_fatal ("failed to append past buffer");
+
+    if (((DBusRealString *) &str)->borrowed)
+      _dbus_test_fatal ("long string stayed in the caller's buffer");
+
+    if (!_dbus_string_equal_c_str (&str, "abcdefghijklmnopqrstuvwxyz"))
+      _dbus_test_fatal ("unexpected content after growing");
+
+    _dbus_string_free (&str);
+
+    /* stealing copies */
+    _dbus_string_init_with_buffer (&str, buffer, sizeof (buffer));
+
+    if (!_dbus_string_append (&str, "hello"))
+      _dbus_test_fatal ("failed to append to buffer");
+
+    if (!_dbus_string_steal_data (&str, &stolen))
+      _dbus_test_fatal ("failed to steal from buffer");
+
+    if (strcmp (stolen, "hello") != 0 ||
+        _dbus_string_get_length (&str) != 0)
+      _dbus_test_fatal ("unexpected content after steal");
+
+    dbus_free (stolen);
+    _dbus_string_free (&str);
+  }
+
   {
     const char two_strings[] = "one\ttwo";
 
@@ -158,12 +158,55 @@ _dbus_string_init_preallocated (DBusString *str,
   real->locked = FALSE;
   real->valid = TRUE;
   real->align_offset = 0;
+  real->borrowed = FALSE;
   
   fixup_alignment (real);
   
   return TRUE;
 }
 
+/**
+ * Initializes a string that keeps its data in a buffer supplied by
+ * the caller, typically on the stack, until it grows too long for
+ * it; then it moves to the heap like any other string. Short-lived
+ * strings that usually stay short can avoid malloc() this way.
+ *
+ * The string starts life with zero length. It must still be freed
+ * with _dbus_string_free(), which never frees the buffer itself, and
+ * the buffer must outlive the string. Its data never moves to another
+ * string: _dbus_string_move() and _dbus_string_steal_data() copy it.
+ *
+ * @param str memory to hold the string
+ * @param buffer storage for the string data
+ * @param buffer_size size of buffer; up to 8 bytes of it are padding
+ */
+void
+_dbus_string_init_with_buffer (DBusString *str,
+                               char       *buffer,
+                               int         buffer_size)
+{
+  DBusRealString *real;
+
+  _dbus_assert (str != NULL);
+  _dbus_assert (buffer != NULL);
+  _dbus_assert (buffer_size > _DBUS_STRING_ALLOCATION_PADDING);
+
+  real = (DBusRealString*) str;
+
+  real->str = (unsigned char*) buffer;
+  real->allocated = buffer_size;
+  real->len = 0;
+  real->str[real->len] = '\0';
+
+  real->constant = FALSE;
+  real->locked = FALSE;
+  real->valid = TRUE;
+  real->align_offset = 0;
+  real->borrowed = TRUE;
+
+  fixup_alignment (real);
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -227,6 +270,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->valid = TRUE;
   real->align_offset = 0;
+  real->borrowed = FALSE;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -271,7 +315,7 @@ _dbus_string_free (DBusString *str)
   /* Allow for the _DBUS_STRING_INIT_INVALID case */
   if (real->str == NULL && real->len == 0 && real->allocated == 0 &&
       !real->constant && !real->locked && !real->valid &&
-      real->align_offset == 0)
+      real->align_offset == 0 && !real->borrowed)
     return;
 
   DBUS_GENERIC_STRING_PREAMBLE (real);
@@ -286,6 +330,10 @@ _dbus_string_free (DBusString *str)
   if (real->str == NULL)
     goto wipe;
 
+  /* the caller owns the buffer */
+  if (real->borrowed)
+    goto wipe;
+
   dbus_free (real->str - real->align_offset);
 
 wipe:
@@ -306,6 +354,10 @@ compact (DBusRealString *real,
   if (waste <= max_waste)
     return TRUE;
 
+  /* nothing to give back to malloc */
+  if (real->borrowed)
+    return TRUE;
+
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
   new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
@@ -380,9 +432,24 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
-  if (_DBUS_UNLIKELY (new_str == NULL))
-    return FALSE;
+
+  if (real->borrowed)
+    {
+      /* outgrew the caller's buffer, move to the heap */
+      new_str = dbus_malloc (new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+
+      memcpy (new_str, real->str, real->len + 1);
+      real->align_offset = 0;
+      real->borrowed = FALSE;
+    }
+  else
+    {
+      new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+    }
 
   real->str = new_str + real->align_offset;
   real->allocated = new_allocated;
@@ -661,6 +728,17 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  if (real->borrowed)
+    {
+      /* the caller's buffer can't be handed out, so copy it */
+      if (!_dbus_string_copy_data (str, data_return))
+        return FALSE;
+
+      real->len = 0;
+      real->str[real->len] = '\0';
+      return TRUE;
+    }
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -787,6 +865,32 @@ _dbus_string_lengthen (DBusString *str,
                      real->len + additional_length);
 }
 
+/**
+ * Makes sure the string can be lengthened by the given number of bytes
+ * without reallocating. The length and contents are unchanged. Use
+ * this before appending many small items whose total size is known
+ * or can be estimated.
+ *
+ * @param str a string
+ * @param additional_length bytes that will be appended
+ * @returns #FALSE if no memory, or the result would be too long
+ */
+dbus_bool_t
+_dbus_string_reserve (DBusString *str,
+                      int         additional_length)
+{
+  DBUS_STRING_PREAMBLE (str);
+  _dbus_assert (additional_length >= 0);
+
+  if (_DBUS_UNLIKELY (additional_length > _DBUS_STRING_MAX_LENGTH - real->len))
+    return FALSE; /* would overflow */
+
+  if (real->len + additional_length <= real->allocated - _DBUS_STRING_ALLOCATION_PADDING)
+    return TRUE;
+
+  return reallocate_for_length (real, real->len + additional_length);
+}
+
 /**
  * Makes a string shorter by the given number of bytes.
  *
@@ -1340,10 +1444,13 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->borrowed &&
+           !real_dest->borrowed)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers. Caller-supplied buffers must stay
+       * with their own string, so those are copied instead.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
@@ -2553,6 +2660,10 @@ _dbus_string_toupper_ascii (const DBusString *str,
     }
 }
 
+/* 0x01 and 0x80 in every byte of a size_t */
+#define UTF8_WORD_ONES  (((size_t) -1) / 0xff)
+#define UTF8_WORD_HIGHS (UTF8_WORD_ONES * 0x80)
+
 /**
  * Checks that the given range of the string is valid UTF-8. If the
  * given range is not entirely contained in the string, returns
@@ -2612,6 +2723,24 @@ _dbus_string_validate_utf8  (const DBusString *str,
       if (*p < 128)
         {
           ++p;
+
+          /* Skip runs of ASCII a machine word at a time. A word is
+           * all non-nul ASCII iff no byte has its high bit set either
+           * before or after subtracting 1 from every byte; any word
+           * failing the test is left to the byte-wise loop.
+           */
+          while ((size_t) (end - p) >= sizeof (size_t))
+            {
+              size_t word;
+
+              memcpy (&word, p, sizeof (word));
+
+              if ((word | (word - UTF8_WORD_ONES)) & UTF8_WORD_HIGHS)
+                break;
+
+              p += sizeof (word);
+            }
+
           continue;
         }
       
@@ -52,6 +52,7 @@ struct DBusString
   unsigned int dummy_bit2 : 1; /**< placeholder */
   unsigned int dummy_bit3 : 1; /**< placeholder */
   unsigned int dummy_bits : 3; /**< placeholder */
+  unsigned int dummy_bit4 : 1; /**< placeholder */
 };
 
 /**
@@ -67,7 +68,8 @@ struct DBusString
   0, /* dummy_bit1 */ \
   0, /* dummy_bit2 */ \
   0, /* dummy_bit3 */ \
-  0 /* dummy_bits */ \
+  0, /* dummy_bits */ \
+  0 /* dummy_bit4 */ \
 }
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -95,6 +97,10 @@ void          _dbus_string_init_const_len        (DBusString        *str,
 DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+DBUS_PRIVATE_EXPORT
+void          _dbus_string_init_with_buffer      (DBusString        *str,
+                                                  char              *buffer,
+                                                  int                buffer_size);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_string_init_from_string        (DBusString        *str,
@@ -189,6 +195,9 @@ DBUS_PRIVATE_EXPORT
 dbus_bool_t   _dbus_string_lengthen              (DBusString        *str,
                                                   int                additional_length);
 DBUS_PRIVATE_EXPORT
+dbus_bool_t   _dbus_string_reserve               (DBusString        *str,
+                                                  int                additional_length);
+DBUS_PRIVATE_EXPORT
 void          _dbus_string_shorten               (DBusString        *str,
                                                   int                length_to_remove);
 DBUS_PRIVATE_EXPORT
@@ -79,17 +79,44 @@ struct DBusCondVar {
 } while (0)
 #endif /* !DBUS_DISABLE_ASSERT */
 
+/* glibc can spin briefly on a contended mutex before sleeping in the
+ * kernel, which suits locks that are only ever held for a short time;
+ * it only does that for non-recursive mutexes */
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+#define DBUS_CMUTEX_TYPE PTHREAD_MUTEX_ADAPTIVE_NP
+#endif
+
+/* How many times to retry a recursive mutex held by another thread
+ * before sleeping on it */
+#define RMUTEX_SPIN_COUNT 100
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define CPU_RELAX() __builtin_ia32_pause ()
+#else
+#define CPU_RELAX() do { } while (0)
+#endif
+
 DBusCMutex *
 _dbus_platform_cmutex_new (void)
 {
   DBusCMutex *pmutex;
+#ifdef DBUS_CMUTEX_TYPE
+  pthread_mutexattr_t mutexattr;
+#endif
   int result;
 
   pmutex = dbus_new (DBusCMutex, 1);
   if (pmutex == NULL)
     return NULL;
 
+#ifdef DBUS_CMUTEX_TYPE
+  pthread_mutexattr_init (&mutexattr);
+  pthread_mutexattr_settype (&mutexattr, DBUS_CMUTEX_TYPE);
+  result = pthread_mutex_init (&pmutex->lock, &mutexattr);
+  pthread_mutexattr_destroy (&mutexattr);
+#else
   result = pthread_mutex_init (&pmutex->lock, NULL);
+#endif
 
   if (result == ENOMEM || result == EAGAIN)
     {
@@ -156,6 +183,24 @@ _dbus_platform_cmutex_lock (DBusCMutex *mutex)
 void
 _dbus_platform_rmutex_lock (DBusRMutex *mutex)
 {
+  int i;
+
+  /* Uncontended, or already ours: the first try succeeds. Otherwise
+   * the owner is likely to be about to unlock it, so wait a little
+   * before paying for a sleep and a wakeup. */
+  for (i = 0; i < RMUTEX_SPIN_COUNT; i++)
+    {
+      int result = pthread_mutex_trylock (&mutex->lock);
+
+      if (result == 0)
+        return;
+
+      if (result != EBUSY)
+        break;
+
+      CPU_RELAX ();
+    }
+
   PTHREAD_CHECK ("pthread_mutex_lock", pthread_mutex_lock (&mutex->lock));
 }
 
@@ -35,7 +35,9 @@
 #include "dbus-userdb.h"
 #include "dbus-list.h"
 #include "dbus-credentials.h"
+#include "dbus-misc.h"
 #include "dbus-nonce.h"
+#include "dbus-address.h"
 
 #include <sys/types.h>
 #include <stdlib.h>
@@ -80,6 +82,9 @@
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 
 #ifdef HAVE_ADT
 #include <bsm/adt.h>
@@ -491,7 +496,19 @@ _dbus_read_socket_with_unix_fds (DBusSocket        fd,
 
             /* Linux doesn't tell us whether MSG_CMSG_CLOEXEC actually
                worked, hence we need to go through this list and set
-               CLOEXEC everywhere in any case */
+               CLOEXEC everywhere in any case. The kernel applies it to
+               all the fds in a message or to none of them, so if the
+               first one has it we can skip a syscall per fd. */
+#ifdef MSG_CMSG_CLOEXEC
+            if (fds_to_use > 0)
+              {
+                int fd_flags = fcntl (fds[0], F_GETFD, 0);
+
+                if (fd_flags >= 0 && (fd_flags & FD_CLOEXEC) != 0)
+                  break;
+              }
+#endif
+
             for (i = 0; i < fds_to_use; i++)
               _dbus_fd_set_close_on_exec(fds[i]);
 
@@ -684,6 +701,74 @@ _dbus_write_socket_two (DBusSocket        fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two(), but for any number of buffers up to
+ * #_DBUS_WRITE_SOCKET_MAX_VECTORS, so that several queued messages
+ * can go out in one system call.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers to write from, in order
+ * @param starts first byte to write in each buffer
+ * @param lens number of bytes to write from each buffer
+ * @param n_buffers number of buffers
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_vectors (DBusSocket               fd,
+                            const DBusString * const *buffers,
+                            const int               *starts,
+                            const int               *lens,
+                            int                      n_buffers)
+{
+#if HAVE_DECL_MSG_NOSIGNAL || defined (HAVE_WRITEV)
+  struct iovec vectors[_DBUS_WRITE_SOCKET_MAX_VECTORS];
+  int bytes_written;
+  int i;
+#if HAVE_DECL_MSG_NOSIGNAL
+  struct msghdr m;
+#endif
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_WRITE_SOCKET_MAX_VECTORS);
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      _dbus_assert (starts[i] >= 0);
+      _dbus_assert (lens[i] >= 0);
+
+      vectors[i].iov_base = (char *) _dbus_string_get_const_data_len (buffers[i],
+                                                                      starts[i],
+                                                                      lens[i]);
+      vectors[i].iov_len = lens[i];
+    }
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_buffers;
+#endif
+
+ again:
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  bytes_written = sendmsg (fd.fd, &m, MSG_NOSIGNAL);
+#else
+  bytes_written = writev (fd.fd, vectors, n_buffers);
+#endif
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+
+#else
+  _dbus_assert (n_buffers > 0);
+
+  /* a short write is always allowed, so just write the first buffer */
+  return _dbus_write_socket (fd, buffers[0], starts[0], lens[0]);
+#endif
+}
+
 /**
  * Thin wrapper around the read() system call that appends
  * the data it reads to the DBusString buffer. It appends
@@ -1228,8 +1313,97 @@ _dbus_listen_unix_socket (const char     *path,
   return listen_fd;
 }
 
+#ifdef HAVE_SYSTEMD
+#define LISTEN_FDS_START SD_LISTEN_FDS_START
+#else
+/* The file descriptor passing protocol documented in sd_listen_fds(3) is
+ * simple and stable, so implement it ourselves when built without
+ * libsystemd: it lets tools like dbus-run-session create the listening
+ * socket and start the daemon without waiting for it. */
+#define LISTEN_FDS_START 3
+
+/* returns the number of sockets passed, or -errno */
+static int
+listen_fds_from_environment (void)
+{
+  const char *e;
+  char *end;
+  unsigned long l;
+  int n;
+  int fd;
+
+  n = 0;
+
+  e = _dbus_getenv ("LISTEN_PID");
+  if (e == NULL)
+    goto out;
+
+  errno = 0;
+  l = strtoul (e, &end, 10);
+  if (errno != 0 || end == e || *end != '\0' ||
+      l == 0 || (pid_t) l != getpid ())
+    goto out;
+
+  e = _dbus_getenv ("LISTEN_FDS");
+  if (e == NULL)
+    goto out;
+
+  errno = 0;
+  l = strtoul (e, &end, 10);
+  if (errno != 0 || end == e || *end != '\0' ||
+      l > (unsigned long) (_DBUS_INT_MAX - LISTEN_FDS_START))
+    {
+      n = -EINVAL;
+      goto out;
+    }
+
+  n = (int) l;
+
+  for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd++)
+    _dbus_fd_set_close_on_exec (fd);
+
+out:
+  /* Like sd_listen_fds (TRUE), don't pass this on to our children */
+  dbus_setenv ("LISTEN_PID", NULL);
+  dbus_setenv ("LISTEN_FDS", NULL);
+  dbus_setenv ("LISTEN_FDNAMES", NULL);
+  return n;
+}
+
+/* returns 1 if fd is a listening stream socket, 0 if not, or -errno */
+static int
+is_listening_stream_socket (int fd)
+{
+  int type = 0;
+  socklen_t len = sizeof (type);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+    return -errno;
+
+  if (len != sizeof (type) || type != SOCK_STREAM)
+    return 0;
+
+#ifdef SO_ACCEPTCONN
+  {
+    int accepting = 0;
+
+    len = sizeof (accepting);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0)
+      return -errno;
+
+    if (len != sizeof (accepting) || !accepting)
+      return 0;
+  }
+#endif
+
+  return 1;
+}
+#endif
+
 /**
- * Acquires one or more sockets passed in from systemd. The sockets
+ * Acquires one or more sockets passed in from systemd, or from any
+ * other process using the same LISTEN_FDS protocol. The sockets
  * are set to be nonblocking.
  *
  * This will set FD_CLOEXEC for the sockets returned.
@@ -1242,14 +1416,17 @@ int
 _dbus_listen_systemd_sockets (DBusSocket **fds,
                               DBusError   *error)
 {
-#ifdef HAVE_SYSTEMD
   int r, n;
   int fd;
   DBusSocket *new_fds;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+#ifdef HAVE_SYSTEMD
   n = sd_listen_fds (TRUE);
+#else
+  n = listen_fds_from_environment ();
+#endif
   if (n < 0)
     {
       dbus_set_error (error, _dbus_error_from_errno (-n),
@@ -1265,9 +1442,13 @@ _dbus_listen_systemd_sockets (DBusSocket **fds,
       return -1;
     }
 
-  for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd ++)
+  for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd ++)
     {
+#ifdef HAVE_SYSTEMD
       r = sd_is_socket (fd, AF_UNSPEC, SOCK_STREAM, 1);
+#else
+      r = is_listening_stream_socket (fd);
+#endif
       if (r < 0)
         {
           dbus_set_error (error, _dbus_error_from_errno (-r),
@@ -1295,7 +1476,7 @@ _dbus_listen_systemd_sockets (DBusSocket **fds,
       goto fail;
     }
 
-  for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd ++)
+  for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd ++)
     {
       if (!_dbus_set_fd_nonblocking (fd, error))
         {
@@ -1303,7 +1484,7 @@ _dbus_listen_systemd_sockets (DBusSocket **fds,
           goto fail;
         }
 
-      new_fds[fd - SD_LISTEN_FDS_START].fd = fd;
+      new_fds[fd - LISTEN_FDS_START].fd = fd;
     }
 
   *fds = new_fds;
@@ -1311,18 +1492,13 @@ _dbus_listen_systemd_sockets (DBusSocket **fds,
 
  fail:
 
-  for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd ++)
+  for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd ++)
     {
       _dbus_close (fd, NULL);
     }
 
   dbus_free (new_fds);
   return -1;
-#else
-  dbus_set_error_const (error, DBUS_ERROR_NOT_SUPPORTED,
-                        "dbus was compiled without systemd support");
-  return -1;
-#endif
 }
 
 /**
@@ -1447,6 +1623,50 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   return fd;
 }
 
+/**
+ * Sets the options of a connected TCP socket that trade throughput
+ * against latency: TCP_NODELAY turns off Nagle's algorithm, so that
+ * a message written while an earlier one is still unacknowledged goes
+ * out straight away, and SO_KEEPALIVE makes the kernel notice a peer
+ * that went away without closing the connection.
+ *
+ * @param fd the socket
+ * @param nodelay whether to set TCP_NODELAY
+ * @param keepalive whether to set SO_KEEPALIVE
+ * @param error return location for errors
+ * @returns #FALSE if a socket option could not be set
+ */
+dbus_bool_t
+_dbus_set_tcp_socket_options (DBusSocket   fd,
+                              dbus_bool_t  nodelay,
+                              dbus_bool_t  keepalive,
+                              DBusError   *error)
+{
+  int value;
+
+  value = nodelay ? 1 : 0;
+
+  if (setsockopt (fd.fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof (value)) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set TCP_NODELAY socket option: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  value = keepalive ? 1 : 0;
+
+  if (setsockopt (fd.fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof (value)) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set SO_KEEPALIVE socket option: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Creates a socket and binds it to the given path, then listens on
  * the socket. The socket is set to be nonblocking.  In case of port=0
@@ -1847,6 +2067,160 @@ out:
 #endif
 }
 
+/* Older C libraries don't know about SO_PEERPIDFD (Linux 6.5), but it has
+ * the same value on every architecture that uses the asm-generic socket
+ * options, so we can still ask for it there. */
+#if defined(__linux__) && !defined(SO_PEERPIDFD) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || \
+     defined(__arm__) || defined(__riscv))
+# define SO_PEERPIDFD 77
+#endif
+
+/* Never fails: if the kernel can't give us a pidfd for the peer we just
+ * go without one, and rely on the process ID as before */
+static void
+add_pid_fd_to_credentials (int              client_fd,
+                           DBusCredentials *credentials)
+{
+#ifdef SO_PEERPIDFD
+  int pid_fd = -1;
+  socklen_t len = sizeof (pid_fd);
+
+  if (getsockopt (client_fd, SOL_SOCKET, SO_PEERPIDFD, &pid_fd, &len) != 0)
+    {
+      _dbus_verbose ("Failed to getsockopt(SO_PEERPIDFD): %s\n",
+                     _dbus_strerror (errno));
+      return;
+    }
+
+  if (len != sizeof (pid_fd) || pid_fd < 0)
+    {
+      _dbus_verbose ("getsockopt(SO_PEERPIDFD) did not return a fd\n");
+      return;
+    }
+
+  /* The kernel opens it with O_CLOEXEC, so we don't need to */
+  _dbus_verbose ("getsockopt(SO_PEERPIDFD): %d\n", pid_fd);
+  _dbus_credentials_take_pid_fd (credentials, pid_fd);
+#endif
+}
+
+/* return FALSE on OOM, TRUE otherwise, even if no groups were found */
+static dbus_bool_t
+add_groups_to_credentials (int              client_fd,
+                           DBusCredentials *credentials,
+                           dbus_gid_t       primary)
+{
+#if defined(__linux__) && defined(SO_PEERGROUPS)
+  _DBUS_STATIC_ASSERT (sizeof (gid_t) <= sizeof (dbus_gid_t));
+  gid_t *buf = NULL;
+  socklen_t len = 1024;
+  dbus_bool_t oom = FALSE;
+  /* libdbus has a different representation of group IDs */
+  dbus_gid_t *converted_gids = NULL;
+  dbus_bool_t need_primary = TRUE;
+  size_t n_gids;
+  size_t i;
+
+  n_gids = ((size_t) len) / sizeof (gid_t);
+  buf = dbus_new (gid_t, n_gids);
+
+  if (buf == NULL)
+    return FALSE;
+
+  while (getsockopt (client_fd, SOL_SOCKET, SO_PEERGROUPS, buf, &len) < 0)
+    {
+      int e = errno;
+      gid_t *replacement;
+
+      _dbus_verbose ("getsockopt failed with %s, len now %lu\n",
+                     _dbus_strerror (e), (unsigned long) len);
+
+      if (e != ERANGE || (size_t) len <= n_gids * sizeof (gid_t))
+        {
+          _dbus_verbose ("Failed to getsockopt(SO_PEERGROUPS): %s\n",
+                         _dbus_strerror (e));
+          goto out;
+        }
+
+      /* If not enough space, len is updated to be enough.
+       * Try again with a large enough buffer. */
+      n_gids = ((size_t) len) / sizeof (gid_t);
+      replacement = dbus_realloc (buf, len);
+
+      if (replacement == NULL)
+        {
+          oom = TRUE;
+          goto out;
+        }
+
+      buf = replacement;
+      _dbus_verbose ("will try again with %lu\n", (unsigned long) len);
+    }
+
+  if (len > n_gids * sizeof (gid_t))
+    {
+      _dbus_verbose ("%lu > %zu", (unsigned long) len, n_gids * sizeof (gid_t));
+      _dbus_assert_not_reached ("getsockopt(SO_PEERGROUPS) overflowed");
+    }
+
+  if (len % sizeof (gid_t) != 0)
+    {
+      _dbus_verbose ("getsockopt(SO_PEERGROUPS) did not return an "
+                     "integer multiple of sizeof(gid_t): %lu should be "
+                     "divisible by %zu",
+                     (unsigned long) len, sizeof (gid_t));
+      goto out;
+    }
+
+  n_gids = ((size_t) len) / sizeof (gid_t);
+
+  /* If n_gids is less than this, then (n_gids + 1) certainly doesn't
+   * overflow, and neither does multiplying that by sizeof(dbus_gid_t).
+   * This is using _DBUS_INT32_MAX as a conservative lower bound for
+   * the maximum size_t. */
+  if (n_gids >= (_DBUS_INT32_MAX / sizeof (dbus_gid_t)) - 1)
+    {
+      _dbus_verbose ("getsockopt(SO_PEERGROUPS) returned a huge number "
+                     "of groups (%lu bytes), ignoring",
+                     (unsigned long) len);
+      goto out;
+    }
+
+  /* Allocate an extra space for the primary group ID */
+  converted_gids = dbus_new (dbus_gid_t, n_gids + 1);
+
+  if (converted_gids == NULL)
+    {
+      oom = TRUE;
+      goto out;
+    }
+
+  for (i = 0; i < n_gids; i++)
+    {
+      converted_gids[i] = (dbus_gid_t) buf[i];
+
+      if (converted_gids[i] == primary)
+        need_primary = FALSE;
+    }
+
+  if (need_primary && primary != DBUS_GID_UNSET)
+    {
+      converted_gids[n_gids] = primary;
+      n_gids++;
+    }
+
+  _dbus_credentials_take_unix_gids (credentials, converted_gids, n_gids);
+
+out:
+  dbus_free (buf);
+  return !oom;
+#else
+  /* no error */
+  return TRUE;
+#endif
+}
+
 /**
  * Reads a single byte which must be nul (an error occurs otherwise),
  * and reads unix credentials if available. Clears the credentials
@@ -1896,6 +2270,7 @@ _dbus_read_credentials_socket  (DBusSocket       client_fd,
   struct iovec iov;
   char buf;
   dbus_uid_t uid_read;
+  dbus_gid_t primary_gid_read;
   dbus_pid_t pid_read;
   int bytes_read;
 
@@ -1915,6 +2290,7 @@ _dbus_read_credentials_socket  (DBusSocket       client_fd,
   _DBUS_STATIC_ASSERT (sizeof (gid_t) <= sizeof (dbus_gid_t));
 
   uid_read = DBUS_UID_UNSET;
+  primary_gid_read = DBUS_GID_UNSET;
   pid_read = DBUS_PID_UNSET;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -2001,6 +2377,7 @@ _dbus_read_credentials_socket  (DBusSocket       client_fd,
       {
         pid_read = cr.pid;
         uid_read = cr.uid;
+        primary_gid_read = cr.gid;
       }
 #elif defined(HAVE_UNPCBID) && defined(LOCAL_PEEREID)
     /* Another variant of the above - used on NetBSD
@@ -2181,6 +2558,16 @@ _dbus_read_credentials_socket  (DBusSocket       client_fd,
       return FALSE;
     }
 
+  add_pid_fd_to_credentials (client_fd.fd, credentials);
+
+  /* We don't put any groups in the credentials unless we can put them
+   * all there. */
+  if (!add_groups_to_credentials (client_fd.fd, credentials, primary_gid_read))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -2740,7 +3127,19 @@ _dbus_parse_uid (const DBusString      *uid_str,
   return TRUE;
 }
 
-#if !DBUS_USE_SYNC
+/* gcc >= 4.7 and clang predefine __ATOMIC_RELAXED and friends along with
+ * the __atomic builtins, which let us ask for only as much ordering as
+ * each operation needs. They work on the plain integer in DBusAtomic,
+ * unlike <stdatomic.h>, which would need it to be declared _Atomic.
+ * The CMake build never checks for __sync, so without this it would
+ * always end up using the mutex below. */
+#if defined(__ATOMIC_RELAXED) && defined(__ATOMIC_ACQ_REL)
+#define DBUS_USE_ATOMIC_BUILTINS 1
+#else
+#define DBUS_USE_ATOMIC_BUILTINS 0
+#endif
+
+#if !DBUS_USE_ATOMIC_BUILTINS && !DBUS_USE_SYNC
 /* To be thread-safe by default on platforms that don't necessarily have
  * atomic operations (notably Debian armel, which is armv4t), we must
  * use a mutex that can be initialized statically, like this.
@@ -2750,7 +3149,8 @@ static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 /**
- * Atomically increments an integer
+ * Atomically increments an integer. This does not order any other
+ * memory accesses, which is all that taking a reference needs.
  *
  * @param atomic pointer to the integer to increment
  * @returns the value before incrementing
@@ -2758,7 +3158,9 @@ static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
 dbus_int32_t
 _dbus_atomic_inc (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if DBUS_USE_ATOMIC_BUILTINS
+  return __atomic_fetch_add (&atomic->value, 1, __ATOMIC_RELAXED);
+#elif DBUS_USE_SYNC
   return __sync_add_and_fetch(&atomic->value, 1)-1;
 #else
   dbus_int32_t res;
@@ -2773,7 +3175,9 @@ _dbus_atomic_inc (DBusAtomic *atomic)
 }
 
 /**
- * Atomically decrement an integer
+ * Atomically decrement an integer. Whichever thread takes it to 0
+ * sees everything the other threads did before their decrements, so
+ * it can safely free the object.
  *
  * @param atomic pointer to the integer to decrement
  * @returns the value before decrementing
@@ -2781,7 +3185,9 @@ _dbus_atomic_inc (DBusAtomic *atomic)
 dbus_int32_t
 _dbus_atomic_dec (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if DBUS_USE_ATOMIC_BUILTINS
+  return __atomic_fetch_sub (&atomic->value, 1, __ATOMIC_ACQ_REL);
+#elif DBUS_USE_SYNC
   return __sync_sub_and_fetch(&atomic->value, 1)+1;
 #else
   dbus_int32_t res;
@@ -2805,7 +3211,9 @@ _dbus_atomic_dec (DBusAtomic *atomic)
 dbus_int32_t
 _dbus_atomic_get (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if DBUS_USE_ATOMIC_BUILTINS
+  return __atomic_load_n (&atomic->value, __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
   __sync_synchronize ();
   return atomic->value;
 #else
@@ -2819,6 +3227,24 @@ _dbus_atomic_get (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Get the value of an integer without a memory barrier, for when the
+ * result is only a hint: statistics, or an assertion about an object
+ * that no other thread can be using.
+ *
+ * @param atomic pointer to the integer to get
+ * @returns the value at about this moment
+ */
+dbus_int32_t
+_dbus_atomic_get_relaxed (DBusAtomic *atomic)
+{
+#if DBUS_USE_ATOMIC_BUILTINS
+  return __atomic_load_n (&atomic->value, __ATOMIC_RELAXED);
+#else
+  return atomic->value;
+#endif
+}
+
 /**
  * Wrapper for poll().
  *
@@ -3104,10 +3530,69 @@ _dbus_generate_random_bytes (DBusString *str,
   int old_len;
   int fd;
   int result;
+#ifdef HAVE_GETRANDOM
+  char *p;
+  int got;
+#endif
 
   old_len = _dbus_string_get_length (str);
   fd = -1;
 
+#if defined(HAVE_GETRANDOM)
+  /* No file descriptor needed, so this keeps working when we are at
+   * RLIMIT_NOFILE; only fall back to the device if the kernel is too
+   * old to have the syscall at all, or if the entropy pool is not
+   * initialized yet, since a bus started early in boot must not block
+   * here where reading /dev/urandom would not have. */
+  if (!_dbus_string_lengthen (str, n_bytes))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  p = _dbus_string_get_data_len (str, old_len, n_bytes);
+  got = 0;
+
+  while (got < n_bytes)
+    {
+      ssize_t n = getrandom (p + got, n_bytes - got, GRND_NONBLOCK);
+
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          break;
+        }
+
+      got += n;
+    }
+
+  if (got == n_bytes)
+    return TRUE;
+
+  _dbus_string_set_length (str, old_len);
+
+  if (errno != ENOSYS && errno != EAGAIN)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not get random bytes: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+#elif defined(HAVE_ARC4RANDOM_BUF)
+  /* Buffered and reseeded by libc, and cannot fail */
+  if (!_dbus_string_lengthen (str, n_bytes))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  arc4random_buf (_dbus_string_get_data_len (str, old_len, n_bytes),
+                  n_bytes);
+  return TRUE;
+#endif
+
   /* note, urandom on linux will fall back to pseudorandom */
   fd = open ("/dev/urandom", O_RDONLY);
 
@@ -3208,6 +3693,28 @@ _dbus_fd_set_close_on_exec (int fd)
   fcntl (fd, F_SETFD, val);
 }
 
+/**
+ * Lets the file descriptor survive exec, so that it can be handed to
+ * the program being executed. The opposite of
+ * _dbus_fd_set_close_on_exec().
+ *
+ * @param fd the file descriptor
+ */
+void
+_dbus_fd_clear_close_on_exec (int fd)
+{
+  int val;
+
+  val = fcntl (fd, F_GETFD, 0);
+
+  if (val < 0)
+    return;
+
+  val &= ~FD_CLOEXEC;
+
+  fcntl (fd, F_SETFD, val);
+}
+
 /**
  * Closes a file descriptor.
  *
@@ -3778,6 +4285,153 @@ _read_subprocess_line_argv (const char *progpath,
 }
 #endif
 
+#ifdef DBUS_ENABLE_X11_AUTOLAUNCH
+/*
+ * Builds the name of the file in which a session bus address found by
+ * X11 autolaunch is remembered, and of the directory containing it:
+ * $XDG_RUNTIME_DIR/dbus-1/autolaunch- followed by the machine uuid and
+ * $DISPLAY. Characters of the display that cannot appear in a file name
+ * are replaced.
+ *
+ * Returns #FALSE if there is no runtime directory or on OOM, in which
+ * case the cache is simply not used.
+ */
+static dbus_bool_t
+autolaunch_cache_filename (DBusString       *dir,
+                           DBusString       *filename,
+                           const DBusString *uuid,
+                           const char       *display)
+{
+  const char *runtime_dir = _dbus_getenv ("XDG_RUNTIME_DIR");
+  int start;
+  int i;
+
+  if (runtime_dir == NULL || runtime_dir[0] != '/')
+    return FALSE;
+
+  if (!_dbus_string_append_printf (dir, "%s/dbus-1", runtime_dir) ||
+      !_dbus_string_copy (dir, 0, filename, 0) ||
+      !_dbus_string_append_printf (filename, "/autolaunch-%s-",
+                                   _dbus_string_get_const_data (uuid)))
+    return FALSE;
+
+  start = _dbus_string_get_length (filename);
+
+  if (!_dbus_string_append (filename, display))
+    return FALSE;
+
+  for (i = start; i < _dbus_string_get_length (filename); i++)
+    {
+      unsigned char c = _dbus_string_get_byte (filename, i);
+
+      if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') || c == '.' || c == ':'))
+        _dbus_string_set_byte (filename, i, '_');
+    }
+
+  return TRUE;
+}
+
+/*
+ * Checks that a remembered autolaunch address still leads somewhere,
+ * by connecting to its first Unix socket once. Addresses with no Unix
+ * socket in them are never trusted from the cache.
+ */
+static dbus_bool_t
+autolaunch_address_is_alive (const char *address)
+{
+  DBusAddressEntry **entries;
+  int n_entries;
+  int i;
+  dbus_bool_t alive = FALSE;
+
+  if (!dbus_parse_address (address, &entries, &n_entries, NULL))
+    return FALSE;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      const char *path = dbus_address_entry_get_value (entries[i], "path");
+      const char *abstract = dbus_address_entry_get_value (entries[i],
+                                                           "abstract");
+      int fd;
+
+      if (strcmp (dbus_address_entry_get_method (entries[i]), "unix") != 0 ||
+          (path == NULL && abstract == NULL))
+        continue;
+
+      fd = _dbus_connect_unix_socket (path != NULL ? path : abstract,
+                                      path == NULL, NULL);
+
+      if (fd >= 0)
+        {
+          _dbus_close (fd, NULL);
+          alive = TRUE;
+        }
+
+      break;
+    }
+
+  dbus_address_entries_free (entries);
+  return alive;
+}
+
+/*
+ * Appends the remembered address to @p address if there is one and
+ * its bus is still running.
+ */
+static dbus_bool_t
+autolaunch_cache_lookup (const DBusString *filename,
+                         DBusString       *address)
+{
+  DBusString contents;
+  dbus_bool_t found = FALSE;
+
+  if (!_dbus_string_init (&contents))
+    return FALSE;
+
+  if (_dbus_file_get_contents (&contents, filename, NULL) &&
+      _dbus_string_get_length (&contents) > 0 &&
+      autolaunch_address_is_alive (_dbus_string_get_const_data (&contents)))
+    {
+      _dbus_verbose ("using cached autolaunch address from %s\n",
+                     _dbus_string_get_const_data (filename));
+      found = _dbus_string_copy (&contents, 0, address,
+                                 _dbus_string_get_length (address));
+    }
+
+  _dbus_string_free (&contents);
+  return found;
+}
+
+/*
+ * Remembers the address dbus-launch printed, starting at @p start in
+ * @p address and ending at the first nul byte of its binary syntax.
+ * Failures are ignored: the next process will just autolaunch again.
+ */
+static void
+autolaunch_cache_store (const DBusString *dir,
+                        const DBusString *filename,
+                        const DBusString *address,
+                        int               start)
+{
+  DBusString contents;
+  const char *found = _dbus_string_get_const_data_len (address, start, 0);
+  int len = strlen (found);
+
+  if (len == 0)
+    return;
+
+  if (!_dbus_string_init (&contents))
+    return;
+
+  if (_dbus_ensure_directory (dir, NULL) &&
+      _dbus_string_append_len (&contents, found, len))
+    _dbus_string_save_to_file (&contents, filename, FALSE, NULL);
+
+  _dbus_string_free (&contents);
+}
+#endif
+
 /**
  * Returns the address of a new session bus.
  *
@@ -3809,6 +4463,10 @@ _dbus_get_autolaunch_address (const char *scope,
   const char *argv[6];
   int i;
   DBusString uuid;
+  DBusString cache_dir;
+  DBusString cache_filename;
+  dbus_bool_t use_cache;
+  int orig_len;
   dbus_bool_t retval;
 
   if (_dbus_check_setuid ())
@@ -3844,11 +4502,38 @@ _dbus_get_autolaunch_address (const char *scope,
       return FALSE;
     }
 
+  if (!_dbus_string_init (&cache_dir))
+    {
+      _dbus_string_free (&uuid);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&cache_filename))
+    {
+      _dbus_string_free (&cache_dir);
+      _dbus_string_free (&uuid);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
   if (!_dbus_get_local_machine_uuid_encoded (&uuid, error))
     {
       goto out;
     }
 
+  /* Spawning dbus-launch costs a fork and exec per process that wants
+   * the session bus; once one of them has found the bus, the rest can
+   * use what it found as long as the bus is still there. */
+  use_cache = autolaunch_cache_filename (&cache_dir, &cache_filename,
+                                         &uuid, display);
+
+  if (use_cache && autolaunch_cache_lookup (&cache_filename, address))
+    {
+      retval = TRUE;
+      goto out;
+    }
+
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
   progpath = _dbus_getenv ("DBUS_TEST_DBUS_LAUNCH");
 
@@ -3876,11 +4561,17 @@ _dbus_get_autolaunch_address (const char *scope,
 
   _dbus_assert (i == _DBUS_N_ELEMENTS (argv));
 
+  orig_len = _dbus_string_get_length (address);
   retval = _read_subprocess_line_argv (progpath,
                                        TRUE,
                                        argv, address, error);
 
+  if (retval && use_cache)
+    autolaunch_cache_store (&cache_dir, &cache_filename, address, orig_len);
+
  out:
+  _dbus_string_free (&cache_filename);
+  _dbus_string_free (&cache_dir);
   _dbus_string_free (&uuid);
   return retval;
 #else
@@ -4375,6 +5066,46 @@ _dbus_socket_can_pass_unix_fd (DBusSocket fd)
 #endif
 }
 
+/**
+ * Gets the effective uid of the process at the other end of a
+ * connected Unix socket, without reading from or writing to it.
+ *
+ * @param fd the socket
+ * @param uid_p return location for the peer's uid
+ * @returns #FALSE if the peer's uid is not available
+ */
+dbus_bool_t
+_dbus_socket_get_peer_uid (DBusSocket  fd,
+                           dbus_uid_t *uid_p)
+{
+#if defined(SO_PEERCRED)
+#ifdef __OpenBSD__
+  struct sockpeercred cr;
+#else
+  struct ucred cr;
+#endif
+  socklen_t cr_len = sizeof (cr);
+
+  if (getsockopt (fd.fd, SOL_SOCKET, SO_PEERCRED, &cr, &cr_len) != 0 ||
+      cr_len != sizeof (cr))
+    return FALSE;
+
+  *uid_p = cr.uid;
+  return TRUE;
+#elif defined(HAVE_GETPEEREID)
+  uid_t euid;
+  gid_t egid;
+
+  if (getpeereid (fd.fd, &euid, &egid) != 0)
+    return FALSE;
+
+  *uid_p = euid;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
 /**
  * Closes all file descriptors except the first three (i.e. stdin,
  * stdout, stderr).
@@ -144,6 +144,9 @@ dbus_uid_t    _dbus_geteuid (void);
 dbus_bool_t _dbus_parse_uid (const DBusString  *uid_str,
                              dbus_uid_t        *uid);
 
+dbus_bool_t _dbus_socket_get_peer_uid (DBusSocket         fd,
+                                       dbus_uid_t        *uid_p);
+
 DBUS_PRIVATE_EXPORT
 void _dbus_close_all (void);
 
@@ -153,6 +156,8 @@ dbus_bool_t _dbus_append_address_from_socket (DBusSocket  fd,
 
 DBUS_PRIVATE_EXPORT
 void _dbus_fd_set_close_on_exec (int fd);
+DBUS_PRIVATE_EXPORT
+void _dbus_fd_clear_close_on_exec (int fd);
 
 typedef enum
 {
@@ -607,45 +607,6 @@ _dbus_path_is_absolute (const DBusString *filename)
     return FALSE;
 }
 
-/**
- * stat() wrapper.
- *
- * @param filename the filename to stat
- * @param statbuf the stat info to fill in
- * @param error return location for error
- * @returns #FALSE if error was set
- */
-dbus_bool_t
-_dbus_stat (const DBusString *filename,
-            DBusStat         *statbuf,
-            DBusError        *error)
-{
-  const char *filename_c;
-  struct stat sb;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  filename_c = _dbus_string_get_const_data (filename);
-
-  if (stat (filename_c, &sb) < 0)
-    {
-      dbus_set_error (error, _dbus_error_from_errno (errno),
-                      "%s", _dbus_strerror (errno));
-      return FALSE;
-    }
-
-  statbuf->mode = sb.st_mode;
-  statbuf->nlink = sb.st_nlink;
-  statbuf->uid = sb.st_uid;
-  statbuf->gid = sb.st_gid;
-  statbuf->size = sb.st_size;
-  statbuf->atime = sb.st_atime;
-  statbuf->mtime = sb.st_mtime;
-  statbuf->ctime = sb.st_ctime;
-
-  return TRUE;
-}
-
 
 /**
  * Internals of directory iterator
@@ -883,7 +844,10 @@ fill_group_info (DBusGroupInfo    *info,
     /* I guess we're screwed on thread safety here */
     struct group *g;
 
-    g = getgrnam (group_c_str);
+    if (gid != DBUS_GID_UNSET)
+      g = getgrgid (gid);
+    else
+      g = getgrnam (group_c_str);
 
     if (g != NULL)
       {
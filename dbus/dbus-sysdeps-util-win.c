@@ -296,98 +296,6 @@ _dbus_rlimit_free (DBusRLimit *lim)
   _dbus_assert (lim == NULL);
 }
 
-/**
- * stat() wrapper.
- *
- * @param filename the filename to stat
- * @param statbuf the stat info to fill in
- * @param error return location for error
- * @returns #FALSE if error was set
- */
-dbus_bool_t
-_dbus_stat(const DBusString *filename,
-           DBusStat         *statbuf,
-           DBusError        *error)
-{
-  const char *filename_c;
-  WIN32_FILE_ATTRIBUTE_DATA wfad;
-  char *lastdot;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-
-  filename_c = _dbus_string_get_const_data (filename);
-
-  if (!GetFileAttributesExA (filename_c, GetFileExInfoStandard, &wfad))
-    {
-      _dbus_win_set_error_from_win_error (error, GetLastError ());
-      return FALSE;
-    }
-
-  if (wfad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-    statbuf->mode = _S_IFDIR;
-  else
-    statbuf->mode = _S_IFREG;
-
-  statbuf->mode |= _S_IREAD;
-  if (wfad.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
-    statbuf->mode |= _S_IWRITE;
-
-  lastdot = strrchr (filename_c, '.');
-  if (lastdot && stricmp (lastdot, ".exe") == 0)
-    statbuf->mode |= _S_IEXEC;
-
-  statbuf->mode |= (statbuf->mode & 0700) >> 3;
-  statbuf->mode |= (statbuf->mode & 0700) >> 6;
-
-  statbuf->nlink = 1;
-
-#ifdef ENABLE_UID_TO_SID
-  {
-    PSID owner_sid, group_sid;
-    PSECURITY_DESCRIPTOR sd;
-
-    sd = NULL;
-    rc = GetNamedSecurityInfo ((char *) filename_c, SE_FILE_OBJECT,
-                               OWNER_SECURITY_INFORMATION |
-                               GROUP_SECURITY_INFORMATION,
-                               &owner_sid, &group_sid,
-                               NULL, NULL,
-                               &sd);
-    if (rc != ERROR_SUCCESS)
-      {
-        _dbus_win_set_error_from_win_error (error, rc);
-        if (sd != NULL)
-          LocalFree (sd);
-        return FALSE;
-      }
-    
-    /* FIXME */
-    statbuf->uid = _dbus_win_sid_to_uid_t (owner_sid);
-    statbuf->gid = _dbus_win_sid_to_uid_t (group_sid);
-
-    LocalFree (sd);
-  }
-#else
-  statbuf->uid = DBUS_UID_UNSET;
-  statbuf->gid = DBUS_GID_UNSET;
-#endif
-
-  statbuf->size = ((dbus_int64_t) wfad.nFileSizeHigh << 32) + wfad.nFileSizeLow;
-
-  statbuf->atime =
-    (((dbus_int64_t) wfad.ftLastAccessTime.dwHighDateTime << 32) +
-     wfad.ftLastAccessTime.dwLowDateTime) / 10000000 - DBUS_INT64_CONSTANT (116444736000000000);
-
-  statbuf->mtime =
-    (((dbus_int64_t) wfad.ftLastWriteTime.dwHighDateTime << 32) +
-     wfad.ftLastWriteTime.dwLowDateTime) / 10000000 - DBUS_INT64_CONSTANT (116444736000000000);
-
-  statbuf->ctime =
-    (((dbus_int64_t) wfad.ftCreationTime.dwHighDateTime << 32) +
-     wfad.ftCreationTime.dwLowDateTime) / 10000000 - DBUS_INT64_CONSTANT (116444736000000000);
-
-  return TRUE;
-}
 
 /**
  * Internals of directory iterator
@@ -101,6 +101,21 @@ _dbus_win_set_errno (int err)
 
 static BOOL is_winxp_sp3_or_lower (void);
 
+/*
+ * AF_UNIX stream sockets are available from Windows 10 1803 on, but
+ * <afunix.h> is missing from older SDKs and MinGW, so mirror what we
+ * need from it here.
+ */
+#define DBUS_WIN_AF_UNIX 1
+#define DBUS_WIN_UNIX_PATH_MAX 108
+#define DBUS_WIN_SIO_AF_UNIX_GETPEERPID _WSAIOR (IOC_VENDOR, 256)
+
+typedef struct
+{
+  unsigned short sun_family;
+  char sun_path[DBUS_WIN_UNIX_PATH_MAX];
+} DBusWinSockaddrUn;
+
 /*
  * _MIB_TCPROW_EX and friends are not available in system headers
  *  and are mapped to attribute identical ...OWNER_PID typedefs.
@@ -269,6 +284,21 @@ _dbus_get_peer_pid_from_tcp_handle (int handle)
          _dbus_verbose ("IPV6 %08x %08x\n", s->sin6_addr.s6_addr, in6addr_loopback.s6_addr);
        */
     }
+  else if (addr.ss_family == DBUS_WIN_AF_UNIX)
+    {
+      DWORD peer_pid = 0;
+      DWORD bytes = 0;
+
+      if (WSAIoctl (handle, DBUS_WIN_SIO_AF_UNIX_GETPEERPID, NULL, 0,
+                    &peer_pid, sizeof (peer_pid), &bytes,
+                    NULL, NULL) == SOCKET_ERROR)
+        {
+          _dbus_verbose ("could not fetch AF_UNIX peer's process id\n");
+          return 0;
+        }
+
+      return peer_pid;
+    }
   else
     {
       _dbus_verbose ("no idea what address family %d is\n", addr.ss_family);
@@ -643,6 +673,70 @@ _dbus_write_socket_two (DBusSocket        fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two(), but for any number of buffers up to
+ * #_DBUS_WRITE_SOCKET_MAX_VECTORS, so that several queued messages
+ * can go out in one system call.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers to write from, in order
+ * @param starts first byte to write in each buffer
+ * @param lens number of bytes to write from each buffer
+ * @param n_buffers number of buffers
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_vectors (DBusSocket               fd,
+                            const DBusString * const *buffers,
+                            const int               *starts,
+                            const int               *lens,
+                            int                      n_buffers)
+{
+  WSABUF vectors[_DBUS_WRITE_SOCKET_MAX_VECTORS];
+  int rc;
+  int i;
+  DWORD bytes_written;
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_WRITE_SOCKET_MAX_VECTORS);
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      _dbus_assert (starts[i] >= 0);
+      _dbus_assert (lens[i] >= 0);
+
+      vectors[i].buf = (char *) _dbus_string_get_const_data_len (buffers[i],
+                                                                 starts[i],
+                                                                 lens[i]);
+      vectors[i].len = lens[i];
+    }
+
+ again:
+
+  _dbus_verbose ("WSASend: %d buffers fd=%Iu\n", n_buffers, fd.sock);
+  rc = WSASend (fd.sock,
+                vectors,
+                n_buffers,
+                &bytes_written,
+                0,
+                NULL,
+                NULL);
+
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = (DWORD) -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  if (bytes_written == (DWORD) -1 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 #if 0
 
 /**
@@ -1160,6 +1254,142 @@ out0:
   return FALSE;
 }
 
+/*
+ * WSAPoll() and WSAPOLLFD are only declared when targeting Vista or
+ * newer, so mirror the structure here and look the function up at
+ * runtime, falling back to select() on systems that lack it.
+ */
+typedef struct
+{
+  SOCKET fd;
+  SHORT events;
+  SHORT revents;
+} DBusWSAPollFD;
+
+#define DBUS_WSAPOLL_RDNORM 0x0100
+#define DBUS_WSAPOLL_WRNORM 0x0010
+#define DBUS_WSAPOLL_ERR    0x0001
+#define DBUS_WSAPOLL_HUP    0x0002
+#define DBUS_WSAPOLL_NVAL   0x0004
+
+typedef int (WSAAPI *ProcWSAPoll) (DBusWSAPollFD *, ULONG, INT);
+
+/* 0 = not looked up yet, 1 = available, -1 = unavailable */
+static int wsapoll_state = 0;
+static ProcWSAPoll lpfnWSAPoll = NULL;
+
+static dbus_bool_t
+load_wsapoll (void)
+{
+  if (wsapoll_state == 0)
+    {
+      HMODULE hModule = GetModuleHandle ("ws2_32.dll");
+
+      if (hModule != NULL)
+        lpfnWSAPoll = (ProcWSAPoll) GetProcAddress (hModule, "WSAPoll");
+
+      if (lpfnWSAPoll == NULL)
+        _dbus_verbose ("WSAPoll not available, using select()\n");
+
+      wsapoll_state = lpfnWSAPoll != NULL ? 1 : -1;
+    }
+
+  return wsapoll_state > 0;
+}
+
+#define DBUS_STACK_WSAPOLLFDS 64
+
+/*
+ * Unlike select(), WSAPoll() is not bounded by FD_SETSIZE and does not
+ * need the fd_set bitmaps rebuilt and rescanned per descriptor, so a
+ * session bus with hundreds of connections polls in time linear in the
+ * number of sockets rather than in their values.
+ *
+ * @returns #FALSE if WSAPoll() could not be used, in which case *result
+ * is not set
+ */
+static dbus_bool_t
+_dbus_poll_wsapoll (DBusPollFD *fds,
+                    int         n_fds,
+                    int         timeout_milliseconds,
+                    int        *result)
+{
+  DBusWSAPollFD on_stack[DBUS_STACK_WSAPOLLFDS];
+  DBusWSAPollFD *pfds;
+  int ready;
+  int i;
+
+  if (!load_wsapoll ())
+    return FALSE;
+
+  if (n_fds > DBUS_STACK_WSAPOLLFDS)
+    {
+      pfds = dbus_new (DBusWSAPollFD, n_fds);
+
+      if (pfds == NULL)
+        return FALSE;
+    }
+  else
+    {
+      pfds = on_stack;
+    }
+
+  for (i = 0; i < n_fds; i++)
+    {
+      pfds[i].fd = fds[i].fd.sock;
+      pfds[i].events = 0;
+      pfds[i].revents = 0;
+
+      if (fds[i].events & _DBUS_POLLIN)
+        pfds[i].events |= DBUS_WSAPOLL_RDNORM;
+
+      if (fds[i].events & _DBUS_POLLOUT)
+        pfds[i].events |= DBUS_WSAPOLL_WRNORM;
+    }
+
+  ready = (* lpfnWSAPoll) (pfds, n_fds, timeout_milliseconds);
+
+  if (DBUS_SOCKET_API_RETURNS_ERROR (ready))
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      if (errno != WSAEWOULDBLOCK)
+        _dbus_verbose ("WSAPoll: failed: %s\n", _dbus_strerror_from_errno ());
+    }
+  else
+    {
+      for (i = 0; i < n_fds; i++)
+        {
+          fds[i].revents = 0;
+
+          if (pfds[i].revents & DBUS_WSAPOLL_RDNORM)
+            fds[i].revents |= _DBUS_POLLIN;
+
+          if (pfds[i].revents & DBUS_WSAPOLL_WRNORM)
+            fds[i].revents |= _DBUS_POLLOUT;
+
+          if (pfds[i].revents & DBUS_WSAPOLL_ERR)
+            fds[i].revents |= _DBUS_POLLERR;
+
+          if (pfds[i].revents & DBUS_WSAPOLL_HUP)
+            fds[i].revents |= _DBUS_POLLHUP;
+
+          if (pfds[i].revents & DBUS_WSAPOLL_NVAL)
+            fds[i].revents |= _DBUS_POLLNVAL;
+        }
+    }
+
+  if (pfds != on_stack)
+    dbus_free (pfds);
+
+  *result = ready;
+  return TRUE;
+}
+
+static int
+_dbus_poll_select (DBusPollFD *fds,
+                   int         n_fds,
+                   int         timeout_milliseconds);
+
 /**
  * Wrapper for poll().
  *
@@ -1172,6 +1402,19 @@ int
 _dbus_poll (DBusPollFD *fds,
             int         n_fds,
             int         timeout_milliseconds)
+{
+  int ready;
+
+  if (_dbus_poll_wsapoll (fds, n_fds, timeout_milliseconds, &ready))
+    return ready;
+
+  return _dbus_poll_select (fds, n_fds, timeout_milliseconds);
+}
+
+static int
+_dbus_poll_select (DBusPollFD *fds,
+                   int         n_fds,
+                   int         timeout_milliseconds)
 {
 #define USE_CHRIS_IMPL 0
 
@@ -1623,6 +1866,209 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   return fd;
 }
 
+/**
+ * Sets the options of a connected TCP socket that trade throughput
+ * against latency: TCP_NODELAY turns off Nagle's algorithm, so that
+ * a message written while an earlier one is still unacknowledged goes
+ * out straight away, and SO_KEEPALIVE makes the kernel notice a peer
+ * that went away without closing the connection.
+ *
+ * @param fd the socket
+ * @param nodelay whether to set TCP_NODELAY
+ * @param keepalive whether to set SO_KEEPALIVE
+ * @param error return location for errors
+ * @returns #FALSE if a socket option could not be set
+ */
+dbus_bool_t
+_dbus_set_tcp_socket_options (DBusSocket   fd,
+                              dbus_bool_t  nodelay,
+                              dbus_bool_t  keepalive,
+                              DBusError   *error)
+{
+  BOOL value;
+
+  value = nodelay ? TRUE : FALSE;
+
+  if (setsockopt (fd.sock, IPPROTO_TCP, TCP_NODELAY,
+                  (const char *) &value, sizeof (value)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set TCP_NODELAY socket option: %s",
+                      _dbus_strerror_from_errno ());
+      return FALSE;
+    }
+
+  value = keepalive ? TRUE : FALSE;
+
+  if (setsockopt (fd.sock, SOL_SOCKET, SO_KEEPALIVE,
+                  (const char *) &value, sizeof (value)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set SO_KEEPALIVE socket option: %s",
+                      _dbus_strerror_from_errno ());
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+fill_sockaddr_un (DBusWinSockaddrUn *addr,
+                  const char        *path,
+                  DBusError         *error)
+{
+  size_t path_len = strlen (path);
+
+  if (path_len >= DBUS_WIN_UNIX_PATH_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Socket name too long\n");
+      return FALSE;
+    }
+
+  _DBUS_ZERO (*addr);
+  addr->sun_family = DBUS_WIN_AF_UNIX;
+  strcpy (addr->sun_path, path);
+  return TRUE;
+}
+
+/**
+ * Creates a socket and connects it to the AF_UNIX socket at the
+ * given path. The connection fd is returned, and is set up as
+ * nonblocking. Only filesystem paths are supported; Windows has no
+ * abstract socket namespace.
+ *
+ * @param path the path to the socket file
+ * @param error return location for error code
+ * @returns connection socket, invalid on error
+ */
+DBusSocket
+_dbus_win_connect_unix_socket (const char *path,
+                               DBusError  *error)
+{
+  DBusSocket fd = DBUS_SOCKET_INIT;
+  DBusWinSockaddrUn addr;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_win_startup_winsock ())
+    {
+      _DBUS_SET_OOM (error);
+      return _dbus_socket_get_invalid ();
+    }
+
+  if (!fill_sockaddr_un (&addr, path, error))
+    return _dbus_socket_get_invalid ();
+
+  if ((fd.sock = socket (DBUS_WIN_AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error,
+                      _dbus_error_from_errno (errno),
+                      "Failed to create AF_UNIX socket: %s",
+                      _dbus_strerror_from_errno ());
+      return _dbus_socket_get_invalid ();
+    }
+
+  if (connect (fd.sock, (struct sockaddr *) &addr, sizeof (addr)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error,
+                      _dbus_error_from_errno (errno),
+                      "Failed to connect to socket %s: %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (fd.sock);
+      return _dbus_socket_get_invalid ();
+    }
+
+  _dbus_win_handle_set_close_on_exec ((HANDLE) fd.sock);
+
+  if (!_dbus_set_socket_nonblocking (fd, error))
+    {
+      closesocket (fd.sock);
+      return _dbus_socket_get_invalid ();
+    }
+
+  return fd;
+}
+
+/**
+ * Creates an AF_UNIX socket, binds it to the given path and listens
+ * on it. A stale socket file left behind at that path is removed
+ * first. The socket is set to be nonblocking.
+ *
+ * @param path the socket file name
+ * @param error return location for errors
+ * @returns the listening socket, invalid on error
+ */
+DBusSocket
+_dbus_win_listen_unix_socket (const char *path,
+                              DBusError  *error)
+{
+  DBusSocket fd = DBUS_SOCKET_INIT;
+  DBusWinSockaddrUn addr;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_win_startup_winsock ())
+    {
+      _DBUS_SET_OOM (error);
+      return _dbus_socket_get_invalid ();
+    }
+
+  if (!fill_sockaddr_un (&addr, path, error))
+    return _dbus_socket_get_invalid ();
+
+  if ((fd.sock = socket (DBUS_WIN_AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error,
+                      _dbus_error_from_errno (errno),
+                      "Failed to create AF_UNIX socket: %s",
+                      _dbus_strerror_from_errno ());
+      return _dbus_socket_get_invalid ();
+    }
+
+  /* As on Unix, a socket file cannot be bound twice; unlike Unix,
+   * nothing else could plausibly live at a path we were told to
+   * listen on, so just remove it. */
+  DeleteFileA (path);
+
+  if (bind (fd.sock, (struct sockaddr *) &addr, sizeof (addr)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to bind socket \"%s\": %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (fd.sock);
+      return _dbus_socket_get_invalid ();
+    }
+
+  if (listen (fd.sock, SOMAXCONN) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to listen on socket \"%s\": %s",
+                      path, _dbus_strerror_from_errno ());
+      closesocket (fd.sock);
+      DeleteFileA (path);
+      return _dbus_socket_get_invalid ();
+    }
+
+  _dbus_win_handle_set_close_on_exec ((HANDLE) fd.sock);
+
+  if (!_dbus_set_socket_nonblocking (fd, error))
+    {
+      closesocket (fd.sock);
+      DeleteFileA (path);
+      return _dbus_socket_get_invalid ();
+    }
+
+  return fd;
+}
+
 /**
  * Creates a socket and binds it to the given path, then listens on
  * the socket. The socket is set to be nonblocking.  In case of port=0
@@ -3203,6 +3649,20 @@ _dbus_atomic_get (DBusAtomic *atomic)
   return atomic->value;
 }
 
+/**
+ * Get the value of an integer without a memory barrier, for when the
+ * result is only a hint: statistics, or an assertion about an object
+ * that no other thread can be using.
+ *
+ * @param atomic pointer to the integer to get
+ * @returns the value at about this moment
+ */
+dbus_int32_t
+_dbus_atomic_get_relaxed (DBusAtomic *atomic)
+{
+  return atomic->value;
+}
+
 /**
  * Called when the bus daemon is signaled to reload its configuration; any
  * caches should be nuked. Of course any caches that need explicit reload
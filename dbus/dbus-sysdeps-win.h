@@ -31,6 +31,7 @@ extern void *_dbus_win_get_dll_hmodule (void);
 
 #include "dbus-hash.h"
 #include "dbus-string.h"
+#include "dbus-sysdeps.h"
 #include <ctype.h>
 #include <malloc.h>
 #include <windows.h>
@@ -90,6 +91,11 @@ void        _dbus_threads_windows_ensure_ctor_linked (void);
 
 DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_getsid(char **sid, dbus_pid_t process_id);
+
+DBusSocket  _dbus_win_connect_unix_socket (const char *path,
+                                           DBusError  *error);
+DBusSocket  _dbus_win_listen_unix_socket  (const char *path,
+                                           DBusError  *error);
 #endif
 
 /** @} end of sysdeps-win.h */
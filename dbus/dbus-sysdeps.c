@@ -30,6 +30,7 @@
 #include "dbus-string.h"
 #include "dbus-list.h"
 #include "dbus-misc.h"
+#include "dbus-trace-ring.h"
 
 /* NOTE: If you include any unix/windows-specific headers here, you are probably doing something
  * wrong and should be putting some code in dbus-sysdeps-unix.c or dbus-sysdeps-win.c.
@@ -81,6 +82,10 @@ _dbus_abort (void)
   const char *s;
   
   _dbus_print_backtrace ();
+
+#ifdef DBUS_ENABLE_TRACE_RING
+  _dbus_trace_ring_dump ();
+#endif
   
   s = _dbus_getenv ("DBUS_BLOCK_ON_ABORT");
   if (s && *s)
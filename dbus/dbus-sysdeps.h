@@ -195,6 +195,15 @@ int         _dbus_write_socket_two (DBusSocket        fd,
                                     int               start2,
                                     int               len2);
 
+/** Most buffers _dbus_write_socket_vectors() accepts in one call */
+#define _DBUS_WRITE_SOCKET_MAX_VECTORS 32
+
+int         _dbus_write_socket_vectors (DBusSocket               fd,
+                                        const DBusString * const *buffers,
+                                        const int               *starts,
+                                        const int               *lens,
+                                        int                      n_buffers);
+
 int _dbus_read_socket_with_unix_fds      (DBusSocket        fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -226,6 +235,10 @@ DBusSocket _dbus_connect_tcp_socket_with_nonce  (const char     *host,
                                                  const char     *family,
                                                  const char     *noncefile,
                                                  DBusError      *error);
+dbus_bool_t _dbus_set_tcp_socket_options (DBusSocket      fd,
+                                          dbus_bool_t     nodelay,
+                                          dbus_bool_t     keepalive,
+                                          DBusError      *error);
 int _dbus_listen_tcp_socket   (const char     *host,
                                const char     *port,
                                const char     *family,
@@ -301,6 +314,8 @@ DBUS_PRIVATE_EXPORT
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
 DBUS_PRIVATE_EXPORT
 dbus_int32_t _dbus_atomic_get (DBusAtomic *atomic);
+DBUS_PRIVATE_EXPORT
+dbus_int32_t _dbus_atomic_get_relaxed (DBusAtomic *atomic);
 
 #ifdef DBUS_WIN
 
@@ -137,6 +137,8 @@ _dbus_run_tests (const char   *test_data_dir,
   
   run_test ("hash", specific_test, _dbus_hash_test);
 
+  run_test ("mainloop", specific_test, _dbus_mainloop_test);
+
 #if !defined(DBUS_WINCE)
   run_data_test ("spawn", specific_test, _dbus_spawn_test, test_data_dir);
 #endif
@@ -96,6 +96,8 @@ dbus_bool_t _dbus_object_tree_test       (void);
 
 dbus_bool_t _dbus_credentials_test       (const char *test_data_dir);
 
+dbus_bool_t _dbus_mainloop_test          (void);
+
 void        _dbus_run_tests                            (const char          *test_data_dir,
                                                         const char          *specific_test);
 
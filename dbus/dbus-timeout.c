@@ -50,8 +50,18 @@ struct DBusTimeout
   DBusFreeFunction free_data_function;         /**< Free the application data. */
   unsigned int enabled : 1;                    /**< True if timeout is active. */
   unsigned int needs_restart : 1;              /**< Flag that timeout should be restarted after re-enabling. */
+
+  DBusTimeoutChangedFunction changed_function; /**< Called when enabled, interval or needs_restart change */
+  void *changed_data;                          /**< Data for changed_function */
 };
 
+static void
+timeout_changed (DBusTimeout *timeout)
+{
+  if (timeout->changed_function != NULL)
+    (* timeout->changed_function) (timeout, timeout->changed_data);
+}
+
 /**
  * Creates a new DBusTimeout, enabled by default.
  * @param interval the timeout interval in milliseconds.
@@ -143,6 +153,28 @@ _dbus_timeout_restart (DBusTimeout *timeout,
   timeout->interval = interval;
   timeout->enabled = TRUE;
   timeout->needs_restart = TRUE;
+  timeout_changed (timeout);
+}
+
+/**
+ * Changes the interval of a timeout without enabling it. The new
+ * interval is counted from when the timeout is next enabled; the
+ * caller must toggle it through its #DBusTimeoutList afterwards so
+ * that application main loops pick up the change, since "whenever
+ * a timeout is toggled, its interval may change."
+ *
+ * @param timeout the timeout
+ * @param interval the new interval
+ */
+void
+_dbus_timeout_set_interval (DBusTimeout *timeout,
+                            int          interval)
+{
+  _dbus_assert (interval >= 0);
+
+  timeout->interval = interval;
+  timeout->needs_restart = TRUE;
+  timeout_changed (timeout);
 }
 
 /**
@@ -159,6 +191,7 @@ void
 _dbus_timeout_disable (DBusTimeout  *timeout)
 {
   timeout->enabled = FALSE;
+  timeout_changed (timeout);
 }
 
 /**
@@ -373,6 +406,7 @@ _dbus_timeout_list_toggle_timeout (DBusTimeoutList           *timeout_list,
     return;
 
   timeout->enabled = enabled;
+  timeout_changed (timeout);
   
   if (timeout_list->timeout_toggled_function != NULL)
     (* timeout_list->timeout_toggled_function) (timeout,
@@ -403,6 +437,31 @@ _dbus_timeout_restarted (DBusTimeout *timeout)
   timeout->needs_restart = FALSE;
 }
 
+/**
+ * Sets a function to be called whenever the timeout is enabled or
+ * disabled, or its interval or whether it needs restarting changes,
+ * so that DBusLoop can keep its timeouts ordered by when they expire
+ * instead of checking every one of them on each iteration.
+ *
+ * The function is called synchronously by whichever thread changes the
+ * timeout, so a timeout with such a function may only be changed on
+ * the thread that the function expects.
+ *
+ * @param timeout the timeout
+ * @param function the function, or #NULL to unset it
+ * @param data data to pass to the function
+ */
+void
+_dbus_timeout_set_changed_function (DBusTimeout                *timeout,
+                                    DBusTimeoutChangedFunction  function,
+                                    void                       *data)
+{
+  _dbus_assert (function == NULL || timeout->changed_function == NULL);
+
+  timeout->changed_function = function;
+  timeout->changed_data = data;
+}
+
 /** @} */
 
 /**
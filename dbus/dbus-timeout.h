@@ -40,6 +40,10 @@ typedef struct DBusTimeoutList DBusTimeoutList;
 /** function to run when the timeout is handled */
 typedef dbus_bool_t (* DBusTimeoutHandler) (void *data);
 
+/** function to run when the timeout's state changes */
+typedef void (* DBusTimeoutChangedFunction) (DBusTimeout *timeout,
+                                             void        *data);
+
 DBUS_PRIVATE_EXPORT
 DBusTimeout* _dbus_timeout_new          (int                 interval,
                                          DBusTimeoutHandler  handler,
@@ -51,6 +55,8 @@ void         _dbus_timeout_unref        (DBusTimeout        *timeout);
 DBUS_PRIVATE_EXPORT
 void         _dbus_timeout_restart      (DBusTimeout        *timeout,
                                          int                 interval);
+void         _dbus_timeout_set_interval (DBusTimeout        *timeout,
+                                         int                 interval);
 DBUS_PRIVATE_EXPORT
 void         _dbus_timeout_disable      (DBusTimeout        *timeout);
 
@@ -74,6 +80,10 @@ DBUS_PRIVATE_EXPORT
 dbus_bool_t _dbus_timeout_needs_restart (DBusTimeout *timeout);
 DBUS_PRIVATE_EXPORT
 void        _dbus_timeout_restarted     (DBusTimeout *timeout);
+DBUS_PRIVATE_EXPORT
+void        _dbus_timeout_set_changed_function (DBusTimeout                *timeout,
+                                                DBusTimeoutChangedFunction  function,
+                                                void                       *data);
 
 /** @} */
 
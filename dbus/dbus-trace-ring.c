@@ -0,0 +1,114 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-trace-ring.c - Recent message-path events, kept for post-mortems
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-trace-ring.h"
+
+#ifdef DBUS_ENABLE_TRACE_RING
+
+#include "dbus-sysdeps.h"
+
+#include <stdio.h>
+
+/* Not static, so that a debugger can find it in a core file */
+DBusTraceRecord _dbus_trace_ring[_DBUS_TRACE_RING_SIZE];
+static DBusAtomic next_seq = { 0 };
+
+/**
+ * Records an event in the trace ring. This does no formatting and
+ * takes no lock, so it is cheap enough to leave enabled everywhere;
+ * each caller claims its own record by atomically incrementing the
+ * sequence number.
+ *
+ * @param event the name of the probe, which must be a string literal
+ * @param serial the message's serial number
+ * @param size the message's size in bytes
+ * @param count an extra count, or -1
+ */
+void
+_dbus_trace_ring_record (const char    *event,
+                         dbus_uint32_t  serial,
+                         dbus_uint32_t  size,
+                         dbus_int32_t   count)
+{
+  dbus_uint32_t seq;
+  DBusTraceRecord *record;
+  long tv_sec, tv_usec;
+
+  seq = (dbus_uint32_t) _dbus_atomic_inc (&next_seq);
+  record = &_dbus_trace_ring[seq % _DBUS_TRACE_RING_SIZE];
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  record->serial = serial;
+  record->usec = (dbus_int64_t) tv_sec * 1000000 + tv_usec;
+  record->event = event;
+  record->size = size;
+  record->count = count;
+  record->seq = seq + 1;
+}
+
+/**
+ * Writes the trace ring to stderr, oldest first. This is meant for
+ * when the process is about to abort, so it does not allocate or lock.
+ */
+void
+_dbus_trace_ring_dump (void)
+{
+  dbus_uint32_t end;
+  dbus_uint32_t seq;
+
+  end = (dbus_uint32_t) _dbus_atomic_get (&next_seq);
+
+  if (end == 0)
+    return;
+
+  fprintf (stderr, "  Last %u message events, oldest first:\n",
+           end < _DBUS_TRACE_RING_SIZE ? end : _DBUS_TRACE_RING_SIZE);
+
+  seq = end < _DBUS_TRACE_RING_SIZE ? 0 : end - _DBUS_TRACE_RING_SIZE;
+
+  for (; seq != end; seq++)
+    {
+      const DBusTraceRecord *record;
+
+      record = &_dbus_trace_ring[seq % _DBUS_TRACE_RING_SIZE];
+
+      /* Overwritten since we read next_seq, or still being written */
+      if (record->seq != seq + 1 || record->event == NULL)
+        continue;
+
+      if (record->count >= 0)
+        fprintf (stderr, "  %ld.%06d %s serial=%u size=%u count=%d\n",
+                 (long) (record->usec / 1000000), (int) (record->usec % 1000000),
+                 record->event, record->serial, record->size,
+                 record->count);
+      else
+        fprintf (stderr, "  %ld.%06d %s serial=%u size=%u\n",
+                 (long) (record->usec / 1000000), (int) (record->usec % 1000000),
+                 record->event, record->serial, record->size);
+    }
+}
+
+#endif /* DBUS_ENABLE_TRACE_RING */
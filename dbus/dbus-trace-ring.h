@@ -0,0 +1,63 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-trace-ring.h - Recent message-path events, kept for post-mortems
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_TRACE_RING_H
+#define DBUS_TRACE_RING_H
+
+#include <dbus/dbus-internals.h>
+
+DBUS_BEGIN_DECLS
+
+#ifdef DBUS_ENABLE_TRACE_RING
+
+/** Number of records kept; a power of 2 */
+#define _DBUS_TRACE_RING_SIZE 4096
+
+/**
+ * One event in the trace ring. The layout is fixed so that the ring can
+ * be read out of a core file, e.g. with "p _dbus_trace_ring" in gdb.
+ */
+typedef struct
+{
+  dbus_uint32_t seq;      /**< 1 + position in the sequence of all events;
+                               0 if never written */
+  dbus_uint32_t serial;   /**< Serial number of the message */
+  dbus_int64_t usec;      /**< Monotonic time of the event */
+  const char *event;      /**< Name of the probe that recorded it */
+  dbus_uint32_t size;     /**< Size of the message in bytes */
+  dbus_int32_t count;     /**< Extra count, or -1 if the probe has none */
+} DBusTraceRecord;
+
+DBUS_PRIVATE_EXPORT
+void _dbus_trace_ring_record (const char    *event,
+                              dbus_uint32_t  serial,
+                              dbus_uint32_t  size,
+                              dbus_int32_t   count);
+void _dbus_trace_ring_dump   (void);
+
+#endif /* DBUS_ENABLE_TRACE_RING */
+
+DBUS_END_DECLS
+
+#endif /* DBUS_TRACE_RING_H */
@@ -79,6 +79,8 @@ struct DBusTransportVTable
  */
 struct DBusTransport
 {
+  /* Fields used for every message come first; see DBusConnection */
+
   int refcount;                               /**< Reference count. */
 
   const DBusTransportVTable *vtable;          /**< Virtual methods for this instance. */
@@ -87,14 +89,29 @@ struct DBusTransport
 
   DBusMessageLoader *loader;                  /**< Message-loading buffer. */
 
-  DBusAuth *auth;                             /**< Authentication conversation */
-
-  DBusCredentials *credentials;               /**< Credentials of other end read from the socket */  
+  DBusCounter *live_messages;                 /**< Counter for size/unix fds of all live messages. */
 
   long max_live_messages_size;                /**< Max total size of received messages. */
   long max_live_messages_unix_fds;            /**< Max total unix fds of received messages. */
 
-  DBusCounter *live_messages;                 /**< Counter for size/unix fds of all live messages. */
+  void (* throttle_function) (void *, dbus_bool_t); /**< Called when we stop or resume reading because of live_messages */
+  void *throttle_data;                              /**< Data for throttle_function */
+
+  DBusAuth *auth;                             /**< Authentication conversation */
+
+  unsigned int disconnected : 1;              /**< #TRUE if we are disconnected. */
+  unsigned int authenticated : 1;             /**< Cache of auth state; use _dbus_transport_peek_is_authenticated() to query value */
+  unsigned int send_credentials_pending : 1;  /**< #TRUE if we need to send credentials */
+  unsigned int receive_credentials_pending : 1; /**< #TRUE if we need to receive credentials */
+  unsigned int is_server : 1;                 /**< #TRUE if on the server side */
+  unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
+  unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int throttled : 1;                 /**< #TRUE if live_messages is at one of its limits */
+  unsigned int reading_paused : 1;            /**< #TRUE if we must not read, see _dbus_transport_set_reading_paused() */
+
+  /* Rarely used from here on */
+
+  DBusCredentials *credentials;               /**< Credentials of other end read from the socket */  
 
   char *address;                              /**< Address of the server we are connecting to (#NULL for the server side of a transport) */
 
@@ -109,14 +126,6 @@ struct DBusTransport
   void *windows_user_data;                            /**< Data for windows_user_function */
   
   DBusFreeFunction free_windows_user_data;            /**< Function to free windows_user_data */
-  
-  unsigned int disconnected : 1;              /**< #TRUE if we are disconnected. */
-  unsigned int authenticated : 1;             /**< Cache of auth state; use _dbus_transport_peek_is_authenticated() to query value */
-  unsigned int send_credentials_pending : 1;  /**< #TRUE if we need to send credentials */
-  unsigned int receive_credentials_pending : 1; /**< #TRUE if we need to receive credentials */
-  unsigned int is_server : 1;                 /**< #TRUE if on the server side */
-  unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
-  unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
@@ -29,6 +29,10 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#include "dbus-probes-internal.h"
+#ifdef DBUS_UNIX
+#include "dbus-sysdeps-unix.h"
+#endif
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -54,6 +58,9 @@ struct DBusTransportSocket
   DBusWatch *write_watch;               /**< Watch for writability. */
 
   int max_bytes_read_per_iteration;     /**< To avoid blocking too long. */
+  int read_chunk_size;                  /**< Current size of a single read,
+                                         *   grown while reads come back full.
+                                         */
   int max_bytes_written_per_iteration;  /**< To avoid blocking too long. */
 
   int message_bytes_written;            /**< Number of bytes of current
@@ -191,7 +198,9 @@ check_read_watch (DBusTransport *transport)
   
   _dbus_transport_ref (transport);
 
-  if (_dbus_transport_try_to_authenticate (transport))
+  if (transport->reading_paused)
+    need_read_watch = FALSE;
+  else if (_dbus_transport_try_to_authenticate (transport))
     need_read_watch =
       (_dbus_counter_get_size_value (transport->live_messages) < transport->max_live_messages_size) &&
       (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds);
@@ -498,6 +507,125 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+/** Most messages do_writing() gathers into a single write */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_WRITE_SOCKET_MAX_VECTORS / 2)
+
+/*
+ * Returns whether writing the message needs a write of its own,
+ * because it has fds that must ride along with its first byte.
+ */
+static dbus_bool_t
+message_needs_own_write (DBusTransport *transport,
+                         DBusMessage   *message)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  const int *unix_fds;
+  unsigned n;
+
+  if (!DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport))
+    return FALSE;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+  return n > 0;
+#else
+  return FALSE;
+#endif
+}
+
+/*
+ * Writes as many of the queued messages as fit in budget bytes with
+ * one system call, starting with a message none of which has been
+ * written yet. Returns the number of bytes written or -1 as for
+ * _dbus_write_socket(), or 0 without writing if fewer than two
+ * messages qualify, in which case the caller writes one as usual.
+ */
+static int
+write_message_batch (DBusTransport *transport,
+                     int            budget,
+                     int           *saved_errno)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+  const DBusString *buffers[_DBUS_WRITE_SOCKET_MAX_VECTORS];
+  int starts[_DBUS_WRITE_SOCKET_MAX_VECTORS];
+  int lens[_DBUS_WRITE_SOCKET_MAX_VECTORS];
+  int n_messages, n_batched, batched_bytes;
+  int bytes_written, remaining;
+  int i;
+
+  _dbus_assert (socket_transport->message_bytes_written == 0);
+
+  n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                      messages,
+                                                      MAX_MESSAGES_PER_WRITE);
+  n_batched = 0;
+  batched_bytes = 0;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      const DBusString *header;
+      const DBusString *body;
+      int len;
+
+      if (message_needs_own_write (transport, messages[i]))
+        break;
+
+      dbus_message_lock (messages[i]);
+      _dbus_message_get_network_data (messages[i], &header, &body);
+      len = _dbus_string_get_length (header) + _dbus_string_get_length (body);
+
+      if (n_batched > 0 && batched_bytes + len > budget)
+        break;
+
+      buffers[2 * i] = header;
+      starts[2 * i] = 0;
+      lens[2 * i] = _dbus_string_get_length (header);
+      buffers[2 * i + 1] = body;
+      starts[2 * i + 1] = 0;
+      lens[2 * i + 1] = _dbus_string_get_length (body);
+
+      n_batched += 1;
+      batched_bytes += len;
+    }
+
+  if (n_batched < 2)
+    return 0;
+
+  bytes_written = _dbus_write_socket_vectors (socket_transport->fd,
+                                              buffers, starts, lens,
+                                              2 * n_batched);
+  *saved_errno = _dbus_save_socket_errno ();
+
+  if (bytes_written <= 0)
+    return bytes_written < 0 ? -1 : 0;
+
+  _dbus_verbose (" wrote %d bytes of %d in a batch of %d messages\n",
+                 bytes_written, batched_bytes, n_batched);
+
+  /* Retire the messages that went out completely; a partially written
+   * one carries on through message_bytes_written like any other.
+   */
+  remaining = bytes_written;
+
+  for (i = 0; i < n_batched; i++)
+    {
+      int len = lens[2 * i] + lens[2 * i + 1];
+
+      if (remaining < len)
+        {
+          socket_transport->message_bytes_written = remaining;
+          break;
+        }
+
+      remaining -= len;
+      _DBUS_PROBE_MESSAGE (message__written, messages[i]);
+      _dbus_connection_message_sent_unlocked (transport->connection,
+                                              messages[i]);
+    }
+
+  return bytes_written;
+}
+
 /* returns false on oom */
 static dbus_bool_t
 do_writing (DBusTransport *transport)
@@ -545,7 +673,34 @@ do_writing (DBusTransport *transport)
                          total, socket_transport->max_bytes_written_per_iteration);
           goto out;
         }
-      
+
+      if (socket_transport->message_bytes_written == 0 &&
+          !_dbus_auth_needs_encoding (transport->auth))
+        {
+          bytes_written =
+            write_message_batch (transport,
+                                 socket_transport->max_bytes_written_per_iteration - total,
+                                 &saved_errno);
+
+          if (bytes_written > 0)
+            {
+              total += bytes_written;
+              continue;
+            }
+          else if (bytes_written < 0)
+            {
+              /* as below; there are no fds, so no ETOOMANYREFS */
+              if (_dbus_get_is_errno_eagain_or_ewouldblock (saved_errno) ||
+                  _dbus_get_is_errno_epipe (saved_errno))
+                goto out;
+
+              _dbus_verbose ("Error writing to remote app: %s\n",
+                             _dbus_strerror (saved_errno));
+              do_io_error (transport);
+              goto out;
+            }
+        }
+
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
       dbus_message_lock (message);
@@ -723,6 +878,7 @@ do_writing (DBusTransport *transport)
               _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
               _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
 
+              _DBUS_PROBE_MESSAGE (message__written, message);
               _dbus_connection_message_sent_unlocked (transport->connection,
                                                       message);
             }
@@ -736,6 +892,37 @@ do_writing (DBusTransport *transport)
     return TRUE;
 }
 
+/** Largest single read do_reading() grows to */
+#define MAX_READ_CHUNK_SIZE (64 * 1024)
+
+/** How many reads' worth of data do_reading() takes before yielding */
+#define READ_CHUNKS_PER_ITERATION 4
+
+/*
+ * Adapts the read size to the last read: a read that filled the whole
+ * chunk suggests the peer has more queued, so the next read asks for
+ * twice as much; a read that came back mostly empty shrinks it again,
+ * so idle connections don't keep big buffers around.
+ */
+static void
+update_read_chunk_size (DBusTransportSocket *socket_transport,
+                        int                  requested,
+                        int                  bytes_read)
+{
+  int chunk = socket_transport->read_chunk_size;
+
+  if (requested < chunk)
+    return; /* the loader limited the read, it says nothing about the peer */
+
+  if (bytes_read == chunk && chunk < MAX_READ_CHUNK_SIZE)
+    chunk *= 2;
+  else if (bytes_read < chunk / 4)
+    chunk /= 2;
+
+  socket_transport->read_chunk_size =
+    MAX (chunk, socket_transport->max_bytes_read_per_iteration);
+}
+
 /* returns false on out-of-memory */
 static dbus_bool_t
 do_reading (DBusTransport *transport)
@@ -743,7 +930,9 @@ do_reading (DBusTransport *transport)
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   DBusString *buffer;
   int bytes_read;
+  int max_to_read;
   int total;
+  int budget;
   dbus_bool_t oom;
   int saved_errno;
 
@@ -758,15 +947,21 @@ do_reading (DBusTransport *transport)
   
   total = 0;
 
+  /* Drain until EAGAIN, but give other connections a turn once we've
+   * had a few reads' worth; the budget is fixed on entry so a burst
+   * that grows the chunk mid-loop can't extend its own turn.
+   */
+  budget = socket_transport->read_chunk_size * READ_CHUNKS_PER_ITERATION;
+
  again:
   
   /* See if we've exceeded max messages and need to disable reading */
   check_read_watch (transport);
   
-  if (total > socket_transport->max_bytes_read_per_iteration)
+  if (total >= budget)
     {
       _dbus_verbose ("%d bytes exceeds %d bytes read per iteration, returning\n",
-                     total, socket_transport->max_bytes_read_per_iteration);
+                     total, budget);
       goto out;
     }
 
@@ -784,17 +979,19 @@ do_reading (DBusTransport *transport)
       /* Does fd passing even make sense with encoded data? */
       _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
 
+      max_to_read = socket_transport->read_chunk_size;
+
       if (_dbus_string_get_length (&socket_transport->encoded_incoming) > 0)
         bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
       else
         bytes_read = _dbus_read_socket (socket_transport->fd,
                                         &socket_transport->encoded_incoming,
-                                        socket_transport->max_bytes_read_per_iteration);
+                                        max_to_read);
 
       saved_errno = _dbus_save_socket_errno ();
 
       _dbus_assert (_dbus_string_get_length (&socket_transport->encoded_incoming) ==
-                    bytes_read);
+                    (bytes_read > 0 ? bytes_read : 0));
       
       if (bytes_read > 0)
         {
@@ -807,10 +1004,17 @@ do_reading (DBusTransport *transport)
                                        &socket_transport->encoded_incoming,
                                        buffer))
             {
-              _dbus_verbose ("Out of memory decoding incoming data\n");
               _dbus_message_loader_return_buffer (transport->loader,
                                               buffer);
 
+              if (_dbus_auth_get_stream_corrupted (transport->auth))
+                {
+                  _dbus_verbose ("Undecodable data from remote app\n");
+                  do_io_error (transport);
+                  goto out;
+                }
+
+              _dbus_verbose ("Out of memory decoding incoming data\n");
               oom = TRUE;
               goto out;
             }
@@ -824,16 +1028,17 @@ do_reading (DBusTransport *transport)
     }
   else
     {
-      int max_to_read = DBUS_MAXIMUM_MESSAGE_LENGTH;
       dbus_bool_t may_read_unix_fds = TRUE;
 
+      max_to_read = DBUS_MAXIMUM_MESSAGE_LENGTH;
+
       _dbus_message_loader_get_buffer (transport->loader,
                                        &buffer,
                                        &max_to_read,
                                        &may_read_unix_fds);
 
-      if (max_to_read > socket_transport->max_bytes_read_per_iteration)
-        max_to_read = socket_transport->max_bytes_read_per_iteration;
+      if (max_to_read > socket_transport->read_chunk_size)
+        max_to_read = socket_transport->read_chunk_size;
 
 #ifdef HAVE_UNIX_FD_PASSING
       if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport) && may_read_unix_fds)
@@ -904,6 +1109,8 @@ do_reading (DBusTransport *transport)
       
       total += bytes_read;      
 
+      update_read_chunk_size (socket_transport, max_to_read, bytes_read);
+
       if (!_dbus_transport_queue_messages (transport))
         {
           oom = TRUE;
@@ -1330,6 +1537,19 @@ _dbus_transport_new_for_socket (DBusSocket        fd,
 
 #ifdef HAVE_UNIX_FD_PASSING
   _dbus_auth_set_unix_fd_possible(socket_transport->base.auth, _dbus_socket_can_pass_unix_fd(fd));
+
+  /* A server running as root or as ourselves could do anything to us
+   * anyway, so if it promises to have validated what it sends, there
+   * is no point checking it again. */
+  if (server_guid == NULL && _dbus_socket_can_pass_unix_fd (fd))
+    {
+      dbus_uid_t peer_uid;
+
+      if (_dbus_socket_get_peer_uid (fd, &peer_uid) &&
+          (peer_uid == 0 || peer_uid == _dbus_geteuid ()))
+        _dbus_auth_set_want_validated_bodies (socket_transport->base.auth,
+                                              TRUE);
+    }
 #endif
 
   socket_transport->fd = fd;
@@ -1338,6 +1558,8 @@ _dbus_transport_new_for_socket (DBusSocket        fd,
   /* These values should probably be tunable or something. */     
   socket_transport->max_bytes_read_per_iteration = 2048;
   socket_transport->max_bytes_written_per_iteration = 2048;
+  socket_transport->read_chunk_size =
+    socket_transport->max_bytes_read_per_iteration;
   
   return (DBusTransport*) socket_transport;
 
@@ -1368,6 +1590,9 @@ failed:
  * @param port the port to connect to
  * @param family the address family to connect to
  * @param noncefile path to nonce file
+ * @param nodelay whether to disable Nagle's algorithm on the socket
+ * @param keepalive whether to enable TCP keepalives on the socket
+ * @param compress whether to ask the server to compress the stream
  * @param error location to store reason for failure.
  * @returns a new transport, or #NULL on failure.
  */
@@ -1376,6 +1601,9 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
                                     const char     *port,
                                     const char     *family,
                                     const char     *noncefile,
+                                    dbus_bool_t     nodelay,
+                                    dbus_bool_t     keepalive,
+                                    dbus_bool_t     compress,
                                     DBusError      *error)
 {
   DBusSocket fd;
@@ -1414,6 +1642,15 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
        !_dbus_string_append (&address, noncefile)))
     goto error;
 
+  if (nodelay && !_dbus_string_append (&address, ",nodelay=true"))
+    goto error;
+
+  if (keepalive && !_dbus_string_append (&address, ",keepalive=true"))
+    goto error;
+
+  if (compress && !_dbus_string_append (&address, ",compress=true"))
+    goto error;
+
   fd = _dbus_connect_tcp_socket_with_nonce (host, port, family, noncefile, error);
   if (!_dbus_socket_is_valid (fd))
     {
@@ -1422,6 +1659,16 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
       return NULL;
     }
 
+  /* Connected sockets start out with both off, so only touch them if asked */
+  if ((nodelay || keepalive) &&
+      !_dbus_set_tcp_socket_options (fd, nodelay, keepalive, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_string_free (&address);
+      _dbus_close_socket (fd, NULL);
+      return NULL;
+    }
+
   _dbus_verbose ("Successfully connected to tcp socket %s:%s\n",
                  host, port);
   
@@ -1433,6 +1680,10 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
       _dbus_close_socket (fd, NULL);
       _dbus_socket_invalidate (&fd);
     }
+  else if (compress)
+    {
+      _dbus_auth_set_compression_possible (transport->auth, TRUE);
+    }
 
   return transport;
 
@@ -1442,6 +1693,36 @@ error:
   return NULL;
 }
 
+/*
+ * Parses an optional true/false key of a tcp address into *value_p,
+ * leaving it alone if the key isn't there.
+ */
+static dbus_bool_t
+get_boolean_address_value (DBusAddressEntry *entry,
+                           const char       *key,
+                           dbus_bool_t      *value_p,
+                           DBusError        *error)
+{
+  const char *value = dbus_address_entry_get_value (entry, key);
+
+  if (value == NULL)
+    return TRUE;
+
+  if (strcmp (value, "true") == 0)
+    *value_p = TRUE;
+  else if (strcmp (value, "false") == 0)
+    *value_p = FALSE;
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Value of \"%s\" must be \"true\" or \"false\", not \"%s\"",
+                      key, value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Opens a TCP socket transport.
  * 
@@ -1471,6 +1752,9 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
       const char *port = dbus_address_entry_get_value (entry, "port");
       const char *family = dbus_address_entry_get_value (entry, "family");
       const char *noncefile = dbus_address_entry_get_value (entry, "noncefile");
+      dbus_bool_t nodelay = FALSE;
+      dbus_bool_t keepalive = FALSE;
+      dbus_bool_t compress = FALSE;
 
       if ((isNonceTcp == TRUE) != (noncefile != NULL)) {
           _dbus_set_bad_address (error, method, "noncefile", NULL);
@@ -1483,7 +1767,15 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
           return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
         }
 
-      *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family, noncefile, error);
+      if (!get_boolean_address_value (entry, "nodelay", &nodelay, error) ||
+          !get_boolean_address_value (entry, "keepalive", &keepalive, error) ||
+          !get_boolean_address_value (entry, "compress", &compress, error))
+        return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+
+      *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family,
+                                                         noncefile, nodelay,
+                                                         keepalive, compress,
+                                                         error);
       if (*transport_p == NULL)
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -34,6 +34,9 @@ DBusTransport*          _dbus_transport_new_for_tcp_socket (const char        *h
                                                             const char        *port,
                                                             const char        *family,
                                                             const char        *noncefile,
+                                                            dbus_bool_t        nodelay,
+                                                            dbus_bool_t        keepalive,
+                                                            dbus_bool_t        compress,
                                                             DBusError         *error);
 DBusTransportOpenResult _dbus_transport_open_socket        (DBusAddressEntry  *entry,
                                                             DBusTransport    **transport_p,
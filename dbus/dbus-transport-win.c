@@ -51,8 +51,76 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
                                         DBusTransport    **transport_p,
                                         DBusError         *error)
 {
-  /* currently no Windows-specific transports */
-  return DBUS_TRANSPORT_OPEN_NOT_HANDLED;
+  const char *method;
+  const char *path;
+  DBusSocket fd;
+  DBusString address;
+
+  method = dbus_address_entry_get_method (entry);
+  _dbus_assert (method != NULL);
+
+  if (strcmp (method, "unix") != 0)
+    return DBUS_TRANSPORT_OPEN_NOT_HANDLED;
+
+  path = dbus_address_entry_get_value (entry, "path");
+
+  if (dbus_address_entry_get_value (entry, "tmpdir") != NULL)
+    {
+      _dbus_set_bad_address (error, NULL, NULL,
+                             "cannot use the \"tmpdir\" option for an address to connect to, only in an address to listen on");
+      return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+    }
+
+  if (dbus_address_entry_get_value (entry, "abstract") != NULL)
+    {
+      _dbus_set_bad_address (error, NULL, NULL,
+                             "abstract sockets are not supported on Windows");
+      return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+    }
+
+  if (path == NULL)
+    {
+      _dbus_set_bad_address (error, "unix", "path", NULL);
+      return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+    }
+
+  if (!_dbus_string_init (&address))
+    {
+      _DBUS_SET_OOM (error);
+      return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+    }
+
+  if (!_dbus_string_append (&address, "unix:path=") ||
+      !_dbus_string_append (&address, path))
+    {
+      _DBUS_SET_OOM (error);
+      _dbus_string_free (&address);
+      return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+    }
+
+  fd = _dbus_win_connect_unix_socket (path, error);
+
+  if (!_dbus_socket_is_valid (fd))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_string_free (&address);
+      return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+    }
+
+  _dbus_verbose ("Successfully connected to unix socket %s\n", path);
+
+  *transport_p = _dbus_transport_new_for_socket (fd, NULL, &address);
+  _dbus_string_free (&address);
+
+  if (*transport_p == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      _dbus_close_socket (fd, NULL);
+      return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+    }
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  return DBUS_TRANSPORT_OPEN_OK;
 }
 
 /** @} */
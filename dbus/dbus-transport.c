@@ -57,6 +57,29 @@
  * or encryption schemes.
  */
 
+/* Tells the throttle function if the live messages have crossed the
+ * limits since it was last called. The connection lock is held. */
+static void
+check_throttled (DBusTransport *transport)
+{
+  dbus_bool_t throttled;
+
+  if (transport->throttle_function == NULL)
+    return;
+
+  throttled =
+    _dbus_counter_get_size_value (transport->live_messages) >=
+      transport->max_live_messages_size ||
+    _dbus_counter_get_unix_fd_value (transport->live_messages) >=
+      transport->max_live_messages_unix_fds;
+
+  if (throttled != transport->throttled)
+    {
+      transport->throttled = throttled;
+      (* transport->throttle_function) (transport->throttle_data, throttled);
+    }
+}
+
 static void
 live_messages_notify (DBusCounter *counter,
                            void        *user_data)
@@ -81,6 +104,8 @@ live_messages_notify (DBusCounter *counter,
       (* transport->vtable->live_messages_changed) (transport);
     }
 
+  check_throttled (transport);
+
   _dbus_transport_unref (transport);
   _dbus_connection_unlock (transport->connection);
 }
@@ -164,6 +189,8 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->vtable = vtable;
   transport->loader = loader;
   transport->auth = auth;
+  _dbus_auth_set_max_decoded_length (auth,
+                                     _dbus_message_loader_get_max_message_size (loader));
   transport->live_messages = counter;
   transport->authenticated = FALSE;
   transport->disconnected = FALSE;
@@ -784,6 +811,10 @@ _dbus_transport_try_to_authenticate (DBusTransport *transport)
               _dbus_connection_unref_unlocked (transport->connection);
               return FALSE;
             }
+
+          /* The server promised to validate everything it sends us */
+          if (_dbus_auth_get_validated_bodies_negotiated (transport->auth))
+            _dbus_message_loader_set_trust_bodies (transport->loader, TRUE);
         }
 
       /* If we're the server, see if we want to allow this identity to proceed.
@@ -1025,48 +1056,41 @@ recover_unused_bytes (DBusTransport *transport)
 {
   if (_dbus_auth_needs_decoding (transport->auth))
     {
-      DBusString plaintext;
       const DBusString *encoded;
       DBusString *buffer;
       int orig_len;
-      
-      if (!_dbus_string_init (&plaintext))
-        goto nomem;
-      
+      dbus_bool_t succeeded;
+
       _dbus_auth_get_unused_bytes (transport->auth,
                                    &encoded);
 
-      if (!_dbus_auth_decode_data (transport->auth,
-                                   encoded, &plaintext))
-        {
-          _dbus_string_free (&plaintext);
-          goto nomem;
-        }
-      
       _dbus_message_loader_get_buffer (transport->loader,
                                        &buffer,
                                        NULL,
                                        NULL);
-      
+
       orig_len = _dbus_string_get_length (buffer);
-      
-      if (!_dbus_string_move (&plaintext, 0, buffer,
-                              orig_len))
-        {
-          _dbus_string_free (&plaintext);
-          goto nomem;
-        }
-      
-      _dbus_verbose (" %d unused bytes sent to message loader\n", 
+
+      /* Decode straight into the loader: a stream decoder can't be
+       * asked to decode the same bytes twice, so whatever it managed
+       * to produce before running out of memory has to be kept.
+       */
+      succeeded = _dbus_auth_decode_data (transport->auth,
+                                          encoded, buffer);
+
+      _dbus_verbose (" %d unused bytes sent to message loader\n",
                      _dbus_string_get_length (buffer) -
                      orig_len);
-      
+
       _dbus_message_loader_return_buffer (transport->loader,
                                           buffer);
 
+      if (!succeeded && !_dbus_auth_get_stream_corrupted (transport->auth))
+        goto nomem;
+
+      /* If the peer sent garbage, the next read reports it as an I/O
+       * error, so we just drop what we have here. */
       _dbus_auth_delete_unused_bytes (transport->auth);
-      
-      _dbus_string_free (&plaintext);
     }
   else
     {
@@ -1197,6 +1221,8 @@ _dbus_transport_queue_messages (DBusTransport *transport)
           if (transport->vtable->live_messages_changed)
             (* transport->vtable->live_messages_changed) (transport);
 
+          check_throttled (transport);
+
           /* pass ownership of link and message ref to connection */
           _dbus_connection_queue_received_message_link (transport->connection,
                                                         link);
@@ -1223,6 +1249,8 @@ _dbus_transport_set_max_message_size (DBusTransport  *transport,
                                       long            size)
 {
   _dbus_message_loader_set_max_message_size (transport->loader, size);
+  _dbus_auth_set_max_decoded_length (transport->auth,
+                                     _dbus_message_loader_get_max_message_size (transport->loader));
 }
 
 /**
@@ -1262,6 +1290,48 @@ _dbus_transport_get_max_message_unix_fds (DBusTransport  *transport)
   return _dbus_message_loader_get_max_message_unix_fds (transport->loader);
 }
 
+/**
+ * See dbus_connection_set_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @param trust #TRUE to skip validation of received message bodies
+ */
+void
+_dbus_transport_set_trust_message_bodies (DBusTransport  *transport,
+                                          dbus_bool_t     trust)
+{
+  _dbus_message_loader_set_trust_bodies (transport->loader, trust);
+}
+
+/**
+ * Sets whether everything sent on a server-side transport has been
+ * validated already, so that a trusting client may skip validating
+ * it again. Must be called before authentication completes.
+ *
+ * @param transport the transport
+ * @param validates #TRUE if every message sent on it has been validated
+ */
+void
+_dbus_transport_set_validates_bodies (DBusTransport  *transport,
+                                      dbus_bool_t     validates)
+{
+  _dbus_assert (transport->is_server);
+
+  _dbus_auth_set_validates_bodies (transport->auth, validates);
+}
+
+/**
+ * See dbus_connection_get_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @returns #TRUE if received message bodies are not validated
+ */
+dbus_bool_t
+_dbus_transport_get_trust_message_bodies (DBusTransport  *transport)
+{
+  return _dbus_message_loader_get_trust_bodies (transport->loader);
+}
+
 /**
  * See dbus_connection_set_max_received_size().
  *
@@ -1310,6 +1380,20 @@ _dbus_transport_get_max_received_size (DBusTransport  *transport)
   return transport->max_live_messages_size;
 }
 
+/**
+ * Gets the total size of the messages read from this transport that
+ * are still alive, whether waiting to be dispatched or queued for
+ * sending elsewhere.
+ *
+ * @param transport the transport
+ * @returns bytes of all live messages
+ */
+long
+_dbus_transport_get_live_messages_size (DBusTransport  *transport)
+{
+  return _dbus_counter_get_size_value (transport->live_messages);
+}
+
 /**
  * See dbus_connection_set_max_received_unix_fds().
  *
@@ -1475,6 +1559,24 @@ _dbus_transport_get_linux_security_label (DBusTransport  *transport,
     }
 }
 
+/**
+ * If the transport has been authenticated, return the credentials
+ * attached to its #DBusAuth. The caller must not modify them, and
+ * must not keep them beyond the lifetime of the transport or a
+ * further authentication.
+ *
+ * @param transport the transport
+ * @returns credentials, or #NULL if not authenticated
+ */
+DBusCredentials *
+_dbus_transport_get_credentials (DBusTransport  *transport)
+{
+  if (!transport->authenticated)
+    return NULL;
+
+  return _dbus_auth_get_identity (transport->auth);
+}
+
 /**
  * See dbus_connection_get_windows_user().
  *
@@ -1589,6 +1691,143 @@ _dbus_transport_set_pending_fds_function (DBusTransport *transport,
                                                  callback, data);
 }
 
+/**
+ * Register a function to be called when the transport stops reading
+ * because the messages it has received and not yet freed reached the
+ * limits set with _dbus_transport_set_max_received_size() or
+ * _dbus_transport_set_max_received_unix_fds(), and again when it
+ * resumes. The function is called with the connection lock held.
+ *
+ * @param transport the transport
+ * @param callback the callback, or #NULL
+ * @param data data for the callback
+ */
+void
+_dbus_transport_set_throttle_function (DBusTransport *transport,
+                                       void (* callback) (void *, dbus_bool_t),
+                                       void *data)
+{
+  transport->throttle_function = callback;
+  transport->throttle_data = data;
+  /* Reported afresh on the next change in the live messages */
+  transport->throttled = FALSE;
+}
+
+/**
+ * Stops or resumes reading from the transport, regardless of how
+ * many received messages are still alive. Messages that were already
+ * read are unaffected.
+ *
+ * @param transport the transport
+ * @param paused #TRUE to stop reading
+ */
+void
+_dbus_transport_set_reading_paused (DBusTransport *transport,
+                                    dbus_bool_t    paused)
+{
+  transport->reading_paused = (paused != FALSE);
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * Checks whether another process could take over this transport's
+ * socket without losing anything: authentication has finished, the
+ * socket is still connected, the stream is neither encoded nor
+ * compressed, and nothing has been read from it that was not yet
+ * turned into a message and dispatched.
+ *
+ * @param transport the transport
+ * @returns #TRUE if the socket can be handed over
+ */
+dbus_bool_t
+_dbus_transport_can_hand_off (DBusTransport *transport)
+{
+  DBusSocket fd;
+
+  if (!transport->is_server || !transport->authenticated)
+    return FALSE;
+
+  if (!_dbus_transport_get_socket_fd (transport, &fd))
+    return FALSE;
+
+  if (_dbus_auth_needs_encoding (transport->auth) ||
+      _dbus_auth_needs_decoding (transport->auth) ||
+      _dbus_auth_get_compression_negotiated (transport->auth))
+    return FALSE;
+
+  if (!transport->unused_bytes_recovered)
+    {
+      const DBusString *bytes;
+
+      _dbus_auth_get_unused_bytes (transport->auth, &bytes);
+
+      if (_dbus_string_get_length (bytes) > 0)
+        return FALSE;
+    }
+
+  return _dbus_message_loader_is_empty (transport->loader);
+}
+
+/**
+ * Gets what another process needs to take over this transport's
+ * socket with _dbus_transport_set_handed_off(). Only valid if
+ * _dbus_transport_can_hand_off() returned #TRUE.
+ *
+ * @param transport the transport
+ * @param identity return location for the authorized identity, not a copy
+ * @param unix_fd_negotiated return location for whether fd passing was agreed
+ * @param validated_bodies_negotiated return location for whether we
+ *   promised to validate what we send
+ */
+void
+_dbus_transport_get_handoff_state (DBusTransport    *transport,
+                                   DBusCredentials **identity,
+                                   dbus_bool_t      *unix_fd_negotiated,
+                                   dbus_bool_t      *validated_bodies_negotiated)
+{
+  _dbus_assert (transport->authenticated);
+
+  *identity = _dbus_auth_get_identity (transport->auth);
+  *unix_fd_negotiated = _dbus_auth_get_unix_fd_negotiated (transport->auth);
+  *validated_bodies_negotiated =
+    _dbus_auth_get_validated_bodies_negotiated (transport->auth);
+}
+
+/**
+ * Marks a new server transport as already authenticated, because
+ * another process authenticated the peer and handed the socket over
+ * to us. The usual checks on the identity, such as the unix user
+ * function, still run the first time authentication is queried.
+ *
+ * @param transport the transport, which must be new
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was agreed
+ * @param validated_bodies_negotiated whether we promised to validate
+ *   what we send
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+_dbus_transport_set_handed_off (DBusTransport   *transport,
+                                DBusCredentials *identity,
+                                dbus_bool_t      unix_fd_negotiated,
+                                dbus_bool_t      validated_bodies_negotiated)
+{
+  _dbus_assert (transport->is_server);
+  _dbus_assert (!transport->authenticated);
+
+  if (!_dbus_auth_set_authenticated (transport->auth, identity,
+                                     unix_fd_negotiated,
+                                     validated_bodies_negotiated))
+    return FALSE;
+
+  /* The peer sent its credentials byte to the previous owner */
+  transport->receive_credentials_pending = FALSE;
+  transport->send_credentials_pending = FALSE;
+  return TRUE;
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_transport_get_stats (DBusTransport  *transport,
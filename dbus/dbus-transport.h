@@ -62,10 +62,16 @@ long               _dbus_transport_get_max_message_size   (DBusTransport
 void               _dbus_transport_set_max_received_size  (DBusTransport              *transport,
                                                            long                        size);
 long               _dbus_transport_get_max_received_size  (DBusTransport              *transport);
+long               _dbus_transport_get_live_messages_size (DBusTransport              *transport);
 
 void               _dbus_transport_set_max_message_unix_fds (DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_message_unix_fds (DBusTransport              *transport);
+void               _dbus_transport_set_trust_message_bodies (DBusTransport              *transport,
+                                                             dbus_bool_t                 trust);
+dbus_bool_t        _dbus_transport_get_trust_message_bodies (DBusTransport              *transport);
+void               _dbus_transport_set_validates_bodies     (DBusTransport              *transport,
+                                                             dbus_bool_t                 validates);
 void               _dbus_transport_set_max_received_unix_fds(DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_received_unix_fds(DBusTransport              *transport);
@@ -89,6 +95,7 @@ dbus_bool_t        _dbus_transport_get_windows_user       (DBusTransport
                                                            char                      **windows_sid_p);
 dbus_bool_t        _dbus_transport_get_linux_security_label (DBusTransport            *transport,
                                                            char                      **label_p);
+DBusCredentials   *_dbus_transport_get_credentials        (DBusTransport              *transport);
 
 void               _dbus_transport_set_windows_user_function (DBusTransport              *transport,
                                                               DBusAllowWindowsUserFunction   function,
@@ -104,6 +111,20 @@ int                _dbus_transport_get_pending_fds_count  (DBusTransport
 void               _dbus_transport_set_pending_fds_function (DBusTransport *transport,
                                                              void (* callback) (void *),
                                                              void *data);
+void               _dbus_transport_set_throttle_function (DBusTransport *transport,
+                                                          void (* callback) (void *, dbus_bool_t),
+                                                          void *data);
+void               _dbus_transport_set_reading_paused     (DBusTransport              *transport,
+                                                           dbus_bool_t                 paused);
+dbus_bool_t        _dbus_transport_can_hand_off           (DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_set_handed_off         (DBusTransport              *transport,
+                                                           DBusCredentials            *identity,
+                                                           dbus_bool_t                 unix_fd_negotiated,
+                                                           dbus_bool_t                 validated_bodies_negotiated);
+void               _dbus_transport_get_handoff_state      (DBusTransport              *transport,
+                                                           DBusCredentials           **identity,
+                                                           dbus_bool_t                *unix_fd_negotiated,
+                                                           dbus_bool_t                *validated_bodies_negotiated);
 
 /* if DBUS_ENABLE_STATS */
 void _dbus_transport_get_stats (DBusTransport  *transport,
@@ -268,6 +268,8 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
         gid = n;
     }
 
+  _dbus_user_database_prune (db);
+
   if (gid != DBUS_GID_UNSET)
     info = _dbus_hash_table_lookup_uintptr (db->groups, gid);
   else
@@ -281,13 +283,21 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
     }
   else
     {
+      DBusError local_error = DBUS_ERROR_INIT;
+      dbus_bool_t filled;
+
       if (gid != DBUS_GID_UNSET)
 	_dbus_verbose ("No cache for GID "DBUS_GID_FORMAT"\n",
 		       gid);
       else
 	_dbus_verbose ("No cache for groupname \"%s\"\n",
 		       _dbus_string_get_const_data (groupname));
-      
+
+      if (_dbus_user_database_find_miss (db, 'g', gid,
+                                         gid == DBUS_GID_UNSET ? groupname : NULL,
+                                         error))
+        return NULL;
+
       info = dbus_new0 (DBusGroupInfo, 1);
       if (info == NULL)
         {
@@ -296,22 +306,19 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
         }
 
       if (gid != DBUS_GID_UNSET)
-        {
-          if (!_dbus_group_info_fill_gid (info, gid, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_group_info_free_allocated (info);
-              return NULL;
-            }
-        }
+        filled = _dbus_group_info_fill_gid (info, gid, &local_error);
       else
+        filled = _dbus_group_info_fill (info, groupname, &local_error);
+
+      if (!filled)
         {
-          if (!_dbus_group_info_fill (info, groupname, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_group_info_free_allocated (info);
-              return NULL;
-            }
+          _DBUS_ASSERT_ERROR_IS_SET (&local_error);
+          _dbus_user_database_add_miss (db, 'g', gid,
+                                        gid == DBUS_GID_UNSET ? groupname : NULL,
+                                        &local_error);
+          dbus_move_error (&local_error, error);
+          _dbus_group_info_free_allocated (info);
+          return NULL;
         }
 
       /* don't use these past here */
@@ -334,7 +341,8 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
           dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
           return NULL;
         }
-      
+
+      _dbus_user_database_entry_added (db);
       return info;
     }
 }
@@ -443,6 +451,83 @@ _dbus_groups_from_uid (dbus_uid_t         uid,
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
 #include <stdio.h>
 
+/* Assumed not to exist in the name service */
+#define UNKNOWN_UID 1234567890
+
+static dbus_bool_t
+check_cache_expiry (dbus_uid_t uid)
+{
+  DBusUserDatabase *db;
+  const DBusUserInfo *info;
+  const DBusUserInfo *again;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusError cached = DBUS_ERROR_INIT;
+
+  db = _dbus_user_database_new ();
+  if (db == NULL)
+    _dbus_test_fatal ("no memory for user database");
+
+  if (!_dbus_user_database_get_uid (db, uid, &info, &error))
+    _dbus_test_fatal ("didn't get current user: %s", error.message);
+
+  if (!_dbus_user_database_get_uid (db, uid, &again, &error))
+    _dbus_test_fatal ("didn't get current user: %s", error.message);
+
+  _dbus_assert (info == again);
+  _dbus_assert (db->expires != 0);
+
+  /* Make the successful lookup outlive its time to live */
+  db->expires = 1;
+
+  if (!_dbus_user_database_get_uid (db, uid, &info, &error))
+    _dbus_test_fatal ("didn't get current user: %s", error.message);
+
+  _dbus_assert (db->expires > 1);
+  _dbus_assert (_dbus_hash_table_get_n_entries (db->users) == 1);
+
+  if (_dbus_user_database_get_uid (db, UNKNOWN_UID, &info, &error))
+    {
+      _dbus_test_diag ("uid %d unexpectedly exists, skipping", UNKNOWN_UID);
+      _dbus_user_database_unref (db);
+      return TRUE;
+    }
+
+  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    _dbus_test_fatal ("no memory");
+
+  _dbus_assert (_dbus_hash_table_get_n_entries (db->misses) == 1);
+
+  /* The second failure is answered from the cache, with the same error */
+  if (_dbus_user_database_get_uid (db, UNKNOWN_UID, &info, &cached))
+    _dbus_test_fatal ("uid %d unexpectedly exists now", UNKNOWN_UID);
+
+  _dbus_assert (dbus_error_has_name (&cached, error.name));
+  _dbus_assert (strcmp (cached.message, error.message) == 0);
+  dbus_error_free (&cached);
+  dbus_error_free (&error);
+
+  /* Reaching the bound discards everything before the next lookup */
+  db->max_entries = 2;
+
+  if (!_dbus_user_database_get_uid (db, uid, &info, &error))
+    _dbus_test_fatal ("didn't get current user: %s", error.message);
+
+  _dbus_assert (_dbus_hash_table_get_n_entries (db->users) == 1);
+  _dbus_assert (_dbus_hash_table_get_n_entries (db->misses) == 0);
+
+  /* With no negative time to live, failures are not remembered */
+  db->negative_ttl = 0;
+
+  if (_dbus_user_database_get_uid (db, UNKNOWN_UID, &info, &error))
+    _dbus_test_fatal ("uid %d unexpectedly exists now", UNKNOWN_UID);
+
+  dbus_error_free (&error);
+  _dbus_assert (_dbus_hash_table_get_n_entries (db->misses) == 0);
+
+  _dbus_user_database_unref (db);
+  return TRUE;
+}
+
 /**
  * Unit test for dbus-userdb.c.
  * 
@@ -489,6 +574,9 @@ _dbus_userdb_test (const char *test_data_dir)
 
   dbus_free (group_ids);
 
+  if (!check_cache_expiry (uid))
+    return FALSE;
+
   return TRUE;
 }
 #endif /* DBUS_ENABLE_EMBEDDED_TESTS */
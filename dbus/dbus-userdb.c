@@ -119,6 +119,236 @@ _dbus_is_a_number (const DBusString *str,
     return FALSE;
 }
 
+/**
+ * How long a successful lookup is cached. Group membership and
+ * similar changes in the name service become visible after this
+ * long at the latest; reloading the bus configuration flushes the
+ * cache immediately.
+ */
+#define DBUS_USER_DATABASE_POSITIVE_TTL 300
+
+/**
+ * How long a failed lookup is cached. This is short, so that a user
+ * added to the name service is noticed soon, but stops a peer with an
+ * unknown uid (typically from a container) from costing a fresh
+ * name service query on every message.
+ */
+#define DBUS_USER_DATABASE_NEGATIVE_TTL 15
+
+/**
+ * Number of cached users, groups and failed lookups at which the
+ * whole cache is discarded.
+ */
+#define DBUS_USER_DATABASE_MAX_ENTRIES 1024
+
+/**
+ * A failed lookup remembered by the user database.
+ */
+typedef struct
+{
+  long expires;  /**< Monotonic time at which this entry is discarded */
+  char *name;    /**< Name of the error the lookup failed with */
+  char *message; /**< Message of the error the lookup failed with */
+} DBusUserDatabaseMiss;
+
+static void
+miss_free (void *data)
+{
+  DBusUserDatabaseMiss *miss = data;
+
+  if (miss == NULL)
+    return;
+
+  dbus_free (miss->name);
+  dbus_free (miss->message);
+  dbus_free (miss);
+}
+
+static long
+monotonic_seconds (void)
+{
+  long now;
+
+  _dbus_get_monotonic_time (&now, NULL);
+  return now;
+}
+
+static dbus_bool_t
+miss_key_init (DBusString       *key,
+               char              kind,
+               unsigned long     id,
+               const DBusString *name)
+{
+  if (!_dbus_string_init (key))
+    return FALSE;
+
+  if (name != NULL)
+    {
+      if (_dbus_string_append_printf (key, "%c:%s", kind,
+                                      _dbus_string_get_const_data (name)))
+        return TRUE;
+    }
+  else
+    {
+      if (_dbus_string_append_printf (key, "%c#%lu", kind, id))
+        return TRUE;
+    }
+
+  _dbus_string_free (key);
+  return FALSE;
+}
+
+/**
+ * Discards the cached entries if the successful lookups have outlived
+ * their time to live, or if the database has grown past its bound.
+ * Must only be called before taking a new pointer into the database,
+ * because it may free the entries that earlier lookups returned.
+ *
+ * @param db the database
+ */
+void
+_dbus_user_database_prune (DBusUserDatabase *db)
+{
+  int n_entries;
+
+  if (db->expires != 0 && monotonic_seconds () >= db->expires)
+    {
+      _dbus_verbose ("User database entries expired, flushing\n");
+      _dbus_user_database_flush (db);
+      return;
+    }
+
+  n_entries = _dbus_hash_table_get_n_entries (db->users) +
+    _dbus_hash_table_get_n_entries (db->groups) +
+    _dbus_hash_table_get_n_entries (db->misses);
+
+  if (n_entries >= db->max_entries)
+    {
+      _dbus_verbose ("User database has %d entries, flushing\n", n_entries);
+      _dbus_user_database_flush (db);
+    }
+}
+
+/**
+ * Records that a user or group was added to the database, starting
+ * the time to live of the successful lookups if it was not running.
+ *
+ * @param db the database
+ */
+void
+_dbus_user_database_entry_added (DBusUserDatabase *db)
+{
+  if (db->expires == 0)
+    db->expires = monotonic_seconds () + db->positive_ttl;
+}
+
+/**
+ * Looks for a cached failure to look up a user or group. Only one of
+ * id or name is used: the name if it is not #NULL.
+ *
+ * @param db the database
+ * @param kind 'u' for users, 'g' for groups
+ * @param id the uid or gid
+ * @param name the user or group name, or #NULL
+ * @param error set to the cached error if found
+ * @returns #TRUE if a failure was cached and error is set
+ */
+dbus_bool_t
+_dbus_user_database_find_miss (DBusUserDatabase *db,
+                               char              kind,
+                               unsigned long     id,
+                               const DBusString *name,
+                               DBusError        *error)
+{
+  DBusUserDatabaseMiss *miss;
+  DBusString key;
+
+  if (_dbus_hash_table_get_n_entries (db->misses) == 0)
+    return FALSE;
+
+  /* If this fails, the caller does the real lookup and will most
+   * likely run out of memory too */
+  if (!miss_key_init (&key, kind, id, name))
+    return FALSE;
+
+  miss = _dbus_hash_table_lookup_string (db->misses,
+                                         _dbus_string_get_const_data (&key));
+
+  if (miss != NULL && monotonic_seconds () >= miss->expires)
+    {
+      _dbus_hash_table_remove_string (db->misses,
+                                      _dbus_string_get_const_data (&key));
+      miss = NULL;
+    }
+
+  _dbus_string_free (&key);
+
+  if (miss == NULL)
+    return FALSE;
+
+  _dbus_verbose ("Using cached failure: %s\n", miss->message);
+  dbus_set_error (error, miss->name, "%s", miss->message);
+  return TRUE;
+}
+
+/**
+ * Remembers that looking up a user or group failed, so that the
+ * name service is not asked again for a while. Failing to remember
+ * it for lack of memory is not an error. Failures for lack of memory
+ * are not remembered.
+ *
+ * @param db the database
+ * @param kind 'u' for users, 'g' for groups
+ * @param id the uid or gid
+ * @param name the user or group name, or #NULL
+ * @param error the error the lookup failed with
+ */
+void
+_dbus_user_database_add_miss (DBusUserDatabase *db,
+                              char              kind,
+                              unsigned long     id,
+                              const DBusString *name,
+                              const DBusError  *error)
+{
+  DBusUserDatabaseMiss *miss;
+  DBusString key;
+  char *key_data;
+
+  _dbus_assert (dbus_error_is_set (error));
+
+  if (db->negative_ttl <= 0 ||
+      dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+    return;
+
+  if (!miss_key_init (&key, kind, id, name))
+    return;
+
+  miss = dbus_new0 (DBusUserDatabaseMiss, 1);
+
+  if (miss == NULL)
+    goto out;
+
+  miss->expires = monotonic_seconds () + db->negative_ttl;
+  miss->name = _dbus_strdup (error->name);
+  miss->message = _dbus_strdup (error->message);
+
+  if (miss->name == NULL || miss->message == NULL ||
+      !_dbus_string_steal_data (&key, &key_data))
+    goto out;
+
+  if (!_dbus_hash_table_insert_string (db->misses, key_data, miss))
+    {
+      dbus_free (key_data);
+      goto out;
+    }
+
+  miss = NULL;
+
+out:
+  miss_free (miss);
+  _dbus_string_free (&key);
+}
+
 /**
  * Looks up a uid or username in the user database.  Only one of name
  * or UID can be provided. There are wrapper functions for this that
@@ -151,6 +381,8 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
         uid = n;
     }
 
+  _dbus_user_database_prune (db);
+
   if (uid != DBUS_UID_UNSET)
     info = _dbus_hash_table_lookup_uintptr (db->users, uid);
   else
@@ -164,13 +396,21 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
     }
   else
     {
+      DBusError local_error = DBUS_ERROR_INIT;
+      dbus_bool_t filled;
+
       if (uid != DBUS_UID_UNSET)
 	_dbus_verbose ("No cache for UID "DBUS_UID_FORMAT"\n",
 		       uid);
       else
 	_dbus_verbose ("No cache for user \"%s\"\n",
 		       _dbus_string_get_const_data (username));
-      
+
+      if (_dbus_user_database_find_miss (db, 'u', uid,
+                                         uid == DBUS_UID_UNSET ? username : NULL,
+                                         error))
+        return NULL;
+
       info = dbus_new0 (DBusUserInfo, 1);
       if (info == NULL)
         {
@@ -179,22 +419,19 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
         }
 
       if (uid != DBUS_UID_UNSET)
-        {
-          if (!_dbus_user_info_fill_uid (info, uid, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
-        }
+        filled = _dbus_user_info_fill_uid (info, uid, &local_error);
       else
+        filled = _dbus_user_info_fill (info, username, &local_error);
+
+      if (!filled)
         {
-          if (!_dbus_user_info_fill (info, username, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
+          _DBUS_ASSERT_ERROR_IS_SET (&local_error);
+          _dbus_user_database_add_miss (db, 'u', uid,
+                                        uid == DBUS_UID_UNSET ? username : NULL,
+                                        &local_error);
+          dbus_move_error (&local_error, error);
+          _dbus_user_info_free_allocated (info);
+          return NULL;
         }
 
       /* be sure we don't use these after here */
@@ -217,7 +454,8 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
           dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
           return NULL;
         }
-      
+
+      _dbus_user_database_entry_added (db);
       return info;
     }
 }
@@ -628,7 +866,16 @@ _dbus_user_database_new (void)
                                              NULL, NULL);
   if (db->groups_by_name == NULL)
     goto failed;
-  
+
+  db->misses = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                     dbus_free, miss_free);
+  if (db->misses == NULL)
+    goto failed;
+
+  db->positive_ttl = DBUS_USER_DATABASE_POSITIVE_TTL;
+  db->negative_ttl = DBUS_USER_DATABASE_NEGATIVE_TTL;
+  db->max_entries = DBUS_USER_DATABASE_MAX_ENTRIES;
+
   return db;
   
  failed:
@@ -646,6 +893,8 @@ _dbus_user_database_flush (DBusUserDatabase *db)
   _dbus_hash_table_remove_all(db->groups_by_name);
   _dbus_hash_table_remove_all(db->users);
   _dbus_hash_table_remove_all(db->groups);
+  _dbus_hash_table_remove_all(db->misses);
+  db->expires = 0;
 }
 
 #ifdef DBUS_ENABLE_EMBEDDED_TESTS
@@ -688,7 +937,10 @@ _dbus_user_database_unref (DBusUserDatabase  *db)
 
       if (db->groups_by_name)
         _dbus_hash_table_unref (db->groups_by_name);
-      
+
+      if (db->misses)
+        _dbus_hash_table_unref (db->misses);
+
       dbus_free (db);
     }
 }
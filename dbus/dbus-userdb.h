@@ -48,7 +48,12 @@ struct DBusUserDatabase
   DBusHashTable *groups; /**< Groups in the database by GID */
   DBusHashTable *users_by_name; /**< Users in the database by name */
   DBusHashTable *groups_by_name; /**< Groups in the database by name */
+  DBusHashTable *misses; /**< Failed lookups by key, see #DBusUserDatabaseMiss */
 
+  long expires; /**< Monotonic time after which the positive entries are discarded, or 0 */
+  long positive_ttl; /**< Seconds to keep successful lookups */
+  long negative_ttl; /**< Seconds to keep failed lookups */
+  int max_entries; /**< Number of users, groups and misses before the cache is flushed */
 };
 
 
@@ -86,6 +91,22 @@ DBusGroupInfo* _dbus_user_database_lookup_group (DBusUserDatabase *db,
                                                  const DBusString *groupname,
                                                  DBusError        *error);
 DBUS_PRIVATE_EXPORT
+void           _dbus_user_database_prune        (DBusUserDatabase *db);
+DBUS_PRIVATE_EXPORT
+dbus_bool_t    _dbus_user_database_find_miss    (DBusUserDatabase *db,
+                                                 char              kind,
+                                                 unsigned long     id,
+                                                 const DBusString *name,
+                                                 DBusError        *error);
+DBUS_PRIVATE_EXPORT
+void           _dbus_user_database_add_miss     (DBusUserDatabase *db,
+                                                 char              kind,
+                                                 unsigned long     id,
+                                                 const DBusString *name,
+                                                 const DBusError  *error);
+DBUS_PRIVATE_EXPORT
+void           _dbus_user_database_entry_added  (DBusUserDatabase *db);
+DBUS_PRIVATE_EXPORT
 void           _dbus_user_info_free_allocated   (DBusUserInfo     *info);
 DBUS_PRIVATE_EXPORT
 void           _dbus_group_info_free_allocated  (DBusGroupInfo    *info);
@@ -35,6 +35,7 @@
 #include <dbus/dbus-message.h>
 #include <dbus/dbus-misc.h>
 #include <dbus/dbus-pending-call.h>
+#include <dbus/dbus-property-cache.h>
 #include <dbus/dbus-protocol.h>
 #include <dbus/dbus-server.h>
 #include <dbus/dbus-shared.h>
@@ -0,0 +1,427 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.c - handing the bus over to a new instance of dbus-daemon
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Starts a dbus-daemon, sets up a well-known name, a match rule and a
+ * method call that has not been answered yet, then sends the
+ * dbus-daemon SIGUSR2 and checks that all three survive the exec into
+ * a new instance, and that new clients can still connect.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dbus/dbus-sysdeps.h"
+#include "dbus/dbus-test-tap.h"
+
+#define SERVICE_NAME "com.example.Handoff"
+#define INTERFACE "com.example.Handoff"
+#define MATCH_RULE "type='signal',interface='" INTERFACE "'"
+/* how long to wait for anything the dbus-daemon does, in microseconds */
+#define TIMEOUT_USEC (10 * 1000 * 1000)
+
+static char tmpdir[] = "/tmp/dbus-handoff-XXXXXX";
+static dbus_bool_t have_tmpdir = FALSE;
+static pid_t daemon_pid = 0;
+
+static void cleanup (void);
+
+static void
+cleanup (void)
+{
+  char path[256];
+
+  if (daemon_pid > 0)
+    {
+      kill (daemon_pid, SIGTERM);
+      waitpid (daemon_pid, NULL, 0);
+      daemon_pid = 0;
+    }
+
+  if (!have_tmpdir)
+    return;
+
+  snprintf (path, sizeof (path), "%s/bus.conf", tmpdir);
+  unlink (path);
+  snprintf (path, sizeof (path), "%s/bus.log", tmpdir);
+  unlink (path);
+  rmdir (tmpdir);
+  have_tmpdir = FALSE;
+}
+
+static void
+write_config (void)
+{
+  char path[256];
+  FILE *f;
+
+  if (mkdtemp (tmpdir) == NULL)
+    test_die ("unable to create temporary directory");
+
+  have_tmpdir = TRUE;
+  snprintf (path, sizeof (path), "%s/bus.conf", tmpdir);
+  f = fopen (path, "w");
+
+  if (f == NULL)
+    {
+      perror (path);
+      test_die ("unable to write configuration");
+    }
+
+  fprintf (f,
+           "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-BUS Bus "
+           "Configuration 1.0//EN\"\n"
+           " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+           "<busconfig>\n"
+           "  <listen>unix:dir=%s</listen>\n"
+           "  <policy context=\"default\">\n"
+           "    <allow send_destination=\"*\"/>\n"
+           "    <allow receive_sender=\"*\"/>\n"
+           "    <allow own=\"*\"/>\n"
+           "    <allow user=\"*\"/>\n"
+           "  </policy>\n"
+           "</busconfig>\n",
+           tmpdir);
+  fclose (f);
+}
+
+/* Starts the dbus-daemon, logging to bus.log, and returns its address */
+static char *
+start_daemon (const char *daemon)
+{
+  char config_arg[256];
+  char path[256];
+  char *address;
+  size_t len = 0;
+  int fds[2];
+
+  snprintf (config_arg, sizeof (config_arg), "--config-file=%s/bus.conf",
+            tmpdir);
+
+  if (pipe (fds) < 0)
+    test_die ("unable to create pipe");
+
+  daemon_pid = fork ();
+
+  if (daemon_pid < 0)
+    test_die ("unable to fork");
+
+  if (daemon_pid == 0)
+    {
+      char fd_arg[32];
+      int log_fd;
+
+      close (fds[0]);
+      snprintf (fd_arg, sizeof (fd_arg), "--print-address=%d", fds[1]);
+      snprintf (path, sizeof (path), "%s/bus.log", tmpdir);
+      log_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+      if (log_fd < 0 || dup2 (log_fd, STDERR_FILENO) < 0)
+        {
+          perror (path);
+          _exit (1);
+        }
+
+      execl (daemon, daemon, config_arg, "--nofork", fd_arg, NULL);
+      perror (daemon);
+      _exit (1);
+    }
+
+  close (fds[1]);
+  address = dbus_malloc0 (1024);
+
+  if (address == NULL)
+    test_oom ("reading address");
+
+  while (len < 1023 && strchr (address, '\n') == NULL)
+    {
+      ssize_t n = read (fds[0], address + len, 1023 - len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        test_die ("dbus-daemon did not start");
+
+      len += n;
+    }
+
+  close (fds[0]);
+  *strchr (address, '\n') = '\0';
+  return address;
+}
+
+/* Waits until the new instance of the bus has logged that it took over,
+ * and returns that line */
+static char *
+wait_for_handoff (void)
+{
+  dbus_uint64_t deadline = test_now_usec () + TIMEOUT_USEC;
+  char path[256];
+  char line[1024];
+
+  snprintf (path, sizeof (path), "%s/bus.log", tmpdir);
+
+  while (test_now_usec () < deadline)
+    {
+      FILE *f = fopen (path, "r");
+
+      if (f == NULL)
+        test_die ("unable to read the dbus-daemon's log");
+
+      while (fgets (line, sizeof (line), f) != NULL)
+        {
+          if (strstr (line, "Took over from the previous instance") != NULL)
+            {
+              fclose (f);
+              line[strcspn (line, "\n")] = '\0';
+              return _dbus_strdup (line);
+            }
+        }
+
+      fclose (f);
+      usleep (10 * 1000);
+    }
+
+  test_die ("the dbus-daemon did not hand over to a new instance");
+}
+
+static DBusConnection *
+connect_to_bus (const char *address)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (address, &error);
+
+  if (connection == NULL || !dbus_bus_register (connection, &error))
+    test_die (error.message);
+
+  return connection;
+}
+
+/* Reads from @connection until a message of @type with @member arrives,
+ * discarding anything else */
+static DBusMessage *
+wait_for_message (DBusConnection *connection,
+                  int             type,
+                  const char     *member)
+{
+  dbus_uint64_t deadline = test_now_usec () + TIMEOUT_USEC;
+
+  while (test_now_usec () < deadline)
+    {
+      DBusMessage *message = dbus_connection_pop_message (connection);
+
+      if (message == NULL)
+        {
+          if (!dbus_connection_read_write (connection, 100))
+            test_die ("disconnected from the bus");
+
+          continue;
+        }
+
+      if (dbus_message_get_type (message) == type &&
+          dbus_message_has_interface (message, INTERFACE) &&
+          dbus_message_has_member (message, member))
+        return message;
+
+      dbus_message_unref (message);
+    }
+
+  test_die ("timed out waiting for a message");
+}
+
+static char *
+get_name_owner (DBusConnection *connection,
+                const char     *name)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *call, *reply;
+  const char *owner;
+  char *ret;
+
+  call = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS, "GetNameOwner");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    test_oom ("building GetNameOwner call");
+
+  reply = dbus_connection_send_with_reply_and_block (connection, call, -1,
+                                                     &error);
+  dbus_message_unref (call);
+
+  if (reply == NULL ||
+      !dbus_message_get_args (reply, &error, DBUS_TYPE_STRING, &owner,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_test_diag ("GetNameOwner failed: %s", error.message);
+      dbus_error_free (&error);
+      ret = NULL;
+    }
+  else
+    {
+      ret = _dbus_strdup (owner);
+    }
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  return ret;
+}
+
+/* This test outputs TAP syntax: http://testanything.org/ */
+int
+main (int    argc,
+      char **argv)
+{
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  DBusConnection *service, *listener, *caller, *late;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusPendingCall *pending;
+  DBusMessage *message, *call, *reply;
+  char *address, *owner, *took_over;
+
+  /* _dbus_test_fatal() exits without calling back into test-utils */
+  test_program_init ("test-handoff", NULL);
+  atexit (cleanup);
+
+  if (daemon == NULL)
+    _dbus_test_skip_all ("DBUS_TEST_DAEMON is not set");
+
+  write_config ();
+  address = start_daemon (daemon);
+
+  service = connect_to_bus (address);
+  listener = connect_to_bus (address);
+  caller = connect_to_bus (address);
+
+  if (dbus_bus_request_name (service, SERVICE_NAME,
+                             DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    test_die ("unable to own " SERVICE_NAME);
+
+  dbus_bus_add_match (listener, MATCH_RULE, &error);
+
+  if (dbus_error_is_set (&error))
+    test_die (error.message);
+
+  /* Leave a method call waiting for its reply while the bus is handed
+   * over */
+  message = dbus_message_new_method_call (SERVICE_NAME, "/", INTERFACE,
+                                          "Ping");
+
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (caller, message, &pending, -1) ||
+      pending == NULL)
+    test_oom ("sending Ping");
+
+  dbus_message_unref (message);
+  dbus_connection_flush (caller);
+  call = wait_for_message (service, DBUS_MESSAGE_TYPE_METHOD_CALL, "Ping");
+  _dbus_test_ok ("the service received a method call before the handoff");
+
+  if (kill (daemon_pid, SIGUSR2) < 0)
+    test_die ("unable to signal the dbus-daemon");
+
+  took_over = wait_for_handoff ();
+  _dbus_test_diag ("%s", took_over);
+
+  if (strstr (took_over, " 3 connections (0 could not") == NULL)
+    _dbus_test_fatal ("expected all 3 connections to be taken over");
+
+  _dbus_test_ok ("the new instance took over all connections");
+  dbus_free (took_over);
+
+  owner = get_name_owner (caller, SERVICE_NAME);
+
+  if (owner == NULL ||
+      strcmp (owner, dbus_bus_get_unique_name (service)) != 0)
+    _dbus_test_fatal ("%s is owned by %s, expected %s", SERVICE_NAME,
+                      owner != NULL ? owner : "nobody",
+                      dbus_bus_get_unique_name (service));
+
+  _dbus_test_ok ("the well-known name survived the handoff");
+  dbus_free (owner);
+
+  message = dbus_message_new_signal ("/", INTERFACE, "Changed");
+
+  if (message == NULL || !dbus_connection_send (service, message, NULL))
+    test_oom ("sending Changed");
+
+  dbus_message_unref (message);
+  dbus_connection_flush (service);
+  message = wait_for_message (listener, DBUS_MESSAGE_TYPE_SIGNAL, "Changed");
+  dbus_message_unref (message);
+  _dbus_test_ok ("the match rule survived the handoff");
+
+  reply = dbus_message_new_method_return (call);
+
+  if (reply == NULL || !dbus_connection_send (service, reply, NULL))
+    test_oom ("sending the reply to Ping");
+
+  dbus_message_unref (reply);
+  dbus_message_unref (call);
+  dbus_connection_flush (service);
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+
+  if (reply == NULL ||
+      dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_test_fatal ("the reply to Ping did not arrive: %s",
+                      reply != NULL ? dbus_message_get_error_name (reply)
+                                    : "(none)");
+
+  _dbus_test_ok ("the pending reply survived the handoff");
+  dbus_message_unref (reply);
+  dbus_pending_call_unref (pending);
+
+  /* The address still has the previous instance's GUID in it */
+  late = connect_to_bus (address);
+  _dbus_test_ok ("a new client can connect after the handoff");
+
+  dbus_connection_close (late);
+  dbus_connection_unref (late);
+  dbus_connection_close (caller);
+  dbus_connection_unref (caller);
+  dbus_connection_close (listener);
+  dbus_connection_unref (listener);
+  dbus_connection_close (service);
+  dbus_connection_unref (service);
+  dbus_free (address);
+  cleanup ();
+  dbus_shutdown ();
+  return _dbus_test_done_testing ();
+}
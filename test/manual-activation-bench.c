@@ -0,0 +1,604 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* manual-activation-bench.c - time taken to activate services
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Starts a dbus-daemon with a generated service directory, then
+ * repeatedly makes --concurrency auto-starting method calls at once,
+ * each to a different service that is not running yet, and measures
+ * the time from each call to its reply.
+ *
+ * --mode=exec has the dbus-daemon fork and exec test-service itself.
+ * --mode=helper goes through dbus-daemon-launch-helper-test, the
+ * non-setuid build of the system bus's activation helper.
+ * --mode=systemd uses systemd activation, with this program taking the
+ * part of systemd: the service is started in-process as soon as the
+ * activation request arrives, so only the bus's share is measured.
+ *
+ * test-service, dbus-daemon-launch-helper-test and (unless
+ * DBUS_TEST_DAEMON says otherwise) dbus-daemon are looked for in the
+ * same directory as this program, or in --exec-dir.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dbus/dbus-sysdeps.h"
+
+#define SERVICE_PREFIX "com.example.ActivationBench"
+#define UNIT_PREFIX "activation-bench-"
+
+typedef enum
+{
+  MODE_EXEC,
+  MODE_HELPER,
+  MODE_SYSTEMD
+} Mode;
+
+static const char * const mode_names[] = { "exec", "helper", "systemd" };
+
+static char tmpdir[] = "/tmp/dbus-activation-bench-XXXXXX";
+static dbus_bool_t have_tmpdir = FALSE;
+static int n_service_files = 0;
+static pid_t daemon_pid = 0;
+
+static TestMainContext *ctx = NULL;
+static int replies = 0;
+static int failures = 0;
+/* round-trip time of each call, in microseconds */
+static dbus_uint64_t *latencies = NULL;
+
+static void cleanup (void);
+
+static void
+cleanup (void)
+{
+  char path[256];
+  int i;
+
+  if (daemon_pid > 0)
+    {
+      kill (daemon_pid, SIGTERM);
+      waitpid (daemon_pid, NULL, 0);
+      daemon_pid = 0;
+    }
+
+  if (!have_tmpdir)
+    return;
+
+  for (i = 0; i < n_service_files; i++)
+    {
+      snprintf (path, sizeof (path), "%s/services/" SERVICE_PREFIX "%d.service",
+                tmpdir, i);
+      unlink (path);
+    }
+
+  snprintf (path, sizeof (path), "%s/services", tmpdir);
+  rmdir (path);
+  snprintf (path, sizeof (path), "%s/bus.conf", tmpdir);
+  unlink (path);
+  rmdir (tmpdir);
+  have_tmpdir = FALSE;
+}
+
+static FILE *
+create_file (const char *path)
+{
+  FILE *f = fopen (path, "w");
+
+  if (f == NULL)
+    {
+      perror (path);
+      test_die ("unable to write configuration");
+    }
+
+  return f;
+}
+
+static void
+write_config (Mode        mode,
+              const char *exec_dir,
+              int         n_services)
+{
+  char path[256];
+  FILE *f;
+  int i;
+
+  if (mkdtemp (tmpdir) == NULL)
+    test_die ("unable to create temporary directory");
+
+  have_tmpdir = TRUE;
+  snprintf (path, sizeof (path), "%s/services", tmpdir);
+
+  if (mkdir (path, 0700) < 0)
+    test_die ("unable to create service directory");
+
+  for (i = 0; i < n_services; i++)
+    {
+      snprintf (path, sizeof (path), "%s/services/" SERVICE_PREFIX "%d.service",
+                tmpdir, i);
+      f = create_file (path);
+      n_service_files++;
+      fprintf (f, "[D-BUS Service]\n");
+      fprintf (f, "Name=" SERVICE_PREFIX "%d\n", i);
+
+      if (mode == MODE_SYSTEMD)
+        {
+          fprintf (f, "Exec=/bin/false\n");
+          fprintf (f, "SystemdService=" UNIT_PREFIX "%d.service\n", i);
+        }
+      else
+        {
+          fprintf (f, "Exec=%s/test-service " SERVICE_PREFIX "%d nofork\n",
+                   exec_dir, i);
+        }
+
+      /* required by the activation helper; the test build of it does not
+       * actually switch user */
+      if (mode == MODE_HELPER)
+        fprintf (f, "User=nobody\n");
+
+      fclose (f);
+    }
+
+  snprintf (path, sizeof (path), "%s/bus.conf", tmpdir);
+  f = create_file (path);
+  fprintf (f,
+           "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-BUS Bus "
+           "Configuration 1.0//EN\"\n"
+           " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+           "<busconfig>\n"
+           "  <listen>unix:dir=%s</listen>\n"
+           "  <servicedir>%s/services</servicedir>\n",
+           tmpdir, tmpdir);
+
+  if (mode == MODE_HELPER)
+    fprintf (f, "  <servicehelper>%s/dbus-daemon-launch-helper-test"
+             "</servicehelper>\n", exec_dir);
+
+  fprintf (f,
+           "  <policy context=\"default\">\n"
+           "    <allow send_destination=\"*\"/>\n"
+           "    <allow receive_sender=\"*\"/>\n"
+           "    <allow own=\"*\"/>\n"
+           "    <allow user=\"*\"/>\n"
+           "  </policy>\n"
+           "</busconfig>\n");
+  fclose (f);
+}
+
+/* Starts the dbus-daemon and returns its address */
+static char *
+start_daemon (Mode        mode,
+              const char *exec_dir)
+{
+  char config_arg[256];
+  char daemon_path[256];
+  const char *daemon = getenv ("DBUS_TEST_DAEMON");
+  char *address;
+  size_t len = 0;
+  int fds[2];
+
+  if (daemon == NULL)
+    {
+      snprintf (daemon_path, sizeof (daemon_path), "%s/dbus-daemon", exec_dir);
+      daemon = daemon_path;
+    }
+
+  snprintf (config_arg, sizeof (config_arg), "--config-file=%s/bus.conf",
+            tmpdir);
+
+  if (pipe (fds) < 0)
+    test_die ("unable to create pipe");
+
+  daemon_pid = fork ();
+
+  if (daemon_pid < 0)
+    test_die ("unable to fork");
+
+  if (daemon_pid == 0)
+    {
+      char fd_arg[32];
+
+      close (fds[0]);
+      snprintf (fd_arg, sizeof (fd_arg), "--print-address=%d", fds[1]);
+
+      /* only read by the non-setuid test build of the helper */
+      if (mode == MODE_HELPER)
+        setenv ("TEST_LAUNCH_HELPER_CONFIG", config_arg +
+                strlen ("--config-file="), 1);
+
+      execl (daemon, daemon, config_arg, "--nofork", fd_arg,
+             mode == MODE_SYSTEMD ? "--systemd-activation" : NULL,
+             NULL);
+      perror (daemon);
+      _exit (1);
+    }
+
+  close (fds[1]);
+  address = dbus_malloc0 (1024);
+
+  if (address == NULL)
+    test_oom ("reading address");
+
+  while (len < 1023 && strchr (address, '\n') == NULL)
+    {
+      ssize_t n = read (fds[0], address + len, 1023 - len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        test_die ("dbus-daemon did not start");
+
+      len += n;
+    }
+
+  close (fds[0]);
+  *strchr (address, '\n') = '\0';
+  return address;
+}
+
+static DBusConnection *
+connect_to_bus (const char *address)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (address, &error);
+
+  if (connection == NULL || !dbus_bus_register (connection, &error))
+    test_die (error.message);
+
+  test_connection_setup (ctx, connection);
+  return connection;
+}
+
+static DBusHandlerResult
+service_filter (DBusConnection *connection,
+                DBusMessage    *message,
+                void           *user_data)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_get_no_reply (message))
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL || !dbus_connection_send (connection, reply, NULL))
+    test_oom ("replying");
+
+  dbus_message_unref (reply);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* In systemd mode, services started in-process */
+static DBusConnection **fake_services = NULL;
+static const char *bus_address = NULL;
+
+/* Takes the part of systemd: starts the service that was asked for */
+static DBusHandlerResult
+systemd_filter (DBusConnection *connection,
+                DBusMessage    *message,
+                void           *user_data)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *service;
+  const char *unit;
+  char name[128];
+  int i;
+
+  if (!dbus_message_is_signal (message, "org.freedesktop.systemd1.Activator",
+                               "ActivationRequest"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!dbus_message_get_args (message, &error, DBUS_TYPE_STRING, &unit,
+                              DBUS_TYPE_INVALID) ||
+      sscanf (unit, UNIT_PREFIX "%d.service", &i) != 1 ||
+      i < 0 || i >= n_service_files)
+    test_die ("unexpected activation request");
+
+  service = connect_to_bus (bus_address);
+
+  if (!dbus_connection_add_filter (service, service_filter, NULL, NULL))
+    test_oom ("adding filter");
+
+  snprintf (name, sizeof (name), SERVICE_PREFIX "%d", i);
+
+  if (dbus_bus_request_name (service, name, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                             &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    test_die ("unable to claim service name");
+
+  fake_services[i] = service;
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+typedef struct
+{
+  dbus_uint64_t sent_usec;
+  int index;
+} Call;
+
+static void
+reply_cb (DBusPendingCall *pc,
+          void            *data)
+{
+  Call *call = data;
+  DBusMessage *reply = dbus_pending_call_steal_reply (pc);
+
+  latencies[call->index] = test_now_usec () - call->sent_usec;
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      dbus_set_error_from_message (&error, reply);
+
+      if (failures == 0)
+        fprintf (stderr, "*** manual-activation-bench: %s: %s\n",
+                 error.name, error.message);
+
+      dbus_error_free (&error);
+      failures++;
+    }
+
+  dbus_message_unref (reply);
+  replies++;
+}
+
+static void
+call_service (DBusConnection *caller,
+              int             index,
+              dbus_bool_t     no_reply,
+              const char     *method)
+{
+  DBusPendingCall *pc;
+  DBusMessage *message;
+  const char *payload = "ping";
+  char name[128];
+  Call *call;
+
+  snprintf (name, sizeof (name), SERVICE_PREFIX "%d", index);
+  message = dbus_message_new_method_call (name, "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          method);
+
+  if (message == NULL ||
+      !dbus_message_append_args (message, DBUS_TYPE_STRING, &payload,
+                                 DBUS_TYPE_INVALID))
+    test_oom ("building call");
+
+  if (no_reply)
+    {
+      dbus_message_set_no_reply (message, TRUE);
+
+      if (!dbus_connection_send (caller, message, NULL))
+        test_oom ("sending call");
+
+      dbus_message_unref (message);
+      return;
+    }
+
+  call = dbus_new0 (Call, 1);
+
+  if (call == NULL)
+    test_oom ("allocating call");
+
+  call->index = index;
+  call->sent_usec = test_now_usec ();
+
+  if (!dbus_connection_send_with_reply (caller, message, &pc,
+                                        DBUS_TIMEOUT_INFINITE) ||
+      pc == NULL ||
+      !dbus_pending_call_set_notify (pc, reply_cb, call, dbus_free))
+    test_oom ("sending call");
+
+  dbus_pending_call_unref (pc);
+  dbus_message_unref (message);
+}
+
+static int
+compare_latencies (const void *a,
+                   const void *b)
+{
+  dbus_uint64_t x = *(const dbus_uint64_t *) a;
+  dbus_uint64_t y = *(const dbus_uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static dbus_uint64_t
+percentile (int    n,
+            double p)
+{
+  int i = (int) (p * n);
+
+  return latencies[i >= n ? n - 1 : i];
+}
+
+static void
+usage (void)
+{
+  test_die ("syntax: manual-activation-bench [--mode=exec|helper|systemd] "
+            "[--rounds=N] [--concurrency=N] [--exec-dir=DIR]");
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  Mode mode = MODE_EXEC;
+  int rounds = 10;
+  int concurrency = 10;
+  char exec_dir[PATH_MAX];
+  DBusConnection *caller;
+  DBusConnection *systemd = NULL;
+  dbus_uint64_t total_usec = 0;
+  char resolved[PATH_MAX];
+  char *address;
+  int n, i, r;
+
+  test_program_init ("manual-activation-bench", cleanup);
+
+  snprintf (exec_dir, sizeof (exec_dir), "%s", argv[0]);
+
+  if (strrchr (exec_dir, '/') != NULL)
+    *strrchr (exec_dir, '/') = '\0';
+  else
+    snprintf (exec_dir, sizeof (exec_dir), ".");
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--mode=exec") == 0)
+        mode = MODE_EXEC;
+      else if (strcmp (arg, "--mode=helper") == 0)
+        mode = MODE_HELPER;
+      else if (strcmp (arg, "--mode=systemd") == 0)
+        mode = MODE_SYSTEMD;
+      else if (strstr (arg, "--rounds=") == arg)
+        rounds = atoi (arg + strlen ("--rounds="));
+      else if (strstr (arg, "--concurrency=") == arg)
+        concurrency = atoi (arg + strlen ("--concurrency="));
+      else if (strstr (arg, "--exec-dir=") == arg)
+        snprintf (exec_dir, sizeof (exec_dir), "%s",
+                  arg + strlen ("--exec-dir="));
+      else
+        usage ();
+    }
+
+  if (rounds < 1 || concurrency < 1)
+    usage ();
+
+  /* the dbus-daemon does not run in our working directory */
+  if (realpath (exec_dir, resolved) == NULL)
+    {
+      perror (exec_dir);
+      test_die ("unable to find executables");
+    }
+
+  n = rounds * concurrency;
+  latencies = dbus_new0 (dbus_uint64_t, n);
+  fake_services = dbus_new0 (DBusConnection *, n);
+
+  if (latencies == NULL || fake_services == NULL)
+    test_oom ("allocating");
+
+  /* each call activates a service that has not been started before */
+  write_config (mode, resolved, n);
+  address = start_daemon (mode, resolved);
+  bus_address = address;
+  ctx = test_main_context_get ();
+  caller = connect_to_bus (address);
+
+  if (mode == MODE_SYSTEMD)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      systemd = connect_to_bus (address);
+
+      if (!dbus_connection_add_filter (systemd, systemd_filter, NULL, NULL))
+        test_oom ("adding filter");
+
+      if (dbus_bus_request_name (systemd, "org.freedesktop.systemd1",
+                                 DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        test_die ("unable to take the place of systemd");
+    }
+
+  for (r = 0; r < rounds; r++)
+    {
+      dbus_uint64_t start = test_now_usec ();
+
+      for (i = r * concurrency; i < (r + 1) * concurrency; i++)
+        call_service (caller, i, FALSE, "Echo");
+
+      while (replies < (r + 1) * concurrency)
+        test_main_context_iterate (ctx, TRUE);
+
+      total_usec += test_now_usec () - start;
+
+      /* don't let services accumulate */
+      for (i = r * concurrency; i < (r + 1) * concurrency; i++)
+        {
+          if (fake_services[i] != NULL)
+            {
+              test_connection_shutdown (ctx, fake_services[i]);
+              dbus_connection_close (fake_services[i]);
+              dbus_connection_unref (fake_services[i]);
+              fake_services[i] = NULL;
+            }
+          else
+            {
+              call_service (caller, i, TRUE, "Exit");
+            }
+        }
+
+      dbus_connection_flush (caller);
+    }
+
+  qsort (latencies, n, sizeof (*latencies), compare_latencies);
+
+  printf ("mode %s\n", mode_names[mode]);
+  printf ("concurrency %d\n", concurrency);
+  printf ("activations %d\n", n);
+  printf ("failures %d\n", failures);
+  printf ("seconds %.3f\n", total_usec / 1e6);
+  printf ("activations_per_second %.1f\n",
+          total_usec == 0 ? 0.0 : n * 1e6 / total_usec);
+  printf ("latency_p50_usec %lu\n", (unsigned long) percentile (n, 0.5));
+  printf ("latency_p99_usec %lu\n", (unsigned long) percentile (n, 0.99));
+  printf ("latency_max_usec %lu\n", (unsigned long) latencies[n - 1]);
+
+  if (systemd != NULL)
+    {
+      test_connection_shutdown (ctx, systemd);
+      dbus_connection_close (systemd);
+      dbus_connection_unref (systemd);
+    }
+
+  test_connection_shutdown (ctx, caller);
+  dbus_connection_close (caller);
+  dbus_connection_unref (caller);
+  test_main_context_unref (ctx);
+  cleanup ();
+  dbus_free (address);
+  dbus_free (fake_services);
+  dbus_free (latencies);
+  dbus_shutdown ();
+  return failures == 0 ? 0 : 1;
+}
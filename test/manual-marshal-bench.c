@@ -0,0 +1,608 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* manual-marshal-bench.c - throughput of the message codec
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Measures how fast libdbus builds, serializes, loads, validates,
+ * byteswaps and reads a fixed set of message bodies, and how many
+ * allocations each of those takes.
+ *
+ * Output is one tab-separated line per workload and phase, preceded by
+ * a header line, so that runs can be compared with a script. Each
+ * phase runs a fixed number of iterations --repeat times and reports
+ * the fastest run, which is more stable than the mean on a busy
+ * machine. Allocation counts are the same in every run.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include "dbus/dbus-internals.h"
+#include "dbus/dbus-marshal-basic.h"
+#include "dbus/dbus-marshal-byteswap.h"
+#include "dbus/dbus-marshal-validate.h"
+#include "dbus/dbus-message-internal.h"
+#include "dbus/dbus-string.h"
+#include "dbus/dbus-sysdeps.h"
+
+/* Allocation accounting: libdbus is told to use these before it
+ * allocates anything. realloc() of NULL is an allocation too. */
+static unsigned long n_allocs = 0;
+
+static void *
+counting_malloc (size_t bytes)
+{
+  n_allocs++;
+  return malloc (bytes);
+}
+
+static void *
+counting_realloc (void   *memory,
+                  size_t  bytes)
+{
+  if (memory == NULL)
+    n_allocs++;
+
+  return realloc (memory, bytes);
+}
+
+static void
+counting_free (void *memory)
+{
+  free (memory);
+}
+
+static void
+append_basic (DBusMessageIter *iter,
+              int              type,
+              const void      *value)
+{
+  if (!dbus_message_iter_append_basic (iter, type, value))
+    test_oom ("appending");
+}
+
+static void
+open_container (DBusMessageIter *iter,
+                int              type,
+                const char      *signature,
+                DBusMessageIter *sub)
+{
+  if (!dbus_message_iter_open_container (iter, type, signature, sub))
+    test_oom ("opening container");
+}
+
+static void
+close_container (DBusMessageIter *iter,
+                 DBusMessageIter *sub)
+{
+  if (!dbus_message_iter_close_container (iter, sub))
+    test_oom ("closing container");
+}
+
+/* a{sv} with 32 entries, like a property dump */
+static void
+append_asv (DBusMessageIter *iter)
+{
+  DBusMessageIter dict, entry, variant, array;
+  char key[32];
+  const char *p;
+  int i, j;
+
+  open_container (iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+  for (i = 0; i < 32; i++)
+    {
+      open_container (&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+      snprintf (key, sizeof (key), "Property%d", i);
+      p = key;
+      append_basic (&entry, DBUS_TYPE_STRING, &p);
+
+      switch (i % 4)
+        {
+          case 0:
+            {
+              dbus_uint32_t u = i;
+
+              open_container (&entry, DBUS_TYPE_VARIANT, "u", &variant);
+              append_basic (&variant, DBUS_TYPE_UINT32, &u);
+            }
+            break;
+
+          case 1:
+            {
+              double d = i / 3.0;
+
+              open_container (&entry, DBUS_TYPE_VARIANT, "d", &variant);
+              append_basic (&variant, DBUS_TYPE_DOUBLE, &d);
+            }
+            break;
+
+          case 2:
+            p = "/org/freedesktop/DBus/Benchmark/Object";
+            open_container (&entry, DBUS_TYPE_VARIANT, "o", &variant);
+            append_basic (&variant, DBUS_TYPE_OBJECT_PATH, &p);
+            break;
+
+          default:
+            open_container (&entry, DBUS_TYPE_VARIANT, "as", &variant);
+            open_container (&variant, DBUS_TYPE_ARRAY, "s", &array);
+
+            for (j = 0; j < 4; j++)
+              {
+                p = "a moderately long string value";
+                append_basic (&array, DBUS_TYPE_STRING, &p);
+              }
+
+            close_container (&variant, &array);
+            break;
+        }
+
+      close_container (&entry, &variant);
+      close_container (&dict, &entry);
+    }
+
+  close_container (iter, &dict);
+}
+
+/* ay of 1 MiB, like a file or image being passed around */
+static void
+append_large_ay (DBusMessageIter *iter)
+{
+  static unsigned char *bytes = NULL;
+  const unsigned char *p;
+  DBusMessageIter array;
+  int i;
+
+  if (bytes == NULL)
+    {
+      bytes = malloc (1024 * 1024);
+
+      if (bytes == NULL)
+        test_oom ("allocating byte array");
+
+      for (i = 0; i < 1024 * 1024; i++)
+        bytes[i] = i & 0xff;
+    }
+
+  p = bytes;
+  open_container (iter, DBUS_TYPE_ARRAY, "y", &array);
+
+  if (!dbus_message_iter_append_fixed_array (&array, DBUS_TYPE_BYTE, &p,
+                                             1024 * 1024))
+    test_oom ("appending byte array");
+
+  close_container (iter, &array);
+}
+
+/* a(i(sd)(ub(x))) with 256 elements, to exercise alignment and nesting */
+static void
+append_nested_structs (DBusMessageIter *iter)
+{
+  DBusMessageIter array, outer, inner, innermost;
+  int i;
+
+  open_container (iter, DBUS_TYPE_ARRAY, "(i(sd)(ub(x)))", &array);
+
+  for (i = 0; i < 256; i++)
+    {
+      dbus_int32_t n = i;
+      const char *s = "struct member";
+      double d = i * 0.5;
+      dbus_uint32_t u = i * 7;
+      dbus_bool_t b = i & 1;
+      dbus_int64_t x = -i;
+
+      open_container (&array, DBUS_TYPE_STRUCT, NULL, &outer);
+      append_basic (&outer, DBUS_TYPE_INT32, &n);
+
+      open_container (&outer, DBUS_TYPE_STRUCT, NULL, &inner);
+      append_basic (&inner, DBUS_TYPE_STRING, &s);
+      append_basic (&inner, DBUS_TYPE_DOUBLE, &d);
+      close_container (&outer, &inner);
+
+      open_container (&outer, DBUS_TYPE_STRUCT, NULL, &inner);
+      append_basic (&inner, DBUS_TYPE_UINT32, &u);
+      append_basic (&inner, DBUS_TYPE_BOOLEAN, &b);
+      open_container (&inner, DBUS_TYPE_STRUCT, NULL, &innermost);
+      append_basic (&innermost, DBUS_TYPE_INT64, &x);
+      close_container (&inner, &innermost);
+      close_container (&outer, &inner);
+
+      close_container (&array, &outer);
+    }
+
+  close_container (iter, &array);
+}
+
+/* as with 4096 elements, like a list of names */
+static void
+append_string_array (DBusMessageIter *iter)
+{
+  DBusMessageIter array;
+  char buf[64];
+  const char *p = buf;
+  int i;
+
+  open_container (iter, DBUS_TYPE_ARRAY, "s", &array);
+
+  for (i = 0; i < 4096; i++)
+    {
+      snprintf (buf, sizeof (buf), "org.freedesktop.Example.Name%d", i);
+      append_basic (&array, DBUS_TYPE_STRING, &p);
+    }
+
+  close_container (iter, &array);
+}
+
+typedef struct
+{
+  const char *name;
+  void (* append) (DBusMessageIter *iter);
+  /* per run, before scaling by --scale */
+  int iterations;
+} Workload;
+
+static const Workload workloads[] =
+{
+  { "a{sv}", append_asv, 2000 },
+  { "large-ay", append_large_ay, 200 },
+  { "nested-structs", append_nested_structs, 500 },
+  { "string-array", append_string_array, 100 }
+};
+
+static DBusMessage *
+build_message (const Workload *workload)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+
+  message = dbus_message_new_signal ("/org/freedesktop/DBus/Benchmark",
+                                     "org.freedesktop.DBus.Benchmark",
+                                     "Payload");
+
+  if (message == NULL)
+    test_oom ("creating message");
+
+  dbus_message_iter_init_append (message, &iter);
+  workload->append (&iter);
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+  return message;
+}
+
+/* Reads every value, as a consumer of the message would */
+static dbus_uint64_t
+read_values (DBusMessageIter *iter)
+{
+  dbus_uint64_t sum = 0;
+  int type;
+
+  while ((type = dbus_message_iter_get_arg_type (iter)) != DBUS_TYPE_INVALID)
+    {
+      if (type == DBUS_TYPE_ARRAY &&
+          dbus_type_is_fixed (dbus_message_iter_get_element_type (iter)))
+        {
+          DBusMessageIter sub;
+          const void *values;
+          int n;
+
+          dbus_message_iter_recurse (iter, &sub);
+          dbus_message_iter_get_fixed_array (&sub, &values, &n);
+          sum += n;
+        }
+      else if (dbus_type_is_container (type))
+        {
+          DBusMessageIter sub;
+
+          dbus_message_iter_recurse (iter, &sub);
+          sum += read_values (&sub);
+        }
+      else
+        {
+          DBusBasicValue value;
+
+          dbus_message_iter_get_basic (iter, &value);
+
+          if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH ||
+              type == DBUS_TYPE_SIGNATURE)
+            sum += value.str[0];
+          else
+            sum += value.u32;
+        }
+
+      dbus_message_iter_next (iter);
+    }
+
+  return sum;
+}
+
+typedef enum
+{
+  PHASE_BUILD,
+  PHASE_MARSHAL,
+  PHASE_DEMARSHAL,
+  PHASE_VALIDATE,
+  PHASE_BYTESWAP,
+  PHASE_ITERATE,
+  N_PHASES
+} Phase;
+
+static const char * const phase_names[N_PHASES] =
+{
+  "build",
+  "marshal",
+  "demarshal",
+  "validate",
+  "byteswap",
+  "iterate"
+};
+
+typedef struct
+{
+  const Workload *workload;
+  DBusMessage *message;
+  char *blob;
+  int blob_len;
+  DBusString signature;
+  DBusString body;
+  int byte_order;
+} Fixture;
+
+static void
+run_once (Fixture *f,
+          Phase    phase)
+{
+  switch (phase)
+    {
+      /* including dbus_message_lock(), which computes the header lengths */
+      case PHASE_BUILD:
+        dbus_message_unref (build_message (f->workload));
+        break;
+
+      case PHASE_MARSHAL:
+        {
+          char *blob;
+          int len;
+
+          if (!dbus_message_marshal (f->message, &blob, &len))
+            test_oom ("marshalling");
+
+          dbus_free (blob);
+        }
+        break;
+
+      /* validates the header and the body as a side-effect */
+      case PHASE_DEMARSHAL:
+        {
+          DBusError error = DBUS_ERROR_INIT;
+          DBusMessage *message;
+
+          message = dbus_message_demarshal (f->blob, f->blob_len, &error);
+
+          if (message == NULL)
+            test_die (error.message);
+
+          dbus_message_unref (message);
+        }
+        break;
+
+      case PHASE_VALIDATE:
+        {
+          DBusValidity validity;
+
+          validity = _dbus_validate_body_with_reason (&f->signature, 0,
+                                                      f->byte_order, NULL,
+                                                      &f->body, 0,
+                                                      _dbus_string_get_length (&f->body));
+
+          if (validity != DBUS_VALID)
+            test_die (_dbus_validity_to_error_message (validity));
+        }
+        break;
+
+      /* alternates between the two byte orders */
+      case PHASE_BYTESWAP:
+        {
+          int new_order;
+
+          new_order = (f->byte_order == DBUS_LITTLE_ENDIAN ?
+                       DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+          _dbus_marshal_byteswap (&f->signature, 0, f->byte_order,
+                                  new_order, &f->body, 0);
+          f->byte_order = new_order;
+        }
+        break;
+
+      case PHASE_ITERATE:
+        {
+          DBusMessageIter iter;
+          static volatile dbus_uint64_t sink;
+
+          dbus_message_iter_init (f->message, &iter);
+          sink = read_values (&iter);
+          (void) sink;
+        }
+        break;
+
+      case N_PHASES:
+      default:
+        _dbus_assert_not_reached ("invalid phase");
+    }
+}
+
+static void
+fixture_init (Fixture        *f,
+              const Workload *workload)
+{
+  const DBusString *header;
+  const DBusString *body;
+
+  f->workload = workload;
+  f->message = build_message (workload);
+
+  if (!dbus_message_marshal (f->message, &f->blob, &f->blob_len))
+    test_oom ("marshalling");
+
+  _dbus_message_get_network_data (f->message, &header, &body);
+
+  if (!_dbus_string_init (&f->body) ||
+      !_dbus_string_copy (body, 0, &f->body, 0))
+    test_oom ("copying body");
+
+  _dbus_string_init_const (&f->signature,
+                           dbus_message_get_signature (f->message));
+  f->byte_order = DBUS_COMPILER_BYTE_ORDER;
+}
+
+static void
+fixture_free (Fixture *f)
+{
+  dbus_message_unref (f->message);
+  dbus_free (f->blob);
+  _dbus_string_free (&f->body);
+}
+
+static void
+usage (void)
+{
+  test_die ("syntax: manual-marshal-bench [--repeat N] [--scale N] [WORKLOAD...]");
+}
+
+static long
+parse_positive (const char *arg)
+{
+  char *end;
+  long n;
+
+  n = strtol (arg, &end, 10);
+
+  if (*arg == '\0' || *end != '\0' || n < 1 || n > 1000000)
+    usage ();
+
+  return n;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  long repeat = 5;
+  long scale = 1;
+  int first_workload = 1;
+  size_t w;
+
+  test_program_init ("manual-marshal-bench", NULL);
+
+  if (!dbus_set_memory_functions (counting_malloc, counting_realloc,
+                                  counting_free))
+    test_die ("could not set memory functions");
+
+  while (first_workload < argc && argv[first_workload][0] == '-')
+    {
+      if (first_workload + 1 >= argc)
+        usage ();
+      else if (strcmp (argv[first_workload], "--repeat") == 0)
+        repeat = parse_positive (argv[first_workload + 1]);
+      else if (strcmp (argv[first_workload], "--scale") == 0)
+        scale = parse_positive (argv[first_workload + 1]);
+      else
+        usage ();
+
+      first_workload += 2;
+    }
+
+  printf ("workload\tphase\tbytes\titerations\tns_per_op\tmb_per_s\t"
+          "allocs_per_op\n");
+
+  for (w = 0; w < _DBUS_N_ELEMENTS (workloads); w++)
+    {
+      const Workload *workload = &workloads[w];
+      Fixture f;
+      long iterations = workload->iterations * scale;
+      int bytes;
+      int phase;
+
+      if (first_workload < argc)
+        {
+          int i;
+
+          for (i = first_workload; i < argc; i++)
+            {
+              if (strcmp (argv[i], workload->name) == 0)
+                break;
+            }
+
+          if (i == argc)
+            continue;
+        }
+
+      fixture_init (&f, workload);
+      bytes = _dbus_string_get_length (&f.body);
+
+      for (phase = 0; phase < N_PHASES; phase++)
+        {
+          dbus_uint64_t best = 0;
+          unsigned long allocs = 0;
+          double ns_per_op;
+          long r, i;
+
+          /* warm up caches and the message cache */
+          run_once (&f, phase);
+
+          for (r = 0; r < repeat; r++)
+            {
+              dbus_uint64_t start;
+              dbus_uint64_t elapsed;
+              unsigned long allocs_before = n_allocs;
+
+              start = test_now_usec ();
+
+              for (i = 0; i < iterations; i++)
+                run_once (&f, phase);
+
+              elapsed = test_now_usec () - start;
+              allocs = n_allocs - allocs_before;
+
+              if (r == 0 || elapsed < best)
+                best = elapsed;
+            }
+
+          ns_per_op = best * 1000.0 / iterations;
+          printf ("%s\t%s\t%d\t%ld\t%.1f\t%.1f\t%.2f\n",
+                  workload->name, phase_names[phase], bytes, iterations,
+                  ns_per_op,
+                  best == 0 ? 0.0 : (double) bytes * iterations / best,
+                  (double) allocs / iterations);
+        }
+
+      fixture_free (&f);
+    }
+
+  dbus_shutdown ();
+  return 0;
+}
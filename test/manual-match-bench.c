@@ -0,0 +1,330 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* manual-match-bench.c - signal fan-out against many match rules
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Connects K clients to a running message bus, gives each of them R
+ * match rules, broadcasts signals and measures how fast the bus
+ * delivers them, and how much CPU time it spends per delivery.
+ *
+ * Each client has one rule that matches the broadcast signals, so
+ * each signal is delivered K times; the other R-1 rules are all
+ * different from each other and never match, but the bus has to
+ * consider them. Their kinds are taken in turn from --mix.
+ *
+ * --clients and --rules take comma-separated lists, and every
+ * combination is measured in turn, one tab-separated line each.
+ * The bus's CPU time is only available on Linux, when the bus runs
+ * on the same machine.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "dbus/dbus-sysdeps.h"
+
+#define BENCH_INTERFACE "com.example.Bench.I0"
+#define BENCH_MEMBER "M0"
+#define BENCH_PATH "/com/example/Bench/P0"
+#define BENCH_ARG0 "com.example.Bench.A0"
+
+/* Rule number 0 of each kind matches the broadcast signals */
+static const struct
+{
+  const char *name;
+  const char *format;
+} rule_kinds[] =
+{
+  { "interface", "type='signal',interface='com.example.Bench.I%d'" },
+  { "member", "type='signal',member='M%d'" },
+  { "path_namespace", "type='signal',path_namespace='/com/example/Bench/P%d'" },
+  { "arg0namespace", "type='signal',arg0namespace='com.example.Bench.A%d'" }
+};
+
+static int mix[_DBUS_N_ELEMENTS (rule_kinds)];
+static int n_mix = 0;
+static DBusBusType bus_type = DBUS_BUS_SESSION;
+static unsigned long deliveries = 0;
+
+static DBusHandlerResult
+count_filter (DBusConnection *connection,
+              DBusMessage    *message,
+              void           *user_data)
+{
+  if (dbus_message_is_signal (message, BENCH_INTERFACE, BENCH_MEMBER))
+    {
+      deliveries++;
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusConnection *
+connect_client (TestMainContext *ctx)
+{
+  DBusConnection *connection;
+  DBusError error = DBUS_ERROR_INIT;
+
+  connection = dbus_bus_get_private (bus_type, &error);
+
+  if (connection == NULL)
+    test_die (error.message);
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+  test_connection_setup (ctx, connection);
+  return connection;
+}
+
+static void
+add_rules (DBusConnection *connection,
+           int             client,
+           int             n_rules)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  char rule[256];
+  int j;
+
+  /* The non-matching rules are added without waiting for replies.
+   * Limits on match rules only get stricter as rules are added, so if
+   * any of them was rejected, the last one will be too. */
+  for (j = 1; j < n_rules; j++)
+    {
+      snprintf (rule, sizeof (rule), rule_kinds[mix[j % n_mix]].format,
+                client * n_rules + j);
+      dbus_bus_add_match (connection, rule, NULL);
+    }
+
+  snprintf (rule, sizeof (rule), rule_kinds[mix[0]].format, 0);
+  dbus_bus_add_match (connection, rule, &error);
+
+  if (dbus_error_is_set (&error))
+    test_die (error.message);
+}
+
+static void
+run (TestMainContext *ctx,
+     DBusConnection  *sender,
+     unsigned long    bus_pid,
+     int              n_clients,
+     int              n_rules,
+     int              n_signals)
+{
+  DBusConnection **clients;
+  unsigned long expected = (unsigned long) n_clients * n_signals;
+  dbus_uint64_t start, elapsed;
+  long long cpu_before, cpu_after;
+  const char *arg0 = BENCH_ARG0;
+  int i;
+
+  clients = dbus_new0 (DBusConnection *, n_clients);
+
+  if (clients == NULL)
+    test_oom ("allocating clients");
+
+  for (i = 0; i < n_clients; i++)
+    {
+      clients[i] = connect_client (ctx);
+
+      if (!dbus_connection_add_filter (clients[i], count_filter, NULL, NULL))
+        test_oom ("adding filter");
+
+      add_rules (clients[i], i, n_rules);
+    }
+
+  deliveries = 0;
+  cpu_before = test_process_cpu_usec (bus_pid);
+  start = test_now_usec ();
+
+  for (i = 0; i < n_signals; i++)
+    {
+      DBusMessage *signal;
+
+      signal = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                        BENCH_MEMBER);
+
+      if (signal == NULL ||
+          !dbus_message_append_args (signal, DBUS_TYPE_STRING, &arg0,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (sender, signal, NULL))
+        test_oom ("sending signal");
+
+      dbus_message_unref (signal);
+    }
+
+  while (deliveries < expected)
+    test_main_context_iterate (ctx, TRUE);
+
+  elapsed = test_now_usec () - start;
+  cpu_after = test_process_cpu_usec (bus_pid);
+
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf ("%d\t%d\t%d\t%lu\t%.3f\t%.1f\t",
+          n_clients, n_rules, n_signals, deliveries, elapsed / 1e6,
+          deliveries * 1e6 / elapsed);
+
+  if (cpu_before >= 0 && cpu_after >= 0)
+    printf ("%lld\t%.3f\n", cpu_after - cpu_before,
+            (double) (cpu_after - cpu_before) / deliveries);
+  else
+    printf ("-\t-\n");
+
+  fflush (stdout);
+
+  for (i = 0; i < n_clients; i++)
+    {
+      test_connection_shutdown (ctx, clients[i]);
+      dbus_connection_close (clients[i]);
+      dbus_connection_unref (clients[i]);
+    }
+
+  dbus_free (clients);
+}
+
+/* Parses a comma-separated list of positive integers */
+static int
+parse_list (const char *arg,
+            int        *values,
+            int         max)
+{
+  int n = 0;
+
+  while (*arg != '\0')
+    {
+      char *end;
+      long value = strtol (arg, &end, 10);
+
+      if (end == arg || value < 1 || value > 1000000 || n == max ||
+          (*end != ',' && *end != '\0'))
+        test_die ("expected a comma-separated list of positive integers");
+
+      values[n++] = value;
+      arg = (*end == ',' ? end + 1 : end);
+    }
+
+  return n;
+}
+
+static void
+parse_mix (const char *arg)
+{
+  n_mix = 0;
+
+  while (*arg != '\0')
+    {
+      size_t len = strcspn (arg, ",");
+      size_t k;
+
+      for (k = 0; k < _DBUS_N_ELEMENTS (rule_kinds); k++)
+        {
+          if (strlen (rule_kinds[k].name) == len &&
+              strncmp (arg, rule_kinds[k].name, len) == 0)
+            break;
+        }
+
+      if (k == _DBUS_N_ELEMENTS (rule_kinds) ||
+          n_mix == _DBUS_N_ELEMENTS (mix))
+        test_die ("--mix takes a list of interface, member, path_namespace "
+                  "and arg0namespace");
+
+      mix[n_mix++] = k;
+      arg += len;
+
+      if (*arg == ',')
+        arg++;
+    }
+
+  if (n_mix == 0)
+    test_die ("--mix must not be empty");
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  TestMainContext *ctx;
+  DBusConnection *sender;
+  int clients[16] = { 10, 100 };
+  int n_clients = 2;
+  int rules[16] = { 1, 10, 100 };
+  int n_rules = 3;
+  int n_signals = 1000;
+  unsigned long bus_pid;
+  int i, c, r;
+
+  test_program_init ("manual-match-bench", NULL);
+
+  parse_mix ("interface,member,path_namespace,arg0namespace");
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strstr (arg, "--clients=") == arg)
+        n_clients = parse_list (arg + strlen ("--clients="), clients,
+                                _DBUS_N_ELEMENTS (clients));
+      else if (strstr (arg, "--rules=") == arg)
+        n_rules = parse_list (arg + strlen ("--rules="), rules,
+                              _DBUS_N_ELEMENTS (rules));
+      else if (strstr (arg, "--signals=") == arg)
+        parse_list (arg + strlen ("--signals="), &n_signals, 1);
+      else if (strstr (arg, "--mix=") == arg)
+        parse_mix (arg + strlen ("--mix="));
+      else if (strcmp (arg, "--system") == 0)
+        bus_type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        bus_type = DBUS_BUS_SESSION;
+      else
+        test_die ("syntax: manual-match-bench [--session|--system] "
+                  "[--clients=K,...] [--rules=R,...] [--signals=N] "
+                  "[--mix=KIND,...]");
+    }
+
+  ctx = test_main_context_get ();
+  sender = connect_client (ctx);
+  bus_pid = test_get_bus_pid (sender);
+
+  printf ("clients\trules\tsignals\tdeliveries\tseconds\t"
+          "deliveries_per_second\tbus_cpu_usec\tbus_cpu_usec_per_delivery\n");
+
+  for (c = 0; c < n_clients; c++)
+    {
+      for (r = 0; r < n_rules; r++)
+        run (ctx, sender, bus_pid, clients[c], rules[r], n_signals);
+    }
+
+  test_connection_shutdown (ctx, sender);
+  dbus_connection_close (sender);
+  dbus_connection_unref (sender);
+  test_main_context_unref (ctx);
+  dbus_shutdown ();
+  return 0;
+}
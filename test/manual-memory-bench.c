@@ -0,0 +1,458 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* manual-memory-bench.c - memory used by the bus per connection
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Connects N clients to a running message bus, gives each of them R
+ * match rules and S well-known names, and has Q messages queued in the
+ * bus for each of them, which they never read. Then reports how much
+ * the bus's resident memory grew, and how much of that growth the bus's
+ * own accounting attributes to each kind of object.
+ *
+ * The breakdown needs a bus built with --enable-stats (it comes from
+ * org.freedesktop.DBus.Debug.Stats.GetStats). The resident memory is
+ * only available on Linux, when the bus runs on the same machine.
+ * Messages only start to queue in the bus once the kernel's socket
+ * buffer for a client is full, so small queue depths may not show up.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include <dbus/dbus.h>
+
+#include "dbus/dbus-internals.h"
+
+/* The GetStats entries we look at */
+typedef enum
+{
+  STAT_LIVE_MESSAGES,
+  STAT_MESSAGE_BYTES,
+  STAT_LIST_BYTES,
+  STAT_MATCH_RULE_BYTES,
+  STAT_SERVICE_BYTES,
+  STAT_OWNER_BYTES,
+  STAT_PENDING_REPLY_BYTES,
+  STAT_HASH_ENTRIES,
+  STAT_HASH_BYTES,
+  N_STATS
+} Stat;
+
+static const char * const stat_names[] = {
+    "LiveMessages",
+    "MessageBytes",
+    "ListMemPoolAllocatedBytes",
+    "MatchRuleMemPoolAllocatedBytes",
+    "ServiceMemPoolAllocatedBytes",
+    "OwnerMemPoolAllocatedBytes",
+    "PendingReplyMemPoolAllocatedBytes",
+    "HashEntries",
+    "HashTableBytes"
+};
+
+typedef struct
+{
+  dbus_bool_t have_stats;
+  long long rss_bytes;
+  dbus_uint32_t values[N_STATS];
+} Snapshot;
+
+static DBusBusType bus_type = DBUS_BUS_SESSION;
+
+/* Returns the resident memory of process pid, or -1 */
+static long long
+process_rss_bytes (unsigned long pid)
+{
+#ifdef __linux__
+  char path[64];
+  char line[256];
+  long long kb = -1;
+  FILE *f;
+
+  snprintf (path, sizeof (path), "/proc/%lu/status", pid);
+  f = fopen (path, "r");
+
+  if (f == NULL)
+    return -1;
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      if (sscanf (line, "VmRSS: %lld kB", &kb) == 1)
+        break;
+    }
+
+  fclose (f);
+  return kb < 0 ? -1 : kb * 1024;
+#else
+  return -1;
+#endif
+}
+
+static DBusMessage *
+call_bus (DBusConnection *connection,
+          const char     *interface,
+          const char     *method,
+          const char     *arg)
+{
+  DBusMessage *call, *reply;
+
+  call = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       interface, method);
+
+  if (call == NULL ||
+      (arg != NULL &&
+       !dbus_message_append_args (call, DBUS_TYPE_STRING, &arg,
+                                  DBUS_TYPE_INVALID)))
+    test_oom ("building call");
+
+  reply = dbus_connection_send_with_reply_and_block (connection, call, -1,
+                                                     NULL);
+  dbus_message_unref (call);
+  return reply;
+}
+
+/*
+ * Takes a snapshot of the bus's memory use. Because the bus handles
+ * each connection's messages in order, this also waits for everything
+ * sent on connection so far to have been dealt with.
+ */
+static void
+take_snapshot (DBusConnection *connection,
+               unsigned long   bus_pid,
+               Snapshot       *snapshot)
+{
+  DBusMessageIter iter, arr_iter;
+  DBusMessage *reply;
+
+  memset (snapshot, 0, sizeof (*snapshot));
+  reply = call_bus (connection, "org.freedesktop.DBus.Debug.Stats",
+                    "GetStats", NULL);
+
+  if (reply != NULL &&
+      dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+      dbus_message_iter_init (reply, &iter) &&
+      dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY)
+    {
+      snapshot->have_stats = TRUE;
+      dbus_message_iter_recurse (&iter, &arr_iter);
+
+      while (dbus_message_iter_get_arg_type (&arr_iter) ==
+             DBUS_TYPE_DICT_ENTRY)
+        {
+          DBusMessageIter entry_iter, var_iter;
+          const char *key;
+          int i;
+
+          dbus_message_iter_recurse (&arr_iter, &entry_iter);
+          dbus_message_iter_get_basic (&entry_iter, &key);
+          dbus_message_iter_next (&entry_iter);
+          dbus_message_iter_recurse (&entry_iter, &var_iter);
+
+          for (i = 0; i < N_STATS; i++)
+            {
+              if (strcmp (key, stat_names[i]) == 0 &&
+                  dbus_message_iter_get_arg_type (&var_iter) ==
+                  DBUS_TYPE_UINT32)
+                dbus_message_iter_get_basic (&var_iter,
+                                             &snapshot->values[i]);
+            }
+
+          dbus_message_iter_next (&arr_iter);
+        }
+    }
+
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  snapshot->rss_bytes = bus_pid == 0 ? -1 : process_rss_bytes (bus_pid);
+}
+
+static DBusConnection *
+connect_client (void)
+{
+  DBusConnection *connection;
+  DBusError error = DBUS_ERROR_INIT;
+
+  connection = dbus_bus_get_private (bus_type, &error);
+
+  if (connection == NULL)
+    test_die (error.message);
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+  return connection;
+}
+
+/* Sets up a client. Returns when the bus has dealt with all of it. */
+static void
+set_up_client (DBusConnection *connection,
+               int             index,
+               int             n_rules,
+               int             n_names)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *reply;
+  char buf[256];
+  int i;
+
+  /* no need to wait for each of these: the GetId call below will */
+  for (i = 0; i < n_rules; i++)
+    {
+      snprintf (buf, sizeof (buf),
+                "type='signal',interface='com.example.MemoryBench',"
+                "member='C%dR%d'", index, i);
+      dbus_bus_add_match (connection, buf, NULL);
+    }
+
+  for (i = 0; i < n_names; i++)
+    {
+      snprintf (buf, sizeof (buf), "com.example.MemoryBench.C%d.N%d",
+                index, i);
+
+      if (dbus_bus_request_name (connection, buf, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                 &error) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        test_die (error.message != NULL ? error.message : "name already owned");
+    }
+
+  reply = call_bus (connection, DBUS_INTERFACE_DBUS, "GetId", NULL);
+
+  if (reply == NULL)
+    test_die ("lost connection to bus");
+
+  dbus_message_unref (reply);
+}
+
+static void
+fill_queue (DBusConnection *sender,
+            const char     *destination,
+            int             depth,
+            int             payload_size,
+            unsigned char  *payload)
+{
+  int i;
+
+  for (i = 0; i < depth; i++)
+    {
+      DBusMessage *message;
+
+      message = dbus_message_new_method_call (destination,
+                                              "/com/example/MemoryBench",
+                                              "com.example.MemoryBench",
+                                              "Queued");
+
+      if (message == NULL ||
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                     &payload, payload_size,
+                                     DBUS_TYPE_INVALID))
+        test_oom ("building message");
+
+      dbus_message_set_no_reply (message, TRUE);
+
+      if (!dbus_connection_send (sender, message, NULL))
+        test_oom ("sending message");
+
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (sender);
+}
+
+static int
+parse_count (const char *arg,
+             const char *prefix)
+{
+  int n = atoi (arg + strlen (prefix));
+
+  if (n < 0)
+    test_die ("counts must not be negative");
+
+  return n;
+}
+
+static void
+print_growth (const char     *key,
+              const Snapshot *before,
+              const Snapshot *after,
+              Stat            stat)
+{
+  printf ("%s %lld\n", key,
+          (long long) after->values[stat] - (long long) before->values[stat]);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  DBusConnection *control;
+  DBusConnection **clients;
+  Snapshot before, after;
+  unsigned char *payload;
+  unsigned long bus_pid;
+  int n_connections = 100;
+  int n_rules = 10;
+  int n_names = 1;
+  int queue_depth = 0;
+  int payload_size = 1024;
+  int i;
+
+  test_program_init ("manual-memory-bench", NULL);
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strstr (arg, "--connections=") == arg)
+        n_connections = parse_count (arg, "--connections=");
+      else if (strstr (arg, "--rules=") == arg)
+        n_rules = parse_count (arg, "--rules=");
+      else if (strstr (arg, "--names=") == arg)
+        n_names = parse_count (arg, "--names=");
+      else if (strstr (arg, "--queue-depth=") == arg)
+        queue_depth = parse_count (arg, "--queue-depth=");
+      else if (strstr (arg, "--payload-size=") == arg)
+        payload_size = parse_count (arg, "--payload-size=");
+      else if (strcmp (arg, "--system") == 0)
+        bus_type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        bus_type = DBUS_BUS_SESSION;
+      else
+        test_die ("syntax: manual-memory-bench [--session|--system] "
+                  "[--connections=N] [--rules=R] [--names=S] "
+                  "[--queue-depth=Q] [--payload-size=BYTES]");
+    }
+
+#ifdef DBUS_UNIX
+    {
+      struct rlimit lim;
+
+      /* one fd per connection */
+      if (getrlimit (RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+        {
+          lim.rlim_cur = lim.rlim_max;
+          setrlimit (RLIMIT_NOFILE, &lim);
+        }
+    }
+#endif
+
+  clients = dbus_new0 (DBusConnection *, n_connections);
+  payload = dbus_malloc0 (payload_size + 1);
+
+  if (clients == NULL || payload == NULL)
+    test_oom ("allocating");
+
+  control = connect_client ();
+  bus_pid = test_get_bus_pid (control);
+  take_snapshot (control, bus_pid, &before);
+
+  for (i = 0; i < n_connections; i++)
+    {
+      clients[i] = connect_client ();
+      set_up_client (clients[i], i, n_rules, n_names);
+    }
+
+  /* the clients never read, so these pile up in the bus */
+  for (i = 0; i < n_connections && queue_depth > 0; i++)
+    fill_queue (control, dbus_bus_get_unique_name (clients[i]),
+                queue_depth, payload_size, payload);
+
+  take_snapshot (control, bus_pid, &after);
+
+  printf ("connections %d\n", n_connections);
+  printf ("rules_per_connection %d\n", n_rules);
+  printf ("names_per_connection %d\n", n_names);
+  printf ("queue_depth %d\n", queue_depth);
+  printf ("payload_size %d\n", payload_size);
+
+  if (before.rss_bytes >= 0 && after.rss_bytes >= 0)
+    {
+      long long growth = after.rss_bytes - before.rss_bytes;
+
+      printf ("rss_before_bytes %lld\n", before.rss_bytes);
+      printf ("rss_after_bytes %lld\n", after.rss_bytes);
+      printf ("rss_growth_bytes %lld\n", growth);
+
+      if (n_connections > 0)
+        printf ("rss_growth_per_connection_bytes %lld\n",
+                growth / n_connections);
+    }
+
+  if (before.have_stats && after.have_stats)
+    {
+      long long accounted = 0;
+      Stat s;
+
+      /* growth in the number of each kind of object, and in the memory
+       * the bus knows it is using for them */
+      print_growth ("live_messages", &before, &after, STAT_LIVE_MESSAGES);
+      print_growth ("message_bytes", &before, &after, STAT_MESSAGE_BYTES);
+      print_growth ("list_bytes", &before, &after, STAT_LIST_BYTES);
+      print_growth ("match_rule_bytes", &before, &after,
+                    STAT_MATCH_RULE_BYTES);
+      print_growth ("name_bytes_services", &before, &after,
+                    STAT_SERVICE_BYTES);
+      print_growth ("name_bytes_owners", &before, &after, STAT_OWNER_BYTES);
+      print_growth ("pending_reply_bytes", &before, &after,
+                    STAT_PENDING_REPLY_BYTES);
+      print_growth ("hash_entries", &before, &after, STAT_HASH_ENTRIES);
+      print_growth ("hash_bytes", &before, &after, STAT_HASH_BYTES);
+
+      for (s = STAT_MESSAGE_BYTES; s < N_STATS; s++)
+        {
+          if (s != STAT_HASH_ENTRIES)
+            accounted += (long long) after.values[s] - before.values[s];
+        }
+
+      /* strings, connection and transport structures, buffers,
+       * allocator overhead... */
+      if (before.rss_bytes >= 0 && after.rss_bytes >= 0)
+        printf ("unaccounted_bytes %lld\n",
+                after.rss_bytes - before.rss_bytes - accounted);
+    }
+  else
+    {
+      fprintf (stderr, "manual-memory-bench: no breakdown, because the "
+                       "bus does not support GetStats\n");
+    }
+
+  for (i = 0; i < n_connections; i++)
+    {
+      dbus_connection_close (clients[i]);
+      dbus_connection_unref (clients[i]);
+    }
+
+  dbus_connection_close (control);
+  dbus_connection_unref (control);
+  dbus_free (clients);
+  dbus_free (payload);
+  dbus_shutdown ();
+  return 0;
+}
@@ -0,0 +1,306 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* manual-thread-bench.c - throughput of one connection shared by threads
+ *
+ * Copyright (C) 2026  D-Bus contributors
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/*
+ * Starts T threads that all use the same DBusConnection to a running
+ * message bus. Each makes --calls blocking method calls, emitting
+ * --signals signals after each one, and the throughput is measured for
+ * each T in --threads, one tab-separated line each. Comparing the
+ * results with --per-thread, where each thread has a connection of its
+ * own, shows how much is lost to contention inside libdbus: on the
+ * connection's mutex, its I/O path and the global locks.
+ *
+ * The calls are to org.freedesktop.DBus.Peer.Ping, which the bus
+ * answers itself unless --dest names another connection (libdbus
+ * answers Ping automatically).
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+
+#include "dbus/dbus-internals.h"
+#include "dbus/dbus-sysdeps.h"
+
+#define MAX_THREADS 256
+
+typedef struct
+{
+  pthread_t thread;
+  DBusConnection *connection;
+  /* round-trip time of each call, in microseconds */
+  dbus_uint64_t *latencies;
+  int failures;
+} Worker;
+
+static DBusBusType bus_type = DBUS_BUS_SESSION;
+static const char *destination = DBUS_SERVICE_DBUS;
+static int n_calls = 2000;
+static int n_signals = 1;
+
+/* The workers wait for this, so that they all start together */
+static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static dbus_bool_t started = FALSE;
+
+static DBusConnection *
+connect_to_bus (void)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_bus_get_private (bus_type, &error);
+
+  if (connection == NULL)
+    test_die (error.message);
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+  return connection;
+}
+
+static void *
+run_worker (void *data)
+{
+  Worker *worker = data;
+  int i, j;
+
+  pthread_mutex_lock (&start_mutex);
+
+  while (!started)
+    pthread_cond_wait (&start_cond, &start_mutex);
+
+  pthread_mutex_unlock (&start_mutex);
+
+  for (i = 0; i < n_calls; i++)
+    {
+      DBusMessage *call, *reply;
+      dbus_uint64_t start;
+
+      call = dbus_message_new_method_call (destination, "/",
+                                           DBUS_INTERFACE_PEER, "Ping");
+
+      if (call == NULL)
+        test_oom ("building call");
+
+      start = test_now_usec ();
+      reply = dbus_connection_send_with_reply_and_block (worker->connection,
+                                                         call, -1, NULL);
+      worker->latencies[i] = test_now_usec () - start;
+      dbus_message_unref (call);
+
+      if (reply == NULL ||
+          dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        worker->failures++;
+
+      if (reply != NULL)
+        dbus_message_unref (reply);
+
+      for (j = 0; j < n_signals; j++)
+        {
+          DBusMessage *signal;
+
+          signal = dbus_message_new_signal ("/com/example/ThreadBench",
+                                            "com.example.ThreadBench",
+                                            "Tick");
+
+          if (signal == NULL ||
+              !dbus_connection_send (worker->connection, signal, NULL))
+            test_oom ("sending signal");
+
+          dbus_message_unref (signal);
+        }
+    }
+
+  dbus_connection_flush (worker->connection);
+  return NULL;
+}
+
+static int
+compare_latencies (const void *a,
+                   const void *b)
+{
+  dbus_uint64_t x = *(const dbus_uint64_t *) a;
+  dbus_uint64_t y = *(const dbus_uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+run (DBusConnection *shared,
+     int             n_threads)
+{
+  Worker workers[MAX_THREADS];
+  dbus_uint64_t *latencies;
+  dbus_uint64_t start, end;
+  double seconds;
+  int n = n_threads * n_calls;
+  int failures = 0;
+  int i;
+
+  latencies = dbus_new0 (dbus_uint64_t, n);
+
+  if (latencies == NULL)
+    test_oom ("allocating");
+
+  started = FALSE;
+
+  for (i = 0; i < n_threads; i++)
+    {
+      workers[i].connection = shared != NULL ? shared : connect_to_bus ();
+      workers[i].latencies = latencies + i * n_calls;
+      workers[i].failures = 0;
+
+      if (pthread_create (&workers[i].thread, NULL, run_worker,
+                          &workers[i]) != 0)
+        test_die ("unable to start thread");
+    }
+
+  pthread_mutex_lock (&start_mutex);
+  started = TRUE;
+  start = test_now_usec ();
+  pthread_cond_broadcast (&start_cond);
+  pthread_mutex_unlock (&start_mutex);
+
+  for (i = 0; i < n_threads; i++)
+    {
+      pthread_join (workers[i].thread, NULL);
+      failures += workers[i].failures;
+    }
+
+  end = test_now_usec ();
+  seconds = (end - start) / 1e6;
+
+  if (seconds <= 0)
+    seconds = 1e-6;
+
+  for (i = 0; shared == NULL && i < n_threads; i++)
+    {
+      dbus_connection_close (workers[i].connection);
+      dbus_connection_unref (workers[i].connection);
+    }
+
+  qsort (latencies, n, sizeof (*latencies), compare_latencies);
+
+  printf ("%d\t%s\t%d\t%d\t%d\t%.3f\t%.1f\t%.1f\t%lu\t%lu\n",
+          n_threads, shared != NULL ? "shared" : "per-thread",
+          n, n * n_signals, failures, seconds, n / seconds,
+          n * n_signals / seconds,
+          (unsigned long) latencies[n / 2],
+          (unsigned long) latencies[(int) (n * 0.99)]);
+  fflush (stdout);
+  dbus_free (latencies);
+}
+
+static int
+parse_list (const char *arg,
+            int        *values,
+            int         max)
+{
+  int n = 0;
+
+  while (*arg != '\0' && n < max)
+    {
+      char *end;
+
+      values[n] = strtol (arg, &end, 10);
+
+      if (end == arg || values[n] < 1 || values[n] > MAX_THREADS ||
+          (*end != ',' && *end != '\0'))
+        test_die ("--threads takes a list of numbers from 1 to 256");
+
+      n++;
+      arg = (*end == ',') ? end + 1 : end;
+    }
+
+  return n;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  DBusConnection *shared = NULL;
+  dbus_bool_t per_thread = FALSE;
+  int threads[16] = { 1, 2, 4, 8 };
+  int n_threads = 4;
+  int i;
+
+  test_program_init ("manual-thread-bench", NULL);
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strstr (arg, "--threads=") == arg)
+        n_threads = parse_list (arg + strlen ("--threads="), threads,
+                                _DBUS_N_ELEMENTS (threads));
+      else if (strstr (arg, "--calls=") == arg)
+        n_calls = atoi (arg + strlen ("--calls="));
+      else if (strstr (arg, "--signals=") == arg)
+        n_signals = atoi (arg + strlen ("--signals="));
+      else if (strstr (arg, "--dest=") == arg)
+        destination = arg + strlen ("--dest=");
+      else if (strcmp (arg, "--per-thread") == 0)
+        per_thread = TRUE;
+      else if (strcmp (arg, "--system") == 0)
+        bus_type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        bus_type = DBUS_BUS_SESSION;
+      else
+        test_die ("syntax: manual-thread-bench [--session|--system] "
+                  "[--threads=T,...] [--calls=N] [--signals=S] [--dest=NAME] "
+                  "[--per-thread]");
+    }
+
+  if (n_calls < 1 || n_signals < 0)
+    test_die ("--calls must be positive and --signals must not be negative");
+
+  if (!dbus_threads_init_default ())
+    test_oom ("initializing threads");
+
+  if (!per_thread)
+    shared = connect_to_bus ();
+
+  printf ("threads\tconnection\tcalls\tsignals\tfailures\tseconds\t"
+          "calls_per_second\tsignals_per_second\tcall_p50_usec\t"
+          "call_p99_usec\n");
+
+  for (i = 0; i < n_threads; i++)
+    run (shared, threads[i]);
+
+  if (shared != NULL)
+    {
+      dbus_connection_close (shared);
+      dbus_connection_unref (shared);
+    }
+
+  dbus_shutdown ();
+  return 0;
+}
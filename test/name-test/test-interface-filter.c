@@ -0,0 +1,225 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#define TEST_PATH "/org/freedesktop/TestSuite/InterfaceFilter"
+#define INTERFACE_ONE "org.freedesktop.TestSuite.One"
+#define INTERFACE_TWO "org.freedesktop.TestSuite.Two"
+#define INTERFACE_OTHER "org.freedesktop.TestSuite.Other"
+
+static void die (const char *message) _DBUS_GNUC_NORETURN;
+
+static void
+die (const char *message)
+{
+  printf ("Bail out! test-interface-filter: %s\n", message);
+  exit (1);
+}
+
+static int test_num = 0;
+
+/* The ids of the filters that ran on the last test message, in order */
+static char ran[32];
+static int n_ran = 0;
+
+typedef struct
+{
+  char id;
+  DBusHandlerResult result;
+} Filter;
+
+/* Plain filters, which run on every message */
+static Filter first = { 'a', DBUS_HANDLER_RESULT_NOT_YET_HANDLED };
+static Filter middle = { 'b', DBUS_HANDLER_RESULT_NOT_YET_HANDLED };
+static Filter last = { 'c', DBUS_HANDLER_RESULT_NOT_YET_HANDLED };
+
+/* Interface filters: signals of INTERFACE_ONE, its Handled member only,
+ * and anything of INTERFACE_TWO */
+static Filter one = { '1', DBUS_HANDLER_RESULT_NOT_YET_HANDLED };
+static Filter handled = { 'H', DBUS_HANDLER_RESULT_HANDLED };
+static Filter two = { '2', DBUS_HANDLER_RESULT_NOT_YET_HANDLED };
+
+static DBusHandlerResult
+record_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  Filter *filter = user_data;
+
+  /* Ignore the bus's own messages, such as NameAcquired */
+  if (!dbus_message_has_path (message, TEST_PATH))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (n_ran >= (int) sizeof (ran) - 1)
+    die ("too many filters ran");
+
+  ran[n_ran++] = filter->id;
+  ran[n_ran] = '\0';
+  return filter->result;
+}
+
+/* Added ahead of the others: on a Remove message, removes the filters
+ * for INTERFACE_ONE while the message is being dispatched */
+static DBusHandlerResult
+remove_filter (DBusConnection *connection,
+               DBusMessage    *message,
+               void           *user_data)
+{
+  if (dbus_message_has_path (message, TEST_PATH) &&
+      dbus_message_has_member (message, "Remove"))
+    {
+      dbus_connection_remove_filter (connection, record_filter, &one);
+      dbus_connection_remove_filter (connection, record_filter, &handled);
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusConnection *
+open_connection (void)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      die ("unable to connect");
+    }
+
+  return connection;
+}
+
+/* Sends a message of @type from @sender to @receiver, dispatches it on
+ * @receiver, and checks that the filters in @expected ran, in order */
+static void
+check_filters (DBusConnection *sender,
+               DBusConnection *receiver,
+               int             type,
+               const char     *interface,
+               const char     *member,
+               const char     *expected)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new (type);
+  if (message == NULL ||
+      !dbus_message_set_destination (message,
+                                     dbus_bus_get_unique_name (receiver)) ||
+      !dbus_message_set_path (message, TEST_PATH) ||
+      !dbus_message_set_interface (message, interface) ||
+      !dbus_message_set_member (message, member))
+    die ("No memory");
+
+  dbus_message_set_no_reply (message, TRUE);
+
+  if (!dbus_connection_send (sender, message, NULL))
+    die ("No memory");
+
+  dbus_message_unref (message);
+  dbus_connection_flush (sender);
+
+  /* The first filter always runs, so once anything has run, the whole
+   * message has been dispatched */
+  n_ran = 0;
+  ran[0] = '\0';
+
+  while (n_ran == 0)
+    {
+      if (!dbus_connection_read_write_dispatch (receiver, -1))
+        die ("disconnected while waiting for the message");
+    }
+
+  if (strcmp (ran, expected) != 0)
+    {
+      fprintf (stderr, "*** %s.%s ran filters \"%s\", expected \"%s\"\n",
+               interface, member, ran, expected);
+      die ("wrong filters ran");
+    }
+}
+
+/* This test outputs TAP syntax: http://testanything.org/ */
+int
+main (int    argc,
+      char **argv)
+{
+  DBusConnection *sender;
+  DBusConnection *receiver;
+
+  sender = open_connection ();
+  receiver = open_connection ();
+
+  if (!dbus_connection_add_filter (receiver, remove_filter, NULL, NULL) ||
+      !dbus_connection_add_filter (receiver, record_filter, &first, NULL) ||
+      !dbus_connection_add_interface_filter (receiver,
+                                             DBUS_MESSAGE_TYPE_SIGNAL,
+                                             INTERFACE_ONE, NULL,
+                                             record_filter, &one, NULL) ||
+      !dbus_connection_add_filter (receiver, record_filter, &middle, NULL) ||
+      !dbus_connection_add_interface_filter (receiver,
+                                             DBUS_MESSAGE_TYPE_INVALID,
+                                             INTERFACE_ONE, "Handled",
+                                             record_filter, &handled, NULL) ||
+      !dbus_connection_add_interface_filter (receiver,
+                                             DBUS_MESSAGE_TYPE_INVALID,
+                                             INTERFACE_TWO, NULL,
+                                             record_filter, &two, NULL) ||
+      !dbus_connection_add_filter (receiver, record_filter, &last, NULL))
+    die ("No memory");
+
+  printf ("ok %d - connected to session bus\n", ++test_num);
+
+  /* Interface filters only run on messages that match them */
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_OTHER, "Ping", "abc");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_TWO, "Ping", "ab2c");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                 INTERFACE_TWO, "Ping", "ab2c");
+  printf ("ok %d - interface filters only run for their interface\n",
+          ++test_num);
+
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_ONE, "Ping", "a1bc");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                 INTERFACE_ONE, "Ping", "abc");
+  printf ("ok %d - interface filters only run for their member and type\n",
+          ++test_num);
+
+  /* All filters run in the order they were added, whichever function
+   * added them, and HANDLED stops the rest */
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_ONE, "Handled", "a1bH");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_METHOD_CALL,
+                 INTERFACE_ONE, "Handled", "abH");
+  printf ("ok %d - HANDLED from an interface filter stops the others\n",
+          ++test_num);
+
+  /* Filters removed by an earlier filter don't run on the message being
+   * dispatched, nor on later ones */
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_ONE, "Remove", "abc");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_ONE, "Handled", "abc");
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_TWO, "Ping", "ab2c");
+  printf ("ok %d - interface filters removed during dispatch\n", ++test_num);
+
+  dbus_connection_remove_filter (receiver, record_filter, &two);
+  check_filters (sender, receiver, DBUS_MESSAGE_TYPE_SIGNAL,
+                 INTERFACE_TWO, "Ping", "abc");
+  printf ("ok %d - interface filter removed between messages\n", ++test_num);
+
+  dbus_connection_close (sender);
+  dbus_connection_unref (sender);
+  dbus_connection_close (receiver);
+  dbus_connection_unref (receiver);
+  dbus_shutdown ();
+
+  printf ("1..%d\n", test_num);
+  return 0;
+}
@@ -0,0 +1,296 @@
+#include <config.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#define TEST_SERVICE "org.freedesktop.DBus.TestSuiteEchoService"
+#define TEST_PATH "/org/freedesktop/TestSuite"
+#define TEST_INTERFACE "org.freedesktop.TestSuite"
+
+static void die (const char *message) _DBUS_GNUC_NORETURN;
+
+static void
+die (const char *message)
+{
+  printf ("Bail out! test-property-cache: %s\n", message);
+  exit (1);
+}
+
+static int test_num = 0;
+static dbus_bool_t service_gone = FALSE;
+
+static DBusHandlerResult
+filter_func (DBusConnection *connection,
+             DBusMessage    *message,
+             void           *user_data)
+{
+  const char *name, *old_owner, *new_owner;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged") &&
+      dbus_message_get_args (message, NULL,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID) &&
+      strcmp (name, TEST_SERVICE) == 0 &&
+      new_owner[0] == '\0')
+    service_gone = TRUE;
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Calls a method of the test service, then dispatches whatever arrived
+ * before the reply, such as the signals it emitted */
+static DBusMessage *
+call_service (DBusConnection *connection,
+              const char     *method,
+              int             first_arg_type,
+              ...)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *call;
+  DBusMessage *reply;
+  va_list args;
+
+  call = dbus_message_new_method_call (TEST_SERVICE, TEST_PATH,
+                                       TEST_INTERFACE, method);
+  if (call == NULL)
+    die ("No memory");
+
+  va_start (args, first_arg_type);
+
+  if (!dbus_message_append_args_valist (call, first_arg_type, args))
+    die ("No memory");
+
+  va_end (args);
+
+  reply = dbus_connection_send_with_reply_and_block (connection, call, -1,
+                                                     &error);
+  dbus_message_unref (call);
+
+  if (reply == NULL)
+    {
+      fprintf (stderr, "*** %s failed: %s\n", method, error.message);
+      die ("method call failed");
+    }
+
+  while (dbus_connection_dispatch (connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+
+  return reply;
+}
+
+static void
+check_calls (DBusConnection *connection,
+             dbus_uint32_t   expected_get_all,
+             dbus_uint32_t   expected_get)
+{
+  DBusMessage *reply;
+  dbus_uint32_t n_get_all, n_get;
+
+  reply = call_service (connection, "GetPropertyCalls", DBUS_TYPE_INVALID);
+
+  if (!dbus_message_get_args (reply, NULL,
+                              DBUS_TYPE_UINT32, &n_get_all,
+                              DBUS_TYPE_UINT32, &n_get,
+                              DBUS_TYPE_INVALID))
+    die ("GetPropertyCalls returned the wrong type");
+
+  dbus_message_unref (reply);
+
+  if (n_get_all != expected_get_all || n_get != expected_get)
+    {
+      fprintf (stderr, "*** service saw %u GetAll and %u Get, expected %u "
+               "and %u\n", n_get_all, n_get, expected_get_all, expected_get);
+      die ("unexpected number of property calls");
+    }
+}
+
+static dbus_int32_t
+get_answer (DBusPropertyCache *cache)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *message;
+  DBusMessageIter iter, variant;
+  dbus_int32_t value;
+
+  if (!dbus_property_cache_get (cache, "Answer", &message, &iter, &error))
+    {
+      fprintf (stderr, "*** Get Answer failed: %s\n", error.message);
+      die ("dbus_property_cache_get failed");
+    }
+
+  if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_VARIANT)
+    die ("value is not a variant");
+
+  dbus_message_iter_recurse (&iter, &variant);
+
+  if (dbus_message_iter_get_arg_type (&variant) != DBUS_TYPE_INT32)
+    die ("Answer is not an int32");
+
+  dbus_message_iter_get_basic (&variant, &value);
+  dbus_message_unref (message);
+  return value;
+}
+
+static void
+check_greeting (DBusPropertyCache *cache,
+                const char        *expected)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *message;
+  DBusMessageIter iter, variant;
+  const char *value;
+
+  if (!dbus_property_cache_get (cache, "Greeting", &message, &iter, &error))
+    {
+      fprintf (stderr, "*** Get Greeting failed: %s\n", error.message);
+      die ("dbus_property_cache_get failed");
+    }
+
+  dbus_message_iter_recurse (&iter, &variant);
+
+  if (dbus_message_iter_get_arg_type (&variant) != DBUS_TYPE_STRING)
+    die ("Greeting is not a string");
+
+  dbus_message_iter_get_basic (&variant, &value);
+
+  if (strcmp (value, expected) != 0)
+    {
+      fprintf (stderr, "*** Greeting is \"%s\", expected \"%s\"\n",
+               value, expected);
+      die ("wrong Greeting");
+    }
+
+  dbus_message_unref (message);
+}
+
+static void
+stop_service (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call (TEST_SERVICE, TEST_PATH,
+                                          TEST_INTERFACE, "Exit");
+  if (message == NULL)
+    die ("No memory");
+
+  dbus_message_set_no_reply (message, TRUE);
+
+  if (!dbus_connection_send (connection, message, NULL))
+    die ("No memory");
+
+  dbus_message_unref (message);
+
+  service_gone = FALSE;
+
+  while (!service_gone && dbus_connection_read_write_dispatch (connection, -1))
+    ;
+
+  if (!service_gone)
+    die ("disconnected while waiting for the service to exit");
+}
+
+/* This test outputs TAP syntax: http://testanything.org/ */
+int
+main (int    argc,
+      char **argv)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+  DBusPropertyCache *cache;
+  dbus_int32_t answer;
+  dbus_int32_t new_answer = 7;
+  const char *new_greeting = "Bonjour";
+
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      dbus_error_free (&error);
+      return 1;
+    }
+
+  dbus_bus_add_match (connection,
+                      "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                      "member='NameOwnerChanged',arg0='" TEST_SERVICE "'",
+                      &error);
+  if (dbus_error_is_set (&error) ||
+      !dbus_connection_add_filter (connection, filter_func, NULL, NULL))
+    die ("unable to watch the test service's name");
+
+  printf ("ok %d - connected to session bus\n", ++test_num);
+
+  cache = dbus_property_cache_new (connection, TEST_SERVICE, TEST_PATH,
+                                   TEST_INTERFACE, &error);
+  if (cache == NULL)
+    {
+      fprintf (stderr, "*** Failed to create cache: %s\n", error.message);
+      die ("dbus_property_cache_new failed");
+    }
+
+  /* The first lookup waits for GetAll, which activates the service */
+  if (get_answer (cache) != 42)
+    die ("initial Answer should be 42");
+
+  check_greeting (cache, "Hello");
+  check_calls (connection, 1, 0);
+  printf ("ok %d - cache filled from GetAll\n", ++test_num);
+
+  /* PropertiesChanged with a value updates the cache */
+  dbus_message_unref (call_service (connection, "SetAnswer",
+                                    DBUS_TYPE_INT32, &new_answer,
+                                    DBUS_TYPE_INVALID));
+
+  if (get_answer (cache) != 7)
+    die ("Answer should be 7 after PropertiesChanged");
+
+  check_calls (connection, 1, 0);
+  printf ("ok %d - PropertiesChanged updated a value\n", ++test_num);
+
+  /* PropertiesChanged invalidating a property makes the next lookup
+   * fall back to a blocking Get, whose result is then cached */
+  dbus_message_unref (call_service (connection, "SetGreeting",
+                                    DBUS_TYPE_STRING, &new_greeting,
+                                    DBUS_TYPE_INVALID));
+  check_greeting (cache, "Bonjour");
+  check_calls (connection, 1, 1);
+  check_greeting (cache, "Bonjour");
+  check_calls (connection, 1, 1);
+  printf ("ok %d - invalidated property fetched with Get and cached\n",
+          ++test_num);
+
+  /* When the owner goes away the cache is cleared, and the next lookup
+   * gets everything again from the new owner */
+  stop_service (connection);
+
+  answer = get_answer (cache);
+
+  if (answer != 42)
+    {
+      fprintf (stderr, "*** Answer is %d, expected 42\n", answer);
+      die ("cache was not cleared when the owner changed");
+    }
+
+  check_greeting (cache, "Hello");
+  check_calls (connection, 1, 0);
+
+  /* The NameOwnerChanged for the new owner arrives after the GetAll
+   * reply it raced with, and must not empty the cache again */
+  get_answer (cache);
+  check_calls (connection, 1, 0);
+  printf ("ok %d - cache cleared when the owner changed\n", ++test_num);
+
+  dbus_property_cache_unref (cache);
+  stop_service (connection);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_shutdown ();
+
+  printf ("1..%d\n", test_num);
+  return 0;
+}
@@ -0,0 +1,233 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dbus/dbus.h>
+
+#define WATCHED_NAME "org.freedesktop.DBus.TestSuite.WatchedName"
+
+static void die (const char *message) _DBUS_GNUC_NORETURN;
+
+static void
+die (const char *message)
+{
+  printf ("Bail out! test-watch-name-owner: %s\n", message);
+  exit (1);
+}
+
+static int test_num = 0;
+static int n_owner_changes = 0;
+
+static DBusHandlerResult
+filter_func (DBusConnection *connection,
+             DBusMessage    *message,
+             void           *user_data)
+{
+  const char *name, *old_owner, *new_owner;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged") &&
+      dbus_message_get_args (message, NULL,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID) &&
+      strcmp (name, WATCHED_NAME) == 0)
+    n_owner_changes++;
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static DBusConnection *
+open_connection (void)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *connection;
+
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      die ("unable to connect");
+    }
+
+  return connection;
+}
+
+/* Dispatches until the filter has seen @n_expected NameOwnerChanged
+ * signals for the watched name in all */
+static void
+dispatch_owner_changes (DBusConnection *connection,
+                        int             n_expected)
+{
+  while (n_owner_changes < n_expected)
+    {
+      if (dbus_connection_dispatch (connection) == DBUS_DISPATCH_COMPLETE &&
+          n_owner_changes < n_expected &&
+          !dbus_connection_read_write (connection, -1))
+        die ("disconnected while waiting for NameOwnerChanged");
+    }
+}
+
+static void
+request_name (DBusConnection *connection)
+{
+  DBusError error = DBUS_ERROR_INIT;
+
+  if (dbus_bus_request_name (connection, WATCHED_NAME,
+                             DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("unable to own the watched name");
+}
+
+static void
+release_name (DBusConnection *connection)
+{
+  DBusError error = DBUS_ERROR_INIT;
+
+  if (dbus_bus_release_name (connection, WATCHED_NAME, &error) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED)
+    die ("unable to release the watched name");
+}
+
+/* Checks that dbus_bus_get_name_owner() and dbus_bus_name_has_owner()
+ * agree that the watched name is owned by @expected, or by nobody */
+static void
+check_owner (DBusConnection *connection,
+             DBusConnection *expected)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  char *owner;
+
+  owner = dbus_bus_get_name_owner (connection, WATCHED_NAME, &error);
+
+  if (expected == NULL)
+    {
+      if (owner != NULL)
+        {
+          fprintf (stderr, "*** owner is %s, expected none\n", owner);
+          die ("name should have no owner");
+        }
+
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NAME_HAS_NO_OWNER))
+        die ("expected NameHasNoOwner");
+
+      dbus_error_free (&error);
+
+      if (dbus_bus_name_has_owner (connection, WATCHED_NAME, &error))
+        die ("dbus_bus_name_has_owner() should say there is no owner");
+    }
+  else
+    {
+      const char *unique = dbus_bus_get_unique_name (expected);
+
+      if (owner == NULL)
+        {
+          fprintf (stderr, "*** expected owner %s: %s\n", unique,
+                   error.message);
+          die ("name should have an owner");
+        }
+
+      if (strcmp (owner, unique) != 0)
+        {
+          fprintf (stderr, "*** owner is %s, expected %s\n", owner, unique);
+          die ("wrong owner");
+        }
+
+      dbus_free (owner);
+
+      if (!dbus_bus_name_has_owner (connection, WATCHED_NAME, &error))
+        die ("dbus_bus_name_has_owner() should say there is an owner");
+    }
+
+  if (dbus_error_is_set (&error))
+    die (error.message);
+}
+
+/* This test outputs TAP syntax: http://testanything.org/ */
+int
+main (int    argc,
+      char **argv)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusConnection *watcher;
+  DBusConnection *owner;
+
+  watcher = open_connection ();
+  owner = open_connection ();
+
+  /* Our own subscription, so that signals about the name can be queued
+   * before the watch starts */
+  dbus_bus_add_match (watcher,
+                      "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                      "member='NameOwnerChanged',arg0='" WATCHED_NAME "'",
+                      &error);
+  if (dbus_error_is_set (&error) ||
+      !dbus_connection_add_filter (watcher, filter_func, NULL, NULL))
+    die ("unable to subscribe to NameOwnerChanged");
+
+  printf ("ok %d - connected to session bus\n", ++test_num);
+
+  /* Two changes that happen before the watch asks for the owner: their
+   * signals reach us before the GetNameOwner reply, but are dispatched
+   * after it, and must not overwrite the newer answer */
+  request_name (owner);
+  release_name (owner);
+
+  if (!dbus_bus_watch_name_owner (watcher, WATCHED_NAME, &error))
+    die (error.message);
+
+  check_owner (watcher, NULL);
+  dispatch_owner_changes (watcher, 1);
+  check_owner (watcher, NULL);
+  dispatch_owner_changes (watcher, 2);
+  check_owner (watcher, NULL);
+  printf ("ok %d - signals older than GetNameOwner's reply are ignored\n",
+          ++test_num);
+
+  /* While watched, the answer comes from the cache, which changes when
+   * the signal is dispatched and not before */
+  request_name (owner);
+  check_owner (watcher, NULL);
+  dispatch_owner_changes (watcher, 3);
+  check_owner (watcher, owner);
+
+  release_name (owner);
+  check_owner (watcher, owner);
+  dispatch_owner_changes (watcher, 4);
+  check_owner (watcher, NULL);
+  printf ("ok %d - owner changes followed while watched\n", ++test_num);
+
+  /* Watches are counted: the cache stays until the last one is undone */
+  if (!dbus_bus_watch_name_owner (watcher, WATCHED_NAME, &error))
+    die (error.message);
+
+  dbus_bus_unwatch_name_owner (watcher, WATCHED_NAME);
+
+  request_name (owner);
+  check_owner (watcher, NULL);
+  dispatch_owner_changes (watcher, 5);
+  check_owner (watcher, owner);
+  printf ("ok %d - still watched after one of two watches is undone\n",
+          ++test_num);
+
+  /* After the last unwatch, the bus is asked directly, so the change is
+   * seen even though its signal has not been dispatched */
+  dbus_bus_unwatch_name_owner (watcher, WATCHED_NAME);
+
+  release_name (owner);
+  check_owner (watcher, NULL);
+  request_name (owner);
+  check_owner (watcher, owner);
+  printf ("ok %d - no longer cached after the last unwatch\n", ++test_num);
+
+  dbus_connection_close (owner);
+  dbus_connection_unref (owner);
+  dbus_connection_close (watcher);
+  dbus_connection_unref (watcher);
+  dbus_shutdown ();
+
+  printf ("1..%d\n", test_num);
+  return 0;
+}
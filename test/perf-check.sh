@@ -0,0 +1,127 @@
+#!/bin/sh
+
+# Copyright © 2026 D-Bus contributors
+#
+# Permission is hereby granted, free of charge, to any person
+# obtaining a copy of this software and associated documentation files
+# (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge,
+# publish, distribute, sublicense, and/or sell copies of the Software,
+# and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+# BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+# ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+# Performance regression check, run by "make check-perf". It is not part
+# of the normal test suite because its results depend on the machine.
+#
+# Runs the message codec, signal fan-out and ping-pong benchmarks with
+# fixed parameters, and compares each throughput figure with the one
+# recorded in $DBUS_TEST_PERF_BASELINE. A figure more than
+# $DBUS_TEST_PERF_TOLERANCE percent below its baseline is a failure.
+#
+# If the baseline does not exist, or DBUS_TEST_PERF_UPDATE=1, the
+# results are recorded as the new baseline instead. Record it on the
+# same machine and build configuration that will be checked later.
+
+set -e
+
+echo "# dbus-daemon binary: ${DBUS_TEST_DAEMON:=dbus-daemon}"
+echo "# dbus-test-tool binary: ${DBUS_TEST_DBUS_TEST_TOOL:=dbus-test-tool}"
+echo "# benchmarks: ${DBUS_TEST_EXEC:=.}"
+echo "# baseline: ${DBUS_TEST_PERF_BASELINE:=perf-baseline.txt}"
+echo "# tolerance: ${DBUS_TEST_PERF_TOLERANCE:=25}%"
+
+if test -n "$DBUS_TEST_DATA"; then
+    config="--config-file=$DBUS_TEST_DATA/valid-config-files/session.conf"
+elif test -n "$DBUS_TEST_DATADIR"; then
+    config="--config-file=$DBUS_TEST_DATADIR/dbus-1/session.conf"
+else
+    config="--session"
+fi
+
+if ! workdir="$(mktemp -d)"; then
+    echo "1..0 # SKIP - mktemp -d doesn't work"
+    exit 0
+fi
+
+bus_pid=
+cleanup () {
+    if test -n "$bus_pid"; then
+        kill "$bus_pid" || :
+    fi
+    rm -fr "$workdir"
+}
+trap cleanup EXIT
+
+results="$workdir/results"
+
+# One "name value" pair per line, higher is better
+"$DBUS_TEST_EXEC/manual-marshal-bench" --repeat 3 | \
+    awk -F '\t' 'NR > 1 { print "marshal." $1 "." $2 ".mb_per_s", $6 }' \
+    >> "$results"
+
+unset DBUS_SESSION_BUS_ADDRESS
+${DBUS_TEST_DAEMON} --fork --print-address=8 --print-pid=9 "$config" \
+    8>"$workdir/address" 9>"$workdir/pid"
+bus_pid="$(cat "$workdir/pid")"
+DBUS_SESSION_BUS_ADDRESS="$(cat "$workdir/address")"
+export DBUS_SESSION_BUS_ADDRESS
+
+"$DBUS_TEST_EXEC/manual-match-bench" --session --clients=10 --rules=100 \
+    --signals=1000 | \
+    awk -F '\t' 'NR > 1 { print "fanout.deliveries_per_second", $6 }' \
+    >> "$results"
+
+for mode in session peer; do
+    ${DBUS_TEST_DBUS_TEST_TOOL} pingpong --$mode --count=5000 --warmup=500 | \
+        awk -F '[=,]' -v mode=$mode \
+            '/^#\[Mean/ { print "pingpong." mode ".calls_per_second", 1e6 / $2 }' \
+        >> "$results"
+done
+
+if test "$DBUS_TEST_PERF_UPDATE" = 1 || ! test -e "$DBUS_TEST_PERF_BASELINE"; then
+    cp "$results" "$DBUS_TEST_PERF_BASELINE"
+    echo "1..0 # SKIP - recorded new baseline in $DBUS_TEST_PERF_BASELINE"
+    exit 0
+fi
+
+awk -v tolerance="$DBUS_TEST_PERF_TOLERANCE" '
+    NR == FNR {
+        if ($1 !~ /^#/ && NF == 2)
+            baseline[$1] = $2
+        next
+    }
+    {
+        n++
+        if (!($1 in baseline)) {
+            print "ok " n " - " $1 " " $2 " # SKIP - not in baseline"
+        } else if ($2 < baseline[$1] * (100 - tolerance) / 100) {
+            print "not ok " n " - " $1 " " $2 " (baseline " baseline[$1] ")"
+            failed = 1
+        } else {
+            print "ok " n " - " $1 " " $2 " (baseline " baseline[$1] ")"
+        }
+        seen[$1] = 1
+    }
+    END {
+        for (name in baseline) {
+            if (!(name in seen)) {
+                n++
+                print "not ok " n " - " name " was not measured"
+                failed = 1
+            }
+        }
+        print "1.." n
+        exit failed
+    }' "$DBUS_TEST_PERF_BASELINE" "$results"
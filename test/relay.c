@@ -269,6 +269,65 @@ test_limit (Fixture *f,
     }
 }
 
+static void
+test_send_many (Fixture *f,
+    gconstpointer data)
+{
+  DBusMessage **outgoing = g_new0 (DBusMessage *, MANY);
+  dbus_uint32_t *serials = g_new0 (dbus_uint32_t, MANY);
+  DBusMessage *incoming;
+  dbus_bool_t have_mem;
+  guint i;
+
+  test_connect (f, data);
+
+  for (i = 0; i < MANY; i++)
+    {
+      gchar *buf = g_strdup_printf ("Message%u", i);
+
+      outgoing[i] = dbus_message_new_signal ("/com/example/Hello",
+          "com.example.Hello", buf);
+      g_assert (outgoing[i] != NULL);
+      g_free (buf);
+    }
+
+  have_mem = dbus_connection_send_many (f->left_client_conn, outgoing, MANY,
+      serials);
+  g_assert (have_mem);
+
+  for (i = 0; i < MANY; i++)
+    {
+      g_assert_cmpuint (serials[i], !=, 0);
+
+      if (i > 0)
+        g_assert_cmpuint (serials[i], ==, serials[i - 1] + 1);
+
+      dbus_message_unref (outgoing[i]);
+    }
+
+  g_free (outgoing);
+  g_free (serials);
+  i = 0;
+
+  while (i < MANY)
+    {
+      while (g_queue_is_empty (&f->messages))
+        {
+          test_main_context_iterate (f->ctx, TRUE);
+        }
+
+      while ((incoming = g_queue_pop_head (&f->messages)) != NULL)
+        {
+          gchar *buf = g_strdup_printf ("Message%u", i);
+
+          g_assert_cmpstr (dbus_message_get_member (incoming), ==, buf);
+          g_free (buf);
+          i++;
+          dbus_message_unref (incoming);
+        }
+    }
+}
+
 static void
 teardown (Fixture *f,
     gconstpointer data G_GNUC_UNUSED)
@@ -327,6 +386,8 @@ main (int argc,
       test_relay, teardown);
   g_test_add ("/limit", Fixture, NULL, setup,
       test_limit, teardown);
+  g_test_add ("/send-many", Fixture, NULL, setup,
+      test_send_many, teardown);
 
   return g_test_run ();
 }
@@ -182,12 +182,18 @@ const char * const valid_strings[] = {
     "",
     "\xc2\xa9",       /* UTF-8 (c) symbol */
     "\xef\xbf\xbe",   /* U+FFFE is reserved but Corrigendum 9 says it's OK */
+    /* long enough to exercise the word-at-a-time ASCII skip */
+    "com.example.SomeInterface.SomeMember",
+    "com.example.SomeInterface\xc2\xa9SomeMember\xc2\xa9",
     NULL
 };
 
 const char * const invalid_strings[] = {
     "\xa9",           /* Latin-1 (c) symbol */
     "\xed\xa0\x80",   /* UTF-16 surrogates are not valid in UTF-8 */
+    "com.example.SomeInterface\xa9SomeMember",
+    "com.example.SomeInterface.SomeMember\xed\xa0\x80",
+    "com.example.SomeInterface.SomeMember\xc2",
     NULL
 };
 
@@ -10,6 +10,12 @@ static DBusLoop *loop;
 static dbus_bool_t already_quit = FALSE;
 static dbus_bool_t hello_from_self_reply_received = FALSE;
 
+/* Properties of org.freedesktop.TestSuite, for testing DBusPropertyCache */
+static dbus_int32_t answer = 42;
+static char *greeting = NULL;
+static dbus_uint32_t n_get_all_calls = 0;
+static dbus_uint32_t n_get_calls = 0;
+
 static void
 quit (void)
 {
@@ -292,6 +298,203 @@ path_unregistered_func (DBusConnection  *connection,
   /* connection was finalized */
 }
 
+#define TEST_SUITE_INTERFACE "org.freedesktop.TestSuite"
+
+/* Appends the named property as a VARIANT; returns FALSE if there is
+ * no such property */
+static dbus_bool_t
+append_property (DBusMessageIter *iter,
+                 const char      *name)
+{
+  DBusMessageIter variant;
+  dbus_bool_t ok;
+
+  if (strcmp (name, "Answer") == 0)
+    {
+      if (!dbus_message_iter_open_container (iter, DBUS_TYPE_VARIANT,
+                                             DBUS_TYPE_INT32_AS_STRING,
+                                             &variant))
+        die ("No memory");
+
+      ok = dbus_message_iter_append_basic (&variant, DBUS_TYPE_INT32,
+                                           &answer);
+    }
+  else if (strcmp (name, "Greeting") == 0)
+    {
+      const char *s = greeting != NULL ? greeting : "Hello";
+
+      if (!dbus_message_iter_open_container (iter, DBUS_TYPE_VARIANT,
+                                             DBUS_TYPE_STRING_AS_STRING,
+                                             &variant))
+        die ("No memory");
+
+      ok = dbus_message_iter_append_basic (&variant, DBUS_TYPE_STRING, &s);
+    }
+  else
+    {
+      return FALSE;
+    }
+
+  if (!ok || !dbus_message_iter_close_container (iter, &variant))
+    die ("No memory");
+
+  return TRUE;
+}
+
+static void
+append_property_entry (DBusMessageIter *dict,
+                       const char      *name)
+{
+  DBusMessageIter entry;
+
+  if (!dbus_message_iter_open_container (dict, DBUS_TYPE_DICT_ENTRY, NULL,
+                                         &entry) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &name))
+    die ("No memory");
+
+  append_property (&entry, name);
+
+  if (!dbus_message_iter_close_container (dict, &entry))
+    die ("No memory");
+}
+
+/* Emits PropertiesChanged with either the new value of @name or, if
+ * @invalidate, just its name */
+static void
+emit_property_changed (DBusConnection *connection,
+                       const char     *name,
+                       dbus_bool_t     invalidate)
+{
+  DBusMessage *signal;
+  DBusMessageIter iter, dict, invalidated;
+  const char *interface = TEST_SUITE_INTERFACE;
+
+  signal = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                    DBUS_INTERFACE_PROPERTIES,
+                                    "PropertiesChanged");
+  if (signal == NULL)
+    die ("No memory");
+
+  dbus_message_iter_init_append (signal, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &interface) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict))
+    die ("No memory");
+
+  if (!invalidate)
+    append_property_entry (&dict, name);
+
+  if (!dbus_message_iter_close_container (&iter, &dict) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &invalidated))
+    die ("No memory");
+
+  if (invalidate &&
+      !dbus_message_iter_append_basic (&invalidated, DBUS_TYPE_STRING, &name))
+    die ("No memory");
+
+  if (!dbus_message_iter_close_container (&iter, &invalidated) ||
+      !dbus_connection_send (connection, signal, NULL))
+    die ("No memory");
+
+  dbus_message_unref (signal);
+}
+
+static void
+send_reply (DBusConnection *connection,
+            DBusMessage    *reply)
+{
+  if (reply == NULL || !dbus_connection_send (connection, reply, NULL))
+    die ("No memory");
+
+  dbus_message_unref (reply);
+}
+
+/* org.freedesktop.DBus.Properties, for a few properties of
+ * org.freedesktop.TestSuite that the methods below change */
+static DBusHandlerResult
+handle_properties (DBusConnection     *connection,
+                   DBusMessage        *message)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *reply;
+  DBusMessageIter iter, dict;
+  const char *interface;
+  const char *name;
+
+  if (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+                                   "GetAll"))
+    {
+      n_get_all_calls++;
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &interface,
+                                  DBUS_TYPE_INVALID))
+        goto error;
+
+      reply = dbus_message_new_method_return (message);
+      if (reply == NULL)
+        die ("No memory");
+
+      dbus_message_iter_init_append (reply, &iter);
+
+      if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+                                             &dict))
+        die ("No memory");
+
+      if (strcmp (interface, TEST_SUITE_INTERFACE) == 0)
+        {
+          append_property_entry (&dict, "Answer");
+          append_property_entry (&dict, "Greeting");
+        }
+
+      if (!dbus_message_iter_close_container (&iter, &dict))
+        die ("No memory");
+
+      send_reply (connection, reply);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+  else if (dbus_message_is_method_call (message, DBUS_INTERFACE_PROPERTIES,
+                                        "Get"))
+    {
+      n_get_calls++;
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &interface,
+                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_INVALID))
+        goto error;
+
+      reply = dbus_message_new_method_return (message);
+      if (reply == NULL)
+        die ("No memory");
+
+      dbus_message_iter_init_append (reply, &iter);
+
+      if (strcmp (interface, TEST_SUITE_INTERFACE) != 0 ||
+          !append_property (&iter, name))
+        {
+          dbus_message_unref (reply);
+          dbus_set_error (&error, DBUS_ERROR_UNKNOWN_PROPERTY,
+                          "No property %s.%s", interface, name);
+          goto error;
+        }
+
+      send_reply (connection, reply);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+error:
+  send_reply (connection,
+              dbus_message_new_error (message, error.name, error.message));
+  dbus_error_free (&error);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 static DBusHandlerResult
 path_message_func (DBusConnection  *connection,
                    DBusMessage     *message,
@@ -305,6 +508,61 @@ path_message_func (DBusConnection  *connection,
                                         "org.freedesktop.TestSuite",
                                         "DelayEcho"))
     return handle_delay_echo (connection, message);
+  else if (dbus_message_has_interface (message, DBUS_INTERFACE_PROPERTIES))
+    return handle_properties (connection, message);
+  else if (dbus_message_is_method_call (message,
+                                        "org.freedesktop.TestSuite",
+                                        "SetAnswer"))
+    {
+      /* Changes Answer, announcing the new value */
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_INT32, &answer,
+                                  DBUS_TYPE_INVALID))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      emit_property_changed (connection, "Answer", FALSE);
+      send_reply (connection, dbus_message_new_method_return (message));
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+  else if (dbus_message_is_method_call (message,
+                                        "org.freedesktop.TestSuite",
+                                        "SetGreeting"))
+    {
+      /* Changes Greeting, announcing only that it changed */
+      const char *s;
+
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_STRING, &s,
+                                  DBUS_TYPE_INVALID))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      dbus_free (greeting);
+      greeting = _dbus_strdup (s);
+
+      if (greeting == NULL)
+        die ("No memory");
+
+      emit_property_changed (connection, "Greeting", TRUE);
+      send_reply (connection, dbus_message_new_method_return (message));
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+  else if (dbus_message_is_method_call (message,
+                                        "org.freedesktop.TestSuite",
+                                        "GetPropertyCalls"))
+    {
+      /* How many times GetAll and Get were called */
+      DBusMessage *reply = dbus_message_new_method_return (message);
+
+      if (reply == NULL ||
+          !dbus_message_append_args (reply,
+                                     DBUS_TYPE_UINT32, &n_get_all_calls,
+                                     DBUS_TYPE_UINT32, &n_get_calls,
+                                     DBUS_TYPE_INVALID))
+        die ("No memory");
+
+      send_reply (connection, reply);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
   else if (dbus_message_is_method_call (message,
                                         "org.freedesktop.TestSuite",
                                         "Exit"))
@@ -502,6 +760,9 @@ main (int    argc,
 
   _dbus_loop_unref (loop);
   loop = NULL;
+
+  dbus_free (greeting);
+  greeting = NULL;
   
   dbus_shutdown ();
 
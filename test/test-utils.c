@@ -1,6 +1,14 @@
 #include <config.h>
 #include "test-utils.h"
 
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "dbus/dbus-sysdeps.h"
+
 typedef struct
 {
   DBusLoop *loop;
@@ -389,3 +397,118 @@ test_pending_call_store_reply (DBusPendingCall *pc,
   *message_p = dbus_pending_call_steal_reply (pc);
   _dbus_assert (*message_p != NULL);
 }
+
+static const char *program_name = "test";
+static void (*program_cleanup) (void) = NULL;
+
+/*
+ * Sets the name that test_oom() and test_die() put in their messages,
+ * and a function for them to call before exiting, or NULL.
+ */
+void
+test_program_init (const char  *name,
+                   void       (*cleanup) (void))
+{
+  program_name = name;
+  program_cleanup = cleanup;
+}
+
+void
+test_oom (const char *doing)
+{
+  fprintf (stderr, "*** %s: OOM while %s\n", program_name, doing);
+
+  if (program_cleanup != NULL)
+    program_cleanup ();
+
+  exit (1);
+}
+
+void
+test_die (const char *message)
+{
+  fprintf (stderr, "*** %s: %s\n", program_name, message);
+
+  if (program_cleanup != NULL)
+    program_cleanup ();
+
+  exit (1);
+}
+
+dbus_uint64_t
+test_now_usec (void)
+{
+  long sec, usec;
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  return ((dbus_uint64_t) sec) * 1000000 + usec;
+}
+
+/* Returns the CPU time used by process pid so far, or -1 */
+long long
+test_process_cpu_usec (unsigned long pid)
+{
+#ifdef __linux__
+  char path[64];
+  char buf[1024];
+  unsigned long utime, stime;
+  const char *p;
+  FILE *f;
+  size_t len;
+
+  snprintf (path, sizeof (path), "/proc/%lu/stat", pid);
+  f = fopen (path, "r");
+
+  if (f == NULL)
+    return -1;
+
+  len = fread (buf, 1, sizeof (buf) - 1, f);
+  fclose (f);
+  buf[len] = '\0';
+
+  /* the command name may contain spaces, so skip past it */
+  p = strrchr (buf, ')');
+
+  if (p == NULL ||
+      sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+              &utime, &stime) != 2)
+    return -1;
+
+  return (utime + stime) * 1000000LL / sysconf (_SC_CLK_TCK);
+#else
+  return -1;
+#endif
+}
+
+/* Returns the process ID of the bus at the other end of connection, or
+ * 0 if it cannot be found out */
+unsigned long
+test_get_bus_pid (DBusConnection *connection)
+{
+  DBusMessage *call, *reply;
+  const char *name = DBUS_SERVICE_DBUS;
+  dbus_uint32_t pid = 0;
+
+  call = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "GetConnectionUnixProcessID");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    test_oom ("building GetConnectionUnixProcessID call");
+
+  reply = dbus_connection_send_with_reply_and_block (connection, call, -1,
+                                                     NULL);
+  dbus_message_unref (call);
+
+  if (reply == NULL)
+    return 0;
+
+  if (!dbus_message_get_args (reply, NULL, DBUS_TYPE_UINT32, &pid,
+                              DBUS_TYPE_INVALID))
+    pid = 0;
+
+  dbus_message_unref (reply);
+  return pid;
+}
@@ -37,4 +37,14 @@ void        test_server_shutdown                  (TestMainContext *ctx,
 void        test_pending_call_store_reply         (DBusPendingCall *pc,
                                                    void *data);
 
+void        test_program_init                     (const char      *name,
+                                                   void           (*cleanup) (void));
+void        test_oom                              (const char      *doing)
+                                                   _DBUS_GNUC_NORETURN;
+void        test_die                              (const char      *message)
+                                                   _DBUS_GNUC_NORETURN;
+dbus_uint64_t test_now_usec                       (void);
+long long   test_process_cpu_usec                 (unsigned long    pid);
+unsigned long test_get_bus_pid                    (DBusConnection  *connection);
+
 #endif
@@ -0,0 +1,393 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-connect-storm.c - rate at which a bus accepts new connections
+ *
+ * Copyright © 2026 D-Bus contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include <dbus/dbus.h>
+
+#include "test-tool.h"
+#include "tool-common.h"
+
+static void usage (int exit_with) _DBUS_GNUC_NORETURN;
+
+static void
+usage (int exit_with)
+{
+  fprintf (stderr,
+           "Usage: dbus-test-tool connect-storm [OPTIONS]\n"
+           "\n"
+           "Repeatedly connect to a message bus, authenticate, call Hello()\n"
+           "and disconnect, then report how fast that was.\n"
+           "\n"
+           "Options:\n"
+           "\n"
+           "    --session     use the session bus (default)\n"
+           "    --system      use the system bus\n"
+           "    --address=ADDRESS  use the bus at ADDRESS\n"
+           "\n"
+           "    --count=N     connect N times in each worker (default 1000)\n"
+           "    --workers=N   connect from N processes at the same time\n"
+           "                  (default 1)\n"
+           "    --ignore-errors  carry on after failing to connect\n"
+           );
+  exit (exit_with);
+}
+
+/* What one worker did */
+typedef struct
+{
+  dbus_uint64_t start_usec;
+  dbus_uint64_t end_usec;
+  dbus_uint64_t failures;
+  dbus_uint64_t n_latencies;
+} StormResults;
+
+static StormResults results = { 0 };
+/* time from starting to connect until Hello() has returned, in usec */
+static dbus_uint32_t *latencies = NULL;
+static size_t latencies_allocated = 0;
+
+static void
+add_latency (dbus_uint64_t usec)
+{
+  if (results.n_latencies == latencies_allocated)
+    {
+      size_t n = latencies_allocated == 0 ? 1024 : latencies_allocated * 2;
+      dbus_uint32_t *tmp = dbus_realloc (latencies, n * sizeof (*tmp));
+
+      if (tmp == NULL)
+        tool_oom ("recording latency");
+
+      latencies = tmp;
+      latencies_allocated = n;
+    }
+
+  latencies[results.n_latencies++] = (usec > 0xffffffff ? 0xffffffff : usec);
+}
+
+static DBusConnection *
+connect_once (DBusBusType   type,
+              const char   *address,
+              DBusError    *error)
+{
+  DBusConnection *connection;
+
+  if (address == NULL)
+    return dbus_bus_get_private (type, error);
+
+  connection = dbus_connection_open_private (address, error);
+
+  if (connection != NULL && !dbus_bus_register (connection, error))
+    {
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return NULL;
+    }
+
+  return connection;
+}
+
+static void
+storm (DBusBusType  type,
+       const char  *address,
+       int          count,
+       dbus_bool_t  ignore_errors)
+{
+  int i;
+
+  results.start_usec = tool_now_usec ();
+
+  for (i = 0; i < count; i++)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      DBusConnection *connection;
+      dbus_uint64_t start = tool_now_usec ();
+
+      connection = connect_once (type, address, &error);
+
+      if (connection == NULL)
+        {
+          if (!ignore_errors)
+            {
+              fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+                       error.name, error.message);
+              exit (1);
+            }
+
+          dbus_error_free (&error);
+          results.failures++;
+          continue;
+        }
+
+      add_latency (tool_now_usec () - start);
+      /* don't let the process exit when the connection is closed */
+      dbus_connection_set_exit_on_disconnect (connection, FALSE);
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+    }
+
+  results.end_usec = tool_now_usec ();
+}
+
+/* One "key value" pair per line, as for dbus-test-tool spam --report */
+static void
+print_report (int n_workers)
+{
+  double seconds = (results.end_usec - results.start_usec) / 1e6;
+
+  if (seconds <= 0)
+    seconds = 1e-6;
+
+  qsort (latencies, results.n_latencies, sizeof (*latencies),
+         tool_compare_latencies);
+
+  printf ("workers %d\n", n_workers);
+  printf ("connections %lu\n", (unsigned long) results.n_latencies);
+  printf ("failures %lu\n", (unsigned long) results.failures);
+  printf ("seconds %.3f\n", seconds);
+  printf ("connections_per_second %.1f\n", results.n_latencies / seconds);
+  printf ("setup_p50_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.5));
+  printf ("setup_p99_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.99));
+  printf ("setup_p999_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.999));
+  printf ("setup_max_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 1.0));
+}
+
+#ifdef DBUS_UNIX
+static dbus_bool_t
+read_all (int     fd,
+          void   *buf,
+          size_t  len)
+{
+  char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Runs storm() in n_workers processes at the same time and merges
+ * their results, which they send back through pipes.
+ */
+static int
+run_workers (DBusBusType  type,
+             const char  *address,
+             int          count,
+             dbus_bool_t  ignore_errors,
+             int          n_workers)
+{
+  int *fds;
+  int ret = 0;
+  int i;
+
+  fds = dbus_new0 (int, n_workers);
+
+  if (fds == NULL)
+    tool_oom ("allocating workers");
+
+  fflush (stdout);
+  fflush (stderr);
+
+  for (i = 0; i < n_workers; i++)
+    {
+      int pipe_fds[2];
+      pid_t pid;
+
+      if (pipe (pipe_fds) < 0)
+        {
+          perror ("dbus-test-tool connect-storm: pipe");
+          exit (1);
+        }
+
+      pid = fork ();
+
+      if (pid < 0)
+        {
+          perror ("dbus-test-tool connect-storm: fork");
+          exit (1);
+        }
+
+      if (pid == 0)
+        {
+          close (pipe_fds[0]);
+          storm (type, address, count, ignore_errors);
+
+          if (!tool_write_all (pipe_fds[1], &results, sizeof (results)) ||
+              !tool_write_all (pipe_fds[1], latencies,
+                               results.n_latencies * sizeof (*latencies)))
+            _exit (1);
+
+          _exit (0);
+        }
+
+      close (pipe_fds[1]);
+      fds[i] = pipe_fds[0];
+    }
+
+  for (i = 0; i < n_workers; i++)
+    {
+      StormResults child;
+      dbus_uint64_t j;
+
+      if (!read_all (fds[i], &child, sizeof (child)))
+        {
+          fprintf (stderr, "Worker %d did not report its results\n", i);
+          ret = 1;
+          close (fds[i]);
+          continue;
+        }
+
+      if (i == 0 || child.start_usec < results.start_usec)
+        results.start_usec = child.start_usec;
+
+      if (child.end_usec > results.end_usec)
+        results.end_usec = child.end_usec;
+
+      results.failures += child.failures;
+
+      for (j = 0; j < child.n_latencies; j++)
+        {
+          dbus_uint32_t latency;
+
+          if (!read_all (fds[i], &latency, sizeof (latency)))
+            {
+              ret = 1;
+              break;
+            }
+
+          add_latency (latency);
+        }
+
+      close (fds[i]);
+    }
+
+  for (i = 0; i < n_workers; i++)
+    {
+      int status;
+
+      if (wait (&status) < 0 || !WIFEXITED (status) ||
+          WEXITSTATUS (status) != 0)
+        ret = 1;
+    }
+
+  dbus_free (fds);
+  return ret;
+}
+#endif
+
+int
+dbus_test_tool_connect_storm (int argc, char **argv)
+{
+  DBusBusType type = DBUS_BUS_SESSION;
+  const char *address = NULL;
+  dbus_bool_t ignore_errors = FALSE;
+  int count = 1000;
+  int n_workers = 1;
+  int ret = 0;
+  int i;
+
+  /* argv[1] is the tool name, so start from 2 */
+
+  for (i = 2; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+          type = DBUS_BUS_SYSTEM;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+          type = DBUS_BUS_SESSION;
+        }
+      else if (strstr (arg, "--address=") == arg)
+        {
+          address = arg + strlen ("--address=");
+        }
+      else if (strstr (arg, "--count=") == arg)
+        {
+          count = atoi (arg + strlen ("--count="));
+
+          if (count < 1)
+            usage (2);
+        }
+      else if (strstr (arg, "--workers=") == arg)
+        {
+          n_workers = atoi (arg + strlen ("--workers="));
+
+          if (n_workers < 1)
+            usage (2);
+        }
+      else if (strcmp (arg, "--ignore-errors") == 0)
+        {
+          ignore_errors = TRUE;
+        }
+      else
+        {
+          usage (2);
+        }
+    }
+
+  if (n_workers > 1)
+    {
+#ifdef DBUS_UNIX
+      ret = run_workers (type, address, count, ignore_errors, n_workers);
+#else
+      fprintf (stderr, "--workers is not supported on this platform\n");
+      return 1;
+#endif
+    }
+  else
+    {
+      storm (type, address, count, ignore_errors);
+    }
+
+  print_report (n_workers);
+  dbus_free (latencies);
+  dbus_shutdown ();
+  return ret;
+}
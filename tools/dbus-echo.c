@@ -29,6 +29,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef DBUS_UNIX
+#include <sys/wait.h>
+#endif
 
 #include <dbus/dbus.h>
 
@@ -56,6 +59,9 @@ usage_echo (int exit_with)
            "\n"
            "    --sleep-ms=N  sleep N milliseconds before sending each reply\n"
            "\n"
+           "    --receivers=M reply from M processes, which claim NAME0\n"
+           "                  to NAME<M-1> if --name is given (default 1)\n"
+           "\n"
            "    --session     use the session bus (default)\n"
            "    --system      use the system bus\n"
            );
@@ -151,6 +157,74 @@ init_connection (DBusBusType type, const char *name)
   return connection;
 }
 
+#ifdef DBUS_UNIX
+/*
+ * Forks n_receivers processes, each of which replies to method calls on
+ * its own connection, and waits for them all to exit.
+ */
+static int
+run_receivers (DBusBusType  type,
+               const char  *name,
+               int          n_receivers)
+{
+  int ret = 0;
+  int i;
+
+  fflush (stdout);
+  fflush (stderr);
+
+  for (i = 0; i < n_receivers; i++)
+    {
+      pid_t pid = fork ();
+
+      if (pid < 0)
+        {
+          perror ("dbus-test-tool echo: fork");
+          exit (1);
+        }
+
+      if (pid == 0)
+        {
+          DBusConnection *connection;
+          char *instance_name = NULL;
+
+          if (name != NULL)
+            {
+              size_t len = strlen (name) + 16;
+
+              instance_name = dbus_malloc (len);
+
+              if (instance_name == NULL)
+                tool_oom ("allocating name");
+
+              snprintf (instance_name, len, "%s%d", name, i);
+            }
+
+          connection = init_connection (type, instance_name);
+          fflush (stdout);
+
+          while (dbus_connection_read_write_dispatch (connection, -1))
+            {}
+
+          dbus_connection_unref (connection);
+          dbus_free (instance_name);
+          _exit (0);
+        }
+    }
+
+  for (i = 0; i < n_receivers; i++)
+    {
+      int status;
+
+      if (wait (&status) < 0 || !WIFEXITED (status) ||
+          WEXITSTATUS (status) != 0)
+        ret = 1;
+    }
+
+  return ret;
+}
+#endif
+
 int
 dbus_test_tool_echo (int argc, char **argv)
 {
@@ -158,6 +232,7 @@ dbus_test_tool_echo (int argc, char **argv)
   DBusBusType type = DBUS_BUS_SESSION;
   int i;
   const char *name = NULL;
+  int n_receivers = 1;
 
   /* argv[1] is the tool name, so start from 2 */
 
@@ -181,12 +256,29 @@ dbus_test_tool_echo (int argc, char **argv)
         {
           sleep_ms = atoi (arg + strlen ("--sleep-ms="));
         }
+      else if (strstr (arg, "--receivers=") == arg)
+        {
+          n_receivers = atoi (arg + strlen ("--receivers="));
+
+          if (n_receivers < 1)
+            usage_echo (2);
+        }
       else
         {
           usage_echo (2);
         }
     }
 
+  if (n_receivers > 1)
+    {
+#ifdef DBUS_UNIX
+      return run_receivers (type, name, n_receivers);
+#else
+      fprintf (stderr, "--receivers is not supported on this platform\n");
+      return 1;
+#endif
+    }
+
   connection = init_connection (type, name);
 
   while (dbus_connection_read_write_dispatch (connection, -1))
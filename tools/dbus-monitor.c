@@ -22,6 +22,9 @@
 #include <config.h>
 
 #include "dbus/dbus-internals.h"
+#include "dbus/dbus-hash.h"
+#include "dbus/dbus-message-internal.h"
+#include "dbus/dbus-string.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,7 +34,12 @@
 #include <winsock2.h>
 #undef interface
 #else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
 #include <time.h>
@@ -48,6 +56,31 @@
 /* http://www.tcpdump.org/linktypes.html */
 #define LINKTYPE_DBUS 231
 
+/* We're not using libpcap because the file format is simple
+ * enough not to need it.
+ * http://wiki.wireshark.org/Development/LibpcapFileFormat */
+typedef struct {
+    dbus_uint32_t magic;
+    dbus_uint16_t major_version;
+    dbus_uint16_t minor_version;
+    dbus_int32_t timezone;
+    dbus_uint32_t precision;
+    dbus_uint32_t max_length;
+    dbus_uint32_t link_type;
+} PcapFileHeader;
+
+static const PcapFileHeader pcap_file_header = {
+    0xA1B2C3D4U,  /* magic number */
+    2, 4,         /* v2.4 */
+    0,            /* capture in GMT */
+    0,            /* no opinion on timestamp precision */
+    (1 << 27),    /* D-Bus spec says so */
+    LINKTYPE_DBUS
+};
+
+/* Assert that there is no padding */
+_DBUS_STATIC_ASSERT (sizeof (PcapFileHeader) == 24);
+
 static DBusHandlerResult
 monitor_filter_func (DBusConnection     *connection,
                      DBusMessage        *message,
@@ -193,6 +226,380 @@ profile_filter_func (DBusConnection     *connection,
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* Seconds between latency summaries */
+#define LATENCY_SUMMARY_INTERVAL 10
+/* Calls still unanswered after this many seconds are forgotten */
+#define LATENCY_PENDING_TIMEOUT 120
+/* Round-trip times kept per member per summary, for the percentiles */
+#define LATENCY_MAX_SAMPLES 100000
+
+/* A method call that we expect to see a reply to */
+typedef struct
+{
+  long sec;
+  long usec;
+  char *interface;
+  char *member;
+} LatencyCall;
+
+/* Replies seen for one interface and member since the last summary */
+typedef struct
+{
+  char *interface;
+  char *member;
+  unsigned long calls;
+  unsigned long errors;
+  long *samples;
+  int n_samples;
+  int n_allocated;
+} LatencyMember;
+
+/* "caller serial" => LatencyCall */
+static DBusHashTable *latency_calls = NULL;
+/* "interface.member" => LatencyMember */
+static DBusHashTable *latency_members = NULL;
+static long latency_last_summary = 0;
+
+static char *
+latency_strdup (const char *str)
+{
+  char *copy;
+
+  if (str == NULL)
+    return NULL;
+
+  copy = strdup (str);
+
+  if (copy == NULL)
+    tool_oom ("copying a name");
+
+  return copy;
+}
+
+static char *
+latency_call_key (const char    *caller,
+                  dbus_uint32_t  serial)
+{
+  size_t len = strlen (caller) + 12;
+  char *key = malloc (len);
+
+  if (key == NULL)
+    tool_oom ("adding a call");
+
+  snprintf (key, len, "%s %u", caller, serial);
+  return key;
+}
+
+static void
+latency_call_free (void *data)
+{
+  LatencyCall *call = data;
+
+  /* the hash table frees the NULL value of a new entry */
+  if (call == NULL)
+    return;
+
+  free (call->interface);
+  free (call->member);
+  free (call);
+}
+
+static void
+latency_member_free (void *data)
+{
+  LatencyMember *member = data;
+
+  /* the hash table frees the NULL value of a new entry */
+  if (member == NULL)
+    return;
+
+  free (member->interface);
+  free (member->member);
+  free (member->samples);
+  free (member);
+}
+
+static void
+latency_init (void)
+{
+  long usec;
+
+  latency_calls = _dbus_hash_table_new (DBUS_HASH_STRING, free,
+                                        latency_call_free);
+  latency_members = _dbus_hash_table_new (DBUS_HASH_STRING, free,
+                                          latency_member_free);
+
+  if (latency_calls == NULL || latency_members == NULL)
+    tool_oom ("creating latency tables");
+
+  _dbus_get_monotonic_time (&latency_last_summary, &usec);
+}
+
+static void
+latency_record (LatencyCall *call,
+                long         rtt,
+                dbus_bool_t  is_error)
+{
+  LatencyMember *member;
+  size_t len;
+  char *key;
+
+  len = strlen (TRAP_NULL_STRING (call->interface)) +
+    strlen (TRAP_NULL_STRING (call->member)) + 2;
+  key = malloc (len);
+
+  if (key == NULL)
+    tool_oom ("adding a member");
+
+  snprintf (key, len, "%s.%s", TRAP_NULL_STRING (call->interface),
+            TRAP_NULL_STRING (call->member));
+
+  member = _dbus_hash_table_lookup_string (latency_members, key);
+
+  if (member != NULL)
+    {
+      free (key);
+    }
+  else
+    {
+      member = calloc (1, sizeof (LatencyMember));
+
+      if (member == NULL)
+        tool_oom ("adding a member");
+
+      member->interface = latency_strdup (call->interface);
+      member->member = latency_strdup (call->member);
+
+      if (!_dbus_hash_table_insert_string (latency_members, key, member))
+        tool_oom ("adding a member");
+    }
+
+  member->calls++;
+
+  if (is_error)
+    member->errors++;
+
+  if (member->n_samples == LATENCY_MAX_SAMPLES)
+    return;
+
+  if (member->n_samples == member->n_allocated)
+    {
+      int n = member->n_allocated == 0 ? 16 : member->n_allocated * 2;
+      long *samples = realloc (member->samples, n * sizeof (long));
+
+      if (samples == NULL)
+        tool_oom ("adding a sample");
+
+      member->samples = samples;
+      member->n_allocated = n;
+    }
+
+  member->samples[member->n_samples++] = rtt;
+}
+
+static int
+compare_samples (const void *a,
+                 const void *b)
+{
+  long x = *(const long *) a;
+  long y = *(const long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static long
+latency_percentile (const LatencyMember *member,
+                    int                  percent)
+{
+  int rank = (member->n_samples * percent + 99) / 100;
+
+  return member->samples[rank > 0 ? rank - 1 : 0];
+}
+
+/* Member names are restricted to ASCII letters, digits, '_' and '.',
+ * so they never need escaping in JSON. */
+static void
+latency_print_json_name (const char *key,
+                         const char *name)
+{
+  if (name == NULL)
+    printf ("\"%s\":null", key);
+  else
+    printf ("\"%s\":\"%s\"", key, name);
+}
+
+/* Print one line of JSON summarizing the replies since the last
+ * summary, then start again; also forget calls that were never
+ * answered. */
+static void
+latency_print_summary (long now)
+{
+  DBusHashIter iter;
+  long sec, usec;
+  dbus_bool_t first = TRUE;
+
+  _dbus_get_real_time (&sec, &usec);
+  printf ("{\"timestamp\":%ld.%06ld,\"interval\":%ld,\"pending\":%d,"
+          "\"members\":[",
+          sec, usec, now - latency_last_summary,
+          _dbus_hash_table_get_n_entries (latency_calls));
+
+  _dbus_hash_iter_init (latency_members, &iter);
+
+  while (_dbus_hash_iter_next (&iter))
+    {
+      LatencyMember *member = _dbus_hash_iter_get_value (&iter);
+
+      qsort (member->samples, member->n_samples, sizeof (long),
+             compare_samples);
+
+      printf ("%s{", first ? "" : ",");
+      latency_print_json_name ("interface", member->interface);
+      printf (",");
+      latency_print_json_name ("member", member->member);
+      printf (",\"calls\":%lu,\"errors\":%lu,\"p50_usec\":%ld,"
+              "\"p90_usec\":%ld,\"p99_usec\":%ld,\"max_usec\":%ld}",
+              member->calls, member->errors,
+              latency_percentile (member, 50),
+              latency_percentile (member, 90),
+              latency_percentile (member, 99),
+              member->samples[member->n_samples - 1]);
+      first = FALSE;
+    }
+
+  printf ("]}\n");
+
+  _dbus_hash_table_remove_all (latency_members);
+
+  _dbus_hash_iter_init (latency_calls, &iter);
+
+  while (_dbus_hash_iter_next (&iter))
+    {
+      LatencyCall *call = _dbus_hash_iter_get_value (&iter);
+
+      if (now - call->sec > LATENCY_PENDING_TIMEOUT)
+        _dbus_hash_iter_remove_entry (&iter);
+    }
+
+  latency_last_summary = now;
+}
+
+static void
+latency_maybe_print_summary (void)
+{
+  long sec, usec;
+
+  _dbus_get_monotonic_time (&sec, &usec);
+
+  if (sec - latency_last_summary >= LATENCY_SUMMARY_INTERVAL)
+    latency_print_summary (sec);
+}
+
+static void
+print_message_latency (DBusMessage *message)
+{
+  static dbus_bool_t first = TRUE;
+  LatencyCall *call;
+  const char *caller;
+  char *key;
+  long sec, usec, real_sec, real_usec, rtt;
+
+  if (first)
+    {
+      printf ("#type\ttimestamp\tcaller\tserial\tcallee\tinterface\tmember\trtt_usec\n");
+      first = FALSE;
+    }
+
+  _dbus_get_monotonic_time (&sec, &usec);
+
+  switch (dbus_message_get_type (message))
+    {
+      case DBUS_MESSAGE_TYPE_METHOD_CALL:
+        caller = dbus_message_get_sender (message);
+
+        if (caller == NULL || dbus_message_get_no_reply (message))
+          break;
+
+        call = malloc (sizeof (LatencyCall));
+
+        if (call == NULL)
+          tool_oom ("adding a call");
+
+        call->sec = sec;
+        call->usec = usec;
+        call->interface = latency_strdup (dbus_message_get_interface (message));
+        call->member = latency_strdup (dbus_message_get_member (message));
+
+        key = latency_call_key (caller, dbus_message_get_serial (message));
+
+        if (!_dbus_hash_table_insert_string (latency_calls, key, call))
+          tool_oom ("adding a call");
+
+        break;
+
+      case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      case DBUS_MESSAGE_TYPE_ERROR:
+        /* the reply goes back to whoever sent the call */
+        caller = dbus_message_get_destination (message);
+
+        if (caller == NULL)
+          break;
+
+        key = latency_call_key (caller,
+                                dbus_message_get_reply_serial (message));
+        call = _dbus_hash_table_lookup_string (latency_calls, key);
+
+        if (call != NULL)
+          {
+            dbus_bool_t is_error =
+              dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR;
+
+            rtt = (sec - call->sec) * 1000000 + (usec - call->usec);
+            _dbus_get_real_time (&real_sec, &real_usec);
+
+            printf ("%s\t%ld.%06ld\t%s\t%u\t%s\t%s\t%s\t%ld\n",
+                    is_error ? "err" : "mr", real_sec, real_usec, caller,
+                    dbus_message_get_reply_serial (message),
+                    TRAP_NULL_STRING (dbus_message_get_sender (message)),
+                    TRAP_NULL_STRING (call->interface),
+                    TRAP_NULL_STRING (call->member), rtt);
+
+            latency_record (call, rtt, is_error);
+            _dbus_hash_table_remove_string (latency_calls, key);
+          }
+
+        free (key);
+        break;
+
+      default:
+        break;
+    }
+
+  latency_maybe_print_summary ();
+}
+
+static DBusHandlerResult
+latency_filter_func (DBusConnection     *connection,
+                     DBusMessage        *message,
+                     void               *user_data)
+{
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    {
+      long sec, usec;
+
+      _dbus_get_monotonic_time (&sec, &usec);
+      latency_print_summary (sec);
+      exit (0);
+    }
+
+  print_message_latency (message);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 typedef enum {
     BINARY_MODE_NOT,
     BINARY_MODE_RAW,
@@ -266,12 +673,166 @@ binary_filter_func (DBusConnection *connection,
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+#ifdef DBUS_UNIX
+
+/* A flight recorder: pcap records go straight into a preallocated,
+ * memory-mapped file, so capturing costs no allocation and no system
+ * call per message. When the file is full it is renamed to FILE.1
+ * (and FILE.1 to FILE.2, and so on, up to the number of files) and a
+ * new one is started, so the disk space used stays bounded.
+ */
+static struct {
+    const char *path;
+    int fd;
+    char *map;
+    size_t size;
+    /* not size_t, so that the signal handler reads it in one go */
+    volatile long used;
+    int n_files;
+} ring = { NULL, -1, NULL, 64 * 1024 * 1024, 0, 4 };
+
+static void
+ring_die (const char *doing)
+{
+  fprintf (stderr, "dbus-monitor: %s \"%s\": %s\n", doing, ring.path,
+           strerror (errno));
+  exit (1);
+}
+
+static void
+ring_open (void)
+{
+  ring.fd = open (ring.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (ring.fd < 0)
+    ring_die ("unable to open");
+
+  if (ftruncate (ring.fd, ring.size) < 0)
+    ring_die ("unable to allocate");
+
+  ring.map = mmap (NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ring.fd, 0);
+
+  if (ring.map == MAP_FAILED)
+    ring_die ("unable to map");
+
+  memcpy (ring.map, &pcap_file_header, sizeof (pcap_file_header));
+  ring.used = sizeof (pcap_file_header);
+}
+
+/* Trims the unused end, so that the file is a complete pcap file */
+static void
+ring_close (void)
+{
+  munmap (ring.map, ring.size);
+
+  if (ftruncate (ring.fd, ring.used) < 0)
+    ring_die ("unable to truncate");
+
+  close (ring.fd);
+  ring.fd = -1;
+}
+
+static void
+ring_rotate (void)
+{
+  int i;
+
+  ring_close ();
+
+  for (i = ring.n_files - 1; i > 0; i--)
+    {
+      char from[4096], to[4096];
+
+      if (i == 1)
+        snprintf (from, sizeof (from), "%s", ring.path);
+      else
+        snprintf (from, sizeof (from), "%s.%d", ring.path, i - 1);
+
+      snprintf (to, sizeof (to), "%s.%d", ring.path, i);
+
+      if (rename (from, to) < 0 && errno != ENOENT)
+        ring_die ("unable to rotate");
+    }
+
+  ring_open ();
+}
+
+static void
+ring_handle_signal (int sig)
+{
+  /* Both are async-signal-safe */
+  if (ring.fd >= 0)
+    ftruncate (ring.fd, ring.used);
+
+  _exit (0);
+}
+
+static DBusHandlerResult
+ring_filter_func (DBusConnection *connection,
+                  DBusMessage    *message,
+                  void           *user_data)
+{
+  const DBusString *header, *body;
+  dbus_uint32_t record[4];
+  long tv_sec, tv_usec;
+  size_t header_len, body_len, len, captured;
+  char *p;
+
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header, &body);
+  header_len = _dbus_string_get_length (header);
+  body_len = _dbus_string_get_length (body);
+  len = header_len + body_len;
+
+  /* A message too large for a whole file is truncated, as a snap
+   * length would */
+  captured = MIN (len,
+                  ring.size - sizeof (pcap_file_header) - sizeof (record));
+
+  if (ring.used + sizeof (record) + captured > ring.size)
+    ring_rotate ();
+
+  _dbus_get_real_time (&tv_sec, &tv_usec);
+  /* seconds, microseconds, bytes captured, original length */
+  record[0] = tv_sec;
+  record[1] = tv_usec;
+  record[2] = captured;
+  record[3] = len;
+
+  p = ring.map + ring.used;
+  memcpy (p, record, sizeof (record));
+  p += sizeof (record);
+  memcpy (p, _dbus_string_get_const_data (header), MIN (header_len, captured));
+
+  if (captured > header_len)
+    memcpy (p + header_len, _dbus_string_get_const_data (body),
+            captured - header_len);
+
+  ring.used += sizeof (record) + captured;
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    {
+      ring_close ();
+      exit (0);
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+#endif /* DBUS_UNIX */
+
 static void usage (char *name, int ecode) _DBUS_GNUC_NORETURN;
 
 static void
 usage (char *name, int ecode)
 {
-  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap | --binary ] [watch expressions]\n", name);
+  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --latency | --pcap | --binary ] [--headers-only] [--sample N] [--lossy] [watch expressions]\n", name);
+#ifdef DBUS_UNIX
+  fprintf (stderr, "       %s [--system | --session | --address ADDRESS] --ring FILE [--ring-size MIB] [--ring-files N] [--headers-only] [--sample N] [--lossy] [watch expressions]\n", name);
+#endif
   exit (ecode);
 }
 
@@ -293,13 +854,13 @@ only_one_type (dbus_bool_t *seen_bus_type,
 static dbus_bool_t
 become_monitor (DBusConnection *connection,
     int numFilters,
-    const char * const *filters)
+    const char * const *filters,
+    dbus_uint32_t flags)
 {
   DBusError error = DBUS_ERROR_INIT;
   DBusMessage *m;
   DBusMessage *r;
   int i;
-  dbus_uint32_t zero = 0;
   DBusMessageIter appender, array_appender;
 
   m = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
@@ -322,7 +883,7 @@ become_monitor (DBusConnection *connection,
     }
 
   if (!dbus_message_iter_close_container (&appender, &array_appender) ||
-      !dbus_message_iter_append_basic (&appender, DBUS_TYPE_UINT32, &zero))
+      !dbus_message_iter_append_basic (&appender, DBUS_TYPE_UINT32, &flags))
     tool_oom ("finishing arguments");
 
   r = dbus_connection_send_with_reply_and_block (connection, m, -1, &error);
@@ -362,6 +923,7 @@ main (int argc, char *argv[])
   BinaryMode binary_mode = BINARY_MODE_NOT;
   int i = 0, j = 0, numFilters = 0;
   char **filters = NULL;
+  dbus_uint32_t monitor_flags = 0;
 
   /* Set stdout to be unbuffered; this is basically so that if people
    * do dbus-monitor > file, then send SIGINT via Control-C, they
@@ -412,6 +974,11 @@ main (int argc, char *argv[])
           filter_func = profile_filter_func;
           binary_mode = BINARY_MODE_NOT;
         }
+      else if (!strcmp (arg, "--latency"))
+        {
+          filter_func = latency_filter_func;
+          binary_mode = BINARY_MODE_NOT;
+        }
       else if (!strcmp (arg, "--binary"))
         {
           filter_func = binary_filter_func;
@@ -422,6 +989,59 @@ main (int argc, char *argv[])
           filter_func = binary_filter_func;
           binary_mode = BINARY_MODE_PCAP;
         }
+#ifdef DBUS_UNIX
+      else if (!strcmp (arg, "--ring"))
+        {
+          if (i+1 >= argc)
+            usage (argv[0], 1);
+
+          filter_func = ring_filter_func;
+          binary_mode = BINARY_MODE_NOT;
+          ring.path = argv[i+1];
+          i++;
+        }
+      else if (!strcmp (arg, "--ring-size") || !strcmp (arg, "--ring-files"))
+        {
+          char *end;
+          unsigned long n;
+
+          if (i+1 >= argc)
+            usage (argv[0], 1);
+
+          n = strtoul (argv[i+1], &end, 10);
+
+          if (*argv[i+1] == '\0' || *end != '\0' || n < 1 || n > 1024)
+            usage (argv[0], 1);
+
+          if (arg[7] == 's')
+            ring.size = n * 1024 * 1024;
+          else
+            ring.n_files = n;
+
+          i++;
+        }
+#endif
+      else if (!strcmp (arg, "--headers-only"))
+        monitor_flags |= DBUS_MONITOR_FLAG_HEADERS_ONLY;
+      else if (!strcmp (arg, "--lossy"))
+        monitor_flags |= DBUS_MONITOR_FLAG_LOSSY;
+      else if (!strcmp (arg, "--sample"))
+        {
+          char *end;
+          unsigned long n;
+
+          if (i+1 >= argc)
+            usage (argv[0], 1);
+
+          n = strtoul (argv[i+1], &end, 10);
+
+          if (*argv[i+1] == '\0' || *end != '\0' || n < 1 || n > 0xffff)
+            usage (argv[0], 1);
+
+          monitor_flags &= ~(0xffffU << DBUS_MONITOR_SAMPLE_SHIFT);
+          monitor_flags |= (dbus_uint32_t) n << DBUS_MONITOR_SAMPLE_SHIFT;
+          i++;
+        }
       else if (!strcmp (arg, "--"))
         continue;
       else if (arg[0] == '-')
@@ -445,6 +1065,19 @@ main (int argc, char *argv[])
       }
     }
 
+  if (filter_func == latency_filter_func)
+    latency_init ();
+
+#ifdef DBUS_UNIX
+  if (filter_func == ring_filter_func)
+    {
+      ring_open ();
+      signal (SIGINT, ring_handle_signal);
+      signal (SIGTERM, ring_handle_signal);
+      signal (SIGHUP, ring_handle_signal);
+    }
+#endif
+
   dbus_error_init (&error);
   
   if (address != NULL)
@@ -504,7 +1137,7 @@ main (int argc, char *argv[])
     }
 
   if (become_monitor (connection, numFilters,
-                      (const char * const *) filters))
+                      (const char * const *) filters, monitor_flags))
     {
       /* no more preparation needed */
     }
@@ -560,41 +1193,26 @@ main (int argc, char *argv[])
         break;
 
       case BINARY_MODE_PCAP:
+        if (!tool_write_all (STDOUT_FILENO, &pcap_file_header,
+                             sizeof (pcap_file_header)))
           {
-            /* We're not using libpcap because the file format is simple
-             * enough not to need it.
-             * http://wiki.wireshark.org/Development/LibpcapFileFormat */
-            struct {
-                dbus_uint32_t magic;
-                dbus_uint16_t major_version;
-                dbus_uint16_t minor_version;
-                dbus_int32_t timezone;
-                dbus_uint32_t precision;
-                dbus_uint32_t max_length;
-                dbus_uint32_t link_type;
-            } header = {
-                0xA1B2C3D4U,  /* magic number */
-                2, 4,         /* v2.4 */
-                0,            /* capture in GMT */
-                0,            /* no opinion on timestamp precision */
-                (1 << 27),    /* D-Bus spec says so */
-                LINKTYPE_DBUS
-            };
-
-            /* Assert that there is no padding */
-            _DBUS_STATIC_ASSERT (sizeof (header) == 24);
-
-            if (!tool_write_all (STDOUT_FILENO, &header, sizeof (header)))
-              {
-                perror ("dbus-monitor: write");
-                exit (1);
-              }
+            perror ("dbus-monitor: write");
+            exit (1);
           }
         break;
     }
 
-  while (dbus_connection_read_write_dispatch(connection, -1))
-    ;
+  if (filter_func == latency_filter_func)
+    {
+      /* wake up regularly so that summaries appear on a quiet bus */
+      while (dbus_connection_read_write_dispatch (connection, 1000))
+        latency_maybe_print_summary ();
+    }
+  else
+    {
+      while (dbus_connection_read_write_dispatch(connection, -1))
+        ;
+    }
   exit (0);
  lose:
   fprintf (stderr, "Error: %s\n", error.message);
@@ -0,0 +1,612 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-pingpong.c - round-trip latency of one method call at a time
+ *
+ * Copyright © 2026 D-Bus contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <dbus/dbus.h>
+
+#include "test-tool.h"
+#include "tool-common.h"
+
+static void usage (int exit_with) _DBUS_GNUC_NORETURN;
+
+static void
+usage (int exit_with)
+{
+  fprintf (stderr,
+           "Usage: dbus-test-tool pingpong [OPTIONS]\n"
+           "\n"
+           "Make one method call at a time and print a histogram of\n"
+           "round-trip times in microseconds.\n"
+           "\n"
+           "Options:\n"
+           "\n"
+           "    --session     go through the session bus (default)\n"
+           "    --system      go through the system bus\n"
+           "    --dest=NAME   call NAME, for example dbus-test-tool echo,\n"
+           "                  instead of a responder started by this tool\n"
+           "\n"
+           "    --peer        call a responder connected directly to a\n"
+           "                  DBusServer in this tool, without a bus\n"
+           "    --listen=ADDRESS  listen on ADDRESS with --peer\n"
+           "                  (default unix:tmpdir=/tmp)\n"
+           "\n"
+           "    --count=N     measure N calls (default 10000)\n"
+           "    --warmup=N    make N calls first, unmeasured (default 1000)\n"
+           "    --payload-size=N  send N bytes with each call (default 0)\n"
+           "\n"
+           "    --cpu=N       run the caller on CPU N\n"
+           "    --responder-cpu=N  run the responder on CPU N\n"
+           );
+  exit (exit_with);
+}
+
+#ifdef DBUS_UNIX
+static void
+pin_to_cpu (int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+
+  if (cpu < 0)
+    return;
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+
+  if (sched_setaffinity (0, sizeof (set), &set) < 0)
+    {
+      perror ("dbus-test-tool pingpong: sched_setaffinity");
+      exit (1);
+    }
+#else
+  if (cpu >= 0)
+    {
+      fprintf (stderr, "--cpu and --responder-cpu are not supported on "
+                       "this platform\n");
+      exit (1);
+    }
+#endif
+}
+
+static DBusHandlerResult
+reply_filter (DBusConnection *connection,
+              DBusMessage    *message,
+              void           *user_data)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    tool_oom ("allocating reply");
+
+  if (!dbus_connection_send (connection, reply, NULL))
+    tool_oom ("sending reply");
+
+  dbus_message_unref (reply);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Replies to method calls on connection until it is disconnected */
+static void _DBUS_GNUC_NORETURN
+respond (DBusConnection *connection,
+         int             cpu)
+{
+  pin_to_cpu (cpu);
+
+  if (!dbus_connection_add_filter (connection, reply_filter, NULL, NULL))
+    tool_oom ("adding message filter");
+
+  while (dbus_connection_read_write_dispatch (connection, -1))
+    {}
+
+  _exit (0);
+}
+
+/* Minimal main loop for accepting one connection on a DBusServer */
+
+#define MAX_SERVER_WATCHES 8
+
+static DBusWatch *server_watches[MAX_SERVER_WATCHES];
+static int n_server_watches = 0;
+static DBusConnection *accepted = NULL;
+
+static dbus_bool_t
+add_server_watch (DBusWatch *watch,
+                  void      *data)
+{
+  if (n_server_watches == MAX_SERVER_WATCHES)
+    return FALSE;
+
+  server_watches[n_server_watches++] = watch;
+  return TRUE;
+}
+
+static void
+remove_server_watch (DBusWatch *watch,
+                     void      *data)
+{
+  int i;
+
+  for (i = 0; i < n_server_watches; i++)
+    {
+      if (server_watches[i] == watch)
+        {
+          server_watches[i] = server_watches[--n_server_watches];
+          return;
+        }
+    }
+}
+
+static void
+new_connection (DBusServer     *server,
+                DBusConnection *connection,
+                void           *data)
+{
+  if (accepted == NULL)
+    accepted = dbus_connection_ref (connection);
+}
+
+static DBusConnection *
+accept_one (DBusServer *server)
+{
+  if (!dbus_server_set_watch_functions (server, add_server_watch,
+                                        remove_server_watch, NULL,
+                                        NULL, NULL))
+    tool_oom ("setting up server");
+
+  dbus_server_set_new_connection_function (server, new_connection,
+                                           NULL, NULL);
+
+  while (accepted == NULL)
+    {
+      struct pollfd fds[MAX_SERVER_WATCHES];
+      int n = 0;
+      int i;
+
+      for (i = 0; i < n_server_watches; i++)
+        {
+          if (!dbus_watch_get_enabled (server_watches[i]))
+            continue;
+
+          fds[n].fd = dbus_watch_get_unix_fd (server_watches[i]);
+          fds[n].events = POLLIN;
+          fds[n].revents = 0;
+          n++;
+        }
+
+      if (poll (fds, n, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          perror ("dbus-test-tool pingpong: poll");
+          exit (1);
+        }
+
+      /* handling a watch can add or remove watches, so look them up
+       * again by fd */
+      for (i = 0; i < n && accepted == NULL; i++)
+        {
+          int j;
+
+          if (fds[i].revents == 0)
+            continue;
+
+          for (j = 0; j < n_server_watches; j++)
+            {
+              if (dbus_watch_get_unix_fd (server_watches[j]) == fds[i].fd)
+                {
+                  dbus_watch_handle (server_watches[j], DBUS_WATCH_READABLE);
+                  break;
+                }
+            }
+        }
+    }
+
+  return accepted;
+}
+
+/*
+ * Starts a responder process connected to the bus, and returns its
+ * unique name, which it sends back through a pipe.
+ */
+static char *
+start_bus_responder (DBusBusType  type,
+                     int          cpu,
+                     pid_t       *pid_p)
+{
+  char name[256];
+  int fds[2];
+  size_t len = 0;
+  ssize_t n;
+
+  if (pipe (fds) < 0)
+    {
+      perror ("dbus-test-tool pingpong: pipe");
+      exit (1);
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+  *pid_p = fork ();
+
+  if (*pid_p < 0)
+    {
+      perror ("dbus-test-tool pingpong: fork");
+      exit (1);
+    }
+
+  if (*pid_p == 0)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      DBusConnection *connection;
+      const char *unique;
+
+      close (fds[0]);
+      connection = dbus_bus_get_private (type, &error);
+
+      if (connection == NULL)
+        {
+          fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+                   error.name, error.message);
+          _exit (1);
+        }
+
+      unique = dbus_bus_get_unique_name (connection);
+
+      if (!tool_write_all (fds[1], unique, strlen (unique)))
+        _exit (1);
+
+      close (fds[1]);
+      respond (connection, cpu);
+    }
+
+  close (fds[1]);
+
+  while (len < sizeof (name) - 1 &&
+         ((n = read (fds[0], name + len, sizeof (name) - 1 - len)) > 0 ||
+          (n < 0 && errno == EINTR)))
+    {
+      if (n > 0)
+        len += n;
+    }
+
+  close (fds[0]);
+  name[len] = '\0';
+
+  if (len == 0)
+    {
+      fprintf (stderr, "Responder failed to start\n");
+      exit (1);
+    }
+
+  return strdup (name);
+}
+
+/*
+ * Starts a responder process that connects to server, and returns our
+ * end of the connection.
+ */
+static DBusConnection *
+start_peer_responder (DBusServer *server,
+                      int         cpu,
+                      pid_t      *pid_p)
+{
+  char *address = dbus_server_get_address (server);
+
+  if (address == NULL)
+    tool_oom ("getting server address");
+
+  fflush (stdout);
+  fflush (stderr);
+  *pid_p = fork ();
+
+  if (*pid_p < 0)
+    {
+      perror ("dbus-test-tool pingpong: fork");
+      exit (1);
+    }
+
+  if (*pid_p == 0)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      DBusConnection *connection;
+
+      connection = dbus_connection_open_private (address, &error);
+
+      if (connection == NULL)
+        {
+          fprintf (stderr, "Failed to connect to %s: %s: %s\n",
+                   address, error.name, error.message);
+          _exit (1);
+        }
+
+      respond (connection, cpu);
+    }
+
+  dbus_free (address);
+  return accept_one (server);
+}
+#endif /* DBUS_UNIX */
+
+/* Newton's method, to avoid linking libm just for this */
+static double
+square_root (double x)
+{
+  double r = x > 1 ? x : 1;
+  int i;
+
+  for (i = 0; i < 64; i++)
+    r = (r + x / r) / 2;
+
+  return r;
+}
+
+/*
+ * Prints samples in the percentile distribution format used by
+ * HdrHistogram, so that the output can be plotted with its tools:
+ * five steps for each halving of the distance to the 100th percentile.
+ * Values are in microseconds and exact, since every sample is kept.
+ */
+static void
+print_histogram (dbus_uint32_t *samples,
+                 int            n)
+{
+  double sum = 0, sum_sq = 0, mean, variance;
+  double half = 1.0;
+  int i;
+
+  qsort (samples, n, sizeof (*samples), tool_compare_latencies);
+
+  printf ("%12s %14s %10s %14s\n\n",
+          "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+  while (1)
+    {
+      int step;
+
+      for (step = 0; step < 5; step++)
+        {
+          double percentile = 1.0 - half + half / 2 * step / 5;
+          int count = (int) (percentile * n + 0.5);
+
+          if (count < 1)
+            count = 1;
+
+          if (count >= n)
+            goto last;
+
+          printf ("%12.3f %2.12f %10d %14.2f\n",
+                  (double) samples[count - 1], percentile, count,
+                  1 / (1 - percentile));
+        }
+
+      half /= 2;
+    }
+
+last:
+  printf ("%12.3f %2.12f %10d\n", (double) samples[n - 1], 1.0, n);
+
+  for (i = 0; i < n; i++)
+    {
+      sum += samples[i];
+      sum_sq += (double) samples[i] * samples[i];
+    }
+
+  mean = sum / n;
+  variance = sum_sq / n - mean * mean;
+
+  printf ("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+          mean, variance > 0 ? square_root (variance) : 0.0);
+  printf ("#[Max     = %12.3f, Total count    = %12d]\n",
+          (double) samples[n - 1], n);
+}
+
+int
+dbus_test_tool_pingpong (int argc, char **argv)
+{
+#ifdef DBUS_UNIX
+  DBusError error = DBUS_ERROR_INIT;
+  DBusBusType type = DBUS_BUS_SESSION;
+  DBusConnection *connection = NULL;
+  DBusServer *server = NULL;
+  const char *listen_address = "unix:tmpdir=/tmp";
+  const char *destination = NULL;
+  char *responder_name = NULL;
+  dbus_bool_t peer = FALSE;
+  int count = 10000;
+  int warmup = 1000;
+  int payload_size = 0;
+  int cpu = -1;
+  int responder_cpu = -1;
+  pid_t responder = 0;
+  unsigned char *payload;
+  dbus_uint32_t *samples;
+  int i;
+
+  /* argv[1] is the tool name, so start from 2 */
+
+  for (i = 2; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        type = DBUS_BUS_SESSION;
+      else if (strstr (arg, "--dest=") == arg)
+        destination = arg + strlen ("--dest=");
+      else if (strcmp (arg, "--peer") == 0)
+        peer = TRUE;
+      else if (strstr (arg, "--listen=") == arg)
+        listen_address = arg + strlen ("--listen=");
+      else if (strstr (arg, "--count=") == arg)
+        count = atoi (arg + strlen ("--count="));
+      else if (strstr (arg, "--warmup=") == arg)
+        warmup = atoi (arg + strlen ("--warmup="));
+      else if (strstr (arg, "--payload-size=") == arg)
+        payload_size = atoi (arg + strlen ("--payload-size="));
+      else if (strstr (arg, "--cpu=") == arg)
+        cpu = atoi (arg + strlen ("--cpu="));
+      else if (strstr (arg, "--responder-cpu=") == arg)
+        responder_cpu = atoi (arg + strlen ("--responder-cpu="));
+      else
+        usage (2);
+    }
+
+  if (count < 1 || warmup < 0 || payload_size < 0 ||
+      (peer && destination != NULL))
+    usage (2);
+
+  payload = dbus_malloc0 (payload_size + 1);
+  samples = dbus_new (dbus_uint32_t, count);
+
+  if (payload == NULL || samples == NULL)
+    tool_oom ("allocating buffers");
+
+  if (peer)
+    {
+      server = dbus_server_listen (listen_address, &error);
+
+      if (server == NULL)
+        {
+          fprintf (stderr, "Failed to listen on %s: %s: %s\n",
+                   listen_address, error.name, error.message);
+          exit (1);
+        }
+
+      connection = start_peer_responder (server, responder_cpu, &responder);
+    }
+  else
+    {
+      connection = dbus_bus_get_private (type, &error);
+
+      if (connection == NULL)
+        {
+          fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+                   error.name, error.message);
+          exit (1);
+        }
+
+      if (destination == NULL)
+        {
+          responder_name = start_bus_responder (type, responder_cpu,
+                                                &responder);
+          destination = responder_name;
+        }
+    }
+
+  pin_to_cpu (cpu);
+
+  for (i = -warmup; i < count; i++)
+    {
+      DBusMessage *call, *reply;
+      dbus_uint64_t start;
+
+      call = dbus_message_new_method_call (destination, "/", "com.example",
+                                           "Ping");
+
+      if (call == NULL ||
+          !dbus_message_append_args (call,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                       &payload, payload_size,
+                                     DBUS_TYPE_INVALID))
+        tool_oom ("building message");
+
+      start = tool_now_usec ();
+      reply = dbus_connection_send_with_reply_and_block (connection, call,
+                                                         DBUS_TIMEOUT_INFINITE,
+                                                         &error);
+
+      if (i >= 0)
+        {
+          dbus_uint64_t usec = tool_now_usec () - start;
+
+          samples[i] = usec > 0xffffffff ? 0xffffffff : usec;
+        }
+
+      dbus_message_unref (call);
+
+      if (reply == NULL)
+        {
+          fprintf (stderr, "Call failed: %s: %s\n", error.name,
+                   error.message);
+          exit (1);
+        }
+
+      dbus_message_unref (reply);
+    }
+
+  print_histogram (samples, count);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+
+  if (responder > 0)
+    {
+      int status;
+
+      /* a peer responder exits when we disconnect, but one on the bus
+       * has no reason to */
+      if (!peer)
+        kill (responder, SIGTERM);
+
+      waitpid (responder, &status, 0);
+    }
+
+  if (server != NULL)
+    {
+      dbus_server_disconnect (server);
+      dbus_server_unref (server);
+    }
+
+  free (responder_name);
+  dbus_free (samples);
+  dbus_free (payload);
+  dbus_shutdown ();
+  return 0;
+#else
+  fprintf (stderr, "dbus-test-tool pingpong is not supported on this "
+                   "platform\n");
+  return 1;
+#endif
+}
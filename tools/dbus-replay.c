@@ -0,0 +1,911 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-replay.c - replay traffic captured by dbus-monitor --pcap
+ *
+ * Copyright © 2026 D-Bus contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <dbus/dbus.h>
+
+#include "dbus/dbus-hash.h"
+#include "test-tool.h"
+#include "tool-common.h"
+
+/* as in dbus-monitor.c */
+#define LINKTYPE_DBUS 231
+
+/* the maximum message size allowed by the D-Bus Specification */
+#define MAX_RECORD_SIZE (1 << 27)
+
+/* how long to wait for outstanding replies after the last message */
+#define DRAIN_TIMEOUT_USEC (30 * 1000000)
+
+#ifdef DBUS_UNIX
+
+static void usage (int exit_with) _DBUS_GNUC_NORETURN;
+
+static void
+usage (int exit_with)
+{
+  fprintf (stderr,
+           "Usage: dbus-test-tool replay [OPTIONS] FILE\n"
+           "\n"
+           "Replay the method calls and signals in FILE, which was written\n"
+           "by dbus-monitor --pcap, with one connection for each connection\n"
+           "in the capture, and report how the bus coped.\n"
+           "\n"
+           "Options:\n"
+           "\n"
+           "    --session     use the session bus (default)\n"
+           "    --system      use the system bus\n"
+           "    --address=ADDRESS  use the bus at ADDRESS\n"
+           "\n"
+           "    --realtime    keep the original timing between messages\n"
+           "                  (default: as fast as possible)\n"
+           );
+  exit (exit_with);
+}
+
+typedef struct
+{
+  /* from the capture's timestamps */
+  dbus_uint64_t usec;
+  DBusMessage *message;
+} Record;
+
+/* A synthetic connection standing in for one in the capture */
+typedef struct
+{
+  DBusConnection *connection;
+  /* unique name on the bus we are replaying to */
+  const char *unique_name;
+  dbus_bool_t disconnected;
+} Peer;
+
+typedef struct
+{
+  dbus_uint64_t sent_usec;
+} Call;
+
+static Record *records = NULL;
+static size_t n_records = 0;
+static size_t records_allocated = 0;
+static unsigned long n_unreadable = 0;
+
+static Peer **peers = NULL;
+static int n_peers = 0;
+/* name in the capture => Peer, for unique names and for well-known
+ * names whose owner could not be worked out */
+static DBusHashTable *peers_by_name = NULL;
+/* well-known name => Peer that will own it */
+static DBusHashTable *owners = NULL;
+/* "sender serial" => well-known destination, while working out owners */
+static DBusHashTable *calls_to_names = NULL;
+
+static struct
+{
+  unsigned long messages;
+  unsigned long calls;
+  unsigned long replies;
+  unsigned long errors;
+  unsigned long signals_received;
+} results = { 0 };
+
+/* time from sending each call until its reply, in usec */
+static dbus_uint32_t *latencies = NULL;
+static size_t n_latencies = 0;
+static size_t latencies_allocated = 0;
+
+static dbus_uint32_t
+swap_uint32 (dbus_uint32_t value)
+{
+  return ((value & 0x000000ffU) << 24) |
+         ((value & 0x0000ff00U) << 8) |
+         ((value & 0x00ff0000U) >> 8) |
+         ((value & 0xff000000U) >> 24);
+}
+
+static void
+add_record (dbus_uint64_t  usec,
+            DBusMessage   *message)
+{
+  if (n_records == records_allocated)
+    {
+      size_t n = records_allocated == 0 ? 1024 : records_allocated * 2;
+      Record *tmp = dbus_realloc (records, n * sizeof (*tmp));
+
+      if (tmp == NULL)
+        tool_oom ("loading capture");
+
+      records = tmp;
+      records_allocated = n;
+    }
+
+  records[n_records].usec = usec;
+  records[n_records].message = message;
+  n_records++;
+}
+
+/*
+ * Reads a capture in the format written by dbus-monitor --pcap,
+ * which is documented at
+ * http://wiki.wireshark.org/Development/LibpcapFileFormat
+ */
+static void
+load_capture (const char *filename)
+{
+  dbus_uint32_t header[6];
+  dbus_uint32_t magic;
+  dbus_bool_t swapped = FALSE;
+  dbus_bool_t nanoseconds = FALSE;
+  char *blob;
+  FILE *f;
+
+  f = fopen (filename, "rb");
+
+  if (f == NULL)
+    {
+      perror (filename);
+      exit (1);
+    }
+
+  if (fread (header, sizeof (header), 1, f) != 1)
+    {
+      fprintf (stderr, "%s: not a pcap file\n", filename);
+      exit (1);
+    }
+
+  magic = header[0];
+
+  if (magic == 0xD4C3B2A1U || magic == 0x4D3CB2A1U)
+    {
+      swapped = TRUE;
+      magic = swap_uint32 (magic);
+    }
+
+  if (magic == 0xA1B23C4DU)
+    nanoseconds = TRUE;
+  else if (magic != 0xA1B2C3D4U)
+    {
+      fprintf (stderr, "%s: not a pcap file\n", filename);
+      exit (1);
+    }
+
+  if ((swapped ? swap_uint32 (header[5]) : header[5]) != LINKTYPE_DBUS)
+    {
+      fprintf (stderr, "%s: not a capture of D-Bus messages\n", filename);
+      exit (1);
+    }
+
+  blob = dbus_malloc (MAX_RECORD_SIZE);
+
+  if (blob == NULL)
+    tool_oom ("allocating buffer");
+
+  while (TRUE)
+    {
+      /* seconds, microseconds, bytes captured, original length */
+      dbus_uint32_t record[4];
+      DBusError error = DBUS_ERROR_INIT;
+      DBusMessage *message;
+      int i;
+
+      if (fread (record, sizeof (record), 1, f) != 1)
+        break;
+
+      for (i = 0; swapped && i < 4; i++)
+        record[i] = swap_uint32 (record[i]);
+
+      /* zero padding after the end of a dbus-monitor --ring file that
+       * was not closed cleanly */
+      if (record[3] == 0)
+        break;
+
+      if (record[2] > MAX_RECORD_SIZE ||
+          fread (blob, 1, record[2], f) != record[2])
+        {
+          fprintf (stderr, "%s: truncated or corrupt record\n", filename);
+          n_unreadable++;
+          break;
+        }
+
+      /* dbus-monitor --headers-only and capture tools with a snap
+       * length can leave out part of the message */
+      if (record[2] != record[3])
+        {
+          n_unreadable++;
+          continue;
+        }
+
+      message = dbus_message_demarshal (blob, record[2], &error);
+
+      if (message == NULL)
+        {
+          dbus_error_free (&error);
+          n_unreadable++;
+          continue;
+        }
+
+      add_record (((dbus_uint64_t) record[0]) * 1000000 +
+                  (nanoseconds ? record[1] / 1000 : record[1]),
+                  message);
+    }
+
+  dbus_free (blob);
+  fclose (f);
+}
+
+static Peer *
+get_peer (const char *name)
+{
+  Peer *peer = _dbus_hash_table_lookup_string (peers_by_name, name);
+  char *key;
+
+  if (peer != NULL)
+    return peer;
+
+  peer = dbus_new0 (Peer, 1);
+  key = strdup (name);
+
+  if (peer == NULL || key == NULL ||
+      !_dbus_hash_table_insert_string (peers_by_name, key, peer))
+    tool_oom ("adding peer");
+
+  if (n_peers % 64 == 0)
+    {
+      Peer **tmp = dbus_realloc (peers, (n_peers + 64) * sizeof (*tmp));
+
+      if (tmp == NULL)
+        tool_oom ("adding peer");
+
+      peers = tmp;
+    }
+
+  peers[n_peers++] = peer;
+  return peer;
+}
+
+static void
+set_owner (const char *name,
+           Peer       *peer)
+{
+  char *key;
+
+  if (_dbus_hash_table_lookup_string (owners, name) != NULL)
+    return;
+
+  key = strdup (name);
+
+  if (key == NULL || !_dbus_hash_table_insert_string (owners, key, peer))
+    tool_oom ("recording name owner");
+}
+
+static dbus_bool_t
+is_well_known (const char *name)
+{
+  return name != NULL && name[0] != ':' &&
+         strcmp (name, DBUS_SERVICE_DBUS) != 0;
+}
+
+/*
+ * Works out which connections were in the capture, and which of them
+ * owned each well-known name that messages were sent to: from
+ * NameOwnerChanged if the capture includes it, otherwise from who
+ * replied to calls to that name. A name whose owner can't be worked
+ * out gets a connection of its own.
+ */
+static void
+plan_peers (void)
+{
+  char key[128];
+  size_t i;
+
+  for (i = 0; i < n_records; i++)
+    {
+      DBusMessage *message = records[i].message;
+      const char *sender = dbus_message_get_sender (message);
+      const char *destination = dbus_message_get_destination (message);
+      const char *name, *old_owner, *new_owner;
+
+      if (sender != NULL && sender[0] == ':')
+        get_peer (sender);
+
+      if (destination != NULL && destination[0] == ':')
+        get_peer (destination);
+
+      switch (dbus_message_get_type (message))
+        {
+          case DBUS_MESSAGE_TYPE_SIGNAL:
+            if (sender != NULL && strcmp (sender, DBUS_SERVICE_DBUS) == 0 &&
+                dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                        "NameOwnerChanged") &&
+                dbus_message_get_args (message, NULL,
+                                       DBUS_TYPE_STRING, &name,
+                                       DBUS_TYPE_STRING, &old_owner,
+                                       DBUS_TYPE_STRING, &new_owner,
+                                       DBUS_TYPE_INVALID) &&
+                is_well_known (name) && new_owner[0] == ':')
+              set_owner (name, get_peer (new_owner));
+            break;
+
+          case DBUS_MESSAGE_TYPE_METHOD_CALL:
+            if (sender != NULL && is_well_known (destination) &&
+                !dbus_message_get_no_reply (message))
+              {
+                char *k, *v;
+
+                snprintf (key, sizeof (key), "%s %u", sender,
+                          dbus_message_get_serial (message));
+                k = strdup (key);
+                v = strdup (destination);
+
+                if (k == NULL || v == NULL ||
+                    !_dbus_hash_table_insert_string (calls_to_names, k, v))
+                  tool_oom ("recording call");
+              }
+            break;
+
+          case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+            if (sender != NULL && sender[0] == ':' && destination != NULL)
+              {
+                snprintf (key, sizeof (key), "%s %u", destination,
+                          dbus_message_get_reply_serial (message));
+                name = _dbus_hash_table_lookup_string (calls_to_names, key);
+
+                if (name != NULL)
+                  set_owner (name, get_peer (sender));
+              }
+            break;
+
+          default:
+            break;
+        }
+    }
+
+  for (i = 0; i < n_records; i++)
+    {
+      const char *destination = dbus_message_get_destination (
+          records[i].message);
+
+      if (is_well_known (destination) &&
+          _dbus_hash_table_lookup_string (owners, destination) == NULL)
+        set_owner (destination, get_peer (destination));
+    }
+}
+
+static DBusHandlerResult
+peer_filter (DBusConnection *connection,
+             DBusMessage    *message,
+             void           *user_data)
+{
+  DBusMessage *reply;
+
+  switch (dbus_message_get_type (message))
+    {
+      case DBUS_MESSAGE_TYPE_METHOD_CALL:
+        if (dbus_message_get_no_reply (message))
+          return DBUS_HANDLER_RESULT_HANDLED;
+
+        reply = dbus_message_new_method_return (message);
+
+        if (reply == NULL)
+          tool_oom ("allocating reply");
+
+        if (!dbus_connection_send (connection, reply, NULL))
+          tool_oom ("sending reply");
+
+        dbus_message_unref (reply);
+        return DBUS_HANDLER_RESULT_HANDLED;
+
+      case DBUS_MESSAGE_TYPE_SIGNAL:
+        if (dbus_message_has_interface (message, DBUS_INTERFACE_LOCAL))
+          return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+        results.signals_received++;
+        return DBUS_HANDLER_RESULT_HANDLED;
+
+      default:
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+}
+
+static void
+connect_peers (DBusBusType  type,
+               const char  *address)
+{
+  DBusHashIter iter;
+  int i;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      Peer *peer = peers[i];
+
+      if (address == NULL)
+        {
+          peer->connection = dbus_bus_get_private (type, &error);
+        }
+      else
+        {
+          peer->connection = dbus_connection_open_private (address, &error);
+
+          if (peer->connection != NULL &&
+              !dbus_bus_register (peer->connection, &error))
+            {
+              dbus_connection_close (peer->connection);
+              dbus_connection_unref (peer->connection);
+              peer->connection = NULL;
+            }
+        }
+
+      if (peer->connection == NULL)
+        {
+          fprintf (stderr, "Failed to connect to bus: %s: %s\n",
+                   error.name, error.message);
+          exit (1);
+        }
+
+      dbus_connection_set_exit_on_disconnect (peer->connection, FALSE);
+      peer->unique_name = dbus_bus_get_unique_name (peer->connection);
+
+      if (!dbus_connection_add_filter (peer->connection, peer_filter,
+                                       NULL, NULL))
+        tool_oom ("adding message filter");
+    }
+
+  _dbus_hash_iter_init (owners, &iter);
+
+  while (_dbus_hash_iter_next (&iter))
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      const char *name = _dbus_hash_iter_get_string_key (&iter);
+      Peer *peer = _dbus_hash_iter_get_value (&iter);
+
+      /* not fatal: calls to this name will fail and be counted */
+      if (dbus_bus_request_name (peer->connection, name,
+                                 DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        {
+          fprintf (stderr, "Unable to own %s: %s\n", name,
+                   error.message != NULL ? error.message : "already owned");
+          dbus_error_free (&error);
+        }
+    }
+}
+
+/*
+ * Does whatever I/O is possible on all peers, waiting up to timeout_ms
+ * for some to be possible, then dispatches what arrived.
+ */
+static void
+pump (int timeout_ms)
+{
+  static struct pollfd *fds = NULL;
+  int i;
+
+  if (fds == NULL)
+    {
+      fds = dbus_new0 (struct pollfd, n_peers);
+
+      if (fds == NULL)
+        tool_oom ("allocating poll set");
+    }
+
+  for (i = 0; i < n_peers; i++)
+    {
+      int fd = -1;
+
+      if (!peers[i]->disconnected)
+        dbus_connection_get_unix_fd (peers[i]->connection, &fd);
+
+      fds[i].fd = fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+
+      if (fd >= 0 && dbus_connection_has_messages_to_send (
+            peers[i]->connection))
+        fds[i].events |= POLLOUT;
+    }
+
+  if (poll (fds, n_peers, timeout_ms) < 0 && errno != EINTR)
+    {
+      perror ("dbus-test-tool replay: poll");
+      exit (1);
+    }
+
+  for (i = 0; i < n_peers; i++)
+    {
+      if (fds[i].revents != 0 &&
+          !dbus_connection_read_write (peers[i]->connection, 0))
+        peers[i]->disconnected = TRUE;
+
+      while (dbus_connection_dispatch (peers[i]->connection) ==
+             DBUS_DISPATCH_DATA_REMAINS)
+        {}
+    }
+}
+
+static void
+add_latency (dbus_uint64_t usec)
+{
+  if (n_latencies == latencies_allocated)
+    {
+      size_t n = latencies_allocated == 0 ? 1024 : latencies_allocated * 2;
+      dbus_uint32_t *tmp = dbus_realloc (latencies, n * sizeof (*tmp));
+
+      if (tmp == NULL)
+        tool_oom ("recording latency");
+
+      latencies = tmp;
+      latencies_allocated = n;
+    }
+
+  latencies[n_latencies++] = (usec > 0xffffffff ? 0xffffffff : usec);
+}
+
+static void
+reply_cb (DBusPendingCall *pc,
+          void            *data)
+{
+  Call *call = data;
+  DBusMessage *reply = dbus_pending_call_steal_reply (pc);
+
+  add_latency (tool_now_usec () - call->sent_usec);
+  results.replies++;
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+    results.errors++;
+
+  dbus_message_unref (reply);
+}
+
+/*
+ * Calls to the bus driver that are worth replaying. Others would
+ * interfere with the replay (Hello, RequestName, BecomeMonitor...) or
+ * change the bus's configuration.
+ */
+static const char * const driver_methods[] = {
+    "AddMatch",
+    "RemoveMatch",
+    "GetNameOwner",
+    "NameHasOwner",
+    "ListNames",
+    "ListActivatableNames",
+    "GetId",
+    NULL
+};
+
+/* Returns TRUE if the message was sent */
+static dbus_bool_t
+replay_one (DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender (message);
+  const char *destination = dbus_message_get_destination (message);
+  int type = dbus_message_get_type (message);
+  DBusMessage *copy;
+  Peer *peer;
+
+  /* the bus will send its own messages, and our peers their own
+   * replies */
+  if (sender == NULL || sender[0] != ':' ||
+      (type != DBUS_MESSAGE_TYPE_METHOD_CALL &&
+       type != DBUS_MESSAGE_TYPE_SIGNAL))
+    return FALSE;
+
+  if (destination != NULL && strcmp (destination, DBUS_SERVICE_DBUS) == 0)
+    {
+      int i;
+
+      for (i = 0; driver_methods[i] != NULL; i++)
+        {
+          if (dbus_message_has_member (message, driver_methods[i]))
+            break;
+        }
+
+      if (driver_methods[i] == NULL)
+        return FALSE;
+    }
+
+  peer = _dbus_hash_table_lookup_string (peers_by_name, sender);
+
+  if (peer == NULL || peer->disconnected)
+    return FALSE;
+
+  /* a copy has no serial, so the connection will give it one */
+  copy = dbus_message_copy (message);
+
+  if (copy == NULL || !dbus_message_set_sender (copy, NULL))
+    tool_oom ("copying message");
+
+  if (destination != NULL && destination[0] == ':')
+    {
+      Peer *recipient = _dbus_hash_table_lookup_string (peers_by_name,
+                                                        destination);
+
+      if (!dbus_message_set_destination (copy, recipient->unique_name))
+        tool_oom ("copying message");
+    }
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      !dbus_message_get_no_reply (copy))
+    {
+      DBusPendingCall *pc;
+      Call *call = dbus_new0 (Call, 1);
+
+      if (call == NULL)
+        tool_oom ("allocating call");
+
+      call->sent_usec = tool_now_usec ();
+
+      if (!dbus_connection_send_with_reply (peer->connection, copy, &pc,
+                                            DBUS_TIMEOUT_INFINITE) ||
+          pc == NULL ||
+          !dbus_pending_call_set_notify (pc, reply_cb, call, dbus_free))
+        tool_oom ("sending call");
+
+      dbus_pending_call_unref (pc);
+      results.calls++;
+    }
+  else if (!dbus_connection_send (peer->connection, copy, NULL))
+    {
+      tool_oom ("sending message");
+    }
+
+  dbus_message_unref (copy);
+  results.messages++;
+  return TRUE;
+}
+
+/* Returns the CPU time used by process pid so far, or -1 */
+static long long
+process_cpu_usec (unsigned long pid)
+{
+#ifdef __linux__
+  char path[64];
+  char buf[1024];
+  unsigned long utime, stime;
+  const char *p;
+  FILE *f;
+  size_t len;
+
+  if (pid == 0)
+    return -1;
+
+  snprintf (path, sizeof (path), "/proc/%lu/stat", pid);
+  f = fopen (path, "r");
+
+  if (f == NULL)
+    return -1;
+
+  len = fread (buf, 1, sizeof (buf) - 1, f);
+  fclose (f);
+  buf[len] = '\0';
+
+  /* the command name may contain spaces, so skip past it */
+  p = strrchr (buf, ')');
+
+  if (p == NULL ||
+      sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+              &utime, &stime) != 2)
+    return -1;
+
+  return (utime + stime) * 1000000LL / sysconf (_SC_CLK_TCK);
+#else
+  return -1;
+#endif
+}
+
+static unsigned long
+get_bus_pid (DBusConnection *connection)
+{
+  DBusMessage *call, *reply;
+  const char *name = DBUS_SERVICE_DBUS;
+  dbus_uint32_t pid = 0;
+
+  call = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "GetConnectionUnixProcessID");
+
+  if (call == NULL ||
+      !dbus_message_append_args (call, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    tool_oom ("building GetConnectionUnixProcessID call");
+
+  /* not fatal if this fails: we just can't report CPU time */
+  reply = dbus_connection_send_with_reply_and_block (connection, call, -1,
+                                                     NULL);
+  dbus_message_unref (call);
+
+  if (reply != NULL)
+    {
+      if (!dbus_message_get_args (reply, NULL, DBUS_TYPE_UINT32, &pid,
+                                  DBUS_TYPE_INVALID))
+        pid = 0;
+
+      dbus_message_unref (reply);
+    }
+
+  return pid;
+}
+
+#endif /* DBUS_UNIX */
+
+int
+dbus_test_tool_replay (int argc, char **argv)
+{
+#ifdef DBUS_UNIX
+  DBusBusType type = DBUS_BUS_SESSION;
+  const char *address = NULL;
+  const char *filename = NULL;
+  dbus_bool_t realtime = FALSE;
+  dbus_uint64_t start, end, last_progress;
+  unsigned long bus_pid;
+  long long cpu_before, cpu_after;
+  double seconds;
+  size_t j;
+  int i;
+
+  /* argv[1] is the tool name, so start from 2 */
+
+  for (i = 2; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        type = DBUS_BUS_SESSION;
+      else if (strstr (arg, "--address=") == arg)
+        address = arg + strlen ("--address=");
+      else if (strcmp (arg, "--realtime") == 0)
+        realtime = TRUE;
+      else if (arg[0] == '-' || filename != NULL)
+        usage (2);
+      else
+        filename = arg;
+    }
+
+  if (filename == NULL)
+    usage (2);
+
+  peers_by_name = _dbus_hash_table_new (DBUS_HASH_STRING, free, dbus_free);
+  owners = _dbus_hash_table_new (DBUS_HASH_STRING, free, NULL);
+  calls_to_names = _dbus_hash_table_new (DBUS_HASH_STRING, free, free);
+
+  if (peers_by_name == NULL || owners == NULL || calls_to_names == NULL)
+    tool_oom ("allocating hash tables");
+
+  load_capture (filename);
+
+  if (n_records == 0)
+    {
+      fprintf (stderr, "%s: no messages to replay\n", filename);
+      return 1;
+    }
+
+  plan_peers ();
+  _dbus_hash_table_unref (calls_to_names);
+  connect_peers (type, address);
+
+  bus_pid = get_bus_pid (peers[0]->connection);
+  cpu_before = process_cpu_usec (bus_pid);
+  start = tool_now_usec ();
+
+  for (j = 0; j < n_records; j++)
+    {
+      if (realtime)
+        {
+          dbus_uint64_t due = start + (records[j].usec - records[0].usec);
+          dbus_uint64_t now;
+
+          while ((now = tool_now_usec ()) < due)
+            pump ((due - now + 999) / 1000);
+        }
+
+      if (replay_one (records[j].message))
+        pump (0);
+    }
+
+  /* wait for outstanding replies, but not forever: the pending calls
+   * have no timeout, because we have no main loop to run them */
+  last_progress = tool_now_usec ();
+
+  while (results.replies < results.calls &&
+         tool_now_usec () - last_progress < DRAIN_TIMEOUT_USEC)
+    {
+      unsigned long before = results.replies;
+
+      pump (100);
+
+      if (results.replies != before)
+        last_progress = tool_now_usec ();
+    }
+
+  end = tool_now_usec ();
+  cpu_after = process_cpu_usec (bus_pid);
+  seconds = (end - start) / 1e6;
+
+  if (seconds <= 0)
+    seconds = 1e-6;
+
+  qsort (latencies, n_latencies, sizeof (*latencies),
+         tool_compare_latencies);
+
+  /* One "key value" pair per line, as for dbus-test-tool spam --report */
+  printf ("records %lu\n", (unsigned long) n_records);
+  printf ("unreadable %lu\n", n_unreadable);
+  printf ("peers %d\n", n_peers);
+  printf ("names %d\n", _dbus_hash_table_get_n_entries (owners));
+  printf ("messages %lu\n", results.messages);
+  printf ("calls %lu\n", results.calls);
+  printf ("replies %lu\n", results.replies);
+  printf ("errors %lu\n", results.errors);
+  printf ("unanswered %lu\n", results.calls - results.replies);
+  printf ("signals_received %lu\n", results.signals_received);
+  printf ("seconds %.3f\n", seconds);
+  printf ("messages_per_second %.1f\n", results.messages / seconds);
+  printf ("latency_p50_usec %u\n",
+          tool_percentile (latencies, n_latencies, 0.5));
+  printf ("latency_p99_usec %u\n",
+          tool_percentile (latencies, n_latencies, 0.99));
+  printf ("latency_p999_usec %u\n",
+          tool_percentile (latencies, n_latencies, 0.999));
+  printf ("latency_max_usec %u\n",
+          tool_percentile (latencies, n_latencies, 1.0));
+
+  if (cpu_before >= 0 && cpu_after >= 0)
+    {
+      printf ("bus_cpu_usec %lld\n", cpu_after - cpu_before);
+      printf ("bus_cpu_usec_per_message %.3f\n",
+              results.messages == 0 ? 0.0 :
+              (double) (cpu_after - cpu_before) / results.messages);
+    }
+
+  for (i = 0; i < n_peers; i++)
+    {
+      dbus_connection_close (peers[i]->connection);
+      dbus_connection_unref (peers[i]->connection);
+    }
+
+  for (j = 0; j < n_records; j++)
+    dbus_message_unref (records[j].message);
+
+  _dbus_hash_table_unref (owners);
+  _dbus_hash_table_unref (peers_by_name);
+  dbus_free (peers);
+  dbus_free (records);
+  dbus_free (latencies);
+  dbus_shutdown ();
+  return 0;
+#else
+  fprintf (stderr, "dbus-test-tool replay is not supported on this "
+                   "platform\n");
+  return 1;
+#endif
+}
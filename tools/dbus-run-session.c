@@ -33,6 +33,8 @@
 #include <unistd.h>
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -42,6 +44,8 @@
 #define MAX_ADDR_LEN 512
 #define PIPE_READ_END  0
 #define PIPE_WRITE_END 1
+/* First file descriptor of the LISTEN_FDS protocol, see sd_listen_fds(3) */
+#define LISTEN_FDS_START 3
 
 /* PROCESSES
  *
@@ -62,6 +66,12 @@
  * PIPES
  *
  * dbus-daemon --print-address -> bus_address_pipe -> d-r-s
+ *
+ * With --create-socket, there is no pipe: d-r-s creates the listening
+ * socket in a private directory, passes it to dbus-daemon
+ * --address=systemd: as file descriptor 3 using the LISTEN_FDS protocol,
+ * and starts myapp straight away. Connections made before dbus-daemon has
+ * finished loading its configuration wait in the socket's backlog.
  */
 
 static const char me[] = "dbus-run-session";
@@ -79,6 +89,8 @@ usage (int ecode)
       "Options:\n"
       "--dbus-daemon=BINARY       run BINARY instead of dbus-daemon\n"
       "--config-file=FILENAME     pass to dbus-daemon instead of --session\n"
+      "--create-socket            create the bus socket and start PROGRAM\n"
+      "                           without waiting for dbus-daemon\n"
       "\n",
       me, me, me);
   exit (ecode);
@@ -198,6 +210,150 @@ exec_dbus_daemon (const char *dbus_daemon,
            me, dbus_daemon, strerror (errno));
 }
 
+static void
+exec_dbus_daemon_with_socket (const char *dbus_daemon,
+                              int         listen_fd,
+                              const char *config_file)
+{
+  /* Child process, which execs dbus-daemon or dies trying */
+  char pid_as_string[MAX_FD_LEN];
+
+  if (listen_fd != LISTEN_FDS_START)
+    {
+      /* this also clears FD_CLOEXEC */
+      if (dup2 (listen_fd, LISTEN_FDS_START) < 0)
+        {
+          fprintf (stderr, "%s: failed to pass socket to message bus daemon: %s\n",
+                   me, strerror (errno));
+          return;
+        }
+
+      close (listen_fd);
+    }
+
+  sprintf (pid_as_string, "%ld", (long) getpid ());
+
+  if (!dbus_setenv ("LISTEN_PID", pid_as_string) ||
+      !dbus_setenv ("LISTEN_FDS", "1"))
+    oom ();
+
+  execlp (dbus_daemon,
+          dbus_daemon,
+          "--nofork",
+          "--address=systemd:",
+          config_file ? "--config-file" : "--session",
+          config_file, /* has to be last in this varargs list */
+          NULL);
+
+  fprintf (stderr, "%s: failed to execute message bus daemon '%s': %s\n",
+           me, dbus_daemon, strerror (errno));
+}
+
+static char socket_dir[MAX_ADDR_LEN] = { 0 };
+static char socket_path[MAX_ADDR_LEN] = { 0 };
+
+static void
+remove_socket (void)
+{
+  if (socket_path[0] != '\0')
+    unlink (socket_path);
+
+  if (socket_dir[0] != '\0')
+    rmdir (socket_dir);
+
+  socket_path[0] = '\0';
+  socket_dir[0] = '\0';
+}
+
+/* Create a listening socket in a new directory only we can use, and
+ * write its D-Bus address into bus_address. Returns the socket, or -1
+ * after printing a message. */
+static int
+create_socket (char   *bus_address,
+               size_t  maxlen)
+{
+  struct sockaddr_un addr;
+  const char *tmpdir;
+  char *escaped;
+  int fd = -1;
+  int len;
+
+  tmpdir = getenv ("TMPDIR");
+
+  if (tmpdir == NULL || tmpdir[0] == '\0')
+    tmpdir = "/tmp";
+
+  len = snprintf (socket_dir, sizeof (socket_dir), "%s/dbus-XXXXXX", tmpdir);
+
+  if (len < 0 || (size_t) len >= sizeof (socket_dir))
+    {
+      socket_dir[0] = '\0';
+      fprintf (stderr, "%s: temporary directory name too long\n", me);
+      return -1;
+    }
+
+  if (mkdtemp (socket_dir) == NULL)
+    {
+      fprintf (stderr, "%s: failed to create directory in %s: %s\n",
+               me, tmpdir, strerror (errno));
+      socket_dir[0] = '\0';
+      return -1;
+    }
+
+  len = snprintf (socket_path, sizeof (socket_path), "%s/bus", socket_dir);
+
+  if (len < 0 || (size_t) len >= sizeof (addr.sun_path))
+    {
+      socket_path[0] = '\0';
+      fprintf (stderr, "%s: socket name too long\n", me);
+      goto fail;
+    }
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    {
+      fprintf (stderr, "%s: failed to create socket: %s\n", me,
+               strerror (errno));
+      goto fail;
+    }
+
+  memset (&addr, '\0', sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+      listen (fd, SOMAXCONN) < 0)
+    {
+      fprintf (stderr, "%s: failed to listen on %s: %s\n", me, socket_path,
+               strerror (errno));
+      goto fail;
+    }
+
+  escaped = dbus_address_escape_value (socket_path);
+
+  if (escaped == NULL)
+    oom ();
+
+  len = snprintf (bus_address, maxlen, "unix:path=%s", escaped);
+  dbus_free (escaped);
+
+  if (len < 0 || (size_t) len >= maxlen)
+    {
+      fprintf (stderr, "%s: bus address too long\n", me);
+      goto fail;
+    }
+
+  return fd;
+
+fail:
+  if (fd >= 0)
+    close (fd);
+
+  remove_socket ();
+  return -1;
+}
+
 static void exec_app (int prog_arg, char **argv) _DBUS_GNUC_NORETURN;
 
 static void
@@ -221,6 +377,8 @@ main (int argc, char **argv)
   const char *prev_arg = NULL;
   int i = 1;
   int requires_arg = 0;
+  int want_socket = 0;
+  int listen_fd = -1;
   pid_t bus_pid;
   pid_t app_pid;
 
@@ -273,6 +431,10 @@ main (int argc, char **argv)
         {
           version ();
         }
+      else if (strcmp (arg, "--create-socket") == 0)
+        {
+          want_socket = 1;
+        }
       else if (strstr (arg, "--config-file=") == arg)
         {
           const char *file;
@@ -348,7 +510,14 @@ main (int argc, char **argv)
   if (dbus_daemon == NULL)
     dbus_daemon = "dbus-daemon";
 
-  if (pipe (bus_address_pipe) < 0)
+  if (want_socket)
+    {
+      listen_fd = create_socket (bus_address, MAX_ADDR_LEN);
+
+      if (listen_fd < 0)
+        return 127;
+    }
+  else if (pipe (bus_address_pipe) < 0)
     {
       fprintf (stderr, "%s: failed to create pipe: %s\n", me, strerror (errno));
       return 127;
@@ -364,40 +533,52 @@ main (int argc, char **argv)
   if (bus_pid < 0)
     {
       fprintf (stderr, "%s: failed to fork: %s\n", me, strerror (errno));
+      remove_socket ();
       return 127;
     }
 
   if (bus_pid == 0)
     {
       /* child */
-      exec_dbus_daemon (dbus_daemon, bus_address_pipe, config_file);
+      if (listen_fd >= 0)
+        exec_dbus_daemon_with_socket (dbus_daemon, listen_fd, config_file);
+      else
+        exec_dbus_daemon (dbus_daemon, bus_address_pipe, config_file);
       /* not reached */
       return 127;
     }
 
-  close (bus_address_pipe[PIPE_WRITE_END]);
-
-  switch (read_line (bus_address_pipe[PIPE_READ_END], bus_address, MAX_ADDR_LEN))
+  if (listen_fd >= 0)
     {
-    case READ_STATUS_OK:
-      break;
+      /* The bus daemon has its own copy, and myapp must not inherit one */
+      close (listen_fd);
+    }
+  else
+    {
+      close (bus_address_pipe[PIPE_WRITE_END]);
 
-    case READ_STATUS_EOF:
-      fprintf (stderr, "%s: EOF reading address from bus daemon\n", me);
-      return 127;
-      break;
+      switch (read_line (bus_address_pipe[PIPE_READ_END], bus_address, MAX_ADDR_LEN))
+        {
+        case READ_STATUS_OK:
+          break;
 
-    case READ_STATUS_ERROR:
-      fprintf (stderr, "%s: error reading address from bus daemon: %s\n",
-               me, strerror (errno));
-      return 127;
-      break;
+        case READ_STATUS_EOF:
+          fprintf (stderr, "%s: EOF reading address from bus daemon\n", me);
+          return 127;
+          break;
 
-    default:
-      _dbus_assert_not_reached ("invalid read result");
-    }
+        case READ_STATUS_ERROR:
+          fprintf (stderr, "%s: error reading address from bus daemon: %s\n",
+                   me, strerror (errno));
+          return 127;
+          break;
 
-  close (bus_address_pipe[PIPE_READ_END]);
+        default:
+          _dbus_assert_not_reached ("invalid read result");
+        }
+
+      close (bus_address_pipe[PIPE_READ_END]);
+    }
 
   if (!dbus_setenv ("DBUS_SESSION_BUS_ADDRESS", bus_address) ||
       !dbus_setenv ("DBUS_SESSION_BUS_PID", NULL) ||
@@ -414,6 +595,7 @@ main (int argc, char **argv)
   if (app_pid < 0)
     {
       fprintf (stderr, "%s: failed to fork: %s\n", me, strerror (errno));
+      remove_socket ();
       return 127;
     }
 
@@ -462,6 +644,8 @@ main (int argc, char **argv)
           if (bus_pid != 0)
             kill (bus_pid, SIGTERM);
 
+          remove_socket ();
+
           if (WIFEXITED (child_status))
             return WEXITSTATUS (child_status);
 
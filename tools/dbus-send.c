@@ -55,6 +55,7 @@ static void
 usage (int ecode)
 {
   fprintf (stderr, "Usage: %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "       %s [--help] [--system | --session | --bus=ADDRESS | --peer=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] --batch[=DEPTH] < messages\n", appname);
   exit (ecode);
 }
 
@@ -243,6 +244,456 @@ type_from_name (const char *arg)
   return type;
 }
 
+/* Builds a message of the given type from an object path, an
+ * Interface.Member name (which is modified) and the contents arguments
+ * described in dbus-send(1). Exits on invalid input.
+ */
+static DBusMessage *
+build_message (int          message_type,
+               const char  *dest,
+               const char  *path,
+               char        *name,
+               int          n_args,
+               char       **args)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  int i;
+
+  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      char *last_dot;
+
+      last_dot = strrchr (name, '.');
+      if (last_dot == NULL)
+        {
+          fprintf (stderr, "Must use org.mydomain.Interface.Method notation, no dot in \"%s\"\n",
+                   name);
+          exit (1);
+        }
+      *last_dot = '\0';
+      
+      message = dbus_message_new_method_call (NULL,
+                                              path,
+                                              name,
+                                              last_dot + 1);
+      handle_oom (message != NULL);
+      dbus_message_set_auto_start (message, TRUE);
+    }
+  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      char *last_dot;
+
+      last_dot = strrchr (name, '.');
+      if (last_dot == NULL)
+        {
+          fprintf (stderr, "Must use org.mydomain.Interface.Signal notation, no dot in \"%s\"\n",
+                   name);
+          exit (1);
+        }
+      *last_dot = '\0';
+      
+      message = dbus_message_new_signal (path, name, last_dot + 1);
+      handle_oom (message != NULL);
+    }
+  else
+    {
+      fprintf (stderr, "Internal error, unknown message type\n");
+      exit (1);
+    }
+
+  if (message == NULL)
+    {
+      fprintf (stderr, "Couldn't allocate D-Bus message\n");
+      exit (1);
+    }
+
+  if (dest && !dbus_message_set_destination (message, dest))
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  dbus_message_iter_init_append (message, &iter);
+
+  for (i = 0; i < n_args; i++)
+    {
+      char *arg;
+      char *c;
+      int type2;
+      int secondary_type;
+      int container_type;
+      DBusMessageIter *target_iter;
+      DBusMessageIter container_iter;
+
+      type2 = DBUS_TYPE_INVALID;
+      secondary_type = DBUS_TYPE_INVALID;
+      arg = args[i];
+      c = strchr (arg, ':');
+
+      if (c == NULL)
+	{
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	  exit (1);
+	}
+
+      *(c++) = 0;
+
+      container_type = DBUS_TYPE_INVALID;
+
+      if (strcmp (arg, "variant") == 0)
+	container_type = DBUS_TYPE_VARIANT;
+      else if (strcmp (arg, "array") == 0)
+	container_type = DBUS_TYPE_ARRAY;
+      else if (strcmp (arg, "dict") == 0)
+	container_type = DBUS_TYPE_DICT_ENTRY;
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+	  arg = c;
+	  c = strchr (arg, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	}
+
+      if (arg[0] == 0)
+	type2 = DBUS_TYPE_STRING;
+      else
+	type2 = type_from_name (arg);
+
+      if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  char sig[5];
+	  arg = c;
+	  c = strchr (c, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	  secondary_type = type_from_name (arg);
+	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
+	  sig[1] = type2;
+	  sig[2] = secondary_type;
+	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
+	  sig[4] = '\0';
+          handle_oom (dbus_message_iter_open_container (&iter,
+                                                        DBUS_TYPE_ARRAY,
+                                                        sig,
+                                                        &container_iter));
+	  target_iter = &container_iter;
+	}
+      else if (container_type != DBUS_TYPE_INVALID)
+	{
+	  char sig[2];
+	  sig[0] = type2;
+	  sig[1] = '\0';
+          handle_oom (dbus_message_iter_open_container (&iter,
+                                                        container_type,
+                                                        sig,
+                                                        &container_iter));
+	  target_iter = &container_iter;
+	}
+      else
+	target_iter = &iter;
+
+      if (container_type == DBUS_TYPE_ARRAY)
+	{
+	  append_array (target_iter, type2, c);
+	}
+      else if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  _dbus_assert (secondary_type != DBUS_TYPE_INVALID);
+	  append_dict (target_iter, type2, secondary_type, c);
+	}
+      else
+	append_arg (target_iter, type2, c);
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+          handle_oom (dbus_message_iter_close_container (&iter,
+                                                         &container_iter));
+	}
+    }
+
+  return message;
+}
+
+/* Reads one line of any length from stream, without its line ending.
+ * Returns NULL at the end of the input.
+ */
+static char *
+read_line (FILE *stream)
+{
+  char *line = NULL;
+  size_t len = 0;
+  size_t size = 0;
+
+  while (TRUE)
+    {
+      if (size - len < 2)
+        {
+          size = (size == 0) ? 256 : size * 2;
+          line = realloc (line, size);
+          handle_oom (line != NULL);
+        }
+
+      if (fgets (line + len, size - len, stream) == NULL)
+        {
+          if (len > 0)
+            break;
+
+          free (line);
+          return NULL;
+        }
+
+      len += strlen (line + len);
+
+      if (len > 0 && line[len - 1] == '\n')
+        break;
+    }
+
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    line[--len] = '\0';
+
+  return line;
+}
+
+/* Splits a line of batch input into words in place, removing quotes
+ * and backslashes as the shell would, but without any expansions. A
+ * word starting with '#' starts a comment. Returns the number of
+ * words, or -1 if a quote is not closed.
+ */
+static int
+split_line (char    *line,
+            char  ***words_p)
+{
+  char **words = NULL;
+  int n_words = 0;
+  int size = 0;
+  char *in = line;
+
+  while (TRUE)
+    {
+      char *out;
+      char quote = '\0';
+
+      while (*in == ' ' || *in == '\t')
+        in++;
+
+      if (*in == '\0' || *in == '#')
+        break;
+
+      if (n_words + 1 >= size)
+        {
+          size = (size == 0) ? 16 : size * 2;
+          words = realloc (words, size * sizeof (char *));
+          handle_oom (words != NULL);
+        }
+
+      out = in;
+      words[n_words++] = out;
+
+      while (*in != '\0' &&
+             (quote != '\0' || (*in != ' ' && *in != '\t')))
+        {
+          if (quote == '\0' && (*in == '\'' || *in == '"'))
+            quote = *in++;
+          else if (quote != '\0' && *in == quote)
+            {
+              quote = '\0';
+              in++;
+            }
+          else if (*in == '\\' && quote != '\'' && in[1] != '\0')
+            {
+              in++;
+              *out++ = *in++;
+            }
+          else
+            *out++ = *in++;
+        }
+
+      if (quote != '\0')
+        {
+          free (words);
+          return -1;
+        }
+
+      if (*in != '\0')
+        in++;
+
+      *out = '\0';
+    }
+
+  *words_p = words;
+  return n_words;
+}
+
+/* Waits for the reply to a pipelined call and prints it, or the error.
+ * Returns FALSE if the reply was an error.
+ */
+static dbus_bool_t
+finish_call (DBusPendingCall *pending,
+             dbus_bool_t      print_reply_literal)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *reply;
+  dbus_bool_t ok = TRUE;
+
+  dbus_pending_call_block (pending);
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (pending);
+
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "Error %s: %s\n", error.name, error.message);
+      dbus_error_free (&error);
+      ok = FALSE;
+    }
+  else
+    {
+      long sec, usec;
+
+      _dbus_get_real_time (&sec, &usec);
+      print_message (reply, print_reply_literal, sec, usec);
+    }
+
+  dbus_message_unref (reply);
+  return ok;
+}
+
+/* Sends the messages described on standard input, one per line, over
+ * one connection. With print_reply, up to depth method calls are in
+ * flight at a time, and their replies are printed in the order of the
+ * lines. Returns the exit status.
+ */
+static int
+send_batch (DBusConnection *connection,
+            int             depth,
+            int             default_type,
+            const char     *default_dest,
+            dbus_bool_t     print_reply,
+            dbus_bool_t     print_reply_literal,
+            int             reply_timeout)
+{
+  DBusPendingCall **in_flight;
+  int head = 0;
+  int n_in_flight = 0;
+  int line_number = 0;
+  int status = 0;
+  char *line;
+
+  in_flight = calloc (depth, sizeof (DBusPendingCall *));
+  handle_oom (in_flight != NULL);
+
+  while ((line = read_line (stdin)) != NULL)
+    {
+      DBusMessage *message;
+      DBusPendingCall *pending;
+      const char *dest = default_dest;
+      int message_type = default_type;
+      char **words;
+      int n_words;
+      int i;
+
+      line_number++;
+      n_words = split_line (line, &words);
+
+      if (n_words < 0)
+        {
+          fprintf (stderr, "%s: line %d: Unterminated quote\n",
+                   appname, line_number);
+          status = 1;
+          break;
+        }
+
+      if (n_words == 0)
+        {
+          free (line);
+          continue;
+        }
+
+      for (i = 0; i < n_words && words[i][0] == '-'; i++)
+        {
+          if (strstr (words[i], "--dest=") == words[i])
+            dest = strchr (words[i], '=') + 1;
+          else if (strstr (words[i], "--type=") == words[i])
+            message_type = dbus_message_type_from_string (strchr (words[i], '=') + 1);
+          else
+            break;
+        }
+
+      if (n_words - i < 2 || words[i][0] == '-' ||
+          !(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+            message_type == DBUS_MESSAGE_TYPE_SIGNAL) ||
+          (dest != NULL && !dbus_validate_bus_name (dest, NULL)))
+        {
+          fprintf (stderr, "%s: line %d: Expected [--dest=NAME] [--type=TYPE] <object path> <message name> [contents ...]\n",
+                   appname, line_number);
+          free (words);
+          free (line);
+          status = 1;
+          break;
+        }
+
+      message = build_message (message_type, dest, words[i], words[i + 1],
+                               n_words - i - 2, words + i + 2);
+      free (words);
+      free (line);
+
+      if (!print_reply || message_type != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        {
+          handle_oom (dbus_connection_send (connection, message, NULL));
+          dbus_message_unref (message);
+          continue;
+        }
+
+      /* Keep at most depth calls in flight, completing the oldest */
+      if (n_in_flight == depth)
+        {
+          if (!finish_call (in_flight[head], print_reply_literal))
+            status = 1;
+
+          head = (head + 1) % depth;
+          n_in_flight--;
+        }
+
+      if (!dbus_connection_send_with_reply (connection, message, &pending,
+                                            reply_timeout))
+        handle_oom (FALSE);
+
+      dbus_message_unref (message);
+
+      if (pending == NULL)
+        {
+          fprintf (stderr, "%s: line %d: Disconnected\n",
+                   appname, line_number);
+          status = 1;
+          break;
+        }
+
+      in_flight[(head + n_in_flight) % depth] = pending;
+      n_in_flight++;
+    }
+
+  for (; n_in_flight > 0; n_in_flight--)
+    {
+      if (!finish_call (in_flight[head], print_reply_literal))
+        status = 1;
+
+      head = (head + 1) % depth;
+    }
+
+  dbus_connection_flush (connection);
+  free (in_flight);
+  return status;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -252,11 +703,11 @@ main (int argc, char *argv[])
   dbus_bool_t print_reply;
   dbus_bool_t print_reply_literal;
   int reply_timeout;
-  DBusMessageIter iter;
+  int batch_depth = 0;
   int i;
   DBusBusType type = DBUS_BUS_SESSION;
   const char *dest = NULL;
-  const char *name = NULL;
+  char *name = NULL;
   const char *path = NULL;
   int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
   const char *type_str = NULL;
@@ -266,7 +717,7 @@ main (int argc, char *argv[])
 
   appname = argv[0];
   
-  if (argc < 3)
+  if (argc < 2)
     usage (1);
 
   print_reply = FALSE;
@@ -349,6 +800,19 @@ main (int argc, char *argv[])
 	}
       else if (strstr (arg, "--type=") == arg)
 	type_str = strchr (arg, '=') + 1;
+      else if (strcmp (arg, "--batch") == 0)
+        batch_depth = 16;
+      else if (strstr (arg, "--batch=") == arg)
+        {
+          batch_depth = strtol (strchr (arg, '=') + 1, NULL, 10);
+
+          if (batch_depth <= 0)
+            {
+              fprintf (stderr, "invalid value (%s) of \"--batch\"\n",
+                       strchr (arg, '=') + 1);
+              usage (1);
+            }
+        }
       else if (!strcmp(arg, "--help"))
 	usage (0);
       else if (arg[0] == '-')
@@ -359,7 +823,7 @@ main (int argc, char *argv[])
         name = arg;
     }
 
-  if (name == NULL)
+  if (batch_depth > 0 ? path != NULL : name == NULL)
     usage (1);
 
   if (session_or_system &&
@@ -418,166 +882,18 @@ main (int argc, char *argv[])
         }
     }
 
-  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
-    {
-      char *last_dot;
-
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
-        {
-          fprintf (stderr, "Must use org.mydomain.Interface.Method notation, no dot in \"%s\"\n",
-                   name);
-          exit (1);
-        }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_method_call (NULL,
-                                              path,
-                                              name,
-                                              last_dot + 1);
-      handle_oom (message != NULL);
-      dbus_message_set_auto_start (message, TRUE);
-    }
-  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
-    {
-      char *last_dot;
-
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
-        {
-          fprintf (stderr, "Must use org.mydomain.Interface.Signal notation, no dot in \"%s\"\n",
-                   name);
-          exit (1);
-        }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_signal (path, name, last_dot + 1);
-      handle_oom (message != NULL);
-    }
-  else
+  if (batch_depth > 0)
     {
-      fprintf (stderr, "Internal error, unknown message type\n");
-      exit (1);
-    }
+      int status;
 
-  if (message == NULL)
-    {
-      fprintf (stderr, "Couldn't allocate D-Bus message\n");
-      exit (1);
+      status = send_batch (connection, batch_depth, message_type, dest,
+                           print_reply, print_reply_literal, reply_timeout);
+      dbus_connection_unref (connection);
+      exit (status);
     }
 
-  if (dest && !dbus_message_set_destination (message, dest))
-    {
-      fprintf (stderr, "Not enough memory\n");
-      exit (1);
-    }
-  
-  dbus_message_iter_init_append (message, &iter);
-
-  while (i < argc)
-    {
-      char *arg;
-      char *c;
-      int type2;
-      int secondary_type;
-      int container_type;
-      DBusMessageIter *target_iter;
-      DBusMessageIter container_iter;
-
-      type2 = DBUS_TYPE_INVALID;
-      secondary_type = DBUS_TYPE_INVALID;
-      arg = argv[i++];
-      c = strchr (arg, ':');
-
-      if (c == NULL)
-	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	  exit (1);
-	}
-
-      *(c++) = 0;
-
-      container_type = DBUS_TYPE_INVALID;
-
-      if (strcmp (arg, "variant") == 0)
-	container_type = DBUS_TYPE_VARIANT;
-      else if (strcmp (arg, "array") == 0)
-	container_type = DBUS_TYPE_ARRAY;
-      else if (strcmp (arg, "dict") == 0)
-	container_type = DBUS_TYPE_DICT_ENTRY;
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-	  arg = c;
-	  c = strchr (arg, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	}
-
-      if (arg[0] == 0)
-	type2 = DBUS_TYPE_STRING;
-      else
-	type2 = type_from_name (arg);
-
-      if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  char sig[5];
-	  arg = c;
-	  c = strchr (c, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	  secondary_type = type_from_name (arg);
-	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
-	  sig[1] = type2;
-	  sig[2] = secondary_type;
-	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
-	  sig[4] = '\0';
-          handle_oom (dbus_message_iter_open_container (&iter,
-                                                        DBUS_TYPE_ARRAY,
-                                                        sig,
-                                                        &container_iter));
-	  target_iter = &container_iter;
-	}
-      else if (container_type != DBUS_TYPE_INVALID)
-	{
-	  char sig[2];
-	  sig[0] = type2;
-	  sig[1] = '\0';
-          handle_oom (dbus_message_iter_open_container (&iter,
-                                                        container_type,
-                                                        sig,
-                                                        &container_iter));
-	  target_iter = &container_iter;
-	}
-      else
-	target_iter = &iter;
-
-      if (container_type == DBUS_TYPE_ARRAY)
-	{
-	  append_array (target_iter, type2, c);
-	}
-      else if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  _dbus_assert (secondary_type != DBUS_TYPE_INVALID);
-	  append_dict (target_iter, type2, secondary_type, c);
-	}
-      else
-	append_arg (target_iter, type2, c);
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-          handle_oom (dbus_message_iter_close_container (&iter,
-                                                         &container_iter));
-	}
-    }
+  message = build_message (message_type, dest, path, name,
+                           argc - i, argv + i);
 
   if (print_reply)
     {
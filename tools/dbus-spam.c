@@ -28,13 +28,49 @@
 #include <string.h>
 #include <time.h>
 
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+#ifdef DBUS_UNIX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
 #include <dbus/dbus.h>
 
 #include "test-tool.h"
 #include "tool-common.h"
 
+#if defined(DBUS_WIN) && !defined(PRIu64)
+#define PRIu64 "I64u"
+#endif
+
 static dbus_bool_t ignore_errors = FALSE;
 
+/* What one sender did, for --report */
+typedef struct
+{
+  dbus_uint64_t start_usec;
+  dbus_uint64_t end_usec;
+  dbus_uint64_t messages;
+  dbus_uint64_t bytes;
+  dbus_uint64_t errors;
+  dbus_uint64_t n_latencies;
+} SpamResults;
+
+static SpamResults results = { 0 };
+/* round-trip times of method calls, in microseconds */
+static dbus_uint32_t *latencies = NULL;
+static size_t latencies_allocated = 0;
+
+typedef struct
+{
+  int *received_p;
+  dbus_uint64_t sent_usec;
+} SpamCall;
+
 static void usage (int ecode) _DBUS_GNUC_NORETURN;
 
 static void
@@ -74,22 +110,55 @@ usage (int ecode)
            "\n"
            "    --seed=SEED   seed for srand (default is time())\n"
            "\n"
+           "    --signals=P   send P%% of messages as signals to the\n"
+           "                  destination, which are not replied to\n"
+           "    --senders=N   send from N processes at the same time,\n"
+           "                  each sending --count messages (default 1)\n"
+           "    --receivers=M spread messages over the M destinations\n"
+           "                  NAME0 to NAME<M-1>, as claimed by\n"
+           "                  dbus-test-tool echo --receivers=M (default 1)\n"
+           "    --report      when done, print message and byte rates\n"
+           "                  and round-trip latency percentiles\n"
+           "\n"
            );
   exit (ecode);
 }
 
+static void
+add_latency (dbus_uint64_t usec)
+{
+  if (results.n_latencies == latencies_allocated)
+    {
+      size_t n = latencies_allocated == 0 ? 1024 : latencies_allocated * 2;
+      dbus_uint32_t *tmp = dbus_realloc (latencies, n * sizeof (*tmp));
+
+      if (tmp == NULL)
+        tool_oom ("recording latency");
+
+      latencies = tmp;
+      latencies_allocated = n;
+    }
+
+  latencies[results.n_latencies++] = (usec > 0xffffffff ?
+                                      0xffffffff : usec);
+}
+
 static void
 pc_notify (DBusPendingCall *pc,
            void            *data)
 {
   DBusMessage *message;
-  int *received_p = data;
+  SpamCall *call = data;
+  int *received_p = call->received_p;
   DBusError error;
 
   dbus_error_init (&error);
 
   message = dbus_pending_call_steal_reply (pc);
 
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    results.errors++;
+
   if (!ignore_errors && dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
     {
       dbus_set_error_from_message (&error, message);
@@ -101,9 +170,212 @@ pc_notify (DBusPendingCall *pc,
       VERBOSE (stderr, "received message #%d\n", *received_p);
     }
 
+  add_latency (tool_now_usec () - call->sent_usec);
+  dbus_message_unref (message);
   (*received_p)++;
 }
 
+static void
+close_connection (DBusConnection *connection)
+{
+  DBusConnectionStats stats;
+
+  dbus_connection_flush (connection);
+  dbus_connection_get_stats (connection, &stats);
+  results.bytes += stats.bytes_sent;
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+/* One "key value" pair per line, so that it can be parsed by a script */
+static void
+print_report (int n_senders)
+{
+  double seconds = (results.end_usec - results.start_usec) / 1e6;
+
+  if (seconds <= 0)
+    seconds = 1e-6;
+
+  qsort (latencies, results.n_latencies, sizeof (*latencies),
+         tool_compare_latencies);
+
+  printf ("senders %d\n", n_senders);
+  printf ("messages %" PRIu64 "\n", results.messages);
+  printf ("bytes %" PRIu64 "\n", results.bytes);
+  printf ("errors %" PRIu64 "\n", results.errors);
+  printf ("seconds %.3f\n", seconds);
+  printf ("messages_per_second %.1f\n", results.messages / seconds);
+  printf ("bytes_per_second %.1f\n", results.bytes / seconds);
+  printf ("replies %" PRIu64 "\n", results.n_latencies);
+  printf ("latency_p50_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.5));
+  printf ("latency_p99_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.99));
+  printf ("latency_p999_usec %u\n",
+          tool_percentile (latencies, results.n_latencies, 0.999));
+}
+
+#ifdef DBUS_UNIX
+static void
+write_all (int         fd,
+           const void *buf,
+           size_t      len)
+{
+  const char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        {
+          perror ("dbus-test-tool spam: writing results");
+          _exit (1);
+        }
+
+      p += n;
+      len -= n;
+    }
+}
+
+static dbus_bool_t
+read_all (int     fd,
+          void   *buf,
+          size_t  len)
+{
+  char *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Forks n_senders processes. Each child gets its index and the write
+ * end of a pipe on which to send its SpamResults and latencies when it
+ * has finished; the parent gets -1 and the read ends in fds.
+ */
+static int
+fork_senders (int  n_senders,
+              int *fds,
+              int *index_p)
+{
+  int i;
+
+  for (i = 0; i < n_senders; i++)
+    {
+      int pipe_fds[2];
+      pid_t pid;
+
+      if (pipe (pipe_fds) < 0)
+        {
+          perror ("dbus-test-tool spam: pipe");
+          exit (1);
+        }
+
+      pid = fork ();
+
+      if (pid < 0)
+        {
+          perror ("dbus-test-tool spam: fork");
+          exit (1);
+        }
+
+      if (pid == 0)
+        {
+          int j;
+
+          for (j = 0; j < i; j++)
+            close (fds[j]);
+
+          close (pipe_fds[0]);
+          *index_p = i;
+          return pipe_fds[1];
+        }
+
+      close (pipe_fds[1]);
+      fds[i] = pipe_fds[0];
+    }
+
+  return -1;
+}
+
+/* Merges what each sender did into results and latencies */
+static int
+collect_senders (int  n_senders,
+                 int *fds)
+{
+  int ret = 0;
+  int i;
+
+  for (i = 0; i < n_senders; i++)
+    {
+      SpamResults child;
+      dbus_uint64_t j;
+
+      if (!read_all (fds[i], &child, sizeof (child)))
+        {
+          fprintf (stderr, "Sender %d did not report its results\n", i);
+          ret = 1;
+          close (fds[i]);
+          continue;
+        }
+
+      if (i == 0 || child.start_usec < results.start_usec)
+        results.start_usec = child.start_usec;
+
+      if (child.end_usec > results.end_usec)
+        results.end_usec = child.end_usec;
+
+      results.messages += child.messages;
+      results.bytes += child.bytes;
+      results.errors += child.errors;
+
+      for (j = 0; j < child.n_latencies; j++)
+        {
+          dbus_uint32_t latency;
+
+          if (!read_all (fds[i], &latency, sizeof (latency)))
+            {
+              fprintf (stderr, "Sender %d did not report its latencies\n", i);
+              ret = 1;
+              break;
+            }
+
+          add_latency (latency);
+        }
+
+      close (fds[i]);
+    }
+
+  for (i = 0; i < n_senders; i++)
+    {
+      int status;
+
+      if (wait (&status) < 0 || !WIFEXITED (status) ||
+          WEXITSTATUS (status) != 0)
+        ret = 1;
+    }
+
+  return ret;
+}
+#endif
+
 static void
 consume_stdin (char   **payload_p,
                size_t  *len_p)
@@ -172,6 +444,13 @@ dbus_test_tool_spam (int argc, char **argv)
   unsigned int seed = time (NULL);
   int n_random_sizes = 0;
   unsigned int *random_sizes = NULL;
+  int signal_percent = 0;
+  int n_senders = 1;
+  int n_receivers = 1;
+  char **receivers = NULL;
+  int sender_index = 0;
+  int result_fd = -1;
+  dbus_bool_t report = FALSE;
 
   /* argv[1] is the tool name, so start from 2 */
 
@@ -337,13 +616,111 @@ dbus_test_tool_spam (int argc, char **argv)
           if (messages_per_conn > 0 && flood)
             usage (2);
         }
+      else if (strstr (arg, "--signals=") == arg)
+        {
+          signal_percent = atoi (arg + strlen ("--signals="));
+
+          if (signal_percent < 0 || signal_percent > 100)
+            usage (2);
+        }
+      else if (strstr (arg, "--senders=") == arg)
+        {
+          n_senders = atoi (arg + strlen ("--senders="));
+
+          if (n_senders < 1)
+            usage (2);
+
+#ifndef DBUS_UNIX
+          if (n_senders > 1)
+            {
+              fprintf (stderr, "--senders is not supported on this platform\n");
+              exit (1);
+            }
+#endif
+        }
+      else if (strstr (arg, "--receivers=") == arg)
+        {
+          n_receivers = atoi (arg + strlen ("--receivers="));
+
+          if (n_receivers < 1)
+            usage (2);
+        }
+      else if (strcmp (arg, "--report") == 0)
+        {
+          report = TRUE;
+        }
       else
         {
           usage (2);
         }
     }
 
-  srand (seed);
+  if (template != NULL && (signal_percent > 0 || n_receivers > 1))
+    {
+      fprintf (stderr, "--signals and --receivers cannot be used with "
+                       "--message-stdin\n");
+      exit (1);
+    }
+
+  if (n_receivers > 1)
+    {
+      receivers = dbus_new0 (char *, n_receivers + 1);
+
+      if (receivers == NULL)
+        tool_oom ("allocating destinations");
+
+      for (i = 0; i < n_receivers; i++)
+        {
+          size_t len = strlen (destination) + 16;
+
+          receivers[i] = dbus_malloc (len);
+
+          if (receivers[i] == NULL)
+            tool_oom ("allocating destinations");
+
+          snprintf (receivers[i], len, "%s%d", destination, i);
+        }
+    }
+
+#ifdef DBUS_UNIX
+  if (n_senders > 1)
+    {
+      int *fds = dbus_new0 (int, n_senders);
+      int ret;
+
+      if (fds == NULL)
+        tool_oom ("allocating senders");
+
+      /* the senders inherit everything parsed so far */
+      fflush (stdout);
+      fflush (stderr);
+      result_fd = fork_senders (n_senders, fds, &sender_index);
+
+      if (result_fd < 0)
+        {
+          ret = collect_senders (n_senders, fds);
+
+          if (report)
+            print_report (n_senders);
+
+          dbus_free (fds);
+          dbus_free (latencies);
+          dbus_free_string_array (receivers);
+          dbus_free (random_sizes);
+          dbus_free (payload_buf);
+
+          if (template != NULL)
+            dbus_message_unref (template);
+
+          dbus_shutdown ();
+          return ret;
+        }
+
+      dbus_free (fds);
+    }
+#endif
+
+  srand (seed + sender_index);
 
   if (payload == NULL)
     {
@@ -366,11 +743,7 @@ dbus_test_tool_spam (int argc, char **argv)
            (no_reply || received - received_before_this_conn == messages_per_conn)))
         {
           if (connection != NULL)
-            {
-              dbus_connection_flush (connection);
-              dbus_connection_close (connection);
-              dbus_connection_unref (connection);
-            }
+            close_connection (connection);
 
           VERBOSE (stderr, "New connection.\n");
           connection = dbus_bus_get_private (type, &error);
@@ -399,6 +772,7 @@ dbus_test_tool_spam (int argc, char **argv)
              (queue_len == -1 || sent_in_this_conn < queue_len + received - received_before_this_conn))
         {
           DBusMessage *message;
+          dbus_bool_t is_signal = FALSE;
 
           if (template != NULL)
             {
@@ -413,16 +787,36 @@ dbus_test_tool_spam (int argc, char **argv)
             {
               dbus_bool_t mem;
               unsigned int len = 0;
+              const char *dest = destination;
+
+              if (receivers != NULL)
+                dest = receivers[(sender_index + sent) % n_receivers];
 
-              message = dbus_message_new_method_call (destination,
-                                                      "/",
-                                                      "com.example",
-                                                      "Spam");
+              /* rand() is only called if needed, so that existing seeds
+               * keep giving the same sizes */
+              if (signal_percent > 0 && rand () % 100 < signal_percent)
+                {
+                  is_signal = TRUE;
+                  message = dbus_message_new_signal ("/", "com.example",
+                                                     "Spam");
+
+                  if (message != NULL &&
+                      !dbus_message_set_destination (message, dest))
+                    tool_oom ("setting destination");
+                }
+              else
+                {
+                  message = dbus_message_new_method_call (dest,
+                                                          "/",
+                                                          "com.example",
+                                                          "Spam");
+                }
 
               if (message == NULL)
                 tool_oom ("allocating message");
 
-              dbus_message_set_no_reply (message, no_reply);
+              if (!is_signal)
+                dbus_message_set_no_reply (message, no_reply);
 
               switch (payload_type)
                 {
@@ -472,7 +866,12 @@ dbus_test_tool_spam (int argc, char **argv)
                 tool_oom ("building message");
             }
 
-          if (no_reply)
+          if (results.messages == 0)
+            results.start_usec = tool_now_usec ();
+
+          results.messages++;
+
+          if (no_reply || is_signal)
             {
               if (!dbus_connection_send (connection, message, NULL))
                 tool_oom ("sending message");
@@ -480,10 +879,15 @@ dbus_test_tool_spam (int argc, char **argv)
               VERBOSE (stderr, "sent message #%d\n", sent);
               sent++;
               sent_in_this_conn++;
+
+              /* nothing to wait for */
+              if (is_signal && !no_reply)
+                received++;
             }
           else
             {
               DBusPendingCall *pc;
+              SpamCall *call;
 
               if (!dbus_connection_send_with_reply (connection,
                                                     message,
@@ -498,11 +902,24 @@ dbus_test_tool_spam (int argc, char **argv)
               if (pc == NULL)
                 tool_oom ("sending message");
 
+              call = dbus_new0 (SpamCall, 1);
+
+              if (call == NULL)
+                tool_oom ("allocating pending call data");
+
+              call->received_p = &received;
+              call->sent_usec = tool_now_usec ();
+
               if (dbus_pending_call_get_completed (pc))
-                pc_notify (pc, &received);
-              else if (!dbus_pending_call_set_notify (pc, pc_notify, &received,
-                                                      NULL))
-                tool_oom ("setting pending call notifier");
+                {
+                  pc_notify (pc, call);
+                  dbus_free (call);
+                }
+              else if (!dbus_pending_call_set_notify (pc, pc_notify, call,
+                                                      dbus_free))
+                {
+                  tool_oom ("setting pending call notifier");
+                }
 
               dbus_pending_call_unref (pc);
             }
@@ -518,14 +935,28 @@ dbus_test_tool_spam (int argc, char **argv)
     }
 
   if (connection != NULL)
-    {
-      dbus_connection_flush (connection);
-      dbus_connection_close (connection);
-      dbus_connection_unref (connection);
-    }
+    close_connection (connection);
 
+  results.end_usec = tool_now_usec ();
   VERBOSE (stderr, "Done\n");
 
+#ifdef DBUS_UNIX
+  if (result_fd >= 0)
+    {
+      write_all (result_fd, &results, sizeof (results));
+      write_all (result_fd, latencies,
+                 results.n_latencies * sizeof (*latencies));
+      close (result_fd);
+    }
+  else
+#endif
+  if (report)
+    {
+      print_report (1);
+    }
+
+  dbus_free (latencies);
+  dbus_free_string_array (receivers);
   dbus_free (payload_buf);
   dbus_free (random_sizes);
 
@@ -35,7 +35,10 @@ static struct {
     int (*callback) (int, char **);
 } subcommands[] = {
       { "black-hole", dbus_test_tool_black_hole },
+      { "connect-storm", dbus_test_tool_connect_storm },
       { "echo",       dbus_test_tool_echo },
+      { "pingpong",   dbus_test_tool_pingpong },
+      { "replay",     dbus_test_tool_replay },
       { "spam",       dbus_test_tool_spam },
       { NULL, NULL }
 };
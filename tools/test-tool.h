@@ -25,7 +25,10 @@
 #define DBUS_TEST_TOOL_H
 
 int dbus_test_tool_black_hole (int argc, char **argv);
+int dbus_test_tool_connect_storm (int argc, char **argv);
 int dbus_test_tool_echo (int argc, char **argv);
+int dbus_test_tool_pingpong (int argc, char **argv);
+int dbus_test_tool_replay (int argc, char **argv);
 int dbus_test_tool_spam (int argc, char **argv);
 
 #endif
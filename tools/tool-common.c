@@ -24,6 +24,8 @@
 #include <config.h>
 #include "tool-common.h"
 
+#include "dbus/dbus-sysdeps.h"
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +46,46 @@ tool_oom (const char *doing)
   exit (1);
 }
 
+/* Microseconds on the monotonic clock, for timing benchmarks */
+dbus_uint64_t
+tool_now_usec (void)
+{
+  long sec, usec;
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  return ((dbus_uint64_t) sec) * 1000000 + usec;
+}
+
+/* qsort() comparison function for latencies in usec */
+int
+tool_compare_latencies (const void *a,
+    const void *b)
+{
+  dbus_uint32_t x = *(const dbus_uint32_t *) a;
+  dbus_uint32_t y = *(const dbus_uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* The latency below which a fraction p of the n sorted latencies lie */
+dbus_uint32_t
+tool_percentile (const dbus_uint32_t *sorted,
+    size_t n,
+    double p)
+{
+  size_t i;
+
+  if (n == 0)
+    return 0;
+
+  i = (size_t) (p * n);
+
+  if (i >= n)
+    i = n - 1;
+
+  return sorted[i];
+}
+
 #ifdef DBUS_WIN
 typedef int WriteResult;
 #define write(fd, buf, len) _write(fd, buf, len)
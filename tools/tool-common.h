@@ -35,4 +35,9 @@
 void tool_oom (const char *doing) _DBUS_GNUC_NORETURN;
 dbus_bool_t tool_write_all (int fd, const void *buf, size_t size);
 
+dbus_uint64_t tool_now_usec (void);
+int tool_compare_latencies (const void *a, const void *b);
+dbus_uint32_t tool_percentile (const dbus_uint32_t *sorted, size_t n,
+    double p);
+
 #endif